@@ -16,10 +16,437 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <bfstats.h>
 #include <intrinsics.h>
 
-int main()
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace eapis::stats;
+
+// -----------------------------------------------------------------------------
+// Ack
+//
+// With no arguments, acks the VMM (i.e. issues a single vmcall) and prints
+// the result. Otherwise, this is a client for the VMM's stats service (see
+// bfstats.h), which fetches counters, histograms and samples, or changes
+// what the VMM traps, using one vmcall per batch of commands per CPU.
+//
+// usage: ack [-c cpu] <command> [args]
+//
+//     stats                        exit counts, profile and samples
+//     latency <reason>             latency histogram of a basic exit reason
+//     export                       physical addresses of the exit export
+//     enable <feature> [arg]       feature: latency, profiler [rate],
+//                                  export [pages]
+//     disable <feature>
+//     trap <io|rdmsr|wrmsr> <first> <last>
+//     pass <io|rdmsr|wrmsr> <first> <last>
+//     poll <ms> [count]            stats every ms (count times, 0 forever)
+//
+// Without -c, the command is run on every online CPU.
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t batch_size = 0x4000U;
+constexpr const uint64_t max_commands = 32U;
+constexpr const uint64_t output_start = 0x800U;
+
+static_assert(sizeof(batch_header_t) + (max_commands * sizeof(command_t)) <= output_start);
+static_assert(batch_size <= max_batch_size);
+
+class batch
+{
+public:
+
+    batch() :
+        m_buf(batch_size)
+    {
+#ifdef __linux__
+
+        // The VMM walks this CPU's page tables to find the batch, so it
+        // must be resident when the vmcall is made.
+        //
+
+        mlock(m_buf.data(), m_buf.size());
+
+#endif
+
+        this->clear();
+    }
+
+    void clear()
+    {
+        std::fill(m_buf.begin(), m_buf.end(), 0);
+        m_next = output_start;
+
+        auto hdr = this->header();
+        hdr->magic = batch_magic;
+        hdr->version = batch_version;
+    }
+
+    uint64_t add(uint32_t op, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t size = 0)
+    {
+        auto hdr = this->header();
+
+        if (hdr->num_commands == max_commands || size > m_buf.size() - m_next) {
+            throw std::runtime_error("batch is full");
+        }
+
+        auto cmd = this->command(hdr->num_commands);
+        *cmd = {op, status_failure, arg0, arg1, size != 0 ? m_next : 0, size, 0};
+
+        m_next += (size + 7U) & ~7ULL;
+        return hdr->num_commands++;
+    }
+
+    bool send()
+    {
+        uint64_t rax = vmcall_opcode;
+        auto rbx = reinterpret_cast<uint64_t>(m_buf.data());
+        auto rcx = static_cast<uint64_t>(m_buf.size());
+
+        asm volatile("vmcall" : "+a"(rax) : "b"(rbx), "c"(rcx) : "rdx", "memory");
+
+        m_status = static_cast<int64_t>(rax);
+        return m_status == status_success;
+    }
+
+    int64_t status() const
+    { return m_status; }
+
+    batch_header_t *header()
+    { return reinterpret_cast<batch_header_t *>(m_buf.data()); }
+
+    command_t *command(uint64_t i)
+    { return reinterpret_cast<command_t *>(&m_buf[sizeof(batch_header_t) + (i * sizeof(command_t))]); }
+
+    template<typename T>
+    T *output(uint64_t i)
+    { return reinterpret_cast<T *>(&m_buf[this->command(i)->offset]); }
+
+private:
+
+    std::vector<uint8_t> m_buf;
+    uint64_t m_next{output_start};
+    int64_t m_status{status_success};
+};
+
+// -----------------------------------------------------------------------------
+// Output
+// -----------------------------------------------------------------------------
+
+static const char *
+status_to_string(int64_t status)
+{
+    switch (status) {
+        case status_success:
+            return "success";
+        case status_invalid:
+            return "invalid";
+        case status_unknown_op:
+            return "unknown op";
+        case status_not_enabled:
+            return "not enabled";
+        case status_failure:
+            return "failure";
+        default:
+            return "no stats service (is the VMM loaded?)";
+    }
+}
+
+static bool
+check(batch &b, uint64_t i)
+{
+    auto status = b.command(i)->status;
+
+    if (status != status_success) {
+        std::cout << "  error: " << status_to_string(status) << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+static void
+print_stats(batch &b, uint64_t counts, uint64_t profile, uint64_t samples)
+{
+    std::cout << std::hex;
+
+    if (check(b, counts)) {
+        auto cnts = b.output<uint64_t>(counts);
+
+        for (auto i = 0ULL; i < b.command(counts)->result; i++) {
+            if (cnts[i] != 0) {
+                std::cout << "  exit 0x" << std::setw(2) << std::setfill('0') << i
+                          << std::setfill(' ') << ": " << std::dec << cnts[i] << std::hex << '\n';
+            }
+        }
+    }
+
+    if (check(b, profile)) {
+        auto prof = b.output<profile_t>(profile);
+
+        std::cout << "  profile: rate " << std::dec << prof->rate
+                  << ", exits " << prof->exits << ", samples " << prof->taken << std::hex << '\n';
+    }
+
+    if (check(b, samples)) {
+        auto smpls = b.output<sample_t>(samples);
+
+        for (auto i = 0ULL; i < b.command(samples)->result; i++) {
+            std::cout << "  sample: exit 0x" << smpls[i].reason
+                      << " rip 0x" << smpls[i].rip << " cr3 0x" << smpls[i].cr3 << '\n';
+        }
+    }
+
+    std::cout << std::dec;
+}
+
+static void
+print_latency(batch &b, uint64_t latency)
 {
-    std::clog << "ack: " << ::intel_x64::vm::call() << '\n';
+    if (!check(b, latency)) {
+        return;
+    }
+
+    auto lat = b.output<latency_t>(latency);
+
+    std::cout << "  count " << lat->count << ", max " << lat->max << " cycles";
+    if (lat->count != 0) {
+        std::cout << ", average " << lat->total / lat->count << " cycles";
+    }
+
+    std::cout << '\n';
+
+    for (auto i = 0ULL; i < num_buckets; i++) {
+        if (lat->buckets[i] != 0) {
+            std::cout << "  [2^" << std::setw(2) << i << ", 2^" << std::setw(2) << i + 1 << "): "
+                      << lat->buckets[i] << '\n';
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Commands
+// -----------------------------------------------------------------------------
+
+static int
+usage()
+{
+    std::cerr << "usage: ack [-c cpu] <stats|latency|export|enable|disable|trap|pass|poll> [args]\n";
+    return EXIT_FAILURE;
+}
+
+static bool
+pin(uint64_t cpu)
+{
+#ifdef __linux__
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+        std::cerr << "unable to run on cpu " << cpu << ": " << strerror(errno) << '\n';
+        return false;
+    }
+
+#else
+    static_cast<void>(cpu);
+#endif
+
+    return true;
+}
+
+static uint64_t
+feature(const std::string &name)
+{
+    if (name == "latency") {
+        return feature_latency;
+    }
+
+    if (name == "profiler") {
+        return feature_profiler;
+    }
+
+    if (name == "export") {
+        return feature_export;
+    }
+
+    throw std::invalid_argument("unknown feature: " + name);
+}
+
+static uint32_t
+range_op(const std::string &verb, const std::string &type)
+{
+    const auto trap = verb == "trap";
+
+    if (type == "io") {
+        return trap ? op_trap_io_range : op_pass_through_io_range;
+    }
+
+    if (type == "rdmsr") {
+        return trap ? op_trap_rdmsr_range : op_pass_through_rdmsr_range;
+    }
+
+    if (type == "wrmsr") {
+        return trap ? op_trap_wrmsr_range : op_pass_through_wrmsr_range;
+    }
+
+    throw std::invalid_argument("unknown range: " + type);
+}
+
+static uint64_t
+number(const std::vector<std::string> &args, std::size_t i, uint64_t def)
+{ return i < args.size() ? std::stoull(args[i], nullptr, 0) : def; }
+
+static bool
+run(batch &b, const std::vector<std::string> &args, uint64_t cpu)
+{
+    const auto &cmd = args.at(0);
+    b.clear();
+
+    std::cout << "cpu " << cpu << ":\n";
+
+    if (cmd == "stats" || cmd == "poll") {
+        auto counts = b.add(op_exit_counts, 0, 0, num_exit_reasons * sizeof(uint64_t));
+        auto profile = b.add(op_profile, 0, 0, sizeof(profile_t));
+        auto samples = b.add(op_drain_samples, 0, 0, 0x1000);
+
+        if (!b.send()) {
+            return false;
+        }
+
+        print_stats(b, counts, profile, samples);
+        return true;
+    }
+
+    if (cmd == "latency") {
+        auto latency = b.add(op_exit_latency, number(args, 1, 0), 0, sizeof(latency_t));
+
+        if (!b.send()) {
+            return false;
+        }
+
+        print_latency(b, latency);
+        return true;
+    }
+
+    if (cmd == "export") {
+        auto exp = b.add(op_export_info, 0, 0, sizeof(export_t));
+
+        if (!b.send()) {
+            return false;
+        }
+
+        if (check(b, exp)) {
+            std::cout << std::hex
+                      << "  ring: 0x" << b.output<export_t>(exp)->ring_phys << '\n'
+                      << "  counters: 0x" << b.output<export_t>(exp)->counters_phys << '\n'
+                      << std::dec;
+        }
+
+        return true;
+    }
+
+    uint64_t i = 0;
+
+    if (cmd == "enable" || cmd == "disable") {
+        i = b.add(cmd == "enable" ? op_enable : op_disable, feature(args.at(1)), number(args, 2, 0));
+    }
+    else if (cmd == "trap" || cmd == "pass") {
+        i = b.add(range_op(cmd, args.at(1)), number(args, 2, 0), number(args, 3, 0));
+    }
+    else {
+        throw std::invalid_argument("unknown command: " + cmd);
+    }
+
+    if (!b.send()) {
+        return false;
+    }
+
+    check(b, i);
+    return true;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    if (argc == 1) {
+        std::clog << "ack: " << ::intel_x64::vm::call() << '\n';
+        return EXIT_SUCCESS;
+    }
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    std::vector<uint64_t> cpus;
+
+    try {
+        if (args.at(0) == "-c") {
+            cpus.push_back(std::stoull(args.at(1)));
+            args.erase(args.begin(), args.begin() + 2);
+        }
+        else {
+#ifdef __linux__
+            for (auto cpu = 0L; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++) {
+                cpus.push_back(static_cast<uint64_t>(cpu));
+            }
+#else
+            cpus.push_back(0);
+#endif
+        }
+
+        if (args.empty()) {
+            return usage();
+        }
+
+        // Polling reuses the same batch (and so the same locked pages)
+        // for every vmcall, so the only cost of each poll is one vmcall
+        // per CPU.
+        //
+
+        batch b;
+
+        const auto poll = args.at(0) == "poll";
+        const auto ms = poll ? number(args, 1, 1000) : 0;
+        auto count = poll ? number(args, 2, 0) : 1;
+
+        do {
+            for (const auto cpu : cpus) {
+                if (!pin(cpu)) {
+                    return EXIT_FAILURE;
+                }
+
+                if (!run(b, args, cpu)) {
+                    std::cerr << "ack: vmcall failed: " << status_to_string(b.status()) << '\n';
+                    return EXIT_FAILURE;
+                }
+            }
+
+#ifdef __linux__
+            if (poll) {
+                usleep(static_cast<useconds_t>(ms * 1000));
+            }
+#endif
+        }
+        while (count == 0 || --count != 0);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "ack: " << e.what() << '\n';
+        return usage();
+    }
+
+    return EXIT_SUCCESS;
 }
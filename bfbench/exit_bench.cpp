@@ -0,0 +1,153 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+#include <intrinsics.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/io.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// Exit Bench
+//
+// Issues millions of exiting instructions from the guest and reports the
+// average round trip (in cycles) of each exit type. Run this while the
+// eapis_integration_intel_x64_bench_exit_cost VMM is loaded, which traps
+// (and cheaply handles) the leaf, MSR and port used below.
+//
+// usage: exit_bench [iterations]
+//
+// Note: the leaf, MSR and port used here must match
+// bfvmm/integration/arch/intel_x64/bench/exit_cost.cpp
+// -----------------------------------------------------------------------------
+
+constexpr const auto bench_leaf = 0xBFBE0000U;
+constexpr const auto bench_msr = 0x000000FEU;           // IA32_MTRRCAP
+constexpr const auto bench_port = 0x80U;                // POST code
+
+template<typename F> void
+bench(const char *name, uint64_t iterations, F func)
+{
+    auto start = __builtin_ia32_rdtsc();
+
+    for (auto i = 0ULL; i < iterations; i++) {
+        func();
+    }
+
+    auto cycles = __builtin_ia32_rdtsc() - start;
+
+    std::cout << std::left << std::setw(16) << name
+              << std::right << std::setw(12) << cycles / iterations << " cycles/exit\n";
+}
+
+int
+main(int argc, const char *argv[])
+{
+    uint64_t iterations = 1000000;
+
+    if (argc > 1) {
+        iterations = std::strtoull(argv[1], nullptr, 10);
+    }
+
+    if (iterations == 0) {
+        std::cerr << "usage: exit_bench [iterations]\n";
+        return EXIT_FAILURE;
+    }
+
+#ifdef __linux__
+
+    // Stay on one CPU, so that all of the exits are handled by the same
+    // vCPU, and the TSC that is read is always the same one.
+    //
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(0, &mask);
+    sched_setaffinity(0, sizeof(mask), &mask);
+
+#endif
+
+    bench("baseline", iterations, [] {
+        asm volatile("" ::: "memory");
+    });
+
+    bench("cpuid", iterations, [] {
+        ::x64::cpuid::get(bench_leaf, 0, 0, 0);
+    });
+
+    bench("vmcall", iterations, [] {
+        ::intel_x64::vm::call();
+    });
+
+#ifdef __linux__
+
+    if (ioperm(bench_port, 1, 1) == 0) {
+        bench("in", iterations, [] {
+            ::x64::portio::inb(bench_port);
+        });
+
+        bench("out", iterations, [] {
+            ::x64::portio::outb(bench_port, 0);
+        });
+    }
+    else {
+        std::cerr << "skipping in/out: ioperm failed: " << strerror(errno) << '\n';
+    }
+
+    // RDMSR cannot be executed from userspace, so the MSR driver is used
+    // instead, which adds the cost of a system call to each exit. The
+    // baseline for this cost is an exit that reads an MSR that is not
+    // trapped (the TSC).
+    //
+
+    auto fd = open("/dev/cpu/0/msr", O_RDONLY);
+    if (fd >= 0) {
+        uint64_t val = 0;
+
+        bench("rdmsr (syscall)", iterations, [&] {
+            if (pread(fd, &val, sizeof(val), 0x10) != sizeof(val)) {
+                throw std::runtime_error("pread failed");
+            }
+        });
+
+        bench("rdmsr", iterations, [&] {
+            if (pread(fd, &val, sizeof(val), bench_msr) != sizeof(val)) {
+                throw std::runtime_error("pread failed");
+            }
+        });
+
+        close(fd);
+    }
+    else {
+        std::cerr << "skipping rdmsr: unable to open /dev/cpu/0/msr: " << strerror(errno) << '\n';
+    }
+
+#endif
+
+    return EXIT_SUCCESS;
+}
@@ -27,7 +27,7 @@
 #ifndef BFCAPSTONE_INTEL_X64_H
 #define BFCAPSTONE_INTEL_X64_H
 
-#include <unordered_map>
+#include <array>
 #include <intrinsics.h>
 #include <capstone/capstone.h>
 #include <bfvmm/hve/arch/intel_x64/save_state.h>
@@ -107,94 +107,94 @@ constexpr struct reg sp = { X86_REG_SP, word, 0x80U };
 constexpr struct reg esp = { X86_REG_ESP, dword, 0x80U };
 constexpr struct reg rsp = { X86_REG_RSP, qword, 0x80U };
 
-const std::unordered_map<enum x86_reg, struct reg> reg_map = {
-    {al.id, al},
-    {ah.id, ah},
-    {ax.id, ax},
-    {eax.id, eax},
-    {rax.id, rax},
-
-    {bl.id, bl},
-    {bh.id, bh},
-    {bx.id, bx},
-    {ebx.id, ebx},
-    {rbx.id, rbx},
-
-    {cl.id, cl},
-    {ch.id, ch},
-    {cx.id, cx},
-    {ecx.id, ecx},
-    {rcx.id, rcx},
-
-    {dl.id, dl},
-    {dh.id, dh},
-    {dx.id, dx},
-    {edx.id, edx},
-    {rdx.id, rdx},
-
-    {bp.id, bp},
-    {ebp.id, ebp},
-    {rbp.id, rbp},
-
-    {si.id, si},
-    {esi.id, esi},
-    {rsi.id, rsi},
-
-    {di.id, di},
-    {edi.id, edi},
-    {rdi.id, rdi},
-
-    {r08.id, r08},
-    {r09.id, r09},
-    {r10.id, r10},
-    {r11.id, r11},
-    {r12.id, r12},
-    {r13.id, r13},
-    {r14.id, r14},
-    {r15.id, r15},
-
-    {ip.id, ip},
-    {eip.id, eip},
-    {rip.id, rip},
-
-    {sp.id, sp},
-    {esp.id, esp},
-    {rsp.id, rsp}
+constexpr struct reg regs[] = {
+    al, ah, ax, eax, rax,
+    bl, bh, bx, ebx, rbx,
+    cl, ch, cx, ecx, rcx,
+    dl, dh, dx, edx, rdx,
+    bp, ebp, rbp,
+    si, esi, rsi,
+    di, edi, rdi,
+    r08, r09, r10, r11, r12, r13, r14, r15,
+    ip, eip, rip,
+    sp, esp, rsp
 };
 
+/// Register Table
+///
+/// Maps every x86_reg to its location in the save state, so decoding a
+/// register operand is a single indexed load. Registers that are not in
+/// the save state have a width of 0.
+///
+constexpr std::array<struct reg, X86_REG_ENDING> make_reg_table()
+{
+    std::array<struct reg, X86_REG_ENDING> table{};
+
+    for (const auto &r : regs) {
+        table[r.id] = r;
+    }
+
+    return table;
+}
+
+constexpr auto reg_table = make_reg_table();
+
+/// Find Register
+///
+/// @param id the capstone register to look up
+/// @return returns the register's location in the save state. An
+///     exception is thrown if the register is not in the save state.
+///
+inline const struct reg &find_reg(enum x86_reg id)
+{
+    if (GSL_UNLIKELY(id >= X86_REG_ENDING || reg_table[id].width == 0)) {
+        throw std::out_of_range("capstone: unsupported reg " + std::to_string(id));
+    }
+
+    return reg_table[id];
+}
+
 using bfvmm::intel_x64::save_state_t;
 
+/// Read
+///
+/// Reads from the save state without any bounds checks. This is meant for
+/// offsets that come from reg_table, which are always valid.
+///
+template<typename T>
+inline T read(const save_state_t *state, uint64_t byte_offset) noexcept
+{
+    auto addr = reinterpret_cast<const uintptr_t>(state) + byte_offset;
+    return *reinterpret_cast<const T *>(addr);
+}
+
 inline uint8_t read8(const save_state_t *state, uint64_t byte_offset)
 {
     expects(byte_offset < 0x88U);
-    auto addr = reinterpret_cast<const uintptr_t>(state) + byte_offset;
-    return *reinterpret_cast<const uint8_t *>(addr);
+    return read<uint8_t>(state, byte_offset);
 }
 
 inline uint16_t read16(const save_state_t *state, uint64_t byte_offset)
 {
     expects(byte_offset <= 0x86U);
-    auto addr = reinterpret_cast<const uintptr_t>(state) + byte_offset;
-    return *reinterpret_cast<const uint16_t *>(addr);
+    return read<uint16_t>(state, byte_offset);
 }
 
 inline uint32_t read32(const save_state_t *state, uint64_t byte_offset)
 {
     expects(byte_offset <= 0x84U);
-    auto addr = reinterpret_cast<const uintptr_t>(state) + byte_offset;
-    return *reinterpret_cast<const uint32_t *>(addr);
+    return read<uint32_t>(state, byte_offset);
 }
 
 inline uint64_t read64(const save_state_t *state, uint64_t byte_offset)
 {
     expects(byte_offset <= 0x80U);
-    auto addr = reinterpret_cast<const uintptr_t>(state) + byte_offset;
-    return *reinterpret_cast<const uint64_t *>(addr);
+    return read<uint64_t>(state, byte_offset);
 }
 
 inline uint32_t *reg32_addr(const save_state_t *state, const cs_x86_op *op)
 {
-    const auto reg = reg_map.at(op->reg);
+    const auto &reg = find_reg(op->reg);
 
     switch (reg.width) {
         case dword: {
@@ -217,13 +217,13 @@ inline uint64_t read_imm_val(const save_state_t *state, const cs_x86_op *op)
 
 inline uint64_t read_reg_val(const save_state_t *state, const cs_x86_op *op)
 {
-    const auto reg = reg_map.at(op->reg);
+    const auto &reg = find_reg(op->reg);
 
     switch (reg.width) {
-        case qword: return read64(state, reg.byte_offset);
-        case dword: return read32(state, reg.byte_offset);
-        case word: return read16(state, reg.byte_offset);
-        case byte: return read8(state, reg.byte_offset);
+        case qword: return read<uint64_t>(state, reg.byte_offset);
+        case dword: return read<uint32_t>(state, reg.byte_offset);
+        case word: return read<uint16_t>(state, reg.byte_offset);
+        case byte: return read<uint8_t>(state, reg.byte_offset);
 
         default:
             throw std::invalid_argument(
@@ -0,0 +1,388 @@
+//
+// Bareflank Hypervisor
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+// TIDY_EXCLUSION=-cppcoreguidelines-pro-bounds-constant-array-index
+//
+// Reason:
+//     The opcode and register tables are indexed by values that have
+//     already been range checked (a byte, or a 4 bit register number).
+//
+
+#ifndef BFMOVDECODER_INTEL_X64_H
+#define BFMOVDECODER_INTEL_X64_H
+
+#include <array>
+#include <bfgsl.h>
+#include <bfcapstone.h>
+
+// -----------------------------------------------------------------------------
+// MOV Decoder
+//
+// Almost every MMIO access a driver makes is one of a handful of
+// encodings: MOV between a register (or an immediate) and memory, MOVZX
+// from memory, and the occasional MOVS. This decoder handles those forms
+// in 64 bit mode directly with a pair of opcode tables, and reports the
+// register involved as a capstone::reg so that the caller can read or
+// write it in the save state. Anything else (including prefixes that
+// change what the instruction does, like LOCK, or VEX encodings) is left
+// to a full disassembler such as capstone.
+//
+// Only the parts of the instruction needed to emulate it are decoded:
+// the memory operand's address is not computed (the exit already
+// provides the GPA), but its length is, so that the guest can be advanced
+// past the instruction.
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+namespace mov_decoder
+{
+
+/// Result
+///
+enum class result {
+    decoded,        ///< The instruction was decoded into insn_t
+    unsupported,    ///< A MOV form that cannot be emulated (e.g. SPL)
+    unknown         ///< Not an instruction this decoder understands
+};
+
+/// Decoded Instruction
+///
+struct insn_t {
+    uint64_t len;           ///< The length of the instruction in bytes
+    uint64_t size;          ///< The number of bytes read / written
+    bool write;             ///< True for a store, false for a load
+    bool imm;               ///< True if the value stored is imm_val
+    uint64_t imm_val;       ///< The (sign extended) immediate
+    capstone::reg reg;      ///< The register loaded / stored
+    bool string;            ///< True for MOVS (no register is involved)
+    bool rep;               ///< True if a MOVS has a REP prefix
+};
+
+/// @cond
+
+enum kind : uint8_t {
+    invalid,
+    store_reg,          // MOV r/m, r
+    load_reg,           // MOV r, r/m and MOVZX r, r/m
+    store_imm,          // MOV r/m, imm
+    store_moffs,        // MOV moffs, rAX
+    load_moffs,         // MOV rAX, moffs
+    movs                // MOVS m, m
+};
+
+struct opcode_t {
+    enum kind kind;
+
+    // The size of the memory access, or 0 if it is the operand size
+    uint8_t size;
+};
+
+constexpr std::array<opcode_t, 256> make_one_byte_table()
+{
+    std::array<opcode_t, 256> table{};
+
+    table[0x88] = {store_reg, 1};
+    table[0x89] = {store_reg, 0};
+    table[0x8A] = {load_reg, 1};
+    table[0x8B] = {load_reg, 0};
+    table[0xA0] = {load_moffs, 1};
+    table[0xA1] = {load_moffs, 0};
+    table[0xA2] = {store_moffs, 1};
+    table[0xA3] = {store_moffs, 0};
+    table[0xA4] = {movs, 1};
+    table[0xA5] = {movs, 0};
+    table[0xC6] = {store_imm, 1};
+    table[0xC7] = {store_imm, 0};
+
+    return table;
+}
+
+constexpr std::array<opcode_t, 256> make_two_byte_table()
+{
+    std::array<opcode_t, 256> table{};
+
+    table[0xB6] = {load_reg, 1};
+    table[0xB7] = {load_reg, 2};
+
+    return table;
+}
+
+constexpr auto one_byte_table = make_one_byte_table();
+constexpr auto two_byte_table = make_two_byte_table();
+
+/// General purpose registers, indexed by [width][reg number]. The save
+/// state does not have every register (e.g. r8d or SIL), so a width of 0
+/// means the register cannot be emulated.
+///
+constexpr std::array<std::array<capstone::reg, 16>, 4> make_gpr_table()
+{
+    std::array<std::array<capstone::reg, 16>, 4> table{};
+
+    table[0] = {
+        capstone::al, capstone::cl, capstone::dl, capstone::bl,
+        capstone::ah, capstone::ch, capstone::dh, capstone::bh
+    };
+
+    table[1] = {
+        capstone::ax, capstone::cx, capstone::dx, capstone::bx,
+        capstone::sp, capstone::bp, capstone::si, capstone::di
+    };
+
+    table[2] = {
+        capstone::eax, capstone::ecx, capstone::edx, capstone::ebx,
+        capstone::esp, capstone::ebp, capstone::esi, capstone::edi
+    };
+
+    table[3] = {
+        capstone::rax, capstone::rcx, capstone::rdx, capstone::rbx,
+        capstone::rsp, capstone::rbp, capstone::rsi, capstone::rdi,
+        capstone::r08, capstone::r09, capstone::r10, capstone::r11,
+        capstone::r12, capstone::r13, capstone::r14, capstone::r15
+    };
+
+    return table;
+}
+
+constexpr auto gpr_table = make_gpr_table();
+
+inline const capstone::reg &
+find_gpr(uint64_t num, uint64_t width, bool rex) noexcept
+{
+    static constexpr const capstone::reg none{};
+
+    // With a REX prefix, 4 - 7 are SPL, BPL, SIL and DIL instead of
+    // AH, CH, DH and BH, which are not in the save state
+    //
+
+    if (width == 1 && rex && num >= 4) {
+        return none;
+    }
+
+    switch (width) {
+        case 1: return gpr_table[0][num];
+        case 2: return gpr_table[1][num];
+        case 4: return gpr_table[2][num];
+        default: return gpr_table[3][num];
+    }
+}
+
+/// Returns the number of bytes taken by the ModRM byte, the SIB byte and
+/// the displacement, or 0 if the ModRM byte does not name memory (or
+/// bytes is too short)
+///
+inline uint64_t
+modrm_len(gsl::span<const uint8_t> bytes, std::ptrdiff_t i) noexcept
+{
+    if (i >= bytes.size()) {
+        return 0;
+    }
+
+    auto modrm = bytes[i];
+    auto mod = modrm >> 6U;
+    auto rm = modrm & 7U;
+
+    uint64_t len = 1;
+
+    if (mod == 3) {
+        return 0;
+    }
+
+    if (rm == 4) {
+        if (i + 1 >= bytes.size()) {
+            return 0;
+        }
+
+        len++;
+
+        if (mod == 0 && (bytes[i + 1] & 7U) == 5) {
+            len += 4;
+        }
+    }
+    else if (mod == 0 && rm == 5) {
+        len += 4;
+    }
+
+    switch (mod) {
+        case 1: return len + 1;
+        case 2: return len + 4;
+        default: return len;
+    }
+}
+
+inline uint64_t
+read_imm(gsl::span<const uint8_t> bytes, std::ptrdiff_t i, uint64_t size) noexcept
+{
+    uint64_t val = 0;
+
+    for (auto b = static_cast<std::ptrdiff_t>(size) - 1; b >= 0; b--) {
+        val = (val << 8U) | bytes[i + b];
+    }
+
+    // Immediates are sign extended to the operand size, like capstone
+    // reports them
+    //
+
+    auto shift = 64 - (size * 8);
+    return static_cast<uint64_t>(static_cast<int64_t>(val << shift) >> shift);
+}
+
+/// @endcond
+
+/// Decode
+///
+/// Decodes the instruction at the start of bytes. Only 64 bit mode
+/// (IA-32e mode with CS.L set) is understood: in any other mode, 0x40 -
+/// 0x4F are instructions and not REX prefixes, and the default operand
+/// and address sizes differ, so result::unknown is returned and the
+/// instruction is left to a full disassembler.
+///
+/// @expects
+/// @ensures
+///
+/// @param bytes the instruction bytes (at most 15 are looked at)
+/// @param insn where to store the decoded instruction
+/// @param long_mode true if the instruction is executing in 64 bit mode
+/// @return returns result::decoded if insn was filled in (see result)
+///
+inline result
+decode(gsl::span<const uint8_t> bytes, insn_t &insn, bool long_mode = true) noexcept
+{
+    constexpr const std::ptrdiff_t max_len = 15;
+
+    if (!long_mode) {
+        return result::unknown;
+    }
+
+    std::ptrdiff_t i = 0;
+    bool opsize = false;
+    bool addrsize = false;
+    bool rep = false;
+
+    auto len = std::min(bytes.size(), max_len);
+
+    for (; i < len; i++) {
+        switch (bytes[i]) {
+            case 0x66: opsize = true; continue;
+            case 0x67: addrsize = true; continue;
+            case 0xF2: case 0xF3: rep = true; continue;
+            case 0x26: case 0x2E: case 0x36: case 0x3E: case 0x64: case 0x65: continue;
+
+            default:
+                break;
+        }
+
+        break;
+    }
+
+    uint8_t rex = 0;
+    if (i < len && (bytes[i] & 0xF0U) == 0x40U) {
+        rex = bytes[i++];
+    }
+
+    if (i >= len) {
+        return result::unknown;
+    }
+
+    auto zx = false;
+    auto op = one_byte_table[bytes[i++]];
+
+    if (bytes[i - 1] == 0x0F) {
+        if (i >= len) {
+            return result::unknown;
+        }
+
+        zx = true;
+        op = two_byte_table[bytes[i++]];
+    }
+
+    if (op.kind == invalid || (rep && op.kind != movs)) {
+        return result::unknown;
+    }
+
+    auto rex_w = (rex & 0x8U) != 0;
+    auto rex_r = (rex & 0x4U) != 0;
+
+    uint64_t opsize_bytes = rex_w ? 8 : (opsize ? 2 : 4);
+    uint64_t size = op.size != 0 ? op.size : opsize_bytes;
+
+    insn = {};
+    insn.size = size;
+
+    if (op.kind == movs) {
+        insn.len = static_cast<uint64_t>(i);
+        insn.string = true;
+        insn.rep = rep;
+        return result::decoded;
+    }
+
+    if (op.kind == load_moffs || op.kind == store_moffs) {
+        auto offs = addrsize ? 4 : 8;
+        if (i + offs > len) {
+            return result::unknown;
+        }
+
+        insn.len = static_cast<uint64_t>(i + offs);
+        insn.write = op.kind == store_moffs;
+        insn.reg = find_gpr(0, size, rex != 0);
+        return result::decoded;
+    }
+
+    auto mlen = modrm_len(bytes.first(len), i);
+    if (mlen == 0 || i + static_cast<std::ptrdiff_t>(mlen) > len) {
+        return result::unknown;
+    }
+
+    auto num = ((bytes[i] >> 3U) & 7U) | (rex_r ? 8U : 0U);
+    i += static_cast<std::ptrdiff_t>(mlen);
+
+    if (op.kind == store_imm) {
+        if ((num & 7U) != 0) {
+            return result::unknown;
+        }
+
+        auto ilen = std::min<uint64_t>(size, 4);
+        if (i + static_cast<std::ptrdiff_t>(ilen) > len) {
+            return result::unknown;
+        }
+
+        insn.len = static_cast<uint64_t>(i) + ilen;
+        insn.write = true;
+        insn.imm = true;
+        insn.imm_val = read_imm(bytes, i, ilen);
+        return result::decoded;
+    }
+
+    // MOVZX reads op.size bytes, but loads them into an operand size
+    // register
+    //
+
+    insn.len = static_cast<uint64_t>(i);
+    insn.write = op.kind == store_reg;
+    insn.reg = find_gpr(num, zx ? opsize_bytes : size, rex != 0);
+
+    return insn.reg.width != 0 ? result::decoded : result::unsupported;
+}
+
+}
+}
+}
+
+#endif
@@ -0,0 +1,259 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef BFSTATS_H
+#define BFSTATS_H
+
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Stats Protocol
+//
+// A guest issues a batch of commands to the VMM with a single vmcall:
+//
+//     rax = eapis::stats::vmcall_opcode
+//     rbx = guest linear address of the batch
+//     rcx = size of the batch in bytes
+//
+// The batch starts with a batch_header_t, followed by num_commands
+// command_t. Every command that returns data writes it into the same
+// buffer at [offset, offset + size), and sets result to the number of
+// bytes (or entries, see each op) it wrote. The VMM writes the entire
+// batch back before resuming the guest, and returns the status of the
+// batch as a whole in rax (see status_t). Each command also reports its
+// own status, so one bad command does not fail the rest of the batch.
+//
+// The vmcall is handled by the vCPU it is issued on, so the counters,
+// histograms and samples returned are those of that vCPU. To poll every
+// vCPU, pin the caller to each CPU in turn.
+//
+// Commands can also be submitted without an exit per batch, through a
+// request ring: a guest physical page that starts with a ring_header_t,
+// followed by num_entries command_t slots, with the rest of the page
+// holding the commands' output (offsets are relative to the page). The
+// guest fills the slot at tail (modulo num_entries) and then increments
+// tail. The VMM runs the commands from head to tail in order, writes each
+// one's status and result back into its slot, and then moves head past
+// it, so the slots behind head are the completions. The ring is attached
+// with op_ring_attach (in an ordinary batch), after which the VMM polls
+// it on every exit the vCPU takes anyway and, optionally, on a timer. The
+// guest only needs to issue the doorbell vmcall:
+//
+//     rax = eapis::stats::ring_vmcall_opcode
+//
+// when it submits to an empty ring (i.e. head was equal to tail before
+// it incremented tail), in case the vCPU does not exit on its own for a
+// while. The vCPU the ring was attached on runs every command in it.
+//
+// Note: this header is shared with the VMM, and must only use types from
+// <cstdint>.
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace stats
+{
+
+constexpr const uint64_t vmcall_opcode = 0xBF05000000000001ULL;
+constexpr const uint64_t ring_vmcall_opcode = 0xBF05000000000002ULL;
+
+constexpr const uint32_t batch_magic = 0xBF57A750U;
+constexpr const uint32_t batch_version = 1U;
+
+constexpr const uint64_t max_batch_size = 0x10000U;
+constexpr const uint64_t num_exit_reasons = 65U;
+constexpr const uint64_t num_buckets = 64U;
+
+constexpr const uint32_t ring_magic = 0xBF57A71BU;
+constexpr const uint32_t ring_version = 1U;
+constexpr const uint64_t ring_size = 0x1000U;
+constexpr const uint64_t max_ring_entries = 64U;
+
+/// Status
+///
+enum status_t : int32_t {
+    status_success = 0,                     ///< The command (or batch) completed
+    status_invalid = -1,                    ///< Bad header, offset or size
+    status_unknown_op = -2,                 ///< The VMM does not know this op
+    status_not_enabled = -3,                ///< The feature is not enabled
+    status_failure = -4                     ///< The VMM failed to run the command
+};
+
+/// Op
+///
+enum op_t : uint32_t {
+
+    /// Does nothing. Useful for measuring the cost of the vmcall itself.
+    ///
+    op_nop = 0,
+
+    /// Writes the number of exits timed for each basic exit reason, as a
+    /// uint64_t[num_exit_reasons], starting at reason arg0. result is
+    /// the number of counters written. Requires op_enable(feature_latency).
+    ///
+    op_exit_counts = 1,
+
+    /// Writes the latency_t of basic exit reason arg0. Requires
+    /// op_enable(feature_latency).
+    ///
+    op_exit_latency = 2,
+
+    /// Drains as many profiler samples (sample_t) as fit. result is the
+    /// number of samples written. Requires op_enable(feature_profiler).
+    ///
+    op_drain_samples = 3,
+
+    /// Writes the profiler's totals (profile_t). Requires
+    /// op_enable(feature_profiler).
+    ///
+    op_profile = 4,
+
+    /// Writes the physical addresses of the exit export's ring header and
+    /// counters page (export_t), which can then be mapped and read in
+    /// place without any further vmcalls. Requires
+    /// op_enable(feature_export).
+    ///
+    op_export_info = 5,
+
+    /// Enables feature arg0 (see feature_t). arg1 is the profiler's rate
+    /// or the number of pages in the export's ring (0 for the default).
+    ///
+    op_enable = 6,
+
+    /// Disables feature arg0 (see feature_t)
+    ///
+    op_disable = 7,
+
+    /// Traps (arg0 first port, arg1 last port) inclusive
+    ///
+    op_trap_io_range = 8,
+
+    /// Passes through (arg0 first port, arg1 last port) inclusive
+    ///
+    op_pass_through_io_range = 9,
+
+    /// Traps reads of (arg0 first MSR, arg1 last MSR) inclusive
+    ///
+    op_trap_rdmsr_range = 10,
+
+    /// Passes through reads of (arg0 first MSR, arg1 last MSR) inclusive
+    ///
+    op_pass_through_rdmsr_range = 11,
+
+    /// Traps writes to (arg0 first MSR, arg1 last MSR) inclusive
+    ///
+    op_trap_wrmsr_range = 12,
+
+    /// Passes through writes to (arg0 first MSR, arg1 last MSR) inclusive
+    ///
+    op_pass_through_wrmsr_range = 13,
+
+    /// Attaches the request ring in the guest physical page at arg0 to the
+    /// vCPU the batch is issued on, replacing any ring that is already
+    /// attached. The ring's header must be filled in first. If arg1 is not
+    /// 0, the ring is also polled every arg1 TSC ticks of guest execution
+    /// using the VMX preemption timer.
+    ///
+    op_ring_attach = 14,
+
+    /// Detaches the request ring. The ring's page can be reused once this
+    /// completes.
+    ///
+    op_ring_detach = 15
+};
+
+/// Feature
+///
+enum feature_t : uint64_t {
+    feature_latency = 0,                    ///< Exit latency histograms
+    feature_profiler = 1,                   ///< Exit profiler samples
+    feature_export = 2                      ///< Exit export ring and counters
+};
+
+/// Batch Header
+///
+struct batch_header_t {
+    uint32_t magic;                         ///< Must be batch_magic
+    uint32_t version;                       ///< Must be batch_version
+    uint32_t num_commands;                  ///< Number of commands that follow
+    int32_t status;                         ///< (out) status of the batch
+};
+
+/// Command
+///
+struct command_t {
+    uint32_t op;                            ///< What to do (see op_t)
+    int32_t status;                         ///< (out) status of the command
+    uint64_t arg0;                          ///< First argument (see op_t)
+    uint64_t arg1;                          ///< Second argument (see op_t)
+    uint64_t offset;                        ///< Offset of the output in the batch
+    uint64_t size;                          ///< Size of the output in bytes
+    uint64_t result;                        ///< (out) amount written (see op_t)
+};
+
+/// Ring Header
+///
+/// num_entries must be a power of two, no larger than max_ring_entries.
+/// tail - head is never more than num_entries.
+///
+struct ring_header_t {
+    uint32_t magic;                         ///< Must be ring_magic
+    uint32_t version;                       ///< Must be ring_version
+    uint32_t num_entries;                   ///< Number of command slots
+    int32_t status;                         ///< (out) status of the last poll
+    uint32_t head;                          ///< (out) next slot the VMM runs
+    uint32_t tail;                          ///< Next slot the guest fills
+    uint64_t polls;                         ///< (out) number of polls that ran commands
+};
+
+/// Latency (op_exit_latency)
+///
+struct latency_t {
+    uint64_t count;                         ///< Number of exits timed
+    uint64_t total;                         ///< Sum of the cycles of every exit
+    uint64_t max;                           ///< Most cycles a single exit took
+    uint64_t buckets[num_buckets];          ///< log2 histogram of the cycles
+};
+
+/// Sample (op_drain_samples)
+///
+struct sample_t {
+    uint64_t reason;                        ///< Basic exit reason
+    uint64_t rip;                           ///< Guest RIP of the exit
+    uint64_t cr3;                           ///< Guest CR3 of the exit
+};
+
+/// Profile (op_profile)
+///
+struct profile_t {
+    uint64_t rate;                          ///< 1 in every rate exits is sampled
+    uint64_t exits;                         ///< Exits seen since the last clear
+    uint64_t taken;                         ///< Samples taken since the last clear
+};
+
+/// Export (op_export_info)
+///
+struct export_t {
+    uint64_t ring_phys;                     ///< Physical address of the ring header
+    uint64_t counters_phys;                 ///< Physical address of the counters page
+};
+
+}
+}
+
+#endif
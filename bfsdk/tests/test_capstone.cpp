@@ -136,6 +136,32 @@ TEST_CASE("eapis::intel_x64::capstone::read_reg_val")
     CHECK(eapis::intel_x64::capstone::read_reg_val(&state, &op) == state.rax);
 }
 
+TEST_CASE("eapis::intel_x64::capstone::reg_table")
+{
+    using namespace eapis::intel_x64::capstone;
+
+    static_assert(reg_table[X86_REG_AH].byte_offset == ah.byte_offset, "reg_table");
+    static_assert(reg_table[X86_REG_R15].byte_offset == r15.byte_offset, "reg_table");
+
+    CHECK(reg_table[X86_REG_EDX].width == dword);
+    CHECK(reg_table[X86_REG_CS].width == 0);
+
+    CHECK(find_reg(X86_REG_RSP).byte_offset == rsp.byte_offset);
+    CHECK_THROWS(find_reg(X86_REG_CS));
+    CHECK_THROWS(find_reg(X86_REG_ENDING));
+}
+
+TEST_CASE("eapis::intel_x64::capstone::read")
+{
+    bfvmm::intel_x64::save_state_t state;
+    state.rax = 0x7766554433221100U;
+
+    CHECK(eapis::intel_x64::capstone::read<uint8_t>(&state, 1U) == 0x11U);
+    CHECK(eapis::intel_x64::capstone::read<uint16_t>(&state, 2U) == 0x3322U);
+    CHECK(eapis::intel_x64::capstone::read<uint32_t>(&state, 4U) == 0x77665544U);
+    CHECK(eapis::intel_x64::capstone::read<uint64_t>(&state, 0U) == state.rax);
+}
+
 TEST_CASE("eapis::intel_x64::capstone::read_mem_val")
 {
     bfvmm::intel_x64::save_state_t state;
@@ -0,0 +1,183 @@
+//
+// Bareflank Hypervisor
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <bfmovdecoder.h>
+
+using namespace eapis::intel_x64;
+using namespace eapis::intel_x64::mov_decoder;
+
+template<std::size_t N>
+result decode(const std::array<uint8_t, N> &bytes, insn_t &insn)
+{ return mov_decoder::decode(bytes, insn); }
+
+TEST_CASE("mov decoder: mov reg")
+{
+    insn_t insn{};
+
+    // mov [rax], ebx
+    CHECK(decode(std::array<uint8_t, 2>{0x89, 0x18}, insn) == result::decoded);
+    CHECK(insn.len == 2);
+    CHECK(insn.size == 4);
+    CHECK(insn.write);
+    CHECK(!insn.imm);
+    CHECK(insn.reg.id == X86_REG_EBX);
+
+    // mov rax, [rbx]
+    CHECK(decode(std::array<uint8_t, 3>{0x48, 0x8B, 0x03}, insn) == result::decoded);
+    CHECK(insn.len == 3);
+    CHECK(insn.size == 8);
+    CHECK(!insn.write);
+    CHECK(insn.reg.id == X86_REG_RAX);
+
+    // mov [rax], dh
+    CHECK(decode(std::array<uint8_t, 2>{0x88, 0x30}, insn) == result::decoded);
+    CHECK(insn.size == 1);
+    CHECK(insn.reg.id == X86_REG_DH);
+
+    // mov [rax], r8
+    CHECK(decode(std::array<uint8_t, 3>{0x4C, 0x89, 0x00}, insn) == result::decoded);
+    CHECK(insn.reg.id == X86_REG_R8);
+
+    // mov ax, gs:[rbx]
+    CHECK(decode(std::array<uint8_t, 4>{0x65, 0x66, 0x8B, 0x03}, insn) == result::decoded);
+    CHECK(insn.len == 4);
+    CHECK(insn.size == 2);
+    CHECK(insn.reg.id == X86_REG_AX);
+}
+
+TEST_CASE("mov decoder: addressing modes")
+{
+    insn_t insn{};
+
+    // mov eax, [rbx + 0x30]
+    CHECK(decode(std::array<uint8_t, 6>{0x8B, 0x83, 0x30, 0x00, 0x00, 0x00}, insn) == result::decoded);
+    CHECK(insn.len == 6);
+
+    // mov eax, [rsp + 8]
+    CHECK(decode(std::array<uint8_t, 4>{0x8B, 0x44, 0x24, 0x08}, insn) == result::decoded);
+    CHECK(insn.len == 4);
+
+    // mov eax, [0xFEE00030]
+    CHECK(decode(std::array<uint8_t, 7>{0x8B, 0x04, 0x25, 0x30, 0x00, 0xE0, 0xFE}, insn) == result::decoded);
+    CHECK(insn.len == 7);
+
+    // mov eax, [rip + 0x04030201]
+    CHECK(decode(std::array<uint8_t, 6>{0x8B, 0x05, 0x01, 0x02, 0x03, 0x04}, insn) == result::decoded);
+    CHECK(insn.len == 6);
+
+    // mov eax, [0x0807060504030201]
+    CHECK(decode(std::array<uint8_t, 9>{0xA1, 1, 2, 3, 4, 5, 6, 7, 8}, insn) == result::decoded);
+    CHECK(insn.len == 9);
+    CHECK(!insn.write);
+    CHECK(insn.reg.id == X86_REG_EAX);
+}
+
+TEST_CASE("mov decoder: mov imm")
+{
+    insn_t insn{};
+
+    // mov dword [rax], 1
+    CHECK(decode(std::array<uint8_t, 6>{0xC7, 0x00, 0x01, 0x00, 0x00, 0x00}, insn) == result::decoded);
+    CHECK(insn.len == 6);
+    CHECK(insn.size == 4);
+    CHECK(insn.write);
+    CHECK(insn.imm);
+    CHECK(insn.imm_val == 1);
+
+    // mov qword [rax], -1
+    CHECK(decode(std::array<uint8_t, 7>{0x48, 0xC7, 0x00, 0xFF, 0xFF, 0xFF, 0xFF}, insn) == result::decoded);
+    CHECK(insn.len == 7);
+    CHECK(insn.size == 8);
+    CHECK(insn.imm_val == 0xFFFFFFFFFFFFFFFF);
+
+    // mov word [rax], 0x1234
+    CHECK(decode(std::array<uint8_t, 5>{0x66, 0xC7, 0x00, 0x34, 0x12}, insn) == result::decoded);
+    CHECK(insn.len == 5);
+    CHECK(insn.size == 2);
+    CHECK(insn.imm_val == 0x1234);
+
+    // mov byte [rax + 0x10], 0x7F
+    CHECK(decode(std::array<uint8_t, 4>{0xC6, 0x40, 0x10, 0x7F}, insn) == result::decoded);
+    CHECK(insn.len == 4);
+    CHECK(insn.size == 1);
+    CHECK(insn.imm_val == 0x7F);
+}
+
+TEST_CASE("mov decoder: movzx")
+{
+    insn_t insn{};
+
+    // movzx eax, byte [rbx]
+    CHECK(decode(std::array<uint8_t, 3>{0x0F, 0xB6, 0x03}, insn) == result::decoded);
+    CHECK(insn.len == 3);
+    CHECK(insn.size == 1);
+    CHECK(!insn.write);
+    CHECK(insn.reg.id == X86_REG_EAX);
+
+    // movzx rax, word [rbx]
+    CHECK(decode(std::array<uint8_t, 4>{0x48, 0x0F, 0xB7, 0x03}, insn) == result::decoded);
+    CHECK(insn.size == 2);
+    CHECK(insn.reg.id == X86_REG_RAX);
+}
+
+TEST_CASE("mov decoder: movs")
+{
+    insn_t insn{};
+
+    // rep movsq
+    CHECK(decode(std::array<uint8_t, 3>{0xF3, 0x48, 0xA5}, insn) == result::decoded);
+    CHECK(insn.len == 3);
+    CHECK(insn.size == 8);
+    CHECK(insn.string);
+    CHECK(insn.rep);
+
+    // movsb
+    CHECK(decode(std::array<uint8_t, 1>{0xA4}, insn) == result::decoded);
+    CHECK(insn.size == 1);
+    CHECK(!insn.rep);
+}
+
+TEST_CASE("mov decoder: unsupported / unknown")
+{
+    insn_t insn{};
+
+    // mov [rax], r8d / mov [rax], sil
+    CHECK(decode(std::array<uint8_t, 3>{0x44, 0x89, 0x00}, insn) == result::unsupported);
+    CHECK(decode(std::array<uint8_t, 3>{0x40, 0x88, 0x30}, insn) == result::unsupported);
+
+    // add [rax], ebx / mov eax, ebx / lock mov / rep mov
+    CHECK(decode(std::array<uint8_t, 2>{0x01, 0x18}, insn) == result::unknown);
+    CHECK(decode(std::array<uint8_t, 2>{0x89, 0xD8}, insn) == result::unknown);
+    CHECK(decode(std::array<uint8_t, 3>{0xF0, 0x89, 0x18}, insn) == result::unknown);
+    CHECK(decode(std::array<uint8_t, 3>{0xF3, 0x89, 0x18}, insn) == result::unknown);
+
+    // truncated
+    CHECK(decode(std::array<uint8_t, 1>{0x0F}, insn) == result::unknown);
+    CHECK(decode(std::array<uint8_t, 3>{0x8B, 0x83, 0x30}, insn) == result::unknown);
+    CHECK(decode(std::array<uint8_t, 3>{0xC7, 0x00, 0x01}, insn) == result::unknown);
+}
+
+TEST_CASE("mov decoder: not 64 bit mode")
+{
+    insn_t insn{};
+
+    // mov [eax], ebx / inc eax; mov eax, [ebx]
+    CHECK(decode(std::array<uint8_t, 2>{0x89, 0x18}, insn, false) == result::unknown);
+    CHECK(decode(std::array<uint8_t, 3>{0x48, 0x8B, 0x03}, insn, false) == result::unknown);
+}
@@ -24,19 +24,37 @@
 #include "vmexit/ept_misconfiguration.h"
 #include "vmexit/ept_violation.h"
 #include "vmexit/external_interrupt.h"
+#include "vmexit/hlt.h"
 #include "vmexit/init_signal.h"
 #include "vmexit/interrupt_window.h"
+#include "vmexit/ipi.h"
 #include "vmexit/io_instruction.h"
 #include "vmexit/monitor_trap.h"
 #include "vmexit/mov_dr.h"
+#include "vmexit/nested_vmx.h"
+#include "vmexit/pause.h"
+#include "vmexit/preemption_timer.h"
+#include "vmexit/pml.h"
 #include "vmexit/rdmsr.h"
 #include "vmexit/sipi_signal.h"
+#include "vmexit/vmcall.h"
 #include "vmexit/wrmsr.h"
 #include "vmexit/xsetbv.h"
 
+#include "bitmaps.h"
 #include "ept.h"
+#include "guest_memory.h"
+#include "guest_walker.h"
 #include "microcode.h"
+#include "msr_lists.h"
+#include "mtrr_pat.h"
+#include "posted_interrupts.h"
+#include "processor_trace.h"
+#include "stats.h"
+#include "tsc.h"
+#include "virtual_apic.h"
 #include "vpid.h"
+#include "write_monitor.h"
 
 #include <bfvmm/hve/arch/intel_x64/vcpu/vcpu.h>
 
@@ -57,9 +75,27 @@ struct eapis_vcpu_global_state_t {
     ///
     /// Synchronization flag used during the INIT/SIPI process. Specifically
     /// this is used to ensure SIPI is not sent before INIT is finished.
+    /// This is only used for broadcast INITs, as the sender cannot know
+    /// which vCPUs the INIT will reach.
     ///
     std::atomic<bool> init_called{false};
 
+    /// Max INIT Pending
+    ///
+    /// The number of x2APIC IDs that are tracked by init_pending. INITs sent
+    /// to an ID larger than this fall back to init_called.
+    ///
+    static constexpr const std::size_t max_init_pending = 1024;
+
+    /// INIT Pending
+    ///
+    /// Set by the vCPU that sends a targeted INIT, and cleared by the target
+    /// once it has been reset. The SIPI to that target waits on this flag
+    /// instead of the INIT itself, so the INITs to each AP are not
+    /// serialized behind one another.
+    ///
+    std::array<std::atomic<bool>, max_init_pending> init_pending{};
+
     /// CR0 Fixed Bits
     ///
     /// Defines the bits that must be fixed to 1. Note that these could change
@@ -77,6 +113,14 @@ struct eapis_vcpu_global_state_t {
     uint64_t ia32_vmx_cr4_fixed0 {
         ::intel_x64::msrs::ia32_vmx_cr4_fixed0::get()
     };
+
+    /// Shared Bitmaps
+    ///
+    /// If set, the vCPUs in this group share these MSR and IO bitmaps
+    /// instead of each allocating their own (see bitmap_policy). The policy
+    /// must outlive every vCPU that uses it.
+    ///
+    bitmap_policy *shared_bitmaps{nullptr};
 };
 
 /// EAPIs Object
@@ -105,6 +149,7 @@ class eapis_vcpu_state_t : public bfobject
     /// state for all of the vCPUs.
     ///
     eapis_vcpu_global_state_t *m_eapis_vcpu_global_state;
+    vcpu_bitmaps m_bitmaps;
 
 public:
 
@@ -142,6 +187,14 @@ inline eapis_vcpu_state_t g_eapis_vcpu_state{&g_eapis_vcpu_global_state};
 /// these APIs from being coupled to the vCPU logic that is provided by the
 /// based hypervisor and other extensions.
 ///
+/// Handlers that install a default policy (control registers, CPUID,
+/// INIT/SIPI, MSRs, microcode and VPID) are created with the apis. The
+/// remaining handlers, and the IO bitmaps, are only created the first time
+/// they are asked for (e.g. through an add_xxx_handler() or trap_xxx()
+/// call), which is also when their exit reason is registered with the exit
+/// handler. Since creating a handler might touch the VMCS, this should only
+/// be done from the vCPU that owns these APIs.
+///
 class apis
 {
 
@@ -186,8 +239,8 @@ public:
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the EPT handler stored in the apis if EPT is
-    ///     enabled, otherwise an exception is thrown
+    /// @return Returns the EPT handler stored in the apis, creating it
+    ///     if this is the first time it is used
     ///
     gsl::not_null<ept_handler *> ept();
 
@@ -199,8 +252,11 @@ public:
     /// @ensures
     ///
     /// @param map The map to set EPTP to.
+    /// @param accessed_and_dirty if true, EPT accessed and dirty flags are
+    ///     enabled, allowing the map to be scanned for the pages the guest
+    ///     has accessed or written to (see ept::mmap::scan_dirty())
     ///
-    VIRTUAL void set_eptp(ept::mmap &map);
+    VIRTUAL void set_eptp(ept::mmap &map, bool accessed_and_dirty = false);
 
     /// Disable EPT
     ///
@@ -209,460 +265,1638 @@ public:
     ///
     VIRTUAL void disable_ept();
 
-    //--------------------------------------------------------------------------
-    // VPID
-    //--------------------------------------------------------------------------
-
-    /// Get VPID Handler
+    /// Invalidate EPT
+    ///
+    /// Flushes the EPT-derived translations of the currently loaded map
+    /// using a single-context INVEPT, skipping the flush if the map has not
+    /// been modified since it was last flushed on this vCPU.
+    ///
+    /// EPT edits are not flushed when they are made. Instead, once EPT is
+    /// enabled with set_eptp() or set_ept_view(), this function is called
+    /// before resuming the guest from every exit dispatched by eapis, so
+    /// any number of edits made while handling an exit coalesce into a
+    /// single flush per vCPU, and a vCPU sharing a map that was modified
+    /// by another vCPU is flushed before its next VM entry. Extensions that
+    /// resume the guest outside of an exit handler (e.g. on launch) should
+    /// call this function first.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the VPID handler stored in the apis if VPID is
-    ///     enabled, otherwise an exception is thrown
+    /// @param force if true, flush even if the map has not been modified
     ///
-    gsl::not_null<vpid_handler *> vpid();
+    VIRTUAL void invalidate_ept(bool force = false);
 
-    /// Enable VPID
+    /// Add EPT View
+    ///
+    /// Adds map to this vCPU's EPTP list so that the guest can switch to
+    /// it using VMFUNC (see ept_handler::add_view()).
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void enable_vpid();
+    /// @param map the map to add
+    /// @return returns the index of the view
+    ///
+    VIRTUAL std::size_t add_ept_view(ept::mmap &map);
 
-    /// Disable VPID
+    /// Set EPT View
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void disable_vpid();
-
-    //==========================================================================
-    // VMExit
-    //==========================================================================
-
-    //--------------------------------------------------------------------------
-    // Control Register
-    //--------------------------------------------------------------------------
+    /// @param index the index of the view to switch to
+    ///
+    VIRTUAL void set_ept_view(std::size_t index);
 
-    /// Get Control Register Object
+    /// Enable EPT SPP
     ///
-    /// @expects
-    /// @ensures
+    /// Enables sub-page write permissions for the currently loaded map (see
+    /// ept_handler::enable_spp())
     ///
-    /// @return Returns the CR handler stored in the apis if CR trapping is
-    ///     enabled, otherwise an exception is thrown
+    /// @expects ept_handler::is_spp_supported()
+    /// @expects EPT is enabled
+    /// @ensures
     ///
-    gsl::not_null<control_register_handler *> control_register();
+    VIRTUAL void enable_ept_spp();
 
-    /// Add Write CR0 Handler
+    /// Disable EPT SPP
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param mask the CR0 enable/disable mask
-    /// @param d the delegate to call when a mov-to-cr0 exit occurs
-    ///
-    VIRTUAL void add_wrcr0_handler(
-        vmcs_n::value_type mask,
-        const control_register_handler::handler_delegate_t &d);
+    VIRTUAL void disable_ept_spp();
 
-    /// Add Read CR3 Handler
+    //--------------------------------------------------------------------------
+    // VPID
+    //--------------------------------------------------------------------------
+
+    /// Get VPID Handler
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when a mov-from-cr3 exit occurs
+    /// @return Returns the VPID handler stored in the apis if VPID is
+    ///     enabled, otherwise an exception is thrown
     ///
-    VIRTUAL void add_rdcr3_handler(
-        const control_register_handler::handler_delegate_t &d);
+    gsl::not_null<vpid_handler *> vpid();
 
-    /// Add Write CR3 Handler
+    /// Enable VPID
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when a mov-to-cr3 exit occurs
-    ///
-    VIRTUAL void add_wrcr3_handler(
-        const control_register_handler::handler_delegate_t &d);
+    VIRTUAL void enable_vpid();
 
-    /// Add Write CR4 Handler
+    /// Disable VPID
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param mask the CR0 enable/disable mask
-    /// @param d the delegate to call when a mov-to-cr4 exit occurs
-    ///
-    VIRTUAL void add_wrcr4_handler(
-        vmcs_n::value_type mask,
-        const control_register_handler::handler_delegate_t &d);
+    VIRTUAL void disable_vpid();
 
     //--------------------------------------------------------------------------
-    // CPUID
+    // TSC
     //--------------------------------------------------------------------------
 
-    /// Get CPUID Object
+    /// Get TSC Object
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the CPUID handler stored in the apis if CPUID trapping is
-    ///     enabled, otherwise an exception is thrown
+    /// @return Returns the TSC handler stored in the apis, creating it (and
+    ///     enabling TSC offsetting) if this is the first time it is used
     ///
-    gsl::not_null<cpuid_handler *> cpuid();
+    gsl::not_null<tsc_handler *> tsc();
 
-    /// Add CPUID Handler
+    /// Set Guest TSC
+    ///
+    /// Sets the TSC offset so that the guest's TSC currently reads val.
+    /// The guest keeps reading its TSC without exiting.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param leaf the leaf to call d on
-    /// @param d the delegate to call when the guest executes CPUID at the given
-    ///        leaf and subleaf
+    /// @param val the value the guest's TSC should read
     ///
-    VIRTUAL void add_cpuid_handler(
-        cpuid_handler::leaf_t leaf, const cpuid_handler::handler_delegate_t &d);
+    VIRTUAL void set_guest_tsc(uint64_t val);
 
     //--------------------------------------------------------------------------
-    // EPT Misconfiguration
+    // MTRR / PAT
     //--------------------------------------------------------------------------
 
-    /// Get EPT misconfiguration object
+    /// Get MTRR / PAT Object
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the EPT misconfiguration handler stored in the apis if EPT
-    ///     trapping is enabled, otherwise an exception is thrown
+    /// @return Returns the MTRR / PAT handler stored in the apis, creating
+    ///     it if this is the first time it is used
     ///
-    gsl::not_null<ept_misconfiguration_handler *> ept_misconfiguration();
+    gsl::not_null<mtrr_pat_handler *> mtrr_pat();
 
-    /// Add EPT Misconfiguration Handler
+    /// Enable MTRR / PAT Virtualization
     ///
-    /// @expects
+    /// Emulates the guest's MTRRs and IA32_PAT, and keeps the memory types
+    /// in map in line with the guest's MTRRs (see mtrr_pat_handler).
+    ///
+    /// @expects [0, size) is identity mapped in map (see ept::identity_map())
     /// @ensures
     ///
-    /// @param d the delegate to call when an exit occurs
+    /// @param map the map to update when the guest's MTRRs change
+    /// @param size the number of bytes of guest physical memory mapped
+    /// @param overrides the memory type overrides used to build the map,
+    ///     or nullptr
     ///
-    VIRTUAL void add_ept_misconfiguration_handler(
-        const ept_misconfiguration_handler::handler_delegate_t &d);
+    VIRTUAL void enable_mtrr_pat_virtualization(
+        ept::mmap &map, uint64_t size,
+        const ept::memory_type_overrides *overrides = nullptr);
 
     //--------------------------------------------------------------------------
-    // EPT Violation
+    // Guest Walker
     //--------------------------------------------------------------------------
 
-    /// Get EPT violation object
+    /// Get Guest Walker Object
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the EPT violation handler stored in the apis if EPT
-    ///     trapping is enabled, otherwise an exception is thrown
+    /// @return Returns the guest page walker stored in the apis, creating it
+    ///     (and trapping INVLPG and CR3 writes) if this is the first time it
+    ///     is used
     ///
-    gsl::not_null<ept_violation_handler *> ept_violation();
+    gsl::not_null<guest_walker *> page_walker();
 
-    /// Add EPT read violation handler
+    /// Guest Virtual to Guest Physical
+    ///
+    /// Translates gva using the guest's current CR3, skipping the page
+    /// walk if the translation is cached (see guest_walker)
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when an exit occurs
+    /// @param gva the guest linear address to translate
+    /// @return the guest physical address of gva
     ///
-    VIRTUAL void add_ept_read_violation_handler(
-        const ept_violation_handler::handler_delegate_t &d);
+    VIRTUAL uint64_t gva_to_gpa(uint64_t gva);
 
-    /// Add EPT write violation handler
+    //--------------------------------------------------------------------------
+    // Guest Memory
+    //--------------------------------------------------------------------------
+
+    /// Get Guest Memory Object
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when an exit occurs
+    /// @return Returns the cache of mapped guest pages stored in the apis,
+    ///     creating it if this is the first time it is used. The IO
+    ///     instruction and EPT violation handlers access guest memory
+    ///     through it.
     ///
-    VIRTUAL void add_ept_write_violation_handler(
-        const ept_violation_handler::handler_delegate_t &d);
+    gsl::not_null<guest_memory *> memory();
 
-    /// Add EPT execute violation handler
+    /// Invalidate Guest Memory
+    ///
+    /// Unmaps any cached mapping of [gpa, gpa + size). This must be called
+    /// if the memory backing a guest physical range changes without the
+    /// EPT map's generation changing (e.g. when EPT is not used).
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when an exit occurs
+    /// @param gpa the first guest physical address that changed
+    /// @param size the size of the range that changed in bytes
     ///
-    VIRTUAL void add_ept_execute_violation_handler(
-        const ept_violation_handler::handler_delegate_t &d);
+    VIRTUAL void invalidate_guest_memory(uint64_t gpa, uint64_t size);
 
     //--------------------------------------------------------------------------
-    // External Interrupt
+    // Bitmaps
     //--------------------------------------------------------------------------
 
-    /// Get External Interrupt Object
+    /// Get Bitmaps
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the external interrupt handler stored in the apis if
-    ///     external-interrupt exiting is enabled, otherwise an exception is
-    ///     thrown
+    /// @return Returns the MSR and IO bitmaps used by this vCPU
     ///
-    gsl::not_null<external_interrupt_handler *> external_interrupt();
+    gsl::not_null<vcpu_bitmaps *> bitmaps();
 
-    /// Add External Interrupt Handler
+    //--------------------------------------------------------------------------
+    // Exit Latency
+    //--------------------------------------------------------------------------
+
+    /// Enable Exit Latency
     ///
-    /// Turns on external interrupt handling and adds an external interrupt
-    /// handler to handle external interrupts
+    /// Starts timing (using the TSC) every VM exit that is handled by a
+    /// delegate registered using add_handler(), keeping a histogram of
+    /// the results for each basic exit reason. The time measured is the
+    /// time from the first delegate being called, to a delegate reporting
+    /// that it handled the exit.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when an exit occurs
-    ///
-    VIRTUAL void add_external_interrupt_handler(
-        const external_interrupt_handler::handler_delegate_t &d);
+    VIRTUAL void enable_exit_latency();
 
-    /// Disable External Interrupt Support
+    /// Disable Exit Latency
+    ///
+    /// Stops timing VM exits and discards the histograms
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void disable_external_interrupts();
-
-    //--------------------------------------------------------------------------
-    // Interrupt Window
-    //--------------------------------------------------------------------------
+    VIRTUAL void disable_exit_latency();
 
-    /// Get Interrupt Window Object
+    /// Exit Latency
+    ///
+    /// Returns the histogram for a basic exit reason. This can be used
+    /// (e.g. by a vmcall) to copy the histogram out of the hypervisor.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the interrupt-window handler stored in the apis if
+    /// @param reason the basic exit reason to get the histogram for
+    /// @return returns the histogram for reason, or nullptr if exit
+    ///     latency is not enabled or reason is not timed
     ///
-    gsl::not_null<interrupt_window_handler *> interrupt_window();
+    VIRTUAL const exit_latency_t *exit_latency(
+        ::intel_x64::vmcs::value_type reason) const;
 
-    /// Trap on the Next Interrupt Window
+    /// Dump Exit Latency
     ///
-    /// When this function is called, the next time an interrupt can be
-    /// safely injected into the vCPU, a VM exit will occur.
+    /// Prints the histogram of every basic exit reason that has been timed
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void trap_on_next_interrupt_window();
+    VIRTUAL void dump_exit_latency();
 
-    /// Disable Interrupt Window
+    //--------------------------------------------------------------------------
+    // Allocation Tracking
+    //--------------------------------------------------------------------------
+
+    /// Enable Allocation Tracking
+    ///
+    /// Starts counting the heap allocations made while handling each VM
+    /// exit, for each basic exit reason (see alloc_counter for how
+    /// allocations are counted). This is meant for debugging and testing
+    /// that the exit path does not allocate.
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void disable_interrupt_window();
+    /// @param assert_none if true, an exit that allocates throws once it
+    ///     has been handled
+    ///
+    VIRTUAL void enable_alloc_tracking(bool assert_none = false);
 
-    /// Add Interrupt Window Handler
+    /// Disable Allocation Tracking
+    ///
+    /// Stops counting allocations and discards the counts
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when an interrupt-window exit occurs
-    ///
-    VIRTUAL void add_interrupt_window_handler(
-        const interrupt_window_handler::handler_delegate_t &d);
+    VIRTUAL void disable_alloc_tracking();
 
-    /// Is Interrupt Window Open
+    /// Exit Allocations
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return returns true if an interrupt can be injected, false otherwise.
+    /// @param reason the basic exit reason to get the counts for
+    /// @return returns the allocation counts for reason, or nullptr if
+    ///     allocation tracking is not enabled or reason is not tracked
     ///
-    VIRTUAL bool is_interrupt_window_open();
+    VIRTUAL const exit_allocs_t *exit_allocs(
+        ::intel_x64::vmcs::value_type reason) const;
 
-    /// Inject External Interrupt
+    /// Dump Allocation Tracking
+    ///
+    /// Prints the allocation counts of every basic exit reason that has
+    /// allocated
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param vector injects an external interrupt into the vCPU with the
-    ///     provided vector
-    ///
-    VIRTUAL void inject_external_interrupt(uint64_t vector);
+    VIRTUAL void dump_alloc_tracking();
 
     //--------------------------------------------------------------------------
-    // IO Instruction
+    // Exit Profiler
     //--------------------------------------------------------------------------
 
-    /// Get IO Instruction Object
+    /// Enable Exit Profiler
     ///
-    /// @expects
+    /// Starts sampling 1 in every rate VM exits that are handled by a
+    /// delegate registered using add_handler(), recording the exit reason
+    /// and the guest's RIP and CR3 (see exit_profiler). If the profiler is
+    /// already enabled, only its rate is changed.
+    ///
+    /// @expects rate != 0
     /// @ensures
     ///
-    /// @return returns the IO Instruction handler stored in the apis if IO
-    ///     Instruction trapping is enabled, otherwise an exception is thrown
+    /// @param rate the profiler samples 1 in every rate exits
     ///
-    gsl::not_null<io_instruction_handler *> io_instruction();
+    VIRTUAL void enable_exit_profiler(uint64_t rate = 64);
 
-    /// Trap All IO Instruction Accesses
+    /// Disable Exit Profiler
+    ///
+    /// Stops sampling VM exits and discards the samples
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void trap_all_io_instruction_accesses();
+    VIRTUAL void disable_exit_profiler();
 
-    /// Pass Through All IO Instruction Accesses
+    /// Exit Profiler
+    ///
+    /// Returns the profiler, which can be used (e.g. by a vmcall) to drain
+    /// the samples out of the hypervisor, or to aggregate them.
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void pass_through_all_io_instruction_accesses();
+    /// @return returns the profiler, or nullptr if the exit profiler is not
+    ///     enabled
+    ///
+    VIRTUAL exit_profiler<> *profiler();
 
-    /// Add IO Instruction Handler
+    /// Dump Exit Profile
+    ///
+    /// Prints the n most sampled (exit reason, guest RIP, guest CR3)
+    /// triples
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param port the port to call
-    /// @param in_d the delegate to call when the reads in from the given port
-    /// @param out_d the delegate to call when the guest writes out to the
-    ///        given port.
+    /// @param n the number of hotspots to print
     ///
-    VIRTUAL void add_io_instruction_handler(
-        vmcs_n::value_type port,
-        const io_instruction_handler::handler_delegate_t &in_d,
-        const io_instruction_handler::handler_delegate_t &out_d);
+    VIRTUAL void dump_exit_profile(std::size_t n = 10);
 
     //--------------------------------------------------------------------------
-    // Monitor Trap
+    // Exit Export
     //--------------------------------------------------------------------------
 
-    /// Get Monitor Trap Object
+    /// Enable Exit Export
     ///
-    /// @expects
+    /// Starts recording every VM exit that is handled by a delegate
+    /// registered using add_handler() into a ring of pages, and counting
+    /// them by reason in a counters page (see exit_export). Both can be
+    /// mapped read-only and read in place from outside of the hypervisor,
+    /// starting from the physical addresses returned by
+    /// exit_export::ring().header_phys() and
+    /// exit_export::counters().page_phys(). If the export is already
+    /// enabled, this does nothing.
+    ///
+    /// @expects num_pages != 0
     /// @ensures
     ///
-    /// @return Returns the Monitor Trap handler stored in the apis if Monitor
-    ///     Trap is enabled, otherwise an exception is thrown
+    /// @param num_pages the number of data pages in the ring
     ///
-    gsl::not_null<monitor_trap_handler *> monitor_trap();
+    VIRTUAL void enable_exit_export(std::size_t num_pages = 16);
 
-    /// Add Monitor Trap Flag Handler
+    /// Disable Exit Export
+    ///
+    /// Stops exporting VM exits and frees the shared pages. Consumers must
+    /// stop reading the pages before this is called.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when a monitor-trap flag exit occurs
-    ///
-    VIRTUAL void add_monitor_trap_handler(
-        const monitor_trap_handler::handler_delegate_t &d);
+    VIRTUAL void disable_exit_export();
 
-    /// Enable Monitor Trap Flag
+    /// Exported Exits
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void enable_monitor_trap_flag();
+    /// @return returns the exit export, or nullptr if the exit export is
+    ///     not enabled
+    ///
+    VIRTUAL exit_export *exported_exits();
 
     //--------------------------------------------------------------------------
-    // MOV DR
+    // VMCS Cache
     //--------------------------------------------------------------------------
 
-    /// Get MOV DR Object
+    /// Get VMCS Cache
+    ///
+    /// Every exit dispatched through add_handler() is bracketed by this
+    /// cache, and the handlers created by the apis read (and write) their
+    /// VMCS fields through it (see vmcs_field_cache)
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the Move DR handler stored in the apis if Move DR
-    ///     trapping is enabled, otherwise an exception is thrown
+    /// @return Returns this vCPU's VMCS field cache
     ///
-    gsl::not_null<mov_dr_handler *> mov_dr();
+    gsl::not_null<vmcs_field_cache<> *> vmcs_cache();
 
-    /// Add Move DR Handler
+    /// Dump VMCS Cache Stats
+    ///
+    /// Prints the number of VMREADs and VMWRITEs per exit, and how many
+    /// the cache saved
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param d the delegate to call when a mov-dr exit occurs
-    ///
-    VIRTUAL void add_mov_dr_handler(
-        const mov_dr_handler::handler_delegate_t &d);
+    VIRTUAL void dump_vmcs_cache_stats();
 
     //--------------------------------------------------------------------------
-    // Read MSR
+    // Coalesced Writes
     //--------------------------------------------------------------------------
 
-    /// Get Read MSR Object
+    /// Get Coalesced Writes
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the Read MSR handler stored in the apis if Read MSR
-    ///     trapping is enabled, otherwise an exception is thrown
+    /// @return Returns this vCPU's ring of coalesced port / MMIO writes
+    ///     (see coalesced_ring)
     ///
-    gsl::not_null<rdmsr_handler *> rdmsr();
+    gsl::not_null<coalesced_ring<> *> coalesced_writes();
 
-    /// Trap All Read MSR Accesses
+    /// Set Coalesced Write Handler
+    ///
+    /// Sets the delegate that emulates the buffered writes to coalesced
+    /// ports and MMIO ranges, a batch at a time. This must be called
+    /// before add_coalesced_io_port() or
+    /// ept_violation_handler::add_coalesced_mmio_handler().
     ///
     /// @expects
     /// @ensures
     ///
-    VIRTUAL void trap_all_rdmsr_accesses();
+    /// @param d the delegate to call with each batch of writes
+    ///
+    VIRTUAL void set_coalesced_write_handler(
+        const coalesced_ring<>::flush_delegate_t &d);
 
-    /// Pass Through All Read MSR Accesses
+    /// Add Coalesced IO Port
     ///
-    /// @expects
+    /// Traps the given port and buffers the guest's OUTs to it in the
+    /// coalesced write ring instead of emulating each one when it exits
+    /// (see io_instruction_handler::add_coalesced_port()).
+    ///
+    /// @expects set_coalesced_write_handler() has been called
     /// @ensures
     ///
-    VIRTUAL void pass_through_all_rdmsr_accesses();
+    /// @param port the port to coalesce writes to
+    ///
+    VIRTUAL void add_coalesced_io_port(vmcs_n::value_type port);
 
-    /// Add Read MSR Handler
+    /// Flush Coalesced Writes
+    ///
+    /// Hands the buffered writes to the coalesced write handler now (e.g.
+    /// from a timer, or before the state of a device is inspected)
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param msr the address at which to call the given handler
-    /// @param d the delegate to call when a rdmsr_handler exit occurs
-    ///
-    VIRTUAL void add_rdmsr_handler(
-        vmcs_n::value_type msr, const rdmsr_handler::handler_delegate_t &d);
+    VIRTUAL void flush_coalesced_writes();
 
     //--------------------------------------------------------------------------
-    // Write MSR
+    // Doorbells
     //--------------------------------------------------------------------------
 
-    /// Get Write MSR Object
+    /// Get Doorbells
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the Write MSR handler stored in the apis if Write MSR
-    ///     trapping is enabled, otherwise an exception is thrown
+    /// @return Returns this vCPU's doorbell bitmap (see doorbell_bitmap),
+    ///     which a device model drains to find the queues that have work
     ///
-    gsl::not_null<wrmsr_handler *> wrmsr();
+    gsl::not_null<doorbell_bitmap<> *> doorbells();
 
-    /// Trap All Write MSR Accesses
+    /// Add IO Doorbell
     ///
-    /// @expects
+    /// Traps the given port, and makes an OUT of val to it ring the given
+    /// doorbell instead of being emulated (see
+    /// io_instruction_handler::add_doorbell())
+    ///
+    /// @expects bit < doorbell_bitmap<>::size()
     /// @ensures
     ///
-    VIRTUAL void trap_all_wrmsr_accesses();
+    /// @param port the doorbell port
+    /// @param val the value that rings the doorbell, or
+    ///     doorbell_table::any_value
+    /// @param bit the doorbell to ring
+    ///
+    VIRTUAL void add_io_doorbell(
+        vmcs_n::value_type port, uint64_t val, uint64_t bit);
 
-    /// Pass Through All Write MSR Accesses
+    /// Add MMIO Doorbell
     ///
-    /// @expects
+    /// Makes a store of val to the given GPA ring the given doorbell
+    /// instead of being emulated (see ept_violation_handler::add_doorbell()).
+    /// The GPA must be mapped in EPT without write access.
+    ///
+    /// @expects bit < doorbell_bitmap<>::size()
     /// @ensures
     ///
-    VIRTUAL void pass_through_all_wrmsr_accesses();
+    /// @param gpa the GPA of the doorbell register
+    /// @param val the value that rings the doorbell, or
+    ///     doorbell_table::any_value
+    /// @param bit the doorbell to ring
+    ///
+    VIRTUAL void add_mmio_doorbell(uint64_t gpa, uint64_t val, uint64_t bit);
 
-    /// Add Write MSR Handler
+    /// Set Doorbell Wake Target
     ///
-    /// @expects
+    /// Posts vector to target whenever one of this vCPU's doorbells goes
+    /// from clear to set, so that the vCPU running the device model is
+    /// woken up (once per batch of doorbells) instead of polling
+    ///
+    /// @expects target has posted interrupts enabled
     /// @ensures
     ///
-    /// @param msr the address at which to call the given handler
-    /// @param d the delegate to call when a wrmsr_handler exit occurs
+    /// @param target the vCPU to wake up
+    /// @param vector the vector to post to target
     ///
-    VIRTUAL void add_wrmsr_handler(
+    VIRTUAL void set_doorbell_wake_target(
+        gsl::not_null<posted_interrupt_handler *> target, uint64_t vector);
+
+    //--------------------------------------------------------------------------
+    // Exit Poll
+    //--------------------------------------------------------------------------
+
+    /// Set Exit Poll Handler
+    ///
+    /// Calls d at the start of every exit that is handled by a delegate
+    /// registered using add_handler(), so work the guest queued in shared
+    /// memory can be picked up while the vCPU is in the VMM anyway,
+    /// without an exit of its own (see stats_service::attach_ring()).
+    /// There is a single poll handler per vCPU; setting a new one replaces
+    /// the old one.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call on every exit
+    ///
+    VIRTUAL void set_exit_poll_handler(const exit_poll_delegate_t &d);
+
+    /// Remove Exit Poll Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void remove_exit_poll_handler();
+
+    //--------------------------------------------------------------------------
+    // Unhandled Exits
+    //--------------------------------------------------------------------------
+
+    /// Set Unhandled Policy
+    ///
+    /// Sets what every handler does with an exit that none of its delegates
+    /// handle (see unhandled_policy). Other than unhandled_policy::raise
+    /// (the default), the handlers never throw when an exit is not
+    /// handled. Handlers that are created later use the same policy.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param policy the policy to use
+    ///
+    VIRTUAL void set_unhandled_policy(unhandled_policy policy);
+
+    //==========================================================================
+    // VMExit
+    //==========================================================================
+
+    //--------------------------------------------------------------------------
+    // Control Register
+    //--------------------------------------------------------------------------
+
+    /// Get Control Register Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the CR handler stored in the apis if CR trapping is
+    ///     enabled, otherwise an exception is thrown
+    ///
+    gsl::not_null<control_register_handler *> control_register();
+
+    /// Add Write CR0 Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mask the CR0 bits the handler watches (added to the CR0
+    ///     guest/host mask, d is only called when one of them changes)
+    /// @param d the delegate to call when a mov-to-cr0 exit occurs
+    ///
+    VIRTUAL void add_wrcr0_handler(
+        vmcs_n::value_type mask,
+        const control_register_handler::handler_delegate_t &d);
+
+    /// Add Read CR3 Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a mov-from-cr3 exit occurs
+    ///
+    VIRTUAL void add_rdcr3_handler(
+        const control_register_handler::handler_delegate_t &d);
+
+    /// Add Write CR3 Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a mov-to-cr3 exit occurs
+    ///
+    VIRTUAL void add_wrcr3_handler(
+        const control_register_handler::handler_delegate_t &d);
+
+    /// Require Write CR3 Exits
+    ///
+    /// Makes sure that every MOV to CR3 exits (see
+    /// control_register_handler::require_wrcr3_exits())
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void require_wrcr3_exits();
+
+    /// Add Write CR4 Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mask the CR4 bits the handler watches (added to the CR4
+    ///     guest/host mask, d is only called when one of them changes)
+    /// @param d the delegate to call when a mov-to-cr4 exit occurs
+    ///
+    VIRTUAL void add_wrcr4_handler(
+        vmcs_n::value_type mask,
+        const control_register_handler::handler_delegate_t &d);
+
+    //--------------------------------------------------------------------------
+    // CPUID
+    //--------------------------------------------------------------------------
+
+    /// Get CPUID Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the CPUID handler stored in the apis if CPUID trapping is
+    ///     enabled, otherwise an exception is thrown
+    ///
+    gsl::not_null<cpuid_handler *> cpuid();
+
+    /// Add CPUID Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the leaf to call d on
+    /// @param d the delegate to call when the guest executes CPUID at the given
+    ///        leaf and subleaf
+    ///
+    VIRTUAL void add_cpuid_handler(
+        cpuid_handler::leaf_t leaf, const cpuid_handler::handler_delegate_t &d);
+
+    /// Add CPUID Subleaf Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the leaf to call d on
+    /// @param subleaf the subleaf to call d on
+    /// @param d the delegate to call when the guest executes CPUID at the given
+    ///        leaf and subleaf
+    ///
+    VIRTUAL void add_cpuid_subleaf_handler(
+        cpuid_handler::leaf_t leaf, cpuid_handler::subleaf_t subleaf,
+        const cpuid_handler::handler_delegate_t &d);
+
+    //--------------------------------------------------------------------------
+    // EPT Misconfiguration
+    //--------------------------------------------------------------------------
+
+    /// Get EPT misconfiguration object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the EPT misconfiguration handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<ept_misconfiguration_handler *> ept_misconfiguration();
+
+    /// Add EPT Misconfiguration Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when an exit occurs
+    ///
+    VIRTUAL void add_ept_misconfiguration_handler(
+        const ept_misconfiguration_handler::handler_delegate_t &d);
+
+    /// Enable MMIO Fast Path
+    ///
+    /// Hands EPT misconfiguration exits to the MMIO ranges and doorbells
+    /// registered with the EPT violation handler (see
+    /// ept_violation_handler::emulate_mmio()) before any other
+    /// misconfiguration handler runs. Together with
+    /// ept::mmap::map_mmio(), this lets device regions exit as
+    /// misconfigurations, which skip the EPT violation handlers entirely.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_mmio_fast_path();
+
+    //--------------------------------------------------------------------------
+    // EPT Violation
+    //--------------------------------------------------------------------------
+
+    /// Get EPT violation object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the EPT violation handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<ept_violation_handler *> ept_violation();
+
+    /// Add EPT read violation handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when an exit occurs
+    ///
+    VIRTUAL void add_ept_read_violation_handler(
+        const ept_violation_handler::handler_delegate_t &d);
+
+    /// Add EPT write violation handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when an exit occurs
+    ///
+    VIRTUAL void add_ept_write_violation_handler(
+        const ept_violation_handler::handler_delegate_t &d);
+
+    /// Add EPT execute violation handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when an exit occurs
+    ///
+    VIRTUAL void add_ept_execute_violation_handler(
+        const ept_violation_handler::handler_delegate_t &d);
+
+    /// Add EPT page violation handler
+    ///
+    /// @expects access != 0
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page to watch
+    /// @param access the accesses to call d for (see
+    ///     ept_violation_handler::access_read, etc.)
+    /// @param d the delegate to call when an exit occurs on the page
+    ///
+    VIRTUAL void add_ept_page_violation_handler(
+        uint64_t gpa, uint64_t access,
+        const ept_violation_handler::handler_delegate_t &d);
+
+    /// Remove EPT page violation handlers
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page
+    ///
+    VIRTUAL void remove_ept_page_violation_handlers(uint64_t gpa);
+
+    /// Add EPT SPP handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when an SPPT miss or misconfiguration
+    ///     occurs (see ept_violation_handler::add_spp_handler())
+    ///
+    VIRTUAL void add_ept_spp_handler(
+        const ept_violation_handler::spp_delegate_t &d);
+
+    //--------------------------------------------------------------------------
+    // EPT Write Monitor
+    //--------------------------------------------------------------------------
+
+    /// Get EPT Write Monitor Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the EPT write monitor stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<ept_write_monitor *> write_monitor();
+
+    /// Watch EPT Writes
+    ///
+    /// Write protects the page that contains gpa in map, and calls d on each
+    /// write to it (see ept_write_monitor::watch)
+    ///
+    /// @expects gpa is mapped in map
+    /// @ensures
+    ///
+    /// @param map the map the guest uses to access gpa
+    /// @param gpa a guest physical address in the page to watch
+    /// @param d the delegate to call when the page is written
+    ///
+    VIRTUAL void watch_ept_writes(
+        ept::mmap &map, uint64_t gpa,
+        const ept_write_monitor::handler_delegate_t &d);
+
+    /// Unwatch EPT Writes
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page
+    ///
+    VIRTUAL void unwatch_ept_writes(uint64_t gpa);
+
+    //--------------------------------------------------------------------------
+    // External Interrupt
+    //--------------------------------------------------------------------------
+
+    /// Get External Interrupt Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the external interrupt handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<external_interrupt_handler *> external_interrupt();
+
+    /// Add External Interrupt Handler
+    ///
+    /// Turns on external interrupt handling and adds an external interrupt
+    /// handler to handle external interrupts
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    VIRTUAL void add_external_interrupt_handler(
+        const external_interrupt_handler::handler_delegate_t &d, int64_t priority = 0);
+
+    /// Disable External Interrupt Support
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_external_interrupts();
+
+    //--------------------------------------------------------------------------
+    // Interrupt Window
+    //--------------------------------------------------------------------------
+
+    /// Get Interrupt Window Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the interrupt-window handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<interrupt_window_handler *> interrupt_window();
+
+    /// Trap on the Next Interrupt Window
+    ///
+    /// When this function is called, the next time an interrupt can be
+    /// safely injected into the vCPU, a VM exit will occur.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void trap_on_next_interrupt_window();
+
+    /// Disable Interrupt Window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_interrupt_window();
+
+    /// Add Interrupt Window Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when an interrupt-window exit occurs
+    ///
+    VIRTUAL void add_interrupt_window_handler(
+        const interrupt_window_handler::handler_delegate_t &d);
+
+    /// Is Interrupt Window Open
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if an interrupt can be injected, false otherwise.
+    ///
+    VIRTUAL bool is_interrupt_window_open();
+
+    /// Inject External Interrupt
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector injects an external interrupt into the vCPU with the
+    ///     provided vector
+    ///
+    VIRTUAL void inject_external_interrupt(uint64_t vector);
+
+    /// Queue External Interrupt
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector queues an external interrupt for injection into the
+    ///     vCPU as soon as the interrupt window is open (see
+    ///     interrupt_window_handler::queue())
+    ///
+    VIRTUAL void queue_external_interrupt(uint64_t vector);
+
+    //--------------------------------------------------------------------------
+    // Virtual APIC
+    //--------------------------------------------------------------------------
+
+    /// Get Virtual APIC Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the virtual APIC handler stored in the apis,
+    ///     creating it if this is the first time it is used
+    ///
+    gsl::not_null<virtual_apic_handler *> virtual_apic();
+
+    /// Enable Virtual APIC
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_virtual_apic();
+
+    //--------------------------------------------------------------------------
+    // Posted Interrupts
+    //--------------------------------------------------------------------------
+
+    /// Get Posted Interrupt Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the posted interrupt handler stored in the apis,
+    ///     creating it if this is the first time it is used
+    ///
+    gsl::not_null<posted_interrupt_handler *> posted_interrupts();
+
+    /// Enable Posted Interrupts
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the notification vector to use
+    ///
+    VIRTUAL void enable_posted_interrupts(uint64_t vector);
+
+    /// Post Interrupt
+    ///
+    /// Posts vector to this vCPU without forcing a VM exit. Unlike the
+    /// other apis, this can be called from any core.
+    ///
+    /// @expects posted interrupts are enabled
+    /// @ensures
+    ///
+    /// @param vector the vector to post
+    ///
+    VIRTUAL void post_interrupt(uint64_t vector);
+
+    //--------------------------------------------------------------------------
+    // IPI
+    //--------------------------------------------------------------------------
+
+    /// Get IPI Object
+    ///
+    /// Creating the IPI handler enables the ICR fast path (see ipi_handler)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the IPI handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<ipi_handler *> ipi();
+
+    /// Add IPI Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when the guest sends a fixed IPI
+    ///
+    VIRTUAL void add_ipi_handler(const ipi_handler::handler_delegate_t &d);
+
+    /// Add IPI Target
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apic_id the x2APIC ID of the target vCPU
+    /// @param target the posted interrupt handler fixed IPIs sent to
+    ///     apic_id are posted to
+    ///
+    VIRTUAL void add_ipi_target(
+        uint64_t apic_id, gsl::not_null<posted_interrupt_handler *> target);
+
+    //--------------------------------------------------------------------------
+    // Page Modification Log
+    //--------------------------------------------------------------------------
+
+    /// Get PML Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the PML handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<pml_handler *> pml();
+
+    /// Enable PML
+    ///
+    /// @expects EPT is enabled with accessed and dirty flags
+    /// @ensures
+    ///
+    VIRTUAL void enable_pml();
+
+    /// Disable PML
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_pml();
+
+    /// Add PML Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call with each batch of logged addresses
+    ///
+    VIRTUAL void add_pml_handler(
+        const pml_handler::handler_delegate_t &d);
+
+    /// Drain PML
+    ///
+    /// Hands any addresses that have been logged so far to the registered
+    /// PML handlers, without waiting for the log to fill up.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of addresses that were drained
+    ///
+    VIRTUAL uint64_t drain_pml();
+
+    //--------------------------------------------------------------------------
+    // Nested VMX
+    //--------------------------------------------------------------------------
+
+    /// Get Nested VMX Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the nested VMX handler stored in the apis, creating
+    ///     it if this is the first time it is used
+    ///
+    gsl::not_null<nested_vmx_handler *> nested_vmx();
+
+    /// Enable Nested VMX
+    ///
+    /// @expects nested_vmx_handler::is_supported()
+    /// @ensures
+    ///
+    VIRTUAL void enable_nested_vmx();
+
+    /// Disable Nested VMX
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_nested_vmx();
+
+    /// Add Nested VMX Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a VMX instruction exits
+    ///
+    VIRTUAL void add_nested_vmx_handler(
+        const nested_vmx_handler::handler_delegate_t &d);
+
+    //--------------------------------------------------------------------------
+    // IO Instruction
+    //--------------------------------------------------------------------------
+
+    /// Get IO Instruction Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the IO Instruction handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<io_instruction_handler *> io_instruction();
+
+    /// Trap All IO Instruction Accesses
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void trap_all_io_instruction_accesses();
+
+    /// Pass Through All IO Instruction Accesses
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void pass_through_all_io_instruction_accesses();
+
+    /// Trap IO Instruction Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first port to trap on
+    /// @param last the last port to trap on (inclusive)
+    ///
+    VIRTUAL void trap_io_instruction_range(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// Pass Through IO Instruction Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first port to pass through
+    /// @param last the last port to pass through (inclusive)
+    ///
+    VIRTUAL void pass_through_io_instruction_range(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// Add IO Instruction Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param port the port to call
+    /// @param in_d the delegate to call when the reads in from the given port
+    /// @param out_d the delegate to call when the guest writes out to the
+    ///        given port.
+    ///
+    VIRTUAL void add_io_instruction_handler(
+        vmcs_n::value_type port,
+        const io_instruction_handler::handler_delegate_t &in_d,
+        const io_instruction_handler::handler_delegate_t &out_d);
+
+    /// Add IO String Handler
+    ///
+    /// Registers handlers that process REP INS / REP OUTS on the given
+    /// port a buffer at a time, instead of once per element.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param port the port to call
+    /// @param in_d the delegate to call when the guest executes rep ins on
+    ///        the given port
+    /// @param out_d the delegate to call when the guest executes rep outs
+    ///        on the given port
+    ///
+    VIRTUAL void add_io_string_handler(
+        vmcs_n::value_type port,
+        const io_instruction_handler::string_handler_delegate_t &in_d,
+        const io_instruction_handler::string_handler_delegate_t &out_d);
+
+    //--------------------------------------------------------------------------
+    // Monitor Trap
+    //--------------------------------------------------------------------------
+
+    /// Get Monitor Trap Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the Monitor Trap handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<monitor_trap_handler *> monitor_trap();
+
+    /// Add Monitor Trap Flag Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a monitor-trap flag exit occurs
+    ///
+    VIRTUAL void add_monitor_trap_handler(
+        const monitor_trap_handler::handler_delegate_t &d);
+
+    /// Enable Monitor Trap Flag
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_monitor_trap_flag();
+
+    //--------------------------------------------------------------------------
+    // Processor Trace
+    //--------------------------------------------------------------------------
+
+    /// Get Processor Trace Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the processor trace handler stored in the apis,
+    ///     creating it if this is the first time it is used
+    ///
+    gsl::not_null<processor_trace_handler *> processor_trace();
+
+    /// Enable Processor Trace
+    ///
+    /// @expects processor_trace_handler::is_supported()
+    /// @ensures
+    ///
+    /// @param pmi_vector the vector to deliver the ToPA PMI on
+    ///
+    VIRTUAL void enable_processor_trace(uint64_t pmi_vector);
+
+    //--------------------------------------------------------------------------
+    // MOV DR
+    //--------------------------------------------------------------------------
+
+    /// Get MOV DR Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the Move DR handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<mov_dr_handler *> mov_dr();
+
+    /// Add Move DR Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a mov-dr exit occurs
+    ///
+    VIRTUAL void add_mov_dr_handler(
+        const mov_dr_handler::handler_delegate_t &d);
+
+    //--------------------------------------------------------------------------
+    // HLT
+    //--------------------------------------------------------------------------
+
+    /// Get HLT Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the HLT handler stored in the apis, creating it
+    ///     (and the interrupt-window handler it wakes on) if this is the
+    ///     first time it is used
+    ///
+    gsl::not_null<hlt_handler *> hlt();
+
+    /// Add HLT Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a HLT exit occurs
+    ///
+    VIRTUAL void add_hlt_handler(
+        const hlt_handler::handler_delegate_t &d);
+
+    /// Enable HLT Exiting
+    ///
+    /// Enables HLT exiting with adaptive halt-polling (see hlt_handler)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_hlt_exiting();
+
+    //--------------------------------------------------------------------------
+    // PAUSE
+    //--------------------------------------------------------------------------
+
+    /// Get PAUSE Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the PAUSE handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<pause_handler *> pause();
+
+    /// Add PAUSE Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a PAUSE exit occurs
+    ///
+    VIRTUAL void add_pause_handler(
+        const pause_handler::handler_delegate_t &d);
+
+    /// Enable PAUSE-Loop Exiting
+    ///
+    /// @expects pause_handler::is_loop_exiting_supported()
+    /// @ensures
+    ///
+    /// @param gap the PLE gap (in TSC ticks)
+    /// @param window the PLE window (in TSC ticks)
+    /// @param max_window if larger than window, the window adapts up to
+    ///     this value (see pause_handler::enable_loop_exiting)
+    ///
+    VIRTUAL void enable_pause_loop_exiting(
+        uint64_t gap = pause_handler::default_ple_gap,
+        uint64_t window = pause_handler::default_ple_window,
+        uint64_t max_window = 0);
+
+    //--------------------------------------------------------------------------
+    // Preemption Timer
+    //--------------------------------------------------------------------------
+
+    /// Get Preemption Timer Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the preemption timer handler stored in the apis,
+    ///     creating it if this is the first time it is used
+    ///
+    gsl::not_null<preemption_timer_handler *> preemption_timer();
+
+    /// Add Preemption Timer Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when the preemption timer expires
+    ///
+    VIRTUAL void add_preemption_timer_handler(
+        const preemption_timer_handler::handler_delegate_t &d);
+
+    /// Arm Preemption Timer
+    ///
+    /// Arms the preemption timer to expire every period TSC ticks of guest
+    /// execution (see preemption_timer_handler::arm_periodic)
+    ///
+    /// @expects preemption_timer_handler::is_supported()
+    /// @ensures
+    ///
+    /// @param period the number of TSC ticks between each expiry
+    ///
+    VIRTUAL void arm_preemption_timer(uint64_t period);
+
+    /// Arm Preemption Deadline
+    ///
+    /// Arms a one-shot preemption timer deadline ticks TSC ticks of guest
+    /// execution from now (see preemption_timer_handler::arm)
+    ///
+    /// @expects preemption_timer_handler::is_supported()
+    /// @ensures
+    ///
+    /// @param ticks the number of TSC ticks until the timer expires
+    ///
+    VIRTUAL void arm_preemption_deadline(uint64_t ticks);
+
+    /// Disarm Preemption Timer
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disarm_preemption_timer();
+
+    //--------------------------------------------------------------------------
+    // Read MSR
+    //--------------------------------------------------------------------------
+
+    /// Get Read MSR Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the Read MSR handler stored in the apis if Read MSR
+    ///     trapping is enabled, otherwise an exception is thrown
+    ///
+    gsl::not_null<rdmsr_handler *> rdmsr();
+
+    /// Trap All Read MSR Accesses
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void trap_all_rdmsr_accesses();
+
+    /// Pass Through All Read MSR Accesses
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void pass_through_all_rdmsr_accesses();
+
+    /// Trap RDMSR Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr to trap reads of
+    /// @param last the last msr to trap reads of (inclusive)
+    ///
+    VIRTUAL void trap_rdmsr_range(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// Pass Through RDMSR Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr to pass through reads of
+    /// @param last the last msr to pass through reads of (inclusive)
+    ///
+    VIRTUAL void pass_through_rdmsr_range(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// Add Read MSR Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the address at which to call the given handler
+    /// @param d the delegate to call when a rdmsr_handler exit occurs
+    ///
+    VIRTUAL void add_rdmsr_handler(
+        vmcs_n::value_type msr, const rdmsr_handler::handler_delegate_t &d);
+
+    /// Add Read MSR Constant
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to answer
+    /// @param val the value every read of msr returns
+    ///
+    VIRTUAL void add_rdmsr_constant(
+        vmcs_n::value_type msr, uint64_t val);
+
+    //--------------------------------------------------------------------------
+    // Write MSR
+    //--------------------------------------------------------------------------
+
+    /// Get Write MSR Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the Write MSR handler stored in the apis if Write MSR
+    ///     trapping is enabled, otherwise an exception is thrown
+    ///
+    gsl::not_null<wrmsr_handler *> wrmsr();
+
+    /// Trap All Write MSR Accesses
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void trap_all_wrmsr_accesses();
+
+    /// Pass Through All Write MSR Accesses
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void pass_through_all_wrmsr_accesses();
+
+    /// Trap WRMSR Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr to trap writes to
+    /// @param last the last msr to trap writes to (inclusive)
+    ///
+    VIRTUAL void trap_wrmsr_range(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// Pass Through WRMSR Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr to pass through writes to
+    /// @param last the last msr to pass through writes to (inclusive)
+    ///
+    VIRTUAL void pass_through_wrmsr_range(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// Add Write MSR Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the address at which to call the given handler
+    /// @param d the delegate to call when a wrmsr_handler exit occurs
+    ///
+    VIRTUAL void add_wrmsr_handler(
         vmcs_n::value_type msr, const wrmsr_handler::handler_delegate_t &d);
 
+    /// Add Write MSR Mask
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to restrict writes to
+    /// @param mask the bits of msr the guest is allowed to write. If 0,
+    ///     writes to msr are ignored
+    ///
+    VIRTUAL void add_wrmsr_mask(
+        vmcs_n::value_type msr, uint64_t mask = 0);
+
+    //--------------------------------------------------------------------------
+    // MSR Lists
+    //--------------------------------------------------------------------------
+
+    /// Get MSR Lists Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the VM-entry/VM-exit MSR lists stored in the apis,
+    ///     creating them if this is the first time they are used
+    ///
+    gsl::not_null<msr_lists *> switched_msrs();
+
+    /// Add Switched MSR
+    ///
+    /// Adds msr to the VM-entry/VM-exit MSR lists, so the CPU loads
+    /// guest_val on VM entry and restores the VMM's current value on VM
+    /// exit, and passes the guest's reads and writes of msr through in the
+    /// MSR bitmaps.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to switch on each VMX transition
+    /// @param guest_val the value msr holds while the guest runs
+    ///
+    VIRTUAL void add_switched_msr(
+        vmcs_n::value_type msr, uint64_t guest_val);
+
+    /// Remove Switched MSR
+    ///
+    /// Removes msr from the VM-entry/VM-exit MSR lists and traps the
+    /// guest's reads and writes of msr again.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to stop switching
+    ///
+    VIRTUAL void remove_switched_msr(
+        vmcs_n::value_type msr);
+
     //--------------------------------------------------------------------------
     // XSetBV
     //--------------------------------------------------------------------------
@@ -672,8 +1906,8 @@ public:
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the XSetBV handler stored in the apis if XSetBV
-    ///     trapping is enabled, otherwise an exception is thrown
+    /// @return Returns the XSetBV handler stored in the apis, creating it
+    ///     if this is the first time it is used
     ///
     gsl::not_null<xsetbv_handler *> xsetbv();
 
@@ -687,6 +1921,85 @@ public:
     VIRTUAL void add_xsetbv_handler(
         const xsetbv_handler::handler_delegate_t &d);
 
+    //--------------------------------------------------------------------------
+    // VMCall
+    //--------------------------------------------------------------------------
+
+    /// Get VMCall Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the VMCall handler stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<vmcall_handler *> vmcall();
+
+    /// Add VMCall Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param opcode the value of RAX to call d for
+    /// @param d the delegate to call when the guest executes vmcall with
+    ///        the given opcode
+    ///
+    VIRTUAL void add_vmcall_handler(
+        uint64_t opcode, const vmcall_handler::handler_delegate_t &d);
+
+    //--------------------------------------------------------------------------
+    // Stats
+    //--------------------------------------------------------------------------
+
+    /// Get Stats Object
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the stats service stored in the apis, creating it
+    ///     if this is the first time it is used
+    ///
+    gsl::not_null<stats_service *> stats();
+
+    /// Enable Stats VMCall
+    ///
+    /// Starts answering batches of stats / control commands issued with
+    /// a vmcall (see bfstats.h and stats_service)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_stats_vmcall();
+
+    //--------------------------------------------------------------------------
+    // Memory Usage
+    //--------------------------------------------------------------------------
+
+    /// Memory Usage
+    ///
+    /// Returns an estimate of the memory used on behalf of this vCPU by
+    /// the extended APIs: the MSR / IO bitmaps, the EPT tables by level,
+    /// the handlers (including the maps and lists holding their delegates),
+    /// the handlers' logs and the telemetry buffers. Pages are counted in
+    /// full and heap containers by capacity (see memory_usage_t). Bitmaps
+    /// and EPT maps shared with other vCPUs are reported by each of them.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the memory used by this vCPU
+    ///
+    VIRTUAL memory_usage_t memory_usage();
+
+    /// Dump Memory Usage
+    ///
+    /// Prints the result of memory_usage()
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void dump_memory_usage();
+
     //==========================================================================
     // Resources
     //==========================================================================
@@ -698,6 +2011,10 @@ public:
     /// as needed. Note that the handlers are called in the reverse order they
     /// are registered (i.e. FIFO).
     ///
+    /// The delegates for each basic exit reason are kept by the apis, which
+    /// registers a single delegate with the exit handler for each reason,
+    /// so that exits can be timed (see enable_exit_latency()).
+    ///
     /// @note If the delegate has serviced the VM exit, it should return true,
     ///     otherwise it should return false, and the next delegate registered
     ///     for this VM exit will execute, or an unimplemented exit reason
@@ -720,32 +2037,102 @@ private:
 
 private:
 
-    std::unique_ptr<uint8_t, void(*)(void *)> m_msr_bitmap;
-    std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_a;
-    std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_b;
+    static constexpr const auto num_timed_exit_reasons = 65U;
+
+    using exit_latencies_t = std::array<exit_latency_t, num_timed_exit_reasons>;
+    using exit_allocs_array_t = std::array<exit_allocs_t, num_timed_exit_reasons>;
+
+    // Note: this must be declared before the handlers below, as they
+    // register their delegates when they are constructed.
+    //
+    exit_dispatch_table<num_timed_exit_reasons> m_exit_dispatch_table;
+    std::unique_ptr<exit_latencies_t> m_exit_latencies;
+    std::unique_ptr<exit_allocs_array_t> m_exit_allocs;
+    std::unique_ptr<exit_profiler<>> m_exit_profiler;
+    std::unique_ptr<exit_export> m_exit_export;
+    vmcs_field_cache<> m_vmcs_cache;
+    coalesced_ring<> m_coalesced_writes;
+    doorbell_bitmap<> m_doorbells;
+    posted_interrupt_handler *m_doorbell_target{nullptr};
+    uint64_t m_doorbell_vector{0};
+    exit_poll_delegate_t m_exit_poll{};
+    exit_poll_delegate_t m_ept_resume{};
+    unhandled_policy m_unhandled_policy{unhandled_policy::raise};
 
 private:
 
+    void wake_doorbell(uint64_t bit);
+
+    // Once EPT is enabled, the generation of the loaded map is checked
+    // before resuming from every exit (see invalidate_ept)
+    //
+    void enable_ept_resume();
+    void resume_ept(gsl::not_null<vmcs_t *> vmcs);
+
+    // The EPT, VPID, bitmap, virtual APIC, posted interrupt and processor
+    // trace handlers are not derived from base, and write the VM-execution,
+    // VM-exit and VM-entry controls directly. Before they are enabled
+    // during an exit, the cache must write back and forget those fields
+    // (see vmcs_field_cache::release)
+    //
+    void release_cached_controls();
+
+    template<typename T>
+    gsl::not_null<T *> lazy_handler(std::unique_ptr<T> &handler)
+    {
+        if (!handler) {
+            handler = std::make_unique<T>(this, m_eapis_vcpu_global_state);
+
+            if constexpr (std::is_base_of<base, T>::value) {
+                handler->set_vmcs_cache(&m_vmcs_cache);
+                handler->set_unhandled_policy(m_unhandled_policy);
+            }
+        }
+
+        return handler.get();
+    }
+
+    eapis_vcpu_global_state_t *m_eapis_vcpu_global_state;
+    vcpu_bitmaps m_bitmaps;
+
     control_register_handler m_control_register_handler;
     cpuid_handler m_cpuid_handler;
-    io_instruction_handler m_io_instruction_handler;
-    monitor_trap_handler m_monitor_trap_handler;
-    mov_dr_handler m_mov_dr_handler;
     rdmsr_handler m_rdmsr_handler;
     wrmsr_handler m_wrmsr_handler;
-    xsetbv_handler m_xsetbv_handler;
-
-    ept_misconfiguration_handler m_ept_misconfiguration_handler;
-    ept_violation_handler m_ept_violation_handler;
-    external_interrupt_handler m_external_interrupt_handler;
     init_signal_handler m_init_signal_handler;
-    interrupt_window_handler m_interrupt_window_handler;
     sipi_signal_handler m_sipi_signal_handler;
-
-    ept_handler m_ept_handler;
     microcode_handler m_microcode_handler;
     vpid_handler m_vpid_handler;
 
+    std::unique_ptr<io_instruction_handler> m_io_instruction_handler;
+    std::unique_ptr<monitor_trap_handler> m_monitor_trap_handler;
+    std::unique_ptr<mov_dr_handler> m_mov_dr_handler;
+    std::unique_ptr<hlt_handler> m_hlt_handler;
+    std::unique_ptr<pause_handler> m_pause_handler;
+    std::unique_ptr<preemption_timer_handler> m_preemption_timer_handler;
+    std::unique_ptr<xsetbv_handler> m_xsetbv_handler;
+
+    std::unique_ptr<ept_misconfiguration_handler> m_ept_misconfiguration_handler;
+    std::unique_ptr<ept_violation_handler> m_ept_violation_handler;
+    std::unique_ptr<external_interrupt_handler> m_external_interrupt_handler;
+    std::unique_ptr<interrupt_window_handler> m_interrupt_window_handler;
+    std::unique_ptr<ipi_handler> m_ipi_handler;
+    std::unique_ptr<pml_handler> m_pml_handler;
+    std::unique_ptr<nested_vmx_handler> m_nested_vmx_handler;
+    std::unique_ptr<virtual_apic_handler> m_virtual_apic_handler;
+    std::unique_ptr<posted_interrupt_handler> m_posted_interrupt_handler;
+    std::unique_ptr<processor_trace_handler> m_processor_trace_handler;
+    std::unique_ptr<tsc_handler> m_tsc_handler;
+    std::unique_ptr<mtrr_pat_handler> m_mtrr_pat_handler;
+    std::unique_ptr<guest_walker> m_guest_walker;
+    std::unique_ptr<guest_memory> m_guest_memory;
+    std::unique_ptr<msr_lists> m_msr_lists;
+    std::unique_ptr<ept_write_monitor> m_write_monitor;
+    std::unique_ptr<vmcall_handler> m_vmcall_handler;
+    std::unique_ptr<stats_service> m_stats_service;
+
+    std::unique_ptr<ept_handler> m_ept_handler;
+
 private:
 
     friend class io_instruction_handler;
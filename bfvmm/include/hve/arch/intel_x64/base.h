@@ -20,17 +20,42 @@
 #define BASE_INTEL_X64_EAPIS_H
 
 #include <bfgsl.h>
+#include <bfdebug.h>
 
-#include <list>
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <string>
 #include <unordered_map>
 
+#include <bfvmm/memory_manager/memory_manager.h>
 #include <bfvmm/hve/arch/intel_x64/vmcs/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler/exit_handler.h>
 
+// The number of records each handler's log holds (see log_ring)
+//
 #ifndef EAPIS_LOG_MAX
 #define EAPIS_LOG_MAX 10
 #endif
 
+// If set to 1, the handlers support a low overhead stats mode, which
+// (unlike the log) is available in release builds (see base::enable_stats)
+//
+#ifndef EAPIS_STATS
+#define EAPIS_STATS 0
+#endif
+
+// While stats are enabled, one in every EAPIS_STATS_SAMPLE_RATE exits is
+// added to a handler's log
+//
+#ifndef EAPIS_STATS_SAMPLE_RATE
+#define EAPIS_STATS_SAMPLE_RATE 64
+#endif
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -74,114 +99,3080 @@ namespace eapis
 namespace intel_x64
 {
 
-/// Base
+/// Read TSC
 ///
-/// Provides an interface for shared features of handlers for the various
-/// exit reasons. New exit reasons may be handled by extending this class
-/// with the relevant exit-reason-specific code.
+/// @return returns the current value of the time stamp counter
 ///
-class EXPORT_EAPIS_HVE base
+inline uint64_t
+read_tsc() noexcept
+{ return __builtin_ia32_rdtsc(); }
+
+/// Exit Latency
+///
+/// A log2 histogram of the number of cycles it took to handle a VM exit.
+/// Bucket i counts the exits that took between 2^i and 2^(i + 1) - 1
+/// cycles (bucket 0 also counts exits that took 0 cycles).
+///
+struct exit_latency_t {
+
+    uint64_t count;                         ///< Number of exits timed
+    uint64_t total;                         ///< Sum of the cycles of every exit
+    uint64_t max;                           ///< Most cycles a single exit took
+    std::array<uint64_t, 64> buckets;       ///< log2 histogram of the cycles
+
+    /// Add
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cycles the number of cycles an exit took to handle
+    ///
+    void add(uint64_t cycles) noexcept
+    {
+        count++;
+        total += cycles;
+        max = std::max(max, cycles);
+
+        buckets[63U - static_cast<uint64_t>(__builtin_clzll(cycles | 1U))]++;
+    }
+};
+
+/// Allocation Counter
+///
+/// A count of the heap allocations made by the VMM, so that the exit path
+/// can be checked for them (see exit_dispatch_table::set_allocs()). The
+/// eapis do not hook the allocator themselves: whatever owns it calls
+/// record() on every allocation (the unit tests do so from a replacement
+/// operator new, see test/support.h, and a debugging build of the VMM
+/// can do the same from its malloc). If nothing calls record(), the count
+/// stays at 0 and no exit is ever seen to allocate.
+///
+/// The count is global, so an exit is charged with the allocations that
+/// other vCPUs make while it is being handled. The numbers are exact with
+/// a single vCPU (and in the unit tests), and are an upper bound
+/// otherwise.
+///
+class alloc_counter
+{
+public:
+
+    /// Record
+    ///
+    /// Called by the allocator for every allocation
+    ///
+    static void record() noexcept
+    { s_count.fetch_add(1, std::memory_order_relaxed); }
+
+    /// Count
+    ///
+    /// @return returns the number of allocations recorded so far
+    ///
+    static uint64_t count() noexcept
+    { return s_count.load(std::memory_order_relaxed); }
+
+private:
+
+    static inline std::atomic<uint64_t> s_count{0};
+};
+
+/// Exit Allocations
+///
+/// The number of heap allocations made while handling the VM exits of a
+/// basic exit reason (see exit_dispatch_table::set_allocs()).
+///
+struct exit_allocs_t {
+
+    uint64_t exits;                         ///< Number of exits tracked
+    uint64_t allocating_exits;              ///< Number of exits that allocated
+    uint64_t allocations;                   ///< Total allocations made
+    uint64_t max;                           ///< Most allocations a single exit made
+
+    /// Add
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param allocations the number of allocations an exit made
+    ///
+    void add(uint64_t allocations) noexcept
+    {
+        exits++;
+        allocating_exits += allocations != 0 ? 1U : 0U;
+
+        this->allocations += allocations;
+        max = std::max(max, allocations);
+    }
+};
+
+/// Exit Counters
+///
+/// A fixed-size table of exit counters indexed by a key (e.g. the MSR,
+/// port or CPUID leaf that caused the exit). The counters are always on
+/// (including release builds) and are cheap enough to be incremented on
+/// every exit: a key is hashed into the table and is found within a few
+/// probes of where it hashes to. If the table is too full to hold a new
+/// key, its exits are counted in other() instead.
+///
+template<std::size_t N = 256>
+class alignas(64) exit_counters
 {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
 
 public:
 
-    /// Default Constructor
+    /// Increment
     ///
     /// @expects
     /// @ensures
     ///
-    base() = default;
+    /// @param key the key to increment the counter of
+    ///
+    void inc(uint64_t key) noexcept
+    {
+        for (auto i = 0U; i < max_probes; i++) {
+            auto &entry = m_entries[slot(key, i)];
 
-    /// Destructor
+            if (entry.count == 0) {
+                entry.key = key;
+            }
+
+            if (entry.key == key) {
+                entry.count++;
+                return;
+            }
+        }
+
+        m_other++;
+    }
+
+    /// Count
     ///
     /// @expects
     /// @ensures
     ///
-    virtual ~base() = default;
+    /// @param key the key to get the counter of
+    /// @return returns the number of times inc(key) has been called
+    ///
+    uint64_t count(uint64_t key) const noexcept
+    {
+        for (auto i = 0U; i < max_probes; i++) {
+            const auto &entry = m_entries[slot(key, i)];
 
-public:
+            if (entry.count == 0) {
+                break;
+            }
 
-    /// Enable Log
+            if (entry.key == key) {
+                return entry.count;
+            }
+        }
+
+        return 0;
+    }
+
+    /// Other
     ///
-    /// Example:
-    /// @code
-    /// this->enable_log();
-    /// @endcode
+    /// @return returns the number of exits that could not be given a
+    ///     counter of their own because the table was full
+    ///
+    uint64_t other() const noexcept
+    { return m_other; }
+
+    /// For Each
+    ///
+    /// Calls func(key, count) for every key that has a counter
     ///
     /// @expects
     /// @ensures
     ///
-    void enable_log()
-    { m_log_enabled = true; }
+    /// @param func the function to call
+    ///
+    template<typename F> void
+    for_each(F func) const
+    {
+        for (const auto &entry : m_entries) {
+            if (entry.count != 0) {
+                func(entry.key, entry.count);
+            }
+        }
+    }
 
-    /// Disable Log
+    /// Clear
     ///
-    /// Example:
-    /// @code
-    /// this->disable_log();
-    /// @endcode
+    /// @expects
+    /// @ensures
+    ///
+    void clear() noexcept
+    {
+        m_entries = {};
+        m_other = 0;
+    }
+
+private:
+
+    static constexpr const auto max_probes = 8U;
+
+    static std::size_t slot(uint64_t key, uint64_t i) noexcept
+    { return static_cast<std::size_t>(((key * 0x9E3779B97F4A7C15ULL) >> 32U) + i) & (N - 1); }
+
+    struct entry_t {
+        uint64_t key;
+        uint64_t count;
+    };
+
+    std::array<entry_t, N> m_entries{};
+    uint64_t m_other{};
+};
+
+/// Log Ring
+///
+/// A fixed-size ring buffer of records. Once the ring is full, each new
+/// record overwrites the oldest one, so the ring always holds the last N
+/// records that were added. The storage is part of the ring itself, so
+/// adding a record never allocates.
+///
+/// The ring supports a single producer (the vCPU that owns the handler)
+/// and a single consumer (e.g. a vmcall draining the log), without locks.
+/// The producer never waits. If the producer overwrites records while the
+/// consumer is copying them, the consumer throws away the records that it
+/// cannot trust.
+///
+template<typename T, std::size_t N = EAPIS_LOG_MAX>
+class log_ring
+{
+    static_assert(N > 0, "log_ring cannot be empty");
+
+public:
+
+    /// Iterator
+    ///
+    /// Visits the records in the ring from oldest to newest. Only the
+    /// producer should iterate over the ring (e.g. in dump_log()).
+    ///
+    class const_iterator
+    {
+    public:
+
+        /// @cond
+
+        const_iterator(const log_ring *ring, uint64_t i) noexcept :
+            m_ring{ring},
+            m_i{i}
+        { }
+
+        const T &operator*() const
+        { return m_ring->m_records[m_i % N]; }
+
+        const_iterator &operator++() noexcept
+        {
+            ++m_i;
+            return *this;
+        }
+
+        bool operator!=(const const_iterator &other) const noexcept
+        { return m_i != other.m_i; }
+
+        /// @endcond
+
+    private:
+
+        const log_ring *m_ring;
+        uint64_t m_i;
+    };
+
+    /// Default Constructor
     ///
     /// @expects
     /// @ensures
     ///
-    void disable_log()
-    { m_log_enabled = true; }
+    log_ring() = default;
 
-    /// Dump Log
+    /// Push
     ///
-    /// Example:
-    /// @code
-    /// this->dump_log();
-    /// @endcode
+    /// Adds a record to the ring, overwriting the oldest record when the
+    /// ring is full.
     ///
     /// @expects
     /// @ensures
     ///
-    virtual void dump_log() = 0;
+    /// @param record the record to add
+    ///
+    void push(const T &record) noexcept
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
 
-    /// Add Record to Log
+        m_claim.store(head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        m_records[head % N] = record;
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    /// Drain
     ///
-    /// Example:
-    /// @code
-    /// this->add_record();
-    /// @endcode
+    /// Copies the oldest records that have not already been drained into
+    /// the provided buffer, oldest first, and removes them from the ring.
+    /// Records that were overwritten before they could be drained are
+    /// lost.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param log The log to add a record to
-    /// @param record The record to add to the log
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
     ///
-    template<typename T> void
-    add_record(std::list<T> &log, const T &record)
+    std::size_t drain(gsl::span<T> records) noexcept
     {
-        if (log.size() < EAPIS_LOG_MAX) {
-            log.push_back(record);
+        auto head = m_head.load(std::memory_order_acquire);
+        auto tail = std::max(m_tail.load(std::memory_order_relaxed), first(head));
+
+        auto num = std::min<uint64_t>(head - tail, static_cast<uint64_t>(records.size()));
+        for (auto i = 0ULL; i < num; i++) {
+            records[static_cast<std::ptrdiff_t>(i)] = m_records[(tail + i) % N];
+        }
+
+        // Any record that the producer overwrote (or is overwriting) while
+        // it was being copied might be torn, so those records are dropped
+        // and the copies that remain are shifted to the front of the buffer.
+        //
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto unsafe = first(m_claim.load(std::memory_order_relaxed));
+        auto lost = unsafe > tail ? std::min(unsafe - tail, num) : 0;
+
+        for (auto i = lost; i < num; i++) {
+            records[static_cast<std::ptrdiff_t>(i - lost)] = records[static_cast<std::ptrdiff_t>(i)];
         }
+
+        m_tail.store(tail + num, std::memory_order_relaxed);
+        return static_cast<std::size_t>(num - lost);
     }
 
-protected:
+    /// Clear
+    ///
+    /// Removes every record from the ring.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear() noexcept
+    { m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_relaxed); }
 
-    /// Log enabled
+    /// Begin
     ///
-    /// If true, *each* class derived from base will log exit-reason-specific
-    /// information on exit (provided also that NDEBUG == 0).
-    //
-    bool m_log_enabled{false};
+    /// @return returns an iterator to the oldest record in the ring
+    ///
+    const_iterator begin() const noexcept
+    {
+        auto head = m_head.load(std::memory_order_acquire);
+        return {this, std::max(m_tail.load(std::memory_order_relaxed), first(head))};
+    }
+
+    /// End
+    ///
+    /// @return returns an iterator to one past the newest record in the ring
+    ///
+    const_iterator end() const noexcept
+    { return {this, m_head.load(std::memory_order_acquire)}; }
+
+    /// Size
+    ///
+    /// @return returns the number of records in the ring
+    ///
+    std::size_t size() const noexcept
+    {
+        auto head = m_head.load(std::memory_order_acquire);
+        return static_cast<std::size_t>(head - std::max(m_tail.load(std::memory_order_relaxed), first(head)));
+    }
+
+    /// Capacity
+    ///
+    /// @return returns the maximum number of records the ring can hold
+    ///
+    static constexpr std::size_t capacity() noexcept
+    { return N; }
+
+    /// Dropped
+    ///
+    /// @return returns the number of records that were overwritten before
+    ///     they could be drained
+    ///
+    uint64_t dropped() const noexcept
+    {
+        auto head = m_head.load(std::memory_order_acquire);
+        auto tail = m_tail.load(std::memory_order_relaxed);
+
+        return first(head) > tail ? first(head) - tail : 0;
+    }
+
+private:
+
+    static uint64_t first(uint64_t head) noexcept
+    { return head > N ? head - N : 0; }
+
+    std::array<T, N> m_records{};
+
+    std::atomic<uint64_t> m_head{0};
+    std::atomic<uint64_t> m_claim{0};
+    std::atomic<uint64_t> m_tail{0};
 
 public:
 
     /// @cond
 
-    base(base &&) = default;
-    base &operator=(base &&) = default;
+    log_ring(log_ring &&other) noexcept :
+        m_records{other.m_records},
+        m_head{other.m_head.load()},
+        m_claim{other.m_claim.load()},
+        m_tail{other.m_tail.load()}
+    { }
 
-    base(const base &) = delete;
-    base &operator=(const base &) = delete;
+    log_ring &operator=(log_ring &&other) noexcept
+    {
+        m_records = other.m_records;
+        m_head = other.m_head.load();
+        m_claim = other.m_claim.load();
+        m_tail = other.m_tail.load();
+
+        return *this;
+    }
+
+    log_ring(const log_ring &) = delete;
+    log_ring &operator=(const log_ring &) = delete;
 
     /// @endcond
 };
 
+/// VMCS Field Cache
+///
+/// Caches the VMCS fields that are read during a single exit, so each
+/// field costs one VMREAD no matter how many handlers read it, and buffers
+/// the VMCS fields that are written, so each field costs one VMWRITE no
+/// matter how many times it is written. The cache is owned by a vCPU's
+/// apis and is bracketed around every exit by the exit dispatch table:
+/// begin_exit() drops whatever was cached during the last exit, and
+/// end_exit() writes the buffered fields back before the VM entry.
+///
+/// Outside of an exit (i.e. before begin_exit() or after end_exit()),
+/// read() and write() go straight to the VMCS, so a handler that is
+/// enabled or configured from the vCPU's constructor, or from code that
+/// runs between exits, never has its writes buffered.
+///
+/// During an exit, the cache is only coherent with the VMCS if a field is
+/// always accessed through the cache (see base::vmread()). Code that
+/// writes a field directly to the VMCS during an exit must call release()
+/// for that field first, so a buffered write is not lost (e.g. by a direct
+/// read-modify-write), and the direct write is neither overwritten by a
+/// buffered write nor hidden by a cached read.
+///
+template<std::size_t N = 16>
+class vmcs_field_cache
+{
+    static_assert(N > 0 && N <= 64, "N must be between 1 and 64");
+
+public:
+
+    /// Read
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to read
+    /// @return returns the field's value, reading it from the VMCS only if
+    ///     it has not been read or written during this exit
+    ///
+    uint64_t read(vmcs_n::field_type field)
+    {
+        if (GSL_UNLIKELY(!m_active)) {
+            return ::intel_x64::vm::read(field);
+        }
+
+        m_reads++;
+
+        auto i = this->find(field);
+        if (GSL_LIKELY(i < m_num)) {
+            return m_vals[i];
+        }
+
+        m_vmreads++;
+        auto val = ::intel_x64::vm::read(field);
+
+        if (m_num < N) {
+            m_fields[m_num] = field;
+            m_vals[m_num++] = val;
+        }
+
+        return val;
+    }
+
+    /// Write
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to write
+    /// @param val the value to write. During an exit, the field is written
+    ///     to the VMCS when flush() is called, otherwise it is written
+    ///     immediately.
+    ///
+    void write(vmcs_n::field_type field, uint64_t val)
+    {
+        if (GSL_UNLIKELY(!m_active)) {
+            ::intel_x64::vm::write(field, val);
+            return;
+        }
+
+        m_writes++;
+
+        auto i = this->find(field);
+        if (i == m_num) {
+            if (m_num == N) {
+                this->flush();
+
+                m_vmwrites++;
+                ::intel_x64::vm::write(field, val);
+
+                return;
+            }
+
+            m_fields[m_num++] = field;
+        }
+
+        m_vals[i] = val;
+        m_dirty |= 1ULL << i;
+    }
+
+    /// Flush
+    ///
+    /// Writes every field that has been written since the last flush to
+    /// the VMCS. The fields stay cached.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void flush()
+    {
+        while (m_dirty != 0) {
+            auto i = static_cast<std::size_t>(__builtin_ctzll(m_dirty));
+
+            m_vmwrites++;
+            ::intel_x64::vm::write(m_fields[i], m_vals[i]);
+
+            m_dirty &= m_dirty - 1U;
+        }
+    }
+
+    /// Release
+    ///
+    /// Writes a field to the VMCS if it has been written since the last
+    /// flush, and then forgets it. This must be called before a field is
+    /// written directly to the VMCS during an exit, so that the direct
+    /// write starts from the field's latest value, the next read() returns
+    /// the value that was written, and flush() does not overwrite it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field that will be written
+    ///
+    void release(vmcs_n::field_type field)
+    {
+        auto i = this->find(field);
+        if (i == m_num) {
+            return;
+        }
+
+        if (((m_dirty >> i) & 1U) != 0) {
+            m_vmwrites++;
+            ::intel_x64::vm::write(m_fields[i], m_vals[i]);
+        }
+
+        this->drop(field);
+    }
+
+    /// Drop
+    ///
+    /// Forgets a field, including a write to it that was not flushed. Use
+    /// release() instead, unless the buffered write is meant to be thrown
+    /// away.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field that was written
+    ///
+    void drop(vmcs_n::field_type field) noexcept
+    {
+        auto i = this->find(field);
+        if (i == m_num) {
+            return;
+        }
+
+        // The last field takes the dropped field's slot, so the cached
+        // fields stay packed at the front of the arrays
+        //
+
+        auto last = --m_num;
+        auto dirty = (m_dirty >> last) & 1U;
+
+        m_dirty &= ~((1ULL << i) | (1ULL << last));
+
+        if (i != last) {
+            m_fields[i] = m_fields[last];
+            m_vals[i] = m_vals[last];
+            m_dirty |= dirty << i;
+        }
+    }
+
+    /// Begin Exit
+    ///
+    /// Drops every cached field, and starts caching reads and buffering
+    /// writes until end_exit() or abort_exit() is called
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void begin_exit() noexcept
+    {
+        m_num = 0;
+        m_dirty = 0;
+        m_active = true;
+        m_exits++;
+    }
+
+    /// End Exit
+    ///
+    /// Writes the buffered fields back to the VMCS, after which reads and
+    /// writes go straight to the VMCS again
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void end_exit()
+    {
+        this->flush();
+        this->abort_exit();
+    }
+
+    /// Abort Exit
+    ///
+    /// Drops every cached field, including writes that were not flushed
+    /// (e.g. because a handler threw), after which reads and writes go
+    /// straight to the VMCS again
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void abort_exit() noexcept
+    {
+        m_num = 0;
+        m_dirty = 0;
+        m_active = false;
+    }
+
+    /// Active
+    ///
+    /// @return returns true between begin_exit() and end_exit()
+    ///
+    bool active() const noexcept
+    { return m_active; }
+
+    /// Reads
+    ///
+    /// @return returns the number of calls to read()
+    ///
+    uint64_t reads() const noexcept
+    { return m_reads; }
+
+    /// VMREADs
+    ///
+    /// @return returns the number of VMREADs read() has performed
+    ///
+    uint64_t vmreads() const noexcept
+    { return m_vmreads; }
+
+    /// Writes
+    ///
+    /// @return returns the number of calls to write()
+    ///
+    uint64_t writes() const noexcept
+    { return m_writes; }
+
+    /// VMWRITEs
+    ///
+    /// @return returns the number of VMWRITEs the cache has performed
+    ///
+    uint64_t vmwrites() const noexcept
+    { return m_vmwrites; }
+
+    /// Exits
+    ///
+    /// @return returns the number of exits the cache has been used for.
+    ///     vmreads() / exits() is the average number of VMREADs per exit.
+    ///
+    uint64_t exits() const noexcept
+    { return m_exits; }
+
+    /// Clear Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear_stats() noexcept
+    {
+        m_reads = 0;
+        m_vmreads = 0;
+        m_writes = 0;
+        m_vmwrites = 0;
+        m_exits = 0;
+    }
+
+private:
+
+    std::size_t find(vmcs_n::field_type field) const noexcept
+    {
+        for (std::size_t i = 0; i < m_num; i++) {
+            if (m_fields[i] == field) {
+                return i;
+            }
+        }
+
+        return m_num;
+    }
+
+    std::size_t m_num{0};
+    uint64_t m_dirty{0};
+    bool m_active{false};
+
+    std::array<vmcs_n::field_type, N> m_fields{};
+    std::array<uint64_t, N> m_vals{};
+
+    uint64_t m_reads{0};
+    uint64_t m_vmreads{0};
+    uint64_t m_writes{0};
+    uint64_t m_vmwrites{0};
+    uint64_t m_exits{0};
+};
+
+/// Coalesced Write
+///
+/// A guest write to a port or MMIO register that was buffered by a
+/// coalesced_ring instead of being emulated when it exited
+///
+struct coalesced_write_t {
+    uint64_t addr;      ///< The port number, or the GPA for MMIO
+    uint64_t val;       ///< The value the guest wrote
+    uint32_t size;      ///< The size of the write in bytes
+    uint32_t mmio;      ///< 1 if addr is a GPA, 0 if it is a port
+};
+
+/// Coalesced Ring
+///
+/// Buffers the writes to write-only device registers (e.g. a debug port,
+/// a UART's transmit register or a doorbell) whose emulation the guest
+/// does not wait on. A write that exits is appended to the ring and the
+/// guest is resumed right away. The writes are handed to the flush
+/// handler, oldest first and in one batch, when the ring fills up, when
+/// flush() is called (e.g. from a timer or a vmcall), or before an
+/// access to a coalesced register that cannot be buffered (e.g. a read),
+/// so that the device always sees the writes in the order the guest made
+/// them. The storage is part of the ring, so a write never allocates.
+///
+/// The ring is owned by a single vCPU and is not thread safe.
+///
+template<std::size_t N = 256>
+class coalesced_ring
+{
+public:
+
+    /// Flush delegate type
+    ///
+    using flush_delegate_t = ::delegate<void(gsl::span<const coalesced_write_t>)>;
+
+    /// Set Flush Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate that emulates a batch of writes
+    ///
+    void set_flush_handler(const flush_delegate_t &d) noexcept
+    {
+        m_flush = d;
+        m_has_flush = true;
+    }
+
+    /// Has Flush Handler
+    ///
+    /// @return returns true if set_flush_handler() has been called
+    ///
+    bool has_flush_handler() const noexcept
+    { return m_has_flush; }
+
+    /// Push
+    ///
+    /// Appends a write to the ring, flushing the ring first if it is full
+    ///
+    /// @expects has_flush_handler()
+    /// @ensures
+    ///
+    /// @param write the write to append
+    ///
+    void push(const coalesced_write_t &write)
+    {
+        if (GSL_UNLIKELY(m_num == N)) {
+            this->flush();
+        }
+
+        m_writes[m_num++] = write;
+        m_pushes++;
+    }
+
+    /// Flush
+    ///
+    /// Hands every buffered write to the flush handler and empties the
+    /// ring. Does nothing if the ring is empty.
+    ///
+    /// @expects
+    /// @ensures size() == 0
+    ///
+    void flush()
+    {
+        if (m_num == 0) {
+            return;
+        }
+
+        auto num = m_num;
+        m_num = 0;
+
+        if (GSL_UNLIKELY(!m_has_flush)) {
+            return;
+        }
+
+        m_flushes++;
+        m_flush(gsl::make_span(m_writes.data(), static_cast<std::ptrdiff_t>(num)));
+    }
+
+    /// Size
+    ///
+    /// @return returns the number of writes waiting to be flushed
+    ///
+    std::size_t size() const noexcept
+    { return m_num; }
+
+    /// Capacity
+    ///
+    /// @return returns the number of writes the ring holds before it is
+    ///     flushed
+    ///
+    static constexpr std::size_t capacity() noexcept
+    { return N; }
+
+    /// Pushes
+    ///
+    /// @return returns the number of writes that have been buffered
+    ///
+    uint64_t pushes() const noexcept
+    { return m_pushes; }
+
+    /// Flushes
+    ///
+    /// @return returns the number of batches handed to the flush handler.
+    ///     pushes() / flushes() is the number of exits each emulation of
+    ///     the device was amortized over.
+    ///
+    uint64_t flushes() const noexcept
+    { return m_flushes; }
+
+private:
+
+    flush_delegate_t m_flush{};
+    bool m_has_flush{false};
+
+    std::size_t m_num{0};
+    std::array<coalesced_write_t, N> m_writes{};
+
+    uint64_t m_pushes{0};
+    uint64_t m_flushes{0};
+};
+
+/// Memory Usage
+///
+/// The VMM memory used by a vCPU's eapis, in bytes (see
+/// apis::memory_usage()). Pages are counted in full. Heap containers are
+/// estimated from their size and capacity (see heap_bytes()), as the
+/// allocator's own overhead cannot be seen from here. Memory that can be
+/// shared with other vCPUs (e.g. an EPT map) is reported by every vCPU
+/// that uses it, so it must not be multiplied by the number of vCPUs.
+///
+struct memory_usage_t {
+
+    uint64_t bitmaps;                       ///< MSR / IO bitmaps owned by this vCPU
+    uint64_t shared_bitmaps;                ///< Bitmaps of a policy shared with other vCPUs
+    std::array<uint64_t, 4> ept_tables;     ///< EPT tables by level (0 = PT, ..., 3 = PML4)
+    uint64_t ept_other;                     ///< Unused EPT pool pages, SPP tables, EPTP list and #VE pages
+    uint64_t handlers;                      ///< Handler objects, and their maps and lists
+    uint64_t logs;                          ///< Exit logs
+    uint64_t telemetry;                     ///< Exit latency, profiler and export
+
+    /// Total
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the sum of every field
+    ///
+    uint64_t total() const noexcept
+    {
+        auto ept = ept_other;
+        for (const auto bytes : ept_tables) {
+            ept += bytes;
+        }
+
+        return bitmaps + shared_bitmaps + ept + handlers + logs + telemetry;
+    }
+};
+
+/// Heap Bytes (vector)
+///
+/// @expects
+/// @ensures
+///
+/// @param v the vector to account for
+/// @return the number of bytes allocated by v (not including the
+///     vector itself, or anything its elements allocate)
+///
+template<typename T, typename A>
+inline uint64_t
+heap_bytes(const std::vector<T, A> &v) noexcept
+{ return v.capacity() * sizeof(T); }
+
+/// Heap Bytes (unordered map)
+///
+/// Estimated as one node per element (the element, the pointer to the
+/// next node, and the cached hash), plus the bucket array.
+///
+/// @expects
+/// @ensures
+///
+/// @param m the map to account for
+/// @return the estimated number of bytes allocated by m (not including
+///     the map itself, or anything its elements allocate)
+///
+template<typename K, typename V, typename H, typename E, typename A>
+inline uint64_t
+heap_bytes(const std::unordered_map<K, V, H, E, A> &m) noexcept
+{
+    using value_type = typename std::unordered_map<K, V, H, E, A>::value_type;
+
+    return (m.size() * (sizeof(value_type) + sizeof(void *) + sizeof(std::size_t))) +
+           (m.bucket_count() * sizeof(void *));
+}
+
+/// Doorbell Bitmap
+///
+/// A bitmap of pending notifications (e.g. one bit per virtqueue), in the
+/// spirit of an eventfd. A trapped write to a doorbell port or MMIO
+/// register that matches a doorbell_table entry only sets the entry's bit
+/// and resumes the guest; the device model (on this or any other core)
+/// collects the pending bits with drain() and does the actual work. The
+/// optional wake handler is called when a bit goes from clear to set, so
+/// a consumer that is woken up once sees every bit rung until it drains.
+///
+/// The bits can be set by the vCPU that owns the bitmap while another
+/// core drains them, without locks.
+///
+template<std::size_t N = 256>
+class doorbell_bitmap
+{
+    static_assert(N % 64 == 0, "doorbell_bitmap: N must be a multiple of 64");
+
+public:
+
+    /// Wake delegate type
+    ///
+    using wake_delegate_t = ::delegate<void(uint64_t)>;
+
+    /// Size
+    ///
+    /// @return returns the number of doorbells in the bitmap
+    ///
+    static constexpr std::size_t size() noexcept
+    { return N; }
+
+    /// Set Wake Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call with the bit that was rung when a
+    ///     doorbell goes from clear to set
+    ///
+    void set_wake_handler(const wake_delegate_t &d) noexcept
+    {
+        m_wake = d;
+        m_has_wake = true;
+    }
+
+    /// Ring
+    ///
+    /// @expects bit < size()
+    /// @ensures
+    ///
+    /// @param bit the doorbell to ring
+    /// @return returns true if the doorbell was not already pending
+    ///
+    bool ring(uint64_t bit)
+    {
+        auto mask = 1ULL << (bit & 63U);
+        auto old = m_bits[bit >> 6U].fetch_or(mask, std::memory_order_release);
+
+        m_rings++;
+
+        if ((old & mask) != 0) {
+            return false;
+        }
+
+        if (m_has_wake) {
+            m_wakes++;
+            m_wake(bit);
+        }
+
+        return true;
+    }
+
+    /// Is Pending
+    ///
+    /// @expects bit < size()
+    /// @ensures
+    ///
+    /// @param bit the doorbell to check
+    /// @return returns true if the doorbell has been rung, but not drained
+    ///
+    bool is_pending(uint64_t bit) const noexcept
+    { return (m_bits[bit >> 6U].load(std::memory_order_acquire) & (1ULL << (bit & 63U))) != 0; }
+
+    /// Drain
+    ///
+    /// Clears every pending doorbell, calling func(bit) for each one
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param func the function to call for each pending doorbell
+    /// @return returns the number of doorbells that were pending
+    ///
+    template<typename F>
+    std::size_t drain(F func)
+    {
+        std::size_t num = 0;
+
+        for (auto i = 0U; i < m_bits.size(); i++) {
+            auto bits = m_bits[i].exchange(0, std::memory_order_acquire);
+
+            while (bits != 0) {
+                auto b = static_cast<uint64_t>(__builtin_ctzll(bits));
+                bits &= bits - 1U;
+
+                func((i * 64U) + b);
+                num++;
+            }
+        }
+
+        return num;
+    }
+
+    /// Rings
+    ///
+    /// @return returns the number of times a doorbell has been rung
+    ///
+    uint64_t rings() const noexcept
+    { return m_rings; }
+
+    /// Wakes
+    ///
+    /// @return returns the number of times the wake handler was called.
+    ///     rings() - wakes() is the number of notifications that were
+    ///     merged into one that was already pending.
+    ///
+    uint64_t wakes() const noexcept
+    { return m_wakes; }
+
+private:
+
+    std::array<std::atomic<uint64_t>, N / 64> m_bits{};
+
+    wake_delegate_t m_wake{};
+    bool m_has_wake{false};
+
+    uint64_t m_rings{0};
+    uint64_t m_wakes{0};
+};
+
+/// Doorbell Table
+///
+/// Maps (address, value) pairs to the doorbell_bitmap bits they ring,
+/// where the address is a port or a GPA. An entry added with any_value
+/// matches every value written to its address. The entries are kept
+/// sorted, so a lookup is a binary search.
+///
+class doorbell_table
+{
+public:
+
+    /// Any Value
+    ///
+    static constexpr const uint64_t any_value = ~0ULL;
+
+    /// Add
+    ///
+    /// @expects bit < the size of the doorbell_bitmap being rung
+    /// @ensures
+    ///
+    /// @param addr the port or GPA of the doorbell register
+    /// @param val the value that rings the doorbell, or any_value
+    /// @param bit the bit in the doorbell_bitmap to set
+    ///
+    void add(uint64_t addr, uint64_t val, uint64_t bit)
+    {
+        auto iter = std::lower_bound(m_entries.begin(), m_entries.end(), entry_t{addr, val, 0});
+
+        if (iter != m_entries.end() && iter->addr == addr && iter->val == val) {
+            iter->bit = bit;
+            return;
+        }
+
+        m_entries.insert(iter, {addr, val, bit});
+    }
+
+    /// Contains
+    ///
+    /// @param addr the port or GPA to look up
+    /// @return returns true if addr has at least one doorbell
+    ///
+    bool contains(uint64_t addr) const noexcept
+    {
+        auto iter = std::lower_bound(m_entries.begin(), m_entries.end(), entry_t{addr, 0, 0});
+        return iter != m_entries.end() && iter->addr == addr;
+    }
+
+    /// Find
+    ///
+    /// @param addr the port or GPA that was written
+    /// @param val the value that was written
+    /// @param bit set to the bit to ring if a doorbell matches
+    /// @return returns true if a doorbell matches (addr, val)
+    ///
+    bool find(uint64_t addr, uint64_t val, uint64_t &bit) const noexcept
+    {
+        if (this->find_exact(addr, val, bit)) {
+            return true;
+        }
+
+        return val != any_value && this->find_exact(addr, any_value, bit);
+    }
+
+    /// Empty
+    ///
+    /// @return returns true if the table has no doorbells
+    ///
+    bool empty() const noexcept
+    { return m_entries.empty(); }
+
+    /// Heap Bytes
+    ///
+    /// @return returns an estimate of the heap memory used by the table
+    ///
+    uint64_t heap_bytes() const noexcept
+    { return eapis::intel_x64::heap_bytes(m_entries); }
+
+private:
+
+    struct entry_t {
+        uint64_t addr;
+        uint64_t val;
+        uint64_t bit;
+
+        bool operator<(const entry_t &other) const noexcept
+        { return addr != other.addr ? addr < other.addr : val < other.val; }
+    };
+
+    bool find_exact(uint64_t addr, uint64_t val, uint64_t &bit) const noexcept
+    {
+        auto iter = std::lower_bound(m_entries.begin(), m_entries.end(), entry_t{addr, val, 0});
+
+        if (iter == m_entries.end() || iter->addr != addr || iter->val != val) {
+            return false;
+        }
+
+        bit = iter->bit;
+        return true;
+    }
+
+    std::vector<entry_t> m_entries;
+};
+
+/// Unhandled Policy
+///
+/// What a handler does with an exit that none of its delegates handled
+/// (see base::unhandled())
+///
+enum class unhandled_policy {
+
+    /// Throw a std::runtime_error, leaving the base hypervisor to deal with
+    /// the exit (the default)
+    ///
+    raise,
+
+    /// Stop running the vCPU by putting it in the shutdown activity state
+    /// (until it is sent an INIT)
+    ///
+    halt,
+
+    /// Inject a #GP(0) into the guest without advancing its instruction
+    /// pointer
+    ///
+    inject_gp,
+
+    /// Report the exit as unhandled (i.e. return false), so the next
+    /// delegate registered for the exit reason (or the base hypervisor)
+    /// gets a chance to handle it
+    ///
+    forward
+};
+
+/// Exit Error
+///
+/// Why a handler could not handle an exit
+///
+enum class exit_error {
+    none,                   ///< No error
+    unhandled_read,         ///< No delegate handled a read (e.g. EPT or IO)
+    unhandled_write,        ///< No delegate handled a write
+    unhandled_execute,      ///< No delegate handled an instruction fetch
+    unhandled_exit,         ///< No delegate handled the exit
+    unsupported             ///< The exit cannot be emulated
+};
+
+/// Base
+///
+/// Provides an interface for shared features of handlers for the various
+/// exit reasons. New exit reasons may be handled by extending this class
+/// with the relevant exit-reason-specific code.
+///
+class EXPORT_EAPIS_HVE base
+{
+
+public:
+
+    /// Default Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    base() = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    virtual ~base() = default;
+
+public:
+
+    /// Enable Log
+    ///
+    /// Example:
+    /// @code
+    /// this->enable_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_log()
+    { m_log_enabled = true; }
+
+    /// Disable Log
+    ///
+    /// Example:
+    /// @code
+    /// this->disable_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_log()
+    { m_log_enabled = false; }
+
+    /// Enable Stats
+    ///
+    /// Turns on stats mode: the counters that are only kept for the log
+    /// (e.g. per-vector interrupt counts) are kept, and a sample of the
+    /// exits is added to the log. Unlike the log, stats mode is available
+    /// in release builds, but only if EAPIS_STATS is set to 1, otherwise
+    /// this has no effect and stats mode compiles away.
+    ///
+    /// Example:
+    /// @code
+    /// this->enable_stats();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_stats()
+    { m_stats_enabled = true; }
+
+    /// Disable Stats
+    ///
+    /// Example:
+    /// @code
+    /// this->disable_stats();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_stats()
+    { m_stats_enabled = false; }
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    virtual void dump_log() = 0;
+
+    /// Memory Usage
+    ///
+    /// Adds the memory this handler allocates (e.g. the maps and lists
+    /// that hold its delegates) to usage.handlers, and the size of its
+    /// logs to usage.logs. The handler object itself is counted by its
+    /// owner (see apis::memory_usage()), and the logs live inside of it,
+    /// so the owner moves their size out of usage.handlers.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage
+    ///
+    virtual void memory_usage(memory_usage_t &usage) const
+    { bfignored(usage); }
+
+    /// Add Record to Log
+    ///
+    /// Example:
+    /// @code
+    /// this->add_record();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param log The log to add a record to
+    /// @param record The record to add to the log
+    ///
+    template<typename T, std::size_t N> void
+    add_record(log_ring<T, N> &log, const T &record) noexcept
+    { log.push(record); }
+
+    /// Stats Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the handler was built with EAPIS_STATS set
+    ///     to 1, and stats have been enabled
+    ///
+    bool stats_enabled() const noexcept
+    { return EAPIS_STATS != 0 && m_stats_enabled; }
+
+    /// Set Unhandled Policy
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param policy what to do with exits that no delegate handles
+    ///
+    void set_unhandled_policy(unhandled_policy policy) noexcept
+    { m_unhandled_policy = policy; }
+
+    /// Last Error
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the reason the last exit that was not handled was
+    ///     not handled, or exit_error::none
+    ///
+    exit_error last_error() const noexcept
+    { return m_last_error; }
+
+    /// Number of Errors
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of exits that were not handled
+    ///
+    uint64_t num_errors() const noexcept
+    { return m_num_errors; }
+
+    /// Unhandled
+    ///
+    /// Records err and applies the unhandled policy. Unless the policy is
+    /// unhandled_policy::raise, this cannot throw, so a handler that ends
+    /// with "return this->unhandled(...)" never unwinds on its exit path.
+    ///
+    /// Example:
+    /// @code
+    /// return this->unhandled(exit_error::unhandled_read, "unhandled read");
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param err the reason the exit was not handled
+    /// @param what the message to raise with (unhandled_policy::raise only)
+    /// @return returns the value the handler should return
+    ///
+    bool unhandled(exit_error err, const char *what)
+    {
+        m_last_error = err;
+        m_num_errors++;
+
+        switch (m_unhandled_policy) {
+            case unhandled_policy::halt:
+                vmcs_n::guest_activity_state::set(vmcs_n::guest_activity_state::shutdown);
+                return true;
+
+            case unhandled_policy::inject_gp:
+                inject_gp();
+                return true;
+
+            case unhandled_policy::forward:
+                return false;
+
+            default:
+                throw std::runtime_error(what);
+        }
+    }
+
+    /// Set VMCS Cache
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cache the vCPU's VMCS field cache, which vmread() and
+    ///     vmwrite() go through. If nullptr, they access the VMCS directly.
+    ///
+    void set_vmcs_cache(vmcs_field_cache<> *cache) noexcept
+    { m_vmcs_cache = cache; }
+
+    /// VMREAD
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to read
+    /// @return returns the value of the field
+    ///
+    uint64_t vmread(vmcs_n::field_type field)
+    {
+        if (m_vmcs_cache != nullptr) {
+            return m_vmcs_cache->read(field);
+        }
+
+        return ::intel_x64::vm::read(field);
+    }
+
+    /// VMWRITE
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to write
+    /// @param val the value to write
+    ///
+    void vmwrite(vmcs_n::field_type field, uint64_t val)
+    {
+        if (m_vmcs_cache != nullptr) {
+            m_vmcs_cache->write(field, val);
+        }
+        else {
+            ::intel_x64::vm::write(field, val);
+        }
+    }
+
+    /// Set VMCS Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to modify
+    /// @param mask the bits to set, using vmread() and vmwrite()
+    ///
+    void vmset_bits(vmcs_n::field_type field, uint64_t mask)
+    { this->vmwrite(field, this->vmread(field) | mask); }
+
+    /// Clear VMCS Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to modify
+    /// @param mask the bits to clear, using vmread() and vmwrite()
+    ///
+    void vmclear_bits(vmcs_n::field_type field, uint64_t mask)
+    { this->vmwrite(field, this->vmread(field) & ~mask); }
+
+    /// Record Exit
+    ///
+    /// Example:
+    /// @code
+    /// if (this->record_exit()) {
+    ///     this->add_record(m_log, {...});
+    /// }
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the current exit should be added to the log,
+    ///     which is every exit while the log is enabled (debug builds only),
+    ///     or a sample of the exits while stats are enabled
+    ///
+    bool record_exit() noexcept
+    {
+        if (!ndebug && m_log_enabled) {
+            return true;
+        }
+
+        if (!stats_enabled()) {
+            return false;
+        }
+
+        return ++m_num_sampled % EAPIS_STATS_SAMPLE_RATE == 0;
+    }
+
+protected:
+
+    /// Log enabled
+    ///
+    /// If true, *each* class derived from base will log exit-reason-specific
+    /// information on exit (provided also that NDEBUG == 0).
+    //
+    bool m_log_enabled{false};
+
+    /// Stats enabled
+    ///
+    /// If true (and EAPIS_STATS == 1), the class keeps its counters and a
+    /// sample of its exits, even in release builds
+    //
+    bool m_stats_enabled{false};
+
+private:
+
+    static void inject_gp()
+    {
+        using namespace vmcs_n::vm_entry_interruption_information;
+
+        uint64_t info = 0;
+
+        vector::set(info, 13);
+        interruption_type::set(info, interruption_type::hardware_exception);
+        deliver_error_code_bit::enable(info);
+        valid_bit::enable(info);
+
+        vmcs_n::vm_entry_exception_error_code::set(0);
+        vmcs_n::vm_entry_interruption_information::set(info);
+    }
+
+    uint64_t m_num_sampled{0};
+    vmcs_field_cache<> *m_vmcs_cache{nullptr};
+
+    unhandled_policy m_unhandled_policy{unhandled_policy::raise};
+    exit_error m_last_error{exit_error::none};
+    uint64_t m_num_errors{0};
+
+public:
+
+    /// @cond
+
+    base(base &&) = default;
+    base &operator=(base &&) = default;
+
+    base(const base &) = delete;
+    base &operator=(const base &) = delete;
+
+    /// @endcond
+};
+
+/// Adaptive Dispatch
+///
+/// Turns adaptive reordering of delegate chains on or off (see
+/// delegate_chain::dispatch()). When enabled, each chain counts how often
+/// each of its delegates accepts an exit, and every period() accepted
+/// exits it reorders the delegates that share a priority so that the ones
+/// that accept most often are tried first. Priorities are never crossed,
+/// so a delegate that needs to see exits before (or after) the others
+/// keeps doing so by being given a higher (or lower) priority.
+///
+/// Reordering only makes sense for delegates of the same priority that
+/// accept disjoint sets of exits (the common case, e.g. handlers that
+/// each check for their own vector, port or leaf), since a different
+/// delegate could otherwise end up accepting an exit first.
+///
+/// The setting is global (it applies to every chain, on every vCPU),
+/// while the counts are kept by each chain. It is disabled by default.
+///
+class adaptive_dispatch
+{
+public:
+
+    /// Default Period
+    ///
+    static constexpr const uint64_t default_period = 1024;
+
+    /// Enable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param period the number of exits a chain accepts between two
+    ///     reorders. 0 disables adaptive reordering.
+    ///
+    static void enable(uint64_t period = default_period) noexcept
+    { s_period.store(period, std::memory_order_relaxed); }
+
+    /// Disable
+    ///
+    /// Chains keep their current order, and stop counting.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    static void disable() noexcept
+    { s_period.store(0, std::memory_order_relaxed); }
+
+    /// Period
+    ///
+    /// @return returns the number of exits a chain accepts between two
+    ///     reorders, or 0 if adaptive reordering is disabled
+    ///
+    static uint64_t period() noexcept
+    { return s_period.load(std::memory_order_relaxed); }
+
+private:
+
+    static inline std::atomic<uint64_t> s_period{0};
+};
+
+/// Delegate Chain
+///
+/// A list of delegates that is optimized for being walked on every exit.
+/// The first N delegates are stored inline, so small chains (the common
+/// case) live entirely inside the object that owns them, and larger chains
+/// only spill the remaining delegates into a single contiguous vector.
+///
+/// Delegates are visited in order of priority (highest first). Delegates
+/// with the same priority are visited in the reverse order they are added
+/// (i.e. like std::list::push_front), which is the order every handler has
+/// always used, unless adaptive reordering is enabled (see
+/// adaptive_dispatch), in which case they are visited in order of how
+/// often they accepted recent exits.
+///
+template<typename D, std::size_t N = 4>
+class delegate_chain
+{
+public:
+
+    /// Iterator
+    ///
+    class const_iterator
+    {
+    public:
+
+        /// @cond
+
+        const_iterator(const delegate_chain *chain, std::size_t i) noexcept :
+            m_chain{chain},
+            m_i{i}
+        { }
+
+        const D &operator*() const
+        { return (*m_chain)[m_i]; }
+
+        const_iterator &operator++() noexcept
+        {
+            ++m_i;
+            return *this;
+        }
+
+        bool operator!=(const const_iterator &other) const noexcept
+        { return m_i != other.m_i; }
+
+        /// @endcond
+
+    private:
+
+        const delegate_chain *m_chain;
+        std::size_t m_i;
+    };
+
+    /// Push Front
+    ///
+    /// Adds a delegate in front of every delegate that has the same or a
+    /// lower priority.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to add to the chain
+    /// @param priority the priority of the delegate
+    ///
+    void push_front(const D &d, int64_t priority = 0)
+    {
+        auto pos = 0U;
+        while (pos < m_size && slot(pos).priority > priority) {
+            pos++;
+        }
+
+        if (m_size < N) {
+            m_inline.at(m_size) = {};
+        }
+        else {
+            m_overflow.emplace_back();
+        }
+
+        for (auto i = m_size; i > pos; i--) {
+            slot(i) = slot(i - 1);
+        }
+
+        slot(pos) = {d, priority, 0};
+        m_size++;
+    }
+
+    /// Dispatch
+    ///
+    /// Calls each delegate in order, and stops at the first one that
+    /// returns true. If adaptive reordering is enabled, the delegate that
+    /// accepted is counted, and the chain is reordered once enough exits
+    /// have been accepted (see adaptive_dispatch). The chain is only
+    /// reordered once the accepting delegate has returned, so a delegate
+    /// never sees the chain change underneath it.
+    ///
+    /// The order of the delegates is an optimization and not part of the
+    /// chain's state (the same delegates, with the same priorities, are in
+    /// the chain either way), which is why this is const.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param args the arguments to pass to each delegate
+    /// @return returns true if a delegate returned true
+    ///
+    template<typename... Args>
+    bool dispatch(Args &&... args) const
+    {
+        for (std::size_t i = 0; i < m_size; i++) {
+            if (slot(i).d(args...)) {
+                if (GSL_UNLIKELY(adaptive_dispatch::period() != 0)) {
+                    this->accepted(i);
+                }
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// At
+    ///
+    /// @expects i < size()
+    /// @ensures
+    ///
+    /// @param i the index of the delegate, where 0 is the front of the chain
+    /// @return returns the delegate at index i
+    ///
+    const D &operator[](std::size_t i) const
+    { return i < N ? m_inline[i].d : m_overflow[i - N].d; }
+
+    /// Hits
+    ///
+    /// @expects i < size()
+    /// @ensures
+    ///
+    /// @param i the index of the delegate, where 0 is the front of the chain
+    /// @return returns the (decayed) number of exits the delegate at index
+    ///     i accepted while adaptive reordering was enabled
+    ///
+    uint64_t hits(std::size_t i) const
+    { return slot(i).hits; }
+
+    /// Reorders
+    ///
+    /// @return returns the number of times the chain was reordered
+    ///
+    uint64_t reorders() const noexcept
+    { return m_reorders; }
+
+    /// Begin
+    ///
+    /// @return returns an iterator to the front of the chain
+    ///
+    const_iterator begin() const noexcept
+    { return {this, 0}; }
+
+    /// End
+    ///
+    /// @return returns an iterator to the end of the chain
+    ///
+    const_iterator end() const noexcept
+    { return {this, m_size}; }
+
+    /// Size
+    ///
+    /// @return returns the number of delegates in the chain
+    ///
+    std::size_t size() const noexcept
+    { return m_size; }
+
+    /// Empty
+    ///
+    /// @return returns true if the chain has no delegates
+    ///
+    bool empty() const noexcept
+    { return m_size == 0; }
+
+    /// Heap Bytes
+    ///
+    /// @return returns the number of bytes allocated for the delegates
+    ///     that do not fit inline
+    ///
+    uint64_t heap_bytes() const noexcept
+    { return eapis::intel_x64::heap_bytes(m_overflow); }
+
+private:
+
+    struct slot_t {
+        D d;
+        int64_t priority;
+        uint64_t hits;
+    };
+
+    slot_t &slot(std::size_t i) const
+    { return i < N ? m_inline.at(i) : m_overflow.at(i - N); }
+
+    void accepted(std::size_t i) const
+    {
+        slot(i).hits++;
+
+        if (++m_accepted >= adaptive_dispatch::period()) {
+            m_accepted = 0;
+            this->reorder();
+        }
+    }
+
+    // Reorder
+    //
+    // An insertion sort by hits (highest first) that never moves a delegate
+    // past one with a different priority, which keeps the priority classes
+    // intact. It is stable, so delegates with the same number of hits keep
+    // their order, and chains that are already in order are not touched.
+    // The hits are halved afterwards, so the order follows what the chain
+    // accepted recently rather than since it was created.
+    //
+    void reorder() const
+    {
+        auto moved = false;
+
+        for (std::size_t i = 1; i < m_size; i++) {
+            for (auto j = i; j > 0; j--) {
+                auto &prev = slot(j - 1);
+                auto &cur = slot(j);
+
+                if (prev.priority != cur.priority || prev.hits >= cur.hits) {
+                    break;
+                }
+
+                std::swap(prev, cur);
+                moved = true;
+            }
+        }
+
+        for (std::size_t i = 0; i < m_size; i++) {
+            slot(i).hits >>= 1U;
+        }
+
+        if (moved) {
+            m_reorders++;
+        }
+    }
+
+    std::size_t m_size{};
+
+    mutable std::array<slot_t, N> m_inline{};
+    mutable std::vector<slot_t> m_overflow;
+
+    mutable uint64_t m_accepted{0};
+    mutable uint64_t m_reorders{0};
+};
+
+/// Static Handlers
+///
+/// A list of handlers that is known at compile time. handle() tries each
+/// handler in order and stops at the first one that returns true, just
+/// like walking a delegate_chain, but as the handlers are template
+/// arguments (free functions or static member functions taking a vmcs and
+/// an I), the compiler can inline all of them into handle(). When the list
+/// is registered using delegate(), the entire list costs a single delegate
+/// call, and any handler that is added at runtime (i.e. a delegate that is
+/// added to the same chain afterwards) still runs first, as usual.
+///
+/// Example:
+/// @code
+/// class my_vcpu : public eapis::intel_x64::vcpu
+/// {
+///     using feature_information_handlers =
+///         static_handlers<cpuid_handler::info_t, handle_leaf_1_ecx, handle_leaf_1_edx>;
+///
+/// public:
+///     my_vcpu(vcpuid::type id) : eapis::intel_x64::vcpu{id}
+///     {
+///         this->add_static_handlers<feature_information_handlers>(
+///             this->eapis()->cpuid(), 1
+///         );
+///     }
+/// };
+/// @endcode
+///
+template<typename I, auto... Hs>
+struct static_handlers {
+
+    /// Delegate Type
+    ///
+    using delegate_t = ::delegate<bool(gsl::not_null<vmcs_t *>, I &)>;
+
+    /// Handle
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vmcs the vmcs of the vCPU that exited
+    /// @param info the info passed to every handler in the list
+    /// @return returns true if a handler in the list handled the exit
+    ///
+    static bool handle(gsl::not_null<vmcs_t *> vmcs, I &info)
+    { return (Hs(vmcs, info) || ...); }
+
+    /// Delegate
+    ///
+    /// @return returns a single delegate that calls every handler in the
+    ///     list, which can be added wherever a delegate_t can
+    ///
+    static delegate_t delegate()
+    { return delegate_t::template create<handle>(); }
+
+    /// Size
+    ///
+    /// @return returns the number of handlers in the list
+    ///
+    static constexpr std::size_t size() noexcept
+    { return sizeof...(Hs); }
+};
+
+/// MSR Map
+///
+/// Maps MSRs to values of type T. The MSRs covered by the MSR bitmap
+/// (0x0 - 0x1FFF and 0xC0000000 - 0xC0001FFF) are looked up using a flat
+/// index per range, so a lookup is a bounds check and two array accesses,
+/// while any other MSR falls back to a hash map. The index stores 16 bit
+/// slots into a vector of values, which keeps the cost of the map low
+/// (32k per map) no matter how many MSRs are in it.
+///
+/// @note Adding an MSR might move the values of the MSRs that are already
+///     in the map, so pointers returned by find() should not be kept
+///     across calls to at().
+///
+template<typename T>
+class msr_map
+{
+public:
+
+    /// At
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the MSR to look up
+    /// @return returns the value for the MSR, which is value initialized
+    ///     if the MSR is not in the map yet
+    ///
+    T &at(uint64_t msr)
+    {
+        auto i = index(msr);
+
+        if (i < 0) {
+            return m_fallback[msr];
+        }
+
+        auto &slot = m_index.at(static_cast<std::size_t>(i));
+
+        if (slot == 0) {
+            m_values.emplace_back();
+            slot = gsl::narrow<uint16_t>(m_values.size());
+        }
+
+        return m_values.at(slot - 1U);
+    }
+
+    /// Find
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the MSR to look up
+    /// @return returns the value for the MSR, or nullptr if the MSR is not
+    ///     in the map
+    ///
+    const T *find(uint64_t msr) const
+    {
+        auto i = index(msr);
+
+        if (GSL_LIKELY(i >= 0)) {
+            auto slot = m_index[static_cast<std::size_t>(i)];
+            return slot != 0 ? &m_values[slot - 1U] : nullptr;
+        }
+
+        auto iter = m_fallback.find(msr);
+        return iter != m_fallback.end() ? &iter->second : nullptr;
+    }
+
+    /// Heap Bytes
+    ///
+    /// @return returns the number of bytes allocated for the values in
+    ///     the map (not including anything the values allocate). The
+    ///     index is part of the map itself.
+    ///
+    uint64_t heap_bytes() const noexcept
+    { return eapis::intel_x64::heap_bytes(m_values) + eapis::intel_x64::heap_bytes(m_fallback); }
+
+private:
+
+    static std::ptrdiff_t index(uint64_t msr) noexcept
+    {
+        if (msr <= 0x00001FFFULL) {
+            return static_cast<std::ptrdiff_t>(msr);
+        }
+
+        if (msr >= 0xC0000000ULL && msr <= 0xC0001FFFULL) {
+            return static_cast<std::ptrdiff_t>(msr - 0xC0000000ULL) + 0x2000;
+        }
+
+        return -1;
+    }
+
+    std::array<uint16_t, 0x4000> m_index{};
+    std::vector<T> m_values;
+    std::unordered_map<uint64_t, T> m_fallback;
+};
+
+/// MSR Dispatch Table
+///
+/// Maps MSRs to their delegate chains (see msr_map).
+///
+template<typename D>
+class msr_dispatch_table
+{
+public:
+
+    /// Push Front
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the MSR to add the delegate to
+    /// @param d the delegate to add to the front of the MSR's chain
+    ///
+    void push_front(uint64_t msr, const D &d)
+    { m_chains.at(msr).push_front(d); }
+
+    /// Find
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the MSR to look up
+    /// @return returns the chain for the MSR, or nullptr if the MSR has no
+    ///     delegates
+    ///
+    const delegate_chain<D> *find(uint64_t msr) const
+    { return m_chains.find(msr); }
+
+    /// Heap Bytes
+    ///
+    /// @return returns the number of bytes allocated for the chains
+    ///
+    uint64_t heap_bytes() const noexcept
+    { return m_chains.heap_bytes(); }
+
+private:
+
+    msr_map<delegate_chain<D>> m_chains;
+};
+
+/// Exit Profiler
+///
+/// Samples 1 in every rate() VM exits that go through the exit dispatch
+/// table, recording the exit reason, and the guest's RIP and CR3 at the
+/// time of the exit, into a ring of the last N samples. Exits that are not
+/// sampled only cost a decrement. The samples can be drained (e.g. by a
+/// vmcall) to be analyzed outside of the hypervisor, or aggregated into
+/// the hottest (reason, RIP, CR3) triples with top(), which shows which
+/// guest code is responsible for a hot exit reason.
+///
+template<std::size_t N = 4096>
+class exit_profiler
+{
+public:
+
+    /// Sample
+    ///
+    struct sample_t {
+
+        uint64_t reason;                    ///< Basic exit reason
+        uint64_t rip;                       ///< Guest RIP of the exit
+        uint64_t cr3;                       ///< Guest CR3 of the exit
+
+        /// @cond
+
+        bool operator==(const sample_t &other) const noexcept
+        { return reason == other.reason && rip == other.rip && cr3 == other.cr3; }
+
+        /// @endcond
+    };
+
+    /// Hotspot
+    ///
+    struct hotspot_t {
+
+        sample_t sample;                    ///< The sampled location
+        uint64_t count;                     ///< Number of times it was sampled
+    };
+
+    /// Default Constructor
+    ///
+    /// @expects rate != 0
+    /// @ensures
+    ///
+    /// @param rate the profiler samples 1 in every rate exits
+    ///
+    explicit exit_profiler(uint64_t rate = 64)
+    { this->set_rate(rate); }
+
+    /// Set Rate
+    ///
+    /// @expects rate != 0
+    /// @ensures
+    ///
+    /// @param rate the profiler samples 1 in every rate exits
+    ///
+    void set_rate(uint64_t rate)
+    {
+        expects(rate != 0);
+
+        m_rate = rate;
+        m_countdown = rate;
+    }
+
+    /// Rate
+    ///
+    /// @return returns the sample rate (1 in every rate() exits)
+    ///
+    uint64_t rate() const noexcept
+    { return m_rate; }
+
+    /// Tick
+    ///
+    /// Called on every exit. Samples the exit if it is the rate()th exit
+    /// since the last sample.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param reason the basic exit reason
+    /// @param vmcs the vmcs of the vCPU that exited
+    ///
+    void tick(uint64_t reason, gsl::not_null<vmcs_t *> vmcs)
+    {
+        m_exits++;
+
+        if (GSL_LIKELY(--m_countdown != 0)) {
+            return;
+        }
+
+        m_countdown = m_rate;
+        this->add({reason, vmcs->save_state()->rip, vmcs_n::guest_cr3::get()});
+    }
+
+    /// Add
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param sample the sample to record
+    ///
+    void add(const sample_t &sample) noexcept
+    {
+        m_samples.push(sample);
+        m_taken++;
+    }
+
+    /// Drain
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param samples the buffer to copy the samples into (see
+    ///     log_ring::drain())
+    /// @return returns the number of samples copied into samples
+    ///
+    std::size_t drain(gsl::span<sample_t> samples) noexcept
+    { return m_samples.drain(samples); }
+
+    /// Top
+    ///
+    /// Aggregates the samples that are in the ring (i.e. have not been
+    /// drained or overwritten) by (reason, RIP, CR3).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param n the number of hotspots to return
+    /// @return returns up to n of the most sampled hotspots, most sampled
+    ///     first
+    ///
+    std::vector<hotspot_t> top(std::size_t n) const
+    {
+        std::vector<hotspot_t> hotspots;
+        std::unordered_map<sample_t, std::size_t, sample_hash> index;
+
+        for (const auto &sample : m_samples) {
+            auto ret = index.emplace(sample, hotspots.size());
+
+            if (ret.second) {
+                hotspots.push_back({sample, 0});
+            }
+
+            hotspots[ret.first->second].count++;
+        }
+
+        auto num = std::min(n, hotspots.size());
+        auto mid = hotspots.begin() + static_cast<std::ptrdiff_t>(num);
+
+        std::partial_sort(hotspots.begin(), mid, hotspots.end(), [](const auto & a, const auto & b) {
+            return a.count > b.count;
+        });
+
+        hotspots.erase(mid, hotspots.end());
+        return hotspots;
+    }
+
+    /// Clear
+    ///
+    /// Removes every sample from the ring and resets the counts
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear() noexcept
+    {
+        m_samples.clear();
+
+        m_exits = 0;
+        m_taken = 0;
+        m_countdown = m_rate;
+    }
+
+    /// Exits
+    ///
+    /// @return returns the number of exits seen by the profiler
+    ///
+    uint64_t exits() const noexcept
+    { return m_exits; }
+
+    /// Taken
+    ///
+    /// @return returns the number of samples taken (including samples
+    ///     that have since been drained or overwritten)
+    ///
+    uint64_t taken() const noexcept
+    { return m_taken; }
+
+    /// Size
+    ///
+    /// @return returns the number of samples in the ring
+    ///
+    std::size_t size() const noexcept
+    { return m_samples.size(); }
+
+private:
+
+    struct sample_hash {
+        std::size_t operator()(const sample_t &s) const noexcept
+        { return std::hash<uint64_t>()(s.rip ^ (s.cr3 << 7U) ^ (s.reason << 57U)); }
+    };
+
+    uint64_t m_rate{};
+    uint64_t m_countdown{};
+
+    uint64_t m_exits{};
+    uint64_t m_taken{};
+
+    log_ring<sample_t, N> m_samples;
+};
+
+/// Shared Ring Header
+///
+/// The first page of a shared_ring, which describes the ring to a consumer
+/// that only has its physical address (e.g. a host userspace tool that has
+/// mapped the pages read-only). The layout is fixed by version, so the
+/// consumer does not need to be built with eapis.
+///
+/// Record i lives in data page (i / records_per_page) % num_pages, at byte
+/// offset (i % records_per_page) * record_size. To read the ring without
+/// locks, the consumer keeps its own tail and:
+///
+/// - reads head (acquire)
+/// - copies the records in [max(tail, head - capacity), head)
+/// - reads claim (after an acquire fence), and throws away every copied
+///   record older than claim - capacity, as the producer may have been
+///   overwriting it during the copy
+/// - sets tail to head
+///
+/// This is the same protocol log_ring::drain() uses, except that the
+/// consumer never writes to the ring, so any number of consumers can read
+/// it at the same time.
+///
+struct shared_ring_header_t {
+
+    uint64_t magic;                         ///< shared_ring_magic
+    uint32_t version;                       ///< shared_ring_version
+    uint32_t record_size;                   ///< Size of a record, in bytes
+    uint32_t records_per_page;              ///< Records in each data page
+    uint32_t num_pages;                     ///< Number of data pages
+    std::atomic<uint64_t> head;             ///< Number of records ever pushed
+    std::atomic<uint64_t> claim;            ///< head + 1 while a record is written
+    uint64_t pages[507];                    ///< Physical address of each data page
+};
+
+static_assert(sizeof(shared_ring_header_t) == 0x1000, "invalid shared ring header");
+
+constexpr const uint64_t shared_ring_magic = 0x474F4C5349504145ULL;        ///< "EAPISLOG"
+constexpr const uint32_t shared_ring_version = 1U;                          ///< Layout version
+
+/// Shared Ring Max Pages
+///
+/// The number of data pages that fit in the header page
+///
+constexpr const std::size_t shared_ring_max_pages =
+    sizeof(shared_ring_header_t::pages) / sizeof(uint64_t);
+
+/// Shared Ring
+///
+/// A ring buffer of records, like log_ring, that lives in pages of its own
+/// so that it can be read in place from outside of the VMM (see
+/// shared_ring_header_t). Pushing a record is a copy into the data pages
+/// and two stores into the header. Nothing is formatted, and the consumer
+/// does not need a vmcall to read the ring once it has been told where the
+/// header page is (see header_phys()).
+///
+/// @note Any page of the ring can be read by whoever maps it, so only
+///     export records that the consumer is allowed to see.
+///
+template<typename T>
+class shared_ring
+{
+    static_assert(sizeof(T) <= 0x1000, "shared_ring: record is larger than a page");
+    static_assert(std::is_trivially_copyable<T>::value, "shared_ring: record is not trivially copyable");
+
+public:
+
+    /// Records Per Page
+    ///
+    static constexpr const std::size_t records_per_page = 0x1000 / sizeof(T);
+
+    /// Constructor
+    ///
+    /// @expects num_pages != 0
+    /// @expects num_pages <= shared_ring_max_pages
+    /// @ensures
+    ///
+    /// @param num_pages the number of data pages to allocate
+    ///
+    explicit shared_ring(std::size_t num_pages) :
+        m_header{static_cast<shared_ring_header_t *>(alloc_page()), free_page}
+    {
+        expects(num_pages != 0);
+        expects(num_pages <= shared_ring_max_pages);
+
+        gsl::memset(gsl::make_span(reinterpret_cast<uint8_t *>(m_header.get()), 0x1000), 0);
+
+        m_header->magic = shared_ring_magic;
+        m_header->version = shared_ring_version;
+        m_header->record_size = sizeof(T);
+        m_header->records_per_page = records_per_page;
+        m_header->num_pages = gsl::narrow_cast<uint32_t>(num_pages);
+
+        for (auto i = 0U; i < num_pages; i++) {
+            m_pages.emplace_back(static_cast<T *>(alloc_page()), free_page);
+            m_header->pages[i] = g_mm->virtptr_to_physint(m_pages.back().get());
+        }
+    }
+
+    /// Push
+    ///
+    /// Adds a record to the ring, overwriting the oldest record when the
+    /// ring is full.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param record the record to add
+    ///
+    void push(const T &record) noexcept
+    {
+        auto head = m_header->head.load(std::memory_order_relaxed);
+
+        m_header->claim.store(head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        this->at(head) = record;
+        m_header->head.store(head + 1, std::memory_order_release);
+    }
+
+    /// At
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param i the index of a record (as counted by head)
+    /// @return returns the slot record i is (or will be) stored in
+    ///
+    T &at(uint64_t i) noexcept
+    { return m_pages[(i / records_per_page) % m_pages.size()].get()[i % records_per_page]; }
+
+    /// Header
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the ring's header page
+    ///
+    const shared_ring_header_t *header() const noexcept
+    { return m_header.get(); }
+
+    /// Header Physical Address
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the physical address of the ring's header page,
+    ///     which is all a consumer needs to find the rest of the ring
+    ///
+    uintptr_t header_phys() const
+    { return g_mm->virtptr_to_physint(m_header.get()); }
+
+    /// Capacity
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the maximum number of records the ring can hold
+    ///
+    std::size_t capacity() const noexcept
+    { return records_per_page * m_pages.size(); }
+
+    /// Pushed
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of records ever pushed
+    ///
+    uint64_t pushed() const noexcept
+    { return m_header->head.load(std::memory_order_relaxed); }
+
+private:
+
+    std::unique_ptr<shared_ring_header_t, void(*)(void *)> m_header;
+    std::vector<std::unique_ptr<T, void(*)(void *)>> m_pages;
+};
+
+/// Shared Counters Page
+///
+/// A page of named 64 bit counters that can be read in place from outside
+/// of the VMM (see shared_counters). Each counter is only written by the
+/// vCPU that owns the page, using aligned 64 bit stores, so a consumer
+/// never sees a torn value. Counters are never removed, and a counter's
+/// name is written before num_counters is incremented (release), so a
+/// consumer that reads num_counters (acquire) can trust every entry below
+/// it.
+///
+struct shared_counters_page_t {
+
+    /// Counter
+    ///
+    struct counter_t {
+        char name[24];                      ///< Null terminated name
+        uint64_t value;                     ///< Current value
+    };
+
+    uint64_t magic;                         ///< shared_counters_magic
+    uint32_t version;                       ///< shared_counters_version
+    std::atomic<uint32_t> num_counters;     ///< Number of valid counters
+    counter_t counters[127];                ///< The counters
+};
+
+static_assert(sizeof(shared_counters_page_t) == 0x1000, "invalid shared counters page");
+
+constexpr const uint64_t shared_counters_magic = 0x5254435349504145ULL;    ///< "EAPISCTR"
+constexpr const uint32_t shared_counters_version = 1U;                      ///< Layout version
+
+/// Shared Counters
+///
+/// Owns a shared_counters_page_t. Counters are added once (e.g. when a
+/// feature is enabled), and the reference that is returned is then updated
+/// in place, which costs exactly what updating a private counter does.
+///
+class shared_counters
+{
+public:
+
+    /// Max Counters
+    ///
+    static constexpr const std::size_t max_counters =
+        sizeof(shared_counters_page_t::counters) / sizeof(shared_counters_page_t::counter_t);
+
+    /// Default Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    shared_counters() :
+        m_page{static_cast<shared_counters_page_t *>(alloc_page()), free_page}
+    {
+        gsl::memset(gsl::make_span(reinterpret_cast<uint8_t *>(m_page.get()), 0x1000), 0);
+
+        m_page->magic = shared_counters_magic;
+        m_page->version = shared_counters_version;
+    }
+
+    /// Add
+    ///
+    /// @expects size() < max_counters
+    /// @ensures
+    ///
+    /// @param name the name of the counter (truncated to 23 characters)
+    /// @return returns the counter's value, which the caller updates
+    ///
+    uint64_t &add(const char *name)
+    {
+        auto index = m_page->num_counters.load(std::memory_order_relaxed);
+        expects(index < max_counters);
+
+        auto &counter = m_page->counters[index];
+
+        std::strncpy(counter.name, name, sizeof(counter.name) - 1);
+        counter.value = 0;
+
+        m_page->num_counters.store(index + 1, std::memory_order_release);
+        return counter.value;
+    }
+
+    /// Find
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param name the name of the counter
+    /// @return returns the counter named name, or nullptr if it has not
+    ///     been added
+    ///
+    uint64_t *find(const char *name) noexcept
+    {
+        for (auto i = 0U; i < this->size(); i++) {
+            if (std::strncmp(m_page->counters[i].name, name, sizeof(m_page->counters[i].name)) == 0) {
+                return &m_page->counters[i].value;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /// Size
+    ///
+    /// @return returns the number of counters that have been added
+    ///
+    std::size_t size() const noexcept
+    { return m_page->num_counters.load(std::memory_order_relaxed); }
+
+    /// Page
+    ///
+    /// @return returns the shared page
+    ///
+    const shared_counters_page_t *page() const noexcept
+    { return m_page.get(); }
+
+    /// Page Physical Address
+    ///
+    /// @return returns the physical address of the shared page
+    ///
+    uintptr_t page_phys() const
+    { return g_mm->virtptr_to_physint(m_page.get()); }
+
+private:
+
+    std::unique_ptr<shared_counters_page_t, void(*)(void *)> m_page;
+};
+
+/// Exit Export
+///
+/// Exports every exit that goes through the exit dispatch table to a
+/// shared_ring of exit records, and counts the exits of each reason in a
+/// shared_counters page (one counter per reason, named by its number), so
+/// exit telemetry can be consumed outside of the VMM without a vmcall per
+/// read and without formatting anything in the VMM.
+///
+class exit_export
+{
+public:
+
+    /// Record
+    ///
+    struct record_t {
+        uint64_t tsc;                       ///< TSC when the exit was dispatched
+        uint64_t rip;                       ///< Guest RIP of the exit
+        uint64_t cr3;                       ///< Guest CR3 of the exit
+        uint32_t reason;                    ///< Basic exit reason
+        uint32_t reserved;                  ///< Must be 0
+    };
+
+    /// Constructor
+    ///
+    /// @expects num_pages != 0
+    /// @ensures
+    ///
+    /// @param num_reasons the number of exit reasons to count
+    /// @param num_pages the number of data pages in the ring
+    ///
+    exit_export(std::size_t num_reasons, std::size_t num_pages) :
+        m_ring{num_pages}
+    {
+        expects(num_reasons <= shared_counters::max_counters);
+
+        for (auto i = 0U; i < num_reasons; i++) {
+            m_counts.push_back(&m_counters.add(("exit " + std::to_string(i)).c_str()));
+        }
+    }
+
+    /// Record
+    ///
+    /// Called on every exit.
+    ///
+    /// @expects reason < the number of reasons passed to the constructor
+    /// @ensures
+    ///
+    /// @param reason the basic exit reason
+    /// @param vmcs the vmcs of the vCPU that exited
+    ///
+    void record(uint64_t reason, gsl::not_null<vmcs_t *> vmcs)
+    {
+        (*m_counts[reason])++;
+
+        m_ring.push({
+            read_tsc(), vmcs->save_state()->rip, vmcs_n::guest_cr3::get(),
+            gsl::narrow_cast<uint32_t>(reason), 0
+        });
+    }
+
+    /// Ring
+    ///
+    /// @return returns the ring the exits are recorded into
+    ///
+    shared_ring<record_t> &ring() noexcept
+    { return m_ring; }
+
+    /// Counters
+    ///
+    /// @return returns the page the exits are counted in. Extensions can
+    ///     add counters of their own to it.
+    ///
+    shared_counters &counters() noexcept
+    { return m_counters; }
+
+private:
+
+    shared_ring<record_t> m_ring;
+    shared_counters m_counters;
+
+    std::vector<uint64_t *> m_counts;
+};
+
+/// Exit Poll Delegate
+///
+/// The type of delegate called at the start of every exit dispatched by
+/// an exit_dispatch_table (see exit_dispatch_table::set_poll()), and
+/// before resuming the guest from every exit it handled (see
+/// exit_dispatch_table::set_resume())
+///
+using exit_poll_delegate_t = ::delegate<void(gsl::not_null<vmcs_t *>)>;
+
+/// Exit Dispatch Table
+///
+/// A flat table of delegate chains indexed by basic exit reason. Each
+/// entry that has delegates is registered with the base exit handler once,
+/// so the base hypervisor only ever sees a single delegate per reason, and
+/// every eapis delegate for that reason is then walked from here. Most
+/// reasons only ever have the eapis handler registered, in which case the
+/// entry calls it directly instead of walking a chain.
+///
+template<std::size_t N = 65>
+class exit_dispatch_table
+{
+public:
+
+    /// Entry
+    ///
+    class entry
+    {
+    public:
+
+        /// Handle
+        ///
+        /// @expects
+        /// @ensures
+        ///
+        /// @param vmcs the vmcs of the vCPU that exited
+        /// @return returns true if a delegate handled the exit
+        ///
+        bool handle(gsl::not_null<vmcs_t *> vmcs)
+        {
+            if (GSL_UNLIKELY(m_allocs != nullptr)) {
+                return this->tracked(vmcs);
+            }
+
+            return this->untracked(vmcs);
+        }
+
+        /// @cond
+
+        delegate_chain<::handler_delegate_t> m_handlers;
+        exit_latency_t *m_latency{nullptr};
+        vmcs_field_cache<> *m_cache{nullptr};
+        exit_profiler<> *m_profiler{nullptr};
+        exit_export *m_export{nullptr};
+        const exit_poll_delegate_t *m_poll{nullptr};
+        const exit_poll_delegate_t *m_resume{nullptr};
+        exit_allocs_t *m_allocs{nullptr};
+        bool m_assert_no_allocs{false};
+        uint64_t m_reason{0};
+
+        /// @endcond
+
+    private:
+
+        bool tracked(gsl::not_null<vmcs_t *> vmcs)
+        {
+            auto before = alloc_counter::count();
+            auto ret = this->untracked(vmcs);
+            auto allocations = alloc_counter::count() - before;
+
+            m_allocs->add(allocations);
+
+            if (GSL_UNLIKELY(m_assert_no_allocs && allocations != 0)) {
+                throw std::runtime_error(
+                    "exit_dispatch_table: exit reason " + std::to_string(m_reason) +
+                    " made " + std::to_string(allocations) + " heap allocations"
+                );
+            }
+
+            return ret;
+        }
+
+        bool untracked(gsl::not_null<vmcs_t *> vmcs)
+        {
+            if (GSL_UNLIKELY(m_profiler != nullptr)) {
+                m_profiler->tick(m_reason, vmcs);
+            }
+
+            if (GSL_UNLIKELY(m_export != nullptr)) {
+                m_export->record(m_reason, vmcs);
+            }
+
+            if (GSL_UNLIKELY(m_poll != nullptr)) {
+                (*m_poll)(vmcs);
+            }
+
+            auto ret = false;
+
+            if (m_cache != nullptr) {
+                m_cache->begin_exit();
+
+                try {
+                    ret = this->dispatch(vmcs);
+                }
+                catch (...) {
+                    m_cache->abort_exit();
+                    throw;
+                }
+
+                m_cache->end_exit();
+            }
+            else {
+                ret = this->dispatch(vmcs);
+            }
+
+            if (ret && GSL_UNLIKELY(m_resume != nullptr)) {
+                (*m_resume)(vmcs);
+            }
+
+            return ret;
+        }
+
+        bool dispatch(gsl::not_null<vmcs_t *> vmcs)
+        {
+            if (GSL_LIKELY(m_latency == nullptr)) {
+                if (GSL_LIKELY(m_handlers.size() == 1)) {
+                    return m_handlers[0](vmcs);
+                }
+
+                return this->walk(vmcs);
+            }
+
+            auto start = read_tsc();
+
+            if (this->walk(vmcs)) {
+                m_latency->add(read_tsc() - start);
+                return true;
+            }
+
+            return false;
+        }
+
+        bool walk(gsl::not_null<vmcs_t *> vmcs)
+        { return m_handlers.dispatch(vmcs); }
+    };
+
+    /// Size
+    ///
+    /// @return returns the number of exit reasons covered by the table
+    ///
+    static constexpr std::size_t size() noexcept
+    { return N; }
+
+    /// Push Front
+    ///
+    /// @expects reason < size()
+    /// @ensures
+    ///
+    /// @param reason the exit reason to add the delegate to
+    /// @param d the delegate to add
+    /// @param priority the priority of the delegate (see delegate_chain)
+    /// @return returns true if this is the first delegate for this reason,
+    ///     in which case the caller needs to register the entry with the
+    ///     base exit handler
+    ///
+    bool push_front(uint64_t reason, const ::handler_delegate_t &d, int64_t priority = 0)
+    {
+        auto &e = m_entries.at(reason);
+        auto first = e.m_handlers.empty();
+
+        e.m_handlers.push_front(d, priority);
+        return first;
+    }
+
+    /// At
+    ///
+    /// @expects reason < size()
+    /// @ensures
+    ///
+    /// @param reason the exit reason to look up
+    /// @return returns the entry for the exit reason
+    ///
+    entry &at(uint64_t reason)
+    { return m_entries.at(reason); }
+
+    /// Handle
+    ///
+    /// Dispatches an exit directly from the table. The base exit handler
+    /// calls the entries themselves; this is used when the exit reason
+    /// has already been read (e.g. by a benchmark).
+    ///
+    /// @expects reason < size()
+    /// @ensures
+    ///
+    /// @param reason the exit reason
+    /// @param vmcs the vmcs of the vCPU that exited
+    /// @return returns true if a delegate handled the exit
+    ///
+    bool handle(uint64_t reason, gsl::not_null<vmcs_t *> vmcs)
+    { return m_entries[reason].handle(vmcs); }
+
+    /// Heap Bytes
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns an estimate of the heap memory used by the delegates
+    ///     that do not fit in the entries themselves
+    ///
+    uint64_t heap_bytes() const noexcept
+    {
+        uint64_t bytes = 0;
+
+        for (const auto &e : m_entries) {
+            bytes += e.m_handlers.heap_bytes();
+        }
+
+        return bytes;
+    }
+
+    /// Set Latencies
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param latencies an array of size() histograms to record each exit
+    ///     into, or nullptr to stop recording
+    ///
+    void set_latencies(exit_latency_t *latencies) noexcept
+    {
+        for (auto i = 0U; i < N; i++) {
+            m_entries[i].m_latency = latencies != nullptr ? &latencies[i] : nullptr;
+        }
+    }
+
+    /// Set VMCS Cache
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cache the VMCS field cache to bracket every exit with (see
+    ///     vmcs_field_cache), or nullptr to stop using it
+    ///
+    void set_vmcs_cache(vmcs_field_cache<> *cache) noexcept
+    {
+        for (auto &e : m_entries) {
+            e.m_cache = cache;
+        }
+    }
+
+    /// Set Profiler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param profiler the profiler to tick on every exit (see
+    ///     exit_profiler), or nullptr to stop profiling
+    ///
+    void set_profiler(exit_profiler<> *profiler) noexcept
+    {
+        for (auto i = 0U; i < N; i++) {
+            m_entries[i].m_profiler = profiler;
+            m_entries[i].m_reason = i;
+        }
+    }
+
+    /// Set Export
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param exp the exit export to record every exit into (see
+    ///     exit_export), or nullptr to stop exporting. It must count at
+    ///     least size() exit reasons.
+    ///
+    void set_export(exit_export *exp) noexcept
+    {
+        for (auto i = 0U; i < N; i++) {
+            m_entries[i].m_export = exp;
+            m_entries[i].m_reason = i;
+        }
+    }
+
+    /// Set Poll
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param poll the delegate to call on every exit (e.g. to poll a ring
+    ///     shared with the guest while the vCPU is in the VMM anyway), or
+    ///     nullptr to stop polling. The delegate must outlive the table,
+    ///     or be removed first.
+    ///
+    void set_poll(const exit_poll_delegate_t *poll) noexcept
+    {
+        for (auto &e : m_entries) {
+            e.m_poll = poll;
+        }
+    }
+
+    /// Set Resume
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param resume the delegate to call after every exit that was
+    ///     handled, just before the guest is resumed (e.g. to flush state
+    ///     that another vCPU may have changed), or nullptr to stop calling
+    ///     it. The delegate must outlive the table, or be removed first.
+    ///
+    void set_resume(const exit_poll_delegate_t *resume) noexcept
+    {
+        for (auto &e : m_entries) {
+            e.m_resume = resume;
+        }
+    }
+
+    /// Set Allocations
+    ///
+    /// Counts the heap allocations made while handling each exit (see
+    /// alloc_counter). The profiler, export and poll delegate are
+    /// included, as they run on the exit path too.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param allocs an array of size() entries to count the allocations
+    ///     of each exit reason in, or nullptr to stop counting
+    /// @param assert_none if true, an exit that allocates throws once it
+    ///     has been handled (so that tests fail)
+    ///
+    void set_allocs(exit_allocs_t *allocs, bool assert_none = false) noexcept
+    {
+        for (auto i = 0U; i < N; i++) {
+            m_entries[i].m_allocs = allocs != nullptr ? &allocs[i] : nullptr;
+            m_entries[i].m_assert_no_allocs = assert_none;
+            m_entries[i].m_reason = i;
+        }
+    }
+
+private:
+
+    std::array<entry, N> m_entries{};
+};
+
 }
 }
 
@@ -0,0 +1,498 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef BITMAPS_INTEL_X64_EAPIS_H
+#define BITMAPS_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "numa.h"
+
+#include <mutex>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+/// Bitmap Policy
+///
+/// Owns an MSR bitmap and a pair of IO bitmaps. A policy can be handed to
+/// a group of vCPUs through eapis_vcpu_global_state_t::shared_bitmaps, in
+/// which case every vCPU in the group points its VMCS at the same pages,
+/// and a single trap_xxx / pass_through_xxx call on the policy applies to
+/// all of them at once. A vCPU that needs a change the policy does not
+/// already have gets its own copy first (see vcpu_bitmaps).
+///
+/// Note that the IO bitmaps only apply to vCPUs that have an IO
+/// instruction handler, as until then, IO is not trapped at all.
+///
+class EXPORT_EAPIS_HVE bitmap_policy
+{
+public:
+
+    /// Constructor
+    ///
+    /// Allocates a zeroed (i.e. pass through) MSR bitmap. The IO bitmaps
+    /// are allocated the first time a port is trapped or a vCPU needs them.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param node the NUMA node to allocate the bitmaps on. The processor
+    ///     reads the MSR bitmap on every RDMSR / WRMSR, so the bitmaps should
+    ///     live on the node of the vCPUs that use them.
+    ///
+    explicit bitmap_policy(numa::node_t node = numa::any_node);
+
+    /// Copy Constructor
+    ///
+    /// Allocates a new set of bitmaps that start out identical to other.
+    /// A policy that is shared by vCPUs on several nodes can be replicated
+    /// onto each node this way.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param other the policy to copy
+    /// @param node the NUMA node to allocate the bitmaps on
+    ///
+    bitmap_policy(const bitmap_policy &other, numa::node_t node = numa::any_node);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~bitmap_policy() = default;
+
+    /// Trap On RDMSR
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to trap reads from
+    ///
+    void trap_rdmsr(vmcs_n::value_type msr);
+
+    /// Pass Through RDMSR
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to stop trapping reads from
+    ///
+    void pass_through_rdmsr(vmcs_n::value_type msr);
+
+    /// Trap On WRMSR
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to trap writes to
+    ///
+    void trap_wrmsr(vmcs_n::value_type msr);
+
+    /// Pass Through WRMSR
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to stop trapping writes to
+    ///
+    void pass_through_wrmsr(vmcs_n::value_type msr);
+
+    /// Trap On IO
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param port the port to trap
+    ///
+    void trap_io(vmcs_n::value_type port);
+
+    /// Pass Through IO
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param port the port to stop trapping
+    ///
+    void pass_through_io(vmcs_n::value_type port);
+
+    /// RDMSR Bit
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to look up
+    /// @return returns the bit in the MSR bitmap that traps reads from msr.
+    ///     An exception is thrown if the msr is not covered by the bitmap.
+    ///
+    static uint64_t rdmsr_bit(vmcs_n::value_type msr);
+
+    /// WRMSR Bit
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to look up
+    /// @return returns the bit in the MSR bitmap that traps writes to msr.
+    ///     An exception is thrown if the msr is not covered by the bitmap.
+    ///
+    static uint64_t wrmsr_bit(vmcs_n::value_type msr);
+
+    /// RDMSR Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr in the range
+    /// @param last the last msr in the range (inclusive)
+    /// @return returns the first and last bits in the MSR bitmap that trap
+    ///     reads from the range. An exception is thrown if the range is
+    ///     empty or is not covered by a single region of the bitmap.
+    ///
+    static std::pair<uint64_t, uint64_t> rdmsr_bits(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// WRMSR Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr in the range
+    /// @param last the last msr in the range (inclusive)
+    /// @return returns the first and last bits in the MSR bitmap that trap
+    ///     writes to the range. An exception is thrown if the range is
+    ///     empty or is not covered by a single region of the bitmap.
+    ///
+    static std::pair<uint64_t, uint64_t> wrmsr_bits(
+        vmcs_n::value_type first, vmcs_n::value_type last);
+
+    /// MSR Bitmap
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the MSR bitmap
+    ///
+    gsl::span<uint8_t> msr_bitmap() const noexcept
+    { return {m_msr_bitmap.get(), ::x64::pt::page_size}; }
+
+    /// IO Bitmap A
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the IO bitmap for ports 0 to 0x7FFF, or an empty
+    ///     span if the IO bitmaps have not been allocated yet
+    ///
+    gsl::span<uint8_t> io_bitmap_a() const noexcept
+    { return {m_io_bitmap_a.get(), m_io_bitmap_a ? ::x64::pt::page_size : 0}; }
+
+    /// IO Bitmap B
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the IO bitmap for ports 0x8000 to 0xFFFF, or an empty
+    ///     span if the IO bitmaps have not been allocated yet
+    ///
+    gsl::span<uint8_t> io_bitmap_b() const noexcept
+    { return {m_io_bitmap_b.get(), m_io_bitmap_b ? ::x64::pt::page_size : 0}; }
+
+    /// Users
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of vCPUs currently using this policy
+    ///
+    uint64_t users() const noexcept
+    { return m_users.load(); }
+
+    /// Node
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the NUMA node the bitmaps live on
+    ///
+    numa::node_t node() const
+    { return numa::node_of(m_msr_bitmap.get()); }
+
+private:
+
+    void alloc_io_bitmaps();
+    gsl::span<uint8_t> io_bitmap(uint64_t port) const;
+
+    static bool is_set(gsl::span<uint8_t> bitmap, uint64_t bit);
+    static void change_bit(gsl::span<uint8_t> bitmap, uint64_t bit, bool trap);
+
+    static bool is_range(gsl::span<uint8_t> bitmap, uint64_t first, uint64_t last, bool trap);
+    static void change_range(gsl::span<uint8_t> bitmap, uint64_t first, uint64_t last, bool trap);
+
+private:
+
+    std::unique_ptr<uint8_t, void(*)(void *)> m_msr_bitmap;
+    std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_a;
+    std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_b;
+
+    numa::node_t m_node;
+    std::atomic<uint64_t> m_users{0};
+    mutable std::mutex m_mutex;
+
+private:
+
+    friend class vcpu_bitmaps;
+
+public:
+
+    /// @cond
+
+    bitmap_policy(bitmap_policy &&) = delete;
+    bitmap_policy &operator=(const bitmap_policy &) = delete;
+    bitmap_policy &operator=(bitmap_policy &&) = delete;
+
+    /// @endcond
+};
+
+/// vCPU Bitmaps
+///
+/// The bitmaps a single vCPU points its VMCS at. If the vCPU's group has a
+/// shared bitmap policy, it is used until this vCPU makes a change the
+/// policy does not already have while another vCPU is also using it, at
+/// which point the policy is copied and the VMCS is pointed at the copy.
+/// Changes that are already reflected in the policy (e.g. every vCPU
+/// trapping the same MSRs at boot) never cause a copy.
+///
+/// Since a copy rewrites the VMCS, changes should only be made from the
+/// vCPU that owns these bitmaps.
+///
+class EXPORT_EAPIS_HVE vcpu_bitmaps
+{
+public:
+
+    /// Constructor
+    ///
+    /// Points the VMCS at the MSR bitmap and leaves IO exiting off.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param policy the shared policy of the vCPU's group, or nullptr
+    ///     to give this vCPU its own bitmaps
+    ///
+    vcpu_bitmaps(bitmap_policy *policy);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vcpu_bitmaps();
+
+    /// Trap MSR Bit
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bit the bit to set (see bitmap_policy::rdmsr_bit and
+    ///     bitmap_policy::wrmsr_bit)
+    ///
+    void trap_msr_bit(uint64_t bit);
+
+    /// Pass Through MSR Bit
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bit the bit to clear
+    ///
+    void pass_through_msr_bit(uint64_t bit);
+
+    /// Fill MSR Bitmap
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the first byte of the MSR bitmap to fill
+    /// @param count the number of bytes to fill
+    /// @param value the value to fill each byte with
+    ///
+    void fill_msr_bitmap(uint64_t offset, uint64_t count, uint8_t value);
+
+    /// Trap MSR Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bits the first and last bits to set (see
+    ///     bitmap_policy::rdmsr_bits and bitmap_policy::wrmsr_bits)
+    ///
+    void trap_msr_range(const std::pair<uint64_t, uint64_t> &bits);
+
+    /// Pass Through MSR Range
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bits the first and last bits to clear
+    ///
+    void pass_through_msr_range(const std::pair<uint64_t, uint64_t> &bits);
+
+    /// Enable IO Bitmaps
+    ///
+    /// Allocates the IO bitmaps if needed, points the VMCS at them and
+    /// enables IO bitmap exiting.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_io_bitmaps();
+
+    /// Trap IO
+    ///
+    /// @expects enable_io_bitmaps() has been called
+    /// @ensures
+    ///
+    /// @param port the port to trap
+    ///
+    void trap_io(uint64_t port);
+
+    /// Pass Through IO
+    ///
+    /// @expects enable_io_bitmaps() has been called
+    /// @ensures
+    ///
+    /// @param port the port to stop trapping
+    ///
+    void pass_through_io(uint64_t port);
+
+    /// Trap IO Range
+    ///
+    /// @expects enable_io_bitmaps() has been called
+    /// @ensures
+    ///
+    /// @param first the first port to trap
+    /// @param last the last port to trap (inclusive)
+    ///
+    void trap_io_range(uint64_t first, uint64_t last);
+
+    /// Pass Through IO Range
+    ///
+    /// @expects enable_io_bitmaps() has been called
+    /// @ensures
+    ///
+    /// @param first the first port to stop trapping
+    /// @param last the last port to stop trapping (inclusive)
+    ///
+    void pass_through_io_range(uint64_t first, uint64_t last);
+
+    /// Fill IO Bitmaps
+    ///
+    /// @expects enable_io_bitmaps() has been called
+    /// @ensures
+    ///
+    /// @param value the value to fill each byte with
+    ///
+    void fill_io_bitmap(uint8_t value);
+
+    /// Is Shared
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if this vCPU is still using its group's policy
+    ///
+    bool is_shared() const noexcept
+    { return m_private.get() != m_policy; }
+
+    /// Policy
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the bitmaps currently in use by this vCPU
+    ///
+    gsl::not_null<const bitmap_policy *> policy() const noexcept
+    { return m_policy; }
+
+    /// Memory Usage
+    ///
+    /// Adds the MSR and IO bitmaps in use by this vCPU to usage. Bitmaps
+    /// still shared with the vCPU's group are reported as shared_bitmaps
+    /// so that callers summing several vCPUs can count them once.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add the memory used by the bitmaps
+    ///
+    void memory_usage(memory_usage_t &usage) const noexcept
+    {
+        auto bytes =
+            m_policy->msr_bitmap().size() +
+            m_policy->io_bitmap_a().size() +
+            m_policy->io_bitmap_b().size();
+
+        if (this->is_shared()) {
+            usage.shared_bitmaps += static_cast<uint64_t>(bytes);
+        }
+        else {
+            usage.bitmaps += static_cast<uint64_t>(bytes);
+        }
+    }
+
+private:
+
+    void change_msr_range(const std::pair<uint64_t, uint64_t> &bits, bool trap);
+    void change_io_range(uint64_t first, uint64_t last, bool trap);
+
+    gsl::not_null<bitmap_policy *> writable();
+    void make_private();
+    void set_vmcs_addresses();
+
+private:
+
+    bitmap_policy *m_policy;
+    std::unique_ptr<bitmap_policy> m_private;
+
+    bool m_io_enabled{false};
+
+public:
+
+    /// @cond
+
+    vcpu_bitmaps(vcpu_bitmaps &&) = delete;
+    vcpu_bitmaps &operator=(vcpu_bitmaps &&) = delete;
+
+    vcpu_bitmaps(const vcpu_bitmaps &) = delete;
+    vcpu_bitmaps &operator=(const vcpu_bitmaps &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
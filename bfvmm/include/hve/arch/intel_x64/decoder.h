@@ -0,0 +1,427 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef DECODER_INTEL_X64_EAPIS_H
+#define DECODER_INTEL_X64_EAPIS_H
+
+#include "base.h"
+
+#include <bfcapstone.h>
+#include <bfmovdecoder.h>
+#include <bfupperlower.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class guest_memory;
+
+/// Decoded Instruction
+///
+/// The parts of a memory access instruction that are needed to emulate
+/// it: how long it is, how much memory it accesses, in which direction,
+/// and which register (or immediate) is on the other side.
+///
+struct decoded_insn_t {
+
+    /// Length
+    ///
+    /// The length of the instruction in bytes
+    ///
+    uint64_t len;
+
+    /// Size
+    ///
+    /// The number of bytes the instruction reads or writes
+    ///
+    uint64_t size;
+
+    /// Write
+    ///
+    /// True if the instruction stores to memory, false if it loads
+    ///
+    bool write;
+
+    /// Immediate
+    ///
+    /// True if the value being stored is an immediate (only valid if
+    /// write is true)
+    ///
+    bool imm;
+
+    /// Immediate Value
+    ///
+    /// The value being stored if imm is true
+    ///
+    uint64_t imm_val;
+
+    /// Register
+    ///
+    /// The register being loaded into, or stored from
+    ///
+    capstone::reg reg;
+};
+
+/// Instruction Cache
+///
+/// A small, direct-mapped cache of decoded instructions keyed by guest CR3
+/// and RIP. MMIO tends to be done by a handful of instructions (a driver's
+/// register accessors), so most exits hit the cache once it is warm.
+///
+/// Each entry also records the mode the instruction was decoded in and
+/// its bytes, and the bytes at RIP are compared with them on every hit, so
+/// code that is rewritten (or a CR3 that is reused) is decoded again
+/// instead of being emulated using a stale entry. invalidate_page() and
+/// invalidate_cr3() only free up the slots of entries that are known to
+/// be stale.
+///
+template<std::size_t N = 64>
+class insn_cache
+{
+    static_assert((N & (N - 1)) == 0, "N must be a power of 2");
+
+public:
+
+    /// Max Length
+    ///
+    /// The longest instruction the architecture allows
+    ///
+    static constexpr const uint64_t max_len = 15;
+
+    /// Find
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cr3 the guest's CR3
+    /// @param rip the guest's RIP
+    /// @param mode the mode the guest is executing in
+    /// @param bytes the instruction bytes at rip
+    /// @return returns the cached instruction, or nullptr on a miss
+    ///
+    const decoded_insn_t *find(
+        uint64_t cr3, uint64_t rip, cs_mode mode, gsl::span<const uint8_t> bytes) noexcept
+    {
+        auto &e = m_entries[index(cr3, rip)];
+
+        if (GSL_LIKELY(e.valid && e.cr3 == cr3 && e.rip == rip && e.mode == mode)) {
+            auto len = static_cast<std::ptrdiff_t>(e.insn.len);
+
+            if (GSL_LIKELY(bytes.size() >= len &&
+                           std::equal(bytes.begin(), bytes.begin() + len, e.bytes.begin()))) {
+                m_hits++;
+                return &e.insn;
+            }
+        }
+
+        m_misses++;
+        return nullptr;
+    }
+
+    /// Insert
+    ///
+    /// Replaces any entry that is already in the same slot.
+    ///
+    /// @expects insn.len <= max_len && insn.len <= bytes.size()
+    /// @ensures
+    ///
+    /// @param cr3 the guest's CR3
+    /// @param rip the guest's RIP
+    /// @param mode the mode the guest is executing in
+    /// @param bytes the instruction bytes at rip
+    /// @param insn the decoded instruction at rip
+    /// @return returns the cached copy of insn
+    ///
+    const decoded_insn_t *insert(
+        uint64_t cr3, uint64_t rip, cs_mode mode, gsl::span<const uint8_t> bytes,
+        const decoded_insn_t &insn)
+    {
+        auto len = static_cast<std::ptrdiff_t>(insn.len);
+        expects(insn.len <= max_len && len <= bytes.size());
+
+        auto &e = m_entries[index(cr3, rip)];
+        e = {true, cr3, rip, mode, {}, insn};
+
+        std::copy(bytes.begin(), bytes.begin() + len, e.bytes.begin());
+        return &e.insn;
+    }
+
+    /// Invalidate Page
+    ///
+    /// Removes every instruction that starts or ends in the page that
+    /// contains addr.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr a guest linear address in the page that was written
+    ///
+    void invalidate_page(uint64_t addr) noexcept
+    {
+        auto page = bfn::upper(addr, ::x64::pt::from);
+
+        for (auto &e : m_entries) {
+            auto first = bfn::upper(e.rip, ::x64::pt::from);
+            auto last = bfn::upper(e.rip + e.insn.len - 1, ::x64::pt::from);
+
+            if (first == page || last == page) {
+                e.valid = false;
+            }
+        }
+    }
+
+    /// Invalidate CR3
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cr3 removes every instruction cached for this CR3
+    ///
+    void invalidate_cr3(uint64_t cr3) noexcept
+    {
+        for (auto &e : m_entries) {
+            if (e.cr3 == cr3) {
+                e.valid = false;
+            }
+        }
+    }
+
+    /// Clear
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear() noexcept
+    {
+        for (auto &e : m_entries) {
+            e.valid = false;
+        }
+    }
+
+    /// Hits
+    ///
+    /// @return returns the number of lookups that were found in the cache
+    ///
+    uint64_t hits() const noexcept
+    { return m_hits; }
+
+    /// Misses
+    ///
+    /// @return returns the number of lookups that were not in the cache
+    ///
+    uint64_t misses() const noexcept
+    { return m_misses; }
+
+private:
+
+    static std::size_t index(uint64_t cr3, uint64_t rip) noexcept
+    { return ((rip ^ (rip >> 12) ^ (cr3 >> 12)) * 0x9E3779B97F4A7C15ULL) >> (64 - log2()); }
+
+    static constexpr uint64_t log2() noexcept
+    {
+        uint64_t n = 0;
+        while ((1ULL << n) < N) {
+            n++;
+        }
+
+        return n;
+    }
+
+    struct entry_t {
+        bool valid;
+        uint64_t cr3;
+        uint64_t rip;
+        cs_mode mode;
+        std::array<uint8_t, max_len> bytes;
+        decoded_insn_t insn;
+    };
+
+    std::array<entry_t, N> m_entries{};
+
+    uint64_t m_hits{0};
+    uint64_t m_misses{0};
+};
+
+/// Instruction Decoder
+///
+/// Decodes the instruction the guest is currently executing using
+/// capstone, so that memory accesses (e.g. MMIO) can be emulated.
+/// Decoded instructions are cached (see insn_cache), so capstone only has
+/// to run the first time a given instruction is seen.
+///
+/// Only MOV and MOVZX to / from memory are currently understood, which
+/// covers the register accessors of most device drivers. In 64 bit mode,
+/// the common encodings of these are decoded directly (see
+/// bfmovdecoder.h), and capstone is only used for the rest. Capstone is
+/// switched to the guest's mode (see guest_mode()) before it decodes.
+///
+/// The capstone handle is opened (with detail mode on) when the decoder
+/// is created, and capstone decodes into an instruction that is also
+/// allocated up front, so a decode does not allocate. Each vCPU owns its
+/// decoder, so none of this state is shared between vCPUs.
+///
+class EXPORT_EAPIS_HVE insn_decoder
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    insn_decoder();
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~insn_decoder();
+
+    /// Decode
+    ///
+    /// Decodes the instruction at the guest's current RIP.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vmcs the vmcs of the vCPU that exited
+    /// @return returns the decoded instruction, or nullptr if the
+    ///     instruction is not one the decoder understands
+    ///
+    const decoded_insn_t *decode(gsl::not_null<vmcs_t *> vmcs);
+
+    /// Decode (Bytes)
+    ///
+    /// Decodes the instruction in bytes, without using the cache. In 64
+    /// bit mode, the built in MOV decoder is tried first, and capstone is
+    /// only used if it does not recognize the instruction.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bytes the instruction bytes
+    /// @param rip the address of the instruction
+    /// @param insn where to store the decoded instruction
+    /// @param mode the mode the instruction is executing in (see
+    ///     guest_mode())
+    /// @return returns true if the instruction was decoded
+    ///
+    bool decode(
+        gsl::span<const uint8_t> bytes, uint64_t rip, decoded_insn_t &insn,
+        cs_mode mode = CS_MODE_64);
+
+    /// Guest Mode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns CS_MODE_64 if the guest is in IA-32e mode and CS.L
+    ///     is set, and otherwise CS_MODE_32 or CS_MODE_16 depending on
+    ///     CS.D
+    ///
+    static cs_mode guest_mode();
+
+    /// @cond
+
+    static void read_guest(uint64_t rip, uint64_t cr3, gsl::span<uint8_t> bytes);
+
+    /// @endcond
+
+    /// Cache
+    ///
+    /// @return returns the cache of decoded instructions
+    ///
+    insn_cache<> &cache() noexcept
+    { return m_cache; }
+
+    /// Set Guest Memory
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mem if not nullptr, the instruction bytes are read through
+    ///     mem's cache of mapped guest pages instead of mapping them on
+    ///     every decode
+    ///
+    void set_guest_memory(guest_memory *mem) noexcept
+    { m_guest_memory = mem; }
+
+    /// Heap Bytes
+    ///
+    /// @return returns the number of bytes this decoder uses, including
+    ///     the instruction capstone decodes into
+    ///
+    std::size_t heap_bytes() const noexcept
+    { return sizeof(insn_decoder) + sizeof(cs_insn) + sizeof(cs_detail); }
+
+    /// Fast Decodes
+    ///
+    /// @return returns the number of instructions decoded without
+    ///     capstone
+    ///
+    uint64_t fast_decodes() const noexcept
+    { return m_fast_decodes; }
+
+    /// Capstone Decodes
+    ///
+    /// @return returns the number of instructions that had to be
+    ///     disassembled by capstone
+    ///
+    uint64_t capstone_decodes() const noexcept
+    { return m_capstone_decodes; }
+
+private:
+
+    bool decode_capstone(
+        gsl::span<const uint8_t> bytes, uint64_t rip, decoded_insn_t &insn, cs_mode mode);
+
+private:
+
+    csh m_handle{};
+    cs_mode m_mode{CS_MODE_64};
+    cs_insn *m_insn{nullptr};
+    insn_cache<> m_cache;
+
+    guest_memory *m_guest_memory{nullptr};
+
+    uint64_t m_fast_decodes{0};
+    uint64_t m_capstone_decodes{0};
+
+public:
+
+    /// @cond
+
+    insn_decoder(insn_decoder &&) = delete;
+    insn_decoder &operator=(insn_decoder &&) = delete;
+
+    insn_decoder(const insn_decoder &) = delete;
+    insn_decoder &operator=(const insn_decoder &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
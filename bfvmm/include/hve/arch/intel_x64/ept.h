@@ -71,12 +71,286 @@ public:
     ///
     /// @param map A pointer to the map to set EPTP to. If the pointer is
     ///     a nullptr, EPT is disabled.
+    /// @param accessed_and_dirty if true, the hardware sets the accessed
+    ///     and dirty flags of the map's entries as the guest uses them
+    ///     (see ept::mmap::scan_accessed() and ept::mmap::scan_dirty()).
+    ///     The CPU must support EPT accessed and dirty flags.
     ///
-    void set_eptp(ept::mmap *map);
+    void set_eptp(ept::mmap *map, bool accessed_and_dirty = false);
+
+    /// Map
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the map currently loaded into EPTP (the active
+    ///     view if views have been added), or nullptr if EPT is disabled
+    ///
+    ept::mmap *map() const noexcept
+    { return m_map; }
+
+    /// Invalidate
+    ///
+    /// Invalidates the guest-physical and combined mappings derived from
+    /// the map currently loaded into EPTP using a single-context INVEPT,
+    /// instead of a global INVEPT which flushes the mappings of every
+    /// EPTP on this core. If the CPU does not support single-context
+    /// INVEPT (see is_invept_single_context_supported()), a global INVEPT
+    /// is used instead. If the map has not been modified since it was
+    /// last invalidated on this vCPU, the INVEPT is skipped entirely
+    /// unless it is forced. If EPT is disabled, this function does nothing.
+    ///
+    /// If views have been added, every view that has been modified is
+    /// invalidated, as the guest can switch to any of them without an exit.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param force if true, the INVEPT is executed even if the map has
+    ///     not been modified
+    /// @return Returns true if an INVEPT was executed, false otherwise
+    ///
+    bool invalidate(bool force = false);
+
+    /// Invalidations
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of INVEPTs executed by invalidate()
+    ///
+    uint64_t invalidations() const noexcept;
+
+    /// Invalidations Avoided
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of INVEPTs skipped by invalidate()
+    ///     because the map was not modified
+    ///
+    uint64_t invalidations_avoided() const noexcept;
+
+    /// Is Single-Context INVEPT Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the CPU supports single-context INVEPT
+    ///
+    static bool is_invept_single_context_supported();
+
+    /// Is All-Context INVEPT Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the CPU supports all-context INVEPT
+    ///
+    static bool is_invept_all_context_supported();
+
+public:
+
+    /// Max Views
+    ///
+    /// The number of entries in the EPTP list
+    ///
+    static constexpr const std::size_t max_views = 512;
+
+    /// Add View
+    ///
+    /// Adds map to this vCPU's EPTP list. The first time a view is added,
+    /// VMFUNC EPTP switching is enabled, which lets the guest switch
+    /// between views using VMFUNC (EAX = 0, ECX = index) without a VM exit.
+    ///
+    /// Once views have been added, use set_view() instead of set_eptp() so
+    /// that EPTP always matches an entry in the list.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param map the map to add. The map must remain valid for the life of
+    ///     this handler.
+    /// @param accessed_and_dirty if true, the hardware sets the accessed
+    ///     and dirty flags of the map's entries while this view is active
+    /// @return returns the index of the view. An exception is thrown if
+    ///     max_views views have already been added.
+    ///
+    std::size_t add_view(ept::mmap &map, bool accessed_and_dirty = false);
+
+    /// Set View
+    ///
+    /// Switches to the view at index from the VMM (e.g. while handling an
+    /// exit). Translations are tagged by EPTP, so no INVEPT is needed.
+    ///
+    /// @expects index < num_views()
+    /// @ensures
+    ///
+    /// @param index the index returned by add_view()
+    ///
+    void set_view(std::size_t index);
+
+    /// View
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the index of the active view. The guest may have
+    ///     changed it using VMFUNC since the last exit.
+    ///
+    std::size_t view() const;
+
+    /// Number of Views
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of views that have been added
+    ///
+    std::size_t num_views() const noexcept;
+
+public:
+
+    /// #VE Information
+    ///
+    /// The layout of the virtualization exception information area that
+    /// the CPU fills in before delivering a #VE to the guest
+    ///
+    struct ve_info_t {
+        uint32_t exit_reason;
+        uint32_t busy;
+        uint64_t exit_qualification;
+        uint64_t gla;
+        uint64_t gpa;
+        uint16_t eptp_index;
+    };
+
+    /// Enable #VE
+    ///
+    /// Enables delivery of convertible EPT violations to the guest as a
+    /// virtualization exception (vector 20), using a per-vCPU information
+    /// page allocated the first time this is called. An EPT violation is
+    /// only converted if the suppress #VE bit of the faulting entry is
+    /// clear (see ept::mmap::set_suppress_ve()) and the information page
+    /// is not busy. Everything else (including a second violation before
+    /// the guest has cleared busy) causes a normal VM exit, which is
+    /// handled by the EPT violation handlers as before.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_ve();
+
+    /// Disable #VE
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_ve();
+
+    /// #VE Information
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns this vCPU's #VE information area, or nullptr if
+    ///     enable_ve() has not been called. The guest maps the same page
+    ///     (see ve_info_phys()) and clears busy once it has handled a #VE.
+    ///
+    ve_info_t *ve_info() noexcept;
+
+    /// #VE Information (Physical Address)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the physical address of this vCPU's #VE
+    ///     information area, or 0 if enable_ve() has not been called
+    ///
+    uintptr_t ve_info_phys() const;
+
+public:
+
+    /// Is SPP Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the CPU supports sub-page write permissions
+    ///
+    static bool is_spp_supported();
+
+    /// Enable SPP
+    ///
+    /// Enables sub-page write permissions, pointing SPPTP at the SPPT of
+    /// the map currently loaded into EPTP (see
+    /// ept::mmap::set_sub_page_permissions()). Once enabled, SPPTP follows
+    /// set_eptp() and set_view(). A view switch done by the guest using
+    /// VMFUNC does not change SPPTP, so views that use SPP should agree on
+    /// the permissions of the pages they protect.
+    ///
+    /// @expects is_spp_supported()
+    /// @expects map() != nullptr
+    /// @ensures
+    ///
+    void enable_spp();
+
+    /// Disable SPP
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_spp();
+
+    /// Is SPP Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if enable_spp() has been called
+    ///
+    bool is_spp_enabled() const noexcept
+    { return m_spp; }
+
+    /// Memory Usage
+    ///
+    /// Adds the tables of the map set with set_eptp() and of every view
+    /// (a map used by several views is counted once), and the EPTP list
+    /// and #VE information pages, to usage.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add the memory used by EPT
+    ///
+    void memory_usage(memory_usage_t &usage) const;
+
+private:
+
+    bool invalidate_views(bool force);
+    void invept(uint64_t eptp);
 
 private:
 
     gsl::not_null<eapis_vcpu_global_state_t *> m_eapis_vcpu_global_state;
+    bool m_invept_single_context;
+
+    ept::mmap *m_map{nullptr};
+    uint64_t m_generation{};
+
+    struct view_t {
+        ept::mmap *map;
+        uint64_t generation;
+    };
+
+    std::vector<view_t> m_views;
+    std::unique_ptr<uint64_t, void(*)(void *)> m_eptp_list{nullptr, numa::free_page};
+    std::unique_ptr<ve_info_t, void(*)(void *)> m_ve_info{nullptr, numa::free_page};
+
+    uint64_t m_invalidations{};
+    uint64_t m_invalidations_avoided{};
+
+    bool m_spp{false};
 
 public:
 
@@ -21,6 +21,7 @@
 #define EPT_HELPERS_INTEL_X64_H
 
 #include "mmap.h"
+#include "overrides.h"
 #include "../mtrrs.h"
 
 namespace eapis
@@ -447,48 +448,64 @@ identity_map_convert_4k_to_2m(
 ///
 /// Adds a 1:1 map from the starting address to the ending address.
 /// This version incorporates the MTRRs, ensuring the cache type is set up
-/// properly in EPT. 2m granularity is always used unless the MTRRs define a
-/// range that is not on a 2m boundry in which case 4k is used. Regular RAM
-/// is likely to be mapped using 2m regions.
+/// properly in EPT. Each MTRR range is mapped using the largest page size
+/// its alignment allows (1g, then 2m, then 4k), so smaller pages are only
+/// used at MTRR boundaries. Regular RAM is likely to be mapped using 1g
+/// regions. The number of tables allocated at each level can be queried
+/// using mmap::pdpt_count(), mmap::pd_count() and mmap::pt_count().
 ///
 /// Note that this version should ALWAYS be used when creating an EPT memory
 /// map for the Host OS, as using EPT ignores the MTRRs which can cause
 /// corruption on the host OS.
 ///
+/// If overrides is given, the ranges it contains are mapped with their
+/// forced memory type (and ignore PAT bit) instead of the MTRRs' type.
+///
 /// @param map the map to apply the identity map too
 /// @param saddr the starting address for the map
 /// @param eaddr the ending address for the map
 /// @param attr the memory attributes to apply to the map
+/// @param overrides the memory type overrides to apply, or nullptr
 ///
 inline void
 identity_map(
     mmap &map,
     mmap::phys_addr_t saddr,
     mmap::phys_addr_t eaddr,
-    mmap::attr_type attr = mmap::attr_type::read_write_execute)
+    mmap::attr_type attr = mmap::attr_type::read_write_execute,
+    const memory_type_overrides *overrides = nullptr)
 {
     using namespace ::intel_x64::ept;
-    auto range = g_mtrrs->ranges().begin();
 
     expects(g_mtrrs->size() != 0);
     expects(bfn::lower(saddr, pd::from) == 0);
     expects(bfn::lower(eaddr, pd::from) == 0);
 
     while (saddr < eaddr) {
-        while (!range->contains(saddr)) {
-            range++;
+        const auto &range = g_mtrrs->find(saddr);
+        auto size = std::min(range.distance(saddr), eaddr - saddr);
+
+        if (overrides == nullptr || overrides->empty()) {
+            map.map_range(saddr, saddr, size, attr, range.type);
+            saddr += size;
+
+            continue;
         }
 
-        if (bfn::lower(saddr, pd::from) == 0 &&
-            std::min(range->distance(saddr), eaddr - saddr) >= pd::page_size
-           ) {
-            map.map_2m(saddr, saddr, attr, range->type);
-            saddr += pd::page_size;
+        size = std::min(size, overrides->next_boundary(saddr) - saddr);
+
+        if (auto o = overrides->find(saddr)) {
+            map.map_range(saddr, saddr, size, attr, o->type);
+
+            if (o->ignore_pat) {
+                map.set_memory_type(saddr, size, o->type, true);
+            }
         }
         else {
-            map.map_4k(saddr, saddr, attr, range->type);
-            saddr += pt::page_size;
+            map.map_range(saddr, saddr, size, attr, range.type);
         }
+
+        saddr += size;
     }
 }
 
@@ -496,9 +513,11 @@ identity_map(
 ///
 /// Adds a 1:1 map from 0 to the ending address.
 /// This version incorporates the MTRRs, ensuring the cache type is set up
-/// properly in EPT. 2m granularity is always used unless the MTRRs define a
-/// range that is not on a 2m boundry in which case 4k is used. Regular RAM
-/// is likely to be mapped using 2m regions.
+/// properly in EPT. Each MTRR range is mapped using the largest page size
+/// its alignment allows (1g, then 2m, then 4k), so smaller pages are only
+/// used at MTRR boundaries. Regular RAM is likely to be mapped using 1g
+/// regions. The number of tables allocated at each level can be queried
+/// using mmap::pdpt_count(), mmap::pd_count() and mmap::pt_count().
 ///
 /// Note that this version should ALWAYS be used when creating an EPT memory
 /// map for the Host OS, as using EPT ignores the MTRRs which can cause
@@ -507,13 +526,137 @@ identity_map(
 /// @param map the map to apply the identity map too
 /// @param eaddr the ending address for the map
 /// @param attr the memory attributes to apply to the map
+/// @param overrides the memory type overrides to apply, or nullptr
 ///
 inline void
 identity_map(
     mmap &map,
     mmap::phys_addr_t eaddr,
-    mmap::attr_type attr = mmap::attr_type::read_write_execute)
-{ identity_map(map, 0, eaddr, attr); }
+    mmap::attr_type attr = mmap::attr_type::read_write_execute,
+    const memory_type_overrides *overrides = nullptr)
+{ identity_map(map, 0, eaddr, attr, overrides); }
+
+/// Identity Map Part
+///
+/// Builds one of count parts of the identity map of [saddr, eaddr) (see
+/// identity_map()). The parts are split at 1g boundaries, so no two parts
+/// ever need the same PD or PT, and a part that is built in its own mmap
+/// does not touch any state shared with the other parts other than the
+/// MTRRs, which are only read. This allows the parts of a large map to be
+/// built on several cores (or host threads) at once, after which they are
+/// combined using mmap::merge(). Note that small ranges (or large counts)
+/// may leave some of the parts empty.
+///
+/// Example:
+/// @code
+/// // on each of n cores, with i the index of the core
+/// ept::identity_map_part(parts[i], 0, eaddr, i, n);
+///
+/// // once every part is built, on one core
+/// for (auto &part : parts) {
+///     map.merge(part);
+/// }
+/// @endcode
+///
+/// @expects index < count
+///
+/// @param map the map to apply the part of the identity map to
+/// @param saddr the starting address for the whole map
+/// @param eaddr the ending address for the whole map
+/// @param index the part to build
+/// @param count the number of parts the map is split into
+/// @param attr the memory attributes to apply to the map
+/// @param overrides the memory type overrides to apply, or nullptr
+///
+inline void
+identity_map_part(
+    mmap &map,
+    mmap::phys_addr_t saddr,
+    mmap::phys_addr_t eaddr,
+    std::size_t index,
+    std::size_t count,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute,
+    const memory_type_overrides *overrides = nullptr)
+{
+    using namespace ::intel_x64::ept;
+
+    expects(index < count);
+
+    auto boundary = [&](std::size_t i) {
+        if (i == count) {
+            return eaddr;
+        }
+
+        auto addr = bfn::upper(saddr + (((eaddr - saddr) / count) * i), pdpt::from);
+        return std::min(std::max(addr, saddr), eaddr);
+    };
+
+    auto first = boundary(index);
+    auto last = boundary(index + 1);
+
+    if (first < last) {
+        identity_map(map, first, last, attr, overrides);
+    }
+}
+
+/// Apply Memory Type Overrides
+///
+/// Forces the memory type of every range in overrides in a map that has
+/// already been built (see mmap::set_memory_type()). Large pages are only
+/// split where an override does not cover them completely.
+///
+/// @expects every override is mapped in map
+///
+/// @param map the map to apply the overrides to
+/// @param overrides the memory type overrides to apply
+/// @return returns the ranges whose memory type changed. If this is not
+///     empty, the map needs to be invalidated.
+///
+inline std::vector<mmap::range_t>
+apply_memory_type_overrides(mmap &map, const memory_type_overrides &overrides)
+{
+    std::vector<mmap::range_t> changed;
+
+    for (const auto &range : overrides.ranges()) {
+        auto ranges = map.set_memory_type(range.base, range.size, range.type, range.ignore_pat);
+        changed.insert(changed.end(), ranges.begin(), ranges.end());
+    }
+
+    return changed;
+}
+
+/// Restore Memory Types
+///
+/// Sets the memory type of [saddr, eaddr) back to what the MTRRs give it,
+/// and clears the ignore PAT bit (e.g. once an override is removed).
+///
+/// @expects [saddr, eaddr) is mapped in map, and is 4k aligned
+///
+/// @param map the map to restore the memory types of
+/// @param saddr the starting address of the range
+/// @param eaddr the ending address of the range
+/// @return returns the ranges whose memory type changed. If this is not
+///     empty, the map needs to be invalidated.
+///
+inline std::vector<mmap::range_t>
+restore_memory_types(mmap &map, mmap::phys_addr_t saddr, mmap::phys_addr_t eaddr)
+{
+    expects(g_mtrrs->size() != 0);
+
+    std::vector<mmap::range_t> changed;
+
+    while (saddr < eaddr) {
+        const auto &range = g_mtrrs->find(saddr);
+        auto size = std::min(range.distance(saddr), eaddr - saddr);
+
+        auto ranges = map.set_memory_type(saddr, size, range.type, false);
+        changed.insert(changed.end(), ranges.begin(), ranges.end());
+
+        saddr += size;
+    }
+
+    return changed;
+}
 
 }
 }
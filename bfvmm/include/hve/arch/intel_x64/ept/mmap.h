@@ -19,7 +19,13 @@
 #ifndef EPT_MMAP_INTEL_X64_H
 #define EPT_MMAP_INTEL_X64_H
 
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
 
 #include <bfgsl.h>
 #include <bfdebug.h>
@@ -27,6 +33,9 @@
 #include <intrinsics.h>
 #include <bfvmm/memory_manager/memory_manager.h>
 
+#include "../numa.h"
+#include "sppt.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -113,6 +122,40 @@ public:
         m_pml4{allocate_span(::intel_x64::ept::pml4::num_entries), 0}
     { }
 
+    /// Constructor (Pooled)
+    ///
+    /// Creates a map whose page tables are allocated from a per-map pool
+    /// instead of from the global page allocator. The provided number of
+    /// table pages are allocated, and their physical addresses translated,
+    /// up front. Creating a table is then just a pop from the pool, tables
+    /// that are released are returned to the pool instead of the heap, and
+    /// destroying the map releases every pool page in a single pass without
+    /// walking the page tables. If the pool runs dry, it grows a page at a
+    /// time.
+    ///
+    /// @note Pooled maps cannot share page tables with other maps (see
+    ///     share()) as the pool owns every table it hands out.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param pool_size the number of table pages to allocate up front
+    /// @param node the NUMA node to allocate the pool on (see set_node())
+    ///
+    explicit mmap(size_type pool_size, numa::node_t node = numa::any_node) :
+        m_node{node},
+        m_pml4{allocate_span(::intel_x64::ept::pml4::num_entries), 0},
+        m_pooled{true}
+    {
+        m_pool.reserve(pool_size);
+        m_pool_free.reserve(pool_size);
+
+        for (size_type i = 0; i < pool_size; i++) {
+            m_pool.push_back(this->allocate_page(::intel_x64::ept::pt::num_entries));
+            m_pool_free.push_back(m_pool.back());
+        }
+    }
+
     /// Destructor
     ///
     /// @expects
@@ -120,6 +163,15 @@ public:
     ///
     ~mmap()
     {
+        if (m_pooled) {
+            for (const auto &table : m_pool) {
+                numa::free_page(table.virt_addr.data());
+            }
+
+            numa::free_page(m_pml4.virt_addr.data());
+            return;
+        }
+
         for (auto pml4i = 0; pml4i < ::intel_x64::ept::pml4::num_entries; pml4i++) {
             auto &entry = m_pml4.virt_addr.at(pml4i);
 
@@ -130,7 +182,13 @@ public:
             this->clear_pdpt(pml4i);
         }
 
-        free_page(m_pml4.virt_addr.data());
+        if (m_sync) {
+            for (const auto &retired : m_sync->retired) {
+                this->free_table(retired.table);
+            }
+        }
+
+        numa::free_page(m_pml4.virt_addr.data());
     }
 
     /// EPTP
@@ -168,6 +226,7 @@ public:
         attr_type attr = attr_type::read_write_execute,
         memory_type cache = memory_type::write_back)
     {
+        write_guard guard(this);
         this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
         return this->map_pdpte(virt_addr, phys_addr, attr, cache);
     }
@@ -213,6 +272,7 @@ public:
         attr_type attr = attr_type::read_write_execute,
         memory_type cache = memory_type::write_back)
     {
+        write_guard guard(this);
         this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
         this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
 
@@ -260,6 +320,7 @@ public:
         attr_type attr = attr_type::read_write_execute,
         memory_type cache = memory_type::write_back)
     {
+        write_guard guard(this);
         this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
         this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
         this->map_pt(::intel_x64::ept::pd::index(virt_addr));
@@ -289,6 +350,272 @@ public:
         return map_4k(reinterpret_cast<virt_addr_t *>(virt_addr), phys_addr, attr, cache);
     }
 
+    /// Map Virt Address Range to Phys Address Range
+    ///
+    /// Maps [virt_addr, virt_addr + size) to [phys_addr, phys_addr + size)
+    /// using the largest page size that the alignment of both addresses and
+    /// the remaining size allow. Unlike calling map_1g / map_2m / map_4k in a
+    /// loop, each table is located once, and consecutive entries within that
+    /// table are filled in a single pass, so the cost of this function is
+    /// proportional to the number of tables touched, and not the number of
+    /// pages mapped.
+    ///
+    /// @expects virt_addr, phys_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to map from
+    /// @param phys_addr the physical address to map to
+    /// @param size the number of bytes to map
+    /// @param attr the map permissions
+    /// @param cache the memory type for the mapping
+    ///
+    void
+    map_range(
+        virt_addr_t virt_addr,
+        phys_addr_t phys_addr,
+        size_type size,
+        attr_type attr = attr_type::read_write_execute,
+        memory_type cache = memory_type::write_back)
+    {
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(phys_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+
+        write_guard guard(this);
+        auto eaddr = virt_addr + size;
+
+        while (virt_addr < eaddr) {
+            this->map_pdpt(
+                ::intel_x64::ept::pml4::index(
+                    reinterpret_cast<virt_addr_t *>(virt_addr)
+                )
+            );
+
+            this->map_range_pdpt(virt_addr, phys_addr, eaddr, attr, cache);
+        }
+    }
+
+    /// Map MMIO Range
+    ///
+    /// Maps [virt_addr, virt_addr + size) to [phys_addr, phys_addr + size)
+    /// as an emulated device region. The entries are deliberately
+    /// misconfigured (write access without read access, which the
+    /// processor rejects), so that every access to the region exits with
+    /// an EPT misconfiguration instead of an EPT violation. A
+    /// misconfiguration exit skips the permission checks and the
+    /// exit qualification, and is handed straight to
+    /// ept_misconfiguration_handler's MMIO fast path (see
+    /// apis::enable_mmio_fast_path()) instead of walking the EPT
+    /// violation handlers.
+    ///
+    /// @expects virt_addr, phys_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to map from
+    /// @param phys_addr the physical address to map to
+    /// @param size the number of bytes to map
+    ///
+    void
+    map_mmio(
+        virt_addr_t virt_addr,
+        phys_addr_t phys_addr,
+        size_type size)
+    {
+        this->map_range(
+            virt_addr, phys_addr, size,
+            attr_type::write_only, memory_type::uncacheable
+        );
+    }
+
+    /// Compact Virt Address Range
+    ///
+    /// Collapses page tables in [virt_addr, virt_addr + size) back into
+    /// large pages. A PT is replaced with a 2m entry (and a PD with a 1g
+    /// entry) if every entry in the table is present, the entries map
+    /// physically contiguous and suitably aligned memory, and they all have
+    /// the same permissions and memory type. Entries with sub-page write
+    /// permissions, or with a suppress #VE bit that differs from the map's
+    /// default (see set_default_suppress_ve()), are never collapsed, as
+    /// these are set per page. The accessed and dirty flags of the collapsed entries
+    /// are merged. The tables that are no longer needed are given back to
+    /// the heap. Tables that are shared with another map (see share()) are
+    /// only copied if something in them is actually collapsed.
+    ///
+    /// This undoes the fragmentation left behind by protect() (or the
+    /// identity_map_convert_* helpers) once a region's permissions have
+    /// been restored. It does not need to run on the vCPU that uses the
+    /// map, so it can be done on demand or in small pieces from an idle
+    /// vCPU, as long as the map is invalidated afterwards (the generation
+    /// is bumped).
+    ///
+    /// @expects virt_addr and size are 2m aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to start from
+    /// @param size the number of bytes to compact
+    /// @return returns the number of tables that were freed
+    ///
+    size_type
+    compact(virt_addr_t virt_addr, size_type size)
+    {
+        using namespace ::intel_x64::ept;
+
+        expects(bfn::lower(virt_addr, pd::from) == 0);
+        expects(bfn::lower(size, pd::from) == 0);
+
+        write_guard guard(this);
+
+        size_type freed = 0;
+        auto eaddr = virt_addr + size;
+
+        while (virt_addr < eaddr) {
+            auto ptr = reinterpret_cast<virt_addr_t *>(virt_addr);
+            auto next = bfn::upper(virt_addr, pdpt::from) + pdpt::page_size;
+
+            auto pml4e = m_pml4.virt_addr.at(pml4::index(ptr));
+
+            if (pml4e == 0) {
+                virt_addr = bfn::upper(virt_addr, pml4::from) + (1ULL << pml4::from);
+                continue;
+            }
+
+            auto pdpte = table_virt(pml4::entry::phys_addr::get(pml4e))[pdpt::index(ptr)];
+
+            if (pdpte != 0 && pdpt::entry::ps::is_disabled(pdpte)) {
+                freed += this->compact_pd(virt_addr, std::min(next, eaddr));
+            }
+
+            virt_addr = next;
+        }
+
+        return freed;
+    }
+
+    /// Compact
+    ///
+    /// Compacts the whole map (see compact(virt_addr, size))
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of tables that were freed
+    ///
+    size_type
+    compact()
+    {
+        using namespace ::intel_x64::ept;
+
+        size_type freed = 0;
+        for (auto pml4i = 0; pml4i < pml4::num_entries; pml4i++) {
+            if (m_pml4.virt_addr.at(pml4i) != 0) {
+                auto virt_addr = static_cast<virt_addr_t>(pml4i) << pml4::from;
+                freed += this->compact(virt_addr, 1ULL << pml4::from);
+            }
+        }
+
+        return freed;
+    }
+
+    /// Protected Range
+    ///
+    /// A range of the map whose permissions were changed by protect()
+    ///
+    struct range_t {
+        virt_addr_t virt_addr;
+        size_type size;
+    };
+
+    /// Protect Virt Address Range
+    ///
+    /// Changes the permissions of every page in [virt_addr, virt_addr + size)
+    /// to attr. Large pages that are only partly covered by the range are
+    /// split (1g into 2m, 2m into 4k) while keeping their memory type and
+    /// other attributes, so only the edges of the range change granularity.
+    /// Large pages that are completely covered are updated in place, and
+    /// consecutive entries within a table are updated in a single pass.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @expects [virt_addr, virt_addr + size) is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to start from
+    /// @param size the number of bytes to protect
+    /// @param attr the new map permissions
+    /// @return returns the ranges whose permissions actually changed,
+    ///     merged where they are contiguous. If this is empty, nothing
+    ///     needs to be invalidated.
+    ///
+    std::vector<range_t>
+    protect(virt_addr_t virt_addr, size_type size, attr_type attr)
+    {
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+
+        write_guard guard(this);
+        std::vector<range_t> changed;
+
+        auto update = [attr](entry_type entry) {
+            return with_attr(entry, attr);
+        };
+
+        auto eaddr = virt_addr + size;
+        while (virt_addr < eaddr) {
+            virt_addr += this->update_entry(virt_addr, eaddr, update, changed);
+        }
+
+        return changed;
+    }
+
+    /// Ignore PAT Mask
+    ///
+    /// Bit 6 of an EPT entry that maps a page. If set, the memory type in
+    /// the entry is used as is, instead of being combined with the
+    /// guest's PAT.
+    ///
+    static constexpr const entry_type ignore_pat_mask = 0x0000000000000040ULL;
+
+    /// Set Memory Type of Virt Address Range
+    ///
+    /// Changes the memory type (and the ignore PAT bit) of every page in
+    /// [virt_addr, virt_addr + size), splitting large pages at the edges
+    /// of the range in the same way as protect(). This is how a memory
+    /// type override is applied to a map that has already been built (see
+    /// ept::apply_memory_type_overrides()).
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @expects [virt_addr, virt_addr + size) is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to start from
+    /// @param size the number of bytes to change
+    /// @param cache the new memory type
+    /// @param ignore_pat if true, the guest's PAT is ignored for the range
+    /// @return returns the ranges whose memory type actually changed,
+    ///     merged where they are contiguous. If this is empty, nothing
+    ///     needs to be invalidated.
+    ///
+    std::vector<range_t>
+    set_memory_type(
+        virt_addr_t virt_addr, size_type size, memory_type cache, bool ignore_pat = false)
+    {
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+
+        write_guard guard(this);
+        std::vector<range_t> changed;
+
+        auto update = [cache, ignore_pat](entry_type entry) {
+            return with_memory_type(entry, cache, ignore_pat);
+        };
+
+        auto eaddr = virt_addr + size;
+        while (virt_addr < eaddr) {
+            virt_addr += this->update_entry(virt_addr, eaddr, update, changed);
+        }
+
+        return changed;
+    }
+
     /// Unmap Virtual Address
     ///
     /// @expects
@@ -299,6 +626,7 @@ public:
     void
     unmap(virt_addr_t *virt_addr)
     {
+        write_guard guard(this);
         this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
         auto &pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
 
@@ -358,6 +686,7 @@ public:
     void
     release(virt_addr_t *virt_addr)
     {
+        write_guard guard(this);
         if (this->release_pdpte(virt_addr)) {
             m_pml4.virt_addr.at(::intel_x64::ept::pml4::index(virt_addr)) = 0;
         }
@@ -389,6 +718,51 @@ public:
     ///
     entry_type &
     entry(virt_addr_t *virt_addr)
+    {
+        write_guard guard(this);
+        return this->find_entry(virt_addr);
+    }
+
+    /// Virtual Address to Entry
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to be converted
+    /// @return returns entry for the map
+    ///
+    entry_type &entry(virt_addr_t virt_addr)
+    { return entry(reinterpret_cast<virt_addr_t *>(virt_addr)); }
+
+    /// Virtual Address to Entry Value
+    ///
+    /// Unlike entry(), this does not modify the map, so it does not take
+    /// the writer lock, does not bump the generation and (like
+    /// virt_to_phys()) is lock free once concurrent lookups are enabled.
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to be converted
+    /// @return returns a copy of the entry that maps virt_addr
+    ///
+    entry_type
+    entry_value(virt_addr_t virt_addr) const
+    {
+        uintptr_t from{};
+        auto entry = this->lookup(reinterpret_cast<virt_addr_t *>(virt_addr), from);
+
+        if (entry == 0) {
+            throw std::runtime_error("entry_value: virt_addr not mapped");
+        }
+
+        return entry;
+    }
+
+private:
+
+    entry_type &
+    find_entry(virt_addr_t *virt_addr)
     {
         this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
         auto &pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
@@ -422,16 +796,7 @@ public:
         return pte;
     }
 
-    /// Virtual Address to Entry
-    ///
-    /// @expects
-    /// @ensures
-    ///
-    /// @param virt_addr the virtual address to be converted
-    /// @return returns entry for the map
-    ///
-    entry_type &entry(virt_addr_t virt_addr)
-    { return entry(reinterpret_cast<virt_addr_t *>(virt_addr)); }
+public:
 
     /// Virtual Address to Physical Address
     ///
@@ -442,38 +807,25 @@ public:
     /// @return Returns the phys_addr for the map
     ///
     phys_addr_t
-    virt_to_phys(virt_addr_t *virt_addr)
+    virt_to_phys(virt_addr_t *virt_addr) const
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        auto pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
-
-        if (pdpte == 0) {
-            throw std::runtime_error("virt_to_phys: pdpte not mapped");
-        }
-
-        if (::intel_x64::ept::pdpt::entry::ps::is_enabled(pdpte)) {
-            return ::intel_x64::ept::pdpt::entry::phys_addr::get(pdpte);
-        }
-
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        auto pde = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        uintptr_t from{};
+        auto entry = this->lookup(virt_addr, from);
 
-        if (pde == 0) {
-            throw std::runtime_error("virt_to_phys: pde not mapped");
+        if (entry == 0) {
+            throw std::runtime_error("virt_to_phys: virt_addr not mapped");
         }
 
-        if (::intel_x64::ept::pd::entry::ps::is_enabled(pde)) {
-            return ::intel_x64::ept::pd::entry::phys_addr::get(pde);
-        }
+        switch (from) {
+            case ::intel_x64::ept::pdpt::from:
+                return ::intel_x64::ept::pdpt::entry::phys_addr::get(entry);
 
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-        auto pte = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+            case ::intel_x64::ept::pd::from:
+                return ::intel_x64::ept::pd::entry::phys_addr::get(entry);
 
-        if (pte == 0) {
-            throw std::runtime_error("virt_to_phys: pte not mapped");
+            default:
+                return ::intel_x64::ept::pt::entry::phys_addr::get(entry);
         }
-
-        return ::intel_x64::ept::pt::entry::phys_addr::get(pte);
     }
 
     /// Virtual Address to Physical Address
@@ -484,7 +836,7 @@ public:
     /// @param virt_addr the virtual address to be converted
     /// @return Returns the phys_addr for the map
     ///
-    phys_addr_t virt_to_phys(virt_addr_t virt_addr)
+    phys_addr_t virt_to_phys(virt_addr_t virt_addr) const
     { return virt_to_phys(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
     /// Virtual Address to From
@@ -496,38 +848,15 @@ public:
     /// @return returns page size of the mapping (i.e. from)
     ///
     auto
-    from(virt_addr_t *virt_addr)
+    from(virt_addr_t *virt_addr) const
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        auto pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
-
-        if (pdpte == 0) {
-            throw std::runtime_error("from: pdpte not mapped");
-        }
-
-        if (::intel_x64::ept::pdpt::entry::ps::is_enabled(pdpte)) {
-            return ::intel_x64::ept::pdpt::from;
-        }
-
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        auto pde = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
-
-        if (pde == 0) {
-            throw std::runtime_error("from: pde not mapped");
-        }
-
-        if (::intel_x64::ept::pd::entry::ps::is_enabled(pde)) {
-            return ::intel_x64::ept::pd::from;
-        }
+        uintptr_t from{};
 
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-        auto pte = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
-
-        if (pte == 0) {
-            throw std::runtime_error("from: pte not mapped");
+        if (this->lookup(virt_addr, from) == 0) {
+            throw std::runtime_error("from: virt_addr not mapped");
         }
 
-        return ::intel_x64::ept::pt::from;
+        return from;
     }
 
     /// Virtual Address to From
@@ -538,7 +867,7 @@ public:
     /// @param virt_addr the virtual address to test
     /// @return returns page size of the mapping (i.e. from)
     ///
-    auto from(virt_addr_t virt_addr)
+    auto from(virt_addr_t virt_addr) const
     { return from(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
     /// Is 1g
@@ -550,7 +879,7 @@ public:
     /// @return returns true if the virtual address was mapped as 1g page,
     ///     false otherwise
     ///
-    inline auto is_1g(virt_addr_t *virt_addr)
+    inline auto is_1g(virt_addr_t *virt_addr) const
     { return from(virt_addr) == ::intel_x64::ept::pdpt::from; }
 
     /// Is 1g
@@ -562,7 +891,7 @@ public:
     /// @return returns true if the virtual address was mapped as 1g page,
     ///     false otherwise
     ///
-    inline auto is_1g(virt_addr_t virt_addr)
+    inline auto is_1g(virt_addr_t virt_addr) const
     { return is_1g(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
     /// Is 2m
@@ -574,7 +903,7 @@ public:
     /// @return returns true if the virtual address was mapped as 2m page,
     ///     false otherwise
     ///
-    inline auto is_2m(virt_addr_t *virt_addr)
+    inline auto is_2m(virt_addr_t *virt_addr) const
     { return from(virt_addr) == ::intel_x64::ept::pd::from; }
 
     /// Is 2m
@@ -586,7 +915,7 @@ public:
     /// @return returns true if the virtual address was mapped as 2m page,
     ///     false otherwise
     ///
-    inline auto is_2m(virt_addr_t virt_addr)
+    inline auto is_2m(virt_addr_t virt_addr) const
     { return is_2m(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
     /// Is 4k
@@ -598,7 +927,7 @@ public:
     /// @return returns true if the virtual address was mapped as 4k page,
     ///     false otherwise
     ///
-    inline auto is_4k(virt_addr_t *virt_addr)
+    inline auto is_4k(virt_addr_t *virt_addr) const
     { return from(virt_addr) == ::intel_x64::ept::pt::from; }
 
     /// Is 4k
@@ -610,454 +939,2493 @@ public:
     /// @return returns true if the virtual address was mapped as 4k page,
     ///     false otherwise
     ///
-    inline auto is_4k(virt_addr_t virt_addr)
+    inline auto is_4k(virt_addr_t virt_addr) const
     { return is_4k(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
-private:
+    /// Scan Accessed Flags
+    ///
+    /// Reports which 4k pages in [virt_addr, virt_addr + size) have been
+    /// accessed by the guest, as tracked by the EPT accessed flags (which
+    /// must be enabled using set_eptp()). Bit n of the bitmap is set if the
+    /// page at virt_addr + (n * 4k) was accessed. Large pages report all of
+    /// their 4k pages that fall within the range. The scan only walks the
+    /// tables that are present, and skips any table whose parent entry has
+    /// not been accessed, so the cost is proportional to the part of the
+    /// range the guest actually touched.
+    ///
+    /// @note If clear is true, the flags are cleared as they are reported.
+    ///     Clearing a large page clears the flag for the entire large page,
+    ///     even if only part of it falls within the range. EPT must be
+    ///     invalidated (see apis::invalidate_ept()) before the guest is
+    ///     resumed for the hardware to set the flags again.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @expects bitmap holds at least one bit per 4k page in the range
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to start scanning from
+    /// @param size the number of bytes to scan
+    /// @param bitmap the bitmap to store the result in
+    /// @param clear if true, the accessed flags are cleared
+    /// @return Returns the number of 4k pages that were accessed
+    ///
+    size_type
+    scan_accessed(
+        virt_addr_t virt_addr, size_type size, gsl::span<uint64_t> bitmap,
+        bool clear = true)
+    { return this->scan(virt_addr, size, bitmap, accessed_flag, clear); }
 
-    gsl::span<virt_addr_t>
-    allocate_span(size_type num_entries)
-    {
-        return
-            gsl::make_span(
-                static_cast<virt_addr_t *>(alloc_page()),
-                num_entries
-            );
-    }
+    /// Scan Dirty Flags
+    ///
+    /// Identical to scan_accessed(), but reports (and optionally clears)
+    /// the EPT dirty flags, i.e. the 4k pages in the range that have been
+    /// written to by the guest. This provides dirty page logging (e.g.
+    /// for live migration) at the cost of a scan, instead of taking an
+    /// EPT violation on the first write to every page.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @expects bitmap holds at least one bit per 4k page in the range
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to start scanning from
+    /// @param size the number of bytes to scan
+    /// @param bitmap the bitmap to store the result in
+    /// @param clear if true, the dirty flags are cleared
+    /// @return Returns the number of 4k pages that are dirty
+    ///
+    size_type
+    scan_dirty(
+        virt_addr_t virt_addr, size_type size, gsl::span<uint64_t> bitmap,
+        bool clear = true)
+    { return this->scan(virt_addr, size, bitmap, dirty_flag, clear); }
 
-    pair
-    allocate(size_type num_entries)
+    /// Share
+    ///
+    /// Shares all of the page tables of the provided map with this map.
+    /// Once shared, both maps reference the same PDPT, PD and PT pages,
+    /// which are reference counted. When either map modifies an entry, only
+    /// the tables along the path to that entry are cloned (i.e. copy on
+    /// write), while all other tables remain shared. This provides a cheap
+    /// way to create several views of the same memory (e.g. one per vCPU).
+    ///
+    /// @note This function and the copy on write logic are thread safe with
+    ///     respect to the reference counts. A single map is still not safe
+    ///     to modify from more than one core at a time.
+    ///
+    /// Other's entries are marked as shared, so other's writer lock is
+    /// held, and its generation is bumped, while they are.
+    ///
+    /// @expects this map is empty
+    /// @expects neither map is pooled
+    /// @ensures
+    ///
+    /// @param other the map to share page tables with
+    ///
+    void
+    share(mmap &other)
     {
-        auto span =
-            gsl::make_span(
-                static_cast<virt_addr_t *>(alloc_page()),
-                num_entries
-            );
-
-        pair ptrs = {
-            span,
-            g_mm->virtptr_to_physint(
-                span.data()
-            )
-        };
+        expects(&other != this);
 
-        return ptrs;
-    }
+        write_guard guard(this);
+        write_guard other_guard(&other);
+        expects(m_num_pdpt == 0);
+        expects(!m_pooled && !other.m_pooled);
 
-    void
-    free(const gsl::span<virt_addr_t> &virt_addr)
-    { free_page(virt_addr.data()); }
+        for (auto pml4i = 0; pml4i < ::intel_x64::ept::pml4::num_entries; pml4i++) {
+            auto &entry = other.m_pml4.virt_addr.at(pml4i);
 
-private:
+            if (entry != 0) {
+                this->ref_table(::intel_x64::ept::pml4::entry::phys_addr::get(entry));
+                entry |= shared_mask;
+            }
 
-    pair
-    phys_to_pair(phys_addr_t phys_addr, size_type num_entries)
-    {
-        auto virt_addr =
-            static_cast<virt_addr_t *>(
-                g_mm->physint_to_virtptr(phys_addr)
-            );
+            m_pml4.virt_addr.at(pml4i) = entry;
+        }
 
-        return {
-            gsl::make_span<virt_addr_t>(virt_addr, num_entries),
-            phys_addr
-        };
+        m_num_pdpt = other.m_num_pdpt;
+        m_num_pd = other.m_num_pd;
+        m_num_pt = other.m_num_pt;
     }
 
+    /// Clear
+    ///
+    /// Unmaps everything, giving back every table this map owns. Tables
+    /// that are shared with another map (see share()) are only released
+    /// by this map, and stay with the other map. Afterwards, the map is
+    /// empty, so it can share another map again.
+    ///
+    /// @expects
+    /// @ensures pdpt_count() == 0, pd_count() == 0 and pt_count() == 0
+    ///
     void
-    map_pdpt(index_type pml4i)
+    clear()
     {
-        auto &entry = m_pml4.virt_addr.at(pml4i);
+        write_guard guard(this);
+
+        for (auto pml4i = 0; pml4i < ::intel_x64::ept::pml4::num_entries; pml4i++) {
+            auto &entry = m_pml4.virt_addr.at(pml4i);
+
+            if (entry == 0) {
+                continue;
+            }
+
+            this->clear_pdpt(pml4i);
+            entry = 0;
+        }
+
+        m_pdpt = {};
+        m_pd = {};
+        m_pt = {};
+
+        this->flush_walk_cache();
+    }
+
+    /// Clone
+    ///
+    /// Makes this map a private copy of the provided map. Unlike share(),
+    /// no tables are shared afterwards, so neither map pays for copy on
+    /// write later. Each table is duplicated using a single page copy, and
+    /// only the entries that reference other tables are rewritten, which is
+    /// far cheaper than building the map again (e.g. using identity_map()).
+    ///
+    /// @expects this map is empty
+    /// @expects other is not modified while it is being cloned
+    /// @ensures
+    ///
+    /// @param other the map to copy
+    ///
+    void
+    clone(const mmap &other)
+    {
+        using namespace ::intel_x64::ept;
+        this->clone(other, 0, pml4_entry_size * pml4::num_entries);
+    }
+
+    /// Clone (Range)
+    ///
+    /// Same as clone(), but only the part of the provided map that maps
+    /// [virt_addr, virt_addr + size) is copied, which is useful when a new
+    /// view only differs from (and needs) part of the original. Large
+    /// pages that cross the edges of the range are copied whole.
+    ///
+    /// @expects this map is empty
+    /// @expects other is not modified while it is being cloned
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param other the map to copy
+    /// @param virt_addr the first virtual address to copy
+    /// @param size the number of bytes to copy
+    ///
+    void
+    clone(const mmap &other, virt_addr_t virt_addr, size_type size)
+    {
+        using namespace ::intel_x64::ept;
+
+        write_guard guard(this);
+        expects(m_num_pdpt == 0);
+        expects(bfn::lower(virt_addr, pt::from) == 0);
+        expects(bfn::lower(size, pt::from) == 0);
+
+        auto eaddr = virt_addr + size;
+        auto pml4i = static_cast<index_type>(virt_addr / pml4_entry_size);
+
+        for (; pml4i < pml4::num_entries; pml4i++) {
+            auto base = static_cast<virt_addr_t>(pml4i) * pml4_entry_size;
+            auto entry = other.m_pml4.virt_addr.at(pml4i);
+
+            if (base >= eaddr) {
+                break;
+            }
+
+            if (entry != 0) {
+                auto table =
+                    this->clone_table(
+                        table_virt(pml4::entry::phys_addr::get(entry)),
+                        pdpt::from, base, virt_addr, eaddr
+                    );
+
+                pml4::entry::phys_addr::set(entry, table.phys_addr);
+                entry &= ~shared_mask;
+                m_num_pdpt++;
+            }
+
+            m_pml4.virt_addr.at(pml4i) = entry;
+        }
+    }
+
+    /// Extent
+    ///
+    /// A range of the map in which every page maps the next physical page
+    /// with the same permissions and memory type
+    ///
+    struct extent_t {
+        virt_addr_t virt_addr;
+        phys_addr_t phys_addr;
+        size_type size;
+        attr_type attr;
+        memory_type cache;
+
+        /// @cond
+
+        bool operator==(const extent_t &other) const noexcept
+        {
+            return virt_addr == other.virt_addr && phys_addr == other.phys_addr &&
+                   size == other.size && attr == other.attr && cache == other.cache;
+        }
+
+        bool operator!=(const extent_t &other) const noexcept
+        { return !(*this == other); }
+
+        /// @endcond
+    };
+
+    /// Extents
+    ///
+    /// Describes the map as a sorted list of extents. Neighboring leaves
+    /// are merged into one extent whenever they are contiguous (both
+    /// virtually and physically) and have the same permissions and memory
+    /// type, regardless of their page size, so an identity map of all of
+    /// memory is typically just a handful of extents. Since extent_t is
+    /// trivially copyable, the list can be saved and shipped as is, and
+    /// two maps can be compared by comparing their lists.
+    ///
+    /// @note The accessed / dirty flags and the suppress #VE bit are not
+    ///     part of an extent.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the extents of the map
+    ///
+    std::vector<extent_t>
+    extents() const
+    {
+        using namespace ::intel_x64::ept;
+        std::vector<extent_t> list;
+
+        for (auto pml4i = 0; pml4i < pml4::num_entries; pml4i++) {
+            auto entry = m_pml4.virt_addr.at(pml4i);
+
+            if (entry != 0) {
+                extents_table(
+                    table_virt(pml4::entry::phys_addr::get(entry)), pdpt::from,
+                    static_cast<virt_addr_t>(pml4i) << pml4::from, list
+                );
+            }
+        }
+
+        return list;
+    }
+
+    /// Restore
+    ///
+    /// Rebuilds a map from a list of extents (see extents()) using
+    /// map_range(), so every extent is mapped with the largest pages its
+    /// alignment allows. This is much cheaper than building the map from
+    /// scratch (e.g. identity_map() has to look up the memory type of
+    /// every range in the MTRRs).
+    ///
+    /// @expects this map is empty
+    /// @ensures
+    ///
+    /// @param list the extents to map
+    ///
+    void
+    restore(gsl::span<const extent_t> list)
+    {
+        expects(m_num_pdpt == 0);
+
+        for (const auto &extent : list) {
+            this->map_range(
+                extent.virt_addr, extent.phys_addr, extent.size, extent.attr, extent.cache
+            );
+        }
+    }
+
+    /// Merge
+    ///
+    /// Moves all of the page tables of the provided map into this map,
+    /// leaving the provided map empty. No table is copied: each PDPT of
+    /// other is either adopted as is (if this map has nothing mapped in
+    /// its 512g region), or its entries are moved into this map's PDPT.
+    ///
+    /// This is what allows a large map to be built in parallel: each core
+    /// (or host thread) builds a disjoint part of the map in its own mmap
+    /// (see identity_map_part()), without any locking, and the parts are
+    /// then merged into the final map one at a time.
+    ///
+    /// @expects the maps do not both map memory in the same 1g region
+    /// @expects neither map is pooled
+    /// @ensures other is empty
+    ///
+    /// @param other the map to move the page tables from
+    ///
+    void
+    merge(mmap &other)
+    {
+        using namespace ::intel_x64::ept;
+
+        write_guard guard(this);
+        write_guard other_guard(&other);
+        expects(!m_pooled && !other.m_pooled);
+
+        for (auto pml4i = 0; pml4i < pml4::num_entries; pml4i++) {
+            auto src = other.m_pml4.virt_addr.at(pml4i);
+            auto dst = m_pml4.virt_addr.at(pml4i);
+
+            if (src == 0 || dst == 0) {
+                continue;
+            }
+
+            auto src_pdpt = table_virt(pml4::entry::phys_addr::get(src));
+            auto dst_pdpt = table_virt(pml4::entry::phys_addr::get(dst));
+
+            for (auto pdpti = 0; pdpti < pdpt::num_entries; pdpti++) {
+                if (src_pdpt[pdpti] != 0 && dst_pdpt[pdpti] != 0) {
+                    throw std::runtime_error("merge: maps overlap");
+                }
+            }
+        }
+
+        this->flush_walk_cache();
+        other.flush_walk_cache();
+
+        for (auto pml4i = 0; pml4i < pml4::num_entries; pml4i++) {
+            auto &src = other.m_pml4.virt_addr.at(pml4i);
+
+            if (src == 0) {
+                continue;
+            }
+
+            if (m_pml4.virt_addr.at(pml4i) == 0) {
+                m_pml4.virt_addr.at(pml4i) = src;
+                m_num_pdpt++;
+            }
+            else {
+                this->map_pdpt(pml4i);
+                auto table = phys_to_pair(pml4::entry::phys_addr::get(src), pdpt::num_entries);
+
+                for (auto pdpti = 0; pdpti < pdpt::num_entries; pdpti++) {
+                    auto &entry = table.virt_addr.at(pdpti);
+
+                    if (entry != 0) {
+                        m_pdpt.virt_addr.at(pdpti) = entry;
+                        entry = 0;
+                    }
+                }
+
+                if (unref_table(table.phys_addr)) {
+                    other.free(table);
+                }
+            }
+
+            src = 0;
+        }
+
+        m_num_pd += other.m_num_pd;
+        m_num_pt += other.m_num_pt;
+
+        other.m_pdpt = {};
+        other.m_pd = {};
+        other.m_pt = {};
+
+        other.m_num_pdpt = 0;
+        other.m_num_pd = 0;
+        other.m_num_pt = 0;
+    }
+
+    /// Suppress #VE Mask
+    ///
+    /// Bit 63 of an EPT entry that maps a page. If set, EPT violations on
+    /// the page always cause a VM exit, even if #VE delivery is enabled.
+    ///
+    static constexpr const entry_type suppress_ve_mask = 0x8000000000000000ULL;
+
+    /// Set Suppress #VE
+    ///
+    /// Sets or clears the suppress #VE bit of the entry that maps
+    /// virt_addr. Pages with the bit clear have their EPT violations
+    /// delivered to the guest as a #VE when #VE delivery is enabled (see
+    /// ept_handler::enable_ve()), instead of causing a VM exit.
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page to change
+    /// @param suppress if true, EPT violations on the page are not
+    ///     converted into a #VE
+    ///
+    void
+    set_suppress_ve(virt_addr_t virt_addr, bool suppress)
+    {
+        write_guard guard(this);
+        auto &entry = this->find_entry(reinterpret_cast<virt_addr_t *>(virt_addr));
+
+        if (suppress) {
+            entry |= suppress_ve_mask;
+        }
+        else {
+            entry &= ~suppress_ve_mask;
+        }
+    }
+
+    /// Is Suppress #VE
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page to check
+    /// @return returns true if the suppress #VE bit of the entry that maps
+    ///     virt_addr is set
+    ///
+    bool
+    is_suppress_ve(virt_addr_t virt_addr) const
+    { return (this->entry_value(virt_addr) & suppress_ve_mask) != 0; }
+
+    /// Set Default Suppress #VE
+    ///
+    /// New maps start with the suppress #VE bit clear, which means that
+    /// once #VE delivery is enabled, every page is convertible. Set this
+    /// to true before mapping memory to start every new page with the bit
+    /// set instead, and then clear it (using set_suppress_ve()) on just
+    /// the pages the guest wants to handle itself.
+    ///
+    /// @note Existing entries are not changed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param suppress the value of the suppress #VE bit for new entries
+    ///
+    void
+    set_default_suppress_ve(bool suppress) noexcept
+    { m_suppress_ve = suppress ? suppress_ve_mask : 0; }
+
+    /// Sub-Page Write Permissions Bit
+    ///
+    /// Bit 61 of a 4k EPT entry. When it is set and the entry does not
+    /// allow writes, the CPU looks up the page's write permission vector
+    /// in the map's SPPT instead of causing an EPT violation.
+    ///
+    static constexpr const entry_type spp_mask = 0x2000000000000000ULL;
+
+    /// Set Sub-Page Permissions
+    ///
+    /// Write protects the 4k page that maps virt_addr at a 128 byte
+    /// granularity using sub-page write permissions (SPP). The write access
+    /// of the entry is removed and its SPP bit is set, so writes to a
+    /// writable sub-page complete without a VM exit, while writes to any
+    /// other sub-page cause an EPT violation (see
+    /// ept_violation_handler::is_sub_page_violation()). The map's SPPT is
+    /// created the first time this is called, and SPP has to be enabled on
+    /// each vCPU that uses the map (see ept_handler::enable_spp()).
+    ///
+    /// @note The SPPT belongs to this map, and is not copied by clone(),
+    ///     merge() or share().
+    ///
+    /// @expects virt_addr is mapped using a 4k page
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page to change
+    /// @param writable bit i allows the guest to write to bytes
+    ///     [i * 128, (i + 1) * 128) of the page
+    ///
+    void
+    set_sub_page_permissions(virt_addr_t virt_addr, uint32_t writable)
+    {
+        expects(this->is_4k(virt_addr));
+        this->sub_page_table()->set(virt_addr, writable);
+
+        write_guard guard(this);
+        auto &entry = this->find_entry(reinterpret_cast<virt_addr_t *>(virt_addr));
+
+        auto val = entry;
+        ::intel_x64::ept::pt::entry::write_access::disable(val);
+
+        entry = val | spp_mask;
+    }
+
+    /// Clear Sub-Page Permissions
+    ///
+    /// Clears the SPP bit of the entry that maps virt_addr. The page is
+    /// left write protected as a whole; restore its write access (e.g.
+    /// using protect()) if it should be writable again.
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page to change
+    ///
+    void
+    clear_sub_page_permissions(virt_addr_t virt_addr)
+    {
+        {
+            write_guard guard(this);
+            this->find_entry(reinterpret_cast<virt_addr_t *>(virt_addr)) &= ~spp_mask;
+        }
+
+        if (m_sppt) {
+            m_sppt->clear(virt_addr);
+        }
+    }
+
+    /// Sub-Page Permissions
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page to check
+    /// @return returns the writable sub-pages of the page (see
+    ///     set_sub_page_permissions()), or 0 if the page has none
+    ///
+    uint32_t
+    sub_page_permissions(virt_addr_t virt_addr) const
+    { return m_sppt ? m_sppt->get(virt_addr) : 0; }
+
+    /// Is Sub-Page Protected
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page to check
+    /// @return returns true if the SPP bit of the entry that maps
+    ///     virt_addr is set
+    ///
+    bool
+    is_sub_page_protected(virt_addr_t virt_addr) const
+    { return (this->entry_value(virt_addr) & spp_mask) != 0; }
+
+    /// Sub-Page Permission Table
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the map's SPPT, creating it (on the map's node) if
+    ///     this is the first time it is used
+    ///
+    gsl::not_null<sppt *>
+    sub_page_table()
+    {
+        if (!m_sppt) {
+            m_sppt = std::make_unique<sppt>(m_node);
+        }
+
+        return m_sppt.get();
+    }
+
+    /// SPPTP
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the value that should be written into the SPPTP
+    ///     VMCS field for this map
+    ///
+    uintptr_t spptp()
+    { return this->sub_page_table()->spptp(); }
+
+    /// Enable Concurrent Lookups
+    ///
+    /// Allows a map that is shared between vCPUs (e.g. using set_eptp() on
+    /// more than one vCPU) to be queried from all of them at the same time.
+    /// Once enabled, virt_to_phys(), from() and is_1g/2m/4k() are lock free
+    /// and can run on any number of cores, while the functions that modify
+    /// the map are serialized by a single writer lock. Leaf entries are
+    /// always published using a single store, and tables that are freed by
+    /// a writer are only returned to the heap once every reader that might
+    /// still reach them has finished (an epoch based grace period), so a
+    /// reader never walks into a table that has been released.
+    ///
+    /// @note The walk cache is not used for lookups once this is enabled.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void
+    enable_concurrent_lookups()
+    {
+        if (!m_sync) {
+            m_sync = std::make_unique<sync_t>();
+        }
+    }
+
+    /// Generation
+    ///
+    /// Every function that can modify the map (map_*, map_range, unmap,
+    /// release, entry, share and the scan_* functions when clearing)
+    /// increments the generation. Comparing the
+    /// generation against a previously saved value tells the caller whether
+    /// the map might have changed (and thus whether the TLB needs to be
+    /// flushed) since it last looked.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the current generation of the map
+    ///
+    uint64_t generation() const noexcept
+    { return m_generation; }
+
+    /// Set Node
+    ///
+    /// Sets the NUMA node the map's page tables are allocated on. By
+    /// default, they are allocated on the node of the core that allocates
+    /// them. A map should live on the node of the vCPUs that use it, as
+    /// every TLB miss walks its tables. A map that is used by vCPUs on more
+    /// than one node is best replicated once per node instead (e.g. using
+    /// clone() into a map whose node has been set).
+    ///
+    /// @expects this map is empty
+    /// @expects this map is not pooled (see mmap(size_type, numa::node_t))
+    /// @ensures
+    ///
+    /// @param node the node to allocate the map's tables on
+    ///
+    void
+    set_node(numa::node_t node)
+    {
+        expects(m_num_pdpt == 0);
+        expects(!m_pooled);
+
+        auto old = m_pml4;
+
+        m_node = node;
+        m_pml4 = {allocate_span(::intel_x64::ept::pml4::num_entries), 0};
+
+        numa::free_page(old.virt_addr.data());
+    }
+
+    /// Node
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the NUMA node hint of this map, or numa::any_node
+    ///     if its tables are allocated on the node of the allocating core
+    ///
+    numa::node_t node() const noexcept
+    { return m_node; }
+
+    /// Tables On Node
+    ///
+    /// Walks the map and counts the page tables (including the PML4) that
+    /// live on the provided NUMA node, which makes it possible to check
+    /// where a map (or a map shared with other maps) actually is.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param node the node to look for
+    /// @return returns the number of tables of this map on node
+    ///
+    size_type
+    tables_on_node(numa::node_t node) const
+    {
+        using namespace ::intel_x64::ept;
+
+        size_type count = numa::node_of(m_pml4.virt_addr.data()) == node ? 1 : 0;
+
+        for (auto pml4i = 0; pml4i < pml4::num_entries; pml4i++) {
+            auto entry = m_pml4.virt_addr.at(pml4i);
+
+            if (entry != 0) {
+                count += tables_on_node(
+                             table_virt(pml4::entry::phys_addr::get(entry)), pdpt::from, node
+                         );
+            }
+        }
+
+        return count;
+    }
+
+    /// PDPT Count
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of PDPT tables currently allocated by
+    ///     this map
+    ///
+    size_type pdpt_count() const noexcept
+    { return m_num_pdpt; }
+
+    /// PD Count
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of PD tables currently allocated by
+    ///     this map
+    ///
+    size_type pd_count() const noexcept
+    { return m_num_pd; }
+
+    /// PT Count
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of PT tables currently allocated by
+    ///     this map
+    ///
+    size_type pt_count() const noexcept
+    { return m_num_pt; }
+
+    /// Pool Free Count
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of pages in this map's pool that are not
+    ///     in use as a table (i.e. 0 unless the map was created with a
+    ///     pool)
+    ///
+    size_type pool_free_count() const noexcept
+    { return m_pool_free.size(); }
+
+    /// SPP Table Count
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of sub-page permission tables allocated
+    ///     by this map (without allocating the table, see sub_page_table())
+    ///
+    size_type spp_table_count() const noexcept
+    { return m_sppt ? m_sppt->num_tables() : 0; }
+
+private:
+
+    gsl::span<virt_addr_t>
+    allocate_span(size_type num_entries)
+    {
+        return
+            gsl::make_span(
+                static_cast<virt_addr_t *>(numa::alloc_page(m_node)),
+                num_entries
+            );
+    }
+
+    pair
+    allocate_page(size_type num_entries)
+    {
+        auto span =
+            gsl::make_span(
+                static_cast<virt_addr_t *>(numa::alloc_page(m_node)),
+                num_entries
+            );
+
+        pair ptrs = {
+            span,
+            g_mm->virtptr_to_physint(
+                span.data()
+            )
+        };
+
+        return ptrs;
+    }
+
+    pair
+    allocate(size_type num_entries)
+    {
+        if (!m_pooled) {
+            return this->allocate_page(num_entries);
+        }
+
+        if (m_pool_free.empty()) {
+            m_pool.push_back(this->allocate_page(num_entries));
+            return m_pool.back();
+        }
+
+        auto ptrs = m_pool_free.back();
+        m_pool_free.pop_back();
+
+        return ptrs;
+    }
+
+    void
+    free(const pair &table)
+    {
+        this->flush_walk_cache();
+
+        if (m_sync) {
+            m_sync->retired.push_back({table, m_sync->epoch.load()});
+            return;
+        }
+
+        this->free_table(table);
+    }
+
+    void
+    free_table(const pair &table)
+    {
+        if (!m_pooled) {
+            numa::free_page(table.virt_addr.data());
+            return;
+        }
+
+        std::fill(table.virt_addr.begin(), table.virt_addr.end(), 0);
+        m_pool_free.push_back(table);
+    }
+
+private:
+
+    // Lookup
+    //
+    // Walks the page tables without using (or modifying) the cursors that
+    // are used to modify the map. The table that holds the leaf entry for
+    // each 2m region is remembered in a small, direct mapped walk cache so
+    // that repeated lookups within the same region skip both the walk and
+    // the phys to virt translations. Cached tables are validated on each
+    // hit (a large page entry might have been split since it was cached),
+    // and the cache is flushed whenever a table is freed or cloned.
+    //
+    // When concurrent lookups are enabled, the walk cache is not used as it
+    // would be shared by all readers. Instead, the reader registers itself
+    // in the current epoch so that the writer knows when it is safe to
+    // reclaim freed tables (see reclaim()).
+    //
+
+    struct walk_cache_entry {
+        uintptr_t tag{};
+        virt_addr_t *table{};
+        uintptr_t from{};
+    };
+
+    entry_type
+    lookup(virt_addr_t *virt_addr, uintptr_t &from) const
+    {
+        using namespace ::intel_x64::ept;
+
+        if (m_sync) {
+            auto &readers = this->enter_epoch();
+
+            auto entry = this->walk(virt_addr, from, nullptr);
+            readers--;
+
+            return entry;
+        }
+
+        auto tag = reinterpret_cast<uintptr_t>(virt_addr) >> pd::from;
+        auto &cached = m_walk_cache.at(tag % m_walk_cache.size());
+
+        if (cached.table != nullptr && cached.tag == tag) {
+            switch (cached.from) {
+                case pdpt::from: {
+                    auto entry = cached.table[pdpt::index(virt_addr)];
+                    if (pdpt::entry::ps::is_enabled(entry)) {
+                        from = pdpt::from;
+                        return entry;
+                    }
+                    break;
+                }
+
+                case pd::from: {
+                    auto entry = cached.table[pd::index(virt_addr)];
+                    if (pd::entry::ps::is_enabled(entry)) {
+                        from = pd::from;
+                        return entry;
+                    }
+                    break;
+                }
+
+                default: {
+                    auto entry = cached.table[pt::index(virt_addr)];
+                    if (entry != 0) {
+                        from = pt::from;
+                        return entry;
+                    }
+                    return 0;
+                }
+            }
+        }
+
+        return this->walk(virt_addr, from, &cached);
+    }
+
+    // The epoch is checked again once the reader is counted. If a writer
+    // moved the epoch on in between, the reader might have been counted in
+    // a counter the writer is no longer watching, so it tries again.
+    //
+
+    std::atomic<uint64_t> &
+    enter_epoch() const
+    {
+        while (true) {
+            auto epoch = m_sync->epoch.load();
+            auto &readers = m_sync->readers.at(epoch & 1U);
+
+            readers++;
+            if (m_sync->epoch.load() == epoch) {
+                return readers;
+            }
+
+            readers--;
+        }
+    }
+
+    entry_type
+    walk(virt_addr_t *virt_addr, uintptr_t &from, walk_cache_entry *cached) const
+    {
+        using namespace ::intel_x64::ept;
+        auto tag = reinterpret_cast<uintptr_t>(virt_addr) >> pd::from;
+
+        auto pml4e = m_pml4.virt_addr.at(pml4::index(virt_addr));
+        if (pml4e == 0) {
+            return 0;
+        }
+
+        auto pdpt_table = table_virt(pml4::entry::phys_addr::get(pml4e));
+        auto pdpte = pdpt_table[pdpt::index(virt_addr)];
+
+        if (pdpte == 0) {
+            return 0;
+        }
+
+        if (pdpt::entry::ps::is_enabled(pdpte)) {
+            if (cached != nullptr) {
+                *cached = {tag, pdpt_table, pdpt::from};
+            }
+
+            from = pdpt::from;
+            return pdpte;
+        }
+
+        auto pd_table = table_virt(pdpt::entry::phys_addr::get(pdpte));
+        auto pde = pd_table[pd::index(virt_addr)];
+
+        if (pde == 0) {
+            return 0;
+        }
+
+        if (pd::entry::ps::is_enabled(pde)) {
+            if (cached != nullptr) {
+                *cached = {tag, pd_table, pd::from};
+            }
+
+            from = pd::from;
+            return pde;
+        }
+
+        auto pt_table = table_virt(pd::entry::phys_addr::get(pde));
+        auto pte = pt_table[pt::index(virt_addr)];
+
+        if (pte == 0) {
+            return 0;
+        }
+
+        if (cached != nullptr) {
+            *cached = {tag, pt_table, pt::from};
+        }
+
+        from = pt::from;
+        return pte;
+    }
+
+    static virt_addr_t *
+    table_virt(phys_addr_t phys_addr)
+    { return static_cast<virt_addr_t *>(g_mm->physint_to_virtptr(phys_addr)); }
+
+    void
+    flush_walk_cache() const
+    { m_walk_cache.fill({}); }
+
+    pair
+    phys_to_pair(phys_addr_t phys_addr, size_type num_entries)
+    {
+        auto virt_addr =
+            static_cast<virt_addr_t *>(
+                g_mm->physint_to_virtptr(phys_addr)
+            );
+
+        return {
+            gsl::make_span<virt_addr_t>(virt_addr, num_entries),
+            phys_addr
+        };
+    }
+
+    void
+    map_pdpt(index_type pml4i, bool cow = true)
+    {
+        auto &entry = m_pml4.virt_addr.at(pml4i);
 
         if (entry != 0) {
             auto phys_addr = ::intel_x64::ept::pml4::entry::phys_addr::get(entry);
 
-            if (m_pdpt.phys_addr == phys_addr) {
-                return;
-            }
+            if (m_pdpt.phys_addr != phys_addr) {
+                m_pdpt = phys_to_pair(phys_addr, ::intel_x64::ept::pdpt::num_entries);
+            }
+
+            if (cow && this->is_shared(entry, phys_addr)) {
+                m_pdpt = this->clone_pdpt(m_pdpt);
+
+                auto val = entry & ~shared_mask;
+                ::intel_x64::ept::pml4::entry::phys_addr::set(val, m_pdpt.phys_addr);
+
+                entry = val;
+            }
+
+            return;
+        }
+
+        m_pdpt = this->allocate(::intel_x64::ept::pdpt::num_entries);
+        m_num_pdpt++;
+
+        // The entry is built locally and published with a single store, so
+        // a concurrent lookup either sees no table, or a complete entry
+        //
+
+        entry_type val = 0;
+        ::intel_x64::ept::pml4::entry::phys_addr::set(val, m_pdpt.phys_addr);
+        ::intel_x64::ept::pml4::entry::read_access::enable(val);
+        ::intel_x64::ept::pml4::entry::write_access::enable(val);
+        ::intel_x64::ept::pml4::entry::execute_access::enable(val);
+
+        entry = val;
+    }
+
+    void
+    map_pd(index_type pdpti, bool cow = true)
+    {
+        auto &entry = m_pdpt.virt_addr.at(pdpti);
+
+        if (entry != 0) {
+            auto phys_addr = ::intel_x64::ept::pdpt::entry::phys_addr::get(entry);
+
+            if (m_pd.phys_addr != phys_addr) {
+                m_pd = phys_to_pair(phys_addr, ::intel_x64::ept::pd::num_entries);
+            }
+
+            if (cow && this->is_shared(entry, phys_addr)) {
+                m_pd = this->clone_pd(m_pd);
+
+                auto val = entry & ~shared_mask;
+                ::intel_x64::ept::pdpt::entry::phys_addr::set(val, m_pd.phys_addr);
+
+                entry = val;
+            }
+
+            return;
+        }
+
+        m_pd = this->allocate(::intel_x64::ept::pd::num_entries);
+        m_num_pd++;
+
+        entry_type val = 0;
+        ::intel_x64::ept::pdpt::entry::phys_addr::set(val, m_pd.phys_addr);
+        ::intel_x64::ept::pdpt::entry::read_access::enable(val);
+        ::intel_x64::ept::pdpt::entry::write_access::enable(val);
+        ::intel_x64::ept::pdpt::entry::execute_access::enable(val);
+
+        entry = val;
+    }
+
+    void
+    map_pt(index_type pdi, bool cow = true)
+    {
+        auto &entry = m_pd.virt_addr.at(pdi);
+
+        if (entry != 0) {
+            auto phys_addr = ::intel_x64::ept::pd::entry::phys_addr::get(entry);
+
+            if (m_pt.phys_addr != phys_addr) {
+                m_pt = phys_to_pair(phys_addr, ::intel_x64::ept::pt::num_entries);
+            }
+
+            if (cow && this->is_shared(entry, phys_addr)) {
+                m_pt = this->clone_pt(m_pt);
+
+                auto val = entry & ~shared_mask;
+                ::intel_x64::ept::pd::entry::phys_addr::set(val, m_pt.phys_addr);
+
+                entry = val;
+            }
+
+            return;
+        }
+
+        m_pt = this->allocate(::intel_x64::ept::pt::num_entries);
+        m_num_pt++;
+
+        entry_type val = 0;
+        ::intel_x64::ept::pd::entry::phys_addr::set(val, m_pt.phys_addr);
+        ::intel_x64::ept::pd::entry::read_access::enable(val);
+        ::intel_x64::ept::pd::entry::write_access::enable(val);
+        ::intel_x64::ept::pd::entry::execute_access::enable(val);
+
+        entry = val;
+    }
+
+    // Clear
+    //
+    // Gives up this map's reference to a table, and frees it (and the
+    // tables it references) if this map was its last owner. Otherwise, the
+    // tables it references are no longer reachable from this map either,
+    // so they are no longer counted by it. They are counted before the
+    // reference is given up, as the last owner may modify them in place
+    // once it has.
+    //
+
+    void
+    clear_pdpt(index_type pml4i)
+    {
+        this->map_pdpt(pml4i, false);
+
+        size_type num_pd = 0;
+        size_type num_pt = 0;
+
+        if ((m_pml4.virt_addr.at(pml4i) & shared_mask) != 0) {
+            this->count_pdpt(m_pdpt, num_pd, num_pt);
+        }
+
+        if (this->unref_table(m_pdpt.phys_addr)) {
+            for (auto pdpti = 0; pdpti < ::intel_x64::ept::pdpt::num_entries; pdpti++) {
+                auto &entry = m_pdpt.virt_addr.at(pdpti);
+
+                if (entry == 0) {
+                    continue;
+                }
+
+                if (::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
+                    this->clear_pd(pdpti);
+                }
+
+                entry = 0;
+            }
+
+            this->free(m_pdpt);
+        }
+        else {
+            m_num_pd -= num_pd;
+            m_num_pt -= num_pt;
+        }
+
+        m_pdpt = {};
+        m_num_pdpt--;
+    }
+
+    void
+    clear_pd(index_type pdpti)
+    {
+        this->map_pd(pdpti, false);
+
+        size_type num_pt = 0;
+
+        if ((m_pdpt.virt_addr.at(pdpti) & shared_mask) != 0) {
+            num_pt = count_pd(m_pd);
+        }
+
+        if (this->unref_table(m_pd.phys_addr)) {
+            for (auto pdi = 0; pdi < ::intel_x64::ept::pd::num_entries; pdi++) {
+                auto &entry = m_pd.virt_addr.at(pdi);
+
+                if (entry == 0) {
+                    continue;
+                }
+
+                if (::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
+                    this->clear_pt(pdi);
+                }
+
+                entry = 0;
+            }
+
+            this->free(m_pd);
+        }
+        else {
+            m_num_pt -= num_pt;
+        }
+
+        m_pd = {};
+        m_num_pd--;
+    }
+
+    void
+    clear_pt(index_type pdi)
+    {
+        this->map_pt(pdi, false);
+
+        if (this->unref_table(m_pt.phys_addr)) {
+            this->free(m_pt);
+        }
+
+        m_pt = {};
+        m_num_pt--;
+    }
+
+    static size_type
+    count_pd(const pair &pd)
+    {
+        size_type num_pt = 0;
+
+        for (const auto &entry : pd.virt_addr) {
+            if (entry != 0 && ::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
+                num_pt++;
+            }
+        }
+
+        return num_pt;
+    }
+
+    void
+    count_pdpt(const pair &pdpt, size_type &num_pd, size_type &num_pt)
+    {
+        for (const auto &entry : pdpt.virt_addr) {
+            if (entry != 0 && ::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
+                auto pd = this->phys_to_pair(
+                              ::intel_x64::ept::pdpt::entry::phys_addr::get(entry),
+                              ::intel_x64::ept::pd::num_entries
+                          );
+
+                num_pd++;
+                num_pt += count_pd(pd);
+            }
+        }
+    }
+
+    pair
+    copy_table(const pair &table)
+    {
+        auto ptrs = this->allocate(table.virt_addr.size());
+        this->flush_walk_cache();
+
+        std::copy(
+            table.virt_addr.begin(), table.virt_addr.end(), ptrs.virt_addr.begin()
+        );
+
+        return ptrs;
+    }
+
+    // Once a table is copied, the tables it references are referenced by
+    // both the copy and the original, so they are counted and flagged in
+    // both before the original is released. Otherwise, another map that
+    // is left as the only owner of the original could see them as private
+    // and modify them in place while the copy still references them.
+    //
+
+    pair
+    clone_pdpt(const pair &table)
+    {
+        auto ptrs = this->copy_table(table);
+
+        for (auto i = 0; i < ::intel_x64::ept::pdpt::num_entries; i++) {
+            auto &entry = ptrs.virt_addr.at(i);
+
+            if (entry != 0 && ::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
+                this->ref_table(::intel_x64::ept::pdpt::entry::phys_addr::get(entry));
+
+                entry |= shared_mask;
+                table.virt_addr.at(i) |= shared_mask;
+            }
+        }
+
+        this->unref_table(table.phys_addr);
+        return ptrs;
+    }
+
+    pair
+    clone_pd(const pair &table)
+    {
+        auto ptrs = this->copy_table(table);
+
+        for (auto i = 0; i < ::intel_x64::ept::pd::num_entries; i++) {
+            auto &entry = ptrs.virt_addr.at(i);
+
+            if (entry != 0 && ::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
+                this->ref_table(::intel_x64::ept::pd::entry::phys_addr::get(entry));
+
+                entry |= shared_mask;
+                table.virt_addr.at(i) |= shared_mask;
+            }
+        }
+
+        this->unref_table(table.phys_addr);
+        return ptrs;
+    }
+
+    pair
+    clone_pt(const pair &table)
+    {
+        auto ptrs = this->copy_table(table);
+
+        this->unref_table(table.phys_addr);
+        return ptrs;
+    }
+
+    // Tables On Node
+    //
+    // Counts the tables on node, starting with table (whose entries each
+    // map 1 << from bytes), and every table it references.
+    //
+
+    static size_type
+    tables_on_node(const virt_addr_t *table, uintptr_t from, numa::node_t node)
+    {
+        using namespace ::intel_x64::ept;
+
+        size_type count = numa::node_of(table) == node ? 1 : 0;
+
+        if (from == pt::from) {
+            return count;
+        }
+
+        for (auto i = 0; i < pt::num_entries; i++) {
+            auto entry = table[i];
+
+            if (entry != 0 && pd::entry::ps::is_disabled(entry)) {
+                count += tables_on_node(
+                             table_virt(pd::entry::phys_addr::get(entry)),
+                             from - (pdpt::from - pd::from), node
+                         );
+            }
+        }
+
+        return count;
+    }
+
+    // Clone Table
+    //
+    // Copies the entries of a table (whose entries each map 1 << from
+    // bytes, starting at base) that overlap [saddr, eaddr) into a new
+    // table. If the entire table is in the range, it is copied using a
+    // single page copy. The tables referenced by the copied entries are
+    // then cloned the same way, and the entries updated to point to the
+    // copies. The format of an entry that references a table (and of the
+    // PS bit) is the same at every level, so the PD definitions are used
+    // for all of them.
+    //
+
+    static constexpr const size_type pml4_entry_size =
+        1ULL << ::intel_x64::ept::pml4::from;
+
+    pair
+    clone_table(
+        const virt_addr_t *table, uintptr_t from, virt_addr_t base,
+        virt_addr_t saddr, virt_addr_t eaddr)
+    {
+        using namespace ::intel_x64::ept;
+
+        auto ptrs = this->allocate(pt::num_entries);
+        auto entry_size = 1ULL << from;
+
+        auto first = saddr > base ? (saddr - base) >> from : 0;
+        auto last = std::min<uint64_t>(
+                        pt::num_entries, ((eaddr - base) + entry_size - 1) >> from
+                    );
+
+        std::copy(table + first, table + last, ptrs.virt_addr.begin() + first);
+
+        if (from == pt::from) {
+            return ptrs;
+        }
+
+        for (auto i = first; i < last; i++) {
+            auto &entry = ptrs.virt_addr.at(static_cast<index_type>(i));
+
+            if (entry == 0 || pd::entry::ps::is_enabled(entry)) {
+                continue;
+            }
+
+            auto child =
+                this->clone_table(
+                    table_virt(pd::entry::phys_addr::get(entry)),
+                    from - (pdpt::from - pd::from), base + (i * entry_size), saddr, eaddr
+                );
+
+            pd::entry::phys_addr::set(entry, child.phys_addr);
+            entry &= ~shared_mask;
+
+            if (from == pdpt::from) {
+                m_num_pd++;
+            }
+            else {
+                m_num_pt++;
+            }
+        }
+
+        return ptrs;
+    }
+
+    // Extents
+    //
+    // Walks the leaves of a table (whose entries each map 1 << from bytes,
+    // starting at base) in order, extending the last extent in the list
+    // whenever a leaf continues it.
+    //
+
+    static attr_type
+    attr_of(entry_type entry)
+    {
+        using namespace ::intel_x64::ept::pt::entry;
+
+        auto r = read_access::is_enabled(entry);
+        auto w = write_access::is_enabled(entry);
+        auto x = execute_access::is_enabled(entry);
+
+        if (r && w && x) {
+            return attr_type::read_write_execute;
+        }
+
+        if (r && w) {
+            return attr_type::read_write;
+        }
+
+        if (r && x) {
+            return attr_type::read_execute;
+        }
+
+        if (w && x) {
+            throw std::runtime_error("attr_of: write / execute is not supported");
+        }
+
+        if (r) {
+            return attr_type::read_only;
+        }
+
+        if (w) {
+            return attr_type::write_only;
+        }
+
+        return x ? attr_type::execute_only : attr_type::none;
+    }
+
+    static void
+    extents_table(
+        const virt_addr_t *table, uintptr_t from, virt_addr_t base,
+        std::vector<extent_t> &list)
+    {
+        using namespace ::intel_x64::ept;
+
+        for (auto i = 0; i < pt::num_entries; i++) {
+            auto entry = table[i];
+            auto virt_addr = base + (static_cast<virt_addr_t>(i) << from);
+
+            if (entry == 0) {
+                continue;
+            }
+
+            if (from != pt::from && pd::entry::ps::is_disabled(entry)) {
+                extents_table(
+                    table_virt(pd::entry::phys_addr::get(entry)),
+                    from - (pdpt::from - pd::from), virt_addr, list
+                );
+
+                continue;
+            }
+
+            extent_t extent = {
+                virt_addr,
+                bfn::upper(pt::entry::phys_addr::get(entry), from),
+                1ULL << from,
+                attr_of(entry),
+                static_cast<memory_type>(pt::entry::memory_type::get(entry))
+            };
+
+            if (!list.empty()) {
+                auto &last = list.back();
+
+                if (last.virt_addr + last.size == extent.virt_addr &&
+                    last.phys_addr + last.size == extent.phys_addr &&
+                    last.attr == extent.attr && last.cache == extent.cache) {
+
+                    last.size += extent.size;
+                    continue;
+                }
+            }
+
+            list.push_back(extent);
+        }
+    }
+
+private:
+
+    // Shared Tables
+    //
+    // Tables that are referenced by more than one map are tracked here,
+    // keyed by their physical address, along with the number of maps that
+    // reference them. A table that is not in this list is owned by a single
+    // map and can be modified in place. The list is global as tables may be
+    // shared between maps owned by different vCPUs.
+    //
+    // Looking a table up in the list needs the lock, so every entry that
+    // references a table that might be shared is also flagged using a bit
+    // that the hardware ignores in non-leaf entries. The flag is set for
+    // every reference whenever the count of a table is raised, so a table
+    // whose entry is not flagged is private, which is checked without the
+    // lock on every walk that may modify the map. A flagged entry is only
+    // a hint, as the other references may have gone away since, in which
+    // case the list is checked and the flag is cleared.
+    //
+
+    static constexpr const entry_type shared_mask = 0x0000000000000800ULL;
+
+    static std::unordered_map<phys_addr_t, size_type> &
+    shared_tables()
+    {
+        static std::unordered_map<phys_addr_t, size_type> s_shared_tables;
+        return s_shared_tables;
+    }
+
+    static std::mutex &
+    shared_tables_mutex()
+    {
+        static std::mutex s_shared_tables_mutex;
+        return s_shared_tables_mutex;
+    }
+
+    static bool
+    is_shared_table(phys_addr_t phys_addr)
+    {
+        std::lock_guard<std::mutex> lock(shared_tables_mutex());
+        return shared_tables().count(phys_addr) != 0;
+    }
+
+    static bool
+    is_shared(entry_type &entry, phys_addr_t phys_addr)
+    {
+        if ((entry & shared_mask) == 0) {
+            return false;
+        }
+
+        if (is_shared_table(phys_addr)) {
+            return true;
+        }
+
+        entry &= ~shared_mask;
+        return false;
+    }
+
+    static void
+    ref_table(phys_addr_t phys_addr)
+    {
+        std::lock_guard<std::mutex> lock(shared_tables_mutex());
+        auto iter = shared_tables().find(phys_addr);
+
+        if (iter == shared_tables().end()) {
+            shared_tables()[phys_addr] = 2;
+            return;
+        }
+
+        iter->second++;
+    }
+
+    static bool
+    unref_table(phys_addr_t phys_addr)
+    {
+        std::lock_guard<std::mutex> lock(shared_tables_mutex());
+        auto iter = shared_tables().find(phys_addr);
+
+        if (iter == shared_tables().end()) {
+            return true;
+        }
+
+        if (--iter->second == 1) {
+            shared_tables().erase(iter);
+        }
+
+        return false;
+    }
+
+private:
+
+    entry_type &
+    map_pdpte(
+        virt_addr_t *virt_addr, phys_addr_t phys_addr,
+        attr_type attr, memory_type cache)
+    {
+        auto &slot = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+
+        if (slot != 0) {
+            throw std::runtime_error(
+                "map_pdpte: map failed, virt / phys map already exists: " +
+                bfn::to_string(phys_addr, 16)
+            );
+        }
+
+        entry_type entry = 0;
+        ::intel_x64::ept::pdpt::entry::phys_addr::set(entry, phys_addr);
+
+        switch (attr) {
+            case attr_type::none:
+                break;
+
+            case attr_type::read_only:
+                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
+                break;
+
+            case attr_type::write_only:
+                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
+                break;
+
+            case attr_type::execute_only:
+                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
+                break;
+
+            case attr_type::read_write:
+                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
+                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
+                break;
+
+            case attr_type::read_execute:
+                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
+                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
+                break;
+
+            case attr_type::read_write_execute:
+                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
+                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
+                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
+                break;
+        };
+
+        switch (cache) {
+            case memory_type::uncacheable:
+                ::intel_x64::ept::pdpt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pdpt::entry::memory_type::uncacheable
+                );
+                break;
+
+            case memory_type::write_combining:
+                ::intel_x64::ept::pdpt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pdpt::entry::memory_type::write_combining
+                );
+                break;
+
+            case memory_type::write_through:
+                ::intel_x64::ept::pdpt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pdpt::entry::memory_type::write_through
+                );
+                break;
+
+            case memory_type::write_protected:
+                ::intel_x64::ept::pdpt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pdpt::entry::memory_type::write_protected
+                );
+                break;
+
+            case memory_type::write_back:
+                ::intel_x64::ept::pdpt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pdpt::entry::memory_type::write_back
+                );
+                break;
+        };
+
+        ::intel_x64::ept::pdpt::entry::ps::enable(entry);
+        entry |= m_suppress_ve;
+        slot = entry;
+        return slot;
+    }
+
+    entry_type &
+    map_pde(
+        virt_addr_t *virt_addr, phys_addr_t phys_addr,
+        attr_type attr, memory_type cache)
+    {
+        auto &slot = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+
+        if (slot != 0) {
+            throw std::runtime_error(
+                "map_pde: map failed, virt / phys map already exists: " +
+                bfn::to_string(phys_addr, 16)
+            );
+        }
+
+        entry_type entry = 0;
+        ::intel_x64::ept::pd::entry::phys_addr::set(entry, phys_addr);
+
+        switch (attr) {
+            case attr_type::none:
+                break;
+
+            case attr_type::read_only:
+                ::intel_x64::ept::pd::entry::read_access::enable(entry);
+                break;
+
+            case attr_type::write_only:
+                ::intel_x64::ept::pd::entry::write_access::enable(entry);
+                break;
+
+            case attr_type::execute_only:
+                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
+                break;
+
+            case attr_type::read_write:
+                ::intel_x64::ept::pd::entry::read_access::enable(entry);
+                ::intel_x64::ept::pd::entry::write_access::enable(entry);
+                break;
+
+            case attr_type::read_execute:
+                ::intel_x64::ept::pd::entry::read_access::enable(entry);
+                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
+                break;
+
+            case attr_type::read_write_execute:
+                ::intel_x64::ept::pd::entry::read_access::enable(entry);
+                ::intel_x64::ept::pd::entry::write_access::enable(entry);
+                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
+                break;
+        };
+
+        switch (cache) {
+            case memory_type::uncacheable:
+                ::intel_x64::ept::pd::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pd::entry::memory_type::uncacheable
+                );
+                break;
+
+            case memory_type::write_combining:
+                ::intel_x64::ept::pd::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pd::entry::memory_type::write_combining
+                );
+                break;
+
+            case memory_type::write_through:
+                ::intel_x64::ept::pd::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pd::entry::memory_type::write_through
+                );
+                break;
+
+            case memory_type::write_protected:
+                ::intel_x64::ept::pd::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pd::entry::memory_type::write_protected
+                );
+                break;
+
+            case memory_type::write_back:
+                ::intel_x64::ept::pd::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pd::entry::memory_type::write_back
+                );
+                break;
+        };
+
+        ::intel_x64::ept::pd::entry::ps::enable(entry);
+        entry |= m_suppress_ve;
+        slot = entry;
+        return slot;
+    }
+
+    entry_type &
+    map_pte(
+        virt_addr_t *virt_addr, phys_addr_t phys_addr,
+        attr_type attr, memory_type cache)
+    {
+        auto &slot = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+
+        if (slot != 0) {
+            throw std::runtime_error(
+                "map_pte: map failed, virt / phys map already exists: " +
+                bfn::to_string(phys_addr, 16)
+            );
+        }
+
+        entry_type entry = 0;
+        ::intel_x64::ept::pt::entry::phys_addr::set(entry, phys_addr);
+
+        switch (attr) {
+            case attr_type::none:
+                break;
+
+            case attr_type::read_only:
+                ::intel_x64::ept::pt::entry::read_access::enable(entry);
+                break;
+
+            case attr_type::write_only:
+                ::intel_x64::ept::pt::entry::write_access::enable(entry);
+                break;
+
+            case attr_type::execute_only:
+                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
+                break;
+
+            case attr_type::read_write:
+                ::intel_x64::ept::pt::entry::read_access::enable(entry);
+                ::intel_x64::ept::pt::entry::write_access::enable(entry);
+                break;
+
+            case attr_type::read_execute:
+                ::intel_x64::ept::pt::entry::read_access::enable(entry);
+                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
+                break;
 
-            m_pdpt = phys_to_pair(phys_addr, ::intel_x64::ept::pdpt::num_entries);
-            return;
-        }
+            case attr_type::read_write_execute:
+                ::intel_x64::ept::pt::entry::read_access::enable(entry);
+                ::intel_x64::ept::pt::entry::write_access::enable(entry);
+                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
+                break;
+        };
 
-        m_pdpt = this->allocate(::intel_x64::ept::pdpt::num_entries);
+        switch (cache) {
+            case memory_type::uncacheable:
+                ::intel_x64::ept::pt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pt::entry::memory_type::uncacheable
+                );
+                break;
+
+            case memory_type::write_combining:
+                ::intel_x64::ept::pt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pt::entry::memory_type::write_combining
+                );
+                break;
 
-        ::intel_x64::ept::pml4::entry::phys_addr::set(entry, m_pdpt.phys_addr);
-        ::intel_x64::ept::pml4::entry::read_access::enable(entry);
-        ::intel_x64::ept::pml4::entry::write_access::enable(entry);
-        ::intel_x64::ept::pml4::entry::execute_access::enable(entry);
+            case memory_type::write_through:
+                ::intel_x64::ept::pt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pt::entry::memory_type::write_through
+                );
+                break;
+
+            case memory_type::write_protected:
+                ::intel_x64::ept::pt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pt::entry::memory_type::write_protected
+                );
+                break;
+
+            case memory_type::write_back:
+                ::intel_x64::ept::pt::entry::memory_type::set(
+                    entry,
+                    ::intel_x64::ept::pt::entry::memory_type::write_back
+                );
+                break;
+        };
+
+        entry |= m_suppress_ve;
+        slot = entry;
+        return slot;
     }
 
-    void
-    map_pd(index_type pdpti)
+    static entry_type
+    with_attr(entry_type entry, attr_type attr) noexcept
     {
-        auto &entry = m_pdpt.virt_addr.at(pdpti);
+        using namespace ::intel_x64::ept::pt::entry;
 
-        if (entry != 0) {
-            auto phys_addr = ::intel_x64::ept::pdpt::entry::phys_addr::get(entry);
+        // The access bits are in the same place at every level
+        entry &= ~(read_access::mask | write_access::mask | execute_access::mask);
 
-            if (m_pd.phys_addr == phys_addr) {
-                return;
-            }
+        switch (attr) {
+            case attr_type::none:
+                break;
+
+            case attr_type::read_only:
+                read_access::enable(entry);
+                break;
+
+            case attr_type::write_only:
+                write_access::enable(entry);
+                break;
+
+            case attr_type::execute_only:
+                execute_access::enable(entry);
+                break;
+
+            case attr_type::read_write:
+                read_access::enable(entry);
+                write_access::enable(entry);
+                break;
+
+            case attr_type::read_execute:
+                read_access::enable(entry);
+                execute_access::enable(entry);
+                break;
+
+            case attr_type::read_write_execute:
+                read_access::enable(entry);
+                write_access::enable(entry);
+                execute_access::enable(entry);
+                break;
+        };
+
+        return entry;
+    }
+
+    static entry_type
+    with_memory_type(entry_type entry, memory_type cache, bool ignore_pat) noexcept
+    {
+        using namespace ::intel_x64::ept::pt::entry;
+
+        // The memory type and ignore PAT bits are in the same place in
+        // every leaf
+        entry &= ~(memory_type::mask | ignore_pat_mask);
+        memory_type::set(entry, static_cast<entry_type>(cache));
+
+        if (ignore_pat) {
+            entry |= ignore_pat_mask;
+        }
+
+        return entry;
+    }
 
-            m_pd = phys_to_pair(phys_addr, ::intel_x64::ept::pd::num_entries);
+    template<typename F>
+    static void
+    update_leaf(
+        entry_type &entry, virt_addr_t virt_addr, size_type size,
+        F update, std::vector<range_t> &changed)
+    {
+        auto updated = update(entry);
+
+        if (updated == entry) {
             return;
         }
 
-        m_pd = this->allocate(::intel_x64::ept::pd::num_entries);
+        entry = updated;
+
+        if (!changed.empty() && changed.back().virt_addr + changed.back().size == virt_addr) {
+            changed.back().size += size;
+            return;
+        }
 
-        ::intel_x64::ept::pdpt::entry::phys_addr::set(entry, m_pd.phys_addr);
-        ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-        ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-        ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
+        changed.push_back({virt_addr, size});
     }
 
-    void
-    map_pt(index_type pdi)
+    // Compact
+    //
+    // A table can be collapsed into a leaf one level up when all of its
+    // entries are present leaves (large leaves, if large is true), map
+    // contiguous memory starting at a base that is aligned to the size of
+    // the new leaf, differ in nothing but their address and their
+    // accessed / dirty flags, and have neither sub-page permissions nor a
+    // suppress #VE bit that was changed from the map's default (either of
+    // which would otherwise silently apply to the whole large page). On
+    // success, the new leaf is returned in leaf.
+    //
+
+    bool
+    collapsible(
+        gsl::span<virt_addr_t> table, size_type step, bool large, entry_type &leaf)
     {
-        auto &entry = m_pd.virt_addr.at(pdi);
+        using namespace ::intel_x64::ept;
 
-        if (entry != 0) {
-            auto phys_addr = ::intel_x64::ept::pd::entry::phys_addr::get(entry);
+        constexpr const auto phys_mask = pt::entry::phys_addr::mask;
+        constexpr const auto ad_mask = accessed_flag | dirty_flag;
 
-            if (m_pt.phys_addr == phys_addr) {
-                return;
-            }
+        auto first = table.at(0);
+        auto base = first & phys_mask;
+        auto attrs = first & ~(phys_mask | ad_mask);
+        auto size = step * static_cast<size_type>(table.size());
 
-            m_pt = phys_to_pair(phys_addr, ::intel_x64::ept::pt::num_entries);
-            return;
+        if (first == 0 || (base & (size - 1U)) != 0) {
+            return false;
         }
 
-        m_pt = this->allocate(::intel_x64::ept::pt::num_entries);
+        if ((attrs & spp_mask) != 0 || (attrs & suppress_ve_mask) != m_suppress_ve) {
+            return false;
+        }
+
+        if (large != pd::entry::ps::is_enabled(first)) {
+            return false;
+        }
+
+        entry_type ad = 0;
+        for (auto i = 0; i < table.size(); i++) {
+            auto entry = table.at(i);
+
+            if ((entry & phys_mask) != base + static_cast<size_type>(i) * step) {
+                return false;
+            }
+
+            if ((entry & ~(phys_mask | ad_mask)) != attrs) {
+                return false;
+            }
+
+            ad |= entry & ad_mask;
+        }
 
-        ::intel_x64::ept::pd::entry::phys_addr::set(entry, m_pt.phys_addr);
-        ::intel_x64::ept::pd::entry::read_access::enable(entry);
-        ::intel_x64::ept::pd::entry::write_access::enable(entry);
-        ::intel_x64::ept::pd::entry::execute_access::enable(entry);
+        leaf = attrs | base | ad;
+        return true;
     }
 
-    void
-    clear_pdpt(index_type pml4i)
+    // Compactable
+    //
+    // Returns true if compact_pd() would collapse anything, without
+    // modifying the map, so that a PDPT or PD that is shared with another
+    // map is only copied on write when it actually changes.
+    //
+
+    bool
+    compactable_pd(virt_addr_t virt_addr, virt_addr_t eaddr)
     {
-        this->map_pdpt(pml4i);
+        using namespace ::intel_x64::ept;
 
-        for (auto pdpti = 0; pdpti < ::intel_x64::ept::pdpt::num_entries; pdpti++) {
-            auto &entry = m_pdpt.virt_addr.at(pdpti);
+        auto ptr = reinterpret_cast<virt_addr_t *>(virt_addr);
+        auto pml4e = m_pml4.virt_addr.at(pml4::index(ptr));
+        auto pdpte = table_virt(pml4::entry::phys_addr::get(pml4e))[pdpt::index(ptr)];
+        auto pd = phys_to_pair(pdpt::entry::phys_addr::get(pdpte), pd::num_entries);
 
-            if (entry == 0) {
+        auto pdi = pd::index(ptr);
+        entry_type leaf;
+
+        for (; pdi < pd::num_entries && virt_addr < eaddr; pdi++, virt_addr += pd::page_size) {
+            auto pde = pd.virt_addr.at(pdi);
+
+            if (pde == 0 || pd::entry::ps::is_enabled(pde)) {
                 continue;
             }
 
-            if (::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
-                this->clear_pd(pdpti);
+            auto table = phys_to_pair(pd::entry::phys_addr::get(pde), pt::num_entries);
+
+            if (this->collapsible(table.virt_addr, pt::page_size, false, leaf)) {
+                return true;
             }
+        }
 
-            entry = 0;
+        if (pd::index(ptr) != 0 || pdi != pd::num_entries) {
+            return false;
         }
 
-        this->free(m_pdpt.virt_addr);
-        m_pdpt = {};
+        return this->collapsible(pd.virt_addr, pd::page_size, true, leaf);
     }
 
-    void
-    clear_pd(index_type pdpti)
+    size_type
+    compact_pd(virt_addr_t virt_addr, virt_addr_t eaddr)
     {
-        this->map_pd(pdpti);
+        using namespace ::intel_x64::ept;
 
-        for (auto pdi = 0; pdi < ::intel_x64::ept::pd::num_entries; pdi++) {
-            auto &entry = m_pd.virt_addr.at(pdi);
+        auto ptr = reinterpret_cast<virt_addr_t *>(virt_addr);
 
-            if (entry == 0) {
+        if (!this->compactable_pd(virt_addr, eaddr)) {
+            return 0;
+        }
+
+        this->map_pdpt(pml4::index(ptr));
+        auto &pdpte = m_pdpt.virt_addr.at(pdpt::index(ptr));
+
+        this->map_pd(pdpt::index(ptr));
+
+        size_type freed = 0;
+        auto pdi = pd::index(ptr);
+
+        for (; pdi < pd::num_entries && virt_addr < eaddr; pdi++, virt_addr += pd::page_size) {
+            auto &pde = m_pd.virt_addr.at(pdi);
+
+            if (pde == 0 || pd::entry::ps::is_enabled(pde)) {
                 continue;
             }
 
-            if (::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
-                this->clear_pt(pdi);
+            auto table = phys_to_pair(pd::entry::phys_addr::get(pde), pt::num_entries);
+
+            entry_type leaf;
+            if (!this->collapsible(table.virt_addr, pt::page_size, false, leaf)) {
+                continue;
             }
 
-            entry = 0;
+            pd::entry::ps::enable(leaf);
+            pde = leaf;
+
+            this->release_table(table, m_pt);
+            m_num_pt--;
+            freed++;
         }
 
-        this->free(m_pd.virt_addr);
-        m_pd = {};
+        // The PD itself can only be collapsed if the whole 1g region was
+        // part of the range
+        //
+
+        if (pd::index(ptr) != 0 || pdi != pd::num_entries) {
+            return freed;
+        }
+
+        entry_type leaf;
+        if (!this->collapsible(m_pd.virt_addr, pd::page_size, true, leaf)) {
+            return freed;
+        }
+
+        auto table = m_pd;
+        pdpte = leaf;
+
+        this->release_table(table, m_pd);
+        m_num_pd--;
+
+        return freed + 1;
     }
 
     void
-    clear_pt(index_type pdi)
+    release_table(const pair &table, pair &cursor)
     {
-        this->map_pt(pdi);
+        if (cursor.phys_addr == table.phys_addr) {
+            cursor = {};
+        }
 
-        this->free(m_pt.virt_addr);
-        m_pt = {};
+        if (this->unref_table(table.phys_addr)) {
+            this->free(table);
+        }
     }
 
-    entry_type &
-    map_pdpte(
-        virt_addr_t *virt_addr, phys_addr_t phys_addr,
-        attr_type attr, memory_type cache)
+    // Split
+    //
+    // Replaces a large page entry with a table of the next smaller page
+    // size that maps the same memory with the same attributes. The new
+    // table is filled in before it is published, so concurrent lookups
+    // either see the old large page, or the complete table.
+    //
+
+    void
+    split_pdpte(entry_type &pdpte)
     {
-        auto &entry = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        using namespace ::intel_x64::ept;
 
-        if (entry != 0) {
-            throw std::runtime_error(
-                "map_pdpte: map failed, virt / phys map already exists: " +
-                bfn::to_string(phys_addr, 16)
-            );
+        auto table = this->allocate(pd::num_entries);
+        m_num_pd++;
+
+        auto phys_addr = pdpt::entry::phys_addr::get(pdpte);
+        auto bits = pdpte & ~pdpt::entry::phys_addr::mask;
+
+        for (auto pdi = 0; pdi < pd::num_entries; pdi++) {
+            table.virt_addr.at(pdi) =
+                bits | (phys_addr + static_cast<uintptr_t>(pdi) * pd::page_size);
         }
 
-        ::intel_x64::ept::pdpt::entry::phys_addr::set(entry, phys_addr);
+        entry_type entry = 0;
+        pdpt::entry::phys_addr::set(entry, table.phys_addr);
+        pdpt::entry::read_access::enable(entry);
+        pdpt::entry::write_access::enable(entry);
+        pdpt::entry::execute_access::enable(entry);
 
-        switch (attr) {
-            case attr_type::none:
-                break;
+        pdpte = entry;
+    }
 
-            case attr_type::read_only:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                break;
+    void
+    split_pde(entry_type &pde)
+    {
+        using namespace ::intel_x64::ept;
 
-            case attr_type::write_only:
-                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-                break;
+        auto table = this->allocate(pt::num_entries);
+        m_num_pt++;
 
-            case attr_type::execute_only:
-                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
-                break;
+        auto phys_addr = pd::entry::phys_addr::get(pde);
+        auto bits = pde & ~(pd::entry::phys_addr::mask | pd::entry::ps::mask);
 
-            case attr_type::read_write:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-                break;
+        for (auto pti = 0; pti < pt::num_entries; pti++) {
+            table.virt_addr.at(pti) =
+                bits | (phys_addr + static_cast<uintptr_t>(pti) * pt::page_size);
+        }
 
-            case attr_type::read_execute:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
-                break;
+        entry_type entry = 0;
+        pd::entry::phys_addr::set(entry, table.phys_addr);
+        pd::entry::read_access::enable(entry);
+        pd::entry::write_access::enable(entry);
+        pd::entry::execute_access::enable(entry);
 
-            case attr_type::read_write_execute:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
-                break;
-        };
+        pde = entry;
+    }
 
-        switch (cache) {
-            case memory_type::uncacheable:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::uncacheable
+    template<typename F>
+    size_type
+    update_entry(
+        virt_addr_t virt_addr, virt_addr_t eaddr, F update,
+        std::vector<range_t> &changed)
+    {
+        using namespace ::intel_x64::ept;
+        auto ptr = reinterpret_cast<virt_addr_t *>(virt_addr);
+
+        this->map_pdpt(pml4::index(ptr));
+        auto &pdpte = m_pdpt.virt_addr.at(pdpt::index(ptr));
+
+        if (pdpte == 0) {
+            throw std::runtime_error("update_entry: pdpte not mapped");
+        }
+
+        if (pdpt::entry::ps::is_enabled(pdpte)) {
+            if (bfn::lower(virt_addr, pdpt::from) == 0 && eaddr - virt_addr >= pdpt::page_size) {
+                update_leaf(pdpte, virt_addr, pdpt::page_size, update, changed);
+                return pdpt::page_size;
+            }
+
+            this->split_pdpte(pdpte);
+        }
+
+        this->map_pd(pdpt::index(ptr));
+        auto &pde = m_pd.virt_addr.at(pd::index(ptr));
+
+        if (pde == 0) {
+            throw std::runtime_error("update_entry: pde not mapped");
+        }
+
+        if (pd::entry::ps::is_enabled(pde)) {
+            if (bfn::lower(virt_addr, pd::from) == 0 && eaddr - virt_addr >= pd::page_size) {
+                update_leaf(pde, virt_addr, pd::page_size, update, changed);
+                return pd::page_size;
+            }
+
+            this->split_pde(pde);
+        }
+
+        this->map_pt(pd::index(ptr));
+
+        // Update the rest of this PT in a single pass, instead of walking
+        // from the PML4 for every 4k page
+        //
+
+        auto pti = pt::index(ptr);
+        auto start = virt_addr;
+
+        for (; pti < pt::num_entries && virt_addr < eaddr; pti++) {
+            auto &pte = m_pt.virt_addr.at(pti);
+
+            if (pte == 0) {
+                throw std::runtime_error("update_entry: pte not mapped");
+            }
+
+            update_leaf(pte, virt_addr, pt::page_size, update, changed);
+            virt_addr += pt::page_size;
+        }
+
+        return virt_addr - start;
+    }
+
+    void
+    map_range_pdpt(
+        virt_addr_t &virt_addr, phys_addr_t &phys_addr, virt_addr_t eaddr,
+        attr_type attr, memory_type cache)
+    {
+        using namespace ::intel_x64::ept;
+
+        auto pdpti = pdpt::index(reinterpret_cast<virt_addr_t *>(virt_addr));
+        for (; pdpti < pdpt::num_entries && virt_addr < eaddr; pdpti++) {
+
+            if (bfn::lower(virt_addr, pdpt::from) == 0 &&
+                bfn::lower(phys_addr, pdpt::from) == 0 &&
+                eaddr - virt_addr >= pdpt::page_size) {
+
+                this->map_pdpte(
+                    reinterpret_cast<virt_addr_t *>(virt_addr), phys_addr, attr, cache
                 );
-                break;
 
-            case memory_type::write_combining:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_combining
-                );
-                break;
+                virt_addr += pdpt::page_size;
+                phys_addr += pdpt::page_size;
+
+                continue;
+            }
+
+            this->map_pd(pdpti);
+            this->map_range_pd(virt_addr, phys_addr, eaddr, attr, cache);
+        }
+    }
+
+    void
+    map_range_pd(
+        virt_addr_t &virt_addr, phys_addr_t &phys_addr, virt_addr_t eaddr,
+        attr_type attr, memory_type cache)
+    {
+        using namespace ::intel_x64::ept;
+
+        auto pdi = pd::index(reinterpret_cast<virt_addr_t *>(virt_addr));
+        for (; pdi < pd::num_entries && virt_addr < eaddr; pdi++) {
 
-            case memory_type::write_through:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_through
-                );
-                break;
+            if (bfn::lower(virt_addr, pd::from) == 0 &&
+                bfn::lower(phys_addr, pd::from) == 0 &&
+                eaddr - virt_addr >= pd::page_size) {
 
-            case memory_type::write_protected:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_protected
+                this->map_pde(
+                    reinterpret_cast<virt_addr_t *>(virt_addr), phys_addr, attr, cache
                 );
-                break;
 
-            case memory_type::write_back:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_back
-                );
-                break;
-        };
+                virt_addr += pd::page_size;
+                phys_addr += pd::page_size;
 
-        ::intel_x64::ept::pdpt::entry::ps::enable(entry);
-        return entry;
+                continue;
+            }
+
+            this->map_pt(pdi);
+            this->map_range_pt(virt_addr, phys_addr, eaddr, attr, cache);
+        }
     }
 
-    entry_type &
-    map_pde(
-        virt_addr_t *virt_addr, phys_addr_t phys_addr,
+    void
+    map_range_pt(
+        virt_addr_t &virt_addr, phys_addr_t &phys_addr, virt_addr_t eaddr,
         attr_type attr, memory_type cache)
     {
-        auto &entry = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        using namespace ::intel_x64::ept;
 
-        if (entry != 0) {
-            throw std::runtime_error(
-                "map_pde: map failed, virt / phys map already exists: " +
-                bfn::to_string(phys_addr, 16)
+        auto pti = pt::index(reinterpret_cast<virt_addr_t *>(virt_addr));
+        for (; pti < pt::num_entries && virt_addr < eaddr; pti++) {
+            this->map_pte(
+                reinterpret_cast<virt_addr_t *>(virt_addr), phys_addr, attr, cache
             );
+
+            virt_addr += pt::page_size;
+            phys_addr += pt::page_size;
         }
+    }
 
-        ::intel_x64::ept::pd::entry::phys_addr::set(entry, phys_addr);
+    // Scan
+    //
+    // The accessed and dirty flags are bits 8 and 9 of an EPT entry. Bit 8
+    // is defined for every level, while bit 9 is only defined for entries
+    // that map a page. The hardware sets these flags using atomic updates,
+    // which might race with a scan on another core, so they are cleared
+    // atomically as well. The accessed flag of a table entry is only
+    // cleared if the entire table it references is part of the scan, as it
+    // is used to skip tables that have not been accessed.
+    //
+
+    static constexpr const entry_type accessed_flag = 0x0000000000000100;
+    static constexpr const entry_type dirty_flag = 0x0000000000000200;
+
+    struct scan_t {
+        virt_addr_t saddr;
+        virt_addr_t eaddr;
+        gsl::span<uint64_t> bitmap;
+        entry_type flag;
+        bool clear;
+        size_type count;
+    };
 
-        switch (attr) {
-            case attr_type::none:
-                break;
+    size_type
+    scan(
+        virt_addr_t virt_addr, size_type size, gsl::span<uint64_t> bitmap,
+        entry_type flag, bool clear)
+    {
+        using namespace ::intel_x64::ept;
 
-            case attr_type::read_only:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                break;
+        expects(bfn::lower(virt_addr, pt::from) == 0);
+        expects(bfn::lower(size, pt::from) == 0);
+        expects(static_cast<size_type>(bitmap.size()) * 64 >= (size >> pt::from));
 
-            case attr_type::write_only:
-                ::intel_x64::ept::pd::entry::write_access::enable(entry);
-                break;
+        write_guard guard(this, clear);
+        std::fill(bitmap.begin(), bitmap.end(), 0);
 
-            case attr_type::execute_only:
-                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
-                break;
+        scan_t state{virt_addr, virt_addr + size, bitmap, flag, clear, 0};
 
-            case attr_type::read_write:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                ::intel_x64::ept::pd::entry::write_access::enable(entry);
-                break;
+        while (virt_addr < state.eaddr) {
+            auto pml4i = pml4::index(reinterpret_cast<virt_addr_t *>(virt_addr));
+            auto &entry = m_pml4.virt_addr.at(pml4i);
 
-            case attr_type::read_execute:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
-                break;
+            auto saddr = bfn::upper(virt_addr, pml4::from);
+            auto eaddr = saddr + (virt_addr_t{1} << pml4::from);
 
-            case attr_type::read_write_execute:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                ::intel_x64::ept::pd::entry::write_access::enable(entry);
-                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
-                break;
-        };
+            if (this->scan_table(state, entry, saddr, eaddr)) {
+                this->map_pdpt(pml4i, clear);
+                this->scan_pdpt(state, virt_addr);
+            }
 
-        switch (cache) {
-            case memory_type::uncacheable:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::uncacheable
-                );
-                break;
+            virt_addr = eaddr;
+        }
 
-            case memory_type::write_combining:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_combining
-                );
-                break;
+        return state.count;
+    }
 
-            case memory_type::write_through:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_through
-                );
-                break;
+    bool
+    scan_table(
+        scan_t &state, entry_type &entry, virt_addr_t saddr, virt_addr_t eaddr)
+    {
+        if (entry == 0) {
+            return false;
+        }
 
-            case memory_type::write_protected:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_protected
-                );
-                break;
+        if (state.flag != accessed_flag) {
+            return true;
+        }
 
-            case memory_type::write_back:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_back
-                );
-                break;
-        };
+        if (state.clear && saddr >= state.saddr && eaddr <= state.eaddr) {
+            return (__atomic_fetch_and(&entry, ~accessed_flag, __ATOMIC_SEQ_CST) & accessed_flag) != 0;
+        }
 
-        ::intel_x64::ept::pd::entry::ps::enable(entry);
-        return entry;
+        return (entry & accessed_flag) != 0;
     }
 
-    entry_type &
-    map_pte(
-        virt_addr_t *virt_addr, phys_addr_t phys_addr,
-        attr_type attr, memory_type cache)
+    void
+    scan_page(
+        scan_t &state, entry_type &entry, virt_addr_t saddr, virt_addr_t eaddr)
     {
-        auto &entry = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+        using namespace ::intel_x64::ept;
 
-        if (entry != 0) {
-            throw std::runtime_error(
-                "map_pte: map failed, virt / phys map already exists: " +
-                bfn::to_string(phys_addr, 16)
-            );
+        if (entry == 0) {
+            return;
         }
 
-        ::intel_x64::ept::pt::entry::phys_addr::set(entry, phys_addr);
+        auto value = entry;
+        if (state.clear) {
+            value = __atomic_fetch_and(&entry, ~state.flag, __ATOMIC_SEQ_CST);
+        }
 
-        switch (attr) {
-            case attr_type::none:
-                break;
+        if ((value & state.flag) == 0) {
+            return;
+        }
 
-            case attr_type::read_only:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                break;
+        saddr = std::max(saddr, state.saddr);
+        eaddr = std::min(eaddr, state.eaddr);
 
-            case attr_type::write_only:
-                ::intel_x64::ept::pt::entry::write_access::enable(entry);
-                break;
+        for (auto addr = saddr; addr < eaddr; addr += pt::page_size) {
+            auto bit = (addr - state.saddr) >> pt::from;
+            state.bitmap.at(static_cast<index_type>(bit >> 6)) |= 1ULL << (bit & 0x3F);
+            state.count++;
+        }
+    }
 
-            case attr_type::execute_only:
-                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
-                break;
+    void
+    scan_pdpt(scan_t &state, virt_addr_t &virt_addr)
+    {
+        using namespace ::intel_x64::ept;
 
-            case attr_type::read_write:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pt::entry::write_access::enable(entry);
-                break;
+        auto pdpti = pdpt::index(reinterpret_cast<virt_addr_t *>(virt_addr));
+        for (; pdpti < pdpt::num_entries && virt_addr < state.eaddr; pdpti++) {
+            auto &entry = m_pdpt.virt_addr.at(pdpti);
 
-            case attr_type::read_execute:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
-                break;
+            auto saddr = bfn::upper(virt_addr, pdpt::from);
+            auto eaddr = saddr + pdpt::page_size;
 
-            case attr_type::read_write_execute:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pt::entry::write_access::enable(entry);
-                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
-                break;
-        };
+            if (entry != 0 && pdpt::entry::ps::is_enabled(entry)) {
+                this->scan_page(state, entry, saddr, eaddr);
+            }
+            else if (this->scan_table(state, entry, saddr, eaddr)) {
+                this->map_pd(pdpti, state.clear);
+                this->scan_pd(state, virt_addr);
+            }
 
-        switch (cache) {
-            case memory_type::uncacheable:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::uncacheable
-                );
-                break;
+            virt_addr = eaddr;
+        }
+    }
 
-            case memory_type::write_combining:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_combining
-                );
-                break;
+    void
+    scan_pd(scan_t &state, virt_addr_t &virt_addr)
+    {
+        using namespace ::intel_x64::ept;
 
-            case memory_type::write_through:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_through
-                );
-                break;
+        auto pdi = pd::index(reinterpret_cast<virt_addr_t *>(virt_addr));
+        for (; pdi < pd::num_entries && virt_addr < state.eaddr; pdi++) {
+            auto &entry = m_pd.virt_addr.at(pdi);
 
-            case memory_type::write_protected:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_protected
-                );
-                break;
+            auto saddr = bfn::upper(virt_addr, pd::from);
+            auto eaddr = saddr + pd::page_size;
 
-            case memory_type::write_back:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_back
-                );
-                break;
-        };
+            if (entry != 0 && pd::entry::ps::is_enabled(entry)) {
+                this->scan_page(state, entry, saddr, eaddr);
+            }
+            else if (this->scan_table(state, entry, saddr, eaddr)) {
+                this->map_pt(pdi, state.clear);
+                this->scan_pt(state, virt_addr);
+            }
 
-        return entry;
+            virt_addr = eaddr;
+        }
+    }
+
+    void
+    scan_pt(scan_t &state, virt_addr_t &virt_addr)
+    {
+        using namespace ::intel_x64::ept;
+
+        auto pti = pt::index(reinterpret_cast<virt_addr_t *>(virt_addr));
+        for (; pti < pt::num_entries && virt_addr < state.eaddr; pti++) {
+            auto &entry = m_pt.virt_addr.at(pti);
+
+            this->scan_page(state, entry, virt_addr, virt_addr + pt::page_size);
+            virt_addr += pt::page_size;
+        }
     }
 
     bool
@@ -1082,7 +3450,8 @@ private:
         }
 
         if (empty) {
-            this->free(m_pdpt.virt_addr);
+            this->free(m_pdpt);
+            m_num_pdpt--;
             return true;
         }
 
@@ -1111,7 +3480,8 @@ private:
         }
 
         if (empty) {
-            this->free(m_pd.virt_addr);
+            this->free(m_pd);
+            m_num_pd--;
             return true;
         }
 
@@ -1132,7 +3502,8 @@ private:
         }
 
         if (empty) {
-            this->free(m_pt.virt_addr);
+            this->free(m_pt);
+            m_num_pt--;
             return true;
         }
 
@@ -1141,11 +3512,135 @@ private:
 
 private:
 
+    // Write Guard
+    //
+    // Every function that modifies the map (or moves its cursors) takes a
+    // write guard, which bumps the generation of the map (if it is being
+    // modified) and, if concurrent lookups are enabled, serializes writers.
+    // When the writer leaves, the retired tables that no reader can still
+    // be walking are returned to the heap (see reclaim()).
+    //
+
+    class write_guard
+    {
+    public:
+
+        explicit write_guard(mmap *map, bool modify = true) :
+            m_map{map}
+        {
+            if (m_map->m_sync) {
+                m_map->m_sync->lock.lock();
+            }
+
+            if (modify) {
+                m_map->m_generation++;
+            }
+        }
+
+        ~write_guard()
+        {
+            if (m_map->m_sync) {
+                m_map->reclaim();
+                m_map->m_sync->lock.unlock();
+            }
+        }
+
+        write_guard(write_guard &&) = delete;
+        write_guard &operator=(write_guard &&) = delete;
+
+        write_guard(const write_guard &) = delete;
+        write_guard &operator=(const write_guard &) = delete;
+
+    private:
+
+        mmap *m_map;
+    };
+
+    // Reclaim
+    //
+    // Readers count themselves in one of two counters, picked by the
+    // parity of the epoch they started in, and every retired table is
+    // tagged with the epoch it was unlinked in. A reader that registers
+    // after a table was unlinked can no longer reach it, so a table is only
+    // at risk from readers that started in its epoch or earlier.
+    //
+    // Once the counter of the previous epoch drains, every active reader
+    // started in the current epoch, so the tables retired before it can
+    // be freed, and the epoch moves on. New readers always register in
+    // the current epoch, so the previous epoch's counter drains even under
+    // constant reader load, which keeps the retired list bounded (unlike
+    // waiting for there to be no readers at all). If there are no readers
+    // at all, everything that was retired is freed right away.
+    //
+
+    void
+    reclaim()
+    {
+        auto epoch = m_sync->epoch.load();
+        auto &retired = m_sync->retired;
+
+        if (m_sync->readers.at((epoch + 1U) & 1U) != 0) {
+            return;
+        }
+
+        if (m_sync->readers.at(epoch & 1U) == 0) {
+            for (const auto &r : retired) {
+                this->free_table(r.table);
+            }
+
+            retired.clear();
+            return;
+        }
+
+        auto iter = retired.begin();
+
+        while (iter != retired.end() && iter->epoch < epoch) {
+            this->free_table(iter->table);
+            ++iter;
+        }
+
+        retired.erase(retired.begin(), iter);
+        m_sync->epoch.store(epoch + 1U);
+    }
+
+private:
+
+    numa::node_t m_node{numa::any_node};
     pair m_pml4;
+
     pair m_pdpt;
     pair m_pd;
     pair m_pt;
 
+    uint64_t m_generation{};
+    entry_type m_suppress_ve{};
+
+    std::unique_ptr<sppt> m_sppt;
+
+    size_type m_num_pdpt{};
+    size_type m_num_pd{};
+    size_type m_num_pt{};
+
+    mutable std::array<walk_cache_entry, 16> m_walk_cache{};
+
+    struct retired_t {
+        pair table;
+        uint64_t epoch;
+    };
+
+    struct sync_t {
+        std::mutex lock;
+        std::atomic<uint64_t> epoch{0};
+        std::array<std::atomic<uint64_t>, 2> readers{};
+        std::vector<retired_t> retired;
+    };
+
+    std::unique_ptr<sync_t> m_sync;
+
+    bool m_pooled{false};
+    std::vector<pair> m_pool;
+    std::vector<pair> m_pool_free;
+
 public:
 
     /// @cond
@@ -0,0 +1,187 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef EPT_OVERRIDES_INTEL_X64_H
+#define EPT_OVERRIDES_INTEL_X64_H
+
+#include <vector>
+#include <algorithm>
+
+#include "mmap.h"
+
+namespace eapis
+{
+namespace intel_x64
+{
+namespace ept
+{
+
+/// Memory Type Overrides
+///
+/// A list of guest physical ranges whose EPT memory type is forced to a
+/// given type, instead of the type the MTRRs give them (e.g. to map a
+/// framebuffer or a NIC BAR write-combining in the guest, whatever the
+/// host's MTRRs say). The overrides are merged with the MTRRs by
+/// identity_map() when a map is built, and can be applied to (or removed
+/// from) a map that is already built using apply_memory_type_overrides()
+/// and restore_memory_types().
+///
+/// Each override can also set the ignore PAT bit, so that the guest's
+/// PAT cannot weaken the forced type (without it, the EPT and PAT memory
+/// types are combined, and e.g. a guest PAT of UC still wins over WC).
+///
+/// The ranges are kept sorted and cannot overlap, so looking up an
+/// address is a binary search.
+///
+class memory_type_overrides
+{
+public:
+
+    /// Range
+    ///
+    struct range_t {
+        uint64_t base;                  ///< The first GPA in the range
+        uint64_t size;                  ///< The size of the range in bytes
+        mmap::memory_type type;         ///< The forced memory type
+        bool ignore_pat;                ///< If true, the guest's PAT is ignored
+    };
+
+    /// Add
+    ///
+    /// @expects base and size are 4k aligned, and size != 0
+    /// @expects [base, base + size) does not overlap an existing override
+    /// @ensures
+    ///
+    /// @param base the first GPA in the range
+    /// @param size the size of the range in bytes
+    /// @param type the memory type to force
+    /// @param ignore_pat if true, the guest's PAT is ignored for the range
+    ///
+    void add(
+        uint64_t base, uint64_t size, mmap::memory_type type, bool ignore_pat = true)
+    {
+        expects(size != 0);
+        expects(bfn::lower(base, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+
+        auto iter = std::upper_bound(
+            m_ranges.begin(), m_ranges.end(), base,
+        [](auto addr, const auto & range) { return addr < range.base; });
+
+        if (iter != m_ranges.end() && base + size > iter->base) {
+            throw std::runtime_error("memory_type_overrides: range overlaps");
+        }
+
+        if (iter != m_ranges.begin() && std::prev(iter)->base + std::prev(iter)->size > base) {
+            throw std::runtime_error("memory_type_overrides: range overlaps");
+        }
+
+        m_ranges.insert(iter, {base, size, type, ignore_pat});
+    }
+
+    /// Remove
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param base the base of a range passed to add()
+    /// @return returns true if the range was found and removed
+    ///
+    bool remove(uint64_t base)
+    {
+        auto iter = std::find_if(
+            m_ranges.begin(), m_ranges.end(),
+        [base](const auto & range) { return range.base == base; });
+
+        if (iter == m_ranges.end()) {
+            return false;
+        }
+
+        m_ranges.erase(iter);
+        return true;
+    }
+
+    /// Find
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the GPA to look up
+    /// @return returns the override that contains addr, or nullptr if
+    ///     addr is not overridden
+    ///
+    const range_t *find(uint64_t addr) const noexcept
+    {
+        auto iter = std::upper_bound(
+            m_ranges.begin(), m_ranges.end(), addr,
+        [](auto a, const auto & range) { return a < range.base; });
+
+        if (iter == m_ranges.begin()) {
+            return nullptr;
+        }
+
+        --iter;
+        return addr < iter->base + iter->size ? &*iter : nullptr;
+    }
+
+    /// Next Boundary
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the GPA to look up
+    /// @return returns the first address after addr where an override
+    ///     starts or ends, or ~0 if there is none
+    ///
+    uint64_t next_boundary(uint64_t addr) const noexcept
+    {
+        if (auto range = this->find(addr)) {
+            return range->base + range->size;
+        }
+
+        auto iter = std::upper_bound(
+            m_ranges.begin(), m_ranges.end(), addr,
+        [](auto a, const auto & range) { return a < range.base; });
+
+        return iter != m_ranges.end() ? iter->base : ~0ULL;
+    }
+
+    /// Ranges
+    ///
+    /// @return returns the overrides, sorted by base
+    ///
+    const std::vector<range_t> &ranges() const noexcept
+    { return m_ranges; }
+
+    /// Empty
+    ///
+    /// @return returns true if there are no overrides
+    ///
+    bool empty() const noexcept
+    { return m_ranges.empty(); }
+
+private:
+
+    std::vector<range_t> m_ranges;
+};
+
+}
+}
+}
+
+#endif
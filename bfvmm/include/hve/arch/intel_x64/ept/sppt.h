@@ -0,0 +1,252 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef EPT_SPPT_INTEL_X64_H
+#define EPT_SPPT_INTEL_X64_H
+
+#include <vector>
+
+#include <bfgsl.h>
+#include <bfdebug.h>
+
+#include <intrinsics.h>
+#include <bfvmm/memory_manager/memory_manager.h>
+
+#include "../numa.h"
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+namespace ept
+{
+
+/// Sub-Page Permission Table
+///
+/// The table the CPU walks to find the write permissions of the 128 byte
+/// sub-pages of a 4k page whose EPT entry has the SPP bit set (see
+/// ept::mmap::set_sub_page_permissions()). Like EPT, the SPPT has four
+/// levels that are indexed using bits 47:12 of the guest physical
+/// address. The three upper levels hold the physical address of the next
+/// table and a valid bit, and each entry of the last level is the write
+/// permission vector of one 4k page: bit 2i allows writes to sub-page i,
+/// and the odd bits are reserved.
+///
+/// Tables are allocated as they are needed, and are only released when
+/// the table is destroyed, as clearing a vector just write protects every
+/// sub-page of the page.
+///
+class sppt
+{
+public:
+
+    using phys_addr_t = uintptr_t;                      ///< Phys Address Type (as Int)
+    using entry_type = uintptr_t;                       ///< Entry Type
+    using size_type = size_t;                           ///< Size Type
+
+    static constexpr const size_type num_entries = 512;         ///< Entries per table
+    static constexpr const size_type sub_page_size = 128;       ///< Bytes per sub-page
+    static constexpr const size_type num_sub_pages = 32;        ///< Sub-pages per 4k page
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param node the NUMA node to allocate the tables on
+    ///
+    explicit sppt(numa::node_t node = numa::any_node) :
+        m_node{node}
+    { m_root = this->allocate(); }
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~sppt()
+    {
+        for (const auto &table : m_tables) {
+            numa::free_page(table);
+        }
+    }
+
+    /// SPPTP
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the value that should be written into the SPPTP
+    ///     VMCS field
+    ///
+    phys_addr_t spptp() const
+    { return g_mm->virtptr_to_physint(m_root); }
+
+    /// Set Sub-Page Permissions
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the 4k page to change
+    /// @param writable bit i allows the guest to write to bytes
+    ///     [i * sub_page_size, (i + 1) * sub_page_size) of the page
+    ///
+    void set(phys_addr_t gpa, uint32_t writable)
+    { *this->walk(gpa, true) = to_vector(writable); }
+
+    /// Get Sub-Page Permissions
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the 4k page
+    /// @return Returns the writable sub-pages of the page (see set()), or
+    ///     0 if the page does not have a vector
+    ///
+    uint32_t get(phys_addr_t gpa) const
+    {
+        auto entry = const_cast<sppt *>(this)->walk(gpa, false);
+        return entry != nullptr ? from_vector(*entry) : 0;
+    }
+
+    /// Clear Sub-Page Permissions
+    ///
+    /// Write protects every sub-page of the page (which is what an SPPT miss
+    /// would do, minus the VM exit).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the 4k page
+    ///
+    void clear(phys_addr_t gpa)
+    {
+        if (auto entry = this->walk(gpa, false)) {
+            *entry = 0;
+        }
+    }
+
+    /// Number of Tables
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of table pages (including the root)
+    ///
+    size_type num_tables() const noexcept
+    { return m_tables.size(); }
+
+private:
+
+    static constexpr const entry_type valid_mask = 0x1ULL;
+    static constexpr const entry_type phys_addr_mask = 0x000FFFFFFFFFF000ULL;
+
+    static entry_type to_vector(uint32_t writable) noexcept
+    {
+        entry_type vector = 0;
+
+        for (auto i = 0U; i < num_sub_pages; i++) {
+            if ((writable & (1U << i)) != 0) {
+                vector |= 1ULL << (i * 2U);
+            }
+        }
+
+        return vector;
+    }
+
+    static uint32_t from_vector(entry_type vector) noexcept
+    {
+        uint32_t writable = 0;
+
+        for (auto i = 0U; i < num_sub_pages; i++) {
+            if ((vector & (1ULL << (i * 2U))) != 0) {
+                writable |= 1U << i;
+            }
+        }
+
+        return writable;
+    }
+
+    entry_type *allocate()
+    {
+        auto table = static_cast<entry_type *>(numa::alloc_page(m_node));
+        gsl::memset(gsl::make_span(table, num_entries), 0);
+
+        m_tables.push_back(table);
+        return table;
+    }
+
+    // Walk
+    //
+    // Returns the last level entry of gpa, creating the tables that lead
+    // to it if create is true, or nullptr if they do not exist.
+    //
+
+    entry_type *walk(phys_addr_t gpa, bool create)
+    {
+        auto table = m_root;
+
+        for (auto from = 39U; from > 12U; from -= 9U) {
+            auto &entry = table[(gpa >> from) & (num_entries - 1U)];
+
+            if ((entry & valid_mask) == 0) {
+                if (!create) {
+                    return nullptr;
+                }
+
+                auto next = this->allocate();
+                entry = (g_mm->virtptr_to_physint(next) & phys_addr_mask) | valid_mask;
+            }
+
+            table = static_cast<entry_type *>(
+                g_mm->physint_to_virtptr(entry & phys_addr_mask)
+            );
+        }
+
+        return &table[(gpa >> 12U) & (num_entries - 1U)];
+    }
+
+private:
+
+    numa::node_t m_node;
+    entry_type *m_root;
+
+    std::vector<entry_type *> m_tables;
+
+public:
+
+    /// @cond
+
+    sppt(sppt &&) = default;
+    sppt &operator=(sppt &&) = default;
+
+    sppt(const sppt &) = delete;
+    sppt &operator=(const sppt &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+}
+
+#endif
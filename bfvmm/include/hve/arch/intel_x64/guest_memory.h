@@ -0,0 +1,334 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef GUEST_MEMORY_INTEL_X64_EAPIS_H
+#define GUEST_MEMORY_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "ept/mmap.h"
+
+#include <optional>
+
+#include <bfupperlower.h>
+#include <bfvmm/memory_manager/arch/x64/unique_map.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+class guest_walker;
+
+/// Map Cache
+///
+/// A small, fully associative LRU cache of VMM mappings of guest pages,
+/// keyed by guest physical page. M is the type of the mapping (which must provide get(),
+/// and unmaps the page when it is destroyed), which lets the VMM keep
+/// pages mapped across exits instead of creating and destroying a mapping
+/// (and flushing the VMM's TLB) on every access.
+///
+/// Entries are not validated once they are added. Whoever owns the cache
+/// must call invalidate() (or clear()) if a page it caches may now be
+/// backed by different memory.
+///
+template<typename M, std::size_t N = 16>
+class map_cache
+{
+public:
+
+    /// Find Or Map
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param page the page to look up
+    /// @param map called as map(page) to create a mapping of page on a
+    ///     miss, which replaces the least recently used mapping if the
+    ///     cache is full
+    /// @return returns a pointer to the start of page
+    ///
+    template<typename F>
+    uint8_t *find_or_map(uint64_t page, F map)
+    {
+        entry_t *victim = &m_entries.front();
+
+        for (auto &e : m_entries) {
+            if (e.map && e.page == page) {
+                m_hits++;
+                e.last_use = ++m_clock;
+
+                return e.map->get();
+            }
+
+            if (!e.map) {
+                victim = &e;
+            }
+            else if (victim->map && e.last_use < victim->last_use) {
+                victim = &e;
+            }
+        }
+
+        m_misses++;
+
+        if (victim->map) {
+            m_evictions++;
+            victim->map.reset();
+        }
+
+        victim->map.emplace(map(page));
+        victim->page = page;
+        victim->last_use = ++m_clock;
+
+        return victim->map->get();
+    }
+
+    /// Invalidate
+    ///
+    /// Unmaps every cached page that overlaps [addr, addr + size)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the first address of the range
+    /// @param size the size of the range in bytes
+    ///
+    void invalidate(uint64_t addr, uint64_t size)
+    {
+        const auto first = bfn::upper(addr, ::x64::pt::from);
+
+        for (auto &e : m_entries) {
+            if (e.map && e.page >= first && e.page < addr + size) {
+                e.map.reset();
+            }
+        }
+    }
+
+    /// Clear
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear()
+    {
+        for (auto &e : m_entries) {
+            e.map.reset();
+        }
+    }
+
+    /// Hits
+    ///
+    /// @return returns the number of lookups that were already mapped
+    ///
+    uint64_t hits() const noexcept
+    { return m_hits; }
+
+    /// Misses
+    ///
+    /// @return returns the number of lookups that had to be mapped
+    ///
+    uint64_t misses() const noexcept
+    { return m_misses; }
+
+    /// Evictions
+    ///
+    /// @return returns the number of mappings that were unmapped to make
+    ///     room for another
+    ///
+    uint64_t evictions() const noexcept
+    { return m_evictions; }
+
+private:
+
+    struct entry_t {
+        uint64_t page;
+        uint64_t last_use;
+        std::optional<M> map;
+    };
+
+    std::array<entry_t, N> m_entries{};
+
+    uint64_t m_clock{0};
+    uint64_t m_hits{0};
+    uint64_t m_misses{0};
+    uint64_t m_evictions{0};
+};
+
+/// Guest Memory
+///
+/// Gives handlers access to guest memory through a per-vCPU cache of VMM
+/// mappings (see map_cache) so that handlers that touch the same guest
+/// pages on every exit (e.g. string IO buffers or the code being
+/// decoded) do not map and unmap them each time.
+///
+/// Guest physical addresses are translated using the EPT map given to
+/// set_ept() (or identity mapped if there is none). Whenever the
+/// generation of that map changes, the cache is cleared, as any page in
+/// it may now be backed by different memory. Changes that are made
+/// behind the map's back must be followed by a call to invalidate().
+///
+class EXPORT_EAPIS_HVE guest_memory
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this guest memory object
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    guest_memory(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~guest_memory() = default;
+
+    /// Set Walker
+    ///
+    /// Sets the guest page walker used to translate guest linear
+    /// addresses. This is set by the apis when the object is created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param walker the guest page walker of this vCPU
+    ///
+    void set_walker(gsl::not_null<guest_walker *> walker) noexcept
+    { m_walker = walker; }
+
+    /// Set EPT
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param map the EPT map that translates this vCPU's guest physical
+    ///     addresses, or nullptr if guest physical addresses are identity
+    ///     mapped
+    ///
+    void set_ept(ept::mmap *map);
+
+    /// Map Guest Physical
+    ///
+    /// @expects the range does not cross a page boundary
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to map
+    /// @param size the number of bytes to map
+    /// @return a span of the guest's memory, which remains valid until the
+    ///     next call to this object
+    ///
+    gsl::span<uint8_t> map_gpa(uint64_t gpa, uint64_t size);
+
+    /// Map Guest Virtual
+    ///
+    /// Same as map_gpa(), but gva is a linear address in the guest's
+    /// current address space
+    ///
+    /// @expects the range does not cross a page boundary
+    /// @ensures
+    ///
+    /// @param gva the guest linear address to map
+    /// @param size the number of bytes to map
+    /// @return a span of the guest's memory, which remains valid until the
+    ///     next call to this object
+    ///
+    gsl::span<uint8_t> map_gva(uint64_t gva, uint64_t size);
+
+    /// Read Guest Virtual
+    ///
+    /// Copies guest memory at gva into dst. Unlike map_gva(), the range
+    /// may cross page boundaries.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gva the guest linear address to read from
+    /// @param dst where to copy the guest's memory to
+    ///
+    void read_gva(uint64_t gva, gsl::span<uint8_t> dst);
+
+    /// Write Guest Virtual
+    ///
+    /// Copies src into guest memory at gva. Like read_gva(), the range
+    /// may cross page boundaries.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gva the guest linear address to write to
+    /// @param src what to copy into the guest's memory
+    ///
+    void write_gva(uint64_t gva, gsl::span<const uint8_t> src);
+
+    /// Invalidate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address that changed
+    /// @param size the size of the range that changed in bytes
+    ///
+    void invalidate(uint64_t gpa, uint64_t size);
+
+    /// Cache
+    ///
+    /// @return returns the cache of mapped pages
+    ///
+    const auto &cache() const noexcept
+    { return m_cache; }
+
+private:
+
+    uint64_t gpa_to_hpa(uint64_t gpa);
+
+    guest_walker *m_walker{nullptr};
+
+    ept::mmap *m_ept{nullptr};
+    uint64_t m_generation{0};
+
+    map_cache<bfvmm::x64::unique_map<uint8_t>> m_cache;
+
+public:
+
+    /// @cond
+
+    guest_memory(guest_memory &&) = default;
+    guest_memory &operator=(guest_memory &&) = default;
+
+    guest_memory(const guest_memory &) = delete;
+    guest_memory &operator=(const guest_memory &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,343 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef GUEST_WALKER_INTEL_X64_EAPIS_H
+#define GUEST_WALKER_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "vmexit/control_register.h"
+
+#include <bfupperlower.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Translation Cache
+///
+/// A small, direct-mapped cache of guest linear to guest physical page
+/// translations, tagged by the guest's CR3 (which includes the PCID when
+/// CR4.PCIDE is set). Like the guest's own TLB, entries are not validated
+/// against the guest's page tables once they have been added, so whoever
+/// owns the cache must invalidate it whenever the guest would flush its
+/// TLB (see guest_walker).
+///
+template<std::size_t N = 64>
+class gva_cache
+{
+    static_assert((N & (N - 1)) == 0, "N must be a power of 2");
+
+public:
+
+    /// Find
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tag the tag of the address space (see guest_walker::tag)
+    /// @param gva the guest linear address to look up
+    /// @param gpa where to store the guest physical address of gva on a hit
+    /// @return returns true on a hit
+    ///
+    bool find(uint64_t tag, uint64_t gva, uint64_t &gpa) noexcept
+    {
+        const auto page = bfn::upper(gva, ::x64::pt::from);
+        const auto &e = m_entries[index(tag, page)];
+
+        if (GSL_LIKELY(e.valid && e.tag == tag && e.gva == page)) {
+            m_hits++;
+            gpa = e.gpa | bfn::lower(gva, ::x64::pt::from);
+
+            return true;
+        }
+
+        m_misses++;
+        return false;
+    }
+
+    /// Insert
+    ///
+    /// Replaces any entry that is already in the same slot.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tag the tag of the address space (see guest_walker::tag)
+    /// @param gva a guest linear address
+    /// @param gpa the guest physical address gva translates to
+    ///
+    void insert(uint64_t tag, uint64_t gva, uint64_t gpa) noexcept
+    {
+        const auto page = bfn::upper(gva, ::x64::pt::from);
+        m_entries[index(tag, page)] = {true, tag, page, bfn::upper(gpa, ::x64::pt::from)};
+    }
+
+    /// Invalidate Page
+    ///
+    /// Removes the translation of the page that contains gva from every
+    /// address space (as INVLPG also flushes global translations, which
+    /// are not tagged by PCID).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gva a guest linear address in the page to remove
+    ///
+    void invalidate_page(uint64_t gva) noexcept
+    {
+        const auto page = bfn::upper(gva, ::x64::pt::from);
+
+        for (auto &e : m_entries) {
+            if (e.gva == page) {
+                e.valid = false;
+            }
+        }
+    }
+
+    /// Invalidate PCID
+    ///
+    /// Removes the translations of every address space tagged with pcid,
+    /// whatever the address of its page tables, as a MOV to CR3 (without
+    /// bit 63) flushes every translation of the PCID it loads.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param pcid the PCID (bits 11:0 of the tag) to remove
+    ///
+    void invalidate_pcid(uint64_t pcid) noexcept
+    {
+        for (auto &e : m_entries) {
+            if ((e.tag & pcid_mask) == pcid) {
+                e.valid = false;
+            }
+        }
+    }
+
+    /// Invalidate Tag
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tag removes every translation cached for this tag
+    ///
+    void invalidate_tag(uint64_t tag) noexcept
+    {
+        for (auto &e : m_entries) {
+            if (e.tag == tag) {
+                e.valid = false;
+            }
+        }
+    }
+
+    /// Clear
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear() noexcept
+    {
+        for (auto &e : m_entries) {
+            e.valid = false;
+        }
+    }
+
+    /// Hits
+    ///
+    /// @return returns the number of lookups that were found in the cache
+    ///
+    uint64_t hits() const noexcept
+    { return m_hits; }
+
+    /// Misses
+    ///
+    /// @return returns the number of lookups that were not in the cache
+    ///
+    uint64_t misses() const noexcept
+    { return m_misses; }
+
+private:
+
+    static constexpr const uint64_t pcid_mask = 0xFFFULL;
+
+    static std::size_t index(uint64_t tag, uint64_t page) noexcept
+    { return (((page >> 12) ^ (tag >> 12) ^ tag) * 0x9E3779B97F4A7C15ULL) >> (64 - log2()); }
+
+    static constexpr uint64_t log2() noexcept
+    {
+        uint64_t n = 0;
+        while ((1ULL << n) < N) {
+            n++;
+        }
+
+        return n;
+    }
+
+    struct entry_t {
+        bool valid;
+        uint64_t tag;
+        uint64_t gva;
+        uint64_t gpa;
+    };
+
+    std::array<entry_t, N> m_entries{};
+
+    uint64_t m_hits{0};
+    uint64_t m_misses{0};
+};
+
+/// Guest Page Walker
+///
+/// Translates guest linear addresses to guest physical addresses by
+/// walking the guest's page tables, and caches the result (see gva_cache)
+/// so that repeat accesses to the same guest buffers (e.g. string IO, or
+/// the instruction at the guest's RIP) skip the walk.
+///
+/// To keep the cache coherent with the guest's TLB, the walker traps
+/// INVLPG, INVPCID and CR3 writes (which flush the translations of the
+/// PCID being loaded, unless bit 63 is set with CR4.PCIDE), as well as
+/// writes to the CR0 and CR4 bits that flush the whole TLB.
+///
+class EXPORT_EAPIS_HVE guest_walker : public base
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this guest walker
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    guest_walker(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~guest_walker() final = default;
+
+public:
+
+    /// Guest Virtual to Guest Physical
+    ///
+    /// Translates gva using the guest's current CR3.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gva the guest linear address to translate
+    /// @return the guest physical address of gva
+    ///
+    uint64_t gva_to_gpa(uint64_t gva);
+
+    /// Guest Virtual to Guest Physical (CR3)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gva the guest linear address to translate
+    /// @param cr3 the CR3 of the address space to translate gva in
+    /// @return the guest physical address of gva
+    ///
+    uint64_t gva_to_gpa(uint64_t gva, uint64_t cr3);
+
+    /// Tag
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cr3 a value of the guest's CR3
+    /// @return the tag used for the translations of cr3's address space
+    ///
+    static constexpr uint64_t tag(uint64_t cr3) noexcept
+    { return cr3 & 0x7FFFFFFFFFFFFFFFULL; }
+
+    /// Cache
+    ///
+    /// @return returns the cache of translations
+    ///
+    gva_cache<> &cache() noexcept
+    { return m_cache; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final
+    { }
+
+public:
+
+    /// @cond
+
+    static uint64_t walk(uint64_t gva, uint64_t cr3);
+
+    bool handle_invlpg(gsl::not_null<vmcs_t *> vmcs);
+    bool handle_invpcid(gsl::not_null<vmcs_t *> vmcs);
+
+    bool handle_wrcr0(
+        gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info);
+    bool handle_wrcr3(
+        gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info);
+    bool handle_wrcr4(
+        gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    gva_cache<> m_cache;
+
+public:
+
+    /// @cond
+
+    guest_walker(guest_walker &&) = default;
+    guest_walker &operator=(guest_walker &&) = default;
+
+    guest_walker(const guest_walker &) = delete;
+    guest_walker &operator=(const guest_walker &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,248 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MSR_LISTS_INTEL_X64_EAPIS_H
+#define MSR_LISTS_INTEL_X64_EAPIS_H
+
+#include "base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// MSR Lists
+///
+/// Manages the VM-entry MSR-load, VM-exit MSR-store and VM-exit MSR-load
+/// areas of a vCPU, so that MSRs that only need to hold a different value
+/// in the guest than in the VMM are switched by the CPU on each VMX
+/// transition instead of trapping every access:
+///
+/// - the guest area is used as both the VM-entry MSR-load area and the
+///   VM-exit MSR-store area, so the values the guest leaves in these MSRs
+///   on a VM exit are the values that are loaded on the next VM entry
+/// - the host area is used as the VM-exit MSR-load area, and holds the
+///   values the VMM expects in these MSRs while it runs
+///
+/// Each area is a single page, owned by this object. Once an MSR is in the
+/// lists, the guest's accesses to it can be passed through in the MSR
+/// bitmaps (see apis::add_switched_msr()).
+///
+class EXPORT_EAPIS_HVE msr_lists
+{
+public:
+
+    /// Entry
+    ///
+    /// The format of each entry in the MSR-load/store areas (see the
+    /// Intel SDM, Vol. 3, 24.7.2)
+    ///
+    struct entry_t {
+        uint32_t index;
+        uint32_t reserved;
+        uint64_t data;
+    };
+
+    /// Max Entries
+    ///
+    /// The number of MSRs that fit in a page. The CPU's recommended
+    /// maximum (IA32_VMX_MISC[27:25]) is never smaller than this.
+    ///
+    static constexpr const std::size_t max_entries = 0x1000 / sizeof(entry_t);
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for these MSR lists
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    msr_lists(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~msr_lists() = default;
+
+    /// Add
+    ///
+    /// Adds msr to the lists. The guest's value is loaded on the next VM
+    /// entry, and the VMM's value is the value msr holds right now. If msr
+    /// is already in the lists, only its guest value is changed.
+    ///
+    /// @expects size() < max_entries if msr is not in the lists
+    /// @ensures
+    ///
+    /// @param msr the msr to switch on each VMX transition
+    /// @param guest_val the value msr holds while the guest runs
+    ///
+    void add(vmcs_n::value_type msr, uint64_t guest_val);
+
+    /// Add
+    ///
+    /// Same as add(msr, guest_val), but with an explicit VMM value.
+    ///
+    /// @expects size() < max_entries if msr is not in the lists
+    /// @ensures
+    ///
+    /// @param msr the msr to switch on each VMX transition
+    /// @param guest_val the value msr holds while the guest runs
+    /// @param host_val the value msr holds while the VMM runs
+    ///
+    void add(vmcs_n::value_type msr, uint64_t guest_val, uint64_t host_val);
+
+    /// Remove
+    ///
+    /// Removes msr from the lists. The value the guest left in msr stays
+    /// loaded after the next VM exit, so the caller should restore the
+    /// VMM's value (see host_value()) if it differs. Does nothing if msr
+    /// is not in the lists.
+    ///
+    /// @expects
+    /// @ensures !contains(msr)
+    ///
+    /// @param msr the msr to stop switching
+    ///
+    void remove(vmcs_n::value_type msr);
+
+    /// Contains
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to look up
+    /// @return returns true if msr is in the lists
+    ///
+    bool contains(vmcs_n::value_type msr) const noexcept;
+
+    /// Guest Value
+    ///
+    /// When called from a VM exit, this is the value the guest had in msr
+    /// when the VM exit occurred.
+    ///
+    /// @expects contains(msr)
+    /// @ensures
+    ///
+    /// @param msr the msr to look up
+    /// @return returns the value msr holds while the guest runs
+    ///
+    uint64_t guest_value(vmcs_n::value_type msr) const;
+
+    /// Set Guest Value
+    ///
+    /// @expects contains(msr)
+    /// @ensures
+    ///
+    /// @param msr the msr to change
+    /// @param val the value msr holds while the guest runs
+    ///
+    void set_guest_value(vmcs_n::value_type msr, uint64_t val);
+
+    /// Host Value
+    ///
+    /// @expects contains(msr)
+    /// @ensures
+    ///
+    /// @param msr the msr to look up
+    /// @return returns the value msr holds while the VMM runs
+    ///
+    uint64_t host_value(vmcs_n::value_type msr) const;
+
+    /// Set Host Value
+    ///
+    /// @expects contains(msr)
+    /// @ensures
+    ///
+    /// @param msr the msr to change
+    /// @param val the value msr holds while the VMM runs
+    ///
+    void set_host_value(vmcs_n::value_type msr, uint64_t val);
+
+    /// Size
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of MSRs in the lists
+    ///
+    std::size_t size() const noexcept
+    { return m_size; }
+
+    /// Guest Area
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the entries of the VM-entry MSR-load / VM-exit
+    ///     MSR-store area that are in use
+    ///
+    gsl::span<const entry_t> guest_area() const noexcept;
+
+    /// Host Area
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the entries of the VM-exit MSR-load area that are
+    ///     in use
+    ///
+    gsl::span<const entry_t> host_area() const noexcept;
+
+private:
+
+    std::size_t index_of(vmcs_n::value_type msr) const noexcept;
+    std::size_t checked_index_of(vmcs_n::value_type msr) const;
+
+    void write_vmcs();
+
+private:
+
+    std::unique_ptr<entry_t, void(*)(void *)> m_guest;
+    std::unique_ptr<entry_t, void(*)(void *)> m_host;
+
+    std::size_t m_size{0};
+
+public:
+
+    /// @cond
+
+    msr_lists(msr_lists &&) = default;
+    msr_lists &operator=(msr_lists &&) = default;
+
+    msr_lists(const msr_lists &) = delete;
+    msr_lists &operator=(const msr_lists &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,279 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MTRR_PAT_INTEL_X64_EAPIS_H
+#define MTRR_PAT_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "mtrrs.h"
+#include "ept/overrides.h"
+#include "vmexit/rdmsr.h"
+#include "vmexit/wrmsr.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// MTRR / PAT
+///
+/// Virtualizes the guest's MTRRs and IA32_PAT. The MTRR MSRs are never
+/// written to the CPU (they are shared by all of the software on it);
+/// instead, reads and writes are emulated against a copy of the MSRs that
+/// starts out as the host's. When the guest changes its MTRRs, the guest's
+/// range list is rebuilt (see mtrrs::update()) and compared with the
+/// previous one, and only the GPAs whose guest memory type changed are
+/// retyped in the EPT map, followed by a single invalidation.
+///
+/// The memory type given to EPT is the stricter of the host's and the
+/// guest's MTRR type for the address (see effective_type()), so the guest
+/// can make memory less cacheable than the host's MTRRs say, but never
+/// more. Ranges with a memory type override (see
+/// ept::memory_type_overrides) are left alone.
+///
+/// IA32_PAT is loaded from / saved to the VMCS on each VM entry / exit,
+/// so writes to it only update the VMCS. The CPU combines the guest's PAT
+/// with the EPT memory type itself, which is why a PAT write never
+/// touches EPT.
+///
+/// Each vCPU has its own copy of the MSRs, but the EPT map might be
+/// shared. This is fine for guests that program the same MTRRs on each
+/// CPU (which the SDM requires), as the last write wins.
+///
+class EXPORT_EAPIS_HVE mtrr_pat_handler : public base
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this MTRR / PAT handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    mtrr_pat_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~mtrr_pat_handler() final = default;
+
+public:
+
+    /// Enable
+    ///
+    /// Starts trapping the guest's accesses to its MTRRs and IA32_PAT,
+    /// using the host's current values as the guest's initial ones.
+    ///
+    /// @expects [0, size) is identity mapped in map with the host's MTRR
+    ///     types (see ept::identity_map()), and size is 4k aligned
+    /// @expects g_mtrrs->size() != 0
+    /// @ensures
+    ///
+    /// @param map the map to update when the guest's MTRRs change
+    /// @param size the number of bytes of guest physical memory mapped
+    /// @param overrides the memory type overrides used to build the map,
+    ///     or nullptr
+    ///
+    void enable(
+        ept::mmap &map, uint64_t size,
+        const ept::memory_type_overrides *overrides = nullptr);
+
+    /// Effective Type
+    ///
+    /// The SDM only defines the result of overlapping UC with anything
+    /// (UC) and WT with WB (WT). The other combinations use the same
+    /// order, which the memory type encodings happen to follow:
+    /// UC < WC < WT < WP < WB.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param host the host's memory type for an address
+    /// @param guest the guest's memory type for the same address
+    /// @return returns the stricter of the two memory types
+    ///
+    static ept::mmap::memory_type effective_type(
+        ept::mmap::memory_type host, ept::mmap::memory_type guest) noexcept;
+
+    /// Guest MSRs
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the guest's MTRR MSRs
+    ///
+    const mtrrs::msrs_t &guest_msrs() const noexcept
+    { return m_msrs; }
+
+    /// Guest MTRRs
+    ///
+    /// @expects enable() has been called
+    /// @ensures
+    ///
+    /// @return returns the range list of the guest's MTRRs
+    ///
+    const mtrrs &guest_mtrrs() const
+    { return *m_current; }
+
+    /// Guest PAT
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the guest's IA32_PAT
+    ///
+    uint64_t guest_pat() const noexcept
+    { return m_pat; }
+
+    /// Updates
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of guest MTRR writes that changed the
+    ///     guest's MTRRs
+    ///
+    uint64_t updates() const noexcept
+    { return m_updates; }
+
+    /// Invalidations
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of updates that changed EPT (each of
+    ///     which invalidated EPT once)
+    ///
+    uint64_t invalidations() const noexcept
+    { return m_invalidations; }
+
+    /// Retyped Bytes
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the total number of bytes of guest physical memory
+    ///     whose EPT memory type was changed
+    ///
+    uint64_t retyped_bytes() const noexcept
+    { return m_retyped_bytes; }
+
+    /// Rejected Writes
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of guest writes that were dropped,
+    ///     either because they had an invalid memory type (or reserved
+    ///     bits) or because they produced MTRRs that are not supported
+    ///
+    uint64_t rejected_writes() const noexcept
+    { return m_rejected_writes; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final
+    { }
+
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage the memory usage to add this handler's usage to
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+public:
+
+    /// @cond
+
+    bool handle_rdmsr(
+        gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info);
+
+    bool handle_wrmsr(
+        gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    uint64_t *shadow(uint64_t msr);
+    bool is_valid(uint64_t msr, uint64_t val) const;
+
+    void update_ept();
+
+private:
+
+    apis *m_apis;
+
+    mtrrs::msrs_t m_msrs{};
+    uint64_t m_pat{0};
+
+    std::unique_ptr<mtrrs> m_current;
+    std::unique_ptr<mtrrs> m_next;
+
+    ept::mmap *m_map{nullptr};
+    uint64_t m_size{0};
+    const ept::memory_type_overrides *m_overrides{nullptr};
+
+    uint64_t m_updates{0};
+    uint64_t m_invalidations{0};
+    uint64_t m_retyped_bytes{0};
+    uint64_t m_rejected_writes{0};
+
+public:
+
+    /// @cond
+
+    mtrr_pat_handler(mtrr_pat_handler &&) = default;
+    mtrr_pat_handler &operator=(mtrr_pat_handler &&) = default;
+
+    mtrr_pat_handler(const mtrr_pat_handler &) = delete;
+    mtrr_pat_handler &operator=(const mtrr_pat_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -51,6 +51,49 @@ class EXPORT_EAPIS_HVE mtrrs
 public:
 
     constexpr static auto invalid = 0xFFFFFFFFFFFFFFFF;     ///< Invalid
+    constexpr static auto max_variable_ranges = 32U;         ///< Max variable ranges
+
+    /// Fixed Range
+    ///
+    /// Describes one of the fixed-range MTRRs, which each hold the memory
+    /// type of eight consecutive sub-ranges (one byte per sub-range)
+    ///
+    struct fixed_range_t {
+        uint32_t addr;      ///< The address of the MSR
+        uint64_t base;      ///< The base of the first sub-range
+        uint64_t size;      ///< The size of each sub-range
+    };
+
+    /// Fixed Ranges
+    ///
+    /// The fixed-range MTRRs, in address order
+    ///
+    constexpr static std::array<fixed_range_t, 11> fixed_ranges = {{
+        {0x250U, 0x00000U, 0x10000U},       // IA32_MTRR_FIX64K_00000
+        {0x258U, 0x80000U, 0x04000U},       // IA32_MTRR_FIX16K_80000
+        {0x259U, 0xA0000U, 0x04000U},       // IA32_MTRR_FIX16K_A0000
+        {0x268U, 0xC0000U, 0x01000U},       // IA32_MTRR_FIX4K_C0000
+        {0x269U, 0xC8000U, 0x01000U},       // IA32_MTRR_FIX4K_C8000
+        {0x26AU, 0xD0000U, 0x01000U},       // IA32_MTRR_FIX4K_D0000
+        {0x26BU, 0xD8000U, 0x01000U},       // IA32_MTRR_FIX4K_D8000
+        {0x26CU, 0xE0000U, 0x01000U},       // IA32_MTRR_FIX4K_E0000
+        {0x26DU, 0xE8000U, 0x01000U},       // IA32_MTRR_FIX4K_E8000
+        {0x26EU, 0xF0000U, 0x01000U},       // IA32_MTRR_FIX4K_F0000
+        {0x26FU, 0xF8000U, 0x01000U},       // IA32_MTRR_FIX4K_F8000
+    }};
+
+    /// MSRs
+    ///
+    /// The raw values of the MTRR MSRs that the range list is built from.
+    /// By default these are read from the CPU, but they can also come from
+    /// somewhere else (e.g. the MTRRs a guest has programmed).
+    ///
+    struct msrs_t {
+        uint64_t cap{0};                                ///< IA32_MTRRCAP
+        uint64_t def_type{0};                           ///< IA32_MTRR_DEF_TYPE
+        std::array<uint64_t, 11> fixed{};               ///< IA32_MTRR_FIX*, see fixed_ranges
+        std::array<uint64_t, max_variable_ranges * 2> variable{};   ///< IA32_MTRR_PHYSBASE/MASKn
+    };
 
     /// Range
     ///
@@ -116,6 +159,40 @@ public:
     ///
     static mtrrs *instance() noexcept;
 
+    /// Constructor
+    ///
+    /// Builds the range list from the provided MSR values instead of the
+    /// CPU's MTRRs.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msrs the MTRR MSRs to build the range list from
+    ///
+    explicit mtrrs(const msrs_t &msrs) noexcept;
+
+    /// Read MSRs
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the current values of the CPU's MTRR MSRs
+    ///
+    static msrs_t read_msrs();
+
+    /// Update
+    ///
+    /// Rebuilds the range list from the provided MSR values. As with the
+    /// constructor, if the MSRs describe a configuration that is not
+    /// supported, the range list is left empty.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msrs the MTRR MSRs to build the range list from
+    ///
+    void update(const msrs_t &msrs) noexcept;
+
     /// Ranges
     ///
     /// Returns a list of the ranges identified by the MTRRs. Note that the
@@ -149,6 +226,47 @@ public:
     auto size() const
     { return m_num; }
 
+    /// Find
+    ///
+    /// Returns the range that contains the provided address. As the ranges
+    /// are sorted, continuous and cover all of physical memory, this is a
+    /// binary search, so addresses can be looked up in any order.
+    ///
+    /// @expects size() != 0
+    /// @ensures
+    ///
+    /// @param addr the physical address to look up
+    /// @return returns the range that contains addr
+    ///
+    const range_t &find(uint64_t addr) const;
+
+    /// Type Of
+    ///
+    /// @expects size() != 0
+    /// @ensures
+    ///
+    /// @param addr the physical address to look up
+    /// @return returns the memory type of addr
+    ///
+    ept::mmap::memory_type type_of(uint64_t addr) const
+    { return this->find(addr).type; }
+
+    /// Next Boundary
+    ///
+    /// @expects size() != 0
+    /// @ensures
+    ///
+    /// @param addr the physical address to look up
+    /// @return returns the first address after addr with a (potentially)
+    ///     different memory type (i.e. the end of the range that contains
+    ///     addr)
+    ///
+    uint64_t next_boundary(uint64_t addr) const
+    {
+        const auto &range = this->find(addr);
+        return range.base + range.size;
+    }
+
     /// Dump
     ///
     /// Prints the MTRR ranges.
@@ -164,8 +282,8 @@ private:
 
     mtrrs() noexcept;
 
-    void get_fixed_ranges();
-    void get_variable_ranges();
+    void get_fixed_ranges(const msrs_t &msrs);
+    void get_variable_ranges(const msrs_t &msrs);
 
     bool make_continuous();
 
@@ -175,6 +293,7 @@ private:
 private:
 
     uint8_t m_num{0};
+    bool m_fixed{false};
     std::array<range_t, 256> m_ranges;
 
 public:
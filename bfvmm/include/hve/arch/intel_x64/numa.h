@@ -0,0 +1,151 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef NUMA_INTEL_X64_EAPIS_H
+#define NUMA_INTEL_X64_EAPIS_H
+
+#include <cstdint>
+
+#include <bfvmm/memory_manager/memory_manager.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+namespace numa
+{
+
+/// Node Type
+///
+using node_t = uint32_t;
+
+/// Any Node
+///
+/// Used as a node hint, this means the node of the core that is doing the
+/// allocation (see current_node())
+///
+constexpr const node_t any_node = 0xFFFFFFFF;
+
+/// Page Allocator
+///
+/// The base hypervisor's page allocator has no notion of NUMA nodes, so
+/// the platform (which knows the topology, e.g. from the ACPI SRAT) can
+/// provide its own node aware page allocator using set_allocator(). Until
+/// it does, every page comes from alloc_page() and is reported as being
+/// on node 0.
+///
+struct allocator_t {
+
+    /// Allocates a page on the provided node (never any_node)
+    ///
+    void *(*alloc_page)(node_t node);
+
+    /// Frees a page allocated using alloc_page
+    ///
+    void (*free_page)(void *ptr);
+
+    /// Returns the node a page allocated using alloc_page lives on
+    ///
+    node_t (*node_of)(const void *ptr);
+
+    /// Returns the node of the calling core
+    ///
+    node_t (*current_node)();
+};
+
+/// @cond
+
+inline allocator_t &
+allocator() noexcept
+{
+    static allocator_t s_allocator = {
+        [](node_t) -> void * { return ::alloc_page(); },
+        [](void *ptr) { ::free_page(ptr); },
+        [](const void *) -> node_t { return 0; },
+        []() -> node_t { return 0; }
+    };
+
+    return s_allocator;
+}
+
+/// @endcond
+
+/// Set Allocator
+///
+/// @expects no page has been allocated using the current allocator yet
+/// @ensures
+///
+/// @param a the allocator to use from now on
+///
+inline void
+set_allocator(const allocator_t &a) noexcept
+{ allocator() = a; }
+
+/// Current Node
+///
+/// @return returns the node of the calling core
+///
+inline node_t
+current_node()
+{ return allocator().current_node(); }
+
+/// Allocate Page
+///
+/// @expects
+/// @ensures
+///
+/// @param node the node to allocate the page on, or any_node to allocate
+///     it on the node of the calling core
+/// @return returns the newly allocated page
+///
+inline void *
+alloc_page(node_t node = any_node)
+{ return allocator().alloc_page(node == any_node ? current_node() : node); }
+
+/// Free Page
+///
+/// @expects ptr was allocated using numa::alloc_page()
+/// @ensures
+///
+/// @param ptr the page to free
+///
+inline void
+free_page(void *ptr)
+{ allocator().free_page(ptr); }
+
+/// Node Of
+///
+/// @expects ptr was allocated using numa::alloc_page()
+/// @ensures
+///
+/// @param ptr the page to look up
+/// @return returns the node the page lives on
+///
+inline node_t
+node_of(const void *ptr)
+{ return allocator().node_of(ptr); }
+
+}
+}
+}
+
+#endif
@@ -0,0 +1,236 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef POSTED_INTERRUPTS_INTEL_X64_EAPIS_H
+#define POSTED_INTERRUPTS_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "virtual_apic.h"
+#include "vmexit/external_interrupt.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Posted Interrupts
+///
+/// Provides an interface for posting interrupts to a vCPU. A posted vector
+/// is recorded in the vCPU's posted-interrupt descriptor, and the core the
+/// vCPU runs on is sent the notification vector. If the vCPU is running,
+/// the CPU delivers the vector to the guest directly (as a virtual
+/// interrupt) without a VM exit. If the vCPU is in the VMM, the
+/// notification causes an external interrupt exit, which is handled here
+/// by moving the posted vectors into the virtual APIC before the next VM
+/// entry.
+///
+/// Posted interrupts require virtual interrupt delivery, so enable() also
+/// enables the vCPU's virtual APIC (see virtual_apic_handler), which
+/// forwards the external interrupts that still exit to the guest.
+///
+class EXPORT_EAPIS_HVE posted_interrupt_handler
+{
+public:
+
+    /// Descriptor
+    ///
+    /// The layout of the posted-interrupt descriptor
+    ///
+    struct descriptor_t {
+
+        /// Posted-Interrupt Requests
+        ///
+        /// One bit for each vector that has been posted, but not yet
+        /// delivered to the guest
+        ///
+        std::array<uint64_t, 4> pir;
+
+        /// Control
+        ///
+        /// Outstanding notification (bit 0), suppress notification (bit 1),
+        /// notification vector (bits 16-23) and notification destination
+        /// (bits 32-63)
+        ///
+        uint64_t control;
+
+        /// @cond
+
+        std::array<uint64_t, 3> reserved;
+
+        /// @endcond
+    };
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this posted interrupt handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    /// @param virtual_apic the virtual APIC posted vectors are delivered to
+    ///
+    posted_interrupt_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state,
+        gsl::not_null<virtual_apic_handler *> virtual_apic);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~posted_interrupt_handler() = default;
+
+    /// Enable
+    ///
+    /// Enables posted interrupts and the virtual APIC. This must
+    /// be called from the core the vCPU runs on, as that core's x2APIC ID
+    /// becomes the notification destination.
+    ///
+    /// @expects vector >= 32 && vector <= 255
+    /// @ensures
+    ///
+    /// @param vector the notification vector. This vector is reserved for
+    ///     notifications, and should not be used by the guest.
+    ///
+    void enable(uint64_t vector);
+
+    /// Disable
+    ///
+    /// Disables posted interrupts. The virtual APIC is left enabled.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Is Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if posted interrupts are enabled
+    ///
+    bool is_enabled() const noexcept;
+
+    /// Post
+    ///
+    /// Posts vector to this vCPU. This is safe to call from any core. A
+    /// notification is only sent if one is not already outstanding, so
+    /// posting several vectors in a row costs a single IPI.
+    ///
+    /// @expects enable() has been called
+    /// @expects vector >= 16 && vector <= 255
+    /// @ensures
+    ///
+    /// @param vector the vector to post
+    /// @return returns true if a notification was sent
+    ///
+    bool post(uint64_t vector);
+
+    /// Sync
+    ///
+    /// Moves the vectors that have been posted, but not yet delivered, into
+    /// the virtual APIC so that they are delivered on the next VM entry.
+    /// This must be called on the vCPU's core while it is in the VMM. It is
+    /// called automatically when a notification causes an exit.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of vectors that were moved
+    ///
+    uint64_t sync();
+
+    /// Suppress Notifications
+    ///
+    /// While suppressed, post() still records vectors, but does not send a
+    /// notification (e.g. while the vCPU is not scheduled). Call sync()
+    /// once notifications are no longer suppressed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param suppress if true, notifications are suppressed
+    ///
+    void suppress_notifications(bool suppress) noexcept;
+
+    /// Descriptor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns this vCPU's posted-interrupt descriptor
+    ///
+    descriptor_t *descriptor() noexcept
+    { return m_descriptor.get(); }
+
+    /// Virtual APIC
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the virtual APIC posted vectors are delivered to
+    ///
+    gsl::not_null<virtual_apic_handler *> virtual_apic() noexcept
+    { return m_virtual_apic; }
+
+public:
+
+    /// @cond
+
+    bool handle_notification(
+        gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    gsl::not_null<apis *> m_apis;
+
+    gsl::not_null<virtual_apic_handler *> m_virtual_apic;
+
+    std::unique_ptr<descriptor_t, void(*)(void *)> m_descriptor;
+
+    uint64_t m_vector{0};
+    bool m_registered{false};
+
+public:
+
+    /// @cond
+
+    posted_interrupt_handler(posted_interrupt_handler &&) = default;
+    posted_interrupt_handler &operator=(posted_interrupt_handler &&) = default;
+
+    posted_interrupt_handler(const posted_interrupt_handler &) = delete;
+    posted_interrupt_handler &operator=(const posted_interrupt_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
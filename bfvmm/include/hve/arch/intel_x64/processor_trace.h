@@ -0,0 +1,297 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#ifndef PROCESSOR_TRACE_INTEL_X64_EAPIS_H
+#define PROCESSOR_TRACE_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "vmexit/external_interrupt.h"
+#include "vmexit/wrmsr.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Processor Trace
+///
+/// Provides an interface for tracing the guest with Intel Processor Trace
+/// (PT) instead of single stepping it with the monitor trap flag. Once
+/// enabled, the CPU writes the guest's control flow into a circular
+/// buffer owned by this handler without any VM exits:
+///
+/// - IA32_RTIT_CTL is loaded from the VMCS on VM entry and cleared on VM
+///   exit, so only the guest is traced and the VMM never has to save or
+///   restore it
+/// - the output is described by a ToPA (table of physical addresses)
+///   that wraps around onto itself, and the VMX transitions are concealed
+///   from the trace
+/// - when the last output region fills, the CPU raises a PMI (which the
+///   caller routes to an exiting vector, see enable()) and the ToPA-full
+///   handlers are called
+///
+/// The trace is streamed out with read(), which may be called from any
+/// exit on the vCPU that owns the handler (tracing is off while the VMM
+/// runs, so the output pointers are stable). If the buffer wraps before
+/// it is read, the oldest packets are lost and counted by dropped().
+///
+/// Guest writes to IA32_RTIT_CTL are ignored while tracing is enabled.
+///
+class EXPORT_EAPIS_HVE processor_trace_handler
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by processor_trace_handler::handle_pmi
+    /// before being passed to each registered ToPA-full handler.
+    ///
+    struct info_t {
+
+        /// Wraps (in)
+        ///
+        /// The number of times the output buffer has filled, including
+        /// this one
+        ///
+        uint64_t wraps;
+
+        /// Pending (in)
+        ///
+        /// The number of bytes waiting to be read (see read())
+        ///
+        uint64_t pending;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Number of Pages
+    ///
+    /// The number of 4k output regions in the ToPA
+    ///
+    static constexpr const std::size_t num_pages = 16;
+
+    /// Buffer Size
+    ///
+    /// The size of the trace buffer in bytes
+    ///
+    static constexpr const std::size_t buffer_size = num_pages * 0x1000;
+
+    /// Default Control
+    ///
+    /// The IA32_RTIT_CTL bits that enable() uses by default (branch
+    /// tracing, in both the guest's kernel and user mode)
+    ///
+    static constexpr const uint64_t default_ctl = 0x200CULL;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this processor trace handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    processor_trace_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~processor_trace_handler() = default;
+
+    /// Is Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the CPU supports tracing the guest with
+    ///     ToPA output while in VMX operation
+    ///
+    static bool is_supported();
+
+    /// Add ToPA Full Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when the output buffer fills
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Enable
+    ///
+    /// Starts tracing the guest on the next VM entry, from the start of the
+    /// output buffer (anything that was not read yet is discarded). The
+    /// PMI raised when the output buffer fills is delivered to pmi_vector,
+    /// which is programmed into the LVT performance monitor entry of the
+    /// x2APIC. The vector should not be used by the guest, as the handler
+    /// consumes it.
+    ///
+    /// @expects pmi_vector >= 32 && pmi_vector <= 255
+    /// @ensures
+    ///
+    /// @param pmi_vector the vector to deliver the ToPA PMI on
+    /// @param ctl the control bits to trace with (TraceEn and ToPA are
+    ///     always set)
+    ///
+    void enable(uint64_t pmi_vector, uint64_t ctl = default_ctl);
+
+    /// Disable
+    ///
+    /// Stops tracing the guest on the next VM entry. Packets that have not
+    /// been read yet can still be read.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Is Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the guest is being traced
+    ///
+    bool is_enabled() const noexcept
+    { return m_enabled; }
+
+    /// Read
+    ///
+    /// Copies up to buf.size() bytes of trace packets that have not been
+    /// read yet into buf, oldest first.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param buf where to copy the trace packets
+    /// @return returns the number of bytes copied into buf
+    ///
+    std::size_t read(gsl::span<uint8_t> buf);
+
+    /// Pending
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of bytes waiting to be read (at most
+    ///     buffer_size)
+    ///
+    uint64_t pending();
+
+    /// Wraps
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of times the output buffer filled
+    ///
+    uint64_t wraps() const noexcept
+    { return m_wraps; }
+
+    /// Dropped
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of bytes that were overwritten before
+    ///     they were read
+    ///
+    uint64_t dropped() const noexcept
+    { return m_dropped; }
+
+    /// ToPA
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the ToPA (num_pages output entries followed by an
+    ///     END entry that points back to the start of the table)
+    ///
+    gsl::span<uint64_t> topa() noexcept;
+
+public:
+
+    /// @cond
+
+    bool handle_pmi(
+        gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info);
+
+    bool handle_wrmsr(
+        gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    uint64_t head();
+
+private:
+
+    gsl::not_null<apis *> m_apis;
+
+    std::unique_ptr<uint64_t, void(*)(void *)> m_topa;
+    std::vector<std::unique_ptr<uint8_t, void(*)(void *)>> m_pages;
+
+    delegate_chain<handler_delegate_t> m_handlers;
+
+    uint64_t m_vector{0};
+    uint64_t m_pos{0};
+    uint64_t m_wraps{0};
+    uint64_t m_tail{0};
+    uint64_t m_dropped{0};
+
+    bool m_enabled{false};
+    bool m_registered{false};
+
+public:
+
+    /// @cond
+
+    processor_trace_handler(processor_trace_handler &&) = default;
+    processor_trace_handler &operator=(processor_trace_handler &&) = default;
+
+    processor_trace_handler(const processor_trace_handler &) = delete;
+    processor_trace_handler &operator=(const processor_trace_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,260 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef STATS_INTEL_X64_EAPIS_H
+#define STATS_INTEL_X64_EAPIS_H
+
+#include <vector>
+#include <bfstats.h>
+
+#include "base.h"
+#include "guest_memory.h"
+#include "vmexit/preemption_timer.h"
+#include "vmexit/vmcall.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Stats Service
+///
+/// Answers batches of stats / control commands issued by a guest with a
+/// single vmcall (see bfstats.h for the protocol, and bfack for a client).
+/// The batch is copied out of the guest, every command in it is run
+/// against this vCPU's apis, and the batch (now holding the results) is
+/// copied back, so the cost of polling is one exit per batch, no matter
+/// how many counters, histograms and samples are fetched.
+///
+/// Commands only use the apis (e.g. apis::exit_latency() and
+/// apis::profiler()), so they report on, and configure, the vCPU the
+/// vmcall was issued on.
+///
+/// Commands can also be queued in a request ring in guest memory (see
+/// attach_ring()), which is polled on the exits the vCPU takes anyway, so
+/// a guest agent issuing a high rate of commands only needs a vmcall when
+/// it submits to an empty ring.
+///
+class EXPORT_EAPIS_HVE stats_service
+{
+public:
+
+    /// Constructor
+    ///
+    /// Registers the service for stats::vmcall_opcode and
+    /// stats::ring_vmcall_opcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this stats service
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    stats_service(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~stats_service() = default;
+
+    /// Set Guest Memory
+    ///
+    /// Sets the object used to copy batches in and out of the guest. This
+    /// is set by the apis when the object is created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mem this vCPU's guest memory object
+    ///
+    void set_guest_memory(guest_memory *mem) noexcept
+    { m_guest_memory = mem; }
+
+    /// Process
+    ///
+    /// Runs every command in batch, writing the results (and the status
+    /// of each command) back into batch.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param batch a batch header, followed by its commands and the
+    ///     space for their output
+    /// @return the status of the batch as a whole (see stats::status_t)
+    ///
+    int32_t process(gsl::span<uint8_t> batch);
+
+    /// Attach Ring
+    ///
+    /// Attaches the request ring in the guest physical page at gpa (see
+    /// bfstats.h), replacing the ring that is attached, if any, and polls
+    /// it at the start of every exit from now on (see
+    /// apis::set_exit_poll_handler()). If period is not 0, the ring is also
+    /// polled every period TSC ticks of guest execution, using the
+    /// preemption timer (see apis::arm_preemption_timer()), which must not
+    /// be armed by anything else while the ring is attached.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address of the ring
+    /// @param period how often to poll the ring using the preemption
+    ///     timer, or 0 to only poll on exits and doorbells
+    /// @return the status of the attach (see stats::status_t)
+    ///
+    int32_t attach_ring(uint64_t gpa, uint64_t period = 0);
+
+    /// Detach Ring
+    ///
+    /// Stops polling the request ring. Does nothing if no ring is attached.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void detach_ring();
+
+    /// Is Ring Attached
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if a request ring is attached
+    ///
+    bool is_ring_attached() const noexcept
+    { return m_ring_attached; }
+
+    /// Poll
+    ///
+    /// Runs every command that has been submitted to the request ring
+    /// since the last poll
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the status of the ring as a whole (see stats::status_t)
+    ///
+    int32_t poll();
+
+    /// Process Ring
+    ///
+    /// Runs every command between the ring's head and tail, writing the
+    /// results (and the status of each command) back into its slot, and
+    /// moving head past it (see bfstats.h). This is what poll() runs on
+    /// the attached ring.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring a ring header, followed by its slots and the space for
+    ///     their output (stats::ring_size bytes)
+    /// @return the status of the ring as a whole (see stats::status_t)
+    ///
+    int32_t process_ring(gsl::span<uint8_t> ring);
+
+    /// Ring Requests
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of commands run from the request ring
+    ///
+    uint64_t ring_requests() const noexcept
+    { return m_ring_requests; }
+
+    /// Batches
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of batches processed
+    ///
+    uint64_t batches() const noexcept
+    { return m_batches; }
+
+    /// Commands
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of commands processed
+    ///
+    uint64_t commands() const noexcept
+    { return m_commands; }
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs, vmcall_handler::info_t &info);
+    bool handle_ring(gsl::not_null<vmcs_t *> vmcs, vmcall_handler::info_t &info);
+    void handle_exit(gsl::not_null<vmcs_t *> vmcs);
+    bool handle_timer(gsl::not_null<vmcs_t *> vmcs, preemption_timer_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    void execute(stats::command_t &cmd, gsl::span<uint8_t> buf, uint64_t table);
+    int32_t run(stats::command_t &cmd, gsl::span<uint8_t> out);
+    int32_t set_feature(uint64_t feature, uint64_t arg, bool enable);
+    int32_t set_range(uint32_t op, uint64_t first, uint64_t last);
+
+    apis *m_apis;
+    guest_memory *m_guest_memory{nullptr};
+
+    std::vector<uint8_t> m_batch;
+    std::vector<exit_profiler<>::sample_t> m_samples;
+
+    uint64_t m_batches{0};
+    uint64_t m_commands{0};
+
+    uint64_t m_ring_gpa{0};
+    uint64_t m_ring_period{0};
+    uint64_t m_ring_requests{0};
+    bool m_ring_attached{false};
+    bool m_polling{false};
+    bool m_timer_registered{false};
+
+public:
+
+    /// @cond
+
+    stats_service(stats_service &&) = default;
+    stats_service &operator=(stats_service &&) = default;
+
+    stats_service(const stats_service &) = delete;
+    stats_service &operator=(const stats_service &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
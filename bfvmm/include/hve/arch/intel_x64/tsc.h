@@ -0,0 +1,223 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef TSC_INTEL_X64_EAPIS_H
+#define TSC_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "vmexit/wrmsr.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// TSC
+///
+/// Virtualizes the guest's TSC without trapping RDTSC, RDTSCP or reads of
+/// IA32_TSC. The guest's TSC is the host's TSC, scaled by the TSC
+/// multiplier (if scaling is enabled), plus the TSC offset, both of which
+/// the CPU applies on every read. Only writes to IA32_TSC are trapped,
+/// and they are emulated by updating the offset.
+///
+class EXPORT_EAPIS_HVE tsc_handler : public base
+{
+public:
+
+    /// Multiplier Shift
+    ///
+    /// The TSC multiplier is a fixed point value with this many bits of
+    /// fraction (i.e., 1 << multiplier_shift is a ratio of 1)
+    ///
+    static constexpr const uint64_t multiplier_shift = 48;
+
+    /// Constructor
+    ///
+    /// Enables TSC offsetting (with an offset of 0, so the guest's TSC is
+    /// unchanged) and traps writes to IA32_TSC.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this TSC handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    tsc_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~tsc_handler() final = default;
+
+public:
+
+    /// Is Scaling Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true iff the CPU supports TSC scaling
+    ///
+    static bool is_scaling_supported();
+
+    /// Set Offset
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the value added to the (scaled) host TSC
+    ///
+    void set_offset(uint64_t offset);
+
+    /// Offset
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the TSC offset
+    ///
+    uint64_t offset() const noexcept
+    { return m_offset; }
+
+    /// Enable Scaling
+    ///
+    /// Runs the guest's TSC at guest_khz on a host whose TSC runs at
+    /// host_khz. The offset is adjusted so that the guest's TSC does not
+    /// jump when the multiplier changes.
+    ///
+    /// @expects is_scaling_supported()
+    /// @expects guest_khz != 0 && host_khz != 0
+    /// @ensures
+    ///
+    /// @param guest_khz the frequency of the guest's TSC
+    /// @param host_khz the frequency of the host's TSC
+    ///
+    void enable_scaling(uint64_t guest_khz, uint64_t host_khz);
+
+    /// Disable Scaling
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_scaling();
+
+    /// Multiplier
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the TSC multiplier (1 << multiplier_shift if scaling is
+    ///     disabled)
+    ///
+    uint64_t multiplier() const noexcept
+    { return m_multiplier; }
+
+    /// Guest TSC
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param host_tsc a value of the host's TSC
+    /// @return the guest's TSC at host_tsc
+    ///
+    uint64_t guest_tsc(uint64_t host_tsc) const noexcept;
+
+    /// Set Guest TSC
+    ///
+    /// Sets the offset so that the guest's TSC reads val at host_tsc
+    /// (which is how writes to IA32_TSC are emulated)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param val the guest's TSC
+    /// @param host_tsc a value of the host's TSC
+    ///
+    void set_guest_tsc(uint64_t val, uint64_t host_tsc);
+
+    /// TSC Writes
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of guest writes to IA32_TSC
+    ///
+    uint64_t tsc_writes() const noexcept
+    { return m_tsc_writes; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final
+    { }
+
+public:
+
+    /// @cond
+
+    bool handle_wrmsr(
+        gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    uint64_t scale(uint64_t host_tsc) const noexcept;
+
+    uint64_t m_offset{0};
+    uint64_t m_multiplier{1ULL << multiplier_shift};
+
+    uint64_t m_tsc_writes{0};
+
+public:
+
+    /// @cond
+
+    tsc_handler(tsc_handler &&) = default;
+    tsc_handler &operator=(tsc_handler &&) = default;
+
+    tsc_handler(const tsc_handler &) = delete;
+    tsc_handler &operator=(const tsc_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -71,6 +71,23 @@ public:
     gsl::not_null<apis *> eapis()
     { return &m_apis; }
 
+    /// Add Static Handlers
+    ///
+    /// Registers a static_handlers list with one of the eapis handlers as
+    /// a single delegate, so that the handlers in the list are resolved at
+    /// compile time, while handlers added at runtime remain delegates.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param handler the eapis handler to add the list to (e.g. cpuid())
+    /// @param keys what to add the list to, i.e. every argument of the
+    ///     handler's add_handler() other than the delegate (e.g. a leaf)
+    ///
+    template<typename S, typename H, typename... K>
+    void add_static_handlers(gsl::not_null<H *> handler, K &&... keys)
+    { handler->add_handler(std::forward<K>(keys)..., S::delegate()); }
+
 private:
 
     eapis::intel_x64::apis m_apis;
@@ -0,0 +1,211 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef VIRTUAL_APIC_INTEL_X64_EAPIS_H
+#define VIRTUAL_APIC_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "vmexit/external_interrupt.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Virtual APIC
+///
+/// Provides an interface for enabling APIC virtualization for an x2APIC
+/// guest. Once enabled, the CPU handles the guest's most frequent APIC
+/// accesses without a VM exit:
+///
+/// - TPR reads and writes (MSR 0x808) use the TPR shadow
+/// - EOI (MSR 0x80B) and self IPI (MSR 0x83F) writes use virtual
+///   interrupt delivery
+/// - with register virtualization, reads of the other x2APIC MSRs are
+///   served from the virtual-APIC page
+///
+/// Interrupts are delivered to the guest by setting them in the virtual
+/// IRR (see inject()), and the CPU delivers them as soon as the guest can
+/// take them, so no interrupt-window exits are needed. Since the guest's
+/// EOIs no longer reach the physical APIC, external interrupts that exit
+/// are EOI'd by this handler and forwarded to the guest as virtual
+/// interrupts (after any other external interrupt handler has had a
+/// chance to claim them).
+///
+/// MSRs that are trapped in the MSR bitmap (e.g. the ICR, which is
+/// trapped by the INIT signal handler) still exit as before.
+///
+class EXPORT_EAPIS_HVE virtual_apic_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this virtual APIC handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    virtual_apic_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtual_apic_handler() = default;
+
+    /// Enable
+    ///
+    /// Enables the TPR shadow, x2APIC virtualization and virtual interrupt
+    /// delivery. The virtual TPR starts out with the value of the physical
+    /// TPR.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Is Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the virtual APIC is enabled
+    ///
+    bool is_enabled() const noexcept;
+
+    /// Enable Register Virtualization
+    ///
+    /// Serves guest reads of the x2APIC MSRs from the virtual-APIC page.
+    /// The registers that cannot change (ID, version and LDR) are copied
+    /// from the physical APIC. Any other register the guest reads must be
+    /// kept up to date by the VMM (e.g. by trapping writes to it), as
+    /// writes that are not virtualized still go to the physical APIC.
+    ///
+    /// @expects enable() has been called
+    /// @ensures
+    ///
+    void enable_register_virtualization();
+
+    /// Inject
+    ///
+    /// Requests vector in the virtual IRR. The CPU delivers it once it is
+    /// the highest priority virtual interrupt and the guest can take it.
+    ///
+    /// @expects vector >= 16 && vector <= 255
+    /// @ensures
+    ///
+    /// @param vector the vector to inject
+    ///
+    void inject(uint64_t vector);
+
+    /// Inject (Bits)
+    ///
+    /// Requests every vector in bits, where bit n of bits is vector
+    /// (index * 64) + n (i.e. one quarter of a 256 bit IRR)
+    ///
+    /// @expects index < 4
+    /// @ensures
+    ///
+    /// @param index which group of 64 vectors bits describes
+    /// @param bits the vectors to inject
+    ///
+    void inject(uint64_t index, uint64_t bits);
+
+    /// Read
+    ///
+    /// @expects offset < 0x1000 and is 16 byte aligned
+    /// @ensures
+    ///
+    /// @param offset the xAPIC offset of the register to read (the x2APIC
+    ///     MSR is 0x800 + (offset >> 4))
+    /// @return returns the value of the register in the virtual-APIC page
+    ///
+    uint32_t read(uint64_t offset) const;
+
+    /// Write
+    ///
+    /// @expects offset < 0x1000 and is 16 byte aligned
+    /// @ensures
+    ///
+    /// @param offset the xAPIC offset of the register to write
+    /// @param val the value to write to the virtual-APIC page
+    ///
+    void write(uint64_t offset, uint32_t val);
+
+    /// Page
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the virtual-APIC page
+    ///
+    gsl::span<uint32_t> page() noexcept;
+
+public:
+
+    /// @cond
+
+    bool handle_external_interrupt(
+        gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    gsl::not_null<apis *> m_apis;
+    std::unique_ptr<uint32_t, void(*)(void *)> m_page;
+
+    bool m_enabled{false};
+    bool m_registered{false};
+
+public:
+
+    /// @cond
+
+    virtual_apic_handler(virtual_apic_handler &&) = default;
+    virtual_apic_handler &operator=(virtual_apic_handler &&) = default;
+
+    virtual_apic_handler(const virtual_apic_handler &) = delete;
+    virtual_apic_handler &operator=(const virtual_apic_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -39,6 +39,12 @@ class eapis_vcpu_global_state_t;
 /// access. Users may supply handlers and specify shadow values (for CR0 and
 /// CR4).
 ///
+/// CR0 and CR4 write handlers may declare the bits they watch. The CR0 /
+/// CR4 guest/host masks are the union of every watched bit (and the bits
+/// VMX requires), so guest writes that only change other bits do not
+/// exit, and a handler that declared its bits is only called when one of
+/// them changes.
+///
 class EXPORT_EAPIS_HVE control_register_handler : public base
 {
 public:
@@ -122,8 +128,25 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_wrcr0_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Add Write CR0 Handler (Watched Bits)
+    ///
+    /// Adds bits to the CR0 guest/host mask, and only calls d when a guest
+    /// write changes one of them.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bits the CR0 bits the handler watches
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_wrcr0_handler(const handler_delegate_t &d);
+    void add_wrcr0_handler(
+        vmcs_n::value_type bits, const handler_delegate_t &d, int64_t priority = 0);
 
     /// Add Read CR3 Handler
     ///
@@ -131,8 +154,10 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_rdcr3_handler(const handler_delegate_t &d);
+    void add_rdcr3_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
 
     /// Add Write CR3 Handler
     ///
@@ -140,8 +165,10 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_wrcr3_handler(const handler_delegate_t &d);
+    void add_wrcr3_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
 
     /// Add Write CR4 Handler
     ///
@@ -149,25 +176,57 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_wrcr4_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Add Write CR4 Handler (Watched Bits)
+    ///
+    /// Adds bits to the CR4 guest/host mask, and only calls d when a guest
+    /// write changes one of them.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bits the CR4 bits the handler watches
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_wrcr4_handler(const handler_delegate_t &d);
+    void add_wrcr4_handler(
+        vmcs_n::value_type bits, const handler_delegate_t &d, int64_t priority = 0);
 
 public:
 
     /// Enable Write CR0 Exiting
     ///
+    /// Adds mask to the bits that are watched. The cr0 guest/host mask in
+    /// the VMCS is the union of every watched bit, so a caller never
+    /// removes bits that another handler watches.
+    ///
     /// Example:
     /// @code
-    /// this->enable_wrcr0_exiting();
+    /// this->enable_wrcr0_exiting(mask);
     /// @endcode
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param mask the value of the cr0 guest/host mask to set in the vmcs
+    /// @param mask the cr0 bits to watch
     ///
     void enable_wrcr0_exiting(vmcs_n::value_type mask);
 
+    /// CR0 Watched Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the bits of cr0 that are watched (not including the
+    ///     bits that VMX requires)
+    ///
+    vmcs_n::value_type cr0_watched() const noexcept
+    { return m_cr0_watched; }
+
     /// Enable Read CR3 Exiting
     ///
     /// Example:
@@ -194,20 +253,151 @@ public:
 
     /// Enable Write CR4 Exiting
     ///
+    /// Adds mask to the bits that are watched. The cr4 guest/host mask in
+    /// the VMCS is the union of every watched bit, so a caller never
+    /// removes bits that another handler watches.
+    ///
     /// Example:
     /// @code
-    /// this->enable_wrcr4_exiting();
+    /// this->enable_wrcr4_exiting(mask);
     /// @endcode
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param mask the value of the cr4 guest/host mask to set in the vmcs
+    /// @param mask the cr4 bits to watch
     ///
     void enable_wrcr4_exiting(vmcs_n::value_type mask);
 
+    /// CR4 Watched Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the bits of cr4 that are watched (not including the
+    ///     bits that VMX requires)
+    ///
+    vmcs_n::value_type cr4_watched() const noexcept
+    { return m_cr4_watched; }
+
+public:
+
+    /// Max CR3 Targets
+    ///
+    /// The most CR3-target values a VMCS can hold on current CPUs
+    ///
+    static constexpr const std::size_t max_cr3_targets = 4;
+
+    /// Enable CR3 Target List
+    ///
+    /// Manages the VMCS CR3-target list automatically. A guest MOV to CR3
+    /// whose value is in the list does not exit, so every CR3 value that
+    /// exits (and is not watched, see watch_cr3()) is added to the list,
+    /// replacing the least recently added value once the list is full.
+    /// This only matters while write CR3 exiting is enabled.
+    ///
+    /// A MOV to CR3 that does not exit is not seen by the write CR3
+    /// handlers, so the list cannot be used with handlers that track every
+    /// address-space switch. For example, the guest_walker flushes its
+    /// translation cache on MOV to CR3 exits. Such handlers call
+    /// require_wrcr3_exits(), after which this function does nothing.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_cr3_target_list();
+
+    /// Disable CR3 Target List
+    ///
+    /// Empties the CR3-target list, so every MOV to CR3 exits again
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_cr3_target_list();
+
+    /// Require Write CR3 Exits
+    ///
+    /// Disables the CR3-target list for the life of this handler, so every
+    /// MOV to CR3 exits while write CR3 exiting is enabled, even if
+    /// enable_cr3_target_list() is called later
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void require_wrcr3_exits();
+
+    /// Watch CR3
+    ///
+    /// Makes sure that switching to the address space cr3 always exits
+    /// (i.e. it is never added to the CR3-target list). Only the address
+    /// of the page tables is compared (not the PCID or bit 63).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cr3 the address space to watch
+    ///
+    void watch_cr3(uint64_t cr3);
+
+    /// Unwatch CR3
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param cr3 the address space to stop watching
+    ///
+    void unwatch_cr3(uint64_t cr3);
+
+    /// CR3 Targets
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the values in the CR3-target list, most recently
+    ///     added first
+    ///
+    gsl::span<const uint64_t> cr3_targets() const noexcept
+    { return gsl::make_span(m_cr3_targets.data(), static_cast<std::ptrdiff_t>(m_num_cr3_targets)); }
+
+    /// CR3 Exits Avoided
+    ///
+    /// The number of exits the CR3-target list is known to have avoided.
+    /// The CPU does not count MOV to CR3 instructions that do not exit, so
+    /// this is a lower bound: it counts the write CR3 exits for which the
+    /// guest had silently switched to another address space since the
+    /// last one.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of CR3 exits avoided
+    ///
+    uint64_t cr3_exits_avoided() const noexcept
+    { return m_cr3_exits_avoided; }
+
+    /// CR3 Target Evictions
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of values that were replaced in the
+    ///     CR3-target list
+    ///
+    uint64_t cr3_target_evictions() const noexcept
+    { return m_cr3_target_evictions; }
+
 public:
 
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t val;
+        uint64_t shadow;
+    };
+
     /// Dump Log
     ///
     /// Example:
@@ -220,6 +410,55 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain CR0 Log
+    ///
+    /// Copies the oldest records in the CR0 log into records and removes
+    /// them from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_cr0_log(gsl::span<record_t> records);
+
+    /// Drain CR3 Log
+    ///
+    /// Copies the oldest records in the CR3 log into records and removes
+    /// them from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_cr3_log(gsl::span<record_t> records);
+
+    /// Drain CR4 Log
+    ///
+    /// Copies the oldest records in the CR4 log into records and removes
+    /// them from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_cr4_log(gsl::span<record_t> records);
+
 public:
 
     /// @cond
@@ -234,30 +473,53 @@ private:
     bool handle_cr3(gsl::not_null<vmcs_t *> vmcs);
     bool handle_cr4(gsl::not_null<vmcs_t *> vmcs);
 
+    struct watched_handler_t {
+        handler_delegate_t d;
+        vmcs_n::value_type bits;
+    };
+
     bool handle_wrcr0(gsl::not_null<vmcs_t *> vmcs);
     bool handle_rdcr3(gsl::not_null<vmcs_t *> vmcs);
     bool handle_wrcr3(gsl::not_null<vmcs_t *> vmcs);
     bool handle_wrcr4(gsl::not_null<vmcs_t *> vmcs);
 
+    bool emulate_ia_32e_mode_switch(info_t &info);
+
+    bool is_cr3_watched(uint64_t cr3) const;
+    void add_cr3_target(uint64_t cr3);
+    void write_cr3_targets();
+
+    bool default_wrcr0_handler(gsl::not_null<vmcs_t *> vmcs, info_t &info);
+    bool default_wrcr3_handler(gsl::not_null<vmcs_t *> vmcs, info_t &info);
+
 private:
 
+    gsl::not_null<apis *> m_apis;
     gsl::not_null<eapis_vcpu_global_state_t *> m_eapis_vcpu_global_state;
 
-    std::list<handler_delegate_t> m_wrcr0_handlers;
-    std::list<handler_delegate_t> m_rdcr3_handlers;
-    std::list<handler_delegate_t> m_wrcr3_handlers;
-    std::list<handler_delegate_t> m_wrcr4_handlers;
+    delegate_chain<watched_handler_t> m_wrcr0_handlers;
+    delegate_chain<handler_delegate_t> m_rdcr3_handlers;
+    delegate_chain<handler_delegate_t> m_wrcr3_handlers;
+    delegate_chain<watched_handler_t> m_wrcr4_handlers;
 
-private:
+    vmcs_n::value_type m_cr0_watched{0};
+    vmcs_n::value_type m_cr4_watched{0};
 
-    struct record_t {
-        uint64_t val;
-        uint64_t shadow;
-    };
+    std::array<uint64_t, max_cr3_targets> m_cr3_targets{};
+    std::size_t m_num_cr3_targets{0};
+    std::size_t m_max_cr3_targets{0};
+    std::vector<uint64_t> m_watched_cr3s;
+    bool m_wrcr3_exits_required{false};
+
+    uint64_t m_last_cr3{0};
+    uint64_t m_cr3_exits_avoided{0};
+    uint64_t m_cr3_target_evictions{0};
+
+private:
 
-    std::list<record_t> m_cr0_log;
-    std::list<record_t> m_cr3_log;
-    std::list<record_t> m_cr4_log;
+    log_ring<record_t> m_cr0_log;
+    log_ring<record_t> m_cr3_log;
+    log_ring<record_t> m_cr4_log;
 
 public:
 
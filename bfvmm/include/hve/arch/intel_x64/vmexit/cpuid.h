@@ -47,6 +47,11 @@ public:
     ///
     using leaf_t = uint64_t;
 
+    /// Subleaf type
+    ///
+    ///
+    using subleaf_t = uint64_t;
+
     /// Info
     ///
     /// This struct is created by cpuid_handler::handle before being
@@ -89,6 +94,20 @@ public:
         /// default: false
         ///
         bool ignore_advance;
+
+        /// Cacheable (out)
+        ///
+        /// If true, the register values above are cached for the (leaf,
+        /// subleaf) of this CPUID, and any future CPUID with the same
+        /// (leaf, subleaf) is answered from the cache without executing
+        /// CPUID or calling any of the registered handlers. Only set this
+        /// to true if the result of your handler is static (i.e. does not
+        /// depend on guest state that can change). The result is not
+        /// cached if ignore_write or ignore_advance is set.
+        ///
+        /// default: false
+        ///
+        bool cacheable;
     };
 
     /// Handler delegate type
@@ -135,8 +154,89 @@ public:
     ///
     void add_handler(leaf_t leaf, const handler_delegate_t &d);
 
+    /// Add CPUID Handler (Subleaf)
+    ///
+    /// Registers a handler that is only called when the guest executes
+    /// CPUID with the given leaf in EAX and subleaf in ECX. Subleaf
+    /// handlers are called before any handler registered for the entire
+    /// leaf, so a handler for a leaf with subleaves (e.g. 0x4, 0x7, 0xB or
+    /// 0xD) does not need to decode ECX itself.
+    ///
+    /// @expects subleaf < 0x100
+    /// @ensures
+    ///
+    /// @param leaf the cpuid leaf to call d
+    /// @param subleaf the cpuid subleaf to call d
+    /// @param d the handler to call when an exit occurs
+    ///
+    void add_handler(leaf_t leaf, subleaf_t subleaf, const handler_delegate_t &d);
+
+    /// Remove CPUID Handlers
+    ///
+    /// Removes every handler added for leaf (including the handlers added
+    /// for one of its subleaves), including the default handlers added by
+    /// the EAPIs.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the cpuid leaf to remove the handlers of
+    /// @return returns true if the leaf had handlers
+    ///
+    bool remove_handlers(leaf_t leaf);
+
+    /// Invalidate Cache
+    ///
+    /// Removes all of the cached CPUID results (see info_t::cacheable).
+    /// The cache is invalidated whenever a handler is added or removed, so
+    /// this only needs to be called if a handler that marked its result
+    /// as cacheable would now return something different.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void invalidate_cache() noexcept;
+
+    /// Cache Hits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of CPUID exits that were answered from
+    ///     the cache
+    ///
+    uint64_t cache_hits() const noexcept;
+
 public:
 
+    /// Counters
+    ///
+    /// Returns the number of exits for each leaf, whether or not the exit
+    /// was handled. The counters are always on (including release builds),
+    /// so they can be used to decide which exits are worth trapping.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the exit counters for this handler
+    ///
+    const exit_counters<> &counters() const noexcept;
+
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t rax_in;
+        uint64_t rbx_in;
+        uint64_t rcx_in;
+        uint64_t rdx_in;
+        uint64_t rax_out;
+        uint64_t rbx_out;
+        uint64_t rcx_out;
+        uint64_t rdx_out;
+    };
+
     /// Dump Log
     ///
     /// Example:
@@ -149,6 +249,29 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain Log
+    ///
+    /// Copies the oldest records in the log into records and removes them
+    /// from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_log(gsl::span<record_t> records);
+
 public:
 
     /// @cond
@@ -159,22 +282,41 @@ public:
 
 private:
 
-    std::unordered_map<leaf_t, std::list<handler_delegate_t>> m_handlers;
+    // Handlers
+    //
+    // The basic (0x0 - 0x3F) and extended (0x80000000 - 0x8000003F) leaves
+    // are stored in a flat table, while any other leaf (e.g. hypervisor
+    // leaves) falls back to a hash map. Each leaf stores the handlers for
+    // the entire leaf, and a table of handlers indexed by subleaf.
+    //
+
+    struct leaf_handlers_t {
+        delegate_chain<handler_delegate_t> handlers;
+        std::vector<delegate_chain<handler_delegate_t>> subleaf_handlers;
+    };
+
+    leaf_handlers_t &leaf_handlers(leaf_t leaf);
+    const leaf_handlers_t *find_handlers(leaf_t leaf) const;
+
+    std::array<std::unique_ptr<leaf_handlers_t>, 0x80> m_handlers;
+    std::unordered_map<leaf_t, leaf_handlers_t> m_fallback_handlers;
 
 private:
 
-    struct record_t {
-        uint64_t rax_in;
-        uint64_t rbx_in;
-        uint64_t rcx_in;
-        uint64_t rdx_in;
-        uint64_t rax_out;
-        uint64_t rbx_out;
-        uint64_t rcx_out;
-        uint64_t rdx_out;
+    struct cached_t {
+        uint64_t rax;
+        uint64_t rbx;
+        uint64_t rcx;
+        uint64_t rdx;
     };
 
-    std::list<record_t> m_log;
+    std::unordered_map<uint64_t, cached_t> m_cache;
+    uint64_t m_cache_hits{};
+
+private:
+
+    log_ring<record_t> m_log;
+    exit_counters<> m_counters;
 
 public:
 
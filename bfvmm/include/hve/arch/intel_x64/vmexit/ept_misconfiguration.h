@@ -81,6 +81,16 @@ public:
     using handler_delegate_t =
         delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
 
+    /// MMIO delegate type
+    ///
+    /// The type of delegate used for the MMIO fast path. It is given the
+    /// GPA that exited, and returns true if it emulated the access and
+    /// advanced the guest's instruction pointer (see
+    /// ept_violation_handler::emulate_mmio()).
+    ///
+    using mmio_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, uint64_t)>;
+
     /// Constructor
     ///
     /// @expects
@@ -108,8 +118,39 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Set MMIO Handler
+    ///
+    /// Sets the delegate that emulates accesses to device regions mapped
+    /// with ept::mmap::map_mmio(). It is called before the handlers added
+    /// with add_handler(), and when it emulates the access the exit is
+    /// complete: EPT is not invalidated and the guest's instruction
+    /// pointer is not advanced again. Accesses it does not emulate fall
+    /// through to the handlers.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call with the GPA of each exit
     ///
-    void add_handler(const handler_delegate_t &d);
+    void set_mmio_handler(const mmio_delegate_t &d) noexcept
+    {
+        m_mmio = d;
+        m_has_mmio = true;
+    }
+
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t gva;
+        uint64_t gpa;
+    };
 
     /// Dump Log
     ///
@@ -123,6 +164,29 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain Log
+    ///
+    /// Copies the oldest records in the log into records and removes them
+    /// from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_log(gsl::span<record_t> records);
+
 public:
 
     /// @cond
@@ -133,16 +197,16 @@ public:
 
 private:
 
-    std::list<handler_delegate_t> m_handlers;
+    gsl::not_null<apis *> m_apis;
 
-private:
+    delegate_chain<handler_delegate_t> m_handlers;
 
-    struct record_t {
-        uint64_t gva;
-        uint64_t gpa;
-    };
+    mmio_delegate_t m_mmio{};
+    bool m_has_mmio{false};
+
+private:
 
-    std::list<record_t> m_log;
+    log_ring<record_t> m_log;
 
 public:
 
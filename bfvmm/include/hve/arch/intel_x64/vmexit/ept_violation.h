@@ -20,6 +20,7 @@
 #define EPT_VIOLATION_INTEL_X64_H
 
 #include "../base.h"
+#include "../decoder.h"
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -87,6 +88,91 @@ public:
     using handler_delegate_t =
         delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
 
+    ///
+    /// MMIO Info
+    ///
+    /// This struct is created by ept_violation_handler::handle before being
+    /// passed to the MMIO handler that owns the faulting GPA.
+    ///
+    struct mmio_info_t {
+
+        /// GPA (in)
+        ///
+        /// The guest physical address being accessed
+        ///
+        uint64_t gpa;
+
+        /// Size (in)
+        ///
+        /// The number of bytes being accessed (1, 2, 4 or 8)
+        ///
+        uint64_t size;
+
+        /// Write (in)
+        ///
+        /// True if the guest is storing to the device, false if it is
+        /// loading from it
+        ///
+        bool write;
+
+        /// Value (in/out)
+        ///
+        /// For a write, the value the guest is storing. For a read, the
+        /// handler sets this to the value the guest should load.
+        ///
+        uint64_t val;
+    };
+
+    /// MMIO handler delegate type
+    ///
+    /// The type of delegate clients must use when registering MMIO
+    /// handlers. Return false to let the access fall through to the
+    /// read / write handlers.
+    ///
+    using mmio_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, mmio_info_t &)>;
+
+    ///
+    /// SPP Info
+    ///
+    /// This struct is created by ept_violation_handler::handle_spp before
+    /// being passed to each registered SPP handler.
+    ///
+    struct spp_info_t {
+
+        /// GPA (in)
+        ///
+        /// The guest physical address whose SPPT walk failed
+        ///
+        uint64_t gpa;
+
+        /// Misconfiguration (in)
+        ///
+        /// True if the walk found a misconfigured SPPT entry, false if
+        /// the page has no write permission vector (an SPPT miss)
+        ///
+        bool misconfiguration;
+    };
+
+    /// SPP handler delegate type
+    ///
+    /// The type of delegate clients must use when registering SPP
+    /// handlers. The guest's instruction is re-executed once a handler
+    /// returns true, so the handler should fix the SPPT (e.g. using
+    /// ept::mmap::set_sub_page_permissions()) before doing so.
+    ///
+    using spp_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, spp_info_t &)>;
+
+    /// Access Flags
+    ///
+    /// The accesses a page / range handler is registered for. These can
+    /// be or'd together, and match bits 2:0 of the exit qualification.
+    ///
+    static constexpr const uint64_t access_read = 1U << 0;      ///< Data reads
+    static constexpr const uint64_t access_write = 1U << 1;     ///< Data writes
+    static constexpr const uint64_t access_execute = 1U << 2;   ///< Instruction fetches
+
     /// Constructor
     ///
     /// @expects
@@ -114,8 +200,10 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_read_handler(const handler_delegate_t &d);
+    void add_read_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
 
     /// Add Write EPT Violation Handler
     ///
@@ -123,8 +211,10 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_write_handler(const handler_delegate_t &d);
+    void add_write_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
 
     /// Add Execute EPT Violation Handler
     ///
@@ -132,8 +222,250 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_execute_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Add SPP Handler
+    ///
+    /// Registers d for SPP-related events (SPPT misses and
+    /// misconfigurations). Writes that are denied by a page's write
+    /// permission vector are EPT violations, and are passed to the write
+    /// handlers instead (see is_sub_page_violation()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_spp_handler(
+        const spp_delegate_t &d, int64_t priority = 0);
+
+    /// Is Sub-Page Violation
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param info the info passed to an EPT violation handler
+    /// @return returns true if the violation is a write to a sub-page that
+    ///     is not writable in its page's write permission vector (see
+    ///     ept::mmap::set_sub_page_permissions())
+    ///
+    static bool is_sub_page_violation(const info_t &info) noexcept;
+
+    /// Add Page Handler
+    ///
+    /// Registers d for the violations of the given access types that occur
+    /// on the 4k guest physical page that contains gpa. Page handlers are
+    /// kept in a hash table keyed by guest frame number, so finding them
+    /// does not depend on how many pages are being watched. They are
+    /// called before the range handlers, which are called before the
+    /// handlers added with add_read_handler() / add_write_handler() /
+    /// add_execute_handler().
+    ///
+    /// @expects access != 0
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page to watch
+    /// @param access the accesses to call d for (see access_read, etc.)
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_page_handler(
+        uint64_t gpa, uint64_t access, const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Remove Page Handlers
+    ///
+    /// Removes every handler added for the page that contains gpa
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page
+    /// @return returns true if the page had handlers
+    ///
+    bool remove_page_handlers(uint64_t gpa);
+
+    /// Add Range Handler
+    ///
+    /// Registers d for the violations of the given access types that occur
+    /// in [first, last], for regions that are too large to register one
+    /// page at a time. Ranges are found using a binary search. A range must
+    /// either be identical to a range that is already registered (d is
+    /// then added to it), or not overlap any registered range.
+    ///
+    /// @expects first <= last && access != 0
+    /// @ensures
+    ///
+    /// @param first the first GPA in the range
+    /// @param last the last GPA in the range (inclusive)
+    /// @param access the accesses to call d for (see access_read, etc.)
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_range_handler(
+        uint64_t first, uint64_t last, uint64_t access, const handler_delegate_t &d,
+        int64_t priority = 0);
+
+    /// Remove Range Handlers
+    ///
+    /// Removes every handler added for the range that starts at first
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first GPA of a range passed to add_range_handler
+    /// @return returns true if the range was found and removed
+    ///
+    bool remove_range_handlers(uint64_t first);
+
+    /// Add MMIO Handler
+    ///
+    /// Registers d to emulate every read and write to
+    /// [first, last]. The guest's access is decoded, d is called once with
+    /// the value being transferred, the guest's register is updated (for
+    /// reads) and the guest's RIP is advanced past the instruction, so d
+    /// never has to deal with the instruction itself.
+    ///
+    /// The range must be mapped in EPT without read / write access (so
+    /// that accesses exit), and it cannot overlap a range that is already
+    /// registered. Ranges are found using a binary search, so the cost of
+    /// an MMIO exit does not grow with the number of devices.
+    ///
+    /// @expects first <= last
+    /// @ensures
+    ///
+    /// @param first the first GPA in the range
+    /// @param last the last GPA in the range (inclusive)
+    /// @param d the handler to call when the range is accessed
     ///
-    void add_execute_handler(const handler_delegate_t &d);
+    void add_mmio_handler(
+        uint64_t first, uint64_t last, const mmio_delegate_t &d);
+
+    /// Add Coalesced MMIO Handler
+    ///
+    /// The same as add_mmio_handler(), except that the guest's stores to
+    /// [first, last] are appended to the ring set with
+    /// set_coalesced_ring() instead of being handed to d, and the guest is
+    /// resumed right away. The ring's flush handler emulates the stores
+    /// later, in batches (see coalesced_ring). Loads from the range flush
+    /// the ring first and are then handed to d.
+    ///
+    /// @expects first <= last
+    /// @expects set_coalesced_ring() has been given a ring with a flush
+    ///     handler
+    /// @ensures
+    ///
+    /// @param first the first GPA in the range
+    /// @param last the last GPA in the range (inclusive)
+    /// @param d the handler to call when the range is read
+    ///
+    void add_coalesced_mmio_handler(
+        uint64_t first, uint64_t last, const mmio_delegate_t &d);
+
+    /// Set Coalesced Ring
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the vCPU's ring that coalesced stores are appended to
+    ///     (see add_coalesced_mmio_handler())
+    ///
+    void set_coalesced_ring(coalesced_ring<> *ring) noexcept
+    { m_coalesced = ring; }
+
+    /// Add Doorbell
+    ///
+    /// Makes a store of val to the given GPA ring a doorbell: the bit is
+    /// set in the bitmap given to set_doorbells(), the guest's RIP is
+    /// advanced past the store, and no MMIO or write handlers are called.
+    /// Stores of other values are handled as usual. The store still has
+    /// to be decoded to find its value and length, but the decoder caches
+    /// the instructions it decodes, so a doorbell that is always rung from
+    /// the same RIP costs a lookup. Like an MMIO range, the GPA must be
+    /// mapped in EPT without write access.
+    ///
+    /// @expects bit < doorbell_bitmap<>::size()
+    /// @expects set_doorbells() has been called
+    /// @ensures
+    ///
+    /// @param gpa the GPA of the doorbell register
+    /// @param val the value that rings the doorbell, or
+    ///     doorbell_table::any_value to ring it on any store
+    /// @param bit the doorbell to ring
+    ///
+    void add_doorbell(uint64_t gpa, uint64_t val, uint64_t bit);
+
+    /// Set Doorbells
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param doorbells the vCPU's bitmap that doorbells are rung in (see
+    ///     add_doorbell())
+    ///
+    void set_doorbells(doorbell_bitmap<> *doorbells) noexcept
+    { m_doorbells = doorbells; }
+
+    /// Remove MMIO Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first GPA of a range passed to add_mmio_handler
+    /// @return returns true if the range was found and removed
+    ///
+    bool remove_mmio_handler(uint64_t first);
+
+    /// Emulate MMIO
+    ///
+    /// Emulates the guest's access to gpa using the doorbells and MMIO
+    /// ranges registered with this handler, without looking at the exit
+    /// qualification. The guest's RIP is advanced past the instruction if
+    /// the access is emulated. This is what the EPT misconfiguration fast
+    /// path calls for regions mapped with ept::mmap::map_mmio().
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vmcs the vCPU's VMCS
+    /// @param gpa the GPA the guest accessed
+    /// @return returns true if the access was emulated
+    ///
+    bool emulate_mmio(gsl::not_null<vmcs_t *> vmcs, uint64_t gpa);
+
+    /// Decoder
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the instruction decoder used to emulate MMIO,
+    ///     or nullptr if no MMIO handlers have been added
+    ///
+    insn_decoder *decoder() noexcept
+    { return m_decoder.get(); }
+
+    /// Set Guest Memory
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mem the cache of mapped guest pages that the decoder reads
+    ///     instructions through (see insn_decoder::set_guest_memory())
+    ///
+    void set_guest_memory(guest_memory *mem) noexcept;
+
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t gva;
+        uint64_t gpa;
+        uint64_t exit_qualification;
+    };
 
     /// Dump Log
     ///
@@ -147,11 +479,35 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain Log
+    ///
+    /// Copies the oldest records in the log into records and removes them
+    /// from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_log(gsl::span<record_t> records);
+
 public:
 
     /// @cond
 
     bool handle(gsl::not_null<vmcs_t *> vmcs);
+    bool handle_spp(gsl::not_null<vmcs_t *> vmcs);
 
     /// @endcond
 
@@ -160,22 +516,67 @@ private:
     bool handle_read(gsl::not_null<vmcs_t *> vmcs, info_t &info);
     bool handle_write(gsl::not_null<vmcs_t *> vmcs, info_t &info);
     bool handle_execute(gsl::not_null<vmcs_t *> vmcs, info_t &info);
+    bool handle_mmio(gsl::not_null<vmcs_t *> vmcs, uint64_t gpa);
+    bool handle_doorbell(gsl::not_null<vmcs_t *> vmcs, uint64_t gpa);
+    bool handled(gsl::not_null<vmcs_t *> vmcs, info_t &info);
 
-private:
+    struct access_handlers_t {
+        delegate_chain<handler_delegate_t> read;
+        delegate_chain<handler_delegate_t> write;
+        delegate_chain<handler_delegate_t> execute;
 
-    std::list<handler_delegate_t> m_read_handlers;
-    std::list<handler_delegate_t> m_write_handlers;
-    std::list<handler_delegate_t> m_execute_handlers;
+        void push_front(uint64_t access, const handler_delegate_t &d, int64_t priority);
+    };
 
-private:
+    struct range_handlers_t {
+        uint64_t first;
+        uint64_t last;
+        access_handlers_t handlers;
+    };
 
-    struct record_t {
-        uint64_t gva;
-        uint64_t gpa;
-        uint64_t exit_qualification;
+    using access_chain_t = delegate_chain<handler_delegate_t> access_handlers_t::*;
+
+    bool walk(
+        const delegate_chain<handler_delegate_t> &handlers,
+        gsl::not_null<vmcs_t *> vmcs, info_t &info);
+
+    bool walk_page(
+        access_chain_t chain, gsl::not_null<vmcs_t *> vmcs, info_t &info);
+
+    struct mmio_range_t {
+        uint64_t first;
+        uint64_t last;
+        mmio_delegate_t d;
+        bool coalesced;
     };
 
-    std::list<record_t> m_log;
+    void insert_mmio_range(const mmio_range_t &range);
+
+    const mmio_range_t *find_mmio_range(uint64_t gpa) const noexcept;
+    range_handlers_t *find_range(uint64_t gpa) noexcept;
+
+private:
+
+    gsl::not_null<apis *> m_apis;
+
+    delegate_chain<handler_delegate_t> m_read_handlers;
+    delegate_chain<handler_delegate_t> m_write_handlers;
+    delegate_chain<handler_delegate_t> m_execute_handlers;
+    delegate_chain<spp_delegate_t> m_spp_handlers;
+
+    std::unordered_map<uint64_t, access_handlers_t> m_page_handlers;
+    std::vector<range_handlers_t> m_range_handlers;
+
+    std::vector<mmio_range_t> m_mmio_ranges;
+    std::unique_ptr<insn_decoder> m_decoder;
+    guest_memory *m_guest_memory{nullptr};
+    coalesced_ring<> *m_coalesced{nullptr};
+    doorbell_bitmap<> *m_doorbells{nullptr};
+    doorbell_table m_doorbell_table;
+
+private:
+
+    log_ring<record_t> m_log;
 
 public:
 
@@ -94,8 +94,10 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_handler(const handler_delegate_t &d);
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
 
 public:
 
@@ -137,6 +139,16 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
 public:
 
     /// @cond
@@ -147,7 +159,7 @@ public:
 
 private:
 
-    std::list<handler_delegate_t> m_handlers;
+    delegate_chain<handler_delegate_t> m_handlers;
 
 private:
 
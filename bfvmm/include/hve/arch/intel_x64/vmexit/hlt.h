@@ -0,0 +1,284 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef HLT_INTEL_X64_EAPIS_H
+#define HLT_INTEL_X64_EAPIS_H
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+class interrupt_window_handler;
+
+/// HLT
+///
+/// Provides an interface for registering handlers for HLT exits, and
+/// implements adaptive halt-polling for HLTs that no handler claims:
+///
+/// - If the interrupt_window_handler has vectors queued for this vCPU,
+///   the HLT completes right away and the next vector is injected.
+/// - Otherwise, the VMM polls the host's local APIC for a pending interrupt
+///   for up to the poll window before letting the guest halt for real (by
+///   entering it in the HLT activity state), as a wakeup found while
+///   polling avoids the cost of waking a halted core. The APIC is polled
+///   through the x2APIC IRR MSRs, so polling is skipped while the host's
+///   local APIC is in xAPIC mode.
+///
+/// The poll window adapts: it grows when a wakeup is only found late in
+/// the window, and shrinks when polling fails, so vCPUs with short idle
+/// periods poll and vCPUs with long ones do not waste the core.
+///
+class EXPORT_EAPIS_HVE hlt_handler : public base
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by hlt_handler::handle before being
+    /// passed to each registered handler.
+    ///
+    struct info_t {
+
+        /// Ignore advance (out)
+        ///
+        /// If true, do not advance the guest's instruction pointer.
+        /// Set this to true if your handler returns true and has already
+        /// advanced the guest's instruction pointer.
+        ///
+        /// default: false
+        ///
+        bool ignore_advance;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Default Max Poll
+    ///
+    /// The largest the poll window may grow to (in TSC ticks)
+    ///
+    static constexpr const uint64_t default_max_poll = 200000;
+
+    /// Default Poll Start
+    ///
+    /// The poll window used when growing from 0 (in TSC ticks)
+    ///
+    static constexpr const uint64_t default_poll_start = 10000;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this HLT handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    hlt_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~hlt_handler() final = default;
+
+public:
+
+    /// Add Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Enable exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_exiting();
+
+    /// Disable exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_exiting();
+
+    /// Set Interrupt Window
+    ///
+    /// Sets the interrupt-window handler whose queued vectors wake this
+    /// vCPU. This is set by the apis when the handler is created.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param interrupt_window the interrupt-window handler of this vCPU
+    ///
+    void set_interrupt_window(
+        gsl::not_null<interrupt_window_handler *> interrupt_window) noexcept
+    { m_interrupt_window = interrupt_window; }
+
+    /// Set Max Poll
+    ///
+    /// Sets the largest the poll window may grow to (in TSC ticks). A
+    /// max_poll of 0 disables polling.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param max_poll the largest poll window
+    ///
+    void set_max_poll(uint64_t max_poll) noexcept;
+
+    /// Poll Window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current poll window (in TSC ticks)
+    ///
+    uint64_t poll_window() const noexcept
+    { return m_poll; }
+
+    /// Exits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of HLT exits handled
+    ///
+    uint64_t exits() const noexcept
+    { return m_exits; }
+
+    /// Polls
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of HLTs the VMM polled for
+    ///
+    uint64_t polls() const noexcept
+    { return m_polls; }
+
+    /// Poll Hits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of polls that found a wakeup
+    ///
+    uint64_t poll_hits() const noexcept
+    { return m_poll_hits; }
+
+    /// Blocks
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of HLTs that halted the guest for real
+    ///
+    uint64_t blocks() const noexcept
+    { return m_blocks; }
+
+    /// Poll Success Rate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the percentage (0-100) of polls that found a wakeup
+    ///
+    uint64_t poll_success_rate() const noexcept
+    { return m_polls != 0 ? (m_poll_hits * 100) / m_polls : 0; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final;
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
+private:
+
+    bool poll();
+    static bool host_x2apic_mode();
+    static bool host_interrupt_pending();
+
+    delegate_chain<handler_delegate_t> m_handlers;
+    interrupt_window_handler *m_interrupt_window{nullptr};
+
+    uint64_t m_poll{0};
+    uint64_t m_max_poll{default_max_poll};
+
+    uint64_t m_exits{0};
+    uint64_t m_polls{0};
+    uint64_t m_poll_hits{0};
+    uint64_t m_blocks{0};
+
+public:
+
+    /// @cond
+
+    hlt_handler(hlt_handler &&) = default;
+    hlt_handler &operator=(hlt_handler &&) = default;
+
+    hlt_handler(const hlt_handler &) = delete;
+    hlt_handler &operator=(const hlt_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -76,11 +76,25 @@ public:
     void dump_log() final
     { }
 
+    /// SIPI Timeouts
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of SIPIs that were sent before the
+    ///     target had been reset by its INIT, because the target did not
+    ///     take the INIT in time
+    ///
+    uint64_t sipi_timeouts() const noexcept
+    { return m_sipi_timeouts; }
+
 public:
 
     /// @cond
 
     bool handle(gsl::not_null<vmcs_t *> vmcs);
+    bool handle_icr_write(
+        gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info);
 
     /// @endcond
 
@@ -88,11 +102,15 @@ private:
 
     gsl::not_null<eapis_vcpu_global_state_t *> m_eapis_vcpu_global_state;
 
+    uint64_t m_reset_cr0;
+    uint64_t m_reset_cr4;
+    uint64_t m_sipi_timeouts{0};
+
     bool handle_init_assert(
         gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info);
-    bool handle_init_deassert(
+    bool handle_sipi(
         gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info);
-    bool handle_icr_write(
+    bool handle_init_deassert(
         gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info);
 
 public:
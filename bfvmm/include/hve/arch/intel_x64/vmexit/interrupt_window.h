@@ -96,8 +96,10 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_handler(const handler_delegate_t &d);
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
 
 public:
 
@@ -136,6 +138,48 @@ public:
     ///
     void inject(uint64_t vector);
 
+    /// Queue
+    ///
+    /// Adds vector to this vCPU's queue of pending external interrupts,
+    /// and injects the highest pending vector right away if the interrupt
+    /// window is open. Interrupt-window exiting is only enabled while
+    /// vectors are still pending, and each interrupt-window exit injects
+    /// the next highest vector, so callers do not have to track interrupts
+    /// that arrive before the window opens. Queueing a vector that is
+    /// already pending has no effect (as with the IRR of a real APIC).
+    ///
+    /// @expects vector < 256
+    /// @ensures
+    ///
+    /// @param vector the vector to queue
+    ///
+    void queue(uint64_t vector);
+
+    /// Inject Pending
+    ///
+    /// Injects the highest pending vector if the interrupt window is open
+    /// and no other event is being injected on the upcoming VM-entry, and
+    /// updates interrupt-window exiting to match what is left in the queue.
+    /// This is called by queue() and on each interrupt-window exit, and
+    /// can also be called at the end of any other exit to deliver pending
+    /// vectors without waiting for an interrupt-window exit.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if a vector was injected
+    ///
+    bool inject_pending();
+
+    /// Number of Pending Vectors
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of vectors waiting to be injected
+    ///
+    uint64_t num_pending() const noexcept;
+
 public:
 
     /// Dump Log
@@ -161,7 +205,8 @@ public:
 
 private:
 
-    std::list<handler_delegate_t> m_handlers;
+    delegate_chain<handler_delegate_t> m_handlers;
+    std::array<uint64_t, 4> m_pending{};
 
 public:
 
@@ -31,6 +31,8 @@ namespace intel_x64
 {
 
 class apis;
+class vcpu_bitmaps;
+class guest_memory;
 class eapis_vcpu_global_state_t;
 
 /// IO instruction
@@ -119,6 +121,64 @@ public:
     using handler_delegate_t =
         delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
 
+    ///
+    /// String Info
+    ///
+    /// This struct is created by io_instruction_handler::handle for REP
+    /// prefixed string instructions (i.e. REP INS / REP OUTS) on ports that
+    /// have a string handler, before being passed to each registered string
+    /// handler. Instead of calling the handler once per element, the guest
+    /// memory for the whole transfer is mapped once and handed to the
+    /// handler as a single buffer.
+    ///
+    struct string_info_t {
+
+        /// Port number
+        ///
+        /// The port number accessed by the guest.
+        ///
+        /// default: rdx & 0xFFFF
+        ///
+        uint64_t port_number;
+
+        /// Size of access
+        ///
+        /// The size of each element of the transfer.
+        ///
+        /// default: vmcs_n::exit_qualification::io_instruction::size_of_access
+        ///
+        uint64_t size_of_access;
+
+        /// Count (in / out)
+        ///
+        /// On entry, the number of elements in the buffer. A handler that
+        /// returns true may lower this to the number of elements it
+        /// actually transferred, in which case the guest's registers are
+        /// updated accordingly and the guest re-executes the instruction to
+        /// transfer the rest.
+        ///
+        /// default: min(rcx, the number of elements left in the page)
+        ///
+        uint64_t count;
+
+        /// Buffer
+        ///
+        /// The guest's memory for the transfer (count * element size bytes).
+        /// For 'in' accesses, the handler writes the data read from the
+        /// port into the buffer. For 'out' accesses, the buffer holds the
+        /// data the guest is writing to the port.
+        ///
+        gsl::span<uint8_t> buffer;
+    };
+
+    /// String handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// string handlers
+    ///
+    using string_handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, string_info_t &)>;
+
     /// Constructor
     ///
     /// @expects
@@ -142,7 +202,7 @@ public:
 
     /// Add Handler
     ///
-    /// @expects
+    /// @expects port is less than 0x10000
     /// @ensures
     ///
     /// @param port the port to listen to
@@ -155,6 +215,89 @@ public:
         const handler_delegate_t &out_d
     );
 
+    /// Add String Handler
+    ///
+    /// Registers handlers that process REP INS / REP OUTS on the given port
+    /// a buffer at a time. String instructions on ports without a string
+    /// handler fall back to calling the handlers registered using
+    /// add_handler() once per element.
+    ///
+    /// @expects port is less than 0x10000
+    /// @ensures
+    ///
+    /// @param port the port to listen to
+    /// @param in_d the handler to call when a rep ins exit occurs
+    /// @param out_d the handler to call when a rep outs exit occurs
+    ///
+    void add_string_handler(
+        vmcs_n::value_type port,
+        const string_handler_delegate_t &in_d,
+        const string_handler_delegate_t &out_d
+    );
+
+    /// Add Coalesced Port
+    ///
+    /// Makes OUTs to the given port coalesced: instead of calling the
+    /// handlers registered using add_handler(), the value is appended to
+    /// the ring set with set_coalesced_ring() and the guest is resumed
+    /// right away. The ring's flush handler emulates the writes later, in
+    /// batches (see coalesced_ring). INs on the port flush the ring first
+    /// and are then handled as usual, so a port that can be read still
+    /// needs an in handler.
+    ///
+    /// This is meant for write-only ports whose side effects the guest
+    /// does not wait on (e.g. a debug port or a UART's transmit register).
+    ///
+    /// @expects port is less than 0x10000
+    /// @expects set_coalesced_ring() has been given a ring with a flush
+    ///     handler
+    /// @ensures
+    ///
+    /// @param port the port to coalesce writes to
+    ///
+    void add_coalesced_port(vmcs_n::value_type port);
+
+    /// Set Coalesced Ring
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the vCPU's ring that coalesced writes are appended to
+    ///     (see add_coalesced_port())
+    ///
+    void set_coalesced_ring(coalesced_ring<> *ring) noexcept
+    { m_coalesced = ring; }
+
+    /// Add Doorbell
+    ///
+    /// Makes an OUT of val to the given port ring a doorbell: the bit is
+    /// set in the bitmap given to set_doorbells() and the guest is resumed,
+    /// without calling any of the port's handlers. OUTs of other values
+    /// are handled as usual.
+    ///
+    /// @expects port is less than 0x10000
+    /// @expects bit < doorbell_bitmap<>::size()
+    /// @expects set_doorbells() has been called
+    /// @ensures
+    ///
+    /// @param port the doorbell port
+    /// @param val the value that rings the doorbell, or
+    ///     doorbell_table::any_value to ring it on any write
+    /// @param bit the doorbell to ring
+    ///
+    void add_doorbell(vmcs_n::value_type port, uint64_t val, uint64_t bit);
+
+    /// Set Doorbells
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param doorbells the vCPU's bitmap that doorbells are rung in (see
+    ///     add_doorbell())
+    ///
+    void set_doorbells(doorbell_bitmap<> *doorbells) noexcept
+    { m_doorbells = doorbells; }
+
     /// Trap On Access
     ///
     /// Sets a '1' in the IO bitmap corresponding with the provided port. All
@@ -173,6 +316,25 @@ public:
     ///
     void trap_on_access(vmcs_n::value_type port);
 
+    /// Trap On Range
+    ///
+    /// Sets a '1' in the IO bitmap for every port from first to last
+    /// (inclusive). This is the same as calling trap_on_access() for each
+    /// port, but whole bytes of the bitmap are written at once.
+    ///
+    /// Example:
+    /// @code
+    /// this->trap_on_range(0xCF8, 0xCFF);
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first port to trap on
+    /// @param last the last port to trap on
+    ///
+    void trap_on_range(vmcs_n::value_type first, vmcs_n::value_type last);
+
     /// Trap On All Accesses
     ///
     /// Sets a '1' in the IO bitmap corresponding with all of the ports. All
@@ -207,6 +369,24 @@ public:
     ///
     void pass_through_access(vmcs_n::value_type port);
 
+    /// Pass Through Range
+    ///
+    /// Sets a '0' in the IO bitmap for every port from first to last
+    /// (inclusive).
+    ///
+    /// Example:
+    /// @code
+    /// this->pass_through_range(0xCF8, 0xCFF);
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first port to pass through
+    /// @param last the last port to pass through
+    ///
+    void pass_through_range(vmcs_n::value_type first, vmcs_n::value_type last);
+
     /// Pass Through All Access
     ///
     /// Sets a '0' in the IO bitmap corresponding with all of the ports. All
@@ -225,6 +405,31 @@ public:
 
 public:
 
+    /// Counters
+    ///
+    /// Returns the number of exits for each port, whether or not the exit
+    /// was handled. The counters are always on (including release builds),
+    /// so they can be used to decide which exits are worth trapping.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the exit counters for this handler
+    ///
+    const exit_counters<> &counters() const noexcept;
+
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t port_number;
+        uint64_t size_of_access;
+        uint64_t direction_of_access;
+        uint64_t address;
+        uint64_t val;
+    };
+
     /// Dump Log
     ///
     /// Example:
@@ -237,6 +442,41 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain Log
+    ///
+    /// Copies the oldest records in the log into records and removes them
+    /// from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_log(gsl::span<record_t> records);
+
+    /// Set Guest Memory
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mem if not nullptr, the guest buffers of string instructions
+    ///     are accessed through mem's cache of mapped guest pages instead
+    ///     of being mapped on every exit
+    ///
+    void set_guest_memory(guest_memory *mem) noexcept
+    { m_guest_memory = mem; }
+
 public:
 
     /// @cond
@@ -247,8 +487,13 @@ public:
 
 private:
 
+    bool unhandled_io(bool in);
     bool handle_in(gsl::not_null<vmcs_t *> vmcs, info_t &info);
     bool handle_out(gsl::not_null<vmcs_t *> vmcs, info_t &info);
+    bool handle_string(gsl::not_null<vmcs_t *> vmcs, info_t &info, uint64_t reps, uint64_t mask);
+
+    uint64_t address_mask() const;
+    static void add_masked(uint64_t &reg, uint64_t val, uint64_t mask) noexcept;
 
     void emulate_in(info_t &info);
     void emulate_out(info_t &info);
@@ -258,23 +503,41 @@ private:
 
 private:
 
-    gsl::span<uint8_t> m_io_bitmap_a;
-    gsl::span<uint8_t> m_io_bitmap_b;
+    vcpu_bitmaps *m_bitmaps;
+    bool m_ins_outs_info;
+    guest_memory *m_guest_memory{nullptr};
+    coalesced_ring<> *m_coalesced{nullptr};
+    doorbell_bitmap<> *m_doorbells{nullptr};
+    doorbell_table m_doorbell_table;
+
+    // Handlers
+    //
+    // The handlers are stored in a two level table indexed by port, where
+    // each leaf covers 64 consecutive ports and is only allocated once a
+    // handler is added for one of its ports. A lookup is two array
+    // accesses, and the delegates for a port are stored inline.
+    //
+
+    struct port_handlers_t {
+        delegate_chain<handler_delegate_t, 2> in;
+        delegate_chain<handler_delegate_t, 2> out;
+        delegate_chain<string_handler_delegate_t, 1> string_in;
+        delegate_chain<string_handler_delegate_t, 1> string_out;
+        bool coalesced{false};
+        bool doorbell{false};
+    };
 
-    std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_in_handlers;
-    std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_out_handlers;
+    port_handlers_t &port_handlers(vmcs_n::value_type port);
 
-private:
+    using port_table_t = std::array<port_handlers_t, 0x40>;
 
-    struct record_t {
-        uint64_t port_number;
-        uint64_t size_of_access;
-        uint64_t direction_of_access;
-        uint64_t address;
-        uint64_t val;
-    };
+    const port_handlers_t *find_handlers(uint64_t port) const;
+    std::array<std::unique_ptr<port_table_t>, 0x400> m_handlers;
+
+private:
 
-    std::list<record_t> m_log;
+    log_ring<record_t> m_log;
+    exit_counters<> m_counters;
 
 public:
 
@@ -0,0 +1,240 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef IPI_INTEL_X64_EAPIS_H
+#define IPI_INTEL_X64_EAPIS_H
+
+#include <unordered_map>
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+class posted_interrupt_handler;
+
+/// IPI
+///
+/// Provides a fast path for guest writes to the x2APIC ICR (i.e. IPIs such
+/// as TLB shootdowns and reschedules). This handler sits in front of the
+/// wrmsr handler, so ICR writes skip its MSR lookup and handler list. The
+/// ICR is decoded once, and fixed IPIs are:
+///
+/// - posted to the target vCPU if its x2APIC ID was registered using
+///   add_target() (no physical IPI is sent, and a running target does not
+///   exit)
+/// - otherwise given to the registered handlers
+/// - otherwise written to the physical ICR
+///
+/// Every other delivery mode (INIT, SIPI, NMI, etc.) falls back to the
+/// wrmsr handler, and its ICR handlers (e.g. the INIT signal handler).
+///
+class EXPORT_EAPIS_HVE ipi_handler : public base
+{
+public:
+
+    ///
+    /// Info
+    ///
+    /// This struct is created by ipi_handler::handle before being
+    /// passed to each registered handler.
+    ///
+    struct info_t {
+
+        /// Value (in)
+        ///
+        /// The value the guest wrote to the ICR
+        ///
+        /// default: edx:eax
+        ///
+        uint64_t val;
+
+        /// Vector (in)
+        ///
+        /// default: bits 7:0 of val
+        ///
+        uint64_t vector;
+
+        /// Destination (in)
+        ///
+        /// The x2APIC ID (or logical destination) of the target
+        ///
+        /// default: bits 63:32 of val
+        ///
+        uint64_t destination;
+
+        /// Shorthand (in)
+        ///
+        /// 0 (none), 1 (self), 2 (all including self) or 3 (all excluding
+        /// self)
+        ///
+        /// default: bits 19:18 of val
+        ///
+        uint64_t shorthand;
+
+        /// Logical (in)
+        ///
+        /// default: bit 11 of val
+        ///
+        bool logical;
+
+        /// Ignore write (out)
+        ///
+        /// If true, do not write val to the physical ICR
+        ///
+        /// default: false
+        ///
+        bool ignore_write;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this IPI handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    ipi_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~ipi_handler() final;
+
+public:
+
+    /// Add Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when the guest sends a fixed IPI
+    ///
+    void add_handler(const handler_delegate_t &d);
+
+    /// Add Target
+    ///
+    /// Fixed IPIs sent to the physical destination apic_id (without a
+    /// shorthand) are posted to target instead of being sent.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apic_id the x2APIC ID of the target vCPU
+    /// @param target the target vCPU's posted interrupt handler
+    ///
+    void add_target(uint64_t apic_id, gsl::not_null<posted_interrupt_handler *> target);
+
+    /// Remove Target
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apic_id the x2APIC ID of the target vCPU
+    ///
+    void remove_target(uint64_t apic_id);
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final;
+
+    /// Posted
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of IPIs that were posted to a target
+    ///
+    uint64_t posted() const noexcept
+    { return m_posted; }
+
+    /// Sent
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of IPIs that were written to the
+    ///     physical ICR
+    ///
+    uint64_t sent() const noexcept
+    { return m_sent; }
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
+private:
+
+    delegate_chain<handler_delegate_t> m_handlers;
+    std::unordered_map<uint64_t, posted_interrupt_handler *> m_targets;
+
+    uint64_t m_posted{0};
+    uint64_t m_sent{0};
+
+public:
+
+    /// @cond
+
+    ipi_handler(ipi_handler &&) = default;
+    ipi_handler &operator=(ipi_handler &&) = default;
+
+    ipi_handler(const ipi_handler &) = delete;
+    ipi_handler &operator=(const ipi_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
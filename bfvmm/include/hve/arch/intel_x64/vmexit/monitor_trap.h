@@ -67,6 +67,39 @@ public:
     using handler_delegate_t =
         delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
 
+    /// Trace Entry
+    ///
+    /// One entry per monitor-trap exit while tracing (see trace()). The
+    /// register fields are only filled in if registers were requested,
+    /// otherwise they are 0.
+    ///
+    struct trace_entry_t {
+        uint64_t rip;
+        uint64_t rsp;
+        uint64_t rax;
+        uint64_t rbx;
+        uint64_t rcx;
+        uint64_t rdx;
+        uint64_t rsi;
+        uint64_t rdi;
+    };
+
+    /// Trace Done Delegate type
+    ///
+    /// Called once when a trace stops on its own (i.e. the step count ran
+    /// out or the guest left the traced RIP range), before the monitor
+    /// trap flag is cleared.
+    ///
+    using trace_done_delegate_t =
+        delegate<void(gsl::not_null<vmcs_t *>)>;
+
+    /// Trace Size
+    ///
+    /// The number of entries in the trace ring. Once full, the oldest
+    /// entries are overwritten (and counted by trace_dropped()).
+    ///
+    static constexpr const std::size_t trace_size = 1024;
+
     /// Constructor
     ///
     /// @expects
@@ -94,8 +127,10 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
     ///
-    void add_handler(const handler_delegate_t &d);
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
 
     /// Enable
     ///
@@ -109,6 +144,115 @@ public:
     ///
     void enable();
 
+public:
+
+    /// Trace
+    ///
+    /// Single steps the guest for up to "steps" instructions, recording
+    /// the guest's RIP (and optionally its general purpose registers)
+    /// into the trace ring on each monitor-trap exit. While tracing, the
+    /// monitor trap flag stays armed and the registered handlers are not
+    /// called, so each step costs a single exit with no delegate walk.
+    ///
+    /// Example:
+    /// @code
+    /// this->trace(10000, true);
+    /// @endcode
+    ///
+    /// @expects steps != 0
+    /// @ensures
+    ///
+    /// @param steps the maximum number of instructions to trace
+    /// @param regs if true, also record the general purpose registers
+    ///
+    void trace(uint64_t steps, bool regs = false);
+
+    /// Trace Range
+    ///
+    /// Same as trace(), but the trace also stops the first time the guest's
+    /// RIP is outside of [start, end) on a monitor-trap exit (that RIP is
+    /// still recorded, so the drained trace shows where the guest went).
+    ///
+    /// @expects start < end
+    /// @expects steps != 0
+    /// @ensures
+    ///
+    /// @param start the first address of the range to trace
+    /// @param end one past the last address of the range to trace
+    /// @param steps the maximum number of instructions to trace
+    /// @param regs if true, also record the general purpose registers
+    ///
+    void trace_range(
+        uint64_t start, uint64_t end, uint64_t steps, bool regs = false);
+
+    /// Stop Trace
+    ///
+    /// Stops tracing and clears the monitor trap flag. The trace done
+    /// delegate is not called. Recorded entries are kept until drained.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void stop_trace();
+
+    /// Is Tracing
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if a trace is running
+    ///
+    bool is_tracing() const noexcept
+    { return m_trace_steps != 0; }
+
+    /// Set Trace Done Delegate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when a trace stops on its own
+    ///
+    void set_trace_done(const trace_done_delegate_t &d)
+    {
+        m_trace_done = d;
+        m_has_trace_done = true;
+    }
+
+    /// Drain
+    ///
+    /// Moves up to buf.size() entries out of the trace ring, oldest first.
+    /// Draining may be done while a trace is running (see log_ring).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param buf where to copy the entries
+    /// @return returns the number of entries copied into buf
+    ///
+    std::size_t drain(gsl::span<trace_entry_t> buf) noexcept
+    { return m_trace.drain(buf); }
+
+    /// Trace Pending
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of entries waiting to be drained
+    ///
+    std::size_t trace_pending() const noexcept
+    { return m_trace.size(); }
+
+    /// Trace Dropped
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of entries that were overwritten before
+    ///     they were drained
+    ///
+    uint64_t trace_dropped() const noexcept
+    { return m_trace.dropped(); }
+
 public:
 
     /// Dump Log
@@ -134,7 +278,23 @@ public:
 
 private:
 
-    std::list<handler_delegate_t> m_handlers;
+    bool handle_trace(gsl::not_null<vmcs_t *> vmcs);
+
+private:
+
+    gsl::not_null<apis *> m_apis;
+
+    delegate_chain<handler_delegate_t> m_handlers;
+
+    log_ring<trace_entry_t, trace_size> m_trace;
+
+    uint64_t m_trace_steps{0};
+    uint64_t m_trace_start{0};
+    uint64_t m_trace_end{0};
+    bool m_trace_regs{false};
+
+    trace_done_delegate_t m_trace_done{};
+    bool m_has_trace_done{false};
 
 public:
 
@@ -37,6 +37,13 @@ class eapis_vcpu_global_state_t;
 ///
 /// Provides an interface for registering handlers for mov-dr exits.
 ///
+/// The handler can also virtualize the guest's debug registers lazily
+/// (see enable_lazy_exiting()). While the VMM owns the debug registers,
+/// the guest's DR0-DR3 and DR6 are kept in the handler, and the first
+/// MOV DR that no handler claims loads them and turns off mov-dr exiting,
+/// so the guest's context switches do not exit until the VMM takes the
+/// debug registers back with save_guest_drs().
+///
 class EXPORT_EAPIS_HVE mov_dr_handler : public base
 {
 public:
@@ -114,11 +121,112 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Enable Exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_exiting();
+
+    /// Disable Exiting
+    ///
+    /// @expects
+    /// @ensures
     ///
-    void add_handler(const handler_delegate_t &d);
+    void disable_exiting();
 
 public:
 
+    /// Enable Lazy Exiting
+    ///
+    /// Enables mov-dr exiting with the guest's debug registers saved in
+    /// the handler. The first MOV DR that no handler claims loads the
+    /// guest's debug registers and disables exiting, and the guest then
+    /// re-executes the instruction without exiting.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_lazy_exiting();
+
+    /// Disable Lazy Exiting
+    ///
+    /// Gives the debug registers back to the guest for good
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_lazy_exiting();
+
+    /// Save Guest Debug Registers
+    ///
+    /// Takes the debug registers back from the guest (e.g. before the VMM
+    /// programs a watchpoint): the guest's DR0-DR3 and DR6 are saved in
+    /// the handler, and mov-dr exiting is enabled again. Does nothing if
+    /// the guest does not own the debug registers.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void save_guest_drs();
+
+    /// Guest Owns Debug Registers
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the guest's debug registers are loaded
+    ///
+    bool guest_owns_drs() const noexcept
+    { return m_guest_owns_drs; }
+
+    /// Guest DR
+    ///
+    /// @expects n < 4 || n == 6
+    /// @ensures
+    ///
+    /// @param n the debug register to get
+    /// @return returns the guest's value of DRn (from the hardware if the
+    ///     guest owns the debug registers)
+    ///
+    uint64_t guest_dr(uint64_t n) const;
+
+    /// Set Guest DR
+    ///
+    /// @expects n < 4 || n == 6
+    /// @ensures
+    ///
+    /// @param n the debug register to set
+    /// @param val the guest's new value of DRn
+    ///
+    void set_guest_dr(uint64_t n, uint64_t val);
+
+    /// Lazy Loads
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of times the guest's debug registers
+    ///     were loaded because of a MOV DR exit
+    ///
+    uint64_t lazy_loads() const noexcept
+    { return m_lazy_loads; }
+
+public:
+
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t val;
+    };
+
     /// Dump Log
     ///
     /// Example:
@@ -131,25 +239,57 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain Log
+    ///
+    /// Copies the oldest records in the log into records and removes them
+    /// from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_log(gsl::span<record_t> records);
+
 public:
 
     /// @cond
 
     bool handle(gsl::not_null<vmcs_t *> vmcs);
 
+    static uint64_t read_dr(uint64_t n) noexcept;
+    static void write_dr(uint64_t n, uint64_t val) noexcept;
+
     /// @endcond
 
 private:
 
-    std::list<handler_delegate_t> m_handlers;
+    static std::size_t dr_index(uint64_t n);
+    void load_guest_drs();
 
 private:
 
-    struct record_t {
-        uint64_t val;
-    };
+    delegate_chain<handler_delegate_t> m_handlers;
+
+    std::array<uint64_t, 5> m_guest_drs{};
+    bool m_lazy{false};
+    bool m_guest_owns_drs{true};
+    uint64_t m_lazy_loads{0};
+
+private:
 
-    std::list<record_t> m_log;
+    log_ring<record_t> m_log;
 
 public:
 
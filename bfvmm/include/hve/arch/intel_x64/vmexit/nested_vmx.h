@@ -0,0 +1,311 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef NESTED_VMX_INTEL_X64_EAPIS_H
+#define NESTED_VMX_INTEL_X64_EAPIS_H
+
+#include "../base.h"
+#include "cpuid.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Nested VMX
+///
+/// Provides the building blocks for running a hypervisor in the guest
+/// (L1), using VMCS shadowing so that most of the L1 hypervisor's VMREAD
+/// and VMWRITE instructions do not exit:
+///
+/// - a shadow VMCS is linked to the vCPU's VMCS (using the VMCS link
+///   pointer). A VMREAD or VMWRITE of a field that is shadowed operates
+///   directly on the shadow VMCS without a VM exit.
+/// - the VMREAD and VMWRITE bitmaps select which fields are shadowed.
+///   By default, every field exits (see shadow_field()), and enable()
+///   shadows the fields an L1 hypervisor accesses on every one of its
+///   exits.
+/// - once enabled, CPUID.1:ECX.VMX is reported to the guest
+///
+/// The VMX instructions themselves (VMXON, VMPTRLD, VMLAUNCH, etc.), and
+/// VMREAD/VMWRITE of fields that are not shadowed, still exit, and are
+/// handed to the registered delegates, which are responsible for
+/// emulating them (e.g. by building the L2 VMCS from the shadow VMCS on
+/// VMLAUNCH / VMRESUME).
+///
+class EXPORT_EAPIS_HVE nested_vmx_handler : public base
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by nested_vmx_handler::handle before being
+    /// passed to each registered handler.
+    ///
+    struct info_t {
+
+        /// Exit Reason (in)
+        ///
+        /// The basic exit reason, which identifies the VMX instruction
+        ///
+        /// default: vmcs_n::exit_reason::basic_exit_reason::get()
+        ///
+        uint64_t exit_reason;
+
+        /// Exit Qualification (in)
+        ///
+        /// The displacement of the instruction's memory operand, if any
+        ///
+        /// default: vmcs_n::exit_qualification::get()
+        ///
+        uint64_t exit_qualification;
+
+        /// Instruction Information (in)
+        ///
+        /// The instruction's operands (see the Intel SDM, Vol. 3, 27.2.5)
+        ///
+        /// default: vmcs_n::vm_exit_instruction_information::get()
+        ///
+        uint64_t instruction_information;
+
+        /// Ignore advance (out)
+        ///
+        /// If true, do not advance the guest's instruction pointer.
+        /// Set this to true if the instruction was failed with a fault.
+        ///
+        /// default: false
+        ///
+        bool ignore_advance;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this nested VMX handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    nested_vmx_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~nested_vmx_handler() final;
+
+    /// Is Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the CPU supports VMCS shadowing
+    ///
+    static bool is_supported();
+
+public:
+
+    /// Add Nested VMX Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when a VMX instruction exits
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Enable
+    ///
+    /// Links the shadow VMCS to the vCPU that is currently loaded, enables
+    /// VMCS shadowing, shadows the default fields and reports VMX support
+    /// in CPUID.
+    ///
+    /// Example:
+    /// @code
+    /// this->enable();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// Unlinks the shadow VMCS and hides VMX support in CPUID again. The
+    /// contents of the shadow VMCS are kept.
+    ///
+    /// Example:
+    /// @code
+    /// this->disable();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Is Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if VMCS shadowing is enabled
+    ///
+    bool is_enabled() const noexcept
+    { return m_enabled; }
+
+    /// Shadow Field
+    ///
+    /// Lets the guest VMREAD (and if write is true, VMWRITE) field without
+    /// a VM exit. Fields with an encoding above 0x7FFF always exit.
+    ///
+    /// Example:
+    /// @code
+    /// this->shadow_field(0x681E);
+    /// @endcode
+    ///
+    /// @expects field <= 0x7FFF
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to shadow
+    /// @param write if true, VMWRITE is shadowed as well as VMREAD
+    ///
+    void shadow_field(vmcs_n::value_type field, bool write = true);
+
+    /// Trap Field
+    ///
+    /// Makes the guest's VMREAD and VMWRITE of field exit again
+    ///
+    /// Example:
+    /// @code
+    /// this->trap_field(0x681E);
+    /// @endcode
+    ///
+    /// @expects field <= 0x7FFF
+    /// @ensures
+    ///
+    /// @param field the encoding of the VMCS field to trap
+    ///
+    void trap_field(vmcs_n::value_type field);
+
+    /// Shadow VMCS
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the physical address of the shadow VMCS
+    ///
+    uint64_t shadow_vmcs() const;
+
+    /// VMREAD Bitmap
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the VMREAD bitmap (a set bit exits)
+    ///
+    gsl::span<uint8_t> vmread_bitmap() noexcept;
+
+    /// VMWRITE Bitmap
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the VMWRITE bitmap (a set bit exits)
+    ///
+    gsl::span<uint8_t> vmwrite_bitmap() noexcept;
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final;
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    bool handle_cpuid(
+        gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    delegate_chain<handler_delegate_t> m_handlers;
+
+    std::unique_ptr<uint32_t, void(*)(void *)> m_shadow_vmcs;
+    std::unique_ptr<uint8_t, void(*)(void *)> m_vmread_bitmap;
+    std::unique_ptr<uint8_t, void(*)(void *)> m_vmwrite_bitmap;
+
+    bool m_enabled{false};
+
+private:
+
+    uint64_t m_num_exits{};
+    uint64_t m_num_vmread{};
+    uint64_t m_num_vmwrite{};
+
+public:
+
+    /// @cond
+
+    nested_vmx_handler(nested_vmx_handler &&) = default;
+    nested_vmx_handler &operator=(nested_vmx_handler &&) = default;
+
+    nested_vmx_handler(const nested_vmx_handler &) = delete;
+    nested_vmx_handler &operator=(const nested_vmx_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,296 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef PAUSE_INTEL_X64_EAPIS_H
+#define PAUSE_INTEL_X64_EAPIS_H
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// PAUSE
+///
+/// Provides an interface for registering handlers for PAUSE exits, either
+/// on every PAUSE, or (with PAUSE-loop exiting) only once the guest has
+/// been spinning in a PAUSE loop for longer than the PLE window. A PAUSE
+/// loop that long usually means the guest is waiting on a lock whose holder
+/// is not running, which the handlers are told so that they can yield to
+/// another vCPU instead of letting this one spin.
+///
+class EXPORT_EAPIS_HVE pause_handler : public base
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by pause_handler::handle before being
+    /// passed to each registered handler.
+    ///
+    struct info_t {
+
+        /// Lock Holder Preempted (out)
+        ///
+        /// True if this exit came from PAUSE-loop exiting (i.e., the guest
+        /// has been spinning for longer than the PLE window), which is a
+        /// hint that the guest is waiting on a vCPU that is not running.
+        ///
+        bool lock_holder_preempted;
+
+        /// Spins (out)
+        ///
+        /// The number of consecutive PAUSE-loop exits at this RIP,
+        /// including this one. This keeps growing while the guest keeps
+        /// spinning on the same lock across yields.
+        ///
+        uint64_t spins;
+
+        /// Ignore advance (out)
+        ///
+        /// If true, do not advance the guest's instruction pointer.
+        /// Set this to true if your handler returns true and has already
+        /// advanced the guest's instruction pointer.
+        ///
+        /// default: false
+        ///
+        bool ignore_advance;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Default PLE Gap
+    ///
+    /// The maximum number of TSC ticks between two PAUSEs for them to be
+    /// considered part of the same loop
+    ///
+    static constexpr const uint64_t default_ple_gap = 128;
+
+    /// Default PLE Window
+    ///
+    /// The number of TSC ticks a PAUSE loop is allowed to spin before
+    /// it exits
+    ///
+    static constexpr const uint64_t default_ple_window = 4096;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this PAUSE handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    pause_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~pause_handler() final = default;
+
+public:
+
+    /// Add Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Enable exiting
+    ///
+    /// Exit on every PAUSE. This overrides PAUSE-loop exiting.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_exiting();
+
+    /// Disable exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_exiting();
+
+    /// Is Loop Exiting Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true iff the CPU supports PAUSE-loop exiting
+    ///
+    static bool is_loop_exiting_supported();
+
+    /// Enable Loop Exiting
+    ///
+    /// Enables PAUSE-loop exiting with the given gap and window (both in
+    /// TSC ticks). If max_window is larger than window, the window is
+    /// adaptive: each PAUSE-loop exit doubles it (up to max_window), so a
+    /// vCPU that keeps exiting while its lock holders are running spins
+    /// longer before exiting again, and shrink_window() returns it to
+    /// window (typically once this vCPU has been rescheduled).
+    ///
+    /// @expects is_loop_exiting_supported()
+    /// @expects window != 0
+    /// @ensures
+    ///
+    /// @param gap the PLE gap
+    /// @param window the PLE window
+    /// @param max_window the largest the PLE window may grow to
+    ///
+    void enable_loop_exiting(
+        uint64_t gap = default_ple_gap,
+        uint64_t window = default_ple_window,
+        uint64_t max_window = 0);
+
+    /// Disable Loop Exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_loop_exiting();
+
+    /// Grow Window
+    ///
+    /// Doubles the PLE window, up to the max_window given to
+    /// enable_loop_exiting()
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void grow_window();
+
+    /// Shrink Window
+    ///
+    /// Returns the PLE window to the window given to enable_loop_exiting()
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void shrink_window();
+
+    /// Window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current PLE window
+    ///
+    uint64_t window() const noexcept
+    { return m_window; }
+
+    /// Exits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of PAUSE exits handled
+    ///
+    uint64_t exits() const noexcept
+    { return m_exits; }
+
+    /// Loop Exits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of those exits that came from PAUSE-loop exiting
+    ///
+    uint64_t loop_exits() const noexcept
+    { return m_loop_exits; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final
+    { }
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
+private:
+
+    delegate_chain<handler_delegate_t> m_handlers;
+
+    bool m_exiting{false};
+    bool m_loop_exiting{false};
+
+    uint64_t m_base_window{0};
+    uint64_t m_max_window{0};
+    uint64_t m_window{0};
+
+    uint64_t m_last_rip{0};
+    uint64_t m_spins{0};
+
+    uint64_t m_exits{0};
+    uint64_t m_loop_exits{0};
+
+public:
+
+    /// @cond
+
+    pause_handler(pause_handler &&) = default;
+    pause_handler &operator=(pause_handler &&) = default;
+
+    pause_handler(const pause_handler &) = delete;
+    pause_handler &operator=(const pause_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,209 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef PML_INTEL_X64_EAPIS_H
+#define PML_INTEL_X64_EAPIS_H
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Page Modification Log
+///
+/// Provides an interface for Intel's Page Modification Logging (PML). Once
+/// enabled, each time the guest sets the dirty flag of an EPT entry, the
+/// CPU records the guest physical address of the page in a per-vCPU log
+/// (512 entries), and only exits once the log is full. The logged
+/// addresses are handed to the registered delegates in batches, either
+/// when the log is full, or when the log is drained manually using
+/// drain(). Compared to write protecting every page, this reduces the cost
+/// of dirty page tracking from one EPT violation per page to one exit per
+/// 512 pages.
+///
+/// @note PML requires EPT with accessed and dirty flags enabled (see
+///     apis::set_eptp()). A page is only logged when its dirty flag goes
+///     from 0 to 1, so to log a page again, its dirty flag must be cleared
+///     (e.g. using ept::mmap::scan_dirty()) and EPT invalidated.
+///
+class EXPORT_EAPIS_HVE pml_handler : public base
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by pml_handler::drain before being passed to
+    /// each registered handler.
+    ///
+    struct info_t {
+
+        /// GPAs
+        ///
+        /// The 4k aligned guest physical addresses of the pages that were
+        /// logged since the log was last drained.
+        ///
+        gsl::span<uint64_t> gpas;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this PML handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    pml_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~pml_handler() final;
+
+public:
+
+    /// Add PML Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when logged addresses are drained
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Enable
+    ///
+    /// Allocates the log (on first use), resets the log index and enables
+    /// PML on the vCPU that is currently loaded.
+    ///
+    /// Example:
+    /// @code
+    /// this->enable();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// Example:
+    /// @code
+    /// this->disable();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Drain
+    ///
+    /// Hands any addresses that have been logged to the registered
+    /// delegates and resets the log. This can be called at any time (e.g.
+    /// from a VMCall) to collect the dirty pages without waiting for the
+    /// log to fill up.
+    ///
+    /// Example:
+    /// @code
+    /// this->drain(vmcs);
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vmcs the vmcs of the vCPU that owns the log
+    /// @return Returns the number of addresses that were drained
+    ///
+    uint64_t drain(gsl::not_null<vmcs_t *> vmcs);
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final;
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
+private:
+
+    gsl::not_null<apis *> m_apis;
+
+    delegate_chain<handler_delegate_t> m_handlers;
+    std::unique_ptr<uint64_t, void(*)(void *)> m_log_page;
+
+private:
+
+    uint64_t m_num_full{};
+    uint64_t m_num_drained{};
+
+public:
+
+    /// @cond
+
+    pml_handler(pml_handler &&) = default;
+    pml_handler &operator=(pml_handler &&) = default;
+
+    pml_handler(const pml_handler &) = delete;
+    pml_handler &operator=(const pml_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,258 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef PREEMPTION_TIMER_INTEL_X64_EAPIS_H
+#define PREEMPTION_TIMER_INTEL_X64_EAPIS_H
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// Preemption Timer
+///
+/// Provides an interface for arming the VMX-preemption timer and
+/// registering handlers for its exits. Deadlines are given in TSC ticks
+/// and converted to the timer's rate (IA32_VMX_MISC[4:0]). The timer only
+/// counts down while the guest is running (the value is saved on each
+/// VM-exit), so a deadline is a budget of guest execution time, and time
+/// spent in the VMM delays the callback rather than shortening the slice.
+///
+class EXPORT_EAPIS_HVE preemption_timer_handler : public base
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by preemption_timer_handler::handle before
+    /// being passed to each registered handler.
+    ///
+    struct info_t {
+
+        /// TSC (out)
+        ///
+        /// The TSC when the exit was handled
+        ///
+        uint64_t tsc;
+
+        /// Deadline (out)
+        ///
+        /// The deadline (in TSC ticks) that expired
+        ///
+        uint64_t deadline;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this preemption timer handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    preemption_timer_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~preemption_timer_handler() final = default;
+
+public:
+
+    /// Add Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Is Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true iff the CPU allows the VMX-preemption timer to be
+    ///     activated
+    ///
+    static bool is_supported();
+
+    /// Arm
+    ///
+    /// Arms a one-shot deadline ticks (of the TSC) from now. Arming again
+    /// replaces the previous deadline, and a handler may re-arm the timer
+    /// from its exit.
+    ///
+    /// @expects is_supported()
+    /// @ensures is_armed()
+    ///
+    /// @param ticks the number of TSC ticks until the timer expires
+    ///
+    void arm(uint64_t ticks);
+
+    /// Arm Periodic
+    ///
+    /// Arms the timer to expire every period ticks (of the TSC). Each
+    /// deadline is based on the previous one rather than on when its exit
+    /// was handled, so the period does not drift. If the VMM falls more
+    /// than a period behind, the missed deadlines are skipped.
+    ///
+    /// @expects is_supported()
+    /// @expects period != 0
+    /// @ensures is_armed()
+    ///
+    /// @param period the number of TSC ticks between each expiry
+    ///
+    void arm_periodic(uint64_t period);
+
+    /// Disarm
+    ///
+    /// @expects
+    /// @ensures !is_armed()
+    ///
+    void disarm();
+
+    /// Is Armed
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true iff the timer is armed
+    ///
+    bool is_armed() const noexcept
+    { return m_armed; }
+
+    /// Deadline
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the TSC at which the timer is due to expire (if armed)
+    ///
+    uint64_t deadline() const noexcept
+    { return m_deadline; }
+
+    /// Rate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the timer counts down by 1 every 2^rate() TSC ticks
+    ///
+    uint64_t rate() const noexcept
+    { return m_rate; }
+
+    /// Expirations
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of times the timer has expired
+    ///
+    uint64_t expirations() const noexcept
+    { return m_expirations; }
+
+    /// Missed
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of periodic deadlines skipped because the VMM
+    ///     fell more than a period behind
+    ///
+    uint64_t missed() const noexcept
+    { return m_missed; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final
+    { }
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
+private:
+
+    void set_timer(uint64_t deadline, uint64_t tsc);
+
+    delegate_chain<handler_delegate_t> m_handlers;
+
+    bool m_armed{false};
+    uint64_t m_rate{0};
+    uint64_t m_period{0};
+    uint64_t m_deadline{0};
+
+    uint64_t m_expirations{0};
+    uint64_t m_missed{0};
+
+public:
+
+    /// @cond
+
+    preemption_timer_handler(preemption_timer_handler &&) = default;
+    preemption_timer_handler &operator=(preemption_timer_handler &&) = default;
+
+    preemption_timer_handler(const preemption_timer_handler &) = delete;
+    preemption_timer_handler &operator=(const preemption_timer_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
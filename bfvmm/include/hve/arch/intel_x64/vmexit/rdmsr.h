@@ -31,6 +31,7 @@ namespace intel_x64
 {
 
 class apis;
+class vcpu_bitmaps;
 class eapis_vcpu_global_state_t;
 
 /// RDMSR
@@ -123,6 +124,23 @@ public:
     void add_handler(
         vmcs_n::value_type msr, const handler_delegate_t &d);
 
+    /// Add Constant
+    ///
+    /// Answers every read of msr with val. If msr has no delegates,
+    /// answering a read takes neither a delegate call nor a read of the
+    /// real MSR (or a log record). MSRs that only ever return a fixed
+    /// value should use this instead of a handler. If msr also has
+    /// delegates, they are still called first, with val as the value that
+    /// was read, and val is the answer if none of them handle the read.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param msr the msr to answer
+    /// @param val the value every read of msr returns
+    ///
+    void add_constant(vmcs_n::value_type msr, uint64_t val);
+
     /// Trap On Access
     ///
     /// Sets a '1' in the MSR bitmap corresponding with the provided msr. All
@@ -141,6 +159,25 @@ public:
     ///
     void trap_on_access(vmcs_n::value_type msr);
 
+    /// Trap On Range
+    ///
+    /// Sets a '1' in the MSR bitmap for every msr from first to last
+    /// (inclusive). This is the same as calling trap_on_access() for each
+    /// msr, but whole bytes of the bitmap are written at once.
+    ///
+    /// Example:
+    /// @code
+    /// this->trap_on_range(0x800, 0x8FF);
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr to trap on
+    /// @param last the last msr to trap on
+    ///
+    void trap_on_range(vmcs_n::value_type first, vmcs_n::value_type last);
+
     /// Trap On All Accesses
     ///
     /// Sets a '1' in the MSR bitmap corresponding with all of the rdmsr. All
@@ -175,6 +212,24 @@ public:
     ///
     void pass_through_access(vmcs_n::value_type msr);
 
+    /// Pass Through Range
+    ///
+    /// Sets a '0' in the MSR bitmap for every msr from first to last
+    /// (inclusive).
+    ///
+    /// Example:
+    /// @code
+    /// this->pass_through_range(0x800, 0x8FF);
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param first the first msr to pass through
+    /// @param last the last msr to pass through
+    ///
+    void pass_through_range(vmcs_n::value_type first, vmcs_n::value_type last);
+
     /// Pass Through All Access
     ///
     /// Sets a '0' in the MSR bitmap corresponding with all of the ports. All
@@ -193,6 +248,28 @@ public:
 
 public:
 
+    /// Counters
+    ///
+    /// Returns the number of exits for each MSR, whether or not the exit
+    /// was handled. The counters are always on (including release builds),
+    /// so they can be used to decide which exits are worth trapping.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the exit counters for this handler
+    ///
+    const exit_counters<> &counters() const noexcept;
+
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t msr;
+        uint64_t val;
+    };
+
     /// Dump Log
     ///
     /// Example:
@@ -205,6 +282,29 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain Log
+    ///
+    /// Copies the oldest records in the log into records and removes them
+    /// from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_log(gsl::span<record_t> records);
+
 public:
 
     /// @cond
@@ -215,17 +315,19 @@ public:
 
 private:
 
-    gsl::span<uint8_t> m_msr_bitmap;
-    std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_handlers;
-
-private:
-
-    struct record_t {
-        uint64_t msr;
+    vcpu_bitmaps *m_bitmaps;
+    struct msr_handlers_t {
+        delegate_chain<handler_delegate_t> handlers;
+        bool constant;
         uint64_t val;
     };
 
-    std::list<record_t> m_log;
+    msr_map<msr_handlers_t> m_handlers;
+
+private:
+
+    log_ring<record_t> m_log;
+    exit_counters<> m_counters;
 
 public:
 
@@ -0,0 +1,199 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef VMCALL_INTEL_X64_EAPIS_H
+#define VMCALL_INTEL_X64_EAPIS_H
+
+#include <unordered_map>
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// VMCall
+///
+/// Provides an interface for registering handlers for vmcall exits,
+/// keyed on the opcode the guest places in RAX. vmcalls with an opcode
+/// that no handler was registered for are passed on to the next delegate
+/// (i.e. the base hypervisor), so that existing vmcalls (e.g. bfack's
+/// ack) continue to work.
+///
+class EXPORT_EAPIS_HVE vmcall_handler : public base
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by vmcall_handler::handle before being
+    /// passed to each registered handler.
+    ///
+    struct info_t {
+
+        /// RAX (in/out)
+        ///
+        uint64_t rax;
+
+        /// RBX (in/out)
+        ///
+        uint64_t rbx;
+
+        /// RCX (in/out)
+        ///
+        uint64_t rcx;
+
+        /// RDX (in/out)
+        ///
+        uint64_t rdx;
+
+        /// Ignore write (out)
+        ///
+        /// If true, do not update the guest's register state with the four
+        /// register values above.
+        ///
+        /// default: false
+        ///
+        bool ignore_write;
+
+        /// Ignore advance (out)
+        ///
+        /// If true, do not advance the guest's instruction pointer.
+        /// Set this to true if your handler returns true and has already
+        /// advanced the guest's instruction pointer.
+        ///
+        /// default: false
+        ///
+        bool ignore_advance;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this vmcall handler
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    vmcall_handler(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vmcall_handler() final = default;
+
+public:
+
+    /// Add Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param opcode the value of RAX to call d for
+    /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        uint64_t opcode, const handler_delegate_t &d, int64_t priority = 0);
+
+    /// Calls
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of vmcalls handled by a registered handler
+    ///
+    uint64_t calls() const noexcept
+    { return m_calls; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final
+    { }
+
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final
+    { usage.handlers += heap_bytes(m_handlers); }
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
+private:
+
+    std::unordered_map<uint64_t, delegate_chain<handler_delegate_t>> m_handlers;
+    uint64_t m_calls{0};
+
+public:
+
+    /// @cond
+
+    vmcall_handler(vmcall_handler &&) = default;
+    vmcall_handler &operator=(vmcall_handler &&) = default;
+
+    vmcall_handler(const vmcall_handler &) = delete;
+    vmcall_handler &operator=(const vmcall_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -33,9 +33,17 @@ namespace intel_x64
 class apis;
 class eapis_vcpu_global_state_t;
 
-/// MOV DR
+/// XSetBV
 ///
-/// Provides an interface for registering handlers for mov-dr exits.
+/// Provides an interface for registering handlers for xsetbv exits.
+///
+/// The handler also keeps track of the guest's XCR0. The VMM runs with
+/// the guest's XCR0 and extended state loaded, so nothing is saved or
+/// restored on an exit. Only code in the VMM that actually uses extended
+/// state needs to switch to the host's state, by wrapping that code in
+/// begin_host_xstate() / end_host_xstate() (or an xstate_guard), which
+/// saves the guest's state into a per-vCPU compact (XSAVES) area. Guest
+/// writes that do not change XCR0 do not touch the hardware.
 ///
 class EXPORT_EAPIS_HVE xsetbv_handler : public base
 {
@@ -114,11 +122,115 @@ public:
     /// @ensures
     ///
     /// @param d the handler to call when an exit occurs
+    /// @param priority handlers with a higher priority are called first
+    ///
+    void add_handler(
+        const handler_delegate_t &d, int64_t priority = 0);
+
+public:
+
+    /// Guest XCR0
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the guest's XCR0
+    ///
+    uint64_t guest_xcr0() const noexcept
+    { return m_guest_xcr0; }
+
+    /// Redundant Writes
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of guest writes to XCR0 that did not
+    ///     change it (and therefore skipped the hardware write)
+    ///
+    uint64_t redundant_writes() const noexcept
+    { return m_redundant_writes; }
+
+    /// Begin Host Extended State
+    ///
+    /// Saves the guest's extended state (the components enabled in the
+    /// guest's XCR0) and loads host_xcr0, so that the VMM can use
+    /// extended state (e.g. AVX) without corrupting the guest's state.
+    /// Calls may be nested; only the outermost call saves anything.
+    ///
+    /// Example:
+    /// @code
+    /// this->begin_host_xstate(xsetbv_handler::host_xcr0);
+    /// @endcode
+    ///
+    /// @expects host_xcr0 includes x87 state
+    /// @ensures
+    ///
+    /// @param host_xcr0 the XCR0 the VMM needs
+    ///
+    void begin_host_xstate(uint64_t host_xcr0 = default_host_xcr0);
+
+    /// End Host Extended State
     ///
-    void add_handler(const handler_delegate_t &d);
+    /// Undoes the matching begin_host_xstate(). The outermost call
+    /// restores the guest's XCR0 and extended state.
+    ///
+    /// @expects begin_host_xstate() was called
+    /// @ensures
+    ///
+    void end_host_xstate();
+
+    /// Is Host Extended State
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the host's extended state is loaded
+    ///
+    bool is_host_xstate() const noexcept
+    { return m_host_xstate_depth != 0; }
+
+    /// Guest Extended State Saves
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of times the guest's extended state had
+    ///     to be saved
+    ///
+    uint64_t guest_xstate_saves() const noexcept
+    { return m_guest_xstate_saves; }
+
+    /// Extended State Area Size
+    ///
+    /// The area that begin_host_xstate() saves the guest's extended state
+    /// into is allocated on first use, and is sized for every component
+    /// the CPU supports, so that the guest can enable more components
+    /// with XSETBV later without overflowing it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the size of the area (not including the padding
+    ///     used to align it)
+    ///
+    std::size_t xsave_area_size();
+
+    /// Default Host XCR0
+    ///
+    /// x87, SSE and AVX state
+    ///
+    static constexpr const uint64_t default_host_xcr0 = 0x7U;
 
 public:
 
+    /// Record
+    ///
+    /// An entry in the log
+    ///
+    struct record_t {
+        uint64_t val;
+    };
+
     /// Dump Log
     ///
     /// Example:
@@ -131,6 +243,29 @@ public:
     ///
     void dump_log() final;
 
+    /// Memory Usage
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param usage where to add this handler's memory usage (see
+    ///     base::memory_usage())
+    ///
+    void memory_usage(memory_usage_t &usage) const final;
+
+    /// Drain Log
+    ///
+    /// Copies the oldest records in the log into records and removes them
+    /// from the log (e.g. so that a vmcall can return them).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param records the buffer to copy the records into
+    /// @return returns the number of records copied into records
+    ///
+    std::size_t drain_log(gsl::span<record_t> records);
+
 public:
 
     /// @cond
@@ -141,15 +276,26 @@ public:
 
 private:
 
-    std::list<handler_delegate_t> m_handlers;
+    uint8_t *xsave_area();
 
 private:
 
-    struct record_t {
-        uint64_t val;
-    };
+    delegate_chain<handler_delegate_t> m_handlers;
+
+    uint64_t m_guest_xcr0{0};
+    uint64_t m_redundant_writes{0};
 
-    std::list<record_t> m_log;
+    std::unique_ptr<uint8_t[]> m_xsave_buffer;
+    uint8_t *m_xsave_area{nullptr};
+    std::size_t m_xsave_size{0};
+    bool m_xsaves{false};
+
+    uint64_t m_host_xstate_depth{0};
+    uint64_t m_guest_xstate_saves{0};
+
+private:
+
+    log_ring<record_t> m_log;
 
 public:
 
@@ -164,6 +310,61 @@ public:
     /// @endcond
 };
 
+/// XState Guard
+///
+/// Holds the host's extended state for as long as the guard is in scope
+/// (see xsetbv_handler::begin_host_xstate())
+///
+/// Example:
+/// @code
+/// {
+///     xstate_guard guard(m_apis->xsetbv());
+///     ...
+/// }
+/// @endcode
+///
+class xstate_guard
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param xsetbv the xsetbv handler of the current vCPU
+    /// @param host_xcr0 the XCR0 the VMM needs
+    ///
+    explicit xstate_guard(
+        gsl::not_null<xsetbv_handler *> xsetbv,
+        uint64_t host_xcr0 = xsetbv_handler::default_host_xcr0
+    ) :
+        m_xsetbv{xsetbv}
+    { m_xsetbv->begin_host_xstate(host_xcr0); }
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~xstate_guard()
+    { m_xsetbv->end_host_xstate(); }
+
+    /// @cond
+
+    xstate_guard(xstate_guard &&) = delete;
+    xstate_guard &operator=(xstate_guard &&) = delete;
+
+    xstate_guard(const xstate_guard &) = delete;
+    xstate_guard &operator=(const xstate_guard &) = delete;
+
+    /// @endcond
+
+private:
+
+    gsl::not_null<xsetbv_handler *> m_xsetbv;
+};
+
 }
 }
 
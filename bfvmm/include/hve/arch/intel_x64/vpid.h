@@ -33,9 +33,94 @@ namespace intel_x64
 class apis;
 class eapis_vcpu_global_state_t;
 
+/// VPID Allocator
+///
+/// Hands out VPIDs to vCPUs on any core without a lock. Released VPIDs
+/// are kept on a free list (a tagged stack, so a VPID that is released and
+/// reallocated while another core is popping cannot corrupt it) and are
+/// handed out again before any new VPID is. A recycled VPID may still have
+/// translations cached from its previous vCPU, so the caller must flush
+/// it (with a single-context INVVPID) before using it, which leaves the
+/// translations of every other vCPU alone.
+///
+class EXPORT_EAPIS_HVE vpid_allocator
+{
+public:
+
+    /// The number of VPIDs (VPID 0 is reserved for the VMM)
+    ///
+    constexpr static const uint64_t max_vpids = 0x10000;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vpid_allocator() noexcept = default;
+
+    /// Get Singleton Instance
+    ///
+    /// @expects none
+    /// @ensures ret != nullptr
+    ///
+    /// @return a singleton instance of the VPID allocator
+    ///
+    static vpid_allocator *instance() noexcept;
+
+    /// Allocate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param recycled set to true if the VPID was used before, in which
+    ///     case it must be flushed before it is used
+    /// @return returns a VPID, or 0 if all of the VPIDs are in use
+    ///
+    uint16_t allocate(bool &recycled) noexcept;
+
+    /// Release
+    ///
+    /// @expects id != 0
+    /// @ensures
+    ///
+    /// @param id the VPID to return to the free list
+    ///
+    void release(uint16_t id);
+
+#ifndef ENABLE_BUILD_TEST
+private:
+#endif
+
+    vpid_allocator() noexcept = default;
+
+private:
+
+    // The free list's head is the VPID on top of the stack (bits 15:0)
+    // and a tag (bits 63:16) that changes on every push and pop
+    //
+    uint64_t m_head{0};
+    uint64_t m_fresh{1};
+
+    std::array<uint16_t, max_vpids> m_next{};
+
+public:
+
+    /// @cond
+
+    vpid_allocator(vpid_allocator &&) = delete;
+    vpid_allocator &operator=(vpid_allocator &&) = delete;
+
+    vpid_allocator(const vpid_allocator &) = delete;
+    vpid_allocator &operator=(const vpid_allocator &) = delete;
+
+    /// @endcond
+};
+
 /// VPID
 ///
-/// Provides an interface for enabling VPID
+/// Provides an interface for enabling VPID. Each vCPU is given its own
+/// VPID from the VPID allocator, which is released when the vCPU is
+/// destroyed.
 ///
 class EXPORT_EAPIS_HVE vpid_handler
 {
@@ -58,20 +143,23 @@ public:
     /// @expects
     /// @ensures
     ///
-    ~vpid_handler() = default;
+    ~vpid_handler();
 
     /// Get ID
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the VPID
+    /// @return Returns the VPID, or 0 if no VPID was available
     ///
     vmcs_n::value_type id() const noexcept;
 
     /// Enable
     ///
-    /// @expects
+    /// If the VPID was recycled, its stale translations are flushed the
+    /// first time it is enabled.
+    ///
+    /// @expects id() != 0
     /// @ensures
     ///
     void enable();
@@ -85,14 +173,15 @@ public:
 
 private:
 
-    vmcs_n::value_type m_id;
+    vmcs_n::value_type m_id{0};
+    bool m_flush{false};
 
 public:
 
     /// @cond
 
-    vpid_handler(vpid_handler &&) = default;
-    vpid_handler &operator=(vpid_handler &&) = default;
+    vpid_handler(vpid_handler &&other) noexcept;
+    vpid_handler &operator=(vpid_handler &&other) noexcept;
 
     vpid_handler(const vpid_handler &) = delete;
     vpid_handler &operator=(const vpid_handler &) = delete;
@@ -103,4 +192,11 @@ public:
 }
 }
 
+/// Global VPID Allocator
+///
+/// @expects
+/// @ensures g_vpids != nullptr
+///
+#define g_vpids eapis::intel_x64::vpid_allocator::instance()
+
 #endif
@@ -0,0 +1,260 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef WRITE_MONITOR_INTEL_X64_EAPIS_H
+#define WRITE_MONITOR_INTEL_X64_EAPIS_H
+
+#include "base.h"
+#include "ept/mmap.h"
+#include "vmexit/ept_violation.h"
+#include "vmexit/monitor_trap.h"
+#include "vmexit/preemption_timer.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class apis;
+class eapis_vcpu_global_state_t;
+
+/// EPT Write Monitor
+///
+/// Implements the "trap, step, re-protect" pattern for monitoring guest
+/// writes to individual pages:
+///
+/// - watch() removes write access to a 4k page (splitting large pages as
+///   needed) and registers a per-page EPT violation handler for it
+/// - on a write violation, the delegate is told about the write, the page
+///   is made writable, and the guest is single stepped using the monitor
+///   trap flag, so the write completes
+/// - on the monitor trap exit, the page is write protected again
+///
+/// Every edit bumps the map's generation, so each exit ends with a single
+/// context INVEPT (see apis::invalidate_ept()) instead of a global one.
+/// The state of the current step is kept per vCPU (each vCPU has its own
+/// monitor), but the map is not: while a page is writable, it is writable
+/// for every vCPU that uses the map.
+///
+/// Hot pages can be batched (see set_batching()): once a page has taken
+/// a number of write violations, the next violation leaves it writable for
+/// a number of TSC ticks instead of stepping, and the writes made during
+/// that window are reported once (by the violation that opened it). The
+/// window is closed using the vCPU's VMX-preemption timer, so batching
+/// cannot be combined with other users of the preemption timer.
+///
+class EXPORT_EAPIS_HVE ept_write_monitor
+{
+public:
+
+    /// Info
+    ///
+    /// This struct is created by ept_write_monitor::handle_violation before
+    /// being passed to the delegate of the page being written.
+    ///
+    struct info_t {
+
+        /// GVA (in)
+        ///
+        /// The guest virtual (linear) address being written
+        ///
+        uint64_t gva;
+
+        /// GPA (in)
+        ///
+        /// The guest physical address being written
+        ///
+        uint64_t gpa;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when watching a page. Return
+    /// true to let the write happen, or false to let the violation fall
+    /// through to the other EPT violation handlers without granting it.
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vmcs_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apis the apis object for this write monitor
+    /// @param eapis_vcpu_global_state a pointer to the vCPUs global state
+    ///
+    ept_write_monitor(
+        gsl::not_null<apis *> apis,
+        gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~ept_write_monitor() = default;
+
+    /// Watch
+    ///
+    /// Write protects the 4k page that contains gpa in map, and calls d on
+    /// each write to it. If the page is already watched, d replaces its
+    /// delegate.
+    ///
+    /// @expects gpa is mapped in map
+    /// @ensures
+    ///
+    /// @param map the map the guest uses to access gpa
+    /// @param gpa a guest physical address in the page to watch
+    /// @param d the delegate to call when the page is written
+    ///
+    void watch(ept::mmap &map, uint64_t gpa, const handler_delegate_t &d);
+
+    /// Unwatch
+    ///
+    /// Stops watching the page that contains gpa and restores its original
+    /// write access. Does nothing if the page is not watched.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page
+    ///
+    void unwatch(uint64_t gpa);
+
+    /// Is Watched
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page
+    /// @return returns true if the page that contains gpa is watched
+    ///
+    bool is_watched(uint64_t gpa) const;
+
+    /// Set Batching
+    ///
+    /// A page that has taken writes write violations is left writable for
+    /// ticks TSC ticks on its next violation, instead of being single
+    /// stepped. Setting either value to 0 disables batching (the default).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param writes the number of violations after which a page is hot
+    /// @param ticks how long a hot page is left writable
+    ///
+    void set_batching(uint64_t writes, uint64_t ticks) noexcept;
+
+    /// Violations
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of write violations handled
+    ///
+    uint64_t violations() const noexcept
+    { return m_violations; }
+
+    /// Steps
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of monitor trap exits used to re-protect
+    ///     pages
+    ///
+    uint64_t steps() const noexcept
+    { return m_steps; }
+
+    /// Windows
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the number of batching windows that were closed
+    ///
+    uint64_t windows() const noexcept
+    { return m_windows; }
+
+public:
+
+    /// @cond
+
+    bool handle_violation(
+        gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info);
+
+    bool handle_step(
+        gsl::not_null<vmcs_t *> vmcs, monitor_trap_handler::info_t &info);
+
+    bool handle_timer(
+        gsl::not_null<vmcs_t *> vmcs, preemption_timer_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    struct page_t {
+        ept::mmap *map;
+        handler_delegate_t d;
+        uint64_t faults;
+        bool was_writable;
+    };
+
+    void set_writable(uint64_t gfn, const page_t &page, bool writable);
+    void reprotect(std::vector<uint64_t> &gfns);
+
+private:
+
+    gsl::not_null<apis *> m_apis;
+
+    std::unordered_map<uint64_t, page_t> m_pages;
+    std::vector<uint64_t> m_stepping;
+    std::vector<uint64_t> m_window;
+
+    uint64_t m_batch_writes{0};
+    uint64_t m_batch_ticks{0};
+
+    bool m_registered_step{false};
+    bool m_registered_timer{false};
+
+    uint64_t m_violations{0};
+    uint64_t m_steps{0};
+    uint64_t m_windows{0};
+
+public:
+
+    /// @cond
+
+    ept_write_monitor(ept_write_monitor &&) = default;
+    ept_write_monitor &operator=(ept_write_monitor &&) = default;
+
+    ept_write_monitor(const ept_write_monitor &) = delete;
+    ept_write_monitor &operator=(const ept_write_monitor &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
@@ -45,9 +45,29 @@ enable_mtrrs(uint8_t vcnt)
     ::intel_x64::msrs::ia32_mtrr_def_type::type::set(6);
     ::intel_x64::msrs::ia32_mtrr_def_type::mtrr_enable::enable();
 
+    // Fixed ranges are supported and enabled, and set to uncacheable
+    //
+
+    auto cap = ::intel_x64::msrs::get(::x64::msrs::ia32_mtrrcap::addr);
+    ::intel_x64::msrs::set(::x64::msrs::ia32_mtrrcap::addr, cap | 0x100U);
+
+    auto def = ::intel_x64::msrs::get(::intel_x64::msrs::ia32_mtrr_def_type::addr);
+    ::intel_x64::msrs::set(::intel_x64::msrs::ia32_mtrr_def_type::addr, def | 0x400U);
+
+    for (auto addr : {0x250U, 0x258U, 0x259U, 0x268U, 0x269U, 0x26AU, 0x26BU, 0x26CU, 0x26DU, 0x26EU, 0x26FU}) {
+        ::intel_x64::msrs::set(addr, 0U);
+    }
+
     g_eax_cpuid[::x64::cpuid::addr_size::addr] = 43U;
 }
 
+static inline void
+set_fixed_range(uint32_t addr, ept::mmap::memory_type type)
+{
+    auto types = static_cast<uint64_t>(type) * 0x0101010101010101ULL;
+    ::intel_x64::msrs::set(addr, types);
+}
+
 static inline void
 add_variable_range(uint8_t vnum, mtrrs::range_t range, bool disabled = false)
 {
@@ -111,17 +131,59 @@ setup_eapis(MockRepository &mocks)
 
     mocks.OnCall(eapis, apis::set_eptp);
     mocks.OnCall(eapis, apis::disable_ept);
+    mocks.OnCall(eapis, apis::invalidate_ept);
+    mocks.OnCall(eapis, apis::add_ept_view);
+    mocks.OnCall(eapis, apis::set_ept_view);
+    mocks.OnCall(eapis, apis::enable_ept_spp);
+    mocks.OnCall(eapis, apis::disable_ept_spp);
     mocks.OnCall(eapis, apis::enable_vpid);
     mocks.OnCall(eapis, apis::disable_vpid);
+    mocks.OnCall(eapis, apis::set_guest_tsc);
+    mocks.OnCall(eapis, apis::enable_mtrr_pat_virtualization);
+    mocks.OnCall(eapis, apis::gva_to_gpa);
+    mocks.OnCall(eapis, apis::invalidate_guest_memory);
+    mocks.OnCall(eapis, apis::enable_exit_latency);
+    mocks.OnCall(eapis, apis::disable_exit_latency);
+    mocks.OnCall(eapis, apis::exit_latency);
+    mocks.OnCall(eapis, apis::dump_exit_latency);
+    mocks.OnCall(eapis, apis::enable_alloc_tracking);
+    mocks.OnCall(eapis, apis::disable_alloc_tracking);
+    mocks.OnCall(eapis, apis::exit_allocs);
+    mocks.OnCall(eapis, apis::dump_alloc_tracking);
+    mocks.OnCall(eapis, apis::enable_exit_profiler);
+    mocks.OnCall(eapis, apis::disable_exit_profiler);
+    mocks.OnCall(eapis, apis::profiler);
+    mocks.OnCall(eapis, apis::dump_exit_profile);
+    mocks.OnCall(eapis, apis::enable_exit_export);
+    mocks.OnCall(eapis, apis::disable_exit_export);
+    mocks.OnCall(eapis, apis::exported_exits);
+    mocks.OnCall(eapis, apis::dump_vmcs_cache_stats);
+    mocks.OnCall(eapis, apis::set_coalesced_write_handler);
+    mocks.OnCall(eapis, apis::add_coalesced_io_port);
+    mocks.OnCall(eapis, apis::flush_coalesced_writes);
+    mocks.OnCall(eapis, apis::add_io_doorbell);
+    mocks.OnCall(eapis, apis::add_mmio_doorbell);
+    mocks.OnCall(eapis, apis::set_doorbell_wake_target);
+    mocks.OnCall(eapis, apis::set_exit_poll_handler);
+    mocks.OnCall(eapis, apis::remove_exit_poll_handler);
+    mocks.OnCall(eapis, apis::set_unhandled_policy);
     mocks.OnCall(eapis, apis::add_wrcr0_handler);
     mocks.OnCall(eapis, apis::add_rdcr3_handler);
     mocks.OnCall(eapis, apis::add_wrcr3_handler);
+    mocks.OnCall(eapis, apis::require_wrcr3_exits);
     mocks.OnCall(eapis, apis::add_wrcr4_handler);
     mocks.OnCall(eapis, apis::add_cpuid_handler);
+    mocks.OnCall(eapis, apis::add_cpuid_subleaf_handler);
     mocks.OnCall(eapis, apis::add_ept_misconfiguration_handler);
+    mocks.OnCall(eapis, apis::enable_mmio_fast_path);
     mocks.OnCall(eapis, apis::add_ept_read_violation_handler);
     mocks.OnCall(eapis, apis::add_ept_write_violation_handler);
     mocks.OnCall(eapis, apis::add_ept_execute_violation_handler);
+    mocks.OnCall(eapis, apis::add_ept_page_violation_handler);
+    mocks.OnCall(eapis, apis::remove_ept_page_violation_handlers);
+    mocks.OnCall(eapis, apis::add_ept_spp_handler);
+    mocks.OnCall(eapis, apis::watch_ept_writes);
+    mocks.OnCall(eapis, apis::unwatch_ept_writes);
     mocks.OnCall(eapis, apis::add_external_interrupt_handler);
     mocks.OnCall(eapis, apis::disable_external_interrupts);
     mocks.OnCall(eapis, apis::trap_on_next_interrupt_window);
@@ -129,19 +191,56 @@ setup_eapis(MockRepository &mocks)
     mocks.OnCall(eapis, apis::add_interrupt_window_handler);
     mocks.OnCall(eapis, apis::is_interrupt_window_open);
     mocks.OnCall(eapis, apis::inject_external_interrupt);
+    mocks.OnCall(eapis, apis::queue_external_interrupt);
+    mocks.OnCall(eapis, apis::enable_virtual_apic);
+    mocks.OnCall(eapis, apis::enable_posted_interrupts);
+    mocks.OnCall(eapis, apis::post_interrupt);
+    mocks.OnCall(eapis, apis::add_ipi_handler);
+    mocks.OnCall(eapis, apis::add_ipi_target);
+    mocks.OnCall(eapis, apis::enable_pml);
+    mocks.OnCall(eapis, apis::disable_pml);
+    mocks.OnCall(eapis, apis::add_pml_handler);
+    mocks.OnCall(eapis, apis::drain_pml);
+    mocks.OnCall(eapis, apis::enable_nested_vmx);
+    mocks.OnCall(eapis, apis::disable_nested_vmx);
+    mocks.OnCall(eapis, apis::add_nested_vmx_handler);
     mocks.OnCall(eapis, apis::add_io_instruction_handler);
+    mocks.OnCall(eapis, apis::add_io_string_handler);
     mocks.OnCall(eapis, apis::trap_all_io_instruction_accesses);
     mocks.OnCall(eapis, apis::pass_through_all_io_instruction_accesses);
+    mocks.OnCall(eapis, apis::trap_io_instruction_range);
+    mocks.OnCall(eapis, apis::pass_through_io_instruction_range);
     mocks.OnCall(eapis, apis::add_monitor_trap_handler);
     mocks.OnCall(eapis, apis::enable_monitor_trap_flag);
+    mocks.OnCall(eapis, apis::enable_processor_trace);
     mocks.OnCall(eapis, apis::add_mov_dr_handler);
+    mocks.OnCall(eapis, apis::add_hlt_handler);
+    mocks.OnCall(eapis, apis::enable_hlt_exiting);
+    mocks.OnCall(eapis, apis::add_pause_handler);
+    mocks.OnCall(eapis, apis::enable_pause_loop_exiting);
+    mocks.OnCall(eapis, apis::add_preemption_timer_handler);
+    mocks.OnCall(eapis, apis::arm_preemption_timer);
+    mocks.OnCall(eapis, apis::arm_preemption_deadline);
+    mocks.OnCall(eapis, apis::disarm_preemption_timer);
     mocks.OnCall(eapis, apis::trap_all_rdmsr_accesses);
     mocks.OnCall(eapis, apis::pass_through_all_rdmsr_accesses);
+    mocks.OnCall(eapis, apis::trap_rdmsr_range);
+    mocks.OnCall(eapis, apis::pass_through_rdmsr_range);
     mocks.OnCall(eapis, apis::add_rdmsr_handler);
+    mocks.OnCall(eapis, apis::add_rdmsr_constant);
     mocks.OnCall(eapis, apis::trap_all_wrmsr_accesses);
     mocks.OnCall(eapis, apis::pass_through_all_wrmsr_accesses);
+    mocks.OnCall(eapis, apis::trap_wrmsr_range);
+    mocks.OnCall(eapis, apis::pass_through_wrmsr_range);
     mocks.OnCall(eapis, apis::add_wrmsr_handler);
+    mocks.OnCall(eapis, apis::add_wrmsr_mask);
+    mocks.OnCall(eapis, apis::add_switched_msr);
+    mocks.OnCall(eapis, apis::remove_switched_msr);
     mocks.OnCall(eapis, apis::add_xsetbv_handler);
+    mocks.OnCall(eapis, apis::add_vmcall_handler);
+    mocks.OnCall(eapis, apis::enable_stats_vmcall);
+    mocks.OnCall(eapis, apis::memory_usage).Return({});
+    mocks.OnCall(eapis, apis::dump_memory_usage);
     mocks.OnCall(eapis, apis::add_handler);
 
     return eapis;
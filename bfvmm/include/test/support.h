@@ -16,6 +16,13 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
+// TIDY_EXCLUSION=-cppcoreguidelines-owning-memory
+//
+// Reason:
+//     The operator new / delete overloads below are used to count the number
+//     of allocations the tests make, and are not owners.
+//
+
 #ifndef EAPIS_TEST_SUPPORT_H
 #define EAPIS_TEST_SUPPORT_H
 
@@ -24,6 +31,52 @@
 
 #include "hve.h"
 
+#include <new>
+#include <cstdlib>
+
+// Every allocation made by a test is recorded (see alloc_counter), so
+// that tests (and the benchmarks) can check that the exit path does not
+// allocate, either directly (see count_allocations()) or through
+// exit_dispatch_table::set_allocs()
+//
+
+void *
+operator new(std::size_t size)
+{
+    eapis::intel_x64::alloc_counter::record();
+
+    if (auto ptr = malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *ptr) noexcept
+{ free(ptr); }
+
+void
+operator delete(void *ptr, std::size_t size) noexcept
+{
+    bfignored(size);
+    free(ptr);
+}
+
+/// Count Allocations
+///
+/// @param func the code to count the heap allocations of
+/// @return returns the number of heap allocations func made
+///
+template<typename F>
+uint64_t count_allocations(F &&func)
+{
+    auto before = eapis::intel_x64::alloc_counter::count();
+    func();
+
+    return eapis::intel_x64::alloc_counter::count() - before;
+}
+
 void setup_eapis_test_support()
 {
 #ifdef BF_INTEL_X64
@@ -0,0 +1,146 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfvmm/vcpu/vcpu_factory.h>
+#include <eapis/hve/arch/intel_x64/vcpu.h>
+
+// -----------------------------------------------------------------------------
+// Exit Cost Benchmark
+//
+// Traps the exits issued by the userspace exit_bench driver (bfbench), and
+// handles them as cheaply as the APIs allow, so that the round trip measured
+// by the driver is the cost of the exit plus the cost of the APIs. The exit
+// latency histograms are dumped when the vCPU is destroyed, which splits the
+// round trip into the time spent in the handlers and the time spent
+// everywhere else (hardware and base hypervisor).
+//
+// Note: the leaf, MSR and port used here must match bfbench/exit_bench.cpp
+// -----------------------------------------------------------------------------
+
+using namespace eapis::intel_x64;
+
+constexpr const auto bench_leaf = 0xBFBE0000ULL;
+constexpr const auto bench_msr = 0x000000FEULL;        // IA32_MTRRCAP
+constexpr const auto bench_port = 0x80ULL;              // POST code
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+bench_cpuid_handler(
+    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.rax = 42;
+    info.rbx = 0;
+    info.rcx = 0;
+    info.rdx = 0;
+
+    return true;
+}
+
+bool
+bench_rdmsr_handler(
+    gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info)
+{ bfignored(vmcs); bfignored(info); return true; }
+
+bool
+bench_io_handler(
+    gsl::not_null<vmcs_t *> vmcs, io_instruction_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.val = 0;
+    info.ignore_write = true;
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// vCPU
+// -----------------------------------------------------------------------------
+
+namespace test
+{
+
+class vcpu : public eapis::intel_x64::vcpu
+{
+public:
+
+    /// Default Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    explicit vcpu(vcpuid::type id) :
+        eapis::intel_x64::vcpu{id}
+    {
+        eapis()->add_cpuid_handler(
+            bench_leaf, cpuid_handler::handler_delegate_t::create<bench_cpuid_handler>()
+        );
+
+        eapis()->add_rdmsr_handler(
+            bench_msr, rdmsr_handler::handler_delegate_t::create<bench_rdmsr_handler>()
+        );
+
+        eapis()->add_io_instruction_handler(
+            bench_port,
+            io_instruction_handler::handler_delegate_t::create<bench_io_handler>(),
+            io_instruction_handler::handler_delegate_t::create<bench_io_handler>()
+        );
+
+        eapis()->enable_exit_latency();
+    }
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vcpu() override
+    { eapis()->dump_exit_latency(); }
+
+    /// @cond
+
+    vcpu(vcpu &&) = delete;
+    vcpu &operator=(vcpu &&) = delete;
+    vcpu(const vcpu &) = delete;
+    vcpu &operator=(const vcpu &) = delete;
+
+    /// @endcond
+};
+
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Factory
+// -----------------------------------------------------------------------------
+
+namespace bfvmm
+{
+
+std::unique_ptr<vcpu>
+vcpu_factory::make(vcpuid::type vcpuid, bfobject *obj)
+{
+    bfignored(obj);
+    return std::make_unique<test::vcpu>(vcpuid);
+}
+
+}
@@ -88,6 +88,7 @@ public:
             auto gpa1 = bfvmm::x64::virt_to_phys_with_cr3(buffer1.data(), cr3);
             auto gpa2 = bfvmm::x64::virt_to_phys_with_cr3(buffer2.data(), cr3);
 
+            auto gpa1_1g = bfn::upper(gpa1, ::intel_x64::ept::pdpt::from);
             auto gpa1_2m = bfn::upper(gpa1, ::intel_x64::ept::pd::from);
             auto gpa1_4k = bfn::upper(gpa1, ::intel_x64::ept::pt::from);
             auto gpa2_4k = bfn::upper(gpa2, ::intel_x64::ept::pt::from);
@@ -97,6 +98,17 @@ public:
                 MAX_PHYS_ADDR
             );
 
+            // identity_map() uses 1g pages wherever the MTRRs allow it, so
+            // the page may have to be split twice
+            //
+
+            if (g_guest_map.is_1g(gpa1_1g)) {
+                ept::identity_map_convert_1g_to_2m(
+                    g_guest_map,
+                    gpa1_1g
+                );
+            }
+
             ept::identity_map_convert_2m_to_4k(
                 g_guest_map,
                 gpa1_2m
@@ -88,6 +88,7 @@ hyp_src=$2
 config=$3
 vmm_bin_dir=$build_dir/prefixes/x86_64-vmm-elf/bin
 bfm=$build_dir/prefixes/x86_64-userspace-elf/bin/bfm
+exit_bench=$build_dir/prefixes/x86_64-userspace-elf/bin/exit_bench
 
 #
 # Helpers
@@ -191,6 +192,20 @@ check_phys_pci()
     return 0
 }
 
+check_bench()
+{
+    local exit_count=$(grep "cycles/exit" bench.out | wc -l)
+
+    if [[ $exit_count -eq 0 ]];
+    then
+        echo_fail "observed $exit_count exit costs; expected at least one"
+        echo ""
+        die_or_fall_through; return 0
+    fi
+
+    return 0
+}
+
 check_vic()
 {
     local spurious_count=$(dmesg | grep -i "spurious" | wc -l)
@@ -397,6 +412,7 @@ check_test()
         *_x64_vic*) check_vic;;
         *_x64_vpid*) check_vpid;;
         *_x64_phys_pci*) check_phys_pci;;
+        *_x64_bench*) check_bench;;
         *)
             echo ""
             echo -ne "$bold_yellow"
@@ -424,6 +440,26 @@ init_test()
     esac
 }
 
+#
+# Test runners
+#
+
+run_bench()
+{
+    echo ""
+    sudo $exit_bench | tee bench.out
+}
+
+run_test()
+{
+    local vmm=$1
+
+    case $vmm in
+        *_x64_bench*) run_bench;;
+        *) sleep 1;;
+    esac
+}
+
 #
 # Prettify the test names
 #
@@ -469,7 +505,7 @@ do
 
     sudo $bfm load $vmm
     sudo $bfm start
-    sleep 1
+    run_test $vmm
     sudo $bfm stop
     sudo $bfm dump > serial.out
 
@@ -478,7 +514,7 @@ do
 
     if [[ $option_keep_dumps -eq 0 ]]
     then
-        rm -f serial.out
+        rm -f serial.out bench.out
     else
         mv -f serial.out "serial_$(parse_test_name $vmm).out"
     fi
@@ -31,39 +31,19 @@ apis::apis(
     m_vmcs{vmcs},
     m_exit_handler{exit_handler},
 
-    m_msr_bitmap{static_cast<uint8_t *>(alloc_page()), free_page},
-    m_io_bitmap_a{static_cast<uint8_t *>(alloc_page()), free_page},
-    m_io_bitmap_b{static_cast<uint8_t *>(alloc_page()), free_page},
-
-    m_control_register_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_cpuid_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_io_instruction_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_monitor_trap_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_mov_dr_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_rdmsr_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_wrmsr_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_xsetbv_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-
-    m_ept_misconfiguration_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_ept_violation_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_external_interrupt_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_init_signal_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_interrupt_window_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_sipi_signal_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-
-    m_ept_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_microcode_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()},
-    m_vpid_handler{this, eapis_vcpu_state->eapis_vcpu_global_state()}
+    m_eapis_vcpu_global_state{eapis_vcpu_state->eapis_vcpu_global_state()},
+    m_bitmaps{m_eapis_vcpu_global_state->shared_bitmaps},
+
+    m_control_register_handler{this, m_eapis_vcpu_global_state},
+    m_cpuid_handler{this, m_eapis_vcpu_global_state},
+    m_rdmsr_handler{this, m_eapis_vcpu_global_state},
+    m_wrmsr_handler{this, m_eapis_vcpu_global_state},
+    m_init_signal_handler{this, m_eapis_vcpu_global_state},
+    m_sipi_signal_handler{this, m_eapis_vcpu_global_state},
+    m_microcode_handler{this, m_eapis_vcpu_global_state},
+    m_vpid_handler{this, m_eapis_vcpu_global_state}
 {
-    using namespace vmcs_n;
-
-    address_of_msr_bitmap::set(g_mm->virtptr_to_physint(m_msr_bitmap.get()));
-    address_of_io_bitmap_a::set(g_mm->virtptr_to_physint(m_io_bitmap_a.get()));
-    address_of_io_bitmap_b::set(g_mm->virtptr_to_physint(m_io_bitmap_b.get()));
-
-    primary_processor_based_vm_execution_controls::use_msr_bitmap::enable();
-    primary_processor_based_vm_execution_controls::use_io_bitmaps::enable();
-
+    m_exit_dispatch_table.set_vmcs_cache(&m_vmcs_cache);
     this->enable_vpid();
 }
 
@@ -77,15 +57,79 @@ apis::apis(
 
 gsl::not_null<ept_handler *>
 apis::ept()
-{ return &m_ept_handler; }
+{ return lazy_handler(m_ept_handler); }
 
 void
-apis::set_eptp(ept::mmap &map)
-{ m_ept_handler.set_eptp(&map); }
+apis::set_eptp(ept::mmap &map, bool accessed_and_dirty)
+{
+    this->release_cached_controls();
+    this->ept()->set_eptp(&map, accessed_and_dirty);
+    this->enable_ept_resume();
+
+    if (m_guest_memory) {
+        m_guest_memory->set_ept(&map);
+    }
+}
 
 void
 apis::disable_ept()
-{ m_ept_handler.set_eptp(nullptr); }
+{
+    this->release_cached_controls();
+    this->ept()->set_eptp(nullptr);
+    m_exit_dispatch_table.set_resume(nullptr);
+
+    if (m_guest_memory) {
+        m_guest_memory->set_ept(nullptr);
+    }
+}
+
+void
+apis::invalidate_ept(bool force)
+{ this->ept()->invalidate(force); }
+
+void
+apis::enable_ept_resume()
+{
+    m_ept_resume = exit_poll_delegate_t::create<apis, &apis::resume_ept>(this);
+    m_exit_dispatch_table.set_resume(&m_ept_resume);
+}
+
+void
+apis::resume_ept(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+    this->invalidate_ept();
+}
+
+std::size_t
+apis::add_ept_view(ept::mmap &map)
+{ return this->ept()->add_view(map); }
+
+void
+apis::set_ept_view(std::size_t index)
+{
+    this->release_cached_controls();
+    this->ept()->set_view(index);
+    this->enable_ept_resume();
+
+    if (m_guest_memory) {
+        m_guest_memory->set_ept(this->ept()->map());
+    }
+}
+
+void
+apis::enable_ept_spp()
+{
+    this->release_cached_controls();
+    this->ept()->enable_spp();
+}
+
+void
+apis::disable_ept_spp()
+{
+    this->release_cached_controls();
+    this->ept()->disable_spp();
+}
 
 //--------------------------------------------------------------------------
 // VPID
@@ -97,11 +141,604 @@ apis::vpid()
 
 void
 apis::enable_vpid()
-{ m_vpid_handler.enable(); }
+{
+    this->release_cached_controls();
+    m_vpid_handler.enable();
+}
 
 void
 apis::disable_vpid()
-{ m_vpid_handler.disable(); }
+{
+    this->release_cached_controls();
+    m_vpid_handler.disable();
+}
+
+//--------------------------------------------------------------------------
+// TSC
+//--------------------------------------------------------------------------
+
+gsl::not_null<tsc_handler *>
+apis::tsc()
+{ return lazy_handler(m_tsc_handler); }
+
+void
+apis::set_guest_tsc(uint64_t val)
+{ this->tsc()->set_guest_tsc(val, __builtin_ia32_rdtsc()); }
+
+//--------------------------------------------------------------------------
+// MTRR / PAT
+//--------------------------------------------------------------------------
+
+gsl::not_null<mtrr_pat_handler *>
+apis::mtrr_pat()
+{ return lazy_handler(m_mtrr_pat_handler); }
+
+void
+apis::enable_mtrr_pat_virtualization(
+    ept::mmap &map, uint64_t size, const ept::memory_type_overrides *overrides)
+{ this->mtrr_pat()->enable(map, size, overrides); }
+
+//--------------------------------------------------------------------------
+// Guest Walker
+//--------------------------------------------------------------------------
+
+gsl::not_null<guest_walker *>
+apis::page_walker()
+{
+    if (!m_guest_walker && m_guest_memory) {
+        m_guest_memory->set_walker(lazy_handler(m_guest_walker));
+    }
+
+    return lazy_handler(m_guest_walker);
+}
+
+uint64_t
+apis::gva_to_gpa(uint64_t gva)
+{ return this->page_walker()->gva_to_gpa(gva); }
+
+//--------------------------------------------------------------------------
+// Guest Memory
+//--------------------------------------------------------------------------
+
+gsl::not_null<guest_memory *>
+apis::memory()
+{
+    // Note
+    //
+    // The guest page walker is only used if something else has already
+    // created it, as creating it traps INVLPG and CR3 writes. Without it,
+    // guest linear addresses are walked on every miss.
+    //
+
+    if (!m_guest_memory) {
+        auto mem = lazy_handler(m_guest_memory);
+
+        if (m_guest_walker) {
+            mem->set_walker(m_guest_walker.get());
+        }
+
+        if (m_ept_handler) {
+            mem->set_ept(m_ept_handler->map());
+        }
+    }
+
+    return m_guest_memory.get();
+}
+
+void
+apis::invalidate_guest_memory(uint64_t gpa, uint64_t size)
+{ this->memory()->invalidate(gpa, size); }
+
+//--------------------------------------------------------------------------
+// Bitmaps
+//--------------------------------------------------------------------------
+
+gsl::not_null<vcpu_bitmaps *>
+apis::bitmaps()
+{ return &m_bitmaps; }
+
+//--------------------------------------------------------------------------
+// Exit Latency
+//--------------------------------------------------------------------------
+
+void
+apis::enable_exit_latency()
+{
+    if (m_exit_latencies) {
+        return;
+    }
+
+    m_exit_latencies = std::make_unique<exit_latencies_t>();
+    m_exit_dispatch_table.set_latencies(m_exit_latencies->data());
+}
+
+void
+apis::disable_exit_latency()
+{
+    m_exit_dispatch_table.set_latencies(nullptr);
+    m_exit_latencies.reset();
+}
+
+const exit_latency_t *
+apis::exit_latency(::intel_x64::vmcs::value_type reason) const
+{
+    if (!m_exit_latencies || reason >= num_timed_exit_reasons) {
+        return nullptr;
+    }
+
+    return &m_exit_latencies->at(reason);
+}
+
+void
+apis::dump_exit_latency()
+{
+    if (!m_exit_latencies) {
+        return;
+    }
+
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "exit latency (cycles)", msg);
+        bfdebug_brk2(0, msg);
+
+        for (auto i = 0U; i < num_timed_exit_reasons; i++) {
+            const auto &latency = m_exit_latencies->at(i);
+
+            if (latency.count == 0) {
+                continue;
+            }
+
+            bfdebug_info(0, ("exit reason " + std::to_string(i)).c_str(), msg);
+            bfdebug_subnhex(0, "count", latency.count, msg);
+            bfdebug_subnhex(0, "average", latency.total / latency.count, msg);
+            bfdebug_subnhex(0, "max", latency.max, msg);
+
+            for (auto b = 0U; b < latency.buckets.size(); b++) {
+                if (latency.buckets.at(b) > 0U) {
+                    auto name = "< 2^" + std::to_string(b + 1);
+                    bfdebug_subnhex(0, name.c_str(), latency.buckets.at(b), msg);
+                }
+            }
+        }
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+//--------------------------------------------------------------------------
+// Allocation Tracking
+//--------------------------------------------------------------------------
+
+void
+apis::enable_alloc_tracking(bool assert_none)
+{
+    if (!m_exit_allocs) {
+        m_exit_allocs = std::make_unique<exit_allocs_array_t>();
+    }
+
+    m_exit_dispatch_table.set_allocs(m_exit_allocs->data(), assert_none);
+}
+
+void
+apis::disable_alloc_tracking()
+{
+    m_exit_dispatch_table.set_allocs(nullptr);
+    m_exit_allocs.reset();
+}
+
+const exit_allocs_t *
+apis::exit_allocs(::intel_x64::vmcs::value_type reason) const
+{
+    if (!m_exit_allocs || reason >= num_timed_exit_reasons) {
+        return nullptr;
+    }
+
+    return &m_exit_allocs->at(reason);
+}
+
+void
+apis::dump_alloc_tracking()
+{
+    if (!m_exit_allocs) {
+        return;
+    }
+
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "exit allocations", msg);
+        bfdebug_brk2(0, msg);
+
+        for (auto i = 0U; i < num_timed_exit_reasons; i++) {
+            const auto &allocs = m_exit_allocs->at(i);
+
+            if (allocs.allocations == 0) {
+                continue;
+            }
+
+            bfdebug_info(0, ("exit reason " + std::to_string(i)).c_str(), msg);
+            bfdebug_subnhex(0, "exits", allocs.exits, msg);
+            bfdebug_subnhex(0, "allocating exits", allocs.allocating_exits, msg);
+            bfdebug_subnhex(0, "allocations", allocs.allocations, msg);
+            bfdebug_subnhex(0, "max", allocs.max, msg);
+        }
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+//--------------------------------------------------------------------------
+// Exit Profiler
+//--------------------------------------------------------------------------
+
+void
+apis::enable_exit_profiler(uint64_t rate)
+{
+    if (m_exit_profiler) {
+        return m_exit_profiler->set_rate(rate);
+    }
+
+    m_exit_profiler = std::make_unique<exit_profiler<>>(rate);
+    m_exit_dispatch_table.set_profiler(m_exit_profiler.get());
+}
+
+void
+apis::disable_exit_profiler()
+{
+    m_exit_dispatch_table.set_profiler(nullptr);
+    m_exit_profiler.reset();
+}
+
+exit_profiler<> *
+apis::profiler()
+{ return m_exit_profiler.get(); }
+
+void
+apis::dump_exit_profile(std::size_t n)
+{
+    if (!m_exit_profiler) {
+        return;
+    }
+
+    auto hotspots = m_exit_profiler->top(n);
+
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "exit profile", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subnhex(0, "exits", m_exit_profiler->exits(), msg);
+        bfdebug_subnhex(0, "samples", m_exit_profiler->taken(), msg);
+        bfdebug_subnhex(0, "rate", m_exit_profiler->rate(), msg);
+
+        for (const auto &hotspot : hotspots) {
+            bfdebug_info(0, ("exit reason " + std::to_string(hotspot.sample.reason)).c_str(), msg);
+            bfdebug_subnhex(0, "rip", hotspot.sample.rip, msg);
+            bfdebug_subnhex(0, "cr3", hotspot.sample.cr3, msg);
+            bfdebug_subnhex(0, "count", hotspot.count, msg);
+        }
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+//--------------------------------------------------------------------------
+// Exit Export
+//--------------------------------------------------------------------------
+
+void
+apis::enable_exit_export(std::size_t num_pages)
+{
+    if (m_exit_export) {
+        return;
+    }
+
+    m_exit_export = std::make_unique<exit_export>(num_timed_exit_reasons, num_pages);
+    m_exit_dispatch_table.set_export(m_exit_export.get());
+}
+
+void
+apis::disable_exit_export()
+{
+    m_exit_dispatch_table.set_export(nullptr);
+    m_exit_export.reset();
+}
+
+exit_export *
+apis::exported_exits()
+{ return m_exit_export.get(); }
+
+//--------------------------------------------------------------------------
+// VMCS Cache
+//--------------------------------------------------------------------------
+
+gsl::not_null<vmcs_field_cache<> *>
+apis::vmcs_cache()
+{ return &m_vmcs_cache; }
+
+void
+apis::dump_vmcs_cache_stats()
+{
+    const auto exits = std::max<uint64_t>(m_vmcs_cache.exits(), 1);
+
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "vmcs cache", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subnhex(0, "exits", m_vmcs_cache.exits(), msg);
+        bfdebug_subnhex(0, "reads", m_vmcs_cache.reads(), msg);
+        bfdebug_subnhex(0, "vmreads", m_vmcs_cache.vmreads(), msg);
+        bfdebug_subnhex(0, "vmreads per exit", m_vmcs_cache.vmreads() / exits, msg);
+        bfdebug_subnhex(0, "writes", m_vmcs_cache.writes(), msg);
+        bfdebug_subnhex(0, "vmwrites", m_vmcs_cache.vmwrites(), msg);
+        bfdebug_subnhex(0, "vmwrites per exit", m_vmcs_cache.vmwrites() / exits, msg);
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+void
+apis::release_cached_controls()
+{
+    using namespace vmcs_n;
+
+    m_vmcs_cache.release(pin_based_vm_execution_controls::addr);
+    m_vmcs_cache.release(primary_processor_based_vm_execution_controls::addr);
+    m_vmcs_cache.release(secondary_processor_based_vm_execution_controls::addr);
+    m_vmcs_cache.release(vm_exit_controls::addr);
+    m_vmcs_cache.release(vm_entry_controls::addr);
+    m_vmcs_cache.release(ept_pointer::addr);
+}
+
+//--------------------------------------------------------------------------
+// Coalesced Writes
+//--------------------------------------------------------------------------
+
+gsl::not_null<coalesced_ring<> *>
+apis::coalesced_writes()
+{ return &m_coalesced_writes; }
+
+void
+apis::set_coalesced_write_handler(const coalesced_ring<>::flush_delegate_t &d)
+{ m_coalesced_writes.set_flush_handler(d); }
+
+void
+apis::add_coalesced_io_port(vmcs_n::value_type port)
+{
+    this->io_instruction()->trap_on_access(port);
+    this->io_instruction()->add_coalesced_port(port);
+}
+
+void
+apis::flush_coalesced_writes()
+{ m_coalesced_writes.flush(); }
+
+//--------------------------------------------------------------------------
+// Doorbells
+//--------------------------------------------------------------------------
+
+gsl::not_null<doorbell_bitmap<> *>
+apis::doorbells()
+{ return &m_doorbells; }
+
+void
+apis::add_io_doorbell(vmcs_n::value_type port, uint64_t val, uint64_t bit)
+{
+    this->io_instruction()->trap_on_access(port);
+    this->io_instruction()->add_doorbell(port, val, bit);
+}
+
+void
+apis::add_mmio_doorbell(uint64_t gpa, uint64_t val, uint64_t bit)
+{ this->ept_violation()->add_doorbell(gpa, val, bit); }
+
+void
+apis::set_doorbell_wake_target(
+    gsl::not_null<posted_interrupt_handler *> target, uint64_t vector)
+{
+    m_doorbell_target = target;
+    m_doorbell_vector = vector;
+
+    m_doorbells.set_wake_handler(
+        doorbell_bitmap<>::wake_delegate_t::create<apis, &apis::wake_doorbell>(this)
+    );
+}
+
+void
+apis::wake_doorbell(uint64_t bit)
+{
+    bfignored(bit);
+    m_doorbell_target->post(m_doorbell_vector);
+}
+
+//--------------------------------------------------------------------------
+// Exit Poll
+//--------------------------------------------------------------------------
+
+void
+apis::set_exit_poll_handler(const exit_poll_delegate_t &d)
+{
+    m_exit_poll = d;
+    m_exit_dispatch_table.set_poll(&m_exit_poll);
+}
+
+void
+apis::remove_exit_poll_handler()
+{ m_exit_dispatch_table.set_poll(nullptr); }
+
+//--------------------------------------------------------------------------
+// Memory Usage
+//--------------------------------------------------------------------------
+
+template<typename T> static void
+account(const T &object, memory_usage_t &usage)
+{
+    if constexpr (std::is_base_of<base, T>::value) {
+        auto logs = usage.logs;
+        object.memory_usage(usage);
+
+        // The handler reports its logs on their own, but they are also
+        // part of its size, which the caller has already counted.
+        //
+        usage.handlers -= usage.logs - logs;
+    }
+    else {
+        bfignored(object);
+        bfignored(usage);
+    }
+}
+
+template<typename T> static void
+account(const std::unique_ptr<T> &object, memory_usage_t &usage)
+{
+    if (object) {
+        usage.handlers += sizeof(T);
+        account(*object, usage);
+    }
+}
+
+memory_usage_t
+apis::memory_usage()
+{
+    memory_usage_t usage{};
+
+    // The handlers held by value are part of the apis
+    //
+    usage.handlers += sizeof(apis);
+    usage.handlers += m_exit_dispatch_table.heap_bytes();
+
+    account(m_control_register_handler, usage);
+    account(m_cpuid_handler, usage);
+    account(m_rdmsr_handler, usage);
+    account(m_wrmsr_handler, usage);
+    account(m_init_signal_handler, usage);
+    account(m_sipi_signal_handler, usage);
+    account(m_microcode_handler, usage);
+    account(m_vpid_handler, usage);
+
+    account(m_io_instruction_handler, usage);
+    account(m_monitor_trap_handler, usage);
+    account(m_mov_dr_handler, usage);
+    account(m_hlt_handler, usage);
+    account(m_pause_handler, usage);
+    account(m_preemption_timer_handler, usage);
+    account(m_xsetbv_handler, usage);
+    account(m_ept_misconfiguration_handler, usage);
+    account(m_ept_violation_handler, usage);
+    account(m_external_interrupt_handler, usage);
+    account(m_interrupt_window_handler, usage);
+    account(m_ipi_handler, usage);
+    account(m_pml_handler, usage);
+    account(m_nested_vmx_handler, usage);
+    account(m_virtual_apic_handler, usage);
+    account(m_posted_interrupt_handler, usage);
+    account(m_processor_trace_handler, usage);
+    account(m_tsc_handler, usage);
+    account(m_mtrr_pat_handler, usage);
+    account(m_guest_walker, usage);
+    account(m_guest_memory, usage);
+    account(m_msr_lists, usage);
+    account(m_write_monitor, usage);
+    account(m_vmcall_handler, usage);
+    account(m_stats_service, usage);
+    account(m_ept_handler, usage);
+
+    m_bitmaps.memory_usage(usage);
+
+    if (m_ept_handler) {
+        m_ept_handler->memory_usage(usage);
+    }
+
+    if (m_exit_latencies) {
+        usage.telemetry += sizeof(exit_latencies_t);
+    }
+
+    if (m_exit_allocs) {
+        usage.telemetry += sizeof(exit_allocs_array_t);
+    }
+
+    if (m_exit_profiler) {
+        usage.telemetry += sizeof(exit_profiler<>);
+    }
+
+    if (m_exit_export) {
+        usage.telemetry += sizeof(exit_export);
+        usage.telemetry += (m_exit_export->ring().header()->num_pages + 2U) * 0x1000U;
+    }
+
+    return usage;
+}
+
+void
+apis::dump_memory_usage()
+{
+    const auto usage = this->memory_usage();
+
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "eapis memory usage (bytes)", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subnhex(0, "bitmaps", usage.bitmaps, msg);
+        bfdebug_subnhex(0, "shared bitmaps", usage.shared_bitmaps, msg);
+        bfdebug_subnhex(0, "ept pml4", usage.ept_tables.at(3), msg);
+        bfdebug_subnhex(0, "ept pdpt", usage.ept_tables.at(2), msg);
+        bfdebug_subnhex(0, "ept pd", usage.ept_tables.at(1), msg);
+        bfdebug_subnhex(0, "ept pt", usage.ept_tables.at(0), msg);
+        bfdebug_subnhex(0, "ept other", usage.ept_other, msg);
+        bfdebug_subnhex(0, "handlers", usage.handlers, msg);
+        bfdebug_subnhex(0, "logs", usage.logs, msg);
+        bfdebug_subnhex(0, "telemetry", usage.telemetry, msg);
+        bfdebug_brk2(0, msg);
+        bfdebug_subnhex(0, "total", usage.total(), msg);
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+//--------------------------------------------------------------------------
+// Unhandled Exits
+//--------------------------------------------------------------------------
+
+template<typename T> static void
+set_policy(std::unique_ptr<T> &handler, unhandled_policy policy)
+{
+    if (handler) {
+        handler->set_unhandled_policy(policy);
+    }
+}
+
+void
+apis::set_unhandled_policy(unhandled_policy policy)
+{
+    m_unhandled_policy = policy;
+
+    m_control_register_handler.set_unhandled_policy(policy);
+    m_cpuid_handler.set_unhandled_policy(policy);
+    m_rdmsr_handler.set_unhandled_policy(policy);
+    m_wrmsr_handler.set_unhandled_policy(policy);
+    m_init_signal_handler.set_unhandled_policy(policy);
+    m_sipi_signal_handler.set_unhandled_policy(policy);
+    m_microcode_handler.set_unhandled_policy(policy);
+
+    set_policy(m_io_instruction_handler, policy);
+    set_policy(m_monitor_trap_handler, policy);
+    set_policy(m_mov_dr_handler, policy);
+    set_policy(m_hlt_handler, policy);
+    set_policy(m_pause_handler, policy);
+    set_policy(m_preemption_timer_handler, policy);
+    set_policy(m_xsetbv_handler, policy);
+    set_policy(m_ept_misconfiguration_handler, policy);
+    set_policy(m_ept_violation_handler, policy);
+    set_policy(m_external_interrupt_handler, policy);
+    set_policy(m_interrupt_window_handler, policy);
+    set_policy(m_ipi_handler, policy);
+    set_policy(m_pml_handler, policy);
+    set_policy(m_nested_vmx_handler, policy);
+    set_policy(m_tsc_handler, policy);
+    set_policy(m_mtrr_pat_handler, policy);
+    set_policy(m_guest_walker, policy);
+}
 
 //==========================================================================
 // VMExit
@@ -120,8 +757,7 @@ apis::add_wrcr0_handler(
     vmcs_n::value_type mask,
     const control_register_handler::handler_delegate_t &d)
 {
-    m_control_register_handler.add_wrcr0_handler(d);
-    m_control_register_handler.enable_wrcr0_exiting(mask);
+    m_control_register_handler.add_wrcr0_handler(mask, d);
 }
 
 void
@@ -140,13 +776,16 @@ apis::add_wrcr3_handler(
     m_control_register_handler.enable_wrcr3_exiting();
 }
 
+void
+apis::require_wrcr3_exits()
+{ m_control_register_handler.require_wrcr3_exits(); }
+
 void
 apis::add_wrcr4_handler(
     vmcs_n::value_type mask,
     const control_register_handler::handler_delegate_t &d)
 {
-    m_control_register_handler.add_wrcr4_handler(d);
-    m_control_register_handler.enable_wrcr4_exiting(mask);
+    m_control_register_handler.add_wrcr4_handler(mask, d);
 }
 
 //--------------------------------------------------------------------------
@@ -162,18 +801,36 @@ apis::add_cpuid_handler(
     cpuid_handler::leaf_t leaf, const cpuid_handler::handler_delegate_t &d)
 { m_cpuid_handler.add_handler(leaf, std::move(d)); }
 
+void
+apis::add_cpuid_subleaf_handler(
+    cpuid_handler::leaf_t leaf, cpuid_handler::subleaf_t subleaf,
+    const cpuid_handler::handler_delegate_t &d)
+{ m_cpuid_handler.add_handler(leaf, subleaf, d); }
+
 //--------------------------------------------------------------------------
 // EPT Misconfiguration
 //--------------------------------------------------------------------------
 
 gsl::not_null<ept_misconfiguration_handler *>
 apis::ept_misconfiguration()
-{ return &m_ept_misconfiguration_handler; }
+{ return lazy_handler(m_ept_misconfiguration_handler); }
 
 void
 apis::add_ept_misconfiguration_handler(
     const ept_misconfiguration_handler::handler_delegate_t &d)
-{ m_ept_misconfiguration_handler.add_handler(d); }
+{ this->ept_misconfiguration()->add_handler(d); }
+
+void
+apis::enable_mmio_fast_path()
+{
+    using mmio_delegate_t = ept_misconfiguration_handler::mmio_delegate_t;
+
+    this->ept_misconfiguration()->set_mmio_handler(
+        mmio_delegate_t::create<ept_violation_handler, &ept_violation_handler::emulate_mmio>(
+            this->ept_violation().get()
+        )
+    );
+}
 
 //--------------------------------------------------------------------------
 // EPT Violation
@@ -181,22 +838,71 @@ apis::add_ept_misconfiguration_handler(
 
 gsl::not_null<ept_violation_handler *>
 apis::ept_violation()
-{ return &m_ept_violation_handler; }
+{
+    if (!m_ept_violation_handler) {
+        lazy_handler(m_ept_violation_handler)->set_guest_memory(this->memory());
+        m_ept_violation_handler->set_coalesced_ring(&m_coalesced_writes);
+        m_ept_violation_handler->set_doorbells(&m_doorbells);
+    }
+
+    return lazy_handler(m_ept_violation_handler);
+}
 
 void
 apis::add_ept_read_violation_handler(
     const ept_violation_handler::handler_delegate_t &d)
-{ m_ept_violation_handler.add_read_handler(d); }
+{ this->ept_violation()->add_read_handler(d); }
 
 void
 apis::add_ept_write_violation_handler(
     const ept_violation_handler::handler_delegate_t &d)
-{ m_ept_violation_handler.add_write_handler(d); }
+{ this->ept_violation()->add_write_handler(d); }
 
 void
 apis::add_ept_execute_violation_handler(
     const ept_violation_handler::handler_delegate_t &d)
-{ m_ept_violation_handler.add_execute_handler(d); }
+{ this->ept_violation()->add_execute_handler(d); }
+
+void
+apis::add_ept_page_violation_handler(
+    uint64_t gpa, uint64_t access,
+    const ept_violation_handler::handler_delegate_t &d)
+{ this->ept_violation()->add_page_handler(gpa, access, d); }
+
+void
+apis::remove_ept_page_violation_handlers(uint64_t gpa)
+{
+    if (m_ept_violation_handler) {
+        m_ept_violation_handler->remove_page_handlers(gpa);
+    }
+}
+
+void
+apis::add_ept_spp_handler(
+    const ept_violation_handler::spp_delegate_t &d)
+{ this->ept_violation()->add_spp_handler(d); }
+
+//--------------------------------------------------------------------------
+// EPT Write Monitor
+//--------------------------------------------------------------------------
+
+gsl::not_null<ept_write_monitor *>
+apis::write_monitor()
+{ return lazy_handler(m_write_monitor); }
+
+void
+apis::watch_ept_writes(
+    ept::mmap &map, uint64_t gpa,
+    const ept_write_monitor::handler_delegate_t &d)
+{ this->write_monitor()->watch(map, gpa, d); }
+
+void
+apis::unwatch_ept_writes(uint64_t gpa)
+{
+    if (m_write_monitor) {
+        m_write_monitor->unwatch(gpa);
+    }
+}
 
 //--------------------------------------------------------------------------
 // External Interrupt
@@ -204,19 +910,23 @@ apis::add_ept_execute_violation_handler(
 
 gsl::not_null<external_interrupt_handler *>
 apis::external_interrupt()
-{ return &m_external_interrupt_handler; }
+{ return lazy_handler(m_external_interrupt_handler); }
 
 void
 apis::add_external_interrupt_handler(
-    const external_interrupt_handler::handler_delegate_t &d)
+    const external_interrupt_handler::handler_delegate_t &d, int64_t priority)
 {
-    m_external_interrupt_handler.add_handler(d);
-    m_external_interrupt_handler.enable_exiting();
+    this->external_interrupt()->add_handler(d, priority);
+    this->external_interrupt()->enable_exiting();
 }
 
 void
 apis::disable_external_interrupts()
-{ m_external_interrupt_handler.disable_exiting(); }
+{
+    if (m_external_interrupt_handler) {
+        m_external_interrupt_handler->disable_exiting();
+    }
+}
 
 //--------------------------------------------------------------------------
 // Interrupt Window
@@ -224,28 +934,156 @@ apis::disable_external_interrupts()
 
 gsl::not_null<interrupt_window_handler *>
 apis::interrupt_window()
-{ return &m_interrupt_window_handler; }
+{ return lazy_handler(m_interrupt_window_handler); }
 
 void
 apis::trap_on_next_interrupt_window()
-{ m_interrupt_window_handler.enable_exiting(); }
+{ this->interrupt_window()->enable_exiting(); }
 
 void
 apis::disable_interrupt_window()
-{ m_interrupt_window_handler.disable_exiting(); }
+{
+    if (m_interrupt_window_handler) {
+        m_interrupt_window_handler->disable_exiting();
+    }
+}
 
 void
 apis::add_interrupt_window_handler(
     const interrupt_window_handler::handler_delegate_t &d)
-{ m_interrupt_window_handler.add_handler(d); }
+{ this->interrupt_window()->add_handler(d); }
 
 bool
 apis::is_interrupt_window_open()
-{ return m_interrupt_window_handler.is_open(); }
+{ return this->interrupt_window()->is_open(); }
 
 void
 apis::inject_external_interrupt(uint64_t vector)
-{ m_interrupt_window_handler.inject(vector); }
+{ this->interrupt_window()->inject(vector); }
+
+void
+apis::queue_external_interrupt(uint64_t vector)
+{ this->interrupt_window()->queue(vector); }
+
+//--------------------------------------------------------------------------
+// Virtual APIC
+//--------------------------------------------------------------------------
+
+gsl::not_null<virtual_apic_handler *>
+apis::virtual_apic()
+{ return lazy_handler(m_virtual_apic_handler); }
+
+void
+apis::enable_virtual_apic()
+{
+    this->release_cached_controls();
+    this->virtual_apic()->enable();
+}
+
+//--------------------------------------------------------------------------
+// Posted Interrupts
+//--------------------------------------------------------------------------
+
+gsl::not_null<posted_interrupt_handler *>
+apis::posted_interrupts()
+{
+    if (!m_posted_interrupt_handler) {
+        m_posted_interrupt_handler = std::make_unique<posted_interrupt_handler>(
+            this, m_eapis_vcpu_global_state, this->virtual_apic()
+        );
+    }
+
+    return m_posted_interrupt_handler.get();
+}
+
+void
+apis::enable_posted_interrupts(uint64_t vector)
+{
+    this->release_cached_controls();
+    this->posted_interrupts()->enable(vector);
+}
+
+void
+apis::post_interrupt(uint64_t vector)
+{
+    // This can run on another core, so the handler is not created lazily
+    expects(m_posted_interrupt_handler);
+    m_posted_interrupt_handler->post(vector);
+}
+
+//--------------------------------------------------------------------------
+// IPI
+//--------------------------------------------------------------------------
+
+gsl::not_null<ipi_handler *>
+apis::ipi()
+{ return lazy_handler(m_ipi_handler); }
+
+void
+apis::add_ipi_handler(const ipi_handler::handler_delegate_t &d)
+{ this->ipi()->add_handler(d); }
+
+void
+apis::add_ipi_target(
+    uint64_t apic_id, gsl::not_null<posted_interrupt_handler *> target)
+{ this->ipi()->add_target(apic_id, target); }
+
+//--------------------------------------------------------------------------
+// Page Modification Log
+//--------------------------------------------------------------------------
+
+gsl::not_null<pml_handler *>
+apis::pml()
+{ return lazy_handler(m_pml_handler); }
+
+void
+apis::enable_pml()
+{ this->pml()->enable(); }
+
+void
+apis::disable_pml()
+{
+    if (m_pml_handler) {
+        m_pml_handler->disable();
+    }
+}
+
+void
+apis::add_pml_handler(
+    const pml_handler::handler_delegate_t &d)
+{ this->pml()->add_handler(d); }
+
+uint64_t
+apis::drain_pml()
+{ return this->pml()->drain(m_vmcs); }
+
+//--------------------------------------------------------------------------
+// Nested VMX
+//--------------------------------------------------------------------------
+
+gsl::not_null<nested_vmx_handler *>
+apis::nested_vmx()
+{ return lazy_handler(m_nested_vmx_handler); }
+
+void
+apis::enable_nested_vmx()
+{
+    expects(nested_vmx_handler::is_supported());
+    this->nested_vmx()->enable();
+}
+
+void
+apis::disable_nested_vmx()
+{
+    if (m_nested_vmx_handler) {
+        m_nested_vmx_handler->disable();
+    }
+}
+
+void
+apis::add_nested_vmx_handler(
+    const nested_vmx_handler::handler_delegate_t &d)
+{ this->nested_vmx()->add_handler(d); }
 
 //--------------------------------------------------------------------------
 // IO Instruction
@@ -253,15 +1091,43 @@ apis::inject_external_interrupt(uint64_t vector)
 
 gsl::not_null<io_instruction_handler *>
 apis::io_instruction()
-{ return &m_io_instruction_handler; }
+{
+    if (!m_io_instruction_handler) {
+        this->release_cached_controls();
+        m_bitmaps.enable_io_bitmaps();
+        lazy_handler(m_io_instruction_handler)->set_guest_memory(this->memory());
+        m_io_instruction_handler->set_coalesced_ring(&m_coalesced_writes);
+        m_io_instruction_handler->set_doorbells(&m_doorbells);
+    }
+
+    return lazy_handler(m_io_instruction_handler);
+}
 
 void
 apis::trap_all_io_instruction_accesses()
-{ m_io_instruction_handler.trap_on_all_accesses(); }
+{ this->io_instruction()->trap_on_all_accesses(); }
 
 void
 apis::pass_through_all_io_instruction_accesses()
-{ m_io_instruction_handler.pass_through_all_accesses(); }
+{
+    if (m_io_instruction_handler) {
+        m_io_instruction_handler->pass_through_all_accesses();
+    }
+}
+
+void
+apis::trap_io_instruction_range(
+    vmcs_n::value_type first, vmcs_n::value_type last)
+{ this->io_instruction()->trap_on_range(first, last); }
+
+void
+apis::pass_through_io_instruction_range(
+    vmcs_n::value_type first, vmcs_n::value_type last)
+{
+    if (m_io_instruction_handler) {
+        m_io_instruction_handler->pass_through_range(first, last);
+    }
+}
 
 void
 apis::add_io_instruction_handler(
@@ -269,8 +1135,18 @@ apis::add_io_instruction_handler(
     const io_instruction_handler::handler_delegate_t &in_d,
     const io_instruction_handler::handler_delegate_t &out_d)
 {
-    m_io_instruction_handler.trap_on_access(port);
-    m_io_instruction_handler.add_handler(port, in_d, out_d);
+    this->io_instruction()->trap_on_access(port);
+    this->io_instruction()->add_handler(port, in_d, out_d);
+}
+
+void
+apis::add_io_string_handler(
+    vmcs_n::value_type port,
+    const io_instruction_handler::string_handler_delegate_t &in_d,
+    const io_instruction_handler::string_handler_delegate_t &out_d)
+{
+    this->io_instruction()->trap_on_access(port);
+    this->io_instruction()->add_string_handler(port, in_d, out_d);
 }
 
 //--------------------------------------------------------------------------
@@ -279,16 +1155,32 @@ apis::add_io_instruction_handler(
 
 gsl::not_null<monitor_trap_handler *>
 apis::monitor_trap()
-{ return &m_monitor_trap_handler; }
+{ return lazy_handler(m_monitor_trap_handler); }
 
 void
 apis::add_monitor_trap_handler(
     const monitor_trap_handler::handler_delegate_t &d)
-{ m_monitor_trap_handler.add_handler(d); }
+{ this->monitor_trap()->add_handler(d); }
 
 void
 apis::enable_monitor_trap_flag()
-{ m_monitor_trap_handler.enable(); }
+{ this->monitor_trap()->enable(); }
+
+//--------------------------------------------------------------------------
+// Processor Trace
+//--------------------------------------------------------------------------
+
+gsl::not_null<processor_trace_handler *>
+apis::processor_trace()
+{ return lazy_handler(m_processor_trace_handler); }
+
+void
+apis::enable_processor_trace(uint64_t pmi_vector)
+{
+    expects(processor_trace_handler::is_supported());
+    this->release_cached_controls();
+    this->processor_trace()->enable(pmi_vector);
+}
 
 //--------------------------------------------------------------------------
 // Move DR
@@ -296,12 +1188,91 @@ apis::enable_monitor_trap_flag()
 
 gsl::not_null<mov_dr_handler *>
 apis::mov_dr()
-{ return &m_mov_dr_handler; }
+{ return lazy_handler(m_mov_dr_handler); }
 
 void
 apis::add_mov_dr_handler(
     const mov_dr_handler::handler_delegate_t &d)
-{ m_mov_dr_handler.add_handler(d); }
+{ this->mov_dr()->add_handler(d); }
+
+//--------------------------------------------------------------------------
+// HLT
+//--------------------------------------------------------------------------
+
+gsl::not_null<hlt_handler *>
+apis::hlt()
+{
+    if (!m_hlt_handler) {
+        lazy_handler(m_hlt_handler)->set_interrupt_window(this->interrupt_window());
+    }
+
+    return m_hlt_handler.get();
+}
+
+void
+apis::add_hlt_handler(
+    const hlt_handler::handler_delegate_t &d)
+{ this->hlt()->add_handler(d); }
+
+void
+apis::enable_hlt_exiting()
+{ this->hlt()->enable_exiting(); }
+
+//--------------------------------------------------------------------------
+// PAUSE
+//--------------------------------------------------------------------------
+
+gsl::not_null<pause_handler *>
+apis::pause()
+{ return lazy_handler(m_pause_handler); }
+
+void
+apis::add_pause_handler(
+    const pause_handler::handler_delegate_t &d)
+{ this->pause()->add_handler(d); }
+
+void
+apis::enable_pause_loop_exiting(
+    uint64_t gap, uint64_t window, uint64_t max_window)
+{
+    expects(pause_handler::is_loop_exiting_supported());
+    this->pause()->enable_loop_exiting(gap, window, max_window);
+}
+
+//--------------------------------------------------------------------------
+// Preemption Timer
+//--------------------------------------------------------------------------
+
+gsl::not_null<preemption_timer_handler *>
+apis::preemption_timer()
+{ return lazy_handler(m_preemption_timer_handler); }
+
+void
+apis::add_preemption_timer_handler(
+    const preemption_timer_handler::handler_delegate_t &d)
+{ this->preemption_timer()->add_handler(d); }
+
+void
+apis::arm_preemption_timer(uint64_t period)
+{
+    expects(preemption_timer_handler::is_supported());
+    this->preemption_timer()->arm_periodic(period);
+}
+
+void
+apis::arm_preemption_deadline(uint64_t ticks)
+{
+    expects(preemption_timer_handler::is_supported());
+    this->preemption_timer()->arm(ticks);
+}
+
+void
+apis::disarm_preemption_timer()
+{
+    if (m_preemption_timer_handler) {
+        m_preemption_timer_handler->disarm();
+    }
+}
 
 //--------------------------------------------------------------------------
 // Read MSR
@@ -319,6 +1290,16 @@ void
 apis::pass_through_all_rdmsr_accesses()
 { m_rdmsr_handler.pass_through_all_accesses(); }
 
+void
+apis::trap_rdmsr_range(
+    vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_rdmsr_handler.trap_on_range(first, last); }
+
+void
+apis::pass_through_rdmsr_range(
+    vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_rdmsr_handler.pass_through_range(first, last); }
+
 void
 apis::add_rdmsr_handler(
     vmcs_n::value_type msr, const rdmsr_handler::handler_delegate_t &d)
@@ -327,6 +1308,14 @@ apis::add_rdmsr_handler(
     m_rdmsr_handler.add_handler(msr, std::move(d));
 }
 
+void
+apis::add_rdmsr_constant(
+    vmcs_n::value_type msr, uint64_t val)
+{
+    m_rdmsr_handler.trap_on_access(msr);
+    m_rdmsr_handler.add_constant(msr, val);
+}
+
 //--------------------------------------------------------------------------
 // Write MSR
 //--------------------------------------------------------------------------
@@ -343,6 +1332,16 @@ void
 apis::pass_through_all_wrmsr_accesses()
 { m_wrmsr_handler.pass_through_all_accesses(); }
 
+void
+apis::trap_wrmsr_range(
+    vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_wrmsr_handler.trap_on_range(first, last); }
+
+void
+apis::pass_through_wrmsr_range(
+    vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_wrmsr_handler.pass_through_range(first, last); }
+
 void
 apis::add_wrmsr_handler(
     vmcs_n::value_type msr, const wrmsr_handler::handler_delegate_t &d)
@@ -351,18 +1350,85 @@ apis::add_wrmsr_handler(
     m_wrmsr_handler.add_handler(msr, std::move(d));
 }
 
+void
+apis::add_wrmsr_mask(
+    vmcs_n::value_type msr, uint64_t mask)
+{
+    m_wrmsr_handler.trap_on_access(msr);
+    m_wrmsr_handler.add_write_mask(msr, mask);
+}
+
+//--------------------------------------------------------------------------
+// MSR Lists
+//--------------------------------------------------------------------------
+
+gsl::not_null<msr_lists *>
+apis::switched_msrs()
+{ return lazy_handler(m_msr_lists); }
+
+void
+apis::add_switched_msr(
+    vmcs_n::value_type msr, uint64_t guest_val)
+{
+    this->switched_msrs()->add(msr, guest_val);
+
+    m_rdmsr_handler.pass_through_access(msr);
+    m_wrmsr_handler.pass_through_access(msr);
+}
+
+void
+apis::remove_switched_msr(
+    vmcs_n::value_type msr)
+{
+    this->switched_msrs()->remove(msr);
+
+    m_rdmsr_handler.trap_on_access(msr);
+    m_wrmsr_handler.trap_on_access(msr);
+}
+
 //--------------------------------------------------------------------------
 // XSetBV
 //----------------------------------------------------------------- ---------
 
 gsl::not_null<xsetbv_handler *>
 apis::xsetbv()
-{ return &m_xsetbv_handler; }
+{ return lazy_handler(m_xsetbv_handler); }
 
 void
 apis::add_xsetbv_handler(
     const xsetbv_handler::handler_delegate_t &d)
-{ m_xsetbv_handler.add_handler(std::move(d)); }
+{ this->xsetbv()->add_handler(std::move(d)); }
+
+//--------------------------------------------------------------------------
+// VMCall
+//--------------------------------------------------------------------------
+
+gsl::not_null<vmcall_handler *>
+apis::vmcall()
+{ return lazy_handler(m_vmcall_handler); }
+
+void
+apis::add_vmcall_handler(
+    uint64_t opcode, const vmcall_handler::handler_delegate_t &d)
+{ this->vmcall()->add_handler(opcode, d); }
+
+//--------------------------------------------------------------------------
+// Stats
+//--------------------------------------------------------------------------
+
+gsl::not_null<stats_service *>
+apis::stats()
+{
+    if (!m_stats_service) {
+        lazy_handler(m_stats_service)->set_guest_memory(this->memory());
+    }
+
+    return lazy_handler(m_stats_service);
+}
+
+void
+apis::enable_stats_vmcall()
+{ this->stats(); }
 
 //==========================================================================
 // Resources
@@ -372,7 +1438,21 @@ void
 apis::add_handler(
     ::intel_x64::vmcs::value_type reason,
     const handler_delegate_t &d)
-{ m_exit_handler->add_handler(reason, d); }
+{
+    if (reason >= num_timed_exit_reasons) {
+        m_exit_handler->add_handler(reason, d);
+        return;
+    }
+
+    using entry_t = decltype(m_exit_dispatch_table)::entry;
+
+    if (m_exit_dispatch_table.push_front(reason, d)) {
+        m_exit_handler->add_handler(
+            reason,
+            ::handler_delegate_t::create<entry_t, &entry_t::handle>(&m_exit_dispatch_table.at(reason))
+        );
+    }
+}
 
 }
 }
@@ -0,0 +1,483 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// -----------------------------------------------------------------------------
+// Bitmap Policy
+// -----------------------------------------------------------------------------
+
+bitmap_policy::bitmap_policy(numa::node_t node) :
+    m_msr_bitmap{static_cast<uint8_t *>(numa::alloc_page(node)), numa::free_page},
+    m_io_bitmap_a{nullptr, numa::free_page},
+    m_io_bitmap_b{nullptr, numa::free_page},
+    m_node{node}
+{ gsl::memset(this->msr_bitmap(), 0); }
+
+bitmap_policy::bitmap_policy(const bitmap_policy &other, numa::node_t node) :
+    bitmap_policy(node)
+{
+    std::lock_guard<std::mutex> lock(other.m_mutex);
+
+    auto copy = [](const auto & from, const auto & to) {
+        std::copy(from.begin(), from.end(), to.begin());
+    };
+
+    copy(other.msr_bitmap(), this->msr_bitmap());
+
+    if (other.m_io_bitmap_a) {
+        this->alloc_io_bitmaps();
+
+        copy(other.io_bitmap_a(), this->io_bitmap_a());
+        copy(other.io_bitmap_b(), this->io_bitmap_b());
+    }
+}
+
+void
+bitmap_policy::trap_rdmsr(vmcs_n::value_type msr)
+{ change_bit(this->msr_bitmap(), rdmsr_bit(msr), true); }
+
+void
+bitmap_policy::pass_through_rdmsr(vmcs_n::value_type msr)
+{ change_bit(this->msr_bitmap(), rdmsr_bit(msr), false); }
+
+void
+bitmap_policy::trap_wrmsr(vmcs_n::value_type msr)
+{ change_bit(this->msr_bitmap(), wrmsr_bit(msr), true); }
+
+void
+bitmap_policy::pass_through_wrmsr(vmcs_n::value_type msr)
+{ change_bit(this->msr_bitmap(), wrmsr_bit(msr), false); }
+
+void
+bitmap_policy::trap_io(vmcs_n::value_type port)
+{
+    this->alloc_io_bitmaps();
+    change_bit(this->io_bitmap(port), port & 0x7FFF, true);
+}
+
+void
+bitmap_policy::pass_through_io(vmcs_n::value_type port)
+{
+    this->alloc_io_bitmaps();
+    change_bit(this->io_bitmap(port), port & 0x7FFF, false);
+}
+
+uint64_t
+bitmap_policy::rdmsr_bit(vmcs_n::value_type msr)
+{
+    if (msr <= 0x00001FFFUL) {
+        return (msr - 0x00000000UL) + 0;
+    }
+
+    if (msr >= 0xC0000000UL && msr <= 0xC0001FFFUL) {
+        return (msr - 0xC0000000UL) + 0x2000;
+    }
+
+    throw std::runtime_error("invalid msr: " + std::to_string(msr));
+}
+
+uint64_t
+bitmap_policy::wrmsr_bit(vmcs_n::value_type msr)
+{ return rdmsr_bit(msr) + 0x4000; }
+
+std::pair<uint64_t, uint64_t>
+bitmap_policy::rdmsr_bits(vmcs_n::value_type first, vmcs_n::value_type last)
+{
+    if (last < first || (first <= 0x00001FFFUL) != (last <= 0x00001FFFUL)) {
+        throw std::runtime_error(
+            "invalid msr range: " + bfn::to_string(first, 16) + " - " + bfn::to_string(last, 16)
+        );
+    }
+
+    return {rdmsr_bit(first), rdmsr_bit(last)};
+}
+
+std::pair<uint64_t, uint64_t>
+bitmap_policy::wrmsr_bits(vmcs_n::value_type first, vmcs_n::value_type last)
+{
+    auto bits = rdmsr_bits(first, last);
+    return {bits.first + 0x4000, bits.second + 0x4000};
+}
+
+void
+bitmap_policy::alloc_io_bitmaps()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_io_bitmap_a) {
+        return;
+    }
+
+    m_io_bitmap_a.reset(static_cast<uint8_t *>(numa::alloc_page(m_node)));
+    m_io_bitmap_b.reset(static_cast<uint8_t *>(numa::alloc_page(m_node)));
+
+    gsl::memset(this->io_bitmap_a(), 0);
+    gsl::memset(this->io_bitmap_b(), 0);
+}
+
+gsl::span<uint8_t>
+bitmap_policy::io_bitmap(uint64_t port) const
+{
+    if (port >= 0x10000) {
+        throw std::runtime_error("invalid port: " + std::to_string(port));
+    }
+
+    if (!m_io_bitmap_a) {
+        throw std::runtime_error("io bitmaps have not been allocated");
+    }
+
+    return port < 0x8000 ? this->io_bitmap_a() : this->io_bitmap_b();
+}
+
+bool
+bitmap_policy::is_set(gsl::span<uint8_t> bitmap, uint64_t bit)
+{
+    auto byte = bitmap[gsl::narrow_cast<std::ptrdiff_t>(bit >> 3)];
+    return (byte & (1U << (bit & 7U))) != 0;
+}
+
+void
+bitmap_policy::change_bit(gsl::span<uint8_t> bitmap, uint64_t bit, bool trap)
+{
+    // Other vCPUs might be setting bits in the same byte at the same time,
+    // so the read-modify-write has to be atomic.
+    //
+
+    auto byte = &bitmap[gsl::narrow_cast<std::ptrdiff_t>(bit >> 3)];
+    auto mask = gsl::narrow_cast<uint8_t>(1U << (bit & 7U));
+
+    if (trap) {
+        __atomic_fetch_or(byte, mask, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_and(byte, gsl::narrow_cast<uint8_t>(~mask), __ATOMIC_RELAXED);
+    }
+}
+
+bool
+bitmap_policy::is_range(
+    gsl::span<uint8_t> bitmap, uint64_t first, uint64_t last, bool trap)
+{
+    for (auto bit = first; bit <= last; bit++) {
+
+        // Whole bytes are checked at once, which is what makes large
+        // ranges cheap to re-apply.
+        //
+
+        if ((bit & 7U) == 0 && bit + 7 <= last) {
+            if (bitmap[gsl::narrow_cast<std::ptrdiff_t>(bit >> 3)] != (trap ? 0xFF : 0x00)) {
+                return false;
+            }
+
+            bit += 7;
+            continue;
+        }
+
+        if (is_set(bitmap, bit) != trap) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+bitmap_policy::change_range(
+    gsl::span<uint8_t> bitmap, uint64_t first, uint64_t last, bool trap)
+{
+    auto first_byte = (first + 7U) >> 3;
+    auto last_byte = (last + 1U) >> 3;
+
+    if (first_byte >= last_byte) {
+        for (auto bit = first; bit <= last; bit++) {
+            change_bit(bitmap, bit, trap);
+        }
+
+        return;
+    }
+
+    // The partial bytes at either end are shared with bits outside of the
+    // range, so only the bytes in the middle can be filled in one go.
+    //
+
+    for (auto bit = first; bit < first_byte << 3; bit++) {
+        change_bit(bitmap, bit, trap);
+    }
+
+    gsl::memset(
+        bitmap.subspan(
+            gsl::narrow_cast<std::ptrdiff_t>(first_byte),
+            gsl::narrow_cast<std::ptrdiff_t>(last_byte - first_byte)
+        ),
+        trap ? 0xFF : 0x00
+    );
+
+    for (auto bit = last_byte << 3; bit <= last; bit++) {
+        change_bit(bitmap, bit, trap);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Bitmaps
+// -----------------------------------------------------------------------------
+
+vcpu_bitmaps::vcpu_bitmaps(bitmap_policy *policy) :
+    m_policy{policy}
+{
+    using namespace vmcs_n;
+
+    if (m_policy == nullptr) {
+        m_private = std::make_unique<bitmap_policy>();
+        m_policy = m_private.get();
+    }
+    else {
+        m_policy->m_users++;
+    }
+
+    this->set_vmcs_addresses();
+    primary_processor_based_vm_execution_controls::use_msr_bitmap::enable();
+
+    // Until the IO bitmaps are needed, IO instructions are passed through
+    // by leaving both IO exiting controls off.
+    //
+    primary_processor_based_vm_execution_controls::unconditional_io_exiting::disable();
+    primary_processor_based_vm_execution_controls::use_io_bitmaps::disable();
+}
+
+vcpu_bitmaps::~vcpu_bitmaps()
+{
+    if (this->is_shared()) {
+        m_policy->m_users--;
+    }
+}
+
+void
+vcpu_bitmaps::trap_msr_bit(uint64_t bit)
+{
+    if (bitmap_policy::is_set(m_policy->msr_bitmap(), bit)) {
+        return;
+    }
+
+    bitmap_policy::change_bit(this->writable()->msr_bitmap(), bit, true);
+}
+
+void
+vcpu_bitmaps::pass_through_msr_bit(uint64_t bit)
+{
+    if (!bitmap_policy::is_set(m_policy->msr_bitmap(), bit)) {
+        return;
+    }
+
+    bitmap_policy::change_bit(this->writable()->msr_bitmap(), bit, false);
+}
+
+void
+vcpu_bitmaps::fill_msr_bitmap(uint64_t offset, uint64_t count, uint8_t value)
+{
+    auto subspan = [&](const auto & bitmap) {
+        return bitmap.subspan(
+                   gsl::narrow_cast<std::ptrdiff_t>(offset),
+                   gsl::narrow_cast<std::ptrdiff_t>(count)
+               );
+    };
+
+    const auto current = subspan(m_policy->msr_bitmap());
+
+    if (std::all_of(current.begin(), current.end(), [&](auto byte) { return byte == value; })) {
+        return;
+    }
+
+    gsl::memset(subspan(this->writable()->msr_bitmap()), value);
+}
+
+void
+vcpu_bitmaps::trap_msr_range(const std::pair<uint64_t, uint64_t> &bits)
+{ this->change_msr_range(bits, true); }
+
+void
+vcpu_bitmaps::pass_through_msr_range(const std::pair<uint64_t, uint64_t> &bits)
+{ this->change_msr_range(bits, false); }
+
+void
+vcpu_bitmaps::change_msr_range(const std::pair<uint64_t, uint64_t> &bits, bool trap)
+{
+    if (bitmap_policy::is_range(m_policy->msr_bitmap(), bits.first, bits.second, trap)) {
+        return;
+    }
+
+    bitmap_policy::change_range(
+        this->writable()->msr_bitmap(), bits.first, bits.second, trap
+    );
+}
+
+void
+vcpu_bitmaps::enable_io_bitmaps()
+{
+    using namespace vmcs_n;
+
+    if (m_io_enabled) {
+        return;
+    }
+
+    m_policy->alloc_io_bitmaps();
+
+    m_io_enabled = true;
+    this->set_vmcs_addresses();
+
+    primary_processor_based_vm_execution_controls::use_io_bitmaps::enable();
+}
+
+void
+vcpu_bitmaps::trap_io(uint64_t port)
+{
+    if (bitmap_policy::is_set(m_policy->io_bitmap(port), port & 0x7FFF)) {
+        return;
+    }
+
+    bitmap_policy::change_bit(this->writable()->io_bitmap(port), port & 0x7FFF, true);
+}
+
+void
+vcpu_bitmaps::pass_through_io(uint64_t port)
+{
+    if (!bitmap_policy::is_set(m_policy->io_bitmap(port), port & 0x7FFF)) {
+        return;
+    }
+
+    bitmap_policy::change_bit(this->writable()->io_bitmap(port), port & 0x7FFF, false);
+}
+
+void
+vcpu_bitmaps::trap_io_range(uint64_t first, uint64_t last)
+{ this->change_io_range(first, last, true); }
+
+void
+vcpu_bitmaps::pass_through_io_range(uint64_t first, uint64_t last)
+{ this->change_io_range(first, last, false); }
+
+void
+vcpu_bitmaps::change_io_range(uint64_t first, uint64_t last, bool trap)
+{
+    if (last < first || last >= 0x10000) {
+        throw std::runtime_error(
+            "invalid port range: " + bfn::to_string(first, 16) + " - " + bfn::to_string(last, 16)
+        );
+    }
+
+    // A range can straddle IO bitmap A and B, in which case each bitmap
+    // gets its own part of the range.
+    //
+
+    auto for_each_part = [&](const auto & func) {
+        if (first < 0x8000) {
+            if (!func(m_policy->io_bitmap(0), first, std::min<uint64_t>(last, 0x7FFF))) {
+                return false;
+            }
+        }
+
+        if (last >= 0x8000) {
+            if (!func(m_policy->io_bitmap(0x8000), std::max<uint64_t>(first, 0x8000) - 0x8000, last - 0x8000)) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    auto is_range = [&](auto bitmap, auto part_first, auto part_last) {
+        return bitmap_policy::is_range(bitmap, part_first, part_last, trap);
+    };
+
+    if (for_each_part(is_range)) {
+        return;
+    }
+
+    this->writable();
+
+    for_each_part([&](auto bitmap, auto part_first, auto part_last) {
+        bitmap_policy::change_range(bitmap, part_first, part_last, trap);
+        return true;
+    });
+}
+
+void
+vcpu_bitmaps::fill_io_bitmap(uint8_t value)
+{
+    auto filled = [&](const auto & bitmap) {
+        return std::all_of(bitmap.begin(), bitmap.end(), [&](auto byte) { return byte == value; });
+    };
+
+    if (filled(m_policy->io_bitmap(0)) && filled(m_policy->io_bitmap(0x8000))) {
+        return;
+    }
+
+    auto policy = this->writable();
+
+    gsl::memset(policy->io_bitmap(0), value);
+    gsl::memset(policy->io_bitmap(0x8000), value);
+}
+
+gsl::not_null<bitmap_policy *>
+vcpu_bitmaps::writable()
+{
+    if (this->is_shared() && m_policy->users() > 1) {
+        this->make_private();
+    }
+
+    return m_policy;
+}
+
+void
+vcpu_bitmaps::make_private()
+{
+    m_private = std::make_unique<bitmap_policy>(*m_policy);
+
+    m_policy->m_users--;
+    m_policy = m_private.get();
+
+    this->set_vmcs_addresses();
+}
+
+void
+vcpu_bitmaps::set_vmcs_addresses()
+{
+    using namespace vmcs_n;
+
+    address_of_msr_bitmap::set(
+        g_mm->virtptr_to_physint(m_policy->m_msr_bitmap.get())
+    );
+
+    if (m_io_enabled) {
+        address_of_io_bitmap_a::set(
+            g_mm->virtptr_to_physint(m_policy->m_io_bitmap_a.get())
+        );
+
+        address_of_io_bitmap_b::set(
+            g_mm->virtptr_to_physint(m_policy->m_io_bitmap_b.get())
+        );
+    }
+}
+
+}
+}
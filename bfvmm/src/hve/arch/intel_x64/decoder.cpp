@@ -0,0 +1,222 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <hve/arch/intel_x64/apis.h>
+#include <hve/arch/intel_x64/decoder.h>
+
+#include <bfvmm/memory_manager/arch/x64/unique_map.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// The longest instruction the architecture allows
+constexpr const uint64_t max_insn_len = insn_cache<>::max_len;
+
+static bool
+is_known_reg(x86_reg id) noexcept
+{ return id < X86_REG_ENDING && capstone::reg_table[id].width != 0; }
+
+insn_decoder::insn_decoder()
+{
+    if (cs_open(CS_ARCH_X86, m_mode, &m_handle) != CS_ERR_OK) {
+        throw std::runtime_error("insn_decoder: cs_open failed");
+    }
+
+    cs_option(m_handle, CS_OPT_DETAIL, CS_OPT_ON);
+
+    // The instruction (and its detail) that every decode writes into is
+    // allocated once here, so that decoding from an exit handler never
+    // touches the heap
+    //
+
+    m_insn = cs_malloc(m_handle);
+    if (m_insn == nullptr) {
+        cs_close(&m_handle);
+        throw std::runtime_error("insn_decoder: cs_malloc failed");
+    }
+}
+
+insn_decoder::~insn_decoder()
+{
+    cs_free(m_insn, 1);
+    cs_close(&m_handle);
+}
+
+const decoded_insn_t *
+insn_decoder::decode(gsl::not_null<vmcs_t *> vmcs)
+{
+    auto cr3 = vmcs_n::guest_cr3::get();
+    auto rip = vmcs->save_state()->rip;
+    auto mode = guest_mode();
+
+    // The bytes are read even when the instruction is cached, so that
+    // the cached entry can be checked against what is at RIP now
+    //
+
+    std::array<uint8_t, max_insn_len> bytes{};
+
+    if (m_guest_memory != nullptr) {
+        m_guest_memory->read_gva(rip, bytes);
+    }
+    else {
+        read_guest(rip, cr3, bytes);
+    }
+
+    if (auto insn = m_cache.find(cr3, rip, mode, bytes)) {
+        return insn;
+    }
+
+    decoded_insn_t insn{};
+
+    if (!this->decode(bytes, rip, insn, mode)) {
+        return nullptr;
+    }
+
+    return m_cache.insert(cr3, rip, mode, bytes, insn);
+}
+
+bool
+insn_decoder::decode(
+    gsl::span<const uint8_t> bytes, uint64_t rip, decoded_insn_t &insn,
+    cs_mode mode)
+{
+    mov_decoder::insn_t mov{};
+
+    switch (mov_decoder::decode(bytes, mov, mode == CS_MODE_64)) {
+        case mov_decoder::result::decoded:
+
+            // MMIO through MOVS moves memory to memory, which the
+            // emulation does not support
+            //
+
+            if (mov.string) {
+                return false;
+            }
+
+            insn = {mov.len, mov.size, mov.write, mov.imm, mov.imm_val, mov.reg};
+            m_fast_decodes++;
+            return true;
+
+        case mov_decoder::result::unsupported:
+            return false;
+
+        case mov_decoder::result::unknown:
+            break;
+    }
+
+    return this->decode_capstone(bytes, rip, insn, mode);
+}
+
+cs_mode
+insn_decoder::guest_mode()
+{
+    using namespace vmcs_n;
+
+    if (vm_entry_controls::ia_32e_mode_guest::is_enabled() &&
+        guest_cs_access_rights::l::is_enabled()) {
+        return CS_MODE_64;
+    }
+
+    return guest_cs_access_rights::db::is_enabled() ? CS_MODE_32 : CS_MODE_16;
+}
+
+void
+insn_decoder::read_guest(uint64_t rip, uint64_t cr3, gsl::span<uint8_t> bytes)
+{
+    auto size = static_cast<std::size_t>(bytes.size());
+    auto map = bfvmm::x64::make_unique_map<uint8_t>(rip, cr3, size);
+
+    std::copy(map.get(), map.get() + size, bytes.begin());
+}
+
+bool
+insn_decoder::decode_capstone(
+    gsl::span<const uint8_t> bytes, uint64_t rip, decoded_insn_t &insn, cs_mode mode)
+{
+    if (mode != m_mode) {
+        if (cs_option(m_handle, CS_OPT_MODE, mode) != CS_ERR_OK) {
+            return false;
+        }
+
+        m_mode = mode;
+    }
+
+    const auto *code = bytes.data();
+    auto size = static_cast<size_t>(bytes.size());
+    auto addr = rip;
+
+    if (!cs_disasm_iter(m_handle, &code, &size, &addr, m_insn)) {
+        return false;
+    }
+
+    const auto cs = m_insn;
+
+    m_capstone_decodes++;
+
+    if ((cs->id != X86_INS_MOV && cs->id != X86_INS_MOVZX) || cs->detail->x86.op_count != 2) {
+        return false;
+    }
+
+    const auto &dst = cs->detail->x86.operands[0];
+    const auto &src = cs->detail->x86.operands[1];
+
+    insn.len = cs->size;
+
+    if (dst.type == X86_OP_MEM && cs->id == X86_INS_MOV) {
+        insn.size = dst.size;
+        insn.write = true;
+
+        switch (src.type) {
+            case X86_OP_REG:
+                if (!is_known_reg(src.reg)) {
+                    return false;
+                }
+
+                insn.imm = false;
+                insn.reg = capstone::reg_table[src.reg];
+                return true;
+
+            case X86_OP_IMM:
+                insn.imm = true;
+                insn.imm_val = static_cast<uint64_t>(src.imm);
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    if (dst.type == X86_OP_REG && src.type == X86_OP_MEM) {
+        if (!is_known_reg(dst.reg)) {
+            return false;
+        }
+
+        insn.size = src.size;
+        insn.write = false;
+        insn.imm = false;
+        insn.reg = capstone::reg_table[dst.reg];
+        return true;
+    }
+
+    return false;
+}
+
+}
+}
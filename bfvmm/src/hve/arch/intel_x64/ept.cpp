@@ -16,6 +16,8 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
+#include <algorithm>
+
 #include <bfdebug.h>
 #include <hve/arch/intel_x64/vcpu.h>
 
@@ -24,16 +26,32 @@ namespace eapis
 namespace intel_x64
 {
 
+// Sub-page write permissions. These are not defined by the base
+// hypervisor, so they are defined here.
+//
+constexpr const auto vmx_procbased_ctls2_msr = 0x48BU;
+constexpr const uint64_t sub_page_write_permissions = 1ULL << 23;
+constexpr const uint64_t spptp_addr = 0x2030U;
+
+// INVEPT types reported by IA32_VMX_EPT_VPID_CAP. If single-context
+// INVEPT is not supported, the handler falls back to an all-context
+// INVEPT.
+//
+constexpr const auto vmx_ept_vpid_cap_msr = 0x48CU;
+constexpr const uint64_t invept_single_context_supported = 1ULL << 25;
+constexpr const uint64_t invept_all_context_supported = 1ULL << 26;
+
 ept_handler::ept_handler(
     gsl::not_null<apis *> apis,
     gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
 ) :
-    m_eapis_vcpu_global_state{eapis_vcpu_global_state}
+    m_eapis_vcpu_global_state{eapis_vcpu_global_state},
+    m_invept_single_context{is_invept_single_context_supported()}
 {
     bfignored(apis);
 }
 
-void ept_handler::set_eptp(ept::mmap *map)
+void ept_handler::set_eptp(ept::mmap *map, bool accessed_and_dirty)
 {
     using namespace vmcs_n;
     using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
@@ -44,16 +62,31 @@ void ept_handler::set_eptp(ept::mmap *map)
             m_eapis_vcpu_global_state->ia32_vmx_cr0_fixed0 &= ~::intel_x64::cr0::protection_enable::mask;
 
             ept_pointer::memory_type::set(ept_pointer::memory_type::write_back);
-            ept_pointer::accessed_and_dirty_flags::disable();
             ept_pointer::page_walk_length_minus_one::set(3U);
 
             enable_ept::enable();
             unrestricted_guest::enable();
         }
 
+        if (accessed_and_dirty) {
+            ept_pointer::accessed_and_dirty_flags::enable();
+        }
+        else {
+            ept_pointer::accessed_and_dirty_flags::disable();
+        }
+
         ept_pointer::phys_addr::set(map->eptp());
+
+        if (m_spp) {
+            ::intel_x64::vm::write(spptp_addr, map->spptp());
+        }
+
+        m_map = map;
+        m_generation = map->generation() - 1U;
     }
     else {
+        this->disable_spp();
+
         if (ept_pointer::phys_addr::get() != 0) {
             m_eapis_vcpu_global_state->ia32_vmx_cr0_fixed0 |= ::intel_x64::cr0::paging::mask;
             m_eapis_vcpu_global_state->ia32_vmx_cr0_fixed0 |= ::intel_x64::cr0::protection_enable::mask;
@@ -67,7 +100,282 @@ void ept_handler::set_eptp(ept::mmap *map)
         }
 
         ept_pointer::phys_addr::set(0);
+        m_map = nullptr;
+    }
+}
+
+bool ept_handler::invalidate(bool force)
+{
+    if (!m_views.empty()) {
+        return invalidate_views(force);
     }
+
+    if (m_map == nullptr) {
+        return false;
+    }
+
+    auto generation = m_map->generation();
+
+    if (!force && generation == m_generation) {
+        m_invalidations_avoided++;
+        return false;
+    }
+
+    this->invept(vmcs_n::ept_pointer::get());
+
+    m_generation = generation;
+    m_invalidations++;
+
+    return true;
+}
+
+bool ept_handler::is_invept_single_context_supported()
+{ return (::intel_x64::msrs::get(vmx_ept_vpid_cap_msr) & invept_single_context_supported) != 0; }
+
+bool ept_handler::is_invept_all_context_supported()
+{ return (::intel_x64::msrs::get(vmx_ept_vpid_cap_msr) & invept_all_context_supported) != 0; }
+
+void ept_handler::invept(uint64_t eptp)
+{
+    if (m_invept_single_context) {
+        ::intel_x64::vmx::invept_single_context(eptp);
+    }
+    else {
+        ::intel_x64::vmx::invept_global();
+    }
+}
+
+uint64_t ept_handler::invalidations() const noexcept
+{ return m_invalidations; }
+
+uint64_t ept_handler::invalidations_avoided() const noexcept
+{ return m_invalidations_avoided; }
+
+// -----------------------------------------------------------------------------
+// Views
+// -----------------------------------------------------------------------------
+
+static uint64_t
+eptp_list_entry(ept::mmap &map, bool accessed_and_dirty)
+{
+    using namespace vmcs_n::ept_pointer;
+
+    auto entry = map.eptp();
+    entry |= memory_type::write_back << memory_type::from;
+    entry |= 3ULL << page_walk_length_minus_one::from;
+
+    if (accessed_and_dirty) {
+        entry |= accessed_and_dirty_flags::mask;
+    }
+
+    return entry;
+}
+
+std::size_t ept_handler::add_view(ept::mmap &map, bool accessed_and_dirty)
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (m_views.size() == max_views) {
+        throw std::runtime_error("ept_handler::add_view: EPTP list is full");
+    }
+
+    if (!m_eptp_list) {
+        m_eptp_list.reset(static_cast<uint64_t *>(numa::alloc_page()));
+        gsl::memset(gsl::make_span(m_eptp_list.get(), max_views), 0);
+
+        eptp_list_address::set(g_mm->virtptr_to_physint(m_eptp_list.get()));
+
+        enable_vm_functions::enable();
+        vm_function_controls::eptp_switching::enable();
+    }
+
+    auto index = m_views.size();
+
+    m_eptp_list.get()[index] = eptp_list_entry(map, accessed_and_dirty);
+    m_views.push_back({&map, map.generation() - 1U});
+
+    return index;
+}
+
+void ept_handler::set_view(std::size_t index)
+{
+    expects(index < m_views.size());
+
+    // The first switch has to go through set_eptp() to turn EPT on. After
+    // that, switching is just a write of EPTP and its index.
+    //
+
+    if (m_map == nullptr) {
+        this->set_eptp(m_views[index].map);
+    }
+
+    vmcs_n::ept_pointer::set(m_eptp_list.get()[index]);
+    vmcs_n::eptp_index::set(index);
+
+    if (m_spp) {
+        ::intel_x64::vm::write(spptp_addr, m_views[index].map->spptp());
+    }
+
+    m_map = m_views[index].map;
+}
+
+std::size_t ept_handler::view() const
+{ return vmcs_n::eptp_index::get(); }
+
+std::size_t ept_handler::num_views() const noexcept
+{ return m_views.size(); }
+
+bool ept_handler::invalidate_views(bool force)
+{
+    if (m_map == nullptr) {
+        return false;
+    }
+
+    auto invalidated = false;
+
+    for (auto index = 0ULL; index < m_views.size(); index++) {
+        auto &view = m_views[index];
+        auto generation = view.map->generation();
+
+        if (!force && generation == view.generation) {
+            continue;
+        }
+
+        view.generation = generation;
+        invalidated = true;
+
+        if (m_invept_single_context) {
+            ::intel_x64::vmx::invept_single_context(m_eptp_list.get()[index]);
+        }
+    }
+
+    // Without single-context INVEPT, a single all-context INVEPT covers
+    // every view that was modified.
+    //
+
+    if (invalidated && !m_invept_single_context) {
+        ::intel_x64::vmx::invept_global();
+    }
+
+    if (invalidated) {
+        m_invalidations++;
+    }
+    else {
+        m_invalidations_avoided++;
+    }
+
+    return invalidated;
+}
+
+// -----------------------------------------------------------------------------
+// Virtualization Exceptions
+// -----------------------------------------------------------------------------
+
+void ept_handler::enable_ve()
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (!m_ve_info) {
+        m_ve_info.reset(static_cast<ve_info_t *>(numa::alloc_page()));
+        *m_ve_info = {};
+    }
+
+    virtualization_exception_information_address::set(this->ve_info_phys());
+    ept_violation_ve::enable();
+}
+
+void ept_handler::disable_ve()
+{
+    vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::disable();
+}
+
+ept_handler::ve_info_t *ept_handler::ve_info() noexcept
+{ return m_ve_info.get(); }
+
+uintptr_t ept_handler::ve_info_phys() const
+{
+    if (!m_ve_info) {
+        return 0;
+    }
+
+    return g_mm->virtptr_to_physint(m_ve_info.get());
+}
+
+// -----------------------------------------------------------------------------
+// Sub-Page Write Permissions
+// -----------------------------------------------------------------------------
+
+bool ept_handler::is_spp_supported()
+{ return ((::intel_x64::msrs::get(vmx_procbased_ctls2_msr) >> 32) & sub_page_write_permissions) != 0; }
+
+void ept_handler::enable_spp()
+{
+    using namespace vmcs_n;
+
+    expects(is_spp_supported());
+    expects(m_map != nullptr);
+
+    ::intel_x64::vm::write(spptp_addr, m_map->spptp());
+    ::intel_x64::vm::write(
+        secondary_processor_based_vm_execution_controls::addr,
+        ::intel_x64::vm::read(secondary_processor_based_vm_execution_controls::addr) | sub_page_write_permissions
+    );
+
+    m_spp = true;
+}
+
+void ept_handler::disable_spp()
+{
+    using namespace vmcs_n;
+
+    if (!m_spp) {
+        return;
+    }
+
+    ::intel_x64::vm::write(
+        secondary_processor_based_vm_execution_controls::addr,
+        ::intel_x64::vm::read(secondary_processor_based_vm_execution_controls::addr) & ~sub_page_write_permissions
+    );
+
+    m_spp = false;
+}
+
+void
+ept_handler::memory_usage(memory_usage_t &usage) const
+{
+    std::vector<const ept::mmap *> maps;
+
+    if (m_map != nullptr) {
+        maps.push_back(m_map);
+    }
+
+    for (const auto &view : m_views) {
+        if (view.map != nullptr && std::find(maps.begin(), maps.end(), view.map) == maps.end()) {
+            maps.push_back(view.map);
+        }
+    }
+
+    for (const auto map : maps) {
+        usage.ept_tables[3] += 0x1000;
+        usage.ept_tables[2] += map->pdpt_count() * 0x1000;
+        usage.ept_tables[1] += map->pd_count() * 0x1000;
+        usage.ept_tables[0] += map->pt_count() * 0x1000;
+
+        usage.ept_other +=
+            (map->pool_free_count() + map->spp_table_count()) * 0x1000;
+    }
+
+    if (m_eptp_list) {
+        usage.ept_other += 0x1000;
+    }
+
+    if (m_ve_info) {
+        usage.ept_other += 0x1000;
+    }
+
+    usage.handlers += heap_bytes(m_views);
 }
 
 }
@@ -0,0 +1,122 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+guest_memory::guest_memory(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+{
+    bfignored(apis);
+    bfignored(eapis_vcpu_global_state);
+}
+
+void
+guest_memory::set_ept(ept::mmap *map)
+{
+    m_cache.clear();
+
+    m_ept = map;
+    m_generation = map != nullptr ? map->generation() : 0;
+}
+
+uint64_t
+guest_memory::gpa_to_hpa(uint64_t gpa)
+{
+    if (m_ept == nullptr) {
+        return gpa;
+    }
+
+    return m_ept->virt_to_phys(gpa) | bfn::lower(gpa, m_ept->from(gpa));
+}
+
+gsl::span<uint8_t>
+guest_memory::map_gpa(uint64_t gpa, uint64_t size)
+{
+    const auto offset = bfn::lower(gpa, ::x64::pt::from);
+    expects(size <= ::x64::pt::page_size - offset);
+
+    if (m_ept != nullptr && GSL_UNLIKELY(m_ept->generation() != m_generation)) {
+        m_cache.clear();
+        m_generation = m_ept->generation();
+    }
+
+    auto page = m_cache.find_or_map(bfn::upper(gpa, ::x64::pt::from), [&](uint64_t gpa_page) {
+        return bfvmm::x64::make_unique_map<uint8_t>(this->gpa_to_hpa(gpa_page));
+    });
+
+    return gsl::make_span(page + offset, static_cast<std::ptrdiff_t>(size));
+}
+
+gsl::span<uint8_t>
+guest_memory::map_gva(uint64_t gva, uint64_t size)
+{
+    const auto gpa = m_walker != nullptr ?
+                     m_walker->gva_to_gpa(gva) :
+                     bfvmm::x64::virt_to_phys_with_cr3(gva, vmcs_n::guest_cr3::get());
+
+    return this->map_gpa(gpa, size);
+}
+
+void
+guest_memory::read_gva(uint64_t gva, gsl::span<uint8_t> dst)
+{
+    auto left = static_cast<uint64_t>(dst.size());
+    auto out = dst.begin();
+
+    while (left != 0) {
+        const auto size = std::min(left, ::x64::pt::page_size - bfn::lower(gva, ::x64::pt::from));
+        const auto src = this->map_gva(gva, size);
+
+        out = std::copy(src.begin(), src.end(), out);
+
+        gva += size;
+        left -= size;
+    }
+}
+
+void
+guest_memory::write_gva(uint64_t gva, gsl::span<const uint8_t> src)
+{
+    auto left = static_cast<uint64_t>(src.size());
+    auto in = src.begin();
+
+    while (left != 0) {
+        const auto size = std::min(left, ::x64::pt::page_size - bfn::lower(gva, ::x64::pt::from));
+        const auto dst = this->map_gva(gva, size);
+
+        std::copy(in, in + static_cast<std::ptrdiff_t>(size), dst.begin());
+        in += static_cast<std::ptrdiff_t>(size);
+
+        gva += size;
+        left -= size;
+    }
+}
+
+void
+guest_memory::invalidate(uint64_t gpa, uint64_t size)
+{ m_cache.invalidate(gpa, size); }
+
+}
+}
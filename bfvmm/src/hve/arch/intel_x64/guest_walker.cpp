@@ -0,0 +1,208 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+#include <bfvmm/memory_manager/arch/x64/unique_map.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// INVLPG exiting. These are not defined by the base hypervisor, so they
+// are defined here. INVLPG exiting also traps INVPCID (if it is enabled
+// for the guest).
+//
+constexpr const uint64_t invlpg_exit_reason = 14U;
+constexpr const uint64_t invpcid_exit_reason = 58U;
+constexpr const uint64_t invlpg_exiting = 1ULL << 9;
+
+// The CR0 and CR4 bits whose changes flush the entire TLB
+//
+constexpr const uint64_t cr0_flush_bits = (1ULL << 31) | (1ULL << 16);
+constexpr const uint64_t cr4_flush_bits = (1ULL << 4) | (1ULL << 5) | (1ULL << 7) | (1ULL << 17);
+
+constexpr const uint64_t cr4_pcide = 1ULL << 17;
+constexpr const uint64_t cr3_noflush = 1ULL << 63;
+
+guest_walker::guest_walker(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+{
+    using namespace vmcs_n;
+    bfignored(eapis_vcpu_global_state);
+
+    apis->add_handler(
+        invlpg_exit_reason,
+        ::handler_delegate_t::create<guest_walker, &guest_walker::handle_invlpg>(this)
+    );
+
+    apis->add_handler(
+        invpcid_exit_reason,
+        ::handler_delegate_t::create<guest_walker, &guest_walker::handle_invpcid>(this)
+    );
+
+    apis->add_wrcr0_handler(
+        cr0_flush_bits,
+        control_register_handler::handler_delegate_t::create<guest_walker, &guest_walker::handle_wrcr0>(this)
+    );
+
+    apis->add_wrcr3_handler(
+        control_register_handler::handler_delegate_t::create<guest_walker, &guest_walker::handle_wrcr3>(this)
+    );
+
+    // The translation cache is flushed on MOV to CR3 exits, so a CR3 in
+    // the CR3-target list would leave stale translations behind
+    //
+
+    apis->require_wrcr3_exits();
+
+    apis->add_wrcr4_handler(
+        cr4_flush_bits,
+        control_register_handler::handler_delegate_t::create<guest_walker, &guest_walker::handle_wrcr4>(this)
+    );
+
+    this->vmwrite(
+        primary_processor_based_vm_execution_controls::addr,
+        this->vmread(primary_processor_based_vm_execution_controls::addr) | invlpg_exiting
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Translation
+// -----------------------------------------------------------------------------
+
+uint64_t
+guest_walker::walk(uint64_t gva, uint64_t cr3)
+{ return bfvmm::x64::virt_to_phys_with_cr3(gva, cr3); }
+
+uint64_t
+guest_walker::gva_to_gpa(uint64_t gva)
+{ return this->gva_to_gpa(gva, this->vmread(vmcs_n::guest_cr3::addr)); }
+
+uint64_t
+guest_walker::gva_to_gpa(uint64_t gva, uint64_t cr3)
+{
+    const auto tag = guest_walker::tag(cr3);
+
+    uint64_t gpa;
+    if (m_cache.find(tag, gva, gpa)) {
+        return gpa;
+    }
+
+    gpa = walk(gva, cr3);
+    m_cache.insert(tag, gva, gpa);
+
+    return gpa;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+guest_walker::handle_invlpg(gsl::not_null<vmcs_t *> vmcs)
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    const auto gva = this->vmread(vmcs_n::exit_qualification::addr);
+    m_cache.invalidate_page(gva);
+
+    // Note
+    //
+    // As the INVLPG was trapped, it did not flush the guest's TLB, so
+    // that is done here. Without VPID, every VM entry already flushes it.
+    //
+
+    if (enable_vpid::is_enabled()) {
+        ::intel_x64::vmx::invvpid_individual_address(
+            vmcs_n::virtual_processor_identifier::get(), gva
+        );
+    }
+
+    return advance(vmcs);
+}
+
+bool
+guest_walker::handle_invpcid(gsl::not_null<vmcs_t *> vmcs)
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    // Note
+    //
+    // Every INVPCID type flushes a subset of the translations of this
+    // vCPU, so rather than decoding the descriptor, the cache and the
+    // guest's TLB (tagged by its VPID) are flushed entirely. Without VPID,
+    // every VM entry already flushes the TLB.
+    //
+
+    m_cache.clear();
+
+    if (enable_vpid::is_enabled()) {
+        ::intel_x64::vmx::invvpid_single_context(
+            vmcs_n::virtual_processor_identifier::get()
+        );
+    }
+
+    return advance(vmcs);
+}
+
+bool
+guest_walker::handle_wrcr0(
+    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    m_cache.clear();
+    return false;
+}
+
+bool
+guest_walker::handle_wrcr3(
+    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    if ((this->vmread(vmcs_n::guest_cr4::addr) & cr4_pcide) == 0) {
+        m_cache.clear();
+        return false;
+    }
+
+    if ((info.val & cr3_noflush) == 0) {
+        m_cache.invalidate_pcid(info.val & 0xFFFULL);
+    }
+
+    return false;
+}
+
+bool
+guest_walker::handle_wrcr4(
+    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    m_cache.clear();
+    return false;
+}
+
+}
+}
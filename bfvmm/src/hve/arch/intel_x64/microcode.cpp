@@ -24,31 +24,20 @@ namespace eapis
 namespace intel_x64
 {
 
-static bool
-ia32_bios_updt_trig__rdmsr_handler(
-    gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info)
-{
-    bfignored(vmcs);
-
-    info.val = 0;
-    return true;
-}
-
-static bool
-ia32_bios_updt_trig__wrmsr_handler(
-    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+microcode_handler::microcode_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
 {
-    bfignored(vmcs);
+    using namespace vmcs_n;
+    bfignored(eapis_vcpu_global_state);
 
-    info.ignore_write = true;
-    return true;
-}
+    apis->add_rdmsr_constant(
+        ::intel_x64::msrs::ia32_bios_updt_trig::addr, 0
+    );
 
-static bool
-ia32_bios_sign_id__rdmsr_handler(
-    gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info)
-{
-    bfignored(vmcs);
+    apis->add_wrmsr_mask(
+        ::intel_x64::msrs::ia32_bios_updt_trig::addr
+    );
 
     // QUIRK
     //
@@ -60,45 +49,12 @@ ia32_bios_sign_id__rdmsr_handler(
     // kernel thinks that a better version of the microcode is
     // already present.
 
-    info.val = 0xFFFFFFFFFFFFFFFF;
-    return true;
-}
-
-static bool
-ia32_bios_sign_id__wrmsr_handler(
-    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
-{
-    bfignored(vmcs);
-
-    info.ignore_write = true;
-    return true;
-}
-
-microcode_handler::microcode_handler(
-    gsl::not_null<apis *> apis,
-    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
-{
-    using namespace vmcs_n;
-    bfignored(eapis_vcpu_global_state);
-
-    apis->add_rdmsr_handler(
-        ::intel_x64::msrs::ia32_bios_updt_trig::addr,
-        rdmsr_handler::handler_delegate_t::create<ia32_bios_updt_trig__rdmsr_handler>()
-    );
-
-    apis->add_wrmsr_handler(
-        ::intel_x64::msrs::ia32_bios_updt_trig::addr,
-        wrmsr_handler::handler_delegate_t::create<ia32_bios_updt_trig__wrmsr_handler>()
-    );
-
-    apis->add_rdmsr_handler(
-        ::intel_x64::msrs::ia32_bios_sign_id::addr,
-        rdmsr_handler::handler_delegate_t::create<ia32_bios_sign_id__rdmsr_handler>()
+    apis->add_rdmsr_constant(
+        ::intel_x64::msrs::ia32_bios_sign_id::addr, 0xFFFFFFFFFFFFFFFF
     );
 
-    apis->add_wrmsr_handler(
-        ::intel_x64::msrs::ia32_bios_sign_id::addr,
-        wrmsr_handler::handler_delegate_t::create<ia32_bios_sign_id__wrmsr_handler>()
+    apis->add_wrmsr_mask(
+        ::intel_x64::msrs::ia32_bios_sign_id::addr
     );
 }
 
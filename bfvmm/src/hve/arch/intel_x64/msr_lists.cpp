@@ -0,0 +1,179 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+static_assert(sizeof(msr_lists::entry_t) == 16, "invalid MSR list entry");
+
+msr_lists::msr_lists(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_guest{static_cast<entry_t *>(numa::alloc_page()), numa::free_page},
+    m_host{static_cast<entry_t *>(numa::alloc_page()), numa::free_page}
+{
+    bfignored(apis);
+    bfignored(eapis_vcpu_global_state);
+
+    gsl::memset(gsl::span<entry_t>(m_guest.get(), max_entries), 0);
+    gsl::memset(gsl::span<entry_t>(m_host.get(), max_entries), 0);
+}
+
+// -----------------------------------------------------------------------------
+// Add / Remove
+// -----------------------------------------------------------------------------
+
+void
+msr_lists::add(vmcs_n::value_type msr, uint64_t guest_val)
+{
+    if (this->contains(msr)) {
+        return this->set_guest_value(msr, guest_val);
+    }
+
+    this->add(
+        msr, guest_val, ::intel_x64::msrs::get(gsl::narrow_cast<::x64::msrs::field_type>(msr))
+    );
+}
+
+void
+msr_lists::add(vmcs_n::value_type msr, uint64_t guest_val, uint64_t host_val)
+{
+    auto i = index_of(msr);
+
+    if (i == m_size) {
+        expects(m_size < max_entries);
+
+        auto index = gsl::narrow_cast<uint32_t>(msr);
+
+        m_guest.get()[i] = {index, 0, guest_val};
+        m_host.get()[i] = {index, 0, host_val};
+
+        m_size++;
+        return this->write_vmcs();
+    }
+
+    m_guest.get()[i].data = guest_val;
+    m_host.get()[i].data = host_val;
+}
+
+void
+msr_lists::remove(vmcs_n::value_type msr)
+{
+    auto i = index_of(msr);
+
+    if (i == m_size) {
+        return;
+    }
+
+    // The order of the entries does not matter, so the last entry is moved
+    // into the hole, which keeps the areas packed.
+    //
+
+    m_size--;
+
+    m_guest.get()[i] = m_guest.get()[m_size];
+    m_host.get()[i] = m_host.get()[m_size];
+
+    m_guest.get()[m_size] = {};
+    m_host.get()[m_size] = {};
+
+    this->write_vmcs();
+}
+
+// -----------------------------------------------------------------------------
+// Values
+// -----------------------------------------------------------------------------
+
+bool
+msr_lists::contains(vmcs_n::value_type msr) const noexcept
+{ return index_of(msr) != m_size; }
+
+uint64_t
+msr_lists::guest_value(vmcs_n::value_type msr) const
+{ return m_guest.get()[checked_index_of(msr)].data; }
+
+void
+msr_lists::set_guest_value(vmcs_n::value_type msr, uint64_t val)
+{ m_guest.get()[checked_index_of(msr)].data = val; }
+
+uint64_t
+msr_lists::host_value(vmcs_n::value_type msr) const
+{ return m_host.get()[checked_index_of(msr)].data; }
+
+void
+msr_lists::set_host_value(vmcs_n::value_type msr, uint64_t val)
+{ m_host.get()[checked_index_of(msr)].data = val; }
+
+gsl::span<const msr_lists::entry_t>
+msr_lists::guest_area() const noexcept
+{ return gsl::span<const entry_t>(m_guest.get(), gsl::narrow_cast<std::ptrdiff_t>(m_size)); }
+
+gsl::span<const msr_lists::entry_t>
+msr_lists::host_area() const noexcept
+{ return gsl::span<const entry_t>(m_host.get(), gsl::narrow_cast<std::ptrdiff_t>(m_size)); }
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+std::size_t
+msr_lists::index_of(vmcs_n::value_type msr) const noexcept
+{
+    for (auto i = 0U; i < m_size; i++) {
+        if (m_guest.get()[i].index == msr) {
+            return i;
+        }
+    }
+
+    return m_size;
+}
+
+std::size_t
+msr_lists::checked_index_of(vmcs_n::value_type msr) const
+{
+    auto i = index_of(msr);
+    expects(i != m_size);
+
+    return i;
+}
+
+void
+msr_lists::write_vmcs()
+{
+    using namespace vmcs_n;
+
+    auto guest = g_mm->virtptr_to_physint(m_guest.get());
+    auto host = g_mm->virtptr_to_physint(m_host.get());
+
+    vm_entry_msr_load_address::set(guest);
+    vm_exit_msr_store_address::set(guest);
+    vm_exit_msr_load_address::set(host);
+
+    vm_entry_msr_load_count::set(m_size);
+    vm_exit_msr_store_count::set(m_size);
+    vm_exit_msr_load_count::set(m_size);
+}
+
+}
+}
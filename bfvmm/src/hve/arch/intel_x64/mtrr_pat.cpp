@@ -0,0 +1,331 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// MTRR / PAT MSRs and the VMCS fields / controls used to load and save
+// IA32_PAT. These are not all defined by the base hypervisor, so they are
+// defined here.
+//
+constexpr const uint32_t ia32_mtrr_physbase_msr = 0x200U;
+constexpr const uint32_t ia32_pat_msr = 0x277U;
+constexpr const uint32_t ia32_mtrr_def_type_msr = 0x2FFU;
+
+constexpr const uint64_t ia32_mtrrcap_vcnt = 0xFFULL;
+constexpr const uint64_t ia32_mtrrcap_fix = 0x100ULL;
+constexpr const uint64_t ia32_mtrr_def_type_valid = 0xCFFULL;
+
+constexpr const uint64_t guest_ia32_pat_addr = 0x2804U;
+constexpr const uint64_t host_ia32_pat_addr = 0x2C00U;
+constexpr const uint64_t vm_exit_controls_addr = 0x400CU;
+constexpr const uint64_t vm_entry_controls_addr = 0x4012U;
+
+constexpr const uint64_t exit_save_ia32_pat = 1ULL << 18;
+constexpr const uint64_t exit_load_ia32_pat = 1ULL << 19;
+constexpr const uint64_t entry_load_ia32_pat = 1ULL << 14;
+
+static bool
+is_valid_mtrr_type(uint64_t type) noexcept
+{
+    switch (type) {
+        case 0U:    // UC
+        case 1U:    // WC
+        case 4U:    // WT
+        case 5U:    // WP
+        case 6U:    // WB
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool
+is_valid_pat(uint64_t pat) noexcept
+{
+    for (auto i = 0U; i < 8U; i++) {
+        auto type = (pat >> (i * 8U)) & 0xFFU;
+
+        if (type != 7U && !is_valid_mtrr_type(type)) {     // 7 == UC-
+            return false;
+        }
+    }
+
+    return true;
+}
+
+mtrr_pat_handler::mtrr_pat_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis}
+{ bfignored(eapis_vcpu_global_state); }
+
+// -----------------------------------------------------------------------------
+// Enable
+// -----------------------------------------------------------------------------
+
+void
+mtrr_pat_handler::enable(
+    ept::mmap &map, uint64_t size, const ept::memory_type_overrides *overrides)
+{
+    expects(m_map == nullptr);
+    expects(g_mtrrs->size() != 0);
+    expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+
+    m_msrs = mtrrs::read_msrs();
+    m_pat = ::intel_x64::msrs::get(ia32_pat_msr);
+
+    m_current = std::make_unique<mtrrs>(m_msrs);
+    m_next = std::make_unique<mtrrs>(m_msrs);
+
+    m_map = &map;
+    m_size = size;
+    m_overrides = overrides;
+
+    auto rdmsr =
+        rdmsr_handler::handler_delegate_t::create<mtrr_pat_handler, &mtrr_pat_handler::handle_rdmsr>(this);
+    auto wrmsr =
+        wrmsr_handler::handler_delegate_t::create<mtrr_pat_handler, &mtrr_pat_handler::handle_wrmsr>(this);
+
+    auto trap = [&](uint32_t msr) {
+        m_apis->add_rdmsr_handler(msr, rdmsr);
+        m_apis->add_wrmsr_handler(msr, wrmsr);
+    };
+
+    trap(ia32_pat_msr);
+    trap(ia32_mtrr_def_type_msr);
+
+    if ((m_msrs.cap & ia32_mtrrcap_fix) != 0) {
+        for (const auto &fixed : mtrrs::fixed_ranges) {
+            trap(fixed.addr);
+        }
+    }
+
+    auto vcnt = std::min<uint64_t>(m_msrs.cap & ia32_mtrrcap_vcnt, mtrrs::max_variable_ranges);
+    for (uint32_t i = 0U; i < vcnt * 2U; i++) {
+        trap(ia32_mtrr_physbase_msr + i);
+    }
+
+    // The guest's PAT lives in the VMCS from now on, and the host's is
+    // restored on each exit
+    //
+
+    this->vmwrite(host_ia32_pat_addr, m_pat);
+    this->vmwrite(guest_ia32_pat_addr, m_pat);
+
+    this->vmwrite(
+        vm_exit_controls_addr,
+        this->vmread(vm_exit_controls_addr) | exit_save_ia32_pat | exit_load_ia32_pat
+    );
+
+    this->vmwrite(
+        vm_entry_controls_addr,
+        this->vmread(vm_entry_controls_addr) | entry_load_ia32_pat
+    );
+}
+
+ept::mmap::memory_type
+mtrr_pat_handler::effective_type(
+    ept::mmap::memory_type host, ept::mmap::memory_type guest) noexcept
+{ return static_cast<uint64_t>(host) < static_cast<uint64_t>(guest) ? host : guest; }
+
+void
+mtrr_pat_handler::memory_usage(memory_usage_t &usage) const
+{
+    if (m_current) {
+        usage.handlers += sizeof(mtrrs) * 2U;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+mtrr_pat_handler::handle_rdmsr(
+    gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    if (info.msr == ia32_pat_msr) {
+        info.val = m_pat;
+        return true;
+    }
+
+    if (auto msr = this->shadow(info.msr)) {
+        info.val = *msr;
+        return true;
+    }
+
+    return false;
+}
+
+bool
+mtrr_pat_handler::handle_wrmsr(
+    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+    info.ignore_write = true;
+
+    if (!this->is_valid(info.msr, info.val)) {
+        m_rejected_writes++;
+        return true;
+    }
+
+    if (info.msr == ia32_pat_msr) {
+        m_pat = info.val;
+        this->vmwrite(guest_ia32_pat_addr, m_pat);
+
+        return true;
+    }
+
+    auto msr = this->shadow(info.msr);
+    if (msr == nullptr) {
+        return false;
+    }
+
+    if (*msr == info.val) {
+        return true;
+    }
+
+    auto old = *msr;
+    *msr = info.val;
+
+    if (!this->update_ept()) {
+        *msr = old;
+        m_rejected_writes++;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+uint64_t *
+mtrr_pat_handler::shadow(uint64_t msr)
+{
+    if (msr == ia32_mtrr_def_type_msr) {
+        return &m_msrs.def_type;
+    }
+
+    if (msr >= ia32_mtrr_physbase_msr && msr < ia32_mtrr_physbase_msr + m_msrs.variable.size()) {
+        return &m_msrs.variable.at(msr - ia32_mtrr_physbase_msr);
+    }
+
+    for (auto i = 0U; i < mtrrs::fixed_ranges.size(); i++) {
+        if (mtrrs::fixed_ranges.at(i).addr == msr) {
+            return &m_msrs.fixed.at(i);
+        }
+    }
+
+    return nullptr;
+}
+
+bool
+mtrr_pat_handler::is_valid(uint64_t msr, uint64_t val) const
+{
+    if (msr == ia32_pat_msr) {
+        return is_valid_pat(val);
+    }
+
+    if (msr == ia32_mtrr_def_type_msr) {
+        return (val & ~ia32_mtrr_def_type_valid) == 0 && is_valid_mtrr_type(val & 0xFFU);
+    }
+
+    if (msr >= ia32_mtrr_physbase_msr && msr < ia32_mtrr_physbase_msr + m_msrs.variable.size()) {
+        return ((msr - ia32_mtrr_physbase_msr) & 1U) != 0 || is_valid_mtrr_type(val & 0xFFU);
+    }
+
+    for (auto i = 0U; i < 8U; i++) {
+        if (!is_valid_mtrr_type((val >> (i * 8U)) & 0xFFU)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Update EPT
+//
+// Both range lists cover all of physical memory, so they are walked side
+// by side (together with the host's, and the overrides), one segment at a
+// time, where a segment ends at the first boundary of any of them. Only
+// the segments whose guest memory type changed are retyped. Since the
+// range lists only have a handful of ranges, so does the walk.
+//
+bool
+mtrr_pat_handler::update_ept()
+{
+    m_next->update(m_msrs);
+
+    if (m_next->size() == 0) {
+        return false;
+    }
+
+    m_updates++;
+
+    uint64_t retyped = 0;
+    uint64_t addr = 0;
+
+    while (addr < m_size) {
+        const auto &prev = m_current->find(addr);
+        const auto &next = m_next->find(addr);
+        const auto &host = g_mtrrs->find(addr);
+
+        auto end = std::min({m_size, prev.base + prev.size, next.base + next.size, host.base + host.size});
+        auto overridden = false;
+
+        if (m_overrides != nullptr) {
+            end = std::min(end, m_overrides->next_boundary(addr));
+            overridden = m_overrides->find(addr) != nullptr;
+        }
+
+        if (prev.type != next.type && !overridden) {
+            auto changed = m_map->set_memory_type(
+                               addr, end - addr, effective_type(host.type, next.type));
+
+            for (const auto &range : changed) {
+                retyped += range.size;
+            }
+        }
+
+        addr = end;
+    }
+
+    std::swap(m_current, m_next);
+
+    if (retyped != 0) {
+        m_retyped_bytes += retyped;
+        m_invalidations++;
+
+        m_apis->invalidate_ept();
+    }
+
+    return true;
+}
+
+}
+}
@@ -39,6 +39,39 @@ physmask_to_size(uint64_t physmask)
     return ((~(physmask << 12)) & ((1ULL << addr_size) - 1U)) + 1U;
 }
 
+// MTRR bits. IA32_MTRRCAP and IA32_MTRR_DEF_TYPE are decoded from raw
+// values (see mtrrs::msrs_t), so their fields are defined here.
+//
+constexpr const auto fixed_ranges_end = 0x100000ULL;
+constexpr const auto ia32_mtrrcap_vcnt = 0xFFULL;
+constexpr const auto ia32_mtrrcap_fix = 0x100ULL;
+constexpr const auto ia32_mtrr_def_type_type = 0xFFULL;
+constexpr const auto ia32_mtrr_def_type_fe = 0x400ULL;
+constexpr const auto ia32_mtrr_def_type_e = 0x800ULL;
+
+static auto
+to_memory_type(uint64_t type)
+{
+    using namespace ::intel_x64::msrs;
+
+    switch (type) {
+        case ia32_mtrr_physbase::type::write_back:
+            return ept::mmap::memory_type::write_back;
+
+        case ia32_mtrr_physbase::type::write_protected:
+            return ept::mmap::memory_type::write_protected;
+
+        case ia32_mtrr_physbase::type::write_through:
+            return ept::mmap::memory_type::write_through;
+
+        case ia32_mtrr_physbase::type::write_combining:
+            return ept::mmap::memory_type::write_combining;
+
+        default:
+            return ept::mmap::memory_type::uncacheable;
+    }
+}
+
 mtrrs *
 mtrrs::instance() noexcept
 {
@@ -46,6 +79,25 @@ mtrrs::instance() noexcept
     return &self;
 }
 
+const mtrrs::range_t &
+mtrrs::find(uint64_t addr) const
+{
+    expects(m_num != 0);
+
+    auto end = m_ranges.begin() + m_num;
+    auto iter = std::upper_bound(
+        m_ranges.begin(), end, addr, [](uint64_t a, const range_t & range) {
+            return a < range.base;
+        }
+    );
+
+    // The first range always starts at 0, so upper_bound() never returns
+    // the first range
+    //
+
+    return *(iter - 1);
+}
+
 void
 mtrrs::dump(int level, const char *str) const
 {
@@ -103,11 +155,56 @@ mtrrs::dump(int level, const char *str) const
 // can expect at least one range, which is the default memory type.
 //
 mtrrs::mtrrs() noexcept
+{
+    guard_exceptions([&]() {
+        this->update(read_msrs());
+    });
+}
+
+mtrrs::mtrrs(const msrs_t &msrs) noexcept
+{ this->update(msrs); }
+
+mtrrs::msrs_t
+mtrrs::read_msrs()
 {
     using namespace ::intel_x64::msrs;
 
+    msrs_t msrs{};
+
+    msrs.cap = get(::x64::msrs::ia32_mtrrcap::addr);
+    msrs.def_type = get(ia32_mtrr_def_type::addr);
+
+    if ((msrs.def_type & ia32_mtrr_def_type_e) == 0) {
+        return msrs;
+    }
+
+    if ((msrs.cap & ia32_mtrrcap_fix) != 0) {
+        for (auto i = 0U; i < fixed_ranges.size(); i++) {
+            msrs.fixed.at(i) = get(fixed_ranges.at(i).addr);
+        }
+    }
+
+    auto vcnt = std::min<uint64_t>(msrs.cap & ia32_mtrrcap_vcnt, max_variable_ranges);
+    for (uint32_t i = 0U; i < vcnt * 2U; i += 2U) {
+        msrs.variable.at(i) = get(ia32_mtrr_physbase::addr + i);
+        msrs.variable.at(i + 1U) = get(ia32_mtrr_physmask::addr + i);
+    }
+
+    return msrs;
+}
+
+void
+mtrrs::update(const msrs_t &msrs) noexcept
+{
     guard_exceptions([&]() {
-        if (ia32_mtrr_def_type::mtrr_enable::is_disabled()) {
+        for (auto &range : m_ranges) {
+            range = {};
+        }
+
+        m_num = 0;
+        m_fixed = false;
+
+        if ((msrs.def_type & ia32_mtrr_def_type_e) == 0) {
             this->add_range({
                 ept::mmap::memory_type::write_back, 0, 0xFFFFFFFFFFFFFFFF
             });
@@ -115,38 +212,15 @@ mtrrs::mtrrs() noexcept
             return;
         }
 
-        this->get_fixed_ranges();
-        this->get_variable_ranges();
+        this->get_fixed_ranges(msrs);
+        this->get_variable_ranges(msrs);
 
         dump(1, "original mtrrs");
 
         while (this->make_continuous() == false);
 
-        ept::mmap::memory_type type;
-        switch (ia32_mtrr_def_type::type::get()) {
-            case ::intel_x64::msrs::ia32_mtrr_def_type::type::write_back:
-                type = ept::mmap::memory_type::write_back;
-                break;
-
-            case ::intel_x64::msrs::ia32_mtrr_def_type::type::write_protected:
-                type = ept::mmap::memory_type::write_protected;
-                break;
-
-            case ::intel_x64::msrs::ia32_mtrr_def_type::type::write_through:
-                type = ept::mmap::memory_type::write_through;
-                break;
-
-            case ::intel_x64::msrs::ia32_mtrr_def_type::type::write_combining:
-                type = ept::mmap::memory_type::write_combining;
-                break;
-
-            default:
-                type = ept::mmap::memory_type::uncacheable;
-                break;
-        }
-
         this->add_range({
-            type, 0, 0xFFFFFFFFFFFFFFFF
+            to_memory_type(msrs.def_type & ia32_mtrr_def_type_type), 0, 0xFFFFFFFFFFFFFFFF
         });
 
         while (this->make_continuous() == false);
@@ -163,29 +237,62 @@ mtrrs::mtrrs() noexcept
     });
 }
 
+// Get Fixed Ranges
+//
+// The fixed-range MTRRs are only used if the CPU supports them and they
+// are enabled, in which case they take precedence over the variable
+// ranges for the first 1MB. Neighbouring sub-ranges of the same type are
+// merged so that EPT can use the largest pages possible (e.g. a first
+// 640KB that is all write-back stays a single range).
+//
 void
-mtrrs::get_fixed_ranges()
+mtrrs::get_fixed_ranges(const msrs_t &msrs)
 {
-    this->add_range({
-        ept::mmap::memory_type::uncacheable,
-        0,
-        0x100000
-    });
+    if ((msrs.cap & ia32_mtrrcap_fix) == 0) {
+        return;
+    }
+
+    if ((msrs.def_type & ia32_mtrr_def_type_fe) == 0) {
+        return;
+    }
+
+    range_t range{};
+
+    for (auto i = 0U; i < fixed_ranges.size(); i++) {
+        const auto &fixed = fixed_ranges.at(i);
+        auto msr = msrs.fixed.at(i);
+
+        for (auto j = 0U; j < 8U; j++) {
+            auto type = to_memory_type((msr >> (j * 8U)) & 0xFFU);
+
+            if (range.base != invalid && range.type == type) {
+                range.size += fixed.size;
+                continue;
+            }
+
+            if (range.base != invalid) {
+                this->add_range(range);
+            }
+
+            range = {type, fixed.base + (j * fixed.size), fixed.size};
+        }
+    }
+
+    this->add_range(range);
+    m_fixed = true;
 }
 
 void
-mtrrs::get_variable_ranges()
+mtrrs::get_variable_ranges(const msrs_t &msrs)
 {
     using namespace ::intel_x64::msrs;
 
-    auto vcnt = ::x64::msrs::ia32_mtrrcap::vcnt::get();
-    auto base_addr = ia32_mtrr_physbase::addr;
-    auto mask_addr = ia32_mtrr_physmask::addr;
+    auto vcnt = std::min<uint64_t>(msrs.cap & ia32_mtrrcap_vcnt, max_variable_ranges);
 
     for (uint32_t i = 0U; i < vcnt * 2U; i += 2U) {
 
-        auto ia32_mtrr_physbase = get(base_addr + i);
-        auto ia32_mtrr_physmask = get(mask_addr + i);
+        auto ia32_mtrr_physbase = msrs.variable.at(i);
+        auto ia32_mtrr_physmask = msrs.variable.at(i + 1U);
 
         if (ia32_mtrr_physmask::valid::is_disabled(ia32_mtrr_physmask)) {
             continue;
@@ -341,34 +448,28 @@ mtrrs::add_range(uint64_t ia32_mtrr_physbase, uint64_t ia32_mtrr_physmask)
 {
     using namespace ::intel_x64::msrs;
 
-    ept::mmap::memory_type type;
-    switch (ia32_mtrr_physbase::type::get(ia32_mtrr_physbase)) {
-        case ::intel_x64::msrs::ia32_mtrr_physbase::type::write_back:
-            type = ept::mmap::memory_type::write_back;
-            break;
-
-        case ::intel_x64::msrs::ia32_mtrr_physbase::type::write_protected:
-            type = ept::mmap::memory_type::write_protected;
-            break;
+    range_t range = {
+        to_memory_type(ia32_mtrr_physbase::type::get(ia32_mtrr_physbase)),
+        physbase_to_base(ia32_mtrr_physbase::physbase::get(ia32_mtrr_physbase)),
+        physmask_to_size(ia32_mtrr_physmask::physmask::get(ia32_mtrr_physmask))
+    };
 
-        case ::intel_x64::msrs::ia32_mtrr_physbase::type::write_through:
-            type = ept::mmap::memory_type::write_through;
-            break;
+    // When the fixed ranges are in use, they define the first 1MB, so
+    // whatever part of a variable range falls below 1MB is ignored. This
+    // also keeps a variable range from partially overlapping one of the
+    // (merged) fixed ranges, which make_continuous() cannot handle.
+    //
 
-        case ::intel_x64::msrs::ia32_mtrr_physbase::type::write_combining:
-            type = ept::mmap::memory_type::write_combining;
-            break;
+    if (m_fixed && range.base < fixed_ranges_end) {
+        if (range.base + range.size <= fixed_ranges_end) {
+            return;
+        }
 
-        default:
-            type = ept::mmap::memory_type::uncacheable;
-            break;
+        range.size -= fixed_ranges_end - range.base;
+        range.base = fixed_ranges_end;
     }
 
-    return this->add_range({
-        type,
-        physbase_to_base(ia32_mtrr_physbase::physbase::get(ia32_mtrr_physbase)),
-        physmask_to_size(ia32_mtrr_physmask::physmask::get(ia32_mtrr_physmask))
-    });
+    this->add_range(range);
 }
 
 }
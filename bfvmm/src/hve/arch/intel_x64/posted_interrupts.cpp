@@ -0,0 +1,191 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// The x2APIC MSRs used to find this core's ID, and acknowledge
+// notifications that arrive while the vCPU is in the VMM
+//
+constexpr const auto x2apic_id_msr = 0x802U;
+constexpr const auto x2apic_eoi_msr = 0x80BU;
+
+constexpr const uint64_t outstanding_notification = 1ULL << 0;
+constexpr const uint64_t suppress_notification = 1ULL << 1;
+
+posted_interrupt_handler::posted_interrupt_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state,
+    gsl::not_null<virtual_apic_handler *> virtual_apic
+) :
+    m_apis{apis},
+    m_virtual_apic{virtual_apic},
+    m_descriptor{static_cast<descriptor_t *>(alloc_page()), free_page}
+{
+    bfignored(eapis_vcpu_global_state);
+    *m_descriptor = {};
+}
+
+// -----------------------------------------------------------------------------
+// Enablers
+// -----------------------------------------------------------------------------
+
+void
+posted_interrupt_handler::enable(uint64_t vector)
+{
+    using namespace vmcs_n;
+
+    expects(vector >= 32 && vector <= 255);
+
+    auto dest = ::intel_x64::msrs::get(x2apic_id_msr);
+    m_descriptor->control = (dest << 32U) | (vector << 16U);
+    m_vector = vector;
+
+    m_virtual_apic->enable();
+
+    posted_interrupt_descriptor_address::set(g_mm->virtptr_to_physint(m_descriptor.get()));
+    posted_interrupt_notification_vector::set(vector);
+    pin_based_vm_execution_controls::process_posted_interrupts::enable();
+
+    // The notification handler is registered once, as delegates cannot be
+    // removed from a chain. It runs ahead of the virtual APIC's handler,
+    // which would otherwise forward the notification to the guest.
+    //
+
+    if (!m_registered) {
+        m_apis->add_external_interrupt_handler(
+            external_interrupt_handler::handler_delegate_t::create <
+            posted_interrupt_handler, &posted_interrupt_handler::handle_notification > (this)
+        );
+
+        m_registered = true;
+    }
+    else {
+        m_apis->external_interrupt()->enable_exiting();
+    }
+}
+
+void
+posted_interrupt_handler::disable()
+{
+    vmcs_n::pin_based_vm_execution_controls::process_posted_interrupts::disable();
+    m_vector = 0;
+}
+
+bool
+posted_interrupt_handler::is_enabled() const noexcept
+{ return m_vector != 0; }
+
+void
+posted_interrupt_handler::suppress_notifications(bool suppress) noexcept
+{
+    if (suppress) {
+        __atomic_fetch_or(&m_descriptor->control, suppress_notification, __ATOMIC_SEQ_CST);
+    }
+    else {
+        __atomic_fetch_and(&m_descriptor->control, ~suppress_notification, __ATOMIC_SEQ_CST);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Posting
+// -----------------------------------------------------------------------------
+
+bool
+posted_interrupt_handler::post(uint64_t vector)
+{
+    expects(this->is_enabled());
+    expects(vector >= 16 && vector <= 255);
+
+    auto desc = m_descriptor.get();
+    __atomic_fetch_or(&desc->pir.at(vector >> 6U), 1ULL << (vector & 63U), __ATOMIC_SEQ_CST);
+
+    auto control = __atomic_load_n(&desc->control, __ATOMIC_SEQ_CST);
+    if ((control & suppress_notification) != 0) {
+        return false;
+    }
+
+    // Only the poster that sets the outstanding notification bit sends the
+    // IPI. Everyone else's vector is picked up by the same notification.
+    //
+
+    control = __atomic_fetch_or(&desc->control, outstanding_notification, __ATOMIC_SEQ_CST);
+    if ((control & outstanding_notification) != 0) {
+        return false;
+    }
+
+    ::intel_x64::msrs::set(
+        ::intel_x64::msrs::ia32_x2apic_icr::addr, (control & 0xFFFFFFFF00000000ULL) | m_vector
+    );
+
+    return true;
+}
+
+uint64_t
+posted_interrupt_handler::sync()
+{
+    auto desc = m_descriptor.get();
+    __atomic_fetch_and(&desc->control, ~outstanding_notification, __ATOMIC_SEQ_CST);
+
+    uint64_t moved = 0;
+
+    for (auto i = 0ULL; i < desc->pir.size(); i++) {
+        auto bits = __atomic_exchange_n(&desc->pir.at(i), 0ULL, __ATOMIC_SEQ_CST);
+
+        if (bits == 0) {
+            continue;
+        }
+
+        m_virtual_apic->inject(i, bits);
+        moved += static_cast<uint64_t>(__builtin_popcountll(bits));
+    }
+
+    return moved;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+posted_interrupt_handler::handle_notification(
+    gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    if (info.vector != m_vector) {
+        return false;
+    }
+
+    // The notification was acknowledged on exit, so it is in service on
+    // the physical APIC until it is EOI'd
+    //
+
+    this->sync();
+    ::intel_x64::msrs::set(x2apic_eoi_msr, 0);
+
+    return true;
+}
+
+}
+}
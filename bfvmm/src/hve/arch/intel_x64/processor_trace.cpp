@@ -0,0 +1,291 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// Processor trace MSRs
+//
+constexpr const auto rtit_output_base_msr = 0x560U;
+constexpr const auto rtit_output_mask_ptrs_msr = 0x561U;
+constexpr const auto rtit_ctl_msr = 0x570U;
+constexpr const auto rtit_status_msr = 0x571U;
+
+constexpr const uint64_t rtit_ctl_trace_en = 1ULL << 0;
+constexpr const uint64_t rtit_ctl_topa = 1ULL << 8;
+
+// PMI MSRs
+//
+constexpr const auto perf_global_status_msr = 0x38EU;
+constexpr const auto perf_global_ovf_ctrl_msr = 0x390U;
+constexpr const auto x2apic_eoi_msr = 0x80BU;
+constexpr const auto x2apic_lvt_pmi_msr = 0x834U;
+
+constexpr const uint64_t trace_topa_pmi = 1ULL << 55;
+
+// VMX support for processor trace. These are newer than the VMCS
+// definitions in the base hypervisor, so they are defined here.
+//
+constexpr const auto vmx_misc_msr = 0x485U;
+constexpr const uint64_t vmx_misc_rtit = 1ULL << 14;
+
+constexpr const uint64_t guest_ia32_rtit_ctl_addr = 0x2814U;
+constexpr const uint64_t conceal_vmx_from_pt = 1ULL << 19;
+constexpr const uint64_t load_ia32_rtit_ctl = 1ULL << 18;
+constexpr const uint64_t clear_ia32_rtit_ctl = 1ULL << 25;
+
+// ToPA entries
+//
+constexpr const uint64_t topa_end = 1ULL << 0;
+constexpr const uint64_t topa_int = 1ULL << 2;
+
+constexpr const uint64_t region_size = 0x1000U;
+
+processor_trace_handler::processor_trace_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis},
+    m_topa{static_cast<uint64_t *>(alloc_page()), free_page}
+{
+    bfignored(eapis_vcpu_global_state);
+
+    auto topa = this->topa();
+    gsl::memset(topa, 0);
+
+    m_pages.reserve(num_pages);
+    for (auto i = 0U; i < num_pages; i++) {
+        m_pages.emplace_back(static_cast<uint8_t *>(alloc_page()), free_page);
+        topa[i] = g_mm->virtptr_to_physint(m_pages.back().get());
+    }
+
+    topa[num_pages - 1] |= topa_int;
+    topa[num_pages] = g_mm->virtptr_to_physint(m_topa.get()) | topa_end;
+}
+
+bool
+processor_trace_handler::is_supported()
+{
+    auto leaf_7 = ::x64::cpuid::get(0x7, 0, 0, 0);
+    if ((leaf_7.rbx & (1ULL << 25)) == 0) {
+        return false;
+    }
+
+    auto leaf_14 = ::x64::cpuid::get(0x14, 0, 0, 0);
+    if ((leaf_14.rcx & 0x3U) != 0x3U) {
+        return false;
+    }
+
+    return (::intel_x64::msrs::get(vmx_misc_msr) & vmx_misc_rtit) != 0;
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+processor_trace_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+void
+processor_trace_handler::enable(uint64_t pmi_vector, uint64_t ctl)
+{
+    using namespace vmcs_n;
+
+    expects(pmi_vector >= 32 && pmi_vector <= 255);
+
+    m_vector = pmi_vector;
+    m_pos = 0;
+    m_wraps = 0;
+    m_tail = 0;
+    m_dropped = 0;
+
+    ::intel_x64::msrs::set(rtit_output_base_msr, g_mm->virtptr_to_physint(m_topa.get()));
+    ::intel_x64::msrs::set(rtit_output_mask_ptrs_msr, 0x7FU);
+    ::intel_x64::msrs::set(rtit_status_msr, 0);
+    ::intel_x64::msrs::set(x2apic_lvt_pmi_msr, m_vector);
+
+    ::intel_x64::vm::write(guest_ia32_rtit_ctl_addr, ctl | rtit_ctl_trace_en | rtit_ctl_topa);
+
+    ::intel_x64::vm::write(
+        vm_entry_controls::addr,
+        ::intel_x64::vm::read(vm_entry_controls::addr) | load_ia32_rtit_ctl
+    );
+
+    ::intel_x64::vm::write(
+        vm_exit_controls::addr,
+        ::intel_x64::vm::read(vm_exit_controls::addr) | clear_ia32_rtit_ctl
+    );
+
+    ::intel_x64::vm::write(
+        secondary_processor_based_vm_execution_controls::addr,
+        ::intel_x64::vm::read(secondary_processor_based_vm_execution_controls::addr) | conceal_vmx_from_pt
+    );
+
+    if (!m_registered) {
+        m_apis->add_external_interrupt_handler(
+            external_interrupt_handler::handler_delegate_t::create <
+            processor_trace_handler, &processor_trace_handler::handle_pmi > (this)
+        );
+
+        m_apis->add_wrmsr_handler(
+            rtit_ctl_msr,
+            wrmsr_handler::handler_delegate_t::create <
+            processor_trace_handler, &processor_trace_handler::handle_wrmsr > (this)
+        );
+
+        m_registered = true;
+    }
+    else {
+        m_apis->external_interrupt()->enable_exiting();
+    }
+
+    m_enabled = true;
+}
+
+void
+processor_trace_handler::disable()
+{
+    // Clearing the guest's IA32_RTIT_CTL is enough, as VM exits already
+    // clear the real MSR. The load/clear controls are left alone so that
+    // the VMM never runs with the guest's value.
+    //
+
+    ::intel_x64::vm::write(guest_ia32_rtit_ctl_addr, 0);
+    m_enabled = false;
+}
+
+// -----------------------------------------------------------------------------
+// Trace Buffer
+// -----------------------------------------------------------------------------
+
+uint64_t
+processor_trace_handler::head()
+{
+    auto ptrs = ::intel_x64::msrs::get(rtit_output_mask_ptrs_msr);
+
+    auto index = (ptrs >> 7U) & 0x1FFFFFFU;
+    auto pos = index < num_pages ? (index * region_size) + (ptrs >> 32U) : 0;
+
+    // The output pointers only ever move forward, so if they moved back
+    // the buffer wrapped since we last looked. The ToPA PMI makes sure
+    // we look at least once per wrap.
+    //
+
+    if (pos < m_pos) {
+        m_wraps++;
+    }
+
+    m_pos = pos;
+    return (m_wraps * buffer_size) + pos;
+}
+
+uint64_t
+processor_trace_handler::pending()
+{
+    return std::min<uint64_t>(this->head() - m_tail, buffer_size);
+}
+
+std::size_t
+processor_trace_handler::read(gsl::span<uint8_t> buf)
+{
+    auto head = this->head();
+
+    if (head - m_tail > buffer_size) {
+        m_dropped += head - m_tail - buffer_size;
+        m_tail = head - buffer_size;
+    }
+
+    auto num = std::min<uint64_t>(head - m_tail, static_cast<uint64_t>(buf.size()));
+
+    for (auto i = 0ULL; i < num;) {
+        auto pos = (m_tail + i) % buffer_size;
+        auto off = pos % region_size;
+        auto len = std::min(region_size - off, num - i);
+
+        std::copy_n(
+            m_pages[pos / region_size].get() + off, len, buf.begin() + static_cast<std::ptrdiff_t>(i)
+        );
+
+        i += len;
+    }
+
+    m_tail += num;
+    return static_cast<std::size_t>(num);
+}
+
+gsl::span<uint64_t>
+processor_trace_handler::topa() noexcept
+{ return gsl::make_span(m_topa.get(), ::x64::pt::page_size / sizeof(uint64_t)); }
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+processor_trace_handler::handle_pmi(
+    gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info)
+{
+    if (info.vector != m_vector || m_vector == 0) {
+        return false;
+    }
+
+    // The PMI masks the LVT entry, and the interrupt was acknowledged on
+    // exit, so both have to be re-armed before the next PMI can arrive.
+    //
+
+    if ((::intel_x64::msrs::get(perf_global_status_msr) & trace_topa_pmi) != 0) {
+        ::intel_x64::msrs::set(perf_global_ovf_ctrl_msr, trace_topa_pmi);
+    }
+
+    ::intel_x64::msrs::set(x2apic_lvt_pmi_msr, m_vector);
+    ::intel_x64::msrs::set(x2apic_eoi_msr, 0);
+
+    auto pending = this->pending();
+
+    struct info_t pt_info = {
+        m_wraps, pending
+    };
+
+    m_handlers.dispatch(vmcs, pt_info);
+
+    return true;
+}
+
+bool
+processor_trace_handler::handle_wrmsr(
+    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    if (m_enabled) {
+        info.ignore_write = true;
+    }
+
+    return true;
+}
+
+}
+}
@@ -0,0 +1,593 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#include <bfdebug.h>
+#include <bfexception.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// Note
+//
+// The batch is a byte buffer filled in by the guest, so nothing in it is
+// assumed to be aligned. Every structure is copied in and out of it.
+//
+
+template<typename T>
+static T
+load(gsl::span<uint8_t> buf, uint64_t offset)
+{
+    T val{};
+
+    std::memcpy(&val, &buf[static_cast<std::ptrdiff_t>(offset)], sizeof(T));
+    return val;
+}
+
+template<typename T>
+static bool
+store(gsl::span<uint8_t> buf, uint64_t offset, const T &val)
+{
+    if (offset > static_cast<uint64_t>(buf.size()) ||
+        sizeof(T) > static_cast<uint64_t>(buf.size()) - offset) {
+        return false;
+    }
+
+    std::memcpy(&buf[static_cast<std::ptrdiff_t>(offset)], &val, sizeof(T));
+    return true;
+}
+
+static uint64_t
+to_rax(int32_t status) noexcept
+{ return static_cast<uint64_t>(static_cast<int64_t>(status)); }
+
+stats_service::stats_service(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis}
+{
+    bfignored(eapis_vcpu_global_state);
+
+    apis->add_vmcall_handler(
+        stats::vmcall_opcode,
+        vmcall_handler::handler_delegate_t::create<stats_service, &stats_service::handle>(this)
+    );
+
+    apis->add_vmcall_handler(
+        stats::ring_vmcall_opcode,
+        vmcall_handler::handler_delegate_t::create<stats_service, &stats_service::handle_ring>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Batches
+// -----------------------------------------------------------------------------
+
+int32_t
+stats_service::process(gsl::span<uint8_t> batch)
+{
+    using namespace stats;
+
+    const auto size = static_cast<uint64_t>(batch.size());
+
+    if (size < sizeof(batch_header_t)) {
+        return status_invalid;
+    }
+
+    auto hdr = load<batch_header_t>(batch, 0);
+
+    const auto table =
+        sizeof(batch_header_t) + (static_cast<uint64_t>(hdr.num_commands) * sizeof(command_t));
+
+    if (hdr.magic != batch_magic || hdr.version != batch_version || table > size) {
+        hdr.status = status_invalid;
+        store(batch, 0, hdr);
+
+        return status_invalid;
+    }
+
+    for (auto i = 0ULL; i < hdr.num_commands; i++) {
+        const auto offset = sizeof(batch_header_t) + (i * sizeof(command_t));
+        auto cmd = load<command_t>(batch, offset);
+
+        this->execute(cmd, batch, table);
+        store(batch, offset, cmd);
+    }
+
+    hdr.status = status_success;
+    store(batch, 0, hdr);
+
+    m_batches++;
+    return status_success;
+}
+
+void
+stats_service::execute(stats::command_t &cmd, gsl::span<uint8_t> buf, uint64_t table)
+{
+    using namespace stats;
+
+    const auto size = static_cast<uint64_t>(buf.size());
+    cmd.result = 0;
+
+    // The output of a command must not overlap the header or the
+    // commands, as the commands that follow it have not been run yet.
+    //
+
+    if (cmd.size != 0 && (cmd.offset < table || cmd.offset > size || cmd.size > size - cmd.offset)) {
+        cmd.status = status_invalid;
+    }
+    else {
+        auto out = cmd.size != 0 ?
+                   buf.subspan(static_cast<std::ptrdiff_t>(cmd.offset), static_cast<std::ptrdiff_t>(cmd.size)) :
+                   gsl::span<uint8_t>();
+
+        cmd.status = status_failure;
+        guard_exceptions([&]() {
+            cmd.status = this->run(cmd, out);
+        });
+    }
+
+    m_commands++;
+}
+
+int32_t
+stats_service::run(stats::command_t &cmd, gsl::span<uint8_t> out)
+{
+    using namespace stats;
+
+    switch (cmd.op) {
+        case op_nop:
+            return status_success;
+
+        case op_exit_counts: {
+            if (cmd.arg0 >= num_exit_reasons) {
+                return status_invalid;
+            }
+
+            if (m_apis->exit_latency(cmd.arg0) == nullptr) {
+                return status_not_enabled;
+            }
+
+            const auto num = std::min(
+                num_exit_reasons - cmd.arg0, static_cast<uint64_t>(out.size()) / sizeof(uint64_t)
+            );
+
+            for (auto i = 0ULL; i < num; i++) {
+                store(out, i * sizeof(uint64_t), m_apis->exit_latency(cmd.arg0 + i)->count);
+            }
+
+            cmd.result = num;
+            return status_success;
+        }
+
+        case op_exit_latency: {
+            if (cmd.arg0 >= num_exit_reasons) {
+                return status_invalid;
+            }
+
+            const auto lat = m_apis->exit_latency(cmd.arg0);
+            if (lat == nullptr) {
+                return status_not_enabled;
+            }
+
+            latency_t ret{lat->count, lat->total, lat->max, {}};
+            std::copy(lat->buckets.begin(), lat->buckets.end(), &ret.buckets[0]);
+
+            if (!store(out, 0, ret)) {
+                return status_invalid;
+            }
+
+            cmd.result = sizeof(ret);
+            return status_success;
+        }
+
+        case op_drain_samples: {
+            const auto prof = m_apis->profiler();
+            if (prof == nullptr) {
+                return status_not_enabled;
+            }
+
+            m_samples.resize(static_cast<uint64_t>(out.size()) / sizeof(sample_t));
+            const auto num = prof->drain(gsl::make_span(m_samples));
+
+            for (auto i = 0ULL; i < num; i++) {
+                const auto &sample = m_samples[i];
+                store(out, i * sizeof(sample_t), sample_t{sample.reason, sample.rip, sample.cr3});
+            }
+
+            cmd.result = num;
+            return status_success;
+        }
+
+        case op_profile: {
+            const auto prof = m_apis->profiler();
+            if (prof == nullptr) {
+                return status_not_enabled;
+            }
+
+            if (!store(out, 0, profile_t{prof->rate(), prof->exits(), prof->taken()})) {
+                return status_invalid;
+            }
+
+            cmd.result = sizeof(profile_t);
+            return status_success;
+        }
+
+        case op_export_info: {
+            const auto exp = m_apis->exported_exits();
+            if (exp == nullptr) {
+                return status_not_enabled;
+            }
+
+            if (!store(out, 0, export_t{exp->ring().header_phys(), exp->counters().page_phys()})) {
+                return status_invalid;
+            }
+
+            cmd.result = sizeof(export_t);
+            return status_success;
+        }
+
+        case op_enable:
+            return this->set_feature(cmd.arg0, cmd.arg1, true);
+
+        case op_disable:
+            return this->set_feature(cmd.arg0, cmd.arg1, false);
+
+        case op_trap_io_range:
+        case op_pass_through_io_range:
+        case op_trap_rdmsr_range:
+        case op_pass_through_rdmsr_range:
+        case op_trap_wrmsr_range:
+        case op_pass_through_wrmsr_range:
+            return this->set_range(cmd.op, cmd.arg0, cmd.arg1);
+
+        // The ring cannot be replaced while it is being polled, so these
+        // must be issued in a batch
+        //
+
+        case op_ring_attach:
+            return m_polling ? status_invalid : this->attach_ring(cmd.arg0, cmd.arg1);
+
+        case op_ring_detach:
+            if (m_polling) {
+                return status_invalid;
+            }
+
+            this->detach_ring();
+            return status_success;
+
+        default:
+            return status_unknown_op;
+    }
+}
+
+int32_t
+stats_service::set_feature(uint64_t feature, uint64_t arg, bool enable)
+{
+    using namespace stats;
+
+    switch (feature) {
+        case feature_latency:
+            if (enable) {
+                m_apis->enable_exit_latency();
+            }
+            else {
+                m_apis->disable_exit_latency();
+            }
+
+            return status_success;
+
+        case feature_profiler:
+            if (!enable) {
+                m_apis->disable_exit_profiler();
+            }
+            else if (arg != 0) {
+                m_apis->enable_exit_profiler(arg);
+            }
+            else {
+                m_apis->enable_exit_profiler();
+            }
+
+            return status_success;
+
+        case feature_export:
+            if (!enable) {
+                m_apis->disable_exit_export();
+            }
+            else if (arg != 0) {
+                m_apis->enable_exit_export(arg);
+            }
+            else {
+                m_apis->enable_exit_export();
+            }
+
+            return status_success;
+
+        default:
+            return status_invalid;
+    }
+}
+
+int32_t
+stats_service::set_range(uint32_t op, uint64_t first, uint64_t last)
+{
+    using namespace stats;
+
+    // Ports are limited to 16 bits here. MSR ranges that do not fit in the
+    // MSR bitmap are rejected by the bitmap itself (i.e. status_failure).
+    //
+
+    if (first > last) {
+        return status_invalid;
+    }
+
+    switch (op) {
+        case op_trap_io_range:
+        case op_pass_through_io_range:
+            if (last > 0xFFFFU) {
+                return status_invalid;
+            }
+
+            if (op == op_trap_io_range) {
+                m_apis->trap_io_instruction_range(first, last);
+            }
+            else {
+                m_apis->pass_through_io_instruction_range(first, last);
+            }
+
+            return status_success;
+
+        case op_trap_rdmsr_range:
+            m_apis->trap_rdmsr_range(first, last);
+            return status_success;
+
+        case op_pass_through_rdmsr_range:
+            m_apis->pass_through_rdmsr_range(first, last);
+            return status_success;
+
+        case op_trap_wrmsr_range:
+            m_apis->trap_wrmsr_range(first, last);
+            return status_success;
+
+        default:
+            m_apis->pass_through_wrmsr_range(first, last);
+            return status_success;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Request Ring
+// -----------------------------------------------------------------------------
+
+static bool
+is_valid_ring(const stats::ring_header_t &hdr) noexcept
+{
+    using namespace stats;
+
+    if (hdr.magic != ring_magic || hdr.version != ring_version) {
+        return false;
+    }
+
+    if (hdr.num_entries == 0 || hdr.num_entries > max_ring_entries) {
+        return false;
+    }
+
+    return (hdr.num_entries & (hdr.num_entries - 1U)) == 0;
+}
+
+int32_t
+stats_service::attach_ring(uint64_t gpa, uint64_t period)
+{
+    using namespace stats;
+
+    if (m_guest_memory == nullptr || (gpa & (ring_size - 1U)) != 0) {
+        return status_invalid;
+    }
+
+    auto ring = m_guest_memory->map_gpa(gpa, ring_size);
+    if (!is_valid_ring(load<ring_header_t>(ring, 0))) {
+        return status_invalid;
+    }
+
+    this->detach_ring();
+
+    m_ring_gpa = gpa;
+    m_ring_period = period;
+    m_ring_attached = true;
+
+    m_apis->set_exit_poll_handler(
+        exit_poll_delegate_t::create<stats_service, &stats_service::handle_exit>(this)
+    );
+
+    if (period != 0) {
+        if (!m_timer_registered) {
+            m_apis->add_preemption_timer_handler(
+                preemption_timer_handler::handler_delegate_t::create<stats_service, &stats_service::handle_timer>(this)
+            );
+
+            m_timer_registered = true;
+        }
+
+        m_apis->arm_preemption_timer(period);
+    }
+
+    return status_success;
+}
+
+void
+stats_service::detach_ring()
+{
+    if (!m_ring_attached) {
+        return;
+    }
+
+    m_apis->remove_exit_poll_handler();
+
+    if (m_ring_period != 0) {
+        m_apis->disarm_preemption_timer();
+    }
+
+    m_ring_gpa = 0;
+    m_ring_period = 0;
+    m_ring_attached = false;
+}
+
+int32_t
+stats_service::poll()
+{
+    using namespace stats;
+
+    if (!m_ring_attached) {
+        return status_not_enabled;
+    }
+
+    return this->process_ring(m_guest_memory->map_gpa(m_ring_gpa, ring_size));
+}
+
+int32_t
+stats_service::process_ring(gsl::span<uint8_t> ring)
+{
+    using namespace stats;
+
+    if (static_cast<uint64_t>(ring.size()) < ring_size) {
+        return status_invalid;
+    }
+
+    ring = ring.first(static_cast<std::ptrdiff_t>(ring_size));
+
+    // Only the header is read until there is something to do, as this
+    // runs on every exit. head is only ever written here, and tail is
+    // only ever written by the guest, so they are stored one at a time
+    // instead of writing back the whole header.
+    //
+
+    auto hdr = load<ring_header_t>(ring, 0);
+
+    if (hdr.head == hdr.tail) {
+        return status_success;
+    }
+
+    if (!is_valid_ring(hdr) || hdr.tail - hdr.head > hdr.num_entries) {
+        store(ring, offsetof(ring_header_t, status), static_cast<int32_t>(status_invalid));
+        return status_invalid;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    const auto mask = hdr.num_entries - 1U;
+    const auto table = sizeof(ring_header_t) + (hdr.num_entries * sizeof(command_t));
+
+    m_polling = true;
+
+    for (auto i = hdr.head; i != hdr.tail; i++) {
+        const auto offset = sizeof(ring_header_t) + ((i & mask) * sizeof(command_t));
+        auto cmd = load<command_t>(ring, offset);
+
+        this->execute(cmd, ring, table);
+        store(ring, offset, cmd);
+
+        std::atomic_thread_fence(std::memory_order_release);
+        store(ring, offsetof(ring_header_t, head), i + 1U);
+
+        m_ring_requests++;
+    }
+
+    m_polling = false;
+
+    store(ring, offsetof(ring_header_t, polls), hdr.polls + 1U);
+    store(ring, offsetof(ring_header_t, status), static_cast<int32_t>(status_success));
+
+    return status_success;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+stats_service::handle(gsl::not_null<vmcs_t *> vmcs, vmcall_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    const auto gva = info.rbx;
+    const auto size = info.rcx;
+
+    if (m_guest_memory == nullptr || size < sizeof(stats::batch_header_t) || size > stats::max_batch_size) {
+        info.rax = to_rax(stats::status_invalid);
+        return true;
+    }
+
+    auto status = static_cast<int32_t>(stats::status_failure);
+    m_batch.resize(size);
+
+    guard_exceptions([&]() {
+        m_guest_memory->read_gva(gva, gsl::make_span(m_batch));
+        status = this->process(gsl::make_span(m_batch));
+        m_guest_memory->write_gva(gva, gsl::make_span(m_batch));
+    });
+
+    info.rax = to_rax(status);
+    return true;
+}
+
+bool
+stats_service::handle_ring(gsl::not_null<vmcs_t *> vmcs, vmcall_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    auto status = static_cast<int32_t>(stats::status_failure);
+    guard_exceptions([&]() {
+        status = this->poll();
+    });
+
+    info.rax = to_rax(status);
+    return true;
+}
+
+void
+stats_service::handle_exit(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+
+    guard_exceptions([&]() {
+        this->poll();
+    });
+}
+
+bool
+stats_service::handle_timer(
+    gsl::not_null<vmcs_t *> vmcs, preemption_timer_handler::info_t &info)
+{
+    bfignored(info);
+    this->handle_exit(vmcs);
+
+    // Let the other timer handlers (if any) see the expiration too
+    //
+
+    return false;
+}
+
+}
+}
@@ -0,0 +1,158 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// TSC offsetting and scaling. These are not all defined by the base
+// hypervisor, so they are defined here.
+//
+constexpr const auto ia32_tsc_msr = 0x10U;
+constexpr const auto vmx_procbased_ctls2_msr = 0x48BU;
+
+constexpr const uint64_t use_tsc_offsetting = 1ULL << 3;
+constexpr const uint64_t rdtsc_exiting = 1ULL << 12;
+constexpr const uint64_t use_tsc_scaling = 1ULL << 25;
+
+constexpr const uint64_t tsc_offset_addr = 0x2010U;
+constexpr const uint64_t tsc_multiplier_addr = 0x2032U;
+
+tsc_handler::tsc_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+{
+    using namespace vmcs_n;
+    bfignored(eapis_vcpu_global_state);
+
+    this->vmwrite(tsc_offset_addr, 0);
+
+    this->vmwrite(
+        primary_processor_based_vm_execution_controls::addr,
+        (this->vmread(primary_processor_based_vm_execution_controls::addr) |
+         use_tsc_offsetting) & ~rdtsc_exiting
+    );
+
+    apis->add_wrmsr_handler(
+        ia32_tsc_msr,
+        wrmsr_handler::handler_delegate_t::create<tsc_handler, &tsc_handler::handle_wrmsr>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Offsetting / Scaling
+// -----------------------------------------------------------------------------
+
+bool
+tsc_handler::is_scaling_supported()
+{
+    const auto allowed1 = ::intel_x64::msrs::get(vmx_procbased_ctls2_msr) >> 32;
+    return (allowed1 & use_tsc_scaling) != 0;
+}
+
+void
+tsc_handler::set_offset(uint64_t offset)
+{
+    m_offset = offset;
+    this->vmwrite(tsc_offset_addr, offset);
+}
+
+void
+tsc_handler::enable_scaling(uint64_t guest_khz, uint64_t host_khz)
+{
+    using namespace vmcs_n;
+
+    expects(is_scaling_supported());
+    expects(guest_khz != 0 && host_khz != 0);
+
+    const auto host_tsc = __builtin_ia32_rdtsc();
+    const auto val = this->guest_tsc(host_tsc);
+
+    m_multiplier = gsl::narrow_cast<uint64_t>(
+        (static_cast<unsigned __int128>(guest_khz) << multiplier_shift) / host_khz
+    );
+
+    this->vmwrite(tsc_multiplier_addr, m_multiplier);
+    this->set_guest_tsc(val, host_tsc);
+
+    this->vmwrite(
+        secondary_processor_based_vm_execution_controls::addr,
+        this->vmread(secondary_processor_based_vm_execution_controls::addr) | use_tsc_scaling
+    );
+}
+
+void
+tsc_handler::disable_scaling()
+{
+    using namespace vmcs_n;
+
+    const auto host_tsc = __builtin_ia32_rdtsc();
+    const auto val = this->guest_tsc(host_tsc);
+
+    m_multiplier = 1ULL << multiplier_shift;
+    this->set_guest_tsc(val, host_tsc);
+
+    this->vmwrite(
+        secondary_processor_based_vm_execution_controls::addr,
+        this->vmread(secondary_processor_based_vm_execution_controls::addr) & ~use_tsc_scaling
+    );
+}
+
+uint64_t
+tsc_handler::scale(uint64_t host_tsc) const noexcept
+{
+    // Note
+    //
+    // This is the same computation the CPU makes on each read of the TSC
+    // (the high 64 bits of the 128 bit product, with 48 bits of fraction).
+    //
+
+    const auto product = static_cast<unsigned __int128>(host_tsc) * m_multiplier;
+    return static_cast<uint64_t>(product >> multiplier_shift);
+}
+
+uint64_t
+tsc_handler::guest_tsc(uint64_t host_tsc) const noexcept
+{ return this->scale(host_tsc) + m_offset; }
+
+void
+tsc_handler::set_guest_tsc(uint64_t val, uint64_t host_tsc)
+{ this->set_offset(val - this->scale(host_tsc)); }
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+tsc_handler::handle_wrmsr(
+    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    m_tsc_writes++;
+    this->set_guest_tsc(info.val, __builtin_ia32_rdtsc());
+
+    return (info.ignore_write = true);
+}
+
+}
+}
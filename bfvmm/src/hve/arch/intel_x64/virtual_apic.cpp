@@ -0,0 +1,214 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// x2APIC MSRs
+//
+constexpr const auto x2apic_id_msr = 0x802U;
+constexpr const auto x2apic_version_msr = 0x803U;
+constexpr const auto x2apic_tpr_msr = 0x808U;
+constexpr const auto x2apic_eoi_msr = 0x80BU;
+constexpr const auto x2apic_ldr_msr = 0x80DU;
+
+// Virtual-APIC page offsets
+//
+constexpr const auto id_offset = 0x20U;
+constexpr const auto version_offset = 0x30U;
+constexpr const auto tpr_offset = 0x80U;
+constexpr const auto ldr_offset = 0xD0U;
+constexpr const auto irr_offset = 0x200U;
+
+virtual_apic_handler::virtual_apic_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis},
+    m_page{static_cast<uint32_t *>(alloc_page()), free_page}
+{
+    bfignored(eapis_vcpu_global_state);
+    gsl::memset(this->page(), 0);
+}
+
+// -----------------------------------------------------------------------------
+// Enablers
+// -----------------------------------------------------------------------------
+
+void
+virtual_apic_handler::enable()
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (m_enabled) {
+        return;
+    }
+
+    this->write(tpr_offset, gsl::narrow_cast<uint32_t>(::intel_x64::msrs::get(x2apic_tpr_msr)));
+
+    virtual_apic_address::set(g_mm->virtptr_to_physint(m_page.get()));
+    tpr_threshold::set(0);
+    guest_interrupt_status::set(0);
+
+    primary_processor_based_vm_execution_controls::use_tpr_shadow::enable();
+    virtualize_x2apic_mode::enable();
+    virtual_interrupt_delivery::enable();
+
+    // Virtual interrupt delivery requires external interrupt exiting. The
+    // forwarding handler has the lowest priority so that other handlers
+    // (e.g. posted interrupt notifications) see each vector first.
+    //
+
+    if (!m_registered) {
+        m_apis->add_external_interrupt_handler(
+            external_interrupt_handler::handler_delegate_t::create <
+            virtual_apic_handler, &virtual_apic_handler::handle_external_interrupt > (this),
+            std::numeric_limits<int64_t>::min()
+        );
+
+        m_registered = true;
+    }
+    else {
+        m_apis->external_interrupt()->enable_exiting();
+    }
+
+    m_enabled = true;
+}
+
+void
+virtual_apic_handler::disable()
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    apic_register_virtualization::disable();
+    virtual_interrupt_delivery::disable();
+    virtualize_x2apic_mode::disable();
+    primary_processor_based_vm_execution_controls::use_tpr_shadow::disable();
+
+    m_enabled = false;
+}
+
+bool
+virtual_apic_handler::is_enabled() const noexcept
+{ return m_enabled; }
+
+void
+virtual_apic_handler::enable_register_virtualization()
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    expects(m_enabled);
+
+    this->write(id_offset, gsl::narrow_cast<uint32_t>(::intel_x64::msrs::get(x2apic_id_msr)));
+    this->write(version_offset, gsl::narrow_cast<uint32_t>(::intel_x64::msrs::get(x2apic_version_msr)));
+    this->write(ldr_offset, gsl::narrow_cast<uint32_t>(::intel_x64::msrs::get(x2apic_ldr_msr)));
+
+    apic_register_virtualization::enable();
+}
+
+// -----------------------------------------------------------------------------
+// Registers
+// -----------------------------------------------------------------------------
+
+void
+virtual_apic_handler::inject(uint64_t vector)
+{
+    expects(vector >= 16 && vector <= 255);
+    this->inject(vector >> 6U, 1ULL << (vector & 63U));
+}
+
+void
+virtual_apic_handler::inject(uint64_t index, uint64_t bits)
+{
+    using namespace vmcs_n;
+
+    expects(index < 4);
+
+    if (bits == 0) {
+        return;
+    }
+
+    // Each 32 bit IRR register is 16 bytes apart
+    auto reg = irr_offset + (index * 0x20U);
+
+    this->write(reg, this->read(reg) | static_cast<uint32_t>(bits));
+    this->write(reg + 0x10U, this->read(reg + 0x10U) | static_cast<uint32_t>(bits >> 32U));
+
+    // RVI (the low byte of the guest interrupt status) is the highest
+    // vector in the vIRR, which is what the CPU evaluates on VM entry
+    //
+
+    auto highest = (index * 64U) + 63U - static_cast<uint64_t>(__builtin_clzll(bits));
+    auto status = guest_interrupt_status::get();
+
+    if (highest > (status & 0xFFU)) {
+        guest_interrupt_status::set((status & ~0xFFULL) | highest);
+    }
+}
+
+uint32_t
+virtual_apic_handler::read(uint64_t offset) const
+{
+    expects(offset < ::x64::pt::page_size && (offset & 0xFU) == 0);
+    return m_page.get()[offset / sizeof(uint32_t)];
+}
+
+void
+virtual_apic_handler::write(uint64_t offset, uint32_t val)
+{
+    expects(offset < ::x64::pt::page_size && (offset & 0xFU) == 0);
+    m_page.get()[offset / sizeof(uint32_t)] = val;
+}
+
+gsl::span<uint32_t>
+virtual_apic_handler::page() noexcept
+{ return gsl::make_span(m_page.get(), ::x64::pt::page_size / sizeof(uint32_t)); }
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+virtual_apic_handler::handle_external_interrupt(
+    gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    if (!m_enabled || info.vector < 16) {
+        return false;
+    }
+
+    // The interrupt was acknowledged on exit. The guest's EOI will only
+    // reach the virtual APIC, so the physical APIC is EOI'd here.
+    //
+
+    ::intel_x64::msrs::set(x2apic_eoi_msr, 0);
+    this->inject(info.vector);
+
+    return true;
+}
+
+}
+}
@@ -24,65 +24,72 @@ namespace eapis
 namespace intel_x64
 {
 
-static bool
-emulate_ia_32e_mode_switch(
-    control_register_handler::info_t &info)
+// Flush Linear Mappings
+//
+// When VPID is enabled, VM entry does not flush the guest's linear and
+// combined mappings, so once the guest's paging state changes, the mappings
+// tagged with this vCPU's VPID are flushed. Note that this is all that is
+// needed to emulate a CR3 write, as the EPT-derived (guest-physical)
+// mappings are not affected by the guest's page tables. When VPID is
+// disabled, every VM entry already flushes these mappings.
+//
+static void
+flush_linear_mappings(bool retain_globals)
 {
-    using namespace vmcs_n::guest_cr0;
-    using namespace vmcs_n::guest_ia32_efer;
-    using namespace vmcs_n::vm_entry_controls;
     using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
 
-    if (unrestricted_guest::is_disabled() || lme::is_disabled()) {
-        return true;
+    if (enable_vpid::is_disabled()) {
+        return;
     }
 
-    if (paging::is_enabled(info.val)) {
-        lma::enable();
-        ia_32e_mode_guest::enable();
-        ::intel_x64::vmx::invept_global();
+    if (retain_globals) {
+        ::intel_x64::vmx::invvpid_single_context_global(
+            vmcs_n::virtual_processor_identifier::get()
+        );
     }
     else {
-        lma::disable();
-        ia_32e_mode_guest::disable();
-        ::intel_x64::vmx::invept_global();
+        ::intel_x64::vmx::invvpid_single_context(
+            vmcs_n::virtual_processor_identifier::get()
+        );
     }
-
-    return true;
 }
 
-static bool
-default_wrcr0_handler(
-    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
-{
-    using namespace vmcs_n::guest_cr0;
-    bfignored(vmcs);
-
-    if (paging::is_enabled() != paging::is_enabled(info.val)) {
-        return emulate_ia_32e_mode_switch(info);
-    }
+// Every Bit
+//
+// The bits of a handler that did not declare the bits it watches. These
+// handlers are called on every exit.
+//
+constexpr const vmcs_n::value_type every_bit = 0xFFFFFFFFFFFFFFFFULL;
 
-    return true;
-}
+// Changed Bits
+//
+// Returns the bits of a CR that a guest write changes, as seen by the
+// guest (i.e. the masked bits come from the read shadow)
+//
+static vmcs_n::value_type
+changed_bits(
+    vmcs_n::value_type val, vmcs_n::value_type cr,
+    vmcs_n::value_type shadow, vmcs_n::value_type mask)
+{ return val ^ ((shadow & mask) | (cr & ~mask)); }
 
-static bool
-default_rdcr3_handler(
-    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
-{
-    bfignored(vmcs);
-    bfignored(info);
+// CR3-target list
+//
+// These are written by address, as the base hypervisor's VMCS definitions
+// do not name the individual target values.
+//
+constexpr const uint64_t cr3_target_count_addr = 0x400AU;
+constexpr const uint64_t cr3_target_value0_addr = 0x6008U;
 
-    return true;
-}
+constexpr const auto vmx_misc_msr = 0x485U;
+constexpr const uint64_t cr3_address_mask = 0x000FFFFFFFFFF000ULL;
 
 static bool
-default_wrcr3_handler(
+default_rdcr3_handler(
     gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
 {
     bfignored(vmcs);
     bfignored(info);
 
-    ::intel_x64::vmx::invept_global();
     return true;
 }
 
@@ -100,6 +107,7 @@ control_register_handler::control_register_handler(
     gsl::not_null<apis *> apis,
     gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
 ) :
+    m_apis{apis},
     m_eapis_vcpu_global_state{eapis_vcpu_global_state}
 {
     using namespace vmcs_n;
@@ -110,7 +118,7 @@ control_register_handler::control_register_handler(
     );
 
     this->add_wrcr0_handler(
-        handler_delegate_t::create<default_wrcr0_handler>()
+        handler_delegate_t::create<control_register_handler, &control_register_handler::default_wrcr0_handler>(this)
     );
 
     this->add_rdcr3_handler(
@@ -118,7 +126,7 @@ control_register_handler::control_register_handler(
     );
 
     this->add_wrcr3_handler(
-        handler_delegate_t::create<default_wrcr3_handler>()
+        handler_delegate_t::create<control_register_handler, &control_register_handler::default_wrcr3_handler>(this)
     );
 
     this->add_wrcr4_handler(
@@ -142,47 +150,77 @@ control_register_handler::~control_register_handler()
 
 void
 control_register_handler::add_wrcr0_handler(
-    const handler_delegate_t &d)
-{ m_wrcr0_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_wrcr0_handlers.push_front({d, every_bit}, priority); }
+
+void
+control_register_handler::add_wrcr0_handler(
+    vmcs_n::value_type bits, const handler_delegate_t &d, int64_t priority)
+{
+    m_wrcr0_handlers.push_front({d, bits}, priority);
+    this->enable_wrcr0_exiting(bits);
+}
 
 void
 control_register_handler::add_rdcr3_handler(
-    const handler_delegate_t &d)
-{ m_rdcr3_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_rdcr3_handlers.push_front(d, priority); }
 
 void
 control_register_handler::add_wrcr3_handler(
-    const handler_delegate_t &d)
-{ m_wrcr3_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_wrcr3_handlers.push_front(d, priority); }
+
+void
+control_register_handler::add_wrcr4_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_wrcr4_handlers.push_front({d, every_bit}, priority); }
 
 void
 control_register_handler::add_wrcr4_handler(
-    const handler_delegate_t &d)
-{ m_wrcr4_handlers.push_front(d); }
+    vmcs_n::value_type bits, const handler_delegate_t &d, int64_t priority)
+{
+    m_wrcr4_handlers.push_front({d, bits}, priority);
+    this->enable_wrcr4_exiting(bits);
+}
 
 void
 control_register_handler::enable_wrcr0_exiting(
     vmcs_n::value_type mask)
 {
     using namespace vmcs_n;
-    mask |= m_eapis_vcpu_global_state->ia32_vmx_cr0_fixed0;
 
-    cr0_guest_host_mask::set(mask);
-    cr0_read_shadow::set(guest_cr0::get());
+    m_cr0_watched |= mask;
+
+    // Bits that were already masked keep the value the guest sees, and
+    // newly masked bits start out with the guest's real value.
+    //
+
+    auto old_mask = cr0_guest_host_mask::get();
+    auto new_mask = m_cr0_watched | m_eapis_vcpu_global_state->ia32_vmx_cr0_fixed0;
+
+    cr0_read_shadow::set((cr0_read_shadow::get() & old_mask) | (guest_cr0::get() & ~old_mask));
+    cr0_guest_host_mask::set(new_mask);
 }
 
 void
 control_register_handler::enable_rdcr3_exiting()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::cr3_store_exiting::enable();
+    this->vmset_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::cr3_store_exiting::mask
+    );
 }
 
 void
 control_register_handler::enable_wrcr3_exiting()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::cr3_load_exiting::enable();
+    this->vmset_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::cr3_load_exiting::mask
+    );
 }
 
 void
@@ -190,10 +228,127 @@ control_register_handler::enable_wrcr4_exiting(
     vmcs_n::value_type mask)
 {
     using namespace vmcs_n;
-    mask |= m_eapis_vcpu_global_state->ia32_vmx_cr4_fixed0;
 
-    cr4_guest_host_mask::set(mask);
-    cr4_read_shadow::set(guest_cr4::get());
+    m_cr4_watched |= mask;
+
+    // Bits that were already masked keep the value the guest sees, and
+    // newly masked bits start out with the guest's real value.
+    //
+
+    auto old_mask = cr4_guest_host_mask::get();
+    auto new_mask = m_cr4_watched | m_eapis_vcpu_global_state->ia32_vmx_cr4_fixed0;
+
+    cr4_read_shadow::set((cr4_read_shadow::get() & old_mask) | (guest_cr4::get() & ~old_mask));
+    cr4_guest_host_mask::set(new_mask);
+}
+
+// -----------------------------------------------------------------------------
+// CR3-Target List
+// -----------------------------------------------------------------------------
+
+void
+control_register_handler::enable_cr3_target_list()
+{
+    if (m_wrcr3_exits_required) {
+        return;
+    }
+
+    auto supported = (::intel_x64::msrs::get(vmx_misc_msr) >> 16U) & 0x1FFU;
+
+    m_max_cr3_targets = std::min<std::size_t>(supported, max_cr3_targets);
+    m_last_cr3 = vmcs_n::guest_cr3::get();
+}
+
+void
+control_register_handler::disable_cr3_target_list()
+{
+    m_max_cr3_targets = 0;
+    m_num_cr3_targets = 0;
+
+    this->write_cr3_targets();
+}
+
+void
+control_register_handler::require_wrcr3_exits()
+{
+    m_wrcr3_exits_required = true;
+    this->disable_cr3_target_list();
+}
+
+void
+control_register_handler::watch_cr3(uint64_t cr3)
+{
+    if (this->is_cr3_watched(cr3)) {
+        return;
+    }
+
+    m_watched_cr3s.push_back(cr3 & cr3_address_mask);
+
+    auto targets = gsl::make_span(m_cr3_targets.data(), static_cast<std::ptrdiff_t>(m_num_cr3_targets));
+    auto last = std::remove_if(targets.begin(), targets.end(), [&](uint64_t target) {
+        return (target & cr3_address_mask) == (cr3 & cr3_address_mask);
+    });
+
+    m_num_cr3_targets = static_cast<std::size_t>(last - targets.begin());
+    this->write_cr3_targets();
+}
+
+void
+control_register_handler::unwatch_cr3(uint64_t cr3)
+{
+    m_watched_cr3s.erase(
+        std::remove(m_watched_cr3s.begin(), m_watched_cr3s.end(), cr3 & cr3_address_mask),
+        m_watched_cr3s.end()
+    );
+}
+
+bool
+control_register_handler::is_cr3_watched(uint64_t cr3) const
+{
+    return std::find(
+               m_watched_cr3s.begin(), m_watched_cr3s.end(), cr3 & cr3_address_mask
+           ) != m_watched_cr3s.end();
+}
+
+void
+control_register_handler::add_cr3_target(uint64_t cr3)
+{
+    if (m_max_cr3_targets == 0 || this->is_cr3_watched(cr3)) {
+        return;
+    }
+
+    auto num = m_num_cr3_targets;
+    for (auto i = 0U; i < m_num_cr3_targets; i++) {
+        if (m_cr3_targets.at(i) == cr3) {
+            num = i;
+            break;
+        }
+    }
+
+    if (num == m_max_cr3_targets) {
+        num--;
+        m_cr3_target_evictions++;
+    }
+    else if (num == m_num_cr3_targets) {
+        m_num_cr3_targets++;
+    }
+
+    for (auto i = num; i > 0; i--) {
+        m_cr3_targets.at(i) = m_cr3_targets.at(i - 1);
+    }
+
+    m_cr3_targets.at(0) = cr3;
+    this->write_cr3_targets();
+}
+
+void
+control_register_handler::write_cr3_targets()
+{
+    for (auto i = 0U; i < m_num_cr3_targets; i++) {
+        ::intel_x64::vm::write(cr3_target_value0_addr + (i * 2U), m_cr3_targets.at(i));
+    }
+
+    ::intel_x64::vm::write(cr3_target_count_addr, m_num_cr3_targets);
 }
 
 // -----------------------------------------------------------------------------
@@ -252,6 +407,29 @@ control_register_handler::dump_log()
     }
 }
 
+void
+control_register_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers +=
+        m_wrcr0_handlers.heap_bytes() + m_rdcr3_handlers.heap_bytes() +
+        m_wrcr3_handlers.heap_bytes() + m_wrcr4_handlers.heap_bytes() +
+        heap_bytes(m_watched_cr3s);
+
+    usage.logs += sizeof(m_cr0_log) + sizeof(m_cr3_log) + sizeof(m_cr4_log);
+}
+
+std::size_t
+control_register_handler::drain_cr0_log(gsl::span<record_t> records)
+{ return m_cr0_log.drain(records); }
+
+std::size_t
+control_register_handler::drain_cr3_log(gsl::span<record_t> records)
+{ return m_cr3_log.drain(records); }
+
+std::size_t
+control_register_handler::drain_cr4_log(gsl::span<record_t> records)
+{ return m_cr4_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -272,8 +450,8 @@ control_register_handler::handle(gsl::not_null<vmcs_t *> vmcs)
             return handle_cr4(vmcs);
 
         default:
-            throw std::runtime_error(
-                "control_register_handler::handle: invalid cr number"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle: invalid cr number"
             );
     }
 }
@@ -288,18 +466,18 @@ control_register_handler::handle_cr0(gsl::not_null<vmcs_t *> vmcs)
             return handle_wrcr0(vmcs);
 
         case access_type::mov_from_cr:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr0: mov_from_cr not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr0: mov_from_cr not supported"
             );
 
         case access_type::clts:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr0: clts not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr0: clts not supported"
             );
 
         default:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr0: lmsw not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr0: lmsw not supported"
             );
     }
 }
@@ -317,13 +495,13 @@ control_register_handler::handle_cr3(gsl::not_null<vmcs_t *> vmcs)
             return handle_rdcr3(vmcs);
 
         case access_type::clts:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr3: clts not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr3: clts not supported"
             );
 
         default:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr3: lmsw not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr3: lmsw not supported"
             );
     }
 }
@@ -338,18 +516,18 @@ control_register_handler::handle_cr4(gsl::not_null<vmcs_t *> vmcs)
             return handle_wrcr4(vmcs);
 
         case access_type::mov_from_cr:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr4: mov_from_cr not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr4: mov_from_cr not supported"
             );
 
         case access_type::clts:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr4: clts not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr4: clts not supported"
             );
 
         default:
-            throw std::runtime_error(
-                "control_register_handler::handle_cr4: lmsw not supported"
+            return this->unhandled(
+                exit_error::unsupported, "control_register_handler::handle_cr4: lmsw not supported"
             );
     }
 }
@@ -364,17 +542,28 @@ control_register_handler::handle_wrcr0(gsl::not_null<vmcs_t *> vmcs)
         false
     };
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_cr0_log, {
             info.val, info.shadow
         });
     }
 
+    auto changed = changed_bits(
+                       info.val,
+                       vmcs_n::guest_cr0::get(),
+                       info.shadow,
+                       vmcs_n::cr0_guest_host_mask::get()
+                   );
+
     info.shadow = info.val;
     info.val |= m_eapis_vcpu_global_state->ia32_vmx_cr0_fixed0;
 
-    for (const auto &d : m_wrcr0_handlers) {
-        if (d(vmcs, info)) {
+    for (const auto &h : m_wrcr0_handlers) {
+        if (h.bits != every_bit && (h.bits & changed) == 0) {
+            continue;
+        }
+
+        if (h.d(vmcs, info)) {
             break;
         }
     }
@@ -407,17 +596,13 @@ control_register_handler::handle_rdcr3(gsl::not_null<vmcs_t *> vmcs)
         false
     };
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_cr3_log, {
             info.val, info.shadow
         });
     }
 
-    for (const auto &d : m_rdcr3_handlers) {
-        if (d(vmcs, info)) {
-            break;
-        }
-    }
+    m_rdcr3_handlers.dispatch(vmcs, info);
 
     if (!info.ignore_write) {
         emulate_wrgpr(vmcs, info.val);
@@ -440,22 +625,32 @@ control_register_handler::handle_wrcr3(gsl::not_null<vmcs_t *> vmcs)
         false
     };
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_cr3_log, {
             info.val, info.shadow
         });
     }
 
-    for (const auto &d : m_wrcr3_handlers) {
-        if (d(vmcs, info)) {
-            break;
+    m_wrcr3_handlers.dispatch(vmcs, info);
+
+    // If the guest is not in the address space it switched to on the last
+    // exit, it switched at least once without exiting.
+    //
+
+    if (m_max_cr3_targets != 0) {
+        if (vmcs_n::guest_cr3::get() != m_last_cr3) {
+            m_cr3_exits_avoided++;
         }
+
+        this->add_cr3_target(info.val);
     }
 
     if (!info.ignore_write) {
         vmcs_n::guest_cr3::set(info.val & 0x7FFFFFFFFFFFFFFF);
     }
 
+    m_last_cr3 = vmcs_n::guest_cr3::get();
+
     if (!info.ignore_advance) {
         return advance(vmcs);
     }
@@ -473,17 +668,28 @@ control_register_handler::handle_wrcr4(gsl::not_null<vmcs_t *> vmcs)
         false
     };
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_cr4_log, {
             info.val, info.shadow
         });
     }
 
+    auto changed = changed_bits(
+                       info.val,
+                       vmcs_n::guest_cr4::get(),
+                       info.shadow,
+                       vmcs_n::cr4_guest_host_mask::get()
+                   );
+
     info.shadow = info.val;
     info.val |= m_eapis_vcpu_global_state->ia32_vmx_cr4_fixed0;
 
-    for (const auto &d : m_wrcr4_handlers) {
-        if (d(vmcs, info)) {
+    for (const auto &h : m_wrcr4_handlers) {
+        if (h.bits != every_bit && (h.bits & changed) == 0) {
+            continue;
+        }
+
+        if (h.d(vmcs, info)) {
             break;
         }
     }
@@ -506,5 +712,60 @@ control_register_handler::handle_wrcr4(gsl::not_null<vmcs_t *> vmcs)
     return true;
 }
 
+bool
+control_register_handler::emulate_ia_32e_mode_switch(
+    control_register_handler::info_t &info)
+{
+    using namespace vmcs_n::guest_cr0;
+    using namespace vmcs_n::guest_ia32_efer;
+    using namespace vmcs_n::vm_entry_controls;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (unrestricted_guest::is_disabled() || lme::is_disabled()) {
+        return true;
+    }
+
+    if (paging::is_enabled(info.val)) {
+        lma::enable();
+        ia_32e_mode_guest::enable();
+    }
+    else {
+        lma::disable();
+        ia_32e_mode_guest::disable();
+    }
+
+    m_apis->invalidate_ept();
+    flush_linear_mappings(false);
+
+    return true;
+}
+
+bool
+control_register_handler::default_wrcr0_handler(
+    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+{
+    using namespace vmcs_n::guest_cr0;
+    bfignored(vmcs);
+
+    if (paging::is_enabled() != paging::is_enabled(info.val)) {
+        return emulate_ia_32e_mode_switch(info);
+    }
+
+    return true;
+}
+
+bool
+control_register_handler::default_wrcr3_handler(
+    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    m_apis->invalidate_ept();
+    flush_linear_mappings(true);
+
+    return true;
+}
+
 }
 }
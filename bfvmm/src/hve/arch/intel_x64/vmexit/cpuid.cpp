@@ -30,8 +30,10 @@ handle_cpuid_feature_information(
 {
     bfignored(vmcs);
 
-    // Currently, we do not support nested virtualization. As a result,
-    // the EAPIs adds a default handler to disable support for VMXE here.
+    // Nested virtualization is only supported once it has been enabled
+    // (see nested_vmx_handler, which reports VMX support itself). Until
+    // then, the EAPIs adds a default handler to disable support for VMXE
+    // here.
     //
 
     info.rcx = clear_bit(
@@ -72,12 +74,108 @@ cpuid_handler::~cpuid_handler()
 
 void cpuid_handler::add_handler(
     leaf_t leaf, const handler_delegate_t &d)
-{ m_handlers[leaf].push_front(d); }
+{
+    leaf_handlers(leaf).handlers.push_front(d);
+    this->invalidate_cache();
+}
+
+void cpuid_handler::add_handler(
+    leaf_t leaf, subleaf_t subleaf, const handler_delegate_t &d)
+{
+    if (subleaf >= 0x100) {
+        throw std::out_of_range("cpuid_handler: invalid subleaf");
+    }
+
+    auto &hdlrs = leaf_handlers(leaf);
+
+    if (hdlrs.subleaf_handlers.size() <= subleaf) {
+        hdlrs.subleaf_handlers.resize(subleaf + 1U);
+    }
+
+    hdlrs.subleaf_handlers.at(subleaf).push_front(d);
+    this->invalidate_cache();
+}
+
+static std::ptrdiff_t
+leaf_index(cpuid_handler::leaf_t leaf) noexcept
+{
+    if (leaf <= 0x0000003FULL) {
+        return static_cast<std::ptrdiff_t>(leaf);
+    }
+
+    if (leaf >= 0x80000000ULL && leaf <= 0x8000003FULL) {
+        return static_cast<std::ptrdiff_t>(leaf - 0x80000000ULL) + 0x40;
+    }
+
+    return -1;
+}
+
+cpuid_handler::leaf_handlers_t &
+cpuid_handler::leaf_handlers(leaf_t leaf)
+{
+    auto i = leaf_index(leaf);
+
+    if (i < 0) {
+        return m_fallback_handlers[leaf];
+    }
+
+    auto &hdlrs = m_handlers.at(static_cast<std::size_t>(i));
+    if (!hdlrs) {
+        hdlrs = std::make_unique<leaf_handlers_t>();
+    }
+
+    return *hdlrs;
+}
+
+const cpuid_handler::leaf_handlers_t *
+cpuid_handler::find_handlers(leaf_t leaf) const
+{
+    auto i = leaf_index(leaf);
+
+    if (GSL_LIKELY(i >= 0)) {
+        return m_handlers[static_cast<std::size_t>(i)].get();
+    }
+
+    auto iter = m_fallback_handlers.find(leaf);
+    return iter != m_fallback_handlers.end() ? &iter->second : nullptr;
+}
+
+bool
+cpuid_handler::remove_handlers(leaf_t leaf)
+{
+    auto removed = false;
+    auto i = leaf_index(leaf);
+
+    if (i < 0) {
+        removed = m_fallback_handlers.erase(leaf) != 0;
+    }
+    else {
+        auto &hdlrs = m_handlers.at(static_cast<std::size_t>(i));
+
+        removed = static_cast<bool>(hdlrs);
+        hdlrs.reset();
+    }
+
+    this->invalidate_cache();
+    return removed;
+}
+
+void
+cpuid_handler::invalidate_cache() noexcept
+{ m_cache.clear(); }
+
+uint64_t
+cpuid_handler::cache_hits() const noexcept
+{ return m_cache_hits; }
 
 // -----------------------------------------------------------------------------
 // Debug
 // -----------------------------------------------------------------------------
 
+const exit_counters<> &
+cpuid_handler::counters() const noexcept
+{ return m_counters; }
+
 void
 cpuid_handler::dump_log()
 {
@@ -98,10 +196,36 @@ cpuid_handler::dump_log()
             bfdebug_subnhex(0, "rdx_out", record.rdx_out, msg);
         }
 
+        bfdebug_brk2(0, msg);
+
+        m_counters.for_each([&](uint64_t key, uint64_t count) {
+            bfdebug_subnhex(0, ("leaf " + bfn::to_string(key, 16)).c_str(), count, msg);
+        });
+
+        bfdebug_subnhex(0, "other", m_counters.other(), msg);
+
         bfdebug_lnbr(0, msg);
     });
 }
 
+void
+cpuid_handler::memory_usage(memory_usage_t &usage) const
+{
+    for (const auto &leaf : m_handlers) {
+        if (leaf) {
+            usage.handlers +=
+                sizeof(leaf_handlers_t) + leaf->handlers.heap_bytes() + heap_bytes(leaf->subleaf_handlers);
+        }
+    }
+
+    usage.handlers += heap_bytes(m_fallback_handlers) + heap_bytes(m_cache);
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+cpuid_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -109,55 +233,97 @@ cpuid_handler::dump_log()
 bool
 cpuid_handler::handle(gsl::not_null<vmcs_t *> vmcs)
 {
-    const auto &hdlrs =
-        m_handlers.find(vmcs->save_state()->rax);
-
-    if (hdlrs != m_handlers.end()) {
-
-        auto ret =
-            ::x64::cpuid::get(
-                gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rax),
-                gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rbx),
-                gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rcx),
-                gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rdx)
-            );
-
-        struct info_t info = {
-            ret.rax,
-            ret.rbx,
-            ret.rcx,
-            ret.rdx,
-            false,
-            false
-        };
-
-        if (!ndebug && m_log_enabled) {
-            add_record(m_log, {
-                vmcs->save_state()->rax,
-                vmcs->save_state()->rbx,
-                vmcs->save_state()->rcx,
-                vmcs->save_state()->rdx,
-                info.rax, info.rbx, info.rcx, info.rdx
-            });
+    m_counters.inc(vmcs->save_state()->rax & 0x00000000FFFFFFFFULL);
+
+    auto key =
+        ((vmcs->save_state()->rax & 0x00000000FFFFFFFFULL) << 32) |
+        ((vmcs->save_state()->rcx & 0x00000000FFFFFFFFULL) << 0);
+
+    if (!m_cache.empty()) {
+        const auto &cached = m_cache.find(key);
+
+        if (cached != m_cache.end()) {
+            vmcs->save_state()->rax = set_bits(vmcs->save_state()->rax, 0x00000000FFFFFFFFULL, cached->second.rax);
+            vmcs->save_state()->rbx = set_bits(vmcs->save_state()->rbx, 0x00000000FFFFFFFFULL, cached->second.rbx);
+            vmcs->save_state()->rcx = set_bits(vmcs->save_state()->rcx, 0x00000000FFFFFFFFULL, cached->second.rcx);
+            vmcs->save_state()->rdx = set_bits(vmcs->save_state()->rdx, 0x00000000FFFFFFFFULL, cached->second.rdx);
+
+            m_cache_hits++;
+            return advance(vmcs);
         }
+    }
+
+    const auto hdlrs =
+        find_handlers(vmcs->save_state()->rax & 0x00000000FFFFFFFFULL);
+
+    if (hdlrs == nullptr) {
+        return false;
+    }
+
+    auto subleaf = vmcs->save_state()->rcx & 0x00000000FFFFFFFFULL;
 
-        for (const auto &d : hdlrs->second) {
-            if (d(vmcs, info)) {
+    const std::array<const delegate_chain<handler_delegate_t> *, 2> chains = {
+        subleaf < hdlrs->subleaf_handlers.size() ? &hdlrs->subleaf_handlers[subleaf] : nullptr,
+        &hdlrs->handlers
+    };
 
-                if (!info.ignore_write) {
-                    vmcs->save_state()->rax = set_bits(vmcs->save_state()->rax, 0x00000000FFFFFFFFULL, info.rax);
-                    vmcs->save_state()->rbx = set_bits(vmcs->save_state()->rbx, 0x00000000FFFFFFFFULL, info.rbx);
-                    vmcs->save_state()->rcx = set_bits(vmcs->save_state()->rcx, 0x00000000FFFFFFFFULL, info.rcx);
-                    vmcs->save_state()->rdx = set_bits(vmcs->save_state()->rdx, 0x00000000FFFFFFFFULL, info.rdx);
-                }
+    if ((chains[0] == nullptr || chains[0]->empty()) && chains[1]->empty()) {
+        return false;
+    }
 
-                if (!info.ignore_advance) {
-                    return advance(vmcs);
-                }
+    auto ret =
+        ::x64::cpuid::get(
+            gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rax),
+            gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rbx),
+            gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rcx),
+            gsl::narrow_cast<::x64::cpuid::field_type>(vmcs->save_state()->rdx)
+        );
 
-                return true;
+    struct info_t info = {
+        ret.rax,
+        ret.rbx,
+        ret.rcx,
+        ret.rdx,
+        false,
+        false,
+        false
+    };
+
+    if (record_exit()) {
+        add_record(m_log, {
+            vmcs->save_state()->rax,
+            vmcs->save_state()->rbx,
+            vmcs->save_state()->rcx,
+            vmcs->save_state()->rdx,
+            info.rax, info.rbx, info.rcx, info.rdx
+        });
+    }
+
+    for (const auto chain : chains) {
+        if (chain == nullptr) {
+            continue;
+        }
+
+        if (!chain->dispatch(vmcs, info)) {
+            continue;
+        }
+
+        if (!info.ignore_write) {
+            vmcs->save_state()->rax = set_bits(vmcs->save_state()->rax, 0x00000000FFFFFFFFULL, info.rax);
+            vmcs->save_state()->rbx = set_bits(vmcs->save_state()->rbx, 0x00000000FFFFFFFFULL, info.rbx);
+            vmcs->save_state()->rcx = set_bits(vmcs->save_state()->rcx, 0x00000000FFFFFFFFULL, info.rcx);
+            vmcs->save_state()->rdx = set_bits(vmcs->save_state()->rdx, 0x00000000FFFFFFFFULL, info.rdx);
+
+            if (info.cacheable && !info.ignore_advance) {
+                m_cache[key] = {info.rax, info.rbx, info.rcx, info.rdx};
             }
         }
+
+        if (!info.ignore_advance) {
+            return advance(vmcs);
+        }
+
+        return true;
     }
 
     return false;
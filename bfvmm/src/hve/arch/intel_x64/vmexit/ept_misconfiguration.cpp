@@ -26,7 +26,9 @@ namespace intel_x64
 
 ept_misconfiguration_handler::ept_misconfiguration_handler(
     gsl::not_null<apis *> apis,
-    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis}
 {
     using namespace vmcs_n;
     bfignored(eapis_vcpu_global_state);
@@ -49,8 +51,9 @@ ept_misconfiguration_handler::~ept_misconfiguration_handler()
 // -----------------------------------------------------------------------------
 
 void
-ept_misconfiguration_handler::add_handler(const handler_delegate_t &d)
-{ m_handlers.push_front(d); }
+ept_misconfiguration_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
 
 // -----------------------------------------------------------------------------
 // Debug
@@ -74,6 +77,17 @@ ept_misconfiguration_handler::dump_log()
     });
 }
 
+void
+ept_misconfiguration_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers += m_handlers.heap_bytes();
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+ept_misconfiguration_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -82,28 +96,35 @@ bool
 ept_misconfiguration_handler::handle(gsl::not_null<vmcs_t *> vmcs)
 {
     struct info_t info = {
-        vmcs_n::guest_linear_address::get(),
-        vmcs_n::guest_physical_address::get(),
+        this->vmread(vmcs_n::guest_linear_address::addr),
+        this->vmread(vmcs_n::guest_physical_address::addr),
         false
     };
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_log, {info.gva, info.gpa});
     }
 
-    for (const auto &d : m_handlers) {
-        if (d(vmcs, info)) {
+    // Device regions are mapped misconfigured on purpose, and the MMIO
+    // handler has already advanced the guest once it emulates the access
+    //
+
+    if (m_has_mmio && m_mmio(vmcs, info.gpa)) {
+        return true;
+    }
 
-            if (!info.ignore_advance) {
-                return advance(vmcs);
-            }
+    if (m_handlers.dispatch(vmcs, info)) {
+        m_apis->invalidate_ept();
 
-            return true;
+        if (!info.ignore_advance) {
+            return advance(vmcs);
         }
+
+        return true;
     }
 
-    throw std::runtime_error(
-        "ept_misconfiguration_handler::handle: unhandled ept misconfiguration"
+    return this->unhandled(
+        exit_error::unhandled_exit, "ept_misconfiguration_handler::handle: unhandled ept misconfiguration"
     );
 }
 
@@ -24,9 +24,20 @@ namespace eapis
 namespace intel_x64
 {
 
+// Sub-page write permissions. These are not defined by the base
+// hypervisor, so they are defined here. Bit 11 of the exit qualification
+// is set for EPT violations caused by a page's write permission vector,
+// and for SPP-related events caused by an SPPT miss (it is clear for an
+// SPPT misconfiguration).
+//
+constexpr const uint64_t spp_related_event = 66U;
+constexpr const uint64_t spp_qualification_mask = 1ULL << 11;
+
 ept_violation_handler::ept_violation_handler(
     gsl::not_null<apis *> apis,
-    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis}
 {
     using namespace vmcs_n;
     bfignored(eapis_vcpu_global_state);
@@ -35,6 +46,11 @@ ept_violation_handler::ept_violation_handler(
         exit_reason::basic_exit_reason::ept_violation,
         ::handler_delegate_t::create<ept_violation_handler, &ept_violation_handler::handle>(this)
     );
+
+    apis->add_handler(
+        spp_related_event,
+        ::handler_delegate_t::create<ept_violation_handler, &ept_violation_handler::handle_spp>(this)
+    );
 }
 
 ept_violation_handler::~ept_violation_handler()
@@ -50,18 +66,195 @@ ept_violation_handler::~ept_violation_handler()
 
 void
 ept_violation_handler::add_read_handler(
-    const handler_delegate_t &d)
-{ m_read_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_read_handlers.push_front(d, priority); }
 
 void
 ept_violation_handler::add_write_handler(
-    const handler_delegate_t &d)
-{ m_write_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_write_handlers.push_front(d, priority); }
 
 void
 ept_violation_handler::add_execute_handler(
-    const handler_delegate_t &d)
-{ m_execute_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_execute_handlers.push_front(d, priority); }
+
+void
+ept_violation_handler::add_spp_handler(
+    const spp_delegate_t &d, int64_t priority)
+{ m_spp_handlers.push_front(d, priority); }
+
+bool
+ept_violation_handler::is_sub_page_violation(const info_t &info) noexcept
+{ return (info.exit_qualification & spp_qualification_mask) != 0; }
+
+void
+ept_violation_handler::access_handlers_t::push_front(
+    uint64_t access, const handler_delegate_t &d, int64_t priority)
+{
+    if ((access & access_read) != 0) {
+        read.push_front(d, priority);
+    }
+
+    if ((access & access_write) != 0) {
+        write.push_front(d, priority);
+    }
+
+    if ((access & access_execute) != 0) {
+        execute.push_front(d, priority);
+    }
+}
+
+void
+ept_violation_handler::add_page_handler(
+    uint64_t gpa, uint64_t access, const handler_delegate_t &d, int64_t priority)
+{
+    expects(access != 0);
+    m_page_handlers[gpa >> ::x64::pt::from].push_front(access, d, priority);
+}
+
+bool
+ept_violation_handler::remove_page_handlers(uint64_t gpa)
+{ return m_page_handlers.erase(gpa >> ::x64::pt::from) != 0; }
+
+void
+ept_violation_handler::add_range_handler(
+    uint64_t first, uint64_t last, uint64_t access, const handler_delegate_t &d,
+    int64_t priority)
+{
+    expects(first <= last);
+    expects(access != 0);
+
+    auto iter = std::lower_bound(
+        m_range_handlers.begin(), m_range_handlers.end(), first,
+    [](const auto & range, auto gpa) { return range.first < gpa; });
+
+    if (iter != m_range_handlers.end() && iter->first == first && iter->last == last) {
+        return iter->handlers.push_front(access, d, priority);
+    }
+
+    if (iter != m_range_handlers.end() && iter->first <= last) {
+        throw std::runtime_error("add_range_handler: range overlaps an existing range");
+    }
+
+    if (iter != m_range_handlers.begin() && std::prev(iter)->last >= first) {
+        throw std::runtime_error("add_range_handler: range overlaps an existing range");
+    }
+
+    iter = m_range_handlers.insert(iter, {first, last, {}});
+    iter->handlers.push_front(access, d, priority);
+}
+
+bool
+ept_violation_handler::remove_range_handlers(uint64_t first)
+{
+    auto iter = std::find_if(
+        m_range_handlers.begin(), m_range_handlers.end(),
+    [first](const auto & range) { return range.first == first; });
+
+    if (iter == m_range_handlers.end()) {
+        return false;
+    }
+
+    m_range_handlers.erase(iter);
+    return true;
+}
+
+void
+ept_violation_handler::add_mmio_handler(
+    uint64_t first, uint64_t last, const mmio_delegate_t &d)
+{
+    expects(first <= last);
+    insert_mmio_range({first, last, d, false});
+}
+
+void
+ept_violation_handler::add_coalesced_mmio_handler(
+    uint64_t first, uint64_t last, const mmio_delegate_t &d)
+{
+    expects(first <= last);
+
+    if (m_coalesced == nullptr || !m_coalesced->has_flush_handler()) {
+        throw std::runtime_error("add_coalesced_mmio_handler: no coalesced ring");
+    }
+
+    insert_mmio_range({first, last, d, true});
+}
+
+void
+ept_violation_handler::add_doorbell(uint64_t gpa, uint64_t val, uint64_t bit)
+{
+    expects(bit < doorbell_bitmap<>::size());
+
+    if (m_doorbells == nullptr) {
+        throw std::runtime_error("add_doorbell: no doorbell bitmap");
+    }
+
+    if (!m_decoder) {
+        m_decoder = std::make_unique<insn_decoder>();
+        m_decoder->set_guest_memory(m_guest_memory);
+    }
+
+    m_doorbell_table.add(gpa, val, bit);
+}
+
+void
+ept_violation_handler::insert_mmio_range(const mmio_range_t &range)
+{
+    auto iter = std::lower_bound(
+        m_mmio_ranges.begin(), m_mmio_ranges.end(), range.first,
+    [](const auto & r, auto gpa) { return r.first < gpa; });
+
+    if (iter != m_mmio_ranges.end() && iter->first <= range.last) {
+        throw std::runtime_error("add_mmio_handler: range overlaps an existing range");
+    }
+
+    if (iter != m_mmio_ranges.begin() && std::prev(iter)->last >= range.first) {
+        throw std::runtime_error("add_mmio_handler: range overlaps an existing range");
+    }
+
+    if (!m_decoder) {
+        m_decoder = std::make_unique<insn_decoder>();
+        m_decoder->set_guest_memory(m_guest_memory);
+    }
+
+    m_mmio_ranges.insert(iter, range);
+}
+
+void
+ept_violation_handler::set_guest_memory(guest_memory *mem) noexcept
+{
+    m_guest_memory = mem;
+
+    if (m_decoder) {
+        m_decoder->set_guest_memory(mem);
+    }
+}
+
+bool
+ept_violation_handler::remove_mmio_handler(uint64_t first)
+{
+    auto iter = std::find_if(
+        m_mmio_ranges.begin(), m_mmio_ranges.end(),
+    [first](const auto & range) { return range.first == first; });
+
+    if (iter == m_mmio_ranges.end()) {
+        return false;
+    }
+
+    m_mmio_ranges.erase(iter);
+    return true;
+}
+
+bool
+ept_violation_handler::emulate_mmio(gsl::not_null<vmcs_t *> vmcs, uint64_t gpa)
+{
+    if (!m_doorbell_table.empty() && handle_doorbell(vmcs, gpa)) {
+        return true;
+    }
+
+    return !m_mmio_ranges.empty() && handle_mmio(vmcs, gpa);
+}
 
 // -----------------------------------------------------------------------------
 // Debug
@@ -86,6 +279,26 @@ ept_violation_handler::dump_log()
     });
 }
 
+void
+ept_violation_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers +=
+        m_read_handlers.heap_bytes() + m_write_handlers.heap_bytes() +
+        m_execute_handlers.heap_bytes() + m_spp_handlers.heap_bytes() +
+        heap_bytes(m_page_handlers) + heap_bytes(m_range_handlers) + heap_bytes(m_mmio_ranges) +
+        m_doorbell_table.heap_bytes();
+
+    if (m_decoder) {
+        usage.handlers += m_decoder->heap_bytes();
+    }
+
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+ept_violation_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -94,19 +307,29 @@ bool
 ept_violation_handler::handle(gsl::not_null<vmcs_t *> vmcs)
 {
     using namespace vmcs_n;
-    auto qual = exit_qualification::ept_violation::get();
+    auto qual = this->vmread(exit_qualification::addr);
 
     struct info_t info = {
-        guest_linear_address::get(),
-        guest_physical_address::get(),
+        this->vmread(guest_linear_address::addr),
+        this->vmread(guest_physical_address::addr),
         qual,
         true
     };
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_log, {info.gva, info.gpa, info.exit_qualification});
     }
 
+    if (exit_qualification::ept_violation::data_write::is_enabled(qual)) {
+        if (!m_doorbell_table.empty() && handle_doorbell(vmcs, info.gpa)) {
+            return true;
+        }
+    }
+
+    if (!m_mmio_ranges.empty() && handle_mmio(vmcs, info.gpa)) {
+        return true;
+    }
+
     if (exit_qualification::ept_violation::data_read::is_enabled(qual)) {
         return handle_read(vmcs, info);
     }
@@ -119,66 +342,268 @@ ept_violation_handler::handle(gsl::not_null<vmcs_t *> vmcs)
         return handle_execute(vmcs, info);
     }
 
-    throw std::runtime_error(
-        "ept_violation_handler::handle: unhandled ept violation"
+    return this->unhandled(
+        exit_error::unhandled_exit, "ept_violation_handler::handle: unhandled ept violation"
     );
 }
 
 bool
-ept_violation_handler::handle_read(gsl::not_null<vmcs_t *> vmcs, info_t &info)
+ept_violation_handler::handle_spp(gsl::not_null<vmcs_t *> vmcs)
 {
-    for (const auto &d : m_read_handlers) {
-        if (d(vmcs, info)) {
+    using namespace vmcs_n;
 
-            if (!info.ignore_advance) {
-                return advance(vmcs);
-            }
+    struct spp_info_t info = {
+        this->vmread(guest_physical_address::addr),
+        (this->vmread(exit_qualification::addr) & spp_qualification_mask) == 0
+    };
 
-            return true;
-        }
+    if (m_spp_handlers.dispatch(vmcs, info)) {
+        m_apis->invalidate_ept();
+        return true;
+    }
+
+    return this->unhandled(
+        exit_error::unhandled_exit, info.misconfiguration ?
+        "ept_violation_handler: unhandled SPPT misconfiguration" :
+        "ept_violation_handler: unhandled SPPT miss"
+    );
+}
+
+bool
+ept_violation_handler::handle_read(gsl::not_null<vmcs_t *> vmcs, info_t &info)
+{
+    if (walk_page(&access_handlers_t::read, vmcs, info) || walk(m_read_handlers, vmcs, info)) {
+        return this->handled(vmcs, info);
     }
 
-    throw std::runtime_error(
-        "ept_violation_handler: unhandled ept read violation"
+    return this->unhandled(
+        exit_error::unhandled_read, "ept_violation_handler: unhandled ept read violation"
     );
 }
 
 bool
 ept_violation_handler::handle_write(gsl::not_null<vmcs_t *> vmcs, info_t &info)
 {
-    for (const auto &d : m_write_handlers) {
-        if (d(vmcs, info)) {
+    // The guest might be writing to code we have already decoded (e.g. a
+    // write protected code page that is being patched)
+    //
 
-            if (!info.ignore_advance) {
-                return advance(vmcs);
-            }
+    if (m_decoder) {
+        m_decoder->cache().invalidate_page(info.gva);
+    }
 
-            return true;
-        }
+    if (walk_page(&access_handlers_t::write, vmcs, info) || walk(m_write_handlers, vmcs, info)) {
+        return this->handled(vmcs, info);
     }
 
-    throw std::runtime_error(
-        "ept_violation_handler: unhandled ept write violation"
+    return this->unhandled(
+        exit_error::unhandled_write, "ept_violation_handler: unhandled ept write violation"
     );
 }
 
 bool
 ept_violation_handler::handle_execute(gsl::not_null<vmcs_t *> vmcs, info_t &info)
 {
-    for (const auto &d : m_execute_handlers) {
-        if (d(vmcs, info)) {
+    if (walk_page(&access_handlers_t::execute, vmcs, info) || walk(m_execute_handlers, vmcs, info)) {
+        return this->handled(vmcs, info);
+    }
+
+    return this->unhandled(
+        exit_error::unhandled_execute, "ept_violation_handler: unhandled ept execute violation"
+    );
+}
+
+bool
+ept_violation_handler::handled(gsl::not_null<vmcs_t *> vmcs, info_t &info)
+{
+    m_apis->invalidate_ept();
+
+    if (!info.ignore_advance) {
+        return advance(vmcs);
+    }
 
-            if (!info.ignore_advance) {
-                return advance(vmcs);
-            }
+    return true;
+}
 
+bool
+ept_violation_handler::walk(
+    const delegate_chain<handler_delegate_t> &handlers,
+    gsl::not_null<vmcs_t *> vmcs, info_t &info)
+{ return handlers.dispatch(vmcs, info); }
+
+bool
+ept_violation_handler::walk_page(
+    access_chain_t chain, gsl::not_null<vmcs_t *> vmcs, info_t &info)
+{
+    if (!m_page_handlers.empty()) {
+        auto iter = m_page_handlers.find(info.gpa >> ::x64::pt::from);
+
+        if (iter != m_page_handlers.end() && walk(iter->second.*chain, vmcs, info)) {
             return true;
         }
     }
 
-    throw std::runtime_error(
-        "ept_violation_handler: unhandled ept execute violation"
-    );
+    if (!m_range_handlers.empty()) {
+        auto range = find_range(info.gpa);
+
+        if (range != nullptr && walk(range->handlers.*chain, vmcs, info)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ept_violation_handler::range_handlers_t *
+ept_violation_handler::find_range(uint64_t gpa) noexcept
+{
+    auto iter = std::upper_bound(
+        m_range_handlers.begin(), m_range_handlers.end(), gpa,
+    [](auto addr, const auto & range) { return addr < range.first; });
+
+    if (iter == m_range_handlers.begin()) {
+        return nullptr;
+    }
+
+    --iter;
+    return gpa <= iter->last ? &*iter : nullptr;
+}
+
+// -----------------------------------------------------------------------------
+// MMIO
+// -----------------------------------------------------------------------------
+
+static uint64_t
+mask(uint64_t val, uint64_t size) noexcept
+{ return size >= 8 ? val : val & ((1ULL << (size * 8)) - 1); }
+
+static uint64_t
+read_reg(const capstone::save_state_t *state, const capstone::reg &reg) noexcept
+{ return mask(capstone::read<uint64_t>(state, reg.byte_offset), reg.width); }
+
+static void
+write_reg(capstone::save_state_t *state, const capstone::reg &reg, uint64_t val) noexcept
+{
+    auto addr = reinterpret_cast<uintptr_t>(state) + reg.byte_offset;
+
+    // As with the real instruction, 32 bit loads zero the upper half of
+    // the register, while 8 and 16 bit loads leave the rest alone.
+    //
+
+    switch (reg.width) {
+        case capstone::qword:
+        case capstone::dword:
+            *reinterpret_cast<uint64_t *>(addr) = mask(val, reg.width);
+            break;
+
+        case capstone::word:
+            *reinterpret_cast<uint16_t *>(addr) = static_cast<uint16_t>(val);
+            break;
+
+        case capstone::byte:
+            *reinterpret_cast<uint8_t *>(addr) = static_cast<uint8_t>(val);
+            break;
+    }
+}
+
+const ept_violation_handler::mmio_range_t *
+ept_violation_handler::find_mmio_range(uint64_t gpa) const noexcept
+{
+    auto iter = std::upper_bound(
+        m_mmio_ranges.begin(), m_mmio_ranges.end(), gpa,
+    [](auto addr, const auto & range) { return addr < range.first; });
+
+    if (iter == m_mmio_ranges.begin()) {
+        return nullptr;
+    }
+
+    --iter;
+    return gpa <= iter->last ? &*iter : nullptr;
+}
+
+bool
+ept_violation_handler::handle_mmio(gsl::not_null<vmcs_t *> vmcs, uint64_t gpa)
+{
+    auto range = find_mmio_range(gpa);
+    if (range == nullptr) {
+        return false;
+    }
+
+    auto insn = m_decoder->decode(vmcs);
+    if (insn == nullptr) {
+        return false;
+    }
+
+    auto state = vmcs->save_state();
+    struct mmio_info_t mmio_info = {
+        gpa, insn->size, insn->write, 0
+    };
+
+    if (insn->write) {
+        mmio_info.val = mask(insn->imm ? insn->imm_val : read_reg(state, insn->reg), insn->size);
+    }
+
+    if (range->coalesced) {
+        if (insn->write) {
+            m_coalesced->push({
+                gpa, mmio_info.val, gsl::narrow_cast<uint32_t>(insn->size), 1U
+            });
+
+            state->rip += insn->len;
+            return true;
+        }
+
+        m_coalesced->flush();
+    }
+
+    if (!range->d(vmcs, mmio_info)) {
+        return false;
+    }
+
+    // The value is masked to the size of the access, which matters for
+    // MOVZX, where the register is wider than the access
+    //
+
+    if (!insn->write) {
+        write_reg(state, insn->reg, mask(mmio_info.val, insn->size));
+    }
+
+    // The VM exit instruction length is not valid for EPT violations, so
+    // the decoded length is used instead of advance()
+    //
+
+    state->rip += insn->len;
+    return true;
+}
+
+bool
+ept_violation_handler::handle_doorbell(gsl::not_null<vmcs_t *> vmcs, uint64_t gpa)
+{
+    if (!m_doorbell_table.contains(gpa)) {
+        return false;
+    }
+
+    auto insn = m_decoder->decode(vmcs);
+    if (insn == nullptr || !insn->write) {
+        return false;
+    }
+
+    auto state = vmcs->save_state();
+    auto val = mask(insn->imm ? insn->imm_val : read_reg(state, insn->reg), insn->size);
+
+    uint64_t bit;
+    if (!m_doorbell_table.find(gpa, val, bit)) {
+        return false;
+    }
+
+    if (m_coalesced != nullptr) {
+        m_coalesced->flush();
+    }
+
+    m_doorbells->ring(bit);
+
+    state->rip += insn->len;
+    return true;
 }
 
 }
@@ -50,21 +50,39 @@ external_interrupt_handler::~external_interrupt_handler()
 
 void
 external_interrupt_handler::add_handler(
-    const handler_delegate_t &d)
-{ m_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
 
 void
 external_interrupt_handler::enable_exiting()
 {
-    vmcs_n::pin_based_vm_execution_controls::external_interrupt_exiting::enable();
-    vmcs_n::vm_exit_controls::acknowledge_interrupt_on_exit::enable();
+    using namespace vmcs_n;
+
+    this->vmset_bits(
+        pin_based_vm_execution_controls::addr,
+        pin_based_vm_execution_controls::external_interrupt_exiting::mask
+    );
+
+    this->vmset_bits(
+        vm_exit_controls::addr,
+        vm_exit_controls::acknowledge_interrupt_on_exit::mask
+    );
 }
 
 void
 external_interrupt_handler::disable_exiting()
 {
-    vmcs_n::pin_based_vm_execution_controls::external_interrupt_exiting::disable();
-    vmcs_n::vm_exit_controls::acknowledge_interrupt_on_exit::disable();
+    using namespace vmcs_n;
+
+    this->vmclear_bits(
+        pin_based_vm_execution_controls::addr,
+        pin_based_vm_execution_controls::external_interrupt_exiting::mask
+    );
+
+    this->vmclear_bits(
+        vm_exit_controls::addr,
+        vm_exit_controls::acknowledge_interrupt_on_exit::mask
+    );
 }
 
 // -----------------------------------------------------------------------------
@@ -89,6 +107,13 @@ external_interrupt_handler::dump_log()
     });
 }
 
+void
+external_interrupt_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers += m_handlers.heap_bytes();
+    usage.logs += sizeof(m_log);
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -100,18 +125,16 @@ external_interrupt_handler::handle(gsl::not_null<vmcs_t *> vmcs)
         vmcs_n::vm_exit_interruption_information::vector::get()
     };
 
-    if (!ndebug && m_log_enabled) {
+    if ((!ndebug && m_log_enabled) || stats_enabled()) {
         m_log.at(info.vector)++;
     }
 
-    for (const auto &d : m_handlers) {
-        if (d(vmcs, info)) {
-            return true;
-        }
+    if (m_handlers.dispatch(vmcs, info)) {
+        return true;
     }
 
-    throw std::runtime_error(
-        "Unhandled interrupt vector: " + std::to_string(info.vector)
+    return this->unhandled(
+        exit_error::unhandled_exit, "Unhandled interrupt vector"
     );
 }
 
@@ -0,0 +1,223 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// HLT exiting. These are not defined by the base hypervisor, so they are
+// defined here.
+//
+constexpr const uint64_t hlt_exit_reason = 12U;
+constexpr const uint64_t hlt_exiting = 1ULL << 7;
+
+// x2APIC IRR. The IRR MSRs can only be read in x2APIC mode (otherwise
+// the read would #GP).
+//
+constexpr const auto x2apic_irr0_msr = 0x820U;
+constexpr const auto x2apic_irr_msrs = 8U;
+constexpr const auto apic_base_msr = 0x1BU;
+constexpr const uint64_t apic_base_x2apic_mode = 1ULL << 10;
+
+hlt_handler::hlt_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+{
+    bfignored(eapis_vcpu_global_state);
+
+    apis->add_handler(
+        hlt_exit_reason,
+        ::handler_delegate_t::create<hlt_handler, &hlt_handler::handle>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+hlt_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+void
+hlt_handler::enable_exiting()
+{
+    using namespace vmcs_n;
+
+    this->vmwrite(
+        primary_processor_based_vm_execution_controls::addr,
+        this->vmread(primary_processor_based_vm_execution_controls::addr) | hlt_exiting
+    );
+}
+
+void
+hlt_handler::disable_exiting()
+{
+    using namespace vmcs_n;
+
+    this->vmwrite(
+        primary_processor_based_vm_execution_controls::addr,
+        this->vmread(primary_processor_based_vm_execution_controls::addr) & ~hlt_exiting
+    );
+}
+
+void
+hlt_handler::set_max_poll(uint64_t max_poll) noexcept
+{
+    m_max_poll = max_poll;
+    m_poll = std::min(m_poll, m_max_poll);
+}
+
+// -----------------------------------------------------------------------------
+// Debug
+// -----------------------------------------------------------------------------
+
+void
+hlt_handler::dump_log()
+{
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "hlt stats", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subnhex(0, "exits", m_exits, msg);
+        bfdebug_subnhex(0, "polls", m_polls, msg);
+        bfdebug_subnhex(0, "poll hits", m_poll_hits, msg);
+        bfdebug_subnhex(0, "poll success rate (%)", this->poll_success_rate(), msg);
+        bfdebug_subnhex(0, "blocks", m_blocks, msg);
+        bfdebug_subnhex(0, "poll window", m_poll, msg);
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+hlt_handler::host_x2apic_mode()
+{ return (::intel_x64::msrs::get(apic_base_msr) & apic_base_x2apic_mode) != 0; }
+
+bool
+hlt_handler::host_interrupt_pending()
+{
+    for (auto i = 0U; i < x2apic_irr_msrs; i++) {
+        if (::intel_x64::msrs::get(x2apic_irr0_msr + i) != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+hlt_handler::poll()
+{
+    if (m_poll == 0) {
+        m_poll = std::min(default_poll_start, m_max_poll);
+        return false;
+    }
+
+    m_polls++;
+
+    const auto start = __builtin_ia32_rdtsc();
+    const auto end = start + m_poll;
+
+    auto now = start;
+    do {
+        if (host_interrupt_pending()) {
+            m_poll_hits++;
+
+            // Note
+            //
+            // A wakeup found in the second half of the window would likely
+            // have been missed with a smaller one, so the window grows.
+            //
+
+            if ((now - start) > (m_poll >> 1U)) {
+                m_poll = std::min(m_poll << 1U, m_max_poll);
+            }
+
+            return true;
+        }
+
+        __builtin_ia32_pause();
+        now = __builtin_ia32_rdtsc();
+    }
+    while (now < end);
+
+    m_poll >>= 1U;
+    return false;
+}
+
+bool
+hlt_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    using namespace vmcs_n;
+
+    m_exits++;
+
+    struct info_t info = {
+        false
+    };
+
+    if (m_handlers.dispatch(vmcs, info)) {
+        if (!info.ignore_advance) {
+            return advance(vmcs);
+        }
+
+        return true;
+    }
+
+    const auto rflags = this->vmread(guest_rflags::addr);
+    const auto if_set = guest_rflags::interrupt_enable_flag::is_enabled(rflags);
+
+    if (if_set && m_interrupt_window != nullptr) {
+        if (m_interrupt_window->num_pending() != 0) {
+            advance(vmcs);
+            m_interrupt_window->inject_pending();
+
+            return true;
+        }
+    }
+
+    // Note
+    //
+    // With interrupts disabled, only an NMI, SMI or INIT can wake the
+    // guest, so there is nothing to poll for. The host's IRR is read
+    // through the x2APIC MSRs, so an xAPIC host is not polled either.
+    //
+
+    if (if_set && m_max_poll != 0 && host_x2apic_mode() && this->poll()) {
+        return advance(vmcs);
+    }
+
+    m_blocks++;
+    this->vmwrite(guest_activity_state::addr, guest_activity_state::hlt);
+
+    return advance(vmcs);
+}
+
+}
+}
@@ -24,11 +24,106 @@ namespace eapis
 namespace intel_x64
 {
 
+// x2APIC fields
+//
+constexpr const auto x2apic_id_msr = 0x802U;
+constexpr const auto apic_base_msr = 0x1BU;
+constexpr const uint64_t apic_base_x2apic_mode = 1ULL << 10;
+
+constexpr const uint64_t icr_logical_mask = 0x0000000000000800ULL;
+constexpr const uint64_t icr_shorthand_mask = 0x00000000000C0000ULL;
+constexpr const uint64_t icr_destination_from = 32;
+
+constexpr const uint64_t icr_delivery_mode_startup = 6;
+
+// The number of times a SIPI spins (with a pause) waiting for the target
+// to be reset by the INIT that was sent to it before the SIPI is sent
+// anyway. A target normally takes its INIT exit within microseconds.
+//
+constexpr const uint64_t sipi_wait_limit = 0x100000;
+
+// INIT Reset State
+//
+// The guest state the SDM defines after INIT, for every field the VMCS
+// controls (other than CR0 and CR4, which depend on the fixed bits). This
+// is applied in a single pass on each INIT instead of field by field.
+//
+struct reset_field_t {
+    uint64_t addr;
+    uint64_t val;
+};
+
+constexpr const std::array<reset_field_t, 45> reset_state = {{
+    {vmcs_n::guest_rflags::addr, 0x00000002},
+    {vmcs_n::guest_cr3::addr, 0},
+    {vmcs_n::cr0_read_shadow::addr, 0x60000010},
+    {vmcs_n::cr4_read_shadow::addr, 0},
+
+    {vmcs_n::guest_cs_selector::addr, 0xF000},
+    {vmcs_n::guest_cs_base::addr, 0xFFFF0000},
+    {vmcs_n::guest_cs_limit::addr, 0xFFFF},
+    {vmcs_n::guest_cs_access_rights::addr, 0x9B},
+
+    {vmcs_n::guest_ss_selector::addr, 0},
+    {vmcs_n::guest_ss_base::addr, 0},
+    {vmcs_n::guest_ss_limit::addr, 0xFFFF},
+    {vmcs_n::guest_ss_access_rights::addr, 0x93},
+
+    {vmcs_n::guest_ds_selector::addr, 0},
+    {vmcs_n::guest_ds_base::addr, 0},
+    {vmcs_n::guest_ds_limit::addr, 0xFFFF},
+    {vmcs_n::guest_ds_access_rights::addr, 0x93},
+
+    {vmcs_n::guest_es_selector::addr, 0},
+    {vmcs_n::guest_es_base::addr, 0},
+    {vmcs_n::guest_es_limit::addr, 0xFFFF},
+    {vmcs_n::guest_es_access_rights::addr, 0x93},
+
+    {vmcs_n::guest_fs_selector::addr, 0},
+    {vmcs_n::guest_fs_base::addr, 0},
+    {vmcs_n::guest_fs_limit::addr, 0xFFFF},
+    {vmcs_n::guest_fs_access_rights::addr, 0x93},
+
+    {vmcs_n::guest_gs_selector::addr, 0},
+    {vmcs_n::guest_gs_base::addr, 0},
+    {vmcs_n::guest_gs_limit::addr, 0xFFFF},
+    {vmcs_n::guest_gs_access_rights::addr, 0x93},
+
+    {vmcs_n::guest_gdtr_base::addr, 0},
+    {vmcs_n::guest_gdtr_limit::addr, 0xFFFF},
+
+    {vmcs_n::guest_idtr_base::addr, 0},
+    {vmcs_n::guest_idtr_limit::addr, 0xFFFF},
+
+    {vmcs_n::guest_ldtr_selector::addr, 0},
+    {vmcs_n::guest_ldtr_base::addr, 0},
+    {vmcs_n::guest_ldtr_limit::addr, 0xFFFF},
+    {vmcs_n::guest_ldtr_access_rights::addr, 0x82},
+
+    {vmcs_n::guest_tr_selector::addr, 0},
+    {vmcs_n::guest_tr_base::addr, 0},
+    {vmcs_n::guest_tr_limit::addr, 0xFFFF},
+    {vmcs_n::guest_tr_access_rights::addr, 0x8B},
+
+    {vmcs_n::guest_dr7::addr, 0x00000400},
+    {vmcs_n::guest_ia32_efer::addr, 0},
+
+    {vmcs_n::guest_interruptibility_state::addr, 0},
+    {vmcs_n::guest_pending_debug_exceptions::addr, 0},
+
+    {
+        vmcs_n::guest_activity_state::addr,
+        vmcs_n::guest_activity_state::wait_for_sipi
+    }
+}};
+
 init_signal_handler::init_signal_handler(
     gsl::not_null<apis *> apis,
     gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
 ) :
-    m_eapis_vcpu_global_state{eapis_vcpu_global_state}
+    m_eapis_vcpu_global_state{eapis_vcpu_global_state},
+    m_reset_cr0{0x60000010 | eapis_vcpu_global_state->ia32_vmx_cr0_fixed0},
+    m_reset_cr4{0x00000000 | eapis_vcpu_global_state->ia32_vmx_cr4_fixed0}
 {
     using namespace vmcs_n;
 
@@ -50,11 +145,8 @@ init_signal_handler::init_signal_handler(
 bool
 init_signal_handler::handle(gsl::not_null<vmcs_t *> vmcs)
 {
-    using namespace vmcs_n::guest_activity_state;
     using namespace vmcs_n::vm_entry_controls;
 
-    bfignored(vmcs);
-
     // TODO:
     //
     // - Currently, there are several registers that the VMCS does not control
@@ -78,104 +170,62 @@ init_signal_handler::handle(gsl::not_null<vmcs_t *> vmcs)
     //   at some point, we should fill in the proper value
     //
 
-    vmcs_n::guest_rflags::set(0x00000002);
-    vmcs->save_state()->rip = 0x0000FFF0;
-
-    vmcs_n::guest_cr0::set(0x60000010 | m_eapis_vcpu_global_state->ia32_vmx_cr0_fixed0);
-    vmcs_n::guest_cr3::set(0);
-    vmcs_n::guest_cr4::set(0x00000000 | m_eapis_vcpu_global_state->ia32_vmx_cr4_fixed0);
-
-    vmcs_n::cr0_read_shadow::set(0x60000010);
-    vmcs_n::cr4_read_shadow::set(0);
-
-    vmcs_n::guest_cs_selector::set(0xF000);
-    vmcs_n::guest_cs_base::set(0xFFFF0000);
-    vmcs_n::guest_cs_limit::set(0xFFFF);
-    vmcs_n::guest_cs_access_rights::set(0x9B);
-
-    vmcs_n::guest_ss_selector::set(0);
-    vmcs_n::guest_ss_base::set(0);
-    vmcs_n::guest_ss_limit::set(0xFFFF);
-    vmcs_n::guest_ss_access_rights::set(0x93);
-
-    vmcs_n::guest_ds_selector::set(0);
-    vmcs_n::guest_ds_base::set(0);
-    vmcs_n::guest_ds_limit::set(0xFFFF);
-    vmcs_n::guest_ds_access_rights::set(0x93);
-
-    vmcs_n::guest_es_selector::set(0);
-    vmcs_n::guest_es_base::set(0);
-    vmcs_n::guest_es_limit::set(0xFFFF);
-    vmcs_n::guest_es_access_rights::set(0x93);
-
-    vmcs_n::guest_fs_selector::set(0);
-    vmcs_n::guest_fs_base::set(0);
-    vmcs_n::guest_fs_limit::set(0xFFFF);
-    vmcs_n::guest_fs_access_rights::set(0x93);
-
-    vmcs_n::guest_gs_selector::set(0);
-    vmcs_n::guest_gs_base::set(0);
-    vmcs_n::guest_gs_limit::set(0xFFFF);
-    vmcs_n::guest_gs_access_rights::set(0x93);
-
-    vmcs->save_state()->rdx = 0x00000600;
-    vmcs->save_state()->rax = 0;
-    vmcs->save_state()->rbx = 0;
-    vmcs->save_state()->rcx = 0;
-    vmcs->save_state()->rsi = 0;
-    vmcs->save_state()->rdi = 0;
-    vmcs->save_state()->rbp = 0;
-    vmcs->save_state()->rsp = 0;
-
-    vmcs_n::guest_gdtr_base::set(0);
-    vmcs_n::guest_gdtr_limit::set(0xFFFF);
-
-    vmcs_n::guest_idtr_base::set(0);
-    vmcs_n::guest_idtr_limit::set(0xFFFF);
-
-    vmcs_n::guest_ldtr_selector::set(0);
-    vmcs_n::guest_ldtr_base::set(0);
-    vmcs_n::guest_ldtr_limit::set(0xFFFF);
-    vmcs_n::guest_ldtr_access_rights::set(0x82);
-
-    vmcs_n::guest_tr_selector::set(0);
-    vmcs_n::guest_tr_base::set(0);
-    vmcs_n::guest_tr_limit::set(0xFFFF);
-    vmcs_n::guest_tr_access_rights::set(0x8B);
-
-    vmcs_n::guest_dr7::set(0x00000400);
-
-    vmcs->save_state()->r08 = 0;
-    vmcs->save_state()->r09 = 0;
-    vmcs->save_state()->r10 = 0;
-    vmcs->save_state()->r11 = 0;
-    vmcs->save_state()->r12 = 0;
-    vmcs->save_state()->r13 = 0;
-    vmcs->save_state()->r14 = 0;
-    vmcs->save_state()->r15 = 0;
-
-    vmcs_n::guest_ia32_efer::set(0);
-    vmcs_n::guest_fs_base::set(0);
-    vmcs_n::guest_gs_base::set(0);
+    for (const auto &field : reset_state) {
+        this->vmwrite(field.addr, field.val);
+    }
+
+    this->vmwrite(vmcs_n::guest_cr0::addr, m_reset_cr0);
+    this->vmwrite(vmcs_n::guest_cr4::addr, m_reset_cr4);
+
+    auto state = vmcs->save_state();
+
+    state->rax = 0;
+    state->rbx = 0;
+    state->rcx = 0;
+    state->rdx = 0x00000600;
+    state->rbp = 0;
+    state->rsi = 0;
+    state->rdi = 0;
+    state->r08 = 0;
+    state->r09 = 0;
+    state->r10 = 0;
+    state->r11 = 0;
+    state->r12 = 0;
+    state->r13 = 0;
+    state->r14 = 0;
+    state->r15 = 0;
+    state->rsp = 0;
+    state->rip = 0x0000FFF0;
 
     // .........................................................................
     // VT-x Specific
     // .........................................................................
 
     // The following code is specific to VT-x. Typically the hardware would
-    // turn off 64bit mode and set the activity state, but we need to do this
-    // ourselves instead.
+    // turn off 64bit mode, but we need to do this ourselves instead. Note
+    // that the activity state is set to wait-for-SIPI by the reset state.
 
-    vmcs_n::guest_activity_state::set(
-        vmcs_n::guest_activity_state::wait_for_sipi
+    this->vmclear_bits(
+        vm_entry_controls::addr,
+        vm_entry_controls::ia_32e_mode_guest::mask
     );
 
-    ia_32e_mode_guest::disable();
-
     // .........................................................................
     // Done
     // .........................................................................
 
+    // Targeted INITs are only tracked when they are sent through the
+    // x2APIC's ICR MSR. In xAPIC mode there is nothing to clear, and the
+    // x2APIC ID MSR cannot be read (the read would #GP).
+    //
+
+    if ((::intel_x64::msrs::get(apic_base_msr) & apic_base_x2apic_mode) != 0) {
+        const auto id = ::intel_x64::msrs::get(x2apic_id_msr);
+        if (id < eapis_vcpu_global_state_t::max_init_pending) {
+            m_eapis_vcpu_global_state->init_pending.at(id) = false;
+        }
+    }
+
     return (m_eapis_vcpu_global_state->init_called = true);
 }
 
@@ -186,6 +236,28 @@ init_signal_handler::handle_init_assert(
     using namespace ::intel_x64::msrs;
     bfignored(vmcs);
 
+    const auto id = info.val >> icr_destination_from;
+
+    // Note
+    //
+    // A targeted INIT only marks the target as pending and returns, so
+    // that the INITs to each AP are sent back to back. The wait happens on
+    // the SIPI instead (see handle_sipi). A broadcast INIT cannot be
+    // tracked per AP, so it still waits for the first AP to be reset.
+    //
+
+    if ((info.val & (icr_logical_mask | icr_shorthand_mask)) == 0 &&
+        id < eapis_vcpu_global_state_t::max_init_pending) {
+
+        m_eapis_vcpu_global_state->init_pending.at(id) = true;
+
+        ::intel_x64::msrs::set(
+            ia32_x2apic_icr::addr, info.val
+        );
+
+        return (info.ignore_write = true);
+    }
+
     m_eapis_vcpu_global_state->init_called = false;
 
     ::intel_x64::msrs::set(
@@ -198,6 +270,35 @@ init_signal_handler::handle_init_assert(
     return (info.ignore_write = true);
 }
 
+bool
+init_signal_handler::handle_sipi(
+    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    const auto id = info.val >> icr_destination_from;
+
+    if ((info.val & (icr_logical_mask | icr_shorthand_mask)) != 0 ||
+        id >= eapis_vcpu_global_state_t::max_init_pending) {
+        return false;
+    }
+
+    // If the target never takes its INIT (e.g. it is not running), the
+    // SIPI is sent anyway instead of hanging the sender.
+    //
+
+    const auto &pending = m_eapis_vcpu_global_state->init_pending.at(id);
+    for (auto i = 0ULL; pending && i < sipi_wait_limit; i++) {
+        __builtin_ia32_pause();
+    }
+
+    if (pending) {
+        m_sipi_timeouts++;
+    }
+
+    return false;
+}
+
 bool
 init_signal_handler::handle_init_deassert(
     gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
@@ -220,7 +321,13 @@ init_signal_handler::handle_icr_write(
 {
     using namespace ::intel_x64::lapic;
 
-    if (icr::delivery_mode::get(info.val) != icr::delivery_mode::init) {
+    const auto mode = icr::delivery_mode::get(info.val);
+
+    if (mode == icr_delivery_mode_startup) {
+        return handle_sipi(vmcs, info);
+    }
+
+    if (mode != icr::delivery_mode::init) {
         return false;
     }
 
@@ -43,21 +43,27 @@ interrupt_window_handler::interrupt_window_handler(
 
 void
 interrupt_window_handler::add_handler(
-    const handler_delegate_t &d)
-{ m_handlers.push_front(d); }
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
 
 void
 interrupt_window_handler::enable_exiting()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::interrupt_window_exiting::enable();
+    this->vmset_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::interrupt_window_exiting::mask
+    );
 }
 
 void
 interrupt_window_handler::disable_exiting()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::interrupt_window_exiting::disable();
+    this->vmclear_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::interrupt_window_exiting::mask
+    );
 }
 
 bool
@@ -65,11 +71,13 @@ interrupt_window_handler::is_open()
 {
     using namespace vmcs_n;
 
-    if (guest_rflags::interrupt_enable_flag::is_disabled()) {
+    const auto rflags = this->vmread(guest_rflags::addr);
+
+    if (guest_rflags::interrupt_enable_flag::is_disabled(rflags)) {
         return false;
     }
 
-    switch (guest_activity_state::get()) {
+    switch (this->vmread(guest_activity_state::addr)) {
         case guest_activity_state::active:
         case guest_activity_state::hlt:
             break;
@@ -80,7 +88,7 @@ interrupt_window_handler::is_open()
             return false;
     }
 
-    const auto state = guest_interruptibility_state::get();
+    const auto state = this->vmread(guest_interruptibility_state::addr);
 
     if (guest_interruptibility_state::blocking_by_sti::is_enabled(state)) {
         return false;
@@ -104,7 +112,73 @@ interrupt_window_handler::inject(uint64_t vector)
     interruption_type::set(info, interruption_type::external_interrupt);
     valid_bit::enable(info);
 
-    vmcs_n::vm_entry_interruption_information::set(info);
+    this->vmwrite(vmcs_n::vm_entry_interruption_information::addr, info);
+}
+
+void
+interrupt_window_handler::queue(uint64_t vector)
+{
+    expects(vector < 256);
+
+    m_pending.at(vector >> 6U) |= 1ULL << (vector & 63U);
+    this->inject_pending();
+}
+
+bool
+interrupt_window_handler::inject_pending()
+{
+    using namespace vmcs_n::vm_entry_interruption_information;
+
+    if (this->num_pending() == 0) {
+        this->disable_exiting();
+        return false;
+    }
+
+    const auto info = this->vmread(vmcs_n::vm_entry_interruption_information::addr);
+
+    if (valid_bit::is_enabled(info) || !this->is_open()) {
+        this->enable_exiting();
+        return false;
+    }
+
+    // Vectors are delivered highest first, as the APIC's priority classes
+    // are the upper 4 bits of the vector
+    //
+
+    for (auto i = m_pending.size(); i > 0; i--) {
+        auto &bits = m_pending.at(i - 1U);
+
+        if (bits == 0) {
+            continue;
+        }
+
+        auto bit = 63U - static_cast<uint64_t>(__builtin_clzll(bits));
+        bits &= ~(1ULL << bit);
+
+        this->inject(((i - 1U) * 64U) + bit);
+        break;
+    }
+
+    if (this->num_pending() != 0) {
+        this->enable_exiting();
+    }
+    else {
+        this->disable_exiting();
+    }
+
+    return true;
+}
+
+uint64_t
+interrupt_window_handler::num_pending() const noexcept
+{
+    uint64_t num = 0;
+
+    for (const auto &bits : m_pending) {
+        num += static_cast<uint64_t>(__builtin_popcountll(bits));
+    }
+
+    return num;
 }
 
 // -----------------------------------------------------------------------------
@@ -116,19 +190,21 @@ interrupt_window_handler::handle(gsl::not_null<vmcs_t *> vmcs)
 {
     struct info_t info {};
 
-    for (const auto &d : m_handlers) {
-        if (d(vmcs, info)) {
-
-            if (!info.ignore_disable) {
-                this->disable_exiting();
-            }
+    if (this->num_pending() != 0) {
+        this->inject_pending();
+        return true;
+    }
 
-            return true;
+    if (m_handlers.dispatch(vmcs, info)) {
+        if (!info.ignore_disable) {
+            this->disable_exiting();
         }
+
+        return true;
     }
 
-    throw std::runtime_error(
-        "Unhandled interrupt window"
+    return this->unhandled(
+        exit_error::unhandled_exit, "Unhandled interrupt window"
     );
 }
 
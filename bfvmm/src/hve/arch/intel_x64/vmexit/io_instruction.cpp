@@ -29,17 +29,29 @@
 
 #include <bfvmm/memory_manager/arch/x64/unique_map.h>
 
+#include <optional>
+
 namespace eapis
 {
 namespace intel_x64
 {
 
+// If bit 54 of IA32_VMX_BASIC is set, the VM-exit instruction information
+// of an INS / OUTS exit reports the address size in bits 9:7 (0 = 16 bit,
+// 1 = 32 bit, 2 = 64 bit)
+//
+constexpr const uint32_t vmx_basic_msr = 0x480U;
+constexpr const uint64_t vmx_basic_ins_outs_info = 1ULL << 54U;
+
+constexpr const uint64_t address_size_from = 7U;
+constexpr const uint64_t address_size_mask = 0x7U;
+
 io_instruction_handler::io_instruction_handler(
     gsl::not_null<apis *> apis,
     gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
 ) :
-    m_io_bitmap_a{apis->m_io_bitmap_a.get(), ::x64::pt::page_size},
-    m_io_bitmap_b{apis->m_io_bitmap_b.get(), ::x64::pt::page_size}
+    m_bitmaps{&apis->m_bitmaps},
+    m_ins_outs_info{(::intel_x64::msrs::get(vmx_basic_msr) & vmx_basic_ins_outs_info) != 0}
 {
     using namespace vmcs_n;
     bfignored(eapis_vcpu_global_state);
@@ -67,60 +79,107 @@ io_instruction_handler::add_handler(
     const handler_delegate_t &in_d,
     const handler_delegate_t &out_d)
 {
-    m_in_handlers[port].push_front(std::move(in_d));
-    m_out_handlers[port].push_front(std::move(out_d));
+    auto &hdlrs = port_handlers(port);
+
+    hdlrs.in.push_front(std::move(in_d));
+    hdlrs.out.push_front(std::move(out_d));
 }
 
 void
-io_instruction_handler::trap_on_access(vmcs_n::value_type port)
+io_instruction_handler::add_string_handler(
+    vmcs_n::value_type port,
+    const string_handler_delegate_t &in_d,
+    const string_handler_delegate_t &out_d)
 {
-    if (port < 0x8000) {
-        set_bit(m_io_bitmap_a, port);
-        return;
-    }
+    auto &hdlrs = port_handlers(port);
 
-    if (port < 0x10000) {
-        set_bit(m_io_bitmap_b, port);
-        return;
+    hdlrs.string_in.push_front(std::move(in_d));
+    hdlrs.string_out.push_front(std::move(out_d));
+}
+
+void
+io_instruction_handler::add_coalesced_port(vmcs_n::value_type port)
+{
+    if (m_coalesced == nullptr || !m_coalesced->has_flush_handler()) {
+        throw std::runtime_error("add_coalesced_port: no coalesced ring");
     }
 
-    throw std::runtime_error("invalid port: " + std::to_string(port));
+    port_handlers(port).coalesced = true;
 }
 
 void
-io_instruction_handler::trap_on_all_accesses()
+io_instruction_handler::add_doorbell(
+    vmcs_n::value_type port, uint64_t val, uint64_t bit)
 {
-    gsl::memset(m_io_bitmap_a, 0xFF);
-    gsl::memset(m_io_bitmap_b, 0xFF);
+    expects(bit < doorbell_bitmap<>::size());
+
+    if (m_doorbells == nullptr) {
+        throw std::runtime_error("add_doorbell: no doorbell bitmap");
+    }
+
+    port_handlers(port).doorbell = true;
+    m_doorbell_table.add(port, val, bit);
 }
 
-void
-io_instruction_handler::pass_through_access(vmcs_n::value_type port)
+io_instruction_handler::port_handlers_t &
+io_instruction_handler::port_handlers(vmcs_n::value_type port)
 {
-    if (port < 0x8000) {
-        clear_bit(m_io_bitmap_a, port);
-        return;
+    if (port >= 0x10000) {
+        throw std::out_of_range("io_instruction_handler: invalid port");
     }
 
-    if (port < 0x10000) {
-        clear_bit(m_io_bitmap_b, port);
-        return;
+    auto &table = m_handlers.at(port >> 6);
+    if (!table) {
+        table = std::make_unique<port_table_t>();
     }
 
-    throw std::runtime_error("invalid port: " + std::to_string(port));
+    return table->at(port & 0x3F);
 }
 
-void
-io_instruction_handler::pass_through_all_accesses()
+const io_instruction_handler::port_handlers_t *
+io_instruction_handler::find_handlers(uint64_t port) const
 {
-    gsl::memset(m_io_bitmap_a, 0x0);
-    gsl::memset(m_io_bitmap_b, 0x0);
+    const auto &table = m_handlers[(port >> 6) & 0x3FF];
+
+    if (GSL_UNLIKELY(!table)) {
+        return nullptr;
+    }
+
+    return &(*table)[port & 0x3F];
 }
 
+void
+io_instruction_handler::trap_on_access(vmcs_n::value_type port)
+{ m_bitmaps->trap_io(port); }
+
+void
+io_instruction_handler::trap_on_range(vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_bitmaps->trap_io_range(first, last); }
+
+void
+io_instruction_handler::trap_on_all_accesses()
+{ m_bitmaps->fill_io_bitmap(0xFF); }
+
+void
+io_instruction_handler::pass_through_access(vmcs_n::value_type port)
+{ m_bitmaps->pass_through_io(port); }
+
+void
+io_instruction_handler::pass_through_range(vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_bitmaps->pass_through_io_range(first, last); }
+
+void
+io_instruction_handler::pass_through_all_accesses()
+{ m_bitmaps->fill_io_bitmap(0x00); }
+
 // -----------------------------------------------------------------------------
 // Debug
 // -----------------------------------------------------------------------------
 
+const exit_counters<> &
+io_instruction_handler::counters() const noexcept
+{ return m_counters; }
+
 void
 io_instruction_handler::dump_log()
 {
@@ -138,10 +197,36 @@ io_instruction_handler::dump_log()
             bfdebug_subnhex(0, "val", record.val, msg);
         }
 
+        bfdebug_brk2(0, msg);
+
+        m_counters.for_each([&](uint64_t key, uint64_t count) {
+            bfdebug_subnhex(0, ("port " + bfn::to_string(key, 16)).c_str(), count, msg);
+        });
+
+        bfdebug_subnhex(0, "other", m_counters.other(), msg);
+
         bfdebug_lnbr(0, msg);
     });
 }
 
+void
+io_instruction_handler::memory_usage(memory_usage_t &usage) const
+{
+    for (const auto &table : m_handlers) {
+        if (table) {
+            usage.handlers += sizeof(port_table_t);
+        }
+    }
+
+    usage.handlers += m_doorbell_table.heap_bytes();
+
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+io_instruction_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -152,11 +237,6 @@ io_instruction_handler::handle(gsl::not_null<vmcs_t *> vmcs)
     namespace io_instruction = vmcs_n::exit_qualification::io_instruction;
     auto eq = io_instruction::get();
 
-    auto reps = 1ULL;
-    if (io_instruction::rep_prefixed::is_enabled(eq)) {
-        reps = vmcs->save_state()->rcx & 0x00000000FFFFFFFFULL;
-    }
-
     struct info_t info = {
         0ULL,
         io_instruction::size_of_access::get(eq),
@@ -176,39 +256,241 @@ io_instruction_handler::handle(gsl::not_null<vmcs_t *> vmcs)
             break;
     }
 
-    if (io_instruction::string_instruction::is_enabled(eq)) {
-        info.address = vmcs_n::guest_linear_address::get();
+    m_counters.inc(info.port_number);
+
+    auto in = io_instruction::direction_of_access::get(eq) == io_instruction::direction_of_access::in;
+
+    if (!io_instruction::string_instruction::is_enabled(eq)) {
+        if (!(in ? handle_in(vmcs, info) : handle_out(vmcs, info))) {
+            return this->unhandled_io(in);
+        }
+
+        if (!info.ignore_advance) {
+            return advance(vmcs);
+        }
+
+        return true;
     }
 
-    for (auto i = 0ULL; i < reps; i++) {
-        switch (io_instruction::direction_of_access::get(eq)) {
-            case io_instruction::direction_of_access::in:
-                handle_in(vmcs, info);
-                break;
+    // A string instruction only uses as much of RCX, RSI and RDI as its
+    // address size, and leaves the rest of each register unchanged
+    //
 
-            default:
-                handle_out(vmcs, info);
-                break;
+    auto mask = this->address_mask();
+    info.address = vmcs_n::guest_linear_address::get();
+
+    auto reps = 1ULL;
+    if (io_instruction::rep_prefixed::is_enabled(eq)) {
+        reps = vmcs->save_state()->rcx & mask;
+
+        if (handle_string(vmcs, info, reps, mask)) {
+            return true;
+        }
+    }
+
+    auto size = info.size_of_access + 1ULL;
+    auto df = vmcs_n::guest_rflags::direction_flag::is_enabled();
+
+    // If an element is not handled, the guest's registers are left
+    // describing the elements that were, the same way they would be if
+    // the instruction faulted part way through
+    //
+
+    auto done = 0ULL;
+
+    for (; done < reps; done++) {
+        if (!(in ? handle_in(vmcs, info) : handle_out(vmcs, info))) {
+            break;
         }
 
-        info.address += info.size_of_access + 1ULL;
+        info.address = df ? info.address - size : info.address + size;
+    }
+
+    auto bytes = df ? ~(done * size) + 1ULL : done * size;
+
+    if (in) {
+        add_masked(vmcs->save_state()->rdi, bytes, mask);
+    }
+    else {
+        add_masked(vmcs->save_state()->rsi, bytes, mask);
+    }
+
+    if (io_instruction::rep_prefixed::is_enabled(eq)) {
+        add_masked(vmcs->save_state()->rcx, ~done + 1ULL, mask);
+    }
+
+    if (done != reps) {
+        return this->unhandled_io(in);
+    }
+
+    if (!info.ignore_advance) {
+        return advance(vmcs);
     }
 
     return true;
 }
 
+bool
+io_instruction_handler::handle_string(
+    gsl::not_null<vmcs_t *> vmcs, info_t &info, uint64_t reps, uint64_t mask)
+{
+    namespace io_instruction = vmcs_n::exit_qualification::io_instruction;
+
+    auto eq = io_instruction::get();
+    auto in = io_instruction::direction_of_access::get(eq) == io_instruction::direction_of_access::in;
+
+    const auto hdlrs = find_handlers(info.port_number);
+    if (hdlrs == nullptr) {
+        return false;
+    }
+
+    if (hdlrs->coalesced) {
+        m_coalesced->flush();
+    }
+
+    const auto &chain = in ? hdlrs->string_in : hdlrs->string_out;
+    if (chain.empty() || vmcs_n::guest_rflags::direction_flag::is_enabled()) {
+        return false;
+    }
+
+    // Only the elements that fit in the guest page that the transfer starts
+    // in are handed to the handler, so that the guest's memory is mapped
+    // using a single page. If the transfer continues into the next page,
+    // the guest's registers are updated without advancing, and the guest
+    // re-executes the instruction to transfer the rest.
+    //
+
+    auto size = info.size_of_access + 1ULL;
+    auto left = ::x64::pt::page_size - bfn::lower(info.address, ::x64::pt::from);
+    auto count = std::min(reps, left / size);
+
+    if (count == 0) {
+        return false;
+    }
+
+    std::optional<bfvmm::x64::unique_map<uint8_t>> map;
+    gsl::span<uint8_t> buffer;
+
+    if (m_guest_memory != nullptr) {
+        buffer = m_guest_memory->map_gva(info.address, count * size);
+    }
+    else {
+        map.emplace(
+            bfvmm::x64::make_unique_map<uint8_t>(
+                info.address,
+                vmcs_n::guest_cr3::get(),
+                count * size
+            )
+        );
+
+        buffer = gsl::make_span(map->get(), static_cast<std::ptrdiff_t>(count * size));
+    }
+
+    struct string_info_t sinfo = {
+        info.port_number,
+        info.size_of_access,
+        count,
+        buffer
+    };
+
+    if (record_exit()) {
+        add_record(m_log, {
+            info.port_number,
+            info.size_of_access,
+            in ? io_instruction::direction_of_access::in : io_instruction::direction_of_access::out,
+            info.address,
+            count
+        });
+    }
+
+    if (chain.dispatch(vmcs, sinfo)) {
+        auto done = std::min(sinfo.count, count);
+
+        if (in) {
+            add_masked(vmcs->save_state()->rdi, done * size, mask);
+        }
+        else {
+            add_masked(vmcs->save_state()->rsi, done * size, mask);
+        }
+
+        add_masked(vmcs->save_state()->rcx, ~done + 1ULL, mask);
+
+        if (done == reps) {
+            return advance(vmcs);
+        }
+
+        return true;
+    }
+
+    return this->unhandled(
+        exit_error::unhandled_exit, "io_instruction_handler::handle_string: unhandled io instruction"
+    );
+}
+
+uint64_t
+io_instruction_handler::address_mask() const
+{
+    using namespace vmcs_n;
+
+    uint64_t size = 0;
+
+    if (m_ins_outs_info) {
+        size = (vm_exit_instruction_information::get() >> address_size_from) & address_size_mask;
+    }
+    else {
+        // Without the instruction information, the default address size
+        // of the guest's mode is used (an address size prefix is not seen)
+        //
+
+        if (vm_entry_controls::ia_32e_mode_guest::is_enabled() &&
+            guest_cs_access_rights::l::is_enabled()) {
+            size = 2;
+        }
+        else {
+            size = guest_cs_access_rights::db::is_enabled() ? 1 : 0;
+        }
+    }
+
+    switch (size) {
+        case 0: return 0x000000000000FFFFULL;
+        case 1: return 0x00000000FFFFFFFFULL;
+        default: return 0xFFFFFFFFFFFFFFFFULL;
+    }
+}
+
+void
+io_instruction_handler::add_masked(uint64_t &reg, uint64_t val, uint64_t mask) noexcept
+{ reg = (reg & ~mask) | ((reg + val) & mask); }
+
+bool
+io_instruction_handler::unhandled_io(bool in)
+{
+    if (in) {
+        return this->unhandled(
+            exit_error::unhandled_read, "io_instruction_handler::handle_in: unhandled io instruction"
+        );
+    }
+
+    return this->unhandled(
+        exit_error::unhandled_write, "io_instruction_handler::handle_out: unhandled io instruction"
+    );
+}
+
 bool
 io_instruction_handler::handle_in(gsl::not_null<vmcs_t *> vmcs, info_t &info)
 {
     namespace io_instruction = vmcs_n::exit_qualification::io_instruction;
 
-    const auto &hdlrs =
-        m_in_handlers.find(info.port_number);
+    const auto hdlrs = find_handlers(info.port_number);
+
+    if (GSL_UNLIKELY(hdlrs != nullptr && hdlrs->coalesced)) {
+        m_coalesced->flush();
+    }
 
-    if (GSL_LIKELY(hdlrs != m_in_handlers.end())) {
+    if (GSL_LIKELY(hdlrs != nullptr && !hdlrs->in.empty())) {
         emulate_in(info);
 
-        if (!ndebug && m_log_enabled) {
+        if (record_exit()) {
             add_record(m_log, {
                 info.port_number,
                 info.size_of_access,
@@ -218,24 +500,16 @@ io_instruction_handler::handle_in(gsl::not_null<vmcs_t *> vmcs, info_t &info)
             });
         }
 
-        for (const auto &d : hdlrs->second) {
-            if (d(vmcs, info)) {
-
-                if (!info.ignore_write) {
-                    store_operand(vmcs, info);
-                }
-
-                if (!info.ignore_advance) {
-                    return advance(vmcs);
-                }
-
-                return true;
+        if (hdlrs->in.dispatch(vmcs, info)) {
+            if (!info.ignore_write) {
+                store_operand(vmcs, info);
             }
+
+            return true;
         }
     }
 
-    throw std::runtime_error(
-        "io_instruction_handler::handle_in: unhandled io instruction #" + std::to_string(info.port_number));
+    return false;
 }
 
 bool
@@ -243,13 +517,43 @@ io_instruction_handler::handle_out(gsl::not_null<vmcs_t *> vmcs, info_t &info)
 {
     namespace io_instruction = vmcs_n::exit_qualification::io_instruction;
 
-    const auto &hdlrs =
-        m_in_handlers.find(info.port_number);
+    const auto hdlrs = find_handlers(info.port_number);
 
-    if (GSL_LIKELY(hdlrs != m_in_handlers.end())) {
+    if (hdlrs != nullptr && hdlrs->doorbell) {
         load_operand(vmcs, info);
 
-        if (!ndebug && m_log_enabled) {
+        // The device is told to look at what the guest has written so far,
+        // so the writes that are still buffered must reach it first
+        //
+
+        uint64_t bit;
+        if (m_doorbell_table.find(info.port_number, info.val, bit)) {
+            if (m_coalesced != nullptr) {
+                m_coalesced->flush();
+            }
+
+            m_doorbells->ring(bit);
+            return true;
+        }
+    }
+
+    if (hdlrs != nullptr && hdlrs->coalesced) {
+        load_operand(vmcs, info);
+
+        m_coalesced->push({
+            info.port_number,
+            info.val,
+            gsl::narrow_cast<uint32_t>(info.size_of_access + 1U),
+            0U
+        });
+
+        return true;
+    }
+
+    if (GSL_LIKELY(hdlrs != nullptr && !hdlrs->out.empty())) {
+        load_operand(vmcs, info);
+
+        if (record_exit()) {
             add_record(m_log, {
                 info.port_number,
                 info.size_of_access,
@@ -259,24 +563,16 @@ io_instruction_handler::handle_out(gsl::not_null<vmcs_t *> vmcs, info_t &info)
             });
         }
 
-        for (const auto &d : hdlrs->second) {
-            if (d(vmcs, info)) {
-
-                if (!info.ignore_write) {
-                    emulate_out(info);
-                }
-
-                if (!info.ignore_advance) {
-                    return advance(vmcs);
-                }
-
-                return true;
+        if (hdlrs->out.dispatch(vmcs, info)) {
+            if (!info.ignore_write) {
+                emulate_out(info);
             }
+
+            return true;
         }
     }
 
-    throw std::runtime_error(
-        "io_instruction_handler::handle_out: unhandled io instruction #" + std::to_string(info.port_number));
+    return false;
 }
 
 void
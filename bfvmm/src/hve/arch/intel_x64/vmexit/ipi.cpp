@@ -0,0 +1,147 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// x2APIC ICR fields
+//
+constexpr const uint64_t icr_vector_mask = 0x00000000000000FFULL;
+constexpr const uint64_t icr_delivery_mode_mask = 0x0000000000000700ULL;
+constexpr const uint64_t icr_logical_mask = 0x0000000000000800ULL;
+constexpr const uint64_t icr_shorthand_mask = 0x00000000000C0000ULL;
+constexpr const uint64_t icr_shorthand_from = 18;
+constexpr const uint64_t icr_destination_from = 32;
+
+constexpr const uint64_t icr_delivery_mode_fixed = 0;
+
+ipi_handler::ipi_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+{
+    using namespace vmcs_n;
+    bfignored(eapis_vcpu_global_state);
+
+    // This is registered after the wrmsr handler, so it is called first
+    apis->add_handler(
+        exit_reason::basic_exit_reason::wrmsr,
+        ::handler_delegate_t::create<ipi_handler, &ipi_handler::handle>(this)
+    );
+}
+
+ipi_handler::~ipi_handler()
+{
+    if (!ndebug && m_log_enabled) {
+        dump_log();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Targets
+// -----------------------------------------------------------------------------
+
+void
+ipi_handler::add_handler(const handler_delegate_t &d)
+{ m_handlers.push_front(d); }
+
+void
+ipi_handler::add_target(
+    uint64_t apic_id, gsl::not_null<posted_interrupt_handler *> target)
+{ m_targets[apic_id] = target; }
+
+void
+ipi_handler::remove_target(uint64_t apic_id)
+{ m_targets.erase(apic_id); }
+
+// -----------------------------------------------------------------------------
+// Debug
+// -----------------------------------------------------------------------------
+
+void
+ipi_handler::dump_log()
+{
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "ipi_handler log", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subnhex(0, "posted", m_posted, msg);
+        bfdebug_subnhex(0, "sent", m_sent, msg);
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+ipi_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    auto state = vmcs->save_state();
+
+    if (GSL_LIKELY(state->rcx != ::intel_x64::msrs::ia32_x2apic_icr::addr)) {
+        return false;
+    }
+
+    auto val =
+        ((state->rax & 0x00000000FFFFFFFF) << 0) |
+        ((state->rdx & 0x00000000FFFFFFFF) << 32);
+
+    if ((val & icr_delivery_mode_mask) != icr_delivery_mode_fixed) {
+        return false;
+    }
+
+    struct info_t info = {
+        val,
+        val & icr_vector_mask,
+        val >> icr_destination_from,
+        (val & icr_shorthand_mask) >> icr_shorthand_from,
+        (val & icr_logical_mask) != 0,
+        false
+    };
+
+    if (info.shorthand == 0 && !info.logical) {
+        const auto target = m_targets.find(info.destination);
+
+        if (target != m_targets.end() && info.vector >= 16) {
+            target->second->post(info.vector);
+
+            m_posted++;
+            return advance(vmcs);
+        }
+    }
+
+    m_handlers.dispatch(vmcs, info);
+
+    if (!info.ignore_write) {
+        ::intel_x64::msrs::set(::intel_x64::msrs::ia32_x2apic_icr::addr, info.val);
+        m_sent++;
+    }
+
+    return advance(vmcs);
+}
+
+}
+}
@@ -26,7 +26,9 @@ namespace intel_x64
 
 monitor_trap_handler::monitor_trap_handler(
     gsl::not_null<apis *> apis,
-    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis}
 {
     using namespace vmcs_n;
     bfignored(eapis_vcpu_global_state);
@@ -42,14 +44,92 @@ monitor_trap_handler::monitor_trap_handler(
 // -----------------------------------------------------------------------------
 
 void
-monitor_trap_handler::add_handler(const handler_delegate_t &d)
-{ m_handlers.push_front(d); }
+monitor_trap_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
 
 void
 monitor_trap_handler::enable()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::monitor_trap_flag::enable();
+    this->vmset_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::monitor_trap_flag::mask
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Tracing
+// -----------------------------------------------------------------------------
+
+void
+monitor_trap_handler::trace(uint64_t steps, bool regs)
+{ this->trace_range(0, std::numeric_limits<uint64_t>::max(), steps, regs); }
+
+void
+monitor_trap_handler::trace_range(
+    uint64_t start, uint64_t end, uint64_t steps, bool regs)
+{
+    expects(start < end);
+    expects(steps != 0);
+
+    m_trace_steps = steps;
+    m_trace_start = start;
+    m_trace_end = end;
+    m_trace_regs = regs;
+
+    this->enable();
+}
+
+void
+monitor_trap_handler::stop_trace()
+{
+    using namespace vmcs_n;
+
+    m_trace_steps = 0;
+    this->vmclear_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::monitor_trap_flag::mask
+    );
+}
+
+bool
+monitor_trap_handler::handle_trace(gsl::not_null<vmcs_t *> vmcs)
+{
+    using namespace vmcs_n;
+
+    auto state = vmcs->save_state();
+    trace_entry_t entry{state->rip, 0, 0, 0, 0, 0, 0, 0};
+
+    if (m_trace_regs) {
+        entry.rsp = state->rsp;
+        entry.rax = state->rax;
+        entry.rbx = state->rbx;
+        entry.rcx = state->rcx;
+        entry.rdx = state->rdx;
+        entry.rsi = state->rsi;
+        entry.rdi = state->rdi;
+    }
+
+    m_trace.push(entry);
+
+    if (GSL_LIKELY(--m_trace_steps != 0)) {
+        if (GSL_LIKELY(entry.rip >= m_trace_start && entry.rip < m_trace_end)) {
+            return true;
+        }
+    }
+
+    m_trace_steps = 0;
+
+    if (m_has_trace_done) {
+        m_trace_done(vmcs);
+    }
+
+    this->vmclear_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::monitor_trap_flag::mask
+    );
+    return true;
 }
 
 // -----------------------------------------------------------------------------
@@ -61,20 +141,24 @@ monitor_trap_handler::handle(gsl::not_null<vmcs_t *> vmcs)
 {
     using namespace vmcs_n;
 
+    if (m_trace_steps != 0) {
+        return this->handle_trace(vmcs);
+    }
+
     struct info_t info = {
         false
     };
 
-    for (const auto &d : m_handlers) {
-        if (d(vmcs, info)) {
-            break;
-        }
-    }
+    m_handlers.dispatch(vmcs, info);
 
     if (!info.ignore_clear) {
-        primary_processor_based_vm_execution_controls::monitor_trap_flag::disable();
+        this->vmclear_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::monitor_trap_flag::mask
+    );
     }
 
+    m_apis->invalidate_ept();
     return true;
 }
 
@@ -35,9 +35,6 @@ mov_dr_handler::mov_dr_handler(
         exit_reason::basic_exit_reason::mov_dr,
         ::handler_delegate_t::create<mov_dr_handler, &mov_dr_handler::handle>(this)
     );
-
-    // using namespace vmcs_n;
-    // primary_processor_based_vm_execution_controls::mov_dr_exiting::enable();
 }
 
 mov_dr_handler::~mov_dr_handler()
@@ -52,8 +49,168 @@ mov_dr_handler::~mov_dr_handler()
 // -----------------------------------------------------------------------------
 
 void
-mov_dr_handler::add_handler(const handler_delegate_t &d)
-{ m_handlers.push_front(d); }
+mov_dr_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+void
+mov_dr_handler::enable_exiting()
+{
+    using namespace vmcs_n;
+    this->vmset_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::mov_dr_exiting::mask
+    );
+}
+
+void
+mov_dr_handler::disable_exiting()
+{
+    using namespace vmcs_n;
+    this->vmclear_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::mov_dr_exiting::mask
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Lazy Debug Registers
+// -----------------------------------------------------------------------------
+
+// The base hypervisor only provides DR7 (through the VMCS), so DR0-DR3
+// and DR6 are accessed directly. DR4 and DR5 alias DR6 and DR7.
+//
+
+uint64_t
+mov_dr_handler::read_dr(uint64_t n) noexcept
+{
+    uint64_t val = 0;
+
+    switch (n) {
+        case 0:
+            __asm__ volatile("mov %%dr0, %0" : "=r"(val));
+            break;
+
+        case 1:
+            __asm__ volatile("mov %%dr1, %0" : "=r"(val));
+            break;
+
+        case 2:
+            __asm__ volatile("mov %%dr2, %0" : "=r"(val));
+            break;
+
+        case 3:
+            __asm__ volatile("mov %%dr3, %0" : "=r"(val));
+            break;
+
+        default:
+            __asm__ volatile("mov %%dr6, %0" : "=r"(val));
+            break;
+    }
+
+    return val;
+}
+
+void
+mov_dr_handler::write_dr(uint64_t n, uint64_t val) noexcept
+{
+    switch (n) {
+        case 0:
+            __asm__ volatile("mov %0, %%dr0" :: "r"(val));
+            break;
+
+        case 1:
+            __asm__ volatile("mov %0, %%dr1" :: "r"(val));
+            break;
+
+        case 2:
+            __asm__ volatile("mov %0, %%dr2" :: "r"(val));
+            break;
+
+        case 3:
+            __asm__ volatile("mov %0, %%dr3" :: "r"(val));
+            break;
+
+        default:
+            __asm__ volatile("mov %0, %%dr6" :: "r"(val));
+            break;
+    }
+}
+
+std::size_t
+mov_dr_handler::dr_index(uint64_t n)
+{
+    expects(n < 4 || n == 6);
+    return n == 6 ? 4U : static_cast<std::size_t>(n);
+}
+
+void
+mov_dr_handler::enable_lazy_exiting()
+{
+    this->save_guest_drs();
+
+    m_lazy = true;
+    this->enable_exiting();
+}
+
+void
+mov_dr_handler::disable_lazy_exiting()
+{
+    if (!m_guest_owns_drs) {
+        this->load_guest_drs();
+    }
+
+    m_lazy = false;
+    this->disable_exiting();
+}
+
+void
+mov_dr_handler::save_guest_drs()
+{
+    if (!m_guest_owns_drs) {
+        return;
+    }
+
+    for (auto n : {0U, 1U, 2U, 3U, 6U}) {
+        m_guest_drs.at(dr_index(n)) = read_dr(n);
+    }
+
+    m_guest_owns_drs = false;
+
+    if (m_lazy) {
+        this->enable_exiting();
+    }
+}
+
+void
+mov_dr_handler::load_guest_drs()
+{
+    for (auto n : {0U, 1U, 2U, 3U, 6U}) {
+        write_dr(n, m_guest_drs.at(dr_index(n)));
+    }
+
+    m_guest_owns_drs = true;
+}
+
+uint64_t
+mov_dr_handler::guest_dr(uint64_t n) const
+{
+    auto i = dr_index(n);
+    return m_guest_owns_drs ? read_dr(n) : m_guest_drs.at(i);
+}
+
+void
+mov_dr_handler::set_guest_dr(uint64_t n, uint64_t val)
+{
+    auto i = dr_index(n);
+
+    if (m_guest_owns_drs) {
+        write_dr(n, val);
+    }
+    else {
+        m_guest_drs.at(i) = val;
+    }
+}
 
 // -----------------------------------------------------------------------------
 // Debug
@@ -76,6 +233,17 @@ mov_dr_handler::dump_log()
     });
 }
 
+void
+mov_dr_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers += m_handlers.heap_bytes();
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+mov_dr_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -89,28 +257,40 @@ mov_dr_handler::handle(gsl::not_null<vmcs_t *> vmcs)
         false
     };
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_log, {
             info.val
         });
     }
 
-    for (const auto &d : m_handlers) {
-        if (d(vmcs, info)) {
+    if (m_handlers.dispatch(vmcs, info)) {
+        if (!info.ignore_write) {
+            this->vmwrite(vmcs_n::guest_dr7::addr, info.val & 0x00000000FFFFFFFF);
+        }
 
-            if (!info.ignore_write) {
-                vmcs_n::guest_dr7::set(info.val & 0x00000000FFFFFFFF);
-            }
+        if (!info.ignore_advance) {
+            return advance(vmcs);
+        }
 
-            if (!info.ignore_advance) {
-                return advance(vmcs);
-            }
+        return true;
+    }
 
-            return true;
-        }
+    // Nobody needs to see the guest's debug register accesses, so the
+    // guest gets its debug registers back and re-executes the MOV DR,
+    // which no longer exits.
+    //
+
+    if (m_lazy && !m_guest_owns_drs) {
+        this->load_guest_drs();
+        this->disable_exiting();
+
+        m_lazy_loads++;
+        return true;
     }
 
-    throw std::runtime_error("mov_dr_handler::unhandled");
+    return this->unhandled(
+        exit_error::unhandled_exit, "mov_dr_handler::unhandled"
+    );
 }
 
 }
@@ -0,0 +1,319 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// VMCS shadowing. These are not defined by the base hypervisor, so they
+// are defined here.
+//
+constexpr const auto vmx_basic_msr = 0x480U;
+constexpr const auto vmx_procbased_ctls2_msr = 0x48BU;
+
+constexpr const uint64_t vmcs_shadowing = 1ULL << 14;
+constexpr const uint32_t shadow_vmcs_indicator = 1U << 31;
+
+constexpr const uint64_t vmread_bitmap_address_addr = 0x2026U;
+constexpr const uint64_t vmwrite_bitmap_address_addr = 0x2028U;
+
+constexpr const auto max_shadowed_field = 0x7FFFU;
+
+// Default Fields
+//
+// The fields an L1 hypervisor typically touches on each of its own VM
+// exits. The exit information fields are read-only, so only VMREAD is
+// shadowed for them. Every other field still exits, so that whoever
+// emulates VMLAUNCH / VMRESUME sees the writes that matter (controls,
+// host state, etc.) when they happen.
+//
+
+constexpr const std::array<uint32_t, 8> default_read_fields = {{
+    0x2400U,    // guest physical address
+    0x4402U,    // exit reason
+    0x4404U,    // exit interruption information
+    0x4406U,    // exit interruption error code
+    0x440CU,    // exit instruction length
+    0x440EU,    // exit instruction information
+    0x6400U,    // exit qualification
+    0x640AU,    // guest linear address
+}};
+
+constexpr const std::array<uint32_t, 7> default_read_write_fields = {{
+    0x4016U,    // entry interruption information
+    0x4018U,    // entry exception error code
+    0x401AU,    // entry instruction length
+    0x4824U,    // guest interruptibility state
+    0x681CU,    // guest rsp
+    0x681EU,    // guest rip
+    0x6820U,    // guest rflags
+}};
+
+// The VMREAD and VMWRITE bitmaps are indexed by bits 14:0 of the field
+// encoding. Each vCPU owns its bitmaps, so unlike the MSR bitmaps, these
+// do not have to be changed atomically.
+//
+static void
+change_field(gsl::span<uint8_t> bitmap, vmcs_n::value_type field, bool trap)
+{
+    auto &byte = bitmap[gsl::narrow_cast<std::ptrdiff_t>(field >> 3)];
+    auto mask = gsl::narrow_cast<uint8_t>(1U << (field & 7U));
+
+    byte = trap ? (byte | mask) : gsl::narrow_cast<uint8_t>(byte & ~mask);
+}
+
+nested_vmx_handler::nested_vmx_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_shadow_vmcs{static_cast<uint32_t *>(alloc_page()), free_page},
+    m_vmread_bitmap{static_cast<uint8_t *>(alloc_page()), free_page},
+    m_vmwrite_bitmap{static_cast<uint8_t *>(alloc_page()), free_page}
+{
+    using namespace vmcs_n;
+    bfignored(eapis_vcpu_global_state);
+
+    gsl::memset(gsl::span<uint32_t>(m_shadow_vmcs.get(), 0x1000 / sizeof(uint32_t)), 0);
+    gsl::memset(this->vmread_bitmap(), 0xFF);
+    gsl::memset(this->vmwrite_bitmap(), 0xFF);
+
+    m_shadow_vmcs.get()[0] =
+        gsl::narrow_cast<uint32_t>(::intel_x64::msrs::get(vmx_basic_msr) & 0x7FFFFFFFU) |
+        shadow_vmcs_indicator;
+
+    constexpr const std::array<uint64_t, 11> reasons = {{
+        exit_reason::basic_exit_reason::vmclear,
+        exit_reason::basic_exit_reason::vmlaunch,
+        exit_reason::basic_exit_reason::vmptrld,
+        exit_reason::basic_exit_reason::vmptrst,
+        exit_reason::basic_exit_reason::vmread,
+        exit_reason::basic_exit_reason::vmresume,
+        exit_reason::basic_exit_reason::vmwrite,
+        exit_reason::basic_exit_reason::vmxoff,
+        exit_reason::basic_exit_reason::vmxon,
+        exit_reason::basic_exit_reason::invept,
+        exit_reason::basic_exit_reason::invvpid
+    }};
+
+    for (const auto &reason : reasons) {
+        apis->add_handler(
+            reason,
+            ::handler_delegate_t::create<nested_vmx_handler, &nested_vmx_handler::handle>(this)
+        );
+    }
+
+    apis->add_cpuid_handler(
+        ::intel_x64::cpuid::feature_information::addr,
+        cpuid_handler::handler_delegate_t::create <
+        nested_vmx_handler, &nested_vmx_handler::handle_cpuid > (this)
+    );
+}
+
+nested_vmx_handler::~nested_vmx_handler()
+{
+    if (!ndebug && m_log_enabled) {
+        dump_log();
+    }
+}
+
+bool
+nested_vmx_handler::is_supported()
+{ return ((::intel_x64::msrs::get(vmx_procbased_ctls2_msr) >> 32) & vmcs_shadowing) != 0; }
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+nested_vmx_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+void
+nested_vmx_handler::enable()
+{
+    using namespace vmcs_n;
+
+    for (const auto &field : default_read_fields) {
+        this->shadow_field(field, false);
+    }
+
+    for (const auto &field : default_read_write_fields) {
+        this->shadow_field(field);
+    }
+
+    ::intel_x64::vm::write(
+        vmread_bitmap_address_addr, g_mm->virtptr_to_physint(m_vmread_bitmap.get())
+    );
+
+    ::intel_x64::vm::write(
+        vmwrite_bitmap_address_addr, g_mm->virtptr_to_physint(m_vmwrite_bitmap.get())
+    );
+
+    vmcs_link_pointer::set(this->shadow_vmcs());
+
+    this->vmwrite(
+        secondary_processor_based_vm_execution_controls::addr,
+        this->vmread(secondary_processor_based_vm_execution_controls::addr) | vmcs_shadowing
+    );
+
+    m_enabled = true;
+}
+
+void
+nested_vmx_handler::disable()
+{
+    using namespace vmcs_n;
+
+    this->vmwrite(
+        secondary_processor_based_vm_execution_controls::addr,
+        this->vmread(secondary_processor_based_vm_execution_controls::addr) & ~vmcs_shadowing
+    );
+
+    vmcs_link_pointer::set(0xFFFFFFFFFFFFFFFF);
+    m_enabled = false;
+}
+
+// -----------------------------------------------------------------------------
+// Bitmaps
+// -----------------------------------------------------------------------------
+
+void
+nested_vmx_handler::shadow_field(vmcs_n::value_type field, bool write)
+{
+    expects(field <= max_shadowed_field);
+
+    change_field(this->vmread_bitmap(), field, false);
+
+    if (write) {
+        change_field(this->vmwrite_bitmap(), field, false);
+    }
+}
+
+void
+nested_vmx_handler::trap_field(vmcs_n::value_type field)
+{
+    expects(field <= max_shadowed_field);
+
+    change_field(this->vmread_bitmap(), field, true);
+    change_field(this->vmwrite_bitmap(), field, true);
+}
+
+uint64_t
+nested_vmx_handler::shadow_vmcs() const
+{ return g_mm->virtptr_to_physint(m_shadow_vmcs.get()); }
+
+gsl::span<uint8_t>
+nested_vmx_handler::vmread_bitmap() noexcept
+{ return gsl::span<uint8_t>(m_vmread_bitmap.get(), 0x1000); }
+
+gsl::span<uint8_t>
+nested_vmx_handler::vmwrite_bitmap() noexcept
+{ return gsl::span<uint8_t>(m_vmwrite_bitmap.get(), 0x1000); }
+
+// -----------------------------------------------------------------------------
+// Debug
+// -----------------------------------------------------------------------------
+
+void
+nested_vmx_handler::dump_log()
+{
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "nested VMX counts", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subnhex(0, "VMX instruction exits", m_num_exits, msg);
+        bfdebug_subnhex(0, "VMREAD exits", m_num_vmread, msg);
+        bfdebug_subnhex(0, "VMWRITE exits", m_num_vmwrite, msg);
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+nested_vmx_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    using namespace vmcs_n;
+
+    if (!m_enabled) {
+        return false;
+    }
+
+    struct info_t info = {
+        exit_reason::basic_exit_reason::get(),
+        exit_qualification::get(),
+        vm_exit_instruction_information::get(),
+        false
+    };
+
+    m_num_exits++;
+
+    switch (info.exit_reason) {
+        case exit_reason::basic_exit_reason::vmread:
+            m_num_vmread++;
+            break;
+
+        case exit_reason::basic_exit_reason::vmwrite:
+            m_num_vmwrite++;
+            break;
+
+        default:
+            break;
+    }
+
+    if (m_handlers.dispatch(vmcs, info)) {
+        if (!info.ignore_advance) {
+            return advance(vmcs);
+        }
+
+        return true;
+    }
+
+    return this->unhandled(
+        exit_error::unhandled_exit, "nested_vmx_handler::handle: unhandled VMX instruction"
+    );
+}
+
+bool
+nested_vmx_handler::handle_cpuid(
+    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    if (!m_enabled) {
+        return false;
+    }
+
+    info.rcx = set_bit(
+                   info.rcx, ::intel_x64::cpuid::feature_information::ecx::vmx::from
+               );
+
+    return true;
+}
+
+}
+}
@@ -0,0 +1,194 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// PAUSE and PAUSE-loop exiting. These are not defined by the base
+// hypervisor, so they are defined here.
+//
+constexpr const auto vmx_procbased_ctls2_msr = 0x48BU;
+
+constexpr const uint64_t pause_exit_reason = 40U;
+constexpr const uint64_t pause_exiting = 1ULL << 30;
+constexpr const uint64_t pause_loop_exiting = 1ULL << 10;
+
+constexpr const uint64_t ple_gap_addr = 0x4020U;
+constexpr const uint64_t ple_window_addr = 0x4022U;
+
+constexpr const uint64_t max_ple_window = 0xFFFFFFFFU;
+
+pause_handler::pause_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+{
+    bfignored(eapis_vcpu_global_state);
+
+    apis->add_handler(
+        pause_exit_reason,
+        ::handler_delegate_t::create<pause_handler, &pause_handler::handle>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+pause_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+void
+pause_handler::enable_exiting()
+{
+    using namespace vmcs_n;
+
+    m_exiting = true;
+
+    this->vmwrite(
+        primary_processor_based_vm_execution_controls::addr,
+        this->vmread(primary_processor_based_vm_execution_controls::addr) | pause_exiting
+    );
+}
+
+void
+pause_handler::disable_exiting()
+{
+    using namespace vmcs_n;
+
+    m_exiting = false;
+
+    this->vmwrite(
+        primary_processor_based_vm_execution_controls::addr,
+        this->vmread(primary_processor_based_vm_execution_controls::addr) & ~pause_exiting
+    );
+}
+
+bool
+pause_handler::is_loop_exiting_supported()
+{
+    const auto allowed1 = ::intel_x64::msrs::get(vmx_procbased_ctls2_msr) >> 32;
+    return (allowed1 & pause_loop_exiting) != 0;
+}
+
+void
+pause_handler::enable_loop_exiting(
+    uint64_t gap, uint64_t window, uint64_t max_window)
+{
+    using namespace vmcs_n;
+
+    expects(is_loop_exiting_supported());
+    expects(window != 0);
+
+    m_loop_exiting = true;
+    m_base_window = std::min(window, max_ple_window);
+    m_max_window = std::min(std::max(window, max_window), max_ple_window);
+    m_window = m_base_window;
+
+    this->vmwrite(ple_gap_addr, std::min(gap, max_ple_window));
+    this->vmwrite(ple_window_addr, m_window);
+
+    this->vmwrite(
+        secondary_processor_based_vm_execution_controls::addr,
+        this->vmread(secondary_processor_based_vm_execution_controls::addr) | pause_loop_exiting
+    );
+}
+
+void
+pause_handler::disable_loop_exiting()
+{
+    using namespace vmcs_n;
+
+    m_loop_exiting = false;
+
+    this->vmwrite(
+        secondary_processor_based_vm_execution_controls::addr,
+        this->vmread(secondary_processor_based_vm_execution_controls::addr) & ~pause_loop_exiting
+    );
+}
+
+void
+pause_handler::grow_window()
+{
+    const auto window = std::min(m_window << 1U, m_max_window);
+
+    if (window != m_window) {
+        m_window = window;
+        this->vmwrite(ple_window_addr, m_window);
+    }
+}
+
+void
+pause_handler::shrink_window()
+{
+    if (m_window != m_base_window) {
+        m_window = m_base_window;
+        this->vmwrite(ple_window_addr, m_window);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+pause_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    const auto rip = vmcs->save_state()->rip;
+
+    // Note
+    //
+    // PAUSE exiting takes priority over PAUSE-loop exiting, so an exit
+    // is only a PAUSE-loop exit if PAUSE exiting is off.
+    //
+
+    const auto loop_exit = m_loop_exiting && !m_exiting;
+
+    m_exits++;
+
+    if (loop_exit) {
+        m_loop_exits++;
+        m_spins = (rip == m_last_rip) ? m_spins + 1 : 1;
+        m_last_rip = rip;
+
+        this->grow_window();
+    }
+
+    struct info_t info = {
+        loop_exit,
+        loop_exit ? m_spins : 0,
+        false
+    };
+
+    m_handlers.dispatch(vmcs, info);
+
+    if (!info.ignore_advance) {
+        return advance(vmcs);
+    }
+
+    return true;
+}
+
+}
+}
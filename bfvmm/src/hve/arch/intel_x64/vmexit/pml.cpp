@@ -0,0 +1,163 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+static constexpr const uint64_t pml_num_entries = 512U;
+
+pml_handler::pml_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis},
+    m_log_page{nullptr, free_page}
+{
+    using namespace vmcs_n;
+    bfignored(eapis_vcpu_global_state);
+
+    apis->add_handler(
+        exit_reason::basic_exit_reason::page_modification_log_full,
+        ::handler_delegate_t::create<pml_handler, &pml_handler::handle>(this)
+    );
+}
+
+pml_handler::~pml_handler()
+{
+    if (!ndebug && m_log_enabled) {
+        dump_log();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+pml_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+void
+pml_handler::enable()
+{
+    using namespace vmcs_n;
+
+    if (!m_log_page) {
+        m_log_page.reset(static_cast<uint64_t *>(alloc_page()));
+    }
+
+    this->vmwrite(pml_address::addr, g_mm->virtptr_to_physint(m_log_page.get()));
+    this->vmwrite(guest_pml_index::addr, pml_num_entries - 1U);
+
+    this->vmset_bits(
+        secondary_processor_based_vm_execution_controls::addr,
+        secondary_processor_based_vm_execution_controls::enable_pml::mask
+    );
+}
+
+void
+pml_handler::disable()
+{
+    using namespace vmcs_n;
+
+    this->vmclear_bits(
+        secondary_processor_based_vm_execution_controls::addr,
+        secondary_processor_based_vm_execution_controls::enable_pml::mask
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Drain
+// -----------------------------------------------------------------------------
+
+uint64_t
+pml_handler::drain(gsl::not_null<vmcs_t *> vmcs)
+{
+    using namespace vmcs_n;
+
+    if (!m_log_page) {
+        return 0;
+    }
+
+    // The CPU logs from the last entry to the first, decrementing the
+    // index after each write. Once the first entry is written, the index
+    // wraps, which is what triggers the log-full exit.
+    //
+
+    auto index = this->vmread(guest_pml_index::addr);
+    auto first = index >= pml_num_entries ? 0U : index + 1U;
+
+    if (first == pml_num_entries) {
+        return 0;
+    }
+
+    auto log = gsl::make_span(m_log_page.get(), static_cast<std::ptrdiff_t>(pml_num_entries));
+
+    struct info_t info = {
+        log.subspan(static_cast<std::ptrdiff_t>(first))
+    };
+
+    m_handlers.dispatch(vmcs, info);
+
+    this->vmwrite(guest_pml_index::addr, pml_num_entries - 1U);
+    m_num_drained += pml_num_entries - first;
+
+    return pml_num_entries - first;
+}
+
+// -----------------------------------------------------------------------------
+// Debug
+// -----------------------------------------------------------------------------
+
+void
+pml_handler::dump_log()
+{
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "PML counts", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subnhex(0, "log full exits", m_num_full, msg);
+        bfdebug_subnhex(0, "addresses drained", m_num_drained, msg);
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+pml_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    m_num_full++;
+    this->drain(vmcs);
+
+    m_apis->invalidate_ept();
+    return true;
+}
+
+}
+}
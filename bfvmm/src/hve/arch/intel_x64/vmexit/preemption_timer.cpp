@@ -0,0 +1,197 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// VMX-preemption timer. These are not defined by the base hypervisor, so
+// they are defined here.
+//
+constexpr const auto vmx_misc_msr = 0x485U;
+constexpr const uint64_t vmx_misc_timer_rate_mask = 0x1FU;
+constexpr const auto vmx_true_pinbased_ctls_msr = 0x48DU;
+
+constexpr const uint64_t preemption_timer_exit_reason = 52U;
+constexpr const uint64_t vmx_preemption_timer_value_addr = 0x482EU;
+constexpr const uint64_t activate_vmx_preemption_timer = 1ULL << 6;
+constexpr const uint64_t save_vmx_preemption_timer_value = 1ULL << 22;
+
+constexpr const uint64_t max_timer_value = 0xFFFFFFFFU;
+
+preemption_timer_handler::preemption_timer_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_rate{::intel_x64::msrs::get(vmx_misc_msr) & vmx_misc_timer_rate_mask}
+{
+    bfignored(eapis_vcpu_global_state);
+
+    apis->add_handler(
+        preemption_timer_exit_reason,
+        ::handler_delegate_t::create<preemption_timer_handler, &preemption_timer_handler::handle>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+preemption_timer_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+bool
+preemption_timer_handler::is_supported()
+{
+    const auto allowed1 = ::intel_x64::msrs::get(vmx_true_pinbased_ctls_msr) >> 32;
+    return (allowed1 & activate_vmx_preemption_timer) != 0;
+}
+
+void
+preemption_timer_handler::arm(uint64_t ticks)
+{
+    expects(is_supported());
+
+    const auto tsc = __builtin_ia32_rdtsc();
+
+    m_period = 0;
+    this->set_timer(tsc + ticks, tsc);
+}
+
+void
+preemption_timer_handler::arm_periodic(uint64_t period)
+{
+    expects(is_supported());
+    expects(period != 0);
+
+    const auto tsc = __builtin_ia32_rdtsc();
+
+    m_period = period;
+    this->set_timer(tsc + period, tsc);
+}
+
+void
+preemption_timer_handler::disarm()
+{
+    using namespace vmcs_n;
+
+    m_armed = false;
+    m_period = 0;
+
+    this->vmwrite(
+        pin_based_vm_execution_controls::addr,
+        this->vmread(pin_based_vm_execution_controls::addr) & ~activate_vmx_preemption_timer
+    );
+
+    this->vmwrite(
+        vm_exit_controls::addr,
+        this->vmread(vm_exit_controls::addr) & ~save_vmx_preemption_timer_value
+    );
+}
+
+void
+preemption_timer_handler::set_timer(uint64_t deadline, uint64_t tsc)
+{
+    using namespace vmcs_n;
+
+    // Note
+    //
+    // The timer is written in its own units, rounded up so that it never
+    // expires before the deadline. Deadlines that are too far out for the
+    // 32bit counter expire early, and the handler re-arms the remainder
+    // without calling the registered handlers.
+    //
+
+    const auto ticks = deadline > tsc ? deadline - tsc : 0;
+    const auto round = (1ULL << m_rate) - 1;
+
+    const auto value = std::min((ticks + round) >> m_rate, max_timer_value);
+    this->vmwrite(vmx_preemption_timer_value_addr, value);
+
+    if (!m_armed) {
+        this->vmwrite(
+            pin_based_vm_execution_controls::addr,
+            this->vmread(pin_based_vm_execution_controls::addr) | activate_vmx_preemption_timer
+        );
+
+        this->vmwrite(
+            vm_exit_controls::addr,
+            this->vmread(vm_exit_controls::addr) | save_vmx_preemption_timer_value
+        );
+    }
+
+    m_armed = true;
+    m_deadline = deadline;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+preemption_timer_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    const auto tsc = __builtin_ia32_rdtsc();
+
+    if (GSL_UNLIKELY(!m_armed)) {
+        return this->unhandled(
+            exit_error::unhandled_exit, "preemption_timer_handler::handle: timer is not armed"
+        );
+    }
+
+    if (GSL_UNLIKELY(tsc < m_deadline)) {
+        this->set_timer(m_deadline, tsc);
+        return true;
+    }
+
+    struct info_t info = {
+        tsc,
+        m_deadline
+    };
+
+    m_expirations++;
+
+    if (m_period != 0) {
+        auto next = m_deadline + m_period;
+
+        if (next <= tsc) {
+            const auto behind = (tsc - m_deadline) / m_period;
+
+            m_missed += behind;
+            next = m_deadline + ((behind + 1) * m_period);
+        }
+
+        this->set_timer(next, tsc);
+    }
+    else {
+        this->disarm();
+    }
+
+    m_handlers.dispatch(vmcs, info);
+
+    return true;
+}
+
+}
+}
@@ -28,7 +28,7 @@ rdmsr_handler::rdmsr_handler(
     gsl::not_null<apis *> apis,
     gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
 ) :
-    m_msr_bitmap{apis->m_msr_bitmap.get(), ::x64::pt::page_size}
+    m_bitmaps{&apis->m_bitmaps}
 {
     using namespace vmcs_n;
     bfignored(eapis_vcpu_global_state);
@@ -53,48 +53,49 @@ rdmsr_handler::~rdmsr_handler()
 void
 rdmsr_handler::add_handler(
     vmcs_n::value_type msr, const handler_delegate_t &d)
-{ m_handlers[msr].push_front(d); }
+{ m_handlers.at(msr).handlers.push_front(d); }
 
 void
-rdmsr_handler::trap_on_access(vmcs_n::value_type msr)
+rdmsr_handler::add_constant(vmcs_n::value_type msr, uint64_t val)
 {
-    if (msr <= 0x00001FFFUL) {
-        return set_bit(m_msr_bitmap, (msr - 0x00000000UL) + 0);
-    }
+    auto &hdlrs = m_handlers.at(msr);
 
-    if (msr >= 0xC0000000UL && msr <= 0xC0001FFFUL) {
-        return set_bit(m_msr_bitmap, (msr - 0xC0000000UL) + 0x2000);
-    }
-
-    throw std::runtime_error("invalid msr: " + std::to_string(msr));
+    hdlrs.constant = true;
+    hdlrs.val = val;
 }
 
+void
+rdmsr_handler::trap_on_access(vmcs_n::value_type msr)
+{ m_bitmaps->trap_msr_bit(bitmap_policy::rdmsr_bit(msr)); }
+
+void
+rdmsr_handler::trap_on_range(vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_bitmaps->trap_msr_range(bitmap_policy::rdmsr_bits(first, last)); }
+
 void
 rdmsr_handler::trap_on_all_accesses()
-{ gsl::memset(m_msr_bitmap.subspan(0, m_msr_bitmap.size() >> 1), 0xFF); }
+{ m_bitmaps->fill_msr_bitmap(0, 2048, 0xFF); }
 
 void
 rdmsr_handler::pass_through_access(vmcs_n::value_type msr)
-{
-    if (msr <= 0x00001FFFUL) {
-        return clear_bit(m_msr_bitmap, (msr - 0x00000000) + 0);
-    }
+{ m_bitmaps->pass_through_msr_bit(bitmap_policy::rdmsr_bit(msr)); }
 
-    if (msr >= 0xC0000000UL && msr <= 0xC0001FFFUL) {
-        return clear_bit(m_msr_bitmap, (msr - 0xC0000000UL) + 0x2000);
-    }
-
-    throw std::runtime_error("invalid msr: " + std::to_string(msr));
-}
+void
+rdmsr_handler::pass_through_range(vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_bitmaps->pass_through_msr_range(bitmap_policy::rdmsr_bits(first, last)); }
 
 void
 rdmsr_handler::pass_through_all_accesses()
-{ gsl::memset(m_msr_bitmap.subspan(0, m_msr_bitmap.size() >> 1), 0x00); }
+{ m_bitmaps->fill_msr_bitmap(0, 2048, 0x00); }
 
 // -----------------------------------------------------------------------------
 // Debug
 // -----------------------------------------------------------------------------
 
+const exit_counters<> &
+rdmsr_handler::counters() const noexcept
+{ return m_counters; }
+
 void
 rdmsr_handler::dump_log()
 {
@@ -109,10 +110,29 @@ rdmsr_handler::dump_log()
             bfdebug_subnhex(0, "val", record.val, msg);
         }
 
+        bfdebug_brk2(0, msg);
+
+        m_counters.for_each([&](uint64_t key, uint64_t count) {
+            bfdebug_subnhex(0, ("msr " + bfn::to_string(key, 16)).c_str(), count, msg);
+        });
+
+        bfdebug_subnhex(0, "other", m_counters.other(), msg);
+
         bfdebug_lnbr(0, msg);
     });
 }
 
+void
+rdmsr_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers += m_handlers.heap_bytes();
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+rdmsr_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -134,45 +154,66 @@ rdmsr_handler::handle(gsl::not_null<vmcs_t *> vmcs)
     // this case would be the interrupt code that would then inject a GP.
     //
 
-    const auto &hdlrs =
+    m_counters.inc(vmcs->save_state()->rcx);
+
+    const auto hdlrs =
         m_handlers.find(
             vmcs->save_state()->rcx
         );
 
-    if (GSL_LIKELY(hdlrs != m_handlers.end())) {
+    if (GSL_LIKELY(hdlrs != nullptr)) {
+
+        // A constant only short-circuits the read when no delegate is
+        // registered. Otherwise, the delegates see the constant as the
+        // value that was read, and it is the answer if none of them handle
+        // the read.
+        //
+
+        if (hdlrs->constant && hdlrs->handlers.empty()) {
+            vmcs->save_state()->rax = ((hdlrs->val >> 0x00) & 0x00000000FFFFFFFF);
+            vmcs->save_state()->rdx = ((hdlrs->val >> 0x20) & 0x00000000FFFFFFFF);
+
+            return advance(vmcs);
+        }
 
         struct info_t info = {
             vmcs->save_state()->rcx,
-            0,
+            hdlrs->val,
             false,
             false
         };
 
-        info.val =
-            emulate_rdmsr(
-                gsl::narrow_cast<::x64::msrs::field_type>(vmcs->save_state()->rcx)
-            );
+        if (!hdlrs->constant) {
+            info.val =
+                emulate_rdmsr(
+                    gsl::narrow_cast<::x64::msrs::field_type>(vmcs->save_state()->rcx)
+                );
+        }
 
-        if (!ndebug && m_log_enabled) {
+        if (record_exit()) {
             add_record(m_log, {
                 info.msr, info.val
             });
         }
 
-        for (const auto &d : hdlrs->second) {
-            if (d(vmcs, info)) {
+        if (hdlrs->handlers.dispatch(vmcs, info)) {
+            if (!info.ignore_write) {
+                vmcs->save_state()->rax = ((info.val >> 0x00) & 0x00000000FFFFFFFF);
+                vmcs->save_state()->rdx = ((info.val >> 0x20) & 0x00000000FFFFFFFF);
+            }
 
-                if (!info.ignore_write) {
-                    vmcs->save_state()->rax = ((info.val >> 0x00) & 0x00000000FFFFFFFF);
-                    vmcs->save_state()->rdx = ((info.val >> 0x20) & 0x00000000FFFFFFFF);
-                }
+            if (!info.ignore_advance) {
+                return advance(vmcs);
+            }
+
+            return true;
+        }
 
-                if (!info.ignore_advance) {
-                    return advance(vmcs);
-                }
+        if (hdlrs->constant) {
+            vmcs->save_state()->rax = ((hdlrs->val >> 0x00) & 0x00000000FFFFFFFF);
+            vmcs->save_state()->rdx = ((hdlrs->val >> 0x20) & 0x00000000FFFFFFFF);
 
-                return true;
-            }
+            return advance(vmcs);
         }
     }
 
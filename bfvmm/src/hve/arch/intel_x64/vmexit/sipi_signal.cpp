@@ -89,15 +89,15 @@ sipi_signal_handler::handle(gsl::not_null<vmcs_t *> vmcs)
     uint64_t vector_cs_base =
         vmcs_n::exit_qualification::sipi::vector::get() << 12;
 
-    vmcs_n::guest_cs_selector::set(vector_cs_selector);
-    vmcs_n::guest_cs_base::set(vector_cs_base);
-    vmcs_n::guest_cs_limit::set(0xFFFF);
-    vmcs_n::guest_cs_access_rights::set(0x9B);
+    this->vmwrite(vmcs_n::guest_cs_selector::addr, vector_cs_selector);
+    this->vmwrite(vmcs_n::guest_cs_base::addr, vector_cs_base);
+    this->vmwrite(vmcs_n::guest_cs_limit::addr, 0xFFFF);
+    this->vmwrite(vmcs_n::guest_cs_access_rights::addr, 0x9B);
 
     vmcs->save_state()->rip = 0;
 
-    vmcs_n::guest_activity_state::set(
-        vmcs_n::guest_activity_state::active
+    this->vmwrite(
+        vmcs_n::guest_activity_state::addr, vmcs_n::guest_activity_state::active
     );
 
     // .........................................................................
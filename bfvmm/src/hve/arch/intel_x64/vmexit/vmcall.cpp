@@ -0,0 +1,92 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+vmcall_handler::vmcall_handler(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+{
+    using namespace vmcs_n;
+    bfignored(eapis_vcpu_global_state);
+
+    apis->add_handler(
+        exit_reason::basic_exit_reason::vmcall,
+        ::handler_delegate_t::create<vmcall_handler, &vmcall_handler::handle>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+vmcall_handler::add_handler(
+    uint64_t opcode, const handler_delegate_t &d, int64_t priority)
+{ m_handlers[opcode].push_front(d, priority); }
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+vmcall_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    const auto &hdlrs = m_handlers.find(vmcs->save_state()->rax);
+
+    if (hdlrs == m_handlers.end()) {
+        return false;
+    }
+
+    struct info_t info = {
+        vmcs->save_state()->rax,
+        vmcs->save_state()->rbx,
+        vmcs->save_state()->rcx,
+        vmcs->save_state()->rdx,
+        false,
+        false
+    };
+
+    if (!hdlrs->second.dispatch(vmcs, info)) {
+        return false;
+    }
+
+    m_calls++;
+
+    if (!info.ignore_write) {
+        vmcs->save_state()->rax = info.rax;
+        vmcs->save_state()->rbx = info.rbx;
+        vmcs->save_state()->rcx = info.rcx;
+        vmcs->save_state()->rdx = info.rdx;
+    }
+
+    if (!info.ignore_advance) {
+        return advance(vmcs);
+    }
+
+    return true;
+}
+
+}
+}
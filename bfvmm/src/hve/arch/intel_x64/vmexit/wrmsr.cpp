@@ -28,7 +28,7 @@ wrmsr_handler::wrmsr_handler(
     gsl::not_null<apis *> apis,
     gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
 ) :
-    m_msr_bitmap{apis->m_msr_bitmap.get(), ::x64::pt::page_size}
+    m_bitmaps{&apis->m_bitmaps}
 {
     using namespace vmcs_n;
     bfignored(eapis_vcpu_global_state);
@@ -53,48 +53,49 @@ wrmsr_handler::~wrmsr_handler()
 void
 wrmsr_handler::add_handler(
     vmcs_n::value_type msr, const handler_delegate_t &d)
-{ m_handlers[msr].push_front(d); }
+{ m_handlers.at(msr).handlers.push_front(d); }
 
 void
-wrmsr_handler::trap_on_access(vmcs_n::value_type msr)
+wrmsr_handler::add_write_mask(vmcs_n::value_type msr, uint64_t mask)
 {
-    if (msr <= 0x00001FFFUL) {
-        return set_bit(m_msr_bitmap, (msr - 0x00000000UL) + 0x4000);
-    }
-
-    if (msr >= 0xC0000000UL && msr <= 0xC0001FFFUL) {
-        return set_bit(m_msr_bitmap, (msr - 0xC0000000UL) + 0x6000);
-    }
+    auto &hdlrs = m_handlers.at(msr);
 
-    throw std::runtime_error("invalid msr: " + std::to_string(msr));
+    hdlrs.constant = true;
+    hdlrs.mask = mask;
 }
 
+void
+wrmsr_handler::trap_on_access(vmcs_n::value_type msr)
+{ m_bitmaps->trap_msr_bit(bitmap_policy::wrmsr_bit(msr)); }
+
+void
+wrmsr_handler::trap_on_range(vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_bitmaps->trap_msr_range(bitmap_policy::wrmsr_bits(first, last)); }
+
 void
 wrmsr_handler::trap_on_all_accesses()
-{ gsl::memset(m_msr_bitmap.subspan(2048, m_msr_bitmap.size() >> 1), 0xFF); }
+{ m_bitmaps->fill_msr_bitmap(2048, 2048, 0xFF); }
 
 void
 wrmsr_handler::pass_through_access(vmcs_n::value_type msr)
-{
-    if (msr <= 0x00001FFFUL) {
-        return clear_bit(m_msr_bitmap, (msr - 0x00000000UL) + 0x4000);
-    }
-
-    if (msr >= 0xC0000000UL && msr <= 0xC0001FFFUL) {
-        return clear_bit(m_msr_bitmap, (msr - 0xC0000000UL) + 0x6000);
-    }
+{ m_bitmaps->pass_through_msr_bit(bitmap_policy::wrmsr_bit(msr)); }
 
-    throw std::runtime_error("invalid msr: " + std::to_string(msr));
-}
+void
+wrmsr_handler::pass_through_range(vmcs_n::value_type first, vmcs_n::value_type last)
+{ m_bitmaps->pass_through_msr_range(bitmap_policy::wrmsr_bits(first, last)); }
 
 void
 wrmsr_handler::pass_through_all_accesses()
-{ gsl::memset(m_msr_bitmap.subspan(2048, m_msr_bitmap.size() >> 1), 0x00); }
+{ m_bitmaps->fill_msr_bitmap(2048, 2048, 0x00); }
 
 // -----------------------------------------------------------------------------
 // Debug
 // -----------------------------------------------------------------------------
 
+const exit_counters<> &
+wrmsr_handler::counters() const noexcept
+{ return m_counters; }
+
 void
 wrmsr_handler::dump_log()
 {
@@ -109,10 +110,29 @@ wrmsr_handler::dump_log()
             bfdebug_subnhex(0, "val", record.val, msg);
         }
 
+        bfdebug_brk2(0, msg);
+
+        m_counters.for_each([&](uint64_t key, uint64_t count) {
+            bfdebug_subnhex(0, ("msr " + bfn::to_string(key, 16)).c_str(), count, msg);
+        });
+
+        bfdebug_subnhex(0, "other", m_counters.other(), msg);
+
         bfdebug_lnbr(0, msg);
     });
 }
 
+void
+wrmsr_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers += m_handlers.heap_bytes();
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+wrmsr_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -134,51 +154,81 @@ wrmsr_handler::handle(gsl::not_null<vmcs_t *> vmcs)
     // this case would be the interrupt code that would then inject a GP.
     //
 
-    const auto &hdlrs =
+    m_counters.inc(vmcs->save_state()->rcx);
+
+    const auto hdlrs =
         m_handlers.find(
             vmcs->save_state()->rcx
         );
 
-    if (GSL_LIKELY(hdlrs != m_handlers.end())) {
+    if (GSL_LIKELY(hdlrs != nullptr)) {
+
+        auto val =
+            ((vmcs->save_state()->rax & 0x00000000FFFFFFFF) << 0) |
+            ((vmcs->save_state()->rdx & 0x00000000FFFFFFFF) << 32);
+
+        // A mask only short-circuits the write when no delegate is
+        // registered. Otherwise, the delegates are called first, and the
+        // mask still restricts what reaches the real MSR.
+        //
+
+        if (hdlrs->constant && hdlrs->handlers.empty()) {
+            this->write_masked(vmcs->save_state()->rcx, val, hdlrs->mask);
+            return advance(vmcs);
+        }
 
         struct info_t info = {
             vmcs->save_state()->rcx,
-            0,
+            val,
             false,
             false
         };
 
-        info.val =
-            ((vmcs->save_state()->rax & 0x00000000FFFFFFFF) << 0) |
-            ((vmcs->save_state()->rdx & 0x00000000FFFFFFFF) << 32);
-
-        if (!ndebug && m_log_enabled) {
+        if (record_exit()) {
             add_record(m_log, {
                 info.msr, info.val
             });
         }
 
-        for (const auto &d : hdlrs->second) {
-            if (d(vmcs, info)) {
-
-                if (!info.ignore_write) {
+        if (hdlrs->handlers.dispatch(vmcs, info)) {
+            if (!info.ignore_write) {
+                if (hdlrs->constant) {
+                    this->write_masked(info.msr, info.val, hdlrs->mask);
+                }
+                else {
                     emulate_wrmsr(
                         gsl::narrow_cast<::x64::msrs::field_type>(info.msr),
                         info.val
                     );
                 }
+            }
 
-                if (!info.ignore_advance) {
-                    return advance(vmcs);
-                }
-
-                return true;
+            if (!info.ignore_advance) {
+                return advance(vmcs);
             }
+
+            return true;
+        }
+
+        if (hdlrs->constant) {
+            this->write_masked(info.msr, val, hdlrs->mask);
+            return advance(vmcs);
         }
     }
 
     return false;
 }
 
+void
+wrmsr_handler::write_masked(uint64_t msr, uint64_t val, uint64_t mask)
+{
+    if (mask == 0) {
+        return;
+    }
+
+    auto field = gsl::narrow_cast<::x64::msrs::field_type>(msr);
+    emulate_wrmsr(field, set_bits(emulate_rdmsr(field), mask, val));
+}
+
 }
 }
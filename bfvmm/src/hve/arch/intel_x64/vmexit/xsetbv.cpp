@@ -24,9 +24,77 @@ namespace eapis
 namespace intel_x64
 {
 
+// The base hypervisor does not provide the XSAVE family of intrinsics, so
+// they are built here. These only run in the VMM (XSAVES / XRSTORS are
+// supervisor instructions).
+//
+
+__attribute__((target("xsave,xsaves"))) static void
+xsaves(void *area, uint64_t mask) noexcept
+{ __builtin_ia32_xsaves64(area, static_cast<long long>(mask)); }
+
+__attribute__((target("xsave,xsaves"))) static void
+xrstors(void *area, uint64_t mask) noexcept
+{ __builtin_ia32_xrstors64(area, static_cast<long long>(mask)); }
+
+__attribute__((target("xsave"))) static void
+xsave(void *area, uint64_t mask) noexcept
+{ __builtin_ia32_xsave64(area, static_cast<long long>(mask)); }
+
+__attribute__((target("xsave"))) static void
+xrstor(void *area, uint64_t mask) noexcept
+{ __builtin_ia32_xrstor64(area, static_cast<long long>(mask)); }
+
+constexpr const auto xsave_leaf = 0xDU;
+constexpr const auto xsave_alignment = 64U;
+constexpr const uint64_t xsaves_supported = 1ULL << 3;
+
+constexpr const uint64_t xsave_legacy_size = 512U;
+constexpr const uint64_t xsave_header_size = 64U;
+constexpr const uint64_t xsave_component_aligned = 1ULL << 1;
+constexpr const auto xsave_first_extended_component = 2U;
+constexpr const auto xsave_num_components = 63U;
+
+// The compact format packs the enabled components one after the other,
+// so CPUID.(EAX=0DH,ECX=1):EBX only reports the size for the components
+// enabled in XCR0 | IA32_XSS when it is executed. The guest may enable
+// more of them later, so the size is worked out for every user (XCR0)
+// and supervisor (IA32_XSS) component the CPU supports instead.
+//
+static uint64_t
+xsave_compact_size()
+{
+    auto user = ::x64::cpuid::get(xsave_leaf, 0, 0, 0);
+    auto supervisor = ::x64::cpuid::get(xsave_leaf, 0, 1, 0);
+
+    auto components =
+        (user.rax & 0xFFFFFFFFULL) | ((user.rdx & 0xFFFFFFFFULL) << 32) |
+        (supervisor.rcx & 0xFFFFFFFFULL) | ((supervisor.rdx & 0xFFFFFFFFULL) << 32);
+
+    auto size = xsave_legacy_size + xsave_header_size;
+
+    for (auto i = xsave_first_extended_component; i < xsave_num_components; i++) {
+        if ((components & (1ULL << i)) == 0) {
+            continue;
+        }
+
+        auto component = ::x64::cpuid::get(xsave_leaf, 0, i, 0);
+
+        if ((component.rcx & xsave_component_aligned) != 0) {
+            size = (size + xsave_alignment - 1) & ~static_cast<uint64_t>(xsave_alignment - 1);
+        }
+
+        size += component.rax & 0xFFFFFFFFULL;
+    }
+
+    return size;
+}
+
 xsetbv_handler::xsetbv_handler(
     gsl::not_null<apis *> apis,
-    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_guest_xcr0{::intel_x64::xcr0::get()}
 {
     using namespace vmcs_n;
     bfignored(eapis_vcpu_global_state);
@@ -49,8 +117,93 @@ xsetbv_handler::~xsetbv_handler()
 // -----------------------------------------------------------------------------
 
 void
-xsetbv_handler::add_handler(const handler_delegate_t &d)
-{ m_handlers.push_front(d); }
+xsetbv_handler::add_handler(
+    const handler_delegate_t &d, int64_t priority)
+{ m_handlers.push_front(d, priority); }
+
+// -----------------------------------------------------------------------------
+// Extended State
+// -----------------------------------------------------------------------------
+
+uint8_t *
+xsetbv_handler::xsave_area()
+{
+    if (m_xsave_area != nullptr) {
+        return m_xsave_area;
+    }
+
+    // XSAVES uses the compact format (see xsave_compact_size()). Without
+    // XSAVES, the standard format is used, whose size for every component
+    // the CPU supports is in CPUID.(EAX=0DH,ECX=0):ECX.
+    //
+
+    m_xsaves = (::x64::cpuid::get(xsave_leaf, 0, 1, 0).rax & xsaves_supported) != 0;
+
+    auto size = m_xsaves ?
+                xsave_compact_size() : ::x64::cpuid::get(xsave_leaf, 0, 0, 0).rcx & 0xFFFFFFFFULL;
+
+    m_xsave_size = gsl::narrow_cast<std::size_t>(size);
+    m_xsave_buffer = std::make_unique<uint8_t[]>(m_xsave_size + xsave_alignment);
+
+    auto addr = reinterpret_cast<uintptr_t>(m_xsave_buffer.get());
+    addr = (addr + xsave_alignment - 1) & ~static_cast<uintptr_t>(xsave_alignment - 1);
+
+    m_xsave_area = reinterpret_cast<uint8_t *>(addr);
+    return m_xsave_area;
+}
+
+std::size_t
+xsetbv_handler::xsave_area_size()
+{
+    this->xsave_area();
+    return m_xsave_size;
+}
+
+void
+xsetbv_handler::begin_host_xstate(uint64_t host_xcr0)
+{
+    expects((host_xcr0 & 0x1U) != 0);
+
+    if (m_host_xstate_depth++ != 0) {
+        return;
+    }
+
+    auto area = this->xsave_area();
+
+    if (m_xsaves) {
+        xsaves(area, m_guest_xcr0);
+    }
+    else {
+        xsave(area, m_guest_xcr0);
+    }
+
+    if (host_xcr0 != m_guest_xcr0) {
+        ::intel_x64::xcr0::set(host_xcr0);
+    }
+
+    m_guest_xstate_saves++;
+}
+
+void
+xsetbv_handler::end_host_xstate()
+{
+    expects(m_host_xstate_depth != 0);
+
+    if (--m_host_xstate_depth != 0) {
+        return;
+    }
+
+    if (::intel_x64::xcr0::get() != m_guest_xcr0) {
+        ::intel_x64::xcr0::set(m_guest_xcr0);
+    }
+
+    if (m_xsaves) {
+        xrstors(m_xsave_area, m_guest_xcr0);
+    }
+    else {
+        xrstor(m_xsave_area, m_guest_xcr0);
+    }
+}
 
 // -----------------------------------------------------------------------------
 // Debug
@@ -73,6 +226,18 @@ xsetbv_handler::dump_log()
     });
 }
 
+void
+xsetbv_handler::memory_usage(memory_usage_t &usage) const
+{
+    usage.handlers += m_handlers.heap_bytes();
+    usage.handlers += m_xsave_buffer ? m_xsave_size + xsave_alignment : 0;
+    usage.logs += sizeof(m_log);
+}
+
+std::size_t
+xsetbv_handler::drain_log(gsl::span<record_t> records)
+{ return m_log.drain(records); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -89,20 +254,30 @@ xsetbv_handler::handle(gsl::not_null<vmcs_t *> vmcs)
     info.val |= ((vmcs->save_state()->rax & 0x00000000FFFFFFFF) << 0x00);
     info.val |= ((vmcs->save_state()->rdx & 0x00000000FFFFFFFF) << 0x20);
 
-    if (!ndebug && m_log_enabled) {
+    if (record_exit()) {
         add_record(m_log, {
             info.val
         });
     }
 
-    for (const auto &d : m_handlers) {
-        if (d(vmcs, info)) {
-            break;
-        }
-    }
+    m_handlers.dispatch(vmcs, info);
 
     if (!info.ignore_write) {
-        ::intel_x64::xcr0::set(info.val);
+
+        // While the host's extended state is loaded, the new value is
+        // loaded by end_host_xstate() instead.
+        //
+
+        if (info.val == m_guest_xcr0) {
+            m_redundant_writes++;
+        }
+        else {
+            if (m_host_xstate_depth == 0) {
+                ::intel_x64::xcr0::set(info.val);
+            }
+
+            m_guest_xcr0 = info.val;
+        }
     }
 
     if (!info.ignore_advance) {
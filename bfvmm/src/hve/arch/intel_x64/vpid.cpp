@@ -24,6 +24,66 @@ namespace eapis
 namespace intel_x64
 {
 
+constexpr const uint64_t vpid_mask = 0xFFFFULL;
+constexpr const uint64_t tag_one = 0x10000ULL;
+
+// -----------------------------------------------------------------------------
+// VPID Allocator
+// -----------------------------------------------------------------------------
+
+vpid_allocator *
+vpid_allocator::instance() noexcept
+{
+    static vpid_allocator self;
+    return &self;
+}
+
+uint16_t
+vpid_allocator::allocate(bool &recycled) noexcept
+{
+    auto head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+
+    while ((head & vpid_mask) != 0) {
+        auto id = head & vpid_mask;
+        auto next = ((head & ~vpid_mask) + tag_one) |
+                    __atomic_load_n(&m_next.at(id), __ATOMIC_RELAXED);
+
+        if (__atomic_compare_exchange_n(
+                &m_head, &head, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            recycled = true;
+            return gsl::narrow_cast<uint16_t>(id);
+        }
+    }
+
+    auto id = __atomic_fetch_add(&m_fresh, 1, __ATOMIC_RELAXED);
+    if (id >= max_vpids) {
+        return 0;
+    }
+
+    recycled = false;
+    return gsl::narrow_cast<uint16_t>(id);
+}
+
+void
+vpid_allocator::release(uint16_t id)
+{
+    expects(id != 0);
+
+    auto head = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        __atomic_store_n(&m_next.at(id), gsl::narrow_cast<uint16_t>(head & vpid_mask), __ATOMIC_RELAXED);
+        next = ((head & ~vpid_mask) + tag_one) | id;
+    }
+    while (!__atomic_compare_exchange_n(
+               &m_head, &head, next, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// -----------------------------------------------------------------------------
+// VPID Handler
+// -----------------------------------------------------------------------------
+
 vpid_handler::vpid_handler(
     gsl::not_null<apis *> apis,
     gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state)
@@ -31,17 +91,56 @@ vpid_handler::vpid_handler(
     bfignored(apis);
     bfignored(eapis_vcpu_global_state);
 
-    static uint16_t s_id = 1;
-    m_id = s_id++;
+    m_id = g_vpids->allocate(m_flush);
+
+    if (m_id == 0) {
+        bfalert_info(0, "vpid_handler: out of VPIDs");
+    }
 
     vmcs_n::virtual_processor_identifier::set(m_id);
 }
 
+vpid_handler::~vpid_handler()
+{
+    if (m_id != 0) {
+        g_vpids->release(gsl::narrow_cast<uint16_t>(m_id));
+    }
+}
+
+vpid_handler::vpid_handler(vpid_handler &&other) noexcept :
+    m_id{std::exchange(other.m_id, 0)},
+    m_flush{other.m_flush}
+{ }
+
+vpid_handler &
+vpid_handler::operator=(vpid_handler &&other) noexcept
+{
+    if (this != &other) {
+        if (m_id != 0) {
+            g_vpids->release(gsl::narrow_cast<uint16_t>(m_id));
+        }
+
+        m_id = std::exchange(other.m_id, 0);
+        m_flush = other.m_flush;
+    }
+
+    return *this;
+}
+
 vmcs_n::value_type vpid_handler::id() const noexcept
 { return m_id; }
 
 void vpid_handler::enable()
-{ vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::enable(); }
+{
+    expects(m_id != 0);
+
+    if (m_flush) {
+        ::intel_x64::vmx::invvpid_single_context(m_id);
+        m_flush = false;
+    }
+
+    vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::enable();
+}
 
 void vpid_handler::disable()
 { vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::disable(); }
@@ -0,0 +1,267 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <hve/arch/intel_x64/apis.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+ept_write_monitor::ept_write_monitor(
+    gsl::not_null<apis *> apis,
+    gsl::not_null<eapis_vcpu_global_state_t *> eapis_vcpu_global_state
+) :
+    m_apis{apis}
+{ bfignored(eapis_vcpu_global_state); }
+
+// -----------------------------------------------------------------------------
+// Watch / Unwatch
+// -----------------------------------------------------------------------------
+
+void
+ept_write_monitor::watch(
+    ept::mmap &map, uint64_t gpa, const handler_delegate_t &d)
+{
+    using namespace ::intel_x64::ept;
+
+    const auto page = bfn::upper(gpa, pt::from);
+    const auto gfn = page >> pt::from;
+
+    auto iter = m_pages.find(gfn);
+    if (iter != m_pages.end()) {
+        iter->second.d = d;
+        return;
+    }
+
+    const auto was_writable =
+        pt::entry::write_access::is_enabled(map.entry_value(page));
+
+    // Large pages are split so that only this 4k page loses write access.
+    // The split already removes it, which is why was_writable is read
+    // first.
+    //
+
+    if (!map.is_4k(page)) {
+        auto entry = map.entry_value(page);
+
+        if (pt::entry::read_access::is_enabled(entry)) {
+            map.protect(page, pt::page_size, pt::entry::execute_access::is_enabled(entry) ?
+                        ept::mmap::attr_type::read_execute : ept::mmap::attr_type::read_only);
+        }
+        else {
+            map.protect(page, pt::page_size, ept::mmap::attr_type::execute_only);
+        }
+    }
+
+    pt::entry::write_access::disable(map.entry(page));
+    m_pages[gfn] = {&map, d, 0, was_writable};
+
+    if (!m_registered_step) {
+        m_apis->add_monitor_trap_handler(
+            monitor_trap_handler::handler_delegate_t::create<
+            ept_write_monitor, &ept_write_monitor::handle_step>(this)
+        );
+
+        m_registered_step = true;
+    }
+
+    // Read-modify-write instructions report both a read and a write, and
+    // the read is dispatched first, so both are registered (see
+    // handle_violation).
+    //
+
+    m_apis->add_ept_page_violation_handler(
+        page, ept_violation_handler::access_read | ept_violation_handler::access_write,
+        ept_violation_handler::handler_delegate_t::create<
+        ept_write_monitor, &ept_write_monitor::handle_violation>(this)
+    );
+
+    m_apis->invalidate_ept();
+}
+
+void
+ept_write_monitor::unwatch(uint64_t gpa)
+{
+    const auto page = bfn::upper(gpa, ::intel_x64::ept::pt::from);
+    const auto gfn = page >> ::intel_x64::ept::pt::from;
+
+    auto iter = m_pages.find(gfn);
+    if (iter == m_pages.end()) {
+        return;
+    }
+
+    this->set_writable(gfn, iter->second, iter->second.was_writable);
+    m_pages.erase(iter);
+
+    m_stepping.erase(std::remove(m_stepping.begin(), m_stepping.end(), gfn), m_stepping.end());
+    m_window.erase(std::remove(m_window.begin(), m_window.end(), gfn), m_window.end());
+
+    m_apis->remove_ept_page_violation_handlers(page);
+    m_apis->invalidate_ept();
+}
+
+bool
+ept_write_monitor::is_watched(uint64_t gpa) const
+{ return m_pages.count(gpa >> ::intel_x64::ept::pt::from) != 0; }
+
+void
+ept_write_monitor::set_batching(uint64_t writes, uint64_t ticks) noexcept
+{
+    if (writes == 0 || ticks == 0) {
+        writes = 0;
+        ticks = 0;
+    }
+
+    m_batch_writes = writes;
+    m_batch_ticks = ticks;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+ept_write_monitor::handle_violation(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+{
+    using namespace vmcs_n::exit_qualification::ept_violation;
+    const auto gfn = info.gpa >> ::intel_x64::ept::pt::from;
+
+    if (!data_write::is_enabled(info.exit_qualification)) {
+        return false;
+    }
+
+    auto iter = m_pages.find(gfn);
+    if (GSL_UNLIKELY(iter == m_pages.end())) {
+        return false;
+    }
+
+    auto &page = iter->second;
+    struct info_t write_info = {
+        info.gva,
+        info.gpa
+    };
+
+    if (!page.d(vmcs, write_info)) {
+        return false;
+    }
+
+    this->set_writable(gfn, page, true);
+
+    m_violations++;
+    page.faults++;
+
+    // The write is re-executed once the page is writable, as RIP is not
+    // advanced. Hot pages stay writable until the batching window closes,
+    // and every other page is re-protected after a single step.
+    //
+
+    if (m_batch_writes != 0 && page.faults > m_batch_writes) {
+        if (!m_registered_timer) {
+            m_apis->add_preemption_timer_handler(
+                preemption_timer_handler::handler_delegate_t::create<
+                ept_write_monitor, &ept_write_monitor::handle_timer>(this)
+            );
+
+            m_registered_timer = true;
+        }
+
+        if (m_window.empty()) {
+            m_apis->arm_preemption_deadline(m_batch_ticks);
+        }
+
+        m_window.push_back(gfn);
+        return true;
+    }
+
+    m_stepping.push_back(gfn);
+    m_apis->enable_monitor_trap_flag();
+
+    return true;
+}
+
+bool
+ept_write_monitor::handle_step(
+    gsl::not_null<vmcs_t *> vmcs, monitor_trap_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    if (m_stepping.empty()) {
+        return false;
+    }
+
+    m_steps++;
+    this->reprotect(m_stepping);
+
+    return true;
+}
+
+bool
+ept_write_monitor::handle_timer(
+    gsl::not_null<vmcs_t *> vmcs, preemption_timer_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    if (m_window.empty()) {
+        return false;
+    }
+
+    m_windows++;
+    this->reprotect(m_window);
+
+    m_apis->invalidate_ept();
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void
+ept_write_monitor::set_writable(uint64_t gfn, const page_t &page, bool writable)
+{
+    using namespace ::intel_x64::ept::pt::entry;
+    auto &entry = page.map->entry(gfn << ::intel_x64::ept::pt::from);
+
+    if (writable) {
+        write_access::enable(entry);
+    }
+    else {
+        write_access::disable(entry);
+    }
+}
+
+void
+ept_write_monitor::reprotect(std::vector<uint64_t> &gfns)
+{
+    for (const auto &gfn : gfns) {
+        auto iter = m_pages.find(gfn);
+        if (iter != m_pages.end()) {
+            iter->second.faults = 0;
+            this->set_writable(gfn, iter->second, false);
+        }
+    }
+
+    gfns.clear();
+}
+
+}
+}
@@ -0,0 +1,140 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/ept.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+//
+// These are hidden from the unit tests (they are tagged with [.bench]), and
+// are run using:
+//
+//     ./bench_ept [.bench]
+//
+// Each benchmark builds (and tears down) an EPT identity map of 4 GB, 64 GB
+// and 1 TB, reporting the wall time of each step, along with the number of
+// page tables that the map holds and the memory those tables use once the
+// step completes.
+// -----------------------------------------------------------------------------
+
+using namespace eapis::intel_x64;
+using range_t = mtrrs::range_t;
+
+static constexpr const std::array<uint64_t, 3> g_sizes = {
+    0x100000000ULL,         // 4 GB
+    0x1000000000ULL,        // 64 GB
+    0x10000000000ULL        // 1 TB
+};
+
+// The layout of a typical host: the fake ranges used by the MTRR / identity
+// map unit tests (with 4k and 2m boundaries below 16 MB), plus an uncached
+// PCI hole between 3 GB and 4 GB. This has to be set up before the first
+// use of g_mtrrs, which reads the MTRRs once.
+//
+static void
+setup_mtrrs()
+{
+    enable_mtrrs(4);
+    add_variable_range(0, range_t{wb, 0x100000, 0x1000});
+    add_variable_range(1, range_t{wb, 0x200000, 0x400000});
+    add_variable_range(2, range_t{wb, 0x600000, 0x1000});
+    add_variable_range(3, range_t{uc, 0xC0000000, 0x40000000});
+}
+
+static uint64_t
+num_tables(const ept::mmap &map)
+{ return 1 + map.pdpt_count() + map.pd_count() + map.pt_count(); }
+
+template<typename F> void
+bench(const char *name, uint64_t size, const ept::mmap *map, F func)
+{
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    auto tables = map != nullptr ? num_tables(*map) : 0;
+
+    std::cout << std::left << std::setw(32) << name
+              << std::right << std::setw(6) << (size >> 30) << " GB"
+              << std::setw(12) << usec << " us"
+              << std::setw(10) << tables << " tables"
+              << std::setw(12) << (tables * ::x64::pt::page_size) / 1024 << " KB\n";
+}
+
+TEST_CASE("bench: identity_map", "[.bench]")
+{
+    setup_mtrrs();
+
+    for (const auto size : g_sizes) {
+        auto map = std::make_unique<ept::mmap>();
+
+        bench("identity_map", size, map.get(), [&] {
+            ept::identity_map(*map, 0, size);
+        });
+
+        bench("identity_map_convert_1g_to_2m", size, map.get(), [&] {
+            for (auto gpa = 0ULL; gpa < size; gpa += ::intel_x64::ept::pdpt::page_size) {
+                if (map->is_1g(gpa)) {
+                    ept::identity_map_convert_1g_to_2m(*map, gpa);
+                }
+            }
+        });
+
+        bench("identity_map_convert_2m_to_4k", size, map.get(), [&] {
+            for (auto gpa = 0ULL; gpa < ::intel_x64::ept::pdpt::page_size; gpa += ::intel_x64::ept::pd::page_size) {
+                if (map->is_2m(gpa)) {
+                    ept::identity_map_convert_2m_to_4k(*map, gpa);
+                }
+            }
+        });
+
+        bench("~mmap()", size, nullptr, [&] {
+            map.reset();
+        });
+    }
+}
+
+TEST_CASE("bench: release", "[.bench]")
+{
+    setup_mtrrs();
+
+    for (const auto size : g_sizes) {
+        auto map = std::make_unique<ept::mmap>();
+
+        bench("identity_map_1g", size, map.get(), [&] {
+            ept::identity_map_1g(*map, 0, size);
+        });
+
+        bench("identity_unmap_1g", size, map.get(), [&] {
+            ept::identity_unmap_1g(*map, 0, size);
+        });
+
+        bench("identity_release_1g", size, map.get(), [&] {
+            ept::identity_release_1g(*map, 0, size);
+        });
+    }
+}
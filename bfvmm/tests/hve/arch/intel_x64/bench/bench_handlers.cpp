@@ -0,0 +1,227 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/ept.h>
+#include <hve/arch/intel_x64/vmexit/cpuid.h>
+#include <hve/arch/intel_x64/vmexit/ept_violation.h>
+#include <hve/arch/intel_x64/vmexit/io_instruction.h>
+#include <hve/arch/intel_x64/vmexit/rdmsr.h>
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+//
+// These are hidden from the unit tests (they are tagged with [.bench]), and
+// are run using:
+//
+//     ./bench_handlers [.bench]
+//
+// Each benchmark reports the average number of cycles and allocations per
+// operation. The number of operations can be changed using the
+// EAPIS_BENCH_ITERATIONS environment variable. Note that the handlers are
+// driven through the same mocks used by the unit tests, so the numbers are
+// only meaningful when compared against each other (e.g. before and after
+// a change).
+// -----------------------------------------------------------------------------
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+static uint64_t
+iterations()
+{
+    if (auto str = std::getenv("EAPIS_BENCH_ITERATIONS")) {
+        return std::strtoull(str, nullptr, 10);
+    }
+
+    return 100000;
+}
+
+template<typename F> void
+bench(const char *name, F func)
+{
+    auto num = iterations();
+
+    auto allocs = alloc_counter::count();
+    auto start = read_tsc();
+
+    for (auto i = 0ULL; i < num; i++) {
+        func();
+    }
+
+    auto cycles = read_tsc() - start;
+    allocs = alloc_counter::count() - allocs;
+
+    std::cout << std::left << std::setw(32) << name
+              << std::right << std::setw(12) << cycles / num << " cycles/op"
+              << std::setw(12) << static_cast<double>(allocs) / static_cast<double>(num)
+              << " allocs/op\n";
+}
+
+bool
+cpuid_handler_ignore_advance(
+    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.ignore_write = true;
+    info.ignore_advance = true;
+    return true;
+}
+
+bool
+rdmsr_handler_ignore_advance(
+    gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.ignore_write = true;
+    info.ignore_advance = true;
+    return true;
+}
+
+bool
+io_instruction_handler_ignore_advance(
+    gsl::not_null<vmcs_t *> vmcs, io_instruction_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.ignore_write = true;
+    info.ignore_advance = true;
+    return true;
+}
+
+bool
+ept_violation_handler_ignore_advance(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.ignore_advance = true;
+    return true;
+}
+
+TEST_CASE("bench: cpuid_handler::handle", "[.bench]")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<cpuid_handler_ignore_advance>()
+    );
+
+    g_save_state.rax = 42;
+    bench("cpuid_handler::handle", [&] { handler.handle(vmcs); });
+
+    auto table = exit_dispatch_table<>();
+    auto reason = vmcs_n::exit_reason::basic_exit_reason::cpuid;
+
+    table.push_front(
+        reason, ::handler_delegate_t::create<cpuid_handler, &cpuid_handler::handle>(&handler)
+    );
+
+    bench("exit_dispatch_table (cpuid)", [&] { table.handle(reason, vmcs); });
+}
+
+TEST_CASE("bench: rdmsr_handler::handle", "[.bench]")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = rdmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0x42, rdmsr_handler::handler_delegate_t::create<rdmsr_handler_ignore_advance>()
+    );
+
+    g_msrs[0x42] = 0;
+    g_save_state.rcx = 0x42;
+    bench("rdmsr_handler::handle", [&] { handler.handle(vmcs); });
+}
+
+TEST_CASE("bench: io_instruction_handler::handle", "[.bench]")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = io_instruction_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0x42,
+        io_instruction_handler::handler_delegate_t::create<io_instruction_handler_ignore_advance>(),
+        io_instruction_handler::handler_delegate_t::create<io_instruction_handler_ignore_advance>()
+    );
+
+    // out 0x42, al (immediate operand encoding)
+    //
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr, (0x42ULL << 16) | (1ULL << 6)
+    );
+
+    bench("io_instruction_handler::handle", [&] { handler.handle(vmcs); });
+}
+
+TEST_CASE("bench: ept_violation_handler::handle", "[.bench]")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_read_handler(
+        ept_violation_handler::handler_delegate_t::create<ept_violation_handler_ignore_advance>()
+    );
+
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr, 1
+    );
+
+    bench("ept_violation_handler::handle", [&] { handler.handle(vmcs); });
+}
+
+TEST_CASE("bench: ept::mmap", "[.bench]")
+{
+    ept::mmap mmap{};
+    auto addr = 0ULL;
+
+    bench("ept::mmap::map_4k / unmap", [&] {
+        mmap.map_4k(addr, addr);
+        mmap.unmap(addr);
+        addr = (addr + ::x64::pt::page_size) & 0x3FFFFFFF;
+    });
+
+    mmap.map_4k(0x1000, 0x1000);
+    bench("ept::mmap::virt_to_phys", [&] { mmap.virt_to_phys(0x1000); });
+    bench("ept::mmap::entry", [&] { mmap.entry(0x1000); });
+}
+
+#endif
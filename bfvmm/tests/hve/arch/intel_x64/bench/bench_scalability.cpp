@@ -0,0 +1,371 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/ept.h>
+#include <hve/arch/intel_x64/bitmaps.h>
+#include <hve/arch/intel_x64/vpid.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+//
+// These are hidden from the unit tests (they are tagged with [.bench]), and
+// are run using:
+//
+//     ./bench_scalability [.bench]
+//
+// Each benchmark has 1, 2, 4, ... up to 256 threads (one per simulated
+// vCPU) hammer a structure that eapis shares between vCPUs, and reports the
+// total throughput and the throughput per thread for each thread count.
+// Once the threads are done, the structure is checked, so a benchmark also
+// fails if the structure was corrupted along the way.
+//
+// The maximum number of threads can be changed using EAPIS_BENCH_THREADS,
+// and the number of operations each thread performs using
+// EAPIS_BENCH_ITERATIONS. When there are more threads than cores, the
+// threads are time sliced, so the throughput per thread is expected to drop
+// past std::thread::hardware_concurrency() even if nothing is contended.
+// -----------------------------------------------------------------------------
+
+using namespace eapis::intel_x64;
+using range_t = mtrrs::range_t;
+
+static uint64_t
+env(const char *name, uint64_t def)
+{
+    if (auto str = std::getenv(name)) {
+        return std::strtoull(str, nullptr, 10);
+    }
+
+    return def;
+}
+
+static uint64_t
+iterations()
+{ return env("EAPIS_BENCH_ITERATIONS", 10000); }
+
+static std::vector<uint64_t>
+thread_counts()
+{
+    std::vector<uint64_t> counts;
+    auto max = std::max<uint64_t>(env("EAPIS_BENCH_THREADS", 256), 1);
+
+    for (auto num = 1ULL; num < max; num <<= 1U) {
+        counts.push_back(num);
+    }
+
+    counts.push_back(max);
+    return counts;
+}
+
+// Runs func(tid, i) iterations() times on each of num threads. The threads
+// wait for each other before starting, so the time measured is the time it
+// takes for all of them to get through the work while running together,
+// and not the time it takes to create them.
+//
+template<typename F> void
+run(const char *name, uint64_t num, F func)
+{
+    std::atomic<uint64_t> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+
+    auto ops = iterations();
+
+    for (auto tid = 0ULL; tid < num; tid++) {
+        threads.emplace_back([&, tid] {
+            ready++;
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+
+            for (auto i = 0ULL; i < ops; i++) {
+                func(tid, i);
+            }
+        });
+    }
+
+    while (ready.load() != num) {
+        std::this_thread::yield();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    auto total = static_cast<double>(num * ops) / static_cast<double>(std::max<int64_t>(usec, 1));
+
+    std::cout << std::left << std::setw(32) << name
+              << std::right << std::setw(6) << num << " threads"
+              << std::setw(12) << std::fixed << std::setprecision(2) << total << " Mops/s"
+              << std::setw(12) << total / static_cast<double>(num) << " Mops/s/thread\n";
+}
+
+static void
+header(const char *name)
+{
+    std::cout << '\n' << name << " (" << iterations() << " ops/thread, "
+              << std::thread::hardware_concurrency() << " cores)\n";
+}
+
+// The same layout bench_ept uses. This has to be set up before the first
+// use of g_mtrrs, which reads the MTRRs once.
+//
+static void
+setup_mtrrs()
+{
+    enable_mtrrs(4);
+    add_variable_range(0, range_t{wb, 0x100000, 0x1000});
+    add_variable_range(1, range_t{wb, 0x200000, 0x400000});
+    add_variable_range(2, range_t{wb, 0x600000, 0x1000});
+    add_variable_range(3, range_t{uc, 0xC0000000, 0x40000000});
+}
+
+// A cheap per-thread random number generator (xorshift), so that each
+// thread looks at a different part of the structure without sharing the
+// state of something like std::rand().
+//
+static uint64_t
+next(uint64_t &state)
+{
+    state ^= state << 13U;
+    state ^= state >> 7U;
+    state ^= state << 17U;
+
+    return state;
+}
+
+// -----------------------------------------------------------------------------
+// Shared ept::mmap
+//
+// Every thread looks up random 2m pages in the first 1 GB. One in every 64
+// operations is instead a write to the thread's own 4k page at 2 GB (map,
+// look up, unmap and release), which goes through the writer lock while
+// the other threads keep reading.
+// -----------------------------------------------------------------------------
+
+TEST_CASE("bench: shared mmap", "[.bench]")
+{
+    constexpr const auto lookup_size = 0x40000000ULL;
+    constexpr const auto write_addr = 0x80000000ULL;
+
+    header("ept::mmap (lookups, 1 in 64 writes)");
+
+    for (const auto num : thread_counts()) {
+        ept::mmap map{};
+        map.enable_concurrent_lookups();
+        map.map_range(0, 0, lookup_size);
+
+        std::atomic<uint64_t> errors{0};
+        std::vector<uint64_t> seeds(num);
+
+        for (auto tid = 0ULL; tid < num; tid++) {
+            seeds.at(tid) = tid * 0x9E3779B97F4A7C15ULL + 1;
+        }
+
+        run("map/unmap/lookup", num, [&](uint64_t tid, uint64_t i) {
+            if ((i & 63U) == 63U) {
+                auto addr = write_addr + (tid * ::x64::pt::page_size);
+
+                map.map_4k(addr, addr);
+                if (map.virt_to_phys(addr) != addr) {
+                    errors++;
+                }
+
+                map.unmap(addr);
+                map.release(addr);
+                return;
+            }
+
+            auto addr = (next(seeds[tid]) % lookup_size) & ~(::intel_x64::ept::pd::page_size - 1);
+            if (map.virt_to_phys(addr) != addr) {
+                errors++;
+            }
+        });
+
+        CHECK(errors == 0);
+        CHECK(map.is_2m(lookup_size - ::intel_x64::ept::pd::page_size));
+        CHECK_THROWS(map.virt_to_phys(write_addr));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// g_mtrrs
+//
+// Every vCPU reads the same MTRR ranges when it builds (or updates) an
+// identity map.
+// -----------------------------------------------------------------------------
+
+TEST_CASE("bench: g_mtrrs", "[.bench]")
+{
+    constexpr const auto max_addr = 0x100000000ULL;
+
+    setup_mtrrs();
+    header("g_mtrrs (find)");
+
+    auto hole = g_mtrrs->find(0xC0000000).type;
+
+    for (const auto num : thread_counts()) {
+        std::atomic<uint64_t> errors{0};
+        std::vector<uint64_t> seeds(num);
+
+        for (auto tid = 0ULL; tid < num; tid++) {
+            seeds.at(tid) = tid * 0x9E3779B97F4A7C15ULL + 1;
+        }
+
+        run("find", num, [&](uint64_t tid, uint64_t i) {
+            bfignored(i);
+
+            auto addr = next(seeds[tid]) % max_addr;
+            auto &range = g_mtrrs->find(addr);
+
+            if (!range.contains(addr)) {
+                errors++;
+            }
+
+            if (addr >= 0xC0000000 && range.type != hole) {
+                errors++;
+            }
+        });
+
+        CHECK(errors == 0);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// VPID Allocator
+//
+// vCPUs register (allocate) a VPID when they are created, and release it
+// when they are destroyed. Each thread keeps a few VPIDs at a time, and
+// swaps one out on every operation. An owner table makes sure that no VPID
+// is ever handed to two threads at once.
+// -----------------------------------------------------------------------------
+
+TEST_CASE("bench: vpid allocator", "[.bench]")
+{
+    constexpr const auto held = 4ULL;
+
+    header("vpid_allocator (allocate/release)");
+
+    for (const auto num : thread_counts()) {
+        vpid_allocator allocator;
+        auto owners = std::make_unique<std::array<std::atomic<bool>, 0x10000>>();
+
+        std::atomic<uint64_t> errors{0};
+        std::vector<std::array<uint16_t, held>> ids(num);
+
+        for (auto &owner : *owners) {
+            owner = false;
+        }
+
+        for (auto &thread_ids : ids) {
+            thread_ids.fill(0);
+        }
+
+        run("allocate/release", num, [&](uint64_t tid, uint64_t i) {
+            auto &id = ids[tid][i % held];
+
+            if (id != 0) {
+                owners->at(id) = false;
+                allocator.release(id);
+            }
+
+            bool recycled = false;
+            id = allocator.allocate(recycled);
+
+            if (id == 0 || owners->at(id).exchange(true)) {
+                errors++;
+            }
+        });
+
+        CHECK(errors == 0);
+
+        for (auto &thread_ids : ids) {
+            for (const auto id : thread_ids) {
+                if (id != 0) {
+                    allocator.release(id);
+                }
+            }
+        }
+
+        // Every VPID is back on the free list, so the next one handed out
+        // is a recycled one
+        //
+
+        bool recycled = false;
+        CHECK(allocator.allocate(recycled) != 0);
+        CHECK(recycled);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Shared Bitmaps
+//
+// The vCPUs in a group trap and pass through MSRs using the same
+// bitmap_policy. Each thread flips its own MSR, and the MSRs are next to
+// each other, so up to 8 threads share each byte of the bitmap. The last
+// change each thread makes is a trap; none of them can be lost.
+// -----------------------------------------------------------------------------
+
+TEST_CASE("bench: shared bitmaps", "[.bench]")
+{
+    header("bitmap_policy (trap/pass through)");
+
+    for (const auto num : thread_counts()) {
+        bitmap_policy policy;
+        auto ops = iterations();
+
+        run("trap/pass_through", num, [&](uint64_t tid, uint64_t i) {
+            if (((ops - 1 - i) & 1U) == 0) {
+                policy.trap_rdmsr(tid);
+            }
+            else {
+                policy.pass_through_rdmsr(tid);
+            }
+        });
+
+        auto bitmap = policy.msr_bitmap();
+        auto trapped = 0ULL;
+
+        for (auto msr = 0ULL; msr < 0x2000; msr++) {
+            auto byte = bitmap[gsl::narrow_cast<std::ptrdiff_t>(bitmap_policy::rdmsr_bit(msr) >> 3)];
+            if ((byte & (1U << (bitmap_policy::rdmsr_bit(msr) & 7U))) != 0) {
+                trapped++;
+            }
+        }
+
+        CHECK(trapped == std::min<uint64_t>(num, 0x2000));
+    }
+}
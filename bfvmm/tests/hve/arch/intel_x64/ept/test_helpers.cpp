@@ -201,3 +201,124 @@ TEST_CASE("identity_map")
     CHECK(mmap.is_4k(0x7FF000));
     CHECK(mmap.is_2m(0x800000));
 }
+
+TEST_CASE("identity_map 1g")
+{
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{wb, 0x100000, 0x1000});
+    add_variable_range(0, range_t{wb, 0x200000, 0x400000});
+    add_variable_range(0, range_t{wb, 0x600000, 0x1000});
+
+    ept::mmap mmap{};
+    identity_map(mmap, 0, 0x80000000);
+
+    CHECK(mmap.is_4k(0x601000));
+    CHECK(mmap.is_2m(0x800000));
+    CHECK(mmap.is_2m(0x3FE00000));
+    CHECK(mmap.is_1g(0x40000000));
+
+    CHECK(mmap.pdpt_count() == 1);
+    CHECK(mmap.pd_count() == 1);
+    CHECK(mmap.pt_count() == 2);
+}
+
+TEST_CASE("memory_type_overrides")
+{
+    ept::memory_type_overrides overrides{};
+    CHECK(overrides.empty());
+
+    overrides.add(0x200000, 0x2000, ept::mmap::memory_type::write_combining);
+    overrides.add(0x100000, 0x1000, uc, false);
+
+    CHECK_THROWS(overrides.add(0x201000, 0x1000, uc));
+    CHECK_THROWS(overrides.add(0x1FF000, 0x2000, uc));
+    CHECK_THROWS(overrides.add(0x300001, 0x1000, uc));
+    CHECK_THROWS(overrides.add(0x300000, 0, uc));
+
+    REQUIRE(overrides.ranges().size() == 2);
+    CHECK(overrides.ranges().at(0).base == 0x100000);
+    CHECK(overrides.ranges().at(1).base == 0x200000);
+
+    CHECK(overrides.find(0x0FF000) == nullptr);
+    CHECK(overrides.find(0x201FFF)->type == ept::mmap::memory_type::write_combining);
+    CHECK(overrides.find(0x202000) == nullptr);
+    CHECK(!overrides.find(0x100000)->ignore_pat);
+
+    CHECK(overrides.next_boundary(0x0) == 0x100000);
+    CHECK(overrides.next_boundary(0x200000) == 0x202000);
+    CHECK(overrides.next_boundary(0x202000) == ~0ULL);
+
+    overrides.remove(0x100000);
+    CHECK(overrides.find(0x100000) == nullptr);
+    CHECK(overrides.ranges().size() == 1);
+}
+
+TEST_CASE("identity_map with overrides")
+{
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{wb, 0x0, 0x400000});
+
+    ept::memory_type_overrides overrides{};
+    overrides.add(0x201000, 0x1000, ept::mmap::memory_type::write_combining);
+
+    ept::mmap mmap{};
+    identity_map(mmap, 0, 0x400000, ept::mmap::attr_type::read_write_execute, &overrides);
+
+    CHECK(mmap.is_2m(0x0));
+    CHECK(mmap.is_4k(0x200000));
+    CHECK(mmap.is_4k(0x201000));
+    CHECK(((mmap.entry(0x200000) >> 3) & 0x7) == 6);
+    CHECK(((mmap.entry(0x201000) >> 3) & 0x7) == 1);
+    CHECK((mmap.entry(0x201000) & ept::mmap::ignore_pat_mask) != 0);
+    CHECK(((mmap.entry(0x202000) >> 3) & 0x7) == 6);
+
+    auto changed = restore_memory_types(mmap, 0x200000, 0x400000);
+    REQUIRE(changed.size() == 1);
+    CHECK(((mmap.entry(0x201000) >> 3) & 0x7) == 6);
+    CHECK((mmap.entry(0x201000) & ept::mmap::ignore_pat_mask) == 0);
+
+    changed = apply_memory_type_overrides(mmap, overrides);
+    REQUIRE(changed.size() == 1);
+    CHECK(((mmap.entry(0x201000) >> 3) & 0x7) == 1);
+}
+
+TEST_CASE("identity_map_part")
+{
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{wb, 0x100000, 0x1000});
+    add_variable_range(0, range_t{wb, 0x200000, 0x400000});
+    add_variable_range(0, range_t{wb, 0x600000, 0x1000});
+
+    ept::mmap mmap1{};
+    identity_map(mmap1, 0, 0x100000000);
+
+    ept::mmap mmap2{};
+    std::array<ept::mmap, 3> parts{};
+
+    for (auto i = 0U; i < parts.size(); i++) {
+        identity_map_part(parts.at(i), 0, 0x100000000, i, parts.size());
+    }
+
+    CHECK(parts.at(0).is_4k(0x601000));
+    CHECK_THROWS(parts.at(0).is_1g(0x40000000));
+    CHECK(parts.at(1).is_1g(0x40000000));
+    CHECK(parts.at(2).is_1g(0x80000000));
+
+    for (auto &part : parts) {
+        mmap2.merge(part);
+        CHECK(part.pdpt_count() == 0);
+    }
+
+    CHECK(mmap2.extents() == mmap1.extents());
+    CHECK(mmap2.pdpt_count() == mmap1.pdpt_count());
+    CHECK(mmap2.pd_count() == mmap1.pd_count());
+    CHECK(mmap2.pt_count() == mmap1.pt_count());
+
+    CHECK_THROWS(identity_map_part(mmap2, 0, 0x100000000, 3, 3));
+}
@@ -22,6 +22,8 @@
 #include <bfvmm/test/support.h>
 #include <hve/arch/intel_x64/ept.h>
 
+#include <map>
+
 using namespace eapis::intel_x64;
 
 TEST_CASE("mmap: constructor / destructor")
@@ -902,3 +904,874 @@ TEST_CASE("mmap: 4k release range")
     mmap.release(0x3000);
     CHECK(g_allocated_pages.size() == 1);
 }
+
+TEST_CASE("mmap: map range unaligned")
+{
+    ept::mmap mmap{};
+    CHECK_THROWS(mmap.map_range(0x2A, 0x1000, 0x1000));
+    CHECK_THROWS(mmap.map_range(0x1000, 0x2A, 0x1000));
+    CHECK_THROWS(mmap.map_range(0x1000, 0x1000, 0x2A));
+}
+
+TEST_CASE("mmap: map range 1g")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0, 0, 0x80000000);
+
+        CHECK(mmap.is_1g(nullptr));
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK_THROWS(mmap.is_1g(0x80000000));
+        CHECK(g_allocated_pages.size() == 2);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range mixed page sizes")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0x3FFFF000, 0x3FFFF000, 0x40202000);
+
+        CHECK(mmap.is_4k(0x3FFFF000));
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_2m(0x80000000));
+        CHECK(mmap.is_4k(0x80200000));
+        CHECK_THROWS(mmap.is_4k(0x80201000));
+
+        CHECK(mmap.virt_to_phys(0x3FFFF000) == 0x3FFFF000);
+        CHECK(mmap.virt_to_phys(0x80200000) == 0x80200000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range unaligned phys")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0, 0x1000, 0x200000);
+
+        CHECK(mmap.is_4k(nullptr));
+        CHECK(mmap.is_4k(0x1FF000));
+        CHECK(mmap.virt_to_phys(0x1FF000) == 0x200000);
+        CHECK(g_allocated_pages.size() == 4);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range already mapped")
+{
+    ept::mmap mmap{};
+    mmap.map_4k(0x3000, 0x3000);
+    CHECK_THROWS(mmap.map_range(0x1000, 0x1000, 0x4000));
+}
+
+TEST_CASE("mmap: map mmio")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_mmio(0xFEE00000, 0xFEE00000, 0x2000);
+
+        auto entry = mmap.entry(0xFEE01000);
+        CHECK(mmap.is_4k(0xFEE01000));
+        CHECK(::intel_x64::ept::pt::entry::write_access::is_enabled(entry));
+        CHECK(::intel_x64::ept::pt::entry::read_access::is_disabled(entry));
+        CHECK(::intel_x64::ept::pt::entry::memory_type::get(entry) ==
+              ::intel_x64::ept::pt::entry::memory_type::uncacheable);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: table counts")
+{
+    ept::mmap mmap{};
+    CHECK(mmap.pdpt_count() == 0);
+    CHECK(mmap.pd_count() == 0);
+    CHECK(mmap.pt_count() == 0);
+
+    mmap.map_4k(0x1000, 0x1000);
+    CHECK(mmap.pdpt_count() == 1);
+    CHECK(mmap.pd_count() == 1);
+    CHECK(mmap.pt_count() == 1);
+
+    mmap.unmap(0x1000);
+    mmap.release(0x1000);
+    CHECK(mmap.pdpt_count() == 0);
+    CHECK(mmap.pd_count() == 0);
+    CHECK(mmap.pt_count() == 0);
+}
+
+TEST_CASE("mmap: share")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        mmap1.map_4k(0x1000, 0x1000);
+        mmap1.map_2m(0x200000, 0x200000);
+
+        auto generation = mmap1.generation();
+
+        mmap2.share(mmap1);
+        CHECK(g_allocated_pages.size() == 5);
+        CHECK(mmap1.generation() != generation);
+
+        CHECK(mmap2.is_4k(0x1000));
+        CHECK(mmap2.is_2m(0x200000));
+        CHECK(mmap2.virt_to_phys(0x1000) == 0x1000);
+        CHECK(g_allocated_pages.size() == 5);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: share non-empty map")
+{
+    ept::mmap mmap1{};
+    ept::mmap mmap2{};
+
+    mmap2.map_4k(0x1000, 0x1000);
+    CHECK_THROWS(mmap2.share(mmap1));
+    CHECK_THROWS(mmap2.share(mmap2));
+}
+
+TEST_CASE("mmap: share copy on write")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        mmap1.map_4k(0x1000, 0x1000);
+        mmap1.map_4k(0x40000000, 0x40000000);
+
+        mmap2.share(mmap1);
+        mmap2.map_4k(0x2000, 0x2000);
+
+        CHECK(mmap2.virt_to_phys(0x2000) == 0x2000);
+        CHECK_THROWS(mmap1.virt_to_phys(0x2000));
+
+        mmap2.unmap(0x1000);
+        CHECK_THROWS(mmap2.virt_to_phys(0x1000));
+        CHECK(mmap1.virt_to_phys(0x1000) == 0x1000);
+
+        CHECK(mmap1.virt_to_phys(0x40000000) == 0x40000000);
+        CHECK(mmap2.virt_to_phys(0x40000000) == 0x40000000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: share, clear")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        mmap1.map_4k(0x1000, 0x1000);
+        mmap1.map_4k(0x40000000, 0x40000000);
+        CHECK(g_allocated_pages.size() == 7);
+
+        mmap2.share(mmap1);
+        CHECK(mmap2.pdpt_count() == 1);
+        CHECK(mmap2.pd_count() == 2);
+        CHECK(mmap2.pt_count() == 2);
+
+        mmap2.clear();
+        CHECK(mmap2.pdpt_count() == 0);
+        CHECK(mmap2.pd_count() == 0);
+        CHECK(mmap2.pt_count() == 0);
+        CHECK(g_allocated_pages.size() == 7);
+
+        // Once part of the tables have been copied on write, only the
+        // ones that are still shared are given back to mmap1
+        //
+
+        mmap2.share(mmap1);
+        mmap2.map_4k(0x2000, 0x2000);
+        CHECK(g_allocated_pages.size() == 10);
+
+        mmap2.clear();
+        CHECK(mmap2.pdpt_count() == 0);
+        CHECK(mmap2.pd_count() == 0);
+        CHECK(mmap2.pt_count() == 0);
+        CHECK(g_allocated_pages.size() == 7);
+
+        CHECK(mmap1.pdpt_count() == 1);
+        CHECK(mmap1.pd_count() == 2);
+        CHECK(mmap1.pt_count() == 2);
+        CHECK(mmap1.virt_to_phys(0x1000) == 0x1000);
+        CHECK(mmap1.virt_to_phys(0x40000000) == 0x40000000);
+        CHECK_THROWS(mmap2.virt_to_phys(0x1000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: share, last reference modifies in place")
+{
+    {
+        ept::mmap mmap1{};
+
+        mmap1.map_4k(0x1000, 0x1000);
+        CHECK(g_allocated_pages.size() == 4);
+
+        {
+            ept::mmap mmap2{};
+            mmap2.share(mmap1);
+
+            mmap2.map_4k(0x2000, 0x2000);
+            CHECK(g_allocated_pages.size() == 8);
+
+            mmap1.map_4k(0x3000, 0x3000);
+            CHECK(g_allocated_pages.size() == 8);
+            CHECK_THROWS(mmap2.virt_to_phys(0x3000));
+        }
+
+        CHECK(g_allocated_pages.size() == 4);
+
+        mmap1.map_4k(0x4000, 0x4000);
+        CHECK(g_allocated_pages.size() == 4);
+        CHECK(mmap1.virt_to_phys(0x1000) == 0x1000);
+        CHECK(mmap1.virt_to_phys(0x3000) == 0x3000);
+        CHECK(mmap1.virt_to_phys(0x4000) == 0x4000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        mmap1.map_4k(0x1000, 0x1000);
+        mmap1.map_2m(0x200000, 0x200000);
+        mmap1.map_1g(0x8000000000, 0x40000000);
+
+        mmap2.clone(mmap1);
+        CHECK(g_allocated_pages.size() == 10);
+        CHECK(mmap2.pdpt_count() == mmap1.pdpt_count());
+        CHECK(mmap2.pd_count() == mmap1.pd_count());
+        CHECK(mmap2.pt_count() == mmap1.pt_count());
+
+        CHECK(mmap2.is_4k(0x1000));
+        CHECK(mmap2.is_2m(0x200000));
+        CHECK(mmap2.is_1g(0x8000000000));
+        CHECK(mmap2.virt_to_phys(0x8000000000) == 0x40000000);
+
+        mmap2.unmap(0x1000);
+        CHECK_THROWS(mmap2.virt_to_phys(0x1000));
+        CHECK(mmap1.virt_to_phys(0x1000) == 0x1000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone range")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        mmap1.map_4k(0x1000, 0x1000);
+        mmap1.map_4k(0x3000, 0x3000);
+        mmap1.map_2m(0x400000, 0x400000);
+        mmap1.map_4k(0x40000000, 0x40000000);
+
+        mmap2.clone(mmap1, 0x3000, 0x401000);
+        CHECK(mmap2.pdpt_count() == 1);
+        CHECK(mmap2.pd_count() == 1);
+        CHECK(mmap2.pt_count() == 1);
+
+        CHECK_THROWS(mmap2.virt_to_phys(0x1000));
+        CHECK(mmap2.virt_to_phys(0x3000) == 0x3000);
+        CHECK(mmap2.is_2m(0x400000));
+        CHECK_THROWS(mmap2.virt_to_phys(0x40000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone non-empty map")
+{
+    ept::mmap mmap1{};
+    ept::mmap mmap2{};
+
+    mmap2.map_4k(0x1000, 0x1000);
+    CHECK_THROWS(mmap2.clone(mmap1));
+}
+
+TEST_CASE("mmap: extents")
+{
+    using attr_type = ept::mmap::attr_type;
+    using memory_type = ept::mmap::memory_type;
+
+    ept::mmap mmap{};
+
+    mmap.map_4k(0x1FF000, 0x1FF000);
+    mmap.map_2m(0x200000, 0x200000);
+    mmap.map_4k(0x400000, 0x400000);
+    mmap.map_4k(0x401000, 0x401000, attr_type::read_only);
+    mmap.map_4k(0x402000, 0x402000, attr_type::read_only, memory_type::uncacheable);
+    mmap.map_4k(0x404000, 0x10000);
+
+    auto list = mmap.extents();
+    REQUIRE(list.size() == 4);
+
+    CHECK(list.at(0) == ept::mmap::extent_t{0x1FF000, 0x1FF000, 0x202000, attr_type::read_write_execute, memory_type::write_back});
+    CHECK(list.at(1) == ept::mmap::extent_t{0x401000, 0x401000, 0x1000, attr_type::read_only, memory_type::write_back});
+    CHECK(list.at(2) == ept::mmap::extent_t{0x402000, 0x402000, 0x1000, attr_type::read_only, memory_type::uncacheable});
+    CHECK(list.at(3) == ept::mmap::extent_t{0x404000, 0x10000, 0x1000, attr_type::read_write_execute, memory_type::write_back});
+}
+
+TEST_CASE("mmap: restore")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        mmap1.map_range(0x0, 0x0, 0x40400000);
+        mmap1.protect(0x1000, 0x1000, ept::mmap::attr_type::read_only);
+
+        mmap2.restore(mmap1.extents());
+        CHECK(mmap2.extents() == mmap1.extents());
+
+        CHECK(mmap2.is_4k(0x1000));
+        CHECK(mmap2.is_1g(0x0) == false);
+        CHECK(mmap2.is_2m(0x200000));
+        CHECK(mmap2.is_2m(0x40200000));
+        CHECK(mmap2.virt_to_phys(0x40200000) == 0x40200000);
+
+        CHECK_THROWS(mmap2.restore(mmap1.extents()));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: merge")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+        ept::mmap mmap3{};
+
+        mmap1.map_4k(0x1000, 0x1000);
+        mmap2.map_2m(0x40000000, 0x40000000);
+        mmap3.map_1g(0x8000000000, 0x8000000000);
+
+        mmap1.merge(mmap2);
+        mmap1.merge(mmap3);
+        CHECK(g_allocated_pages.size() == 8);
+
+        CHECK(mmap1.pdpt_count() == 2);
+        CHECK(mmap1.pd_count() == 2);
+        CHECK(mmap1.pt_count() == 1);
+
+        CHECK(mmap1.is_4k(0x1000));
+        CHECK(mmap1.is_2m(0x40000000));
+        CHECK(mmap1.is_1g(0x8000000000));
+
+        CHECK(mmap2.pdpt_count() == 0);
+        CHECK_THROWS(mmap2.virt_to_phys(0x40000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: merge overlap")
+{
+    ept::mmap mmap1{};
+    ept::mmap mmap2{};
+
+    mmap1.map_4k(0x1000, 0x1000);
+    mmap2.map_4k(0x2000, 0x2000);
+
+    CHECK_THROWS(mmap1.merge(mmap2));
+    CHECK(mmap2.virt_to_phys(0x2000) == 0x2000);
+}
+
+static std::map<const void *, numa::node_t> g_page_nodes;
+
+static numa::allocator_t g_numa_allocator = {
+    [](numa::node_t node) -> void * {
+        auto ptr = alloc_page();
+        g_page_nodes[ptr] = node;
+        return ptr;
+    },
+    [](void *ptr) {
+        g_page_nodes.erase(ptr);
+        free_page(ptr);
+    },
+    [](const void *ptr) -> numa::node_t {
+        return g_page_nodes.at(ptr);
+    },
+    []() -> numa::node_t {
+        return 1;
+    }
+};
+
+TEST_CASE("mmap: numa node")
+{
+    auto original = numa::allocator();
+    numa::set_allocator(g_numa_allocator);
+
+    {
+        ept::mmap mmap1{};
+        CHECK(mmap1.node() == numa::any_node);
+
+        mmap1.map_4k(0x1000, 0x1000);
+        CHECK(mmap1.tables_on_node(1) == 4);
+        CHECK_THROWS(mmap1.set_node(2));
+
+        ept::mmap mmap2{};
+        mmap2.set_node(2);
+        CHECK(mmap2.node() == 2);
+        CHECK(mmap2.tables_on_node(2) == 1);
+
+        mmap2.clone(mmap1);
+        CHECK(mmap2.tables_on_node(2) == 4);
+        CHECK(mmap2.tables_on_node(1) == 0);
+
+        ept::mmap mmap3{2, 3};
+        mmap3.map_4k(0x1000, 0x1000);
+        CHECK(mmap3.tables_on_node(3) == 4);
+        CHECK_THROWS(mmap3.set_node(2));
+    }
+
+    CHECK(g_page_nodes.empty());
+    numa::set_allocator(original);
+}
+
+TEST_CASE("mmap: pooled")
+{
+    {
+        ept::mmap mmap{4};
+        CHECK(g_allocated_pages.size() == 5);
+
+        mmap.map_4k(0x1000, 0x1000);
+        CHECK(g_allocated_pages.size() == 5);
+        CHECK(mmap.virt_to_phys(0x1000) == 0x1000);
+
+        mmap.map_4k(0x40000000, 0x40000000);
+        CHECK(g_allocated_pages.size() == 6);
+        CHECK(mmap.virt_to_phys(0x40000000) == 0x40000000);
+
+        mmap.unmap(0x1000);
+        mmap.release(0x1000);
+        CHECK(g_allocated_pages.size() == 6);
+
+        mmap.map_4k(0x1000, 0x1000);
+        CHECK(g_allocated_pages.size() == 6);
+        CHECK(mmap.virt_to_phys(0x1000) == 0x1000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: pooled share")
+{
+    ept::mmap mmap1{1};
+    ept::mmap mmap2{};
+
+    CHECK_THROWS(mmap2.share(mmap1));
+    CHECK_THROWS(mmap1.share(mmap2));
+}
+
+TEST_CASE("mmap: const lookups")
+{
+    ept::mmap mmap{};
+    mmap.map_1g(0x40000000, 0x40000000);
+    mmap.map_2m(0x200000, 0x200000);
+    mmap.map_4k(0x1000, 0x1000);
+
+    const auto &cmmap = mmap;
+    CHECK(cmmap.is_1g(0x40000000));
+    CHECK(cmmap.is_2m(0x200000));
+    CHECK(cmmap.is_4k(0x1000));
+    CHECK(cmmap.virt_to_phys(0x40000000) == 0x40000000);
+    CHECK(cmmap.virt_to_phys(0x200000) == 0x200000);
+    CHECK(cmmap.virt_to_phys(0x1000) == 0x1000);
+    CHECK_THROWS(cmmap.virt_to_phys(0x2000));
+    CHECK_THROWS(cmmap.virt_to_phys(0x80000000));
+}
+
+TEST_CASE("mmap: walk cache invalidation")
+{
+    ept::mmap mmap{};
+
+    mmap.map_2m(0x200000, 0x200000);
+    CHECK(mmap.is_2m(0x200000));
+    CHECK(mmap.is_2m(0x201000));
+
+    mmap.unmap(0x200000);
+    CHECK_THROWS(mmap.is_2m(0x200000));
+
+    mmap.map_4k(0x200000, 0x200000);
+    CHECK(mmap.is_4k(0x200000));
+    CHECK_THROWS(mmap.is_4k(0x201000));
+
+    mmap.unmap(0x200000);
+    mmap.release(0x200000);
+    CHECK_THROWS(mmap.is_4k(0x200000));
+
+    mmap.map_4k(0x200000, 0x300000);
+    CHECK(mmap.virt_to_phys(0x200000) == 0x300000);
+}
+
+TEST_CASE("mmap: concurrent lookups")
+{
+    {
+        ept::mmap mmap{};
+        mmap.enable_concurrent_lookups();
+        mmap.enable_concurrent_lookups();
+
+        mmap.map_range(0, 0, 0x400000);
+        mmap.map_4k(0x400000, 0x400000);
+
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.is_4k(0x400000));
+        CHECK(mmap.virt_to_phys(0x400000) == 0x400000);
+
+        mmap.unmap(0x400000);
+        mmap.release(0x400000);
+        CHECK(g_allocated_pages.size() == 3);
+        CHECK_THROWS(mmap.is_4k(0x400000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: generation")
+{
+    ept::mmap mmap{};
+    auto generation = mmap.generation();
+
+    CHECK_THROWS(mmap.virt_to_phys(0x1000));
+    CHECK(mmap.generation() == generation);
+
+    mmap.map_4k(0x1000, 0x1000);
+    CHECK(mmap.generation() != generation);
+
+    generation = mmap.generation();
+    CHECK(mmap.is_4k(0x1000));
+    CHECK(mmap.generation() == generation);
+
+    mmap.unmap(0x1000);
+    CHECK(mmap.generation() != generation);
+}
+
+TEST_CASE("mmap: entry_value")
+{
+    ept::mmap mmap{};
+    mmap.enable_concurrent_lookups();
+
+    mmap.map_4k(0x1000, 0x1000);
+    mmap.set_suppress_ve(0x1000, true);
+
+    CHECK(mmap.entry_value(0x1000) == mmap.entry(0x1000));
+    auto generation = mmap.generation();
+
+    CHECK(mmap.is_suppress_ve(0x1000));
+    CHECK(!mmap.is_sub_page_protected(0x1000));
+    CHECK(::intel_x64::ept::pt::entry::phys_addr::get(mmap.entry_value(0x1000)) == 0x1000);
+    CHECK(mmap.generation() == generation);
+
+    CHECK_THROWS(mmap.entry_value(0x2000));
+    CHECK_THROWS(mmap.is_suppress_ve(0x2000));
+}
+
+TEST_CASE("mmap: scan dirty")
+{
+    {
+        ept::mmap mmap{};
+        std::array<uint64_t, 16> bitmap{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_4k(0x3000, 0x3000);
+        mmap.map_2m(0x200000, 0x200000);
+
+        CHECK(mmap.scan_dirty(0, 0x400000, bitmap) == 0);
+
+        mmap.entry(0x3000) |= 0x200;
+        mmap.entry(0x200000) |= 0x200;
+
+        CHECK(mmap.scan_dirty(0, 0x400000, bitmap, false) == 513);
+        CHECK(bitmap.at(0) == 0x8);
+        CHECK(bitmap.at(8) == 0xFFFFFFFFFFFFFFFF);
+        CHECK(bitmap.at(15) == 0xFFFFFFFFFFFFFFFF);
+
+        CHECK(mmap.scan_dirty(0x2000, 0x2000, bitmap) == 1);
+        CHECK(bitmap.at(0) == 0x2);
+        CHECK(mmap.scan_dirty(0x2000, 0x2000, bitmap) == 0);
+
+        CHECK(mmap.scan_dirty(0x3FF000, 0x1000, bitmap) == 1);
+        CHECK(bitmap.at(0) == 0x1);
+        CHECK(mmap.scan_dirty(0x200000, 0x200000, bitmap) == 0);
+
+        CHECK_THROWS(mmap.scan_dirty(0x1001, 0x1000, bitmap));
+        CHECK_THROWS(mmap.scan_dirty(0, 0x1000000, bitmap));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: scan accessed")
+{
+    {
+        ept::mmap mmap{};
+        std::array<uint64_t, 1> bitmap{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.entry(0x1000) |= 0x100;
+
+        CHECK(mmap.scan_accessed(0, 0x40000, bitmap) == 0);
+        CHECK((mmap.entry(0x1000) & 0x100) != 0);
+
+        auto generation = mmap.generation();
+        CHECK(mmap.scan_accessed(0, 0x40000, bitmap, false) == 0);
+        CHECK(mmap.generation() == generation);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: suppress ve")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        CHECK(!mmap.is_suppress_ve(0x1000));
+
+        auto generation = mmap.generation();
+        mmap.set_suppress_ve(0x1000, true);
+        CHECK(mmap.is_suppress_ve(0x1000));
+        CHECK(mmap.generation() != generation);
+        CHECK(mmap.virt_to_phys(0x1000) == 0x1000);
+
+        mmap.set_suppress_ve(0x1000, false);
+        CHECK(!mmap.is_suppress_ve(0x1000));
+
+        mmap.set_default_suppress_ve(true);
+        mmap.map_4k(0x2000, 0x2000);
+        mmap.map_2m(0x200000, 0x200000);
+        CHECK(mmap.is_suppress_ve(0x2000));
+        CHECK(mmap.is_suppress_ve(0x200000));
+        CHECK(!mmap.is_suppress_ve(0x1000));
+
+        CHECK_THROWS(mmap.set_suppress_ve(0x400000, true));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: sub-page permissions")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_2m(0x200000, 0x200000);
+        CHECK(!mmap.is_sub_page_protected(0x1000));
+        CHECK(mmap.sub_page_permissions(0x1000) == 0);
+
+        auto generation = mmap.generation();
+        mmap.set_sub_page_permissions(0x1000, 0xFFFFFFFE);
+        CHECK(mmap.is_sub_page_protected(0x1000));
+        CHECK(mmap.sub_page_permissions(0x1000) == 0xFFFFFFFE);
+        CHECK(mmap.generation() != generation);
+        CHECK(mmap.virt_to_phys(0x1000) == 0x1000);
+        CHECK(::intel_x64::ept::pt::entry::write_access::is_disabled(mmap.entry(0x1000)));
+        CHECK(mmap.spptp() == mmap.sub_page_table()->spptp());
+
+        mmap.clear_sub_page_permissions(0x1000);
+        CHECK(!mmap.is_sub_page_protected(0x1000));
+        CHECK(mmap.sub_page_permissions(0x1000) == 0);
+        CHECK(::intel_x64::ept::pt::entry::write_access::is_disabled(mmap.entry(0x1000)));
+
+        CHECK_THROWS(mmap.set_sub_page_permissions(0x200000, 0xFFFFFFFF));
+        CHECK_THROWS(mmap.set_sub_page_permissions(0x400000, 0xFFFFFFFF));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: protect")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.map_2m(0x0, 0x0);
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_4k(0x400000, 0x400000);
+
+        auto changed = mmap.protect(0x1000, 0x2000, ept::mmap::attr_type::read_only);
+        REQUIRE(changed.size() == 1);
+        CHECK(changed.at(0).virt_addr == 0x1000);
+        CHECK(changed.at(0).size == 0x2000);
+
+        CHECK(mmap.is_4k(0x1000));
+        CHECK(mmap.is_4k(0x0));
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.virt_to_phys(0x1000) == 0x1000);
+        CHECK(mmap.virt_to_phys(0x1FF000) == 0x1FF000);
+        CHECK((mmap.entry(0x1000) & 0x7) == 0x1);
+        CHECK((mmap.entry(0x2000) & 0x7) == 0x1);
+        CHECK((mmap.entry(0x3000) & 0x7) == 0x7);
+        CHECK(mmap.pt_count() == 2);
+
+        changed = mmap.protect(0x200000, 0x201000, ept::mmap::attr_type::read_execute);
+        REQUIRE(changed.size() == 1);
+        CHECK(changed.at(0).size == 0x201000);
+        CHECK(mmap.is_2m(0x200000));
+        CHECK((mmap.entry(0x200000) & 0x7) == 0x5);
+        CHECK((mmap.entry(0x400000) & 0x7) == 0x5);
+
+        CHECK(mmap.protect(0x200000, 0x200000, ept::mmap::attr_type::read_execute).empty());
+
+        changed = mmap.protect(0x40200000, 0x1000, ept::mmap::attr_type::none);
+        REQUIRE(changed.size() == 1);
+        CHECK(mmap.is_4k(0x40200000));
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.is_2m(0x40400000));
+        CHECK(mmap.virt_to_phys(0x40401000) == 0x40401000);
+        CHECK((mmap.entry(0x40200000) & 0x7) == 0x0);
+
+        CHECK_THROWS(mmap.protect(0x401000, 0x1000, ept::mmap::attr_type::none));
+        CHECK_THROWS(mmap.protect(0x1001, 0x1000, ept::mmap::attr_type::none));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: set memory type")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_2m(0x0, 0x0);
+        mmap.map_2m(0x200000, 0x200000);
+
+        auto changed = mmap.set_memory_type(
+            0x1000, 0x1000, ept::mmap::memory_type::write_combining, true);
+        REQUIRE(changed.size() == 1);
+        CHECK(changed.at(0).virt_addr == 0x1000);
+        CHECK(changed.at(0).size == 0x1000);
+
+        CHECK(mmap.is_4k(0x1000));
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(((mmap.entry(0x1000) >> 3) & 0x7) == 1);
+        CHECK((mmap.entry(0x1000) & ept::mmap::ignore_pat_mask) != 0);
+        CHECK(((mmap.entry(0x2000) >> 3) & 0x7) == 6);
+        CHECK((mmap.entry(0x2000) & ept::mmap::ignore_pat_mask) == 0);
+        CHECK((mmap.entry(0x1000) & 0x7) == 0x7);
+
+        changed = mmap.set_memory_type(
+            0x200000, 0x200000, ept::mmap::memory_type::uncacheable);
+        REQUIRE(changed.size() == 1);
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(((mmap.entry(0x200000) >> 3) & 0x7) == 0);
+
+        CHECK(mmap.set_memory_type(
+                  0x200000, 0x200000, ept::mmap::memory_type::uncacheable).empty());
+
+        changed = mmap.set_memory_type(
+            0x1000, 0x1000, ept::mmap::memory_type::write_back, false);
+        REQUIRE(changed.size() == 1);
+        CHECK(((mmap.entry(0x1000) >> 3) & 0x7) == 6);
+        CHECK((mmap.entry(0x1000) & ept::mmap::ignore_pat_mask) == 0);
+
+        CHECK_THROWS(mmap.set_memory_type(
+                         0x400000, 0x1000, ept::mmap::memory_type::uncacheable));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_range(0x0, 0x0, 0x40000000);
+        mmap.map_range(0x40000000, 0x40000000, 0x200000, ept::mmap::attr_type::read_only);
+        CHECK(mmap.is_1g(0x0));
+
+        mmap.protect(0x1000, 0x1000, ept::mmap::attr_type::read_only);
+        mmap.protect(0x40000000, 0x1000, ept::mmap::attr_type::none);
+        mmap.entry(0x3000) |= 0x300;
+        CHECK(mmap.pd_count() == 2);
+        CHECK(mmap.pt_count() == 2);
+
+        CHECK(mmap.compact() == 0);
+        CHECK(mmap.is_4k(0x1000));
+
+        mmap.protect(0x1000, 0x1000, ept::mmap::attr_type::read_write_execute);
+        CHECK(mmap.compact(0x200000, 0x200000) == 0);
+        CHECK(mmap.compact(0x0, 0x200000) == 1);
+        CHECK(mmap.is_2m(0x0));
+        CHECK((mmap.entry(0x0) & 0x300) == 0x300);
+
+        CHECK(mmap.compact() == 1);
+        CHECK(mmap.is_1g(0x0));
+        CHECK(mmap.virt_to_phys(0x3FFFF000) == 0x3FFFF000);
+        CHECK(mmap.pd_count() == 1);
+        CHECK(mmap.pt_count() == 1);
+
+        mmap.protect(0x40000000, 0x1000, ept::mmap::attr_type::read_only);
+        CHECK(mmap.compact() == 1);
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.pt_count() == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact, per page bits")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_range(0x0, 0x0, 0x200000);
+        mmap.protect(0x1000, 0x1000, ept::mmap::attr_type::read_only);
+        mmap.protect(0x1000, 0x1000, ept::mmap::attr_type::read_write_execute);
+        CHECK(mmap.is_4k(0x1000));
+
+        mmap.entry(0x1000) |= ept::mmap::spp_mask;
+        CHECK(mmap.compact() == 0);
+        CHECK(mmap.is_4k(0x1000));
+        mmap.entry(0x1000) &= ~ept::mmap::spp_mask;
+
+        mmap.entry(0x1000) |= ept::mmap::suppress_ve_mask;
+        CHECK(mmap.compact() == 0);
+        CHECK(mmap.is_4k(0x1000));
+        mmap.entry(0x1000) &= ~ept::mmap::suppress_ve_mask;
+
+        CHECK(mmap.compact() == 1);
+        CHECK(mmap.is_2m(0x1000));
+    }
+    CHECK(g_allocated_pages.empty());
+
+    {
+        ept::mmap mmap{};
+        mmap.set_default_suppress_ve(true);
+
+        mmap.map_range(0x0, 0x0, 0x200000);
+        mmap.protect(0x1000, 0x1000, ept::mmap::attr_type::read_only);
+        mmap.protect(0x1000, 0x1000, ept::mmap::attr_type::read_write_execute);
+        CHECK(mmap.is_suppress_ve(0x1000));
+
+        CHECK(mmap.compact() == 1);
+        CHECK(mmap.is_2m(0x1000));
+        CHECK(mmap.is_suppress_ve(0x1000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact, shared")
+{
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        mmap1.map_range(0x0, 0x0, 0x200000);
+        mmap1.protect(0x1000, 0x1000, ept::mmap::attr_type::read_only);
+        mmap2.share(mmap1);
+
+        auto pages = g_allocated_pages.size();
+        CHECK(mmap2.compact() == 0);
+        CHECK(g_allocated_pages.size() == pages);
+
+        mmap2.protect(0x1000, 0x1000, ept::mmap::attr_type::read_write_execute);
+        CHECK(mmap2.compact() == 1);
+        CHECK(mmap2.is_2m(0x1000));
+        CHECK(mmap1.is_4k(0x1000));
+        CHECK(mmap1.virt_to_phys(0x1000) == 0x1000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
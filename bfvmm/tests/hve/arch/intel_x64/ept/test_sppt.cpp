@@ -0,0 +1,81 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/ept/sppt.h>
+
+using namespace eapis::intel_x64;
+
+TEST_CASE("sppt: constructor / destructor")
+{
+    {
+        ept::sppt sppt{};
+
+        CHECK(sppt.num_tables() == 1);
+        CHECK(sppt.spptp() != 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("sppt: set / get")
+{
+    {
+        ept::sppt sppt{};
+
+        CHECK(sppt.get(0x1000) == 0);
+        CHECK(sppt.num_tables() == 1);
+
+        sppt.set(0x1000, 0xFFFFFFFE);
+        CHECK(sppt.get(0x1000) == 0xFFFFFFFE);
+        CHECK(sppt.get(0x1FFF) == 0xFFFFFFFE);
+        CHECK(sppt.get(0x2000) == 0);
+        CHECK(sppt.num_tables() == 4);
+
+        sppt.set(0x2000, 0x1);
+        CHECK(sppt.get(0x2000) == 0x1);
+        CHECK(sppt.num_tables() == 4);
+
+        sppt.set(0x200000, 0x80000000);
+        CHECK(sppt.get(0x200000) == 0x80000000);
+        CHECK(sppt.num_tables() == 5);
+
+        sppt.set(0x8000000000, 0x2);
+        CHECK(sppt.get(0x8000000000) == 0x2);
+        CHECK(sppt.num_tables() == 8);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("sppt: clear")
+{
+    {
+        ept::sppt sppt{};
+
+        sppt.set(0x1000, 0xFFFFFFFF);
+        sppt.clear(0x1000);
+        CHECK(sppt.get(0x1000) == 0);
+        CHECK(sppt.num_tables() == 4);
+
+        CHECK_NOTHROW(sppt.clear(0x40000000));
+        CHECK(sppt.num_tables() == 4);
+    }
+    CHECK(g_allocated_pages.empty());
+}
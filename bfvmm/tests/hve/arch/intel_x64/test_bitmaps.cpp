@@ -0,0 +1,220 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/bitmaps.h>
+
+using namespace eapis::intel_x64;
+
+static bool
+is_set(gsl::span<uint8_t> bitmap, uint64_t bit)
+{ return (bitmap[gsl::narrow_cast<std::ptrdiff_t>(bit >> 3)] & (1U << (bit & 7U))) != 0; }
+
+TEST_CASE("bitmap policy, msr bits")
+{
+    CHECK(bitmap_policy::rdmsr_bit(0x10) == 0x10);
+    CHECK(bitmap_policy::rdmsr_bit(0xC0000080) == 0x2080);
+    CHECK(bitmap_policy::wrmsr_bit(0x10) == 0x4010);
+    CHECK(bitmap_policy::wrmsr_bit(0xC0000080) == 0x6080);
+
+    CHECK_THROWS(bitmap_policy::rdmsr_bit(0x2000));
+    CHECK_THROWS(bitmap_policy::wrmsr_bit(0xC0002000));
+}
+
+TEST_CASE("bitmap policy, trap / pass through")
+{
+    auto policy = bitmap_policy();
+
+    policy.trap_rdmsr(0x10);
+    policy.trap_wrmsr(0xC0000080);
+    CHECK(is_set(policy.msr_bitmap(), 0x10));
+    CHECK(is_set(policy.msr_bitmap(), 0x6080));
+
+    policy.pass_through_rdmsr(0x10);
+    policy.pass_through_wrmsr(0xC0000080);
+    CHECK(!is_set(policy.msr_bitmap(), 0x10));
+    CHECK(!is_set(policy.msr_bitmap(), 0x6080));
+
+    CHECK(policy.io_bitmap_a().empty());
+
+    policy.trap_io(0x80);
+    policy.trap_io(0x8080);
+    CHECK(is_set(policy.io_bitmap_a(), 0x80));
+    CHECK(is_set(policy.io_bitmap_b(), 0x80));
+
+    policy.pass_through_io(0x80);
+    CHECK(!is_set(policy.io_bitmap_a(), 0x80));
+
+    CHECK_THROWS(policy.trap_io(0x10000));
+}
+
+TEST_CASE("bitmap policy, copy")
+{
+    auto policy = bitmap_policy();
+
+    policy.trap_rdmsr(0x10);
+    policy.trap_io(0x80);
+
+    auto copy = bitmap_policy(policy);
+    CHECK(copy.msr_bitmap().data() != policy.msr_bitmap().data());
+    CHECK(is_set(copy.msr_bitmap(), 0x10));
+    CHECK(is_set(copy.io_bitmap_a(), 0x80));
+}
+
+TEST_CASE("vcpu bitmaps, private")
+{
+    setup_eapis_test_support();
+
+    auto bitmaps = vcpu_bitmaps(nullptr);
+    CHECK(!bitmaps.is_shared());
+    CHECK(vmcs_n::primary_processor_based_vm_execution_controls::use_msr_bitmap::is_enabled());
+    CHECK(vmcs_n::primary_processor_based_vm_execution_controls::use_io_bitmaps::is_disabled());
+
+    bitmaps.trap_msr_bit(0x10);
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x10));
+
+    bitmaps.fill_msr_bitmap(0, 2048, 0xFF);
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x1FFF));
+    CHECK(!is_set(bitmaps.policy()->msr_bitmap(), 0x4000));
+
+    CHECK_THROWS(bitmaps.trap_io(0x80));
+
+    bitmaps.enable_io_bitmaps();
+    CHECK(vmcs_n::primary_processor_based_vm_execution_controls::use_io_bitmaps::is_enabled());
+
+    bitmaps.trap_io(0x80);
+    CHECK(is_set(bitmaps.policy()->io_bitmap_a(), 0x80));
+}
+
+TEST_CASE("vcpu bitmaps, shared")
+{
+    setup_eapis_test_support();
+
+    auto policy = bitmap_policy();
+    auto bitmaps1 = vcpu_bitmaps(&policy);
+
+    bitmaps1.trap_msr_bit(0x10);
+    CHECK(bitmaps1.is_shared());
+    CHECK(is_set(policy.msr_bitmap(), 0x10));
+
+    {
+        auto bitmaps2 = vcpu_bitmaps(&policy);
+        CHECK(policy.users() == 2);
+
+        bitmaps2.trap_msr_bit(0x10);
+        CHECK(bitmaps2.is_shared());
+
+        policy.trap_rdmsr(0x20);
+        CHECK(is_set(bitmaps1.policy()->msr_bitmap(), 0x20));
+        CHECK(is_set(bitmaps2.policy()->msr_bitmap(), 0x20));
+
+        bitmaps2.trap_msr_bit(0x30);
+        CHECK(!bitmaps2.is_shared());
+        CHECK(policy.users() == 1);
+        CHECK(is_set(bitmaps2.policy()->msr_bitmap(), 0x20));
+        CHECK(is_set(bitmaps2.policy()->msr_bitmap(), 0x30));
+        CHECK(!is_set(policy.msr_bitmap(), 0x30));
+    }
+
+    CHECK(policy.users() == 1);
+
+    {
+        auto bitmaps3 = vcpu_bitmaps(&policy);
+        bitmaps3.enable_io_bitmaps();
+
+        bitmaps3.fill_io_bitmap(0x00);
+        CHECK(bitmaps3.is_shared());
+
+        bitmaps3.pass_through_io(0x80);
+        CHECK(bitmaps3.is_shared());
+
+        bitmaps3.fill_io_bitmap(0xFF);
+        CHECK(!bitmaps3.is_shared());
+        CHECK(!is_set(policy.io_bitmap_a(), 0x80));
+    }
+
+    CHECK(policy.users() == 1);
+}
+
+TEST_CASE("vcpu bitmaps, memory usage")
+{
+    setup_eapis_test_support();
+
+    auto policy = bitmap_policy();
+    auto bitmaps = vcpu_bitmaps(&policy);
+
+    memory_usage_t usage{};
+    bitmaps.memory_usage(usage);
+    CHECK(usage.bitmaps == 0);
+    CHECK(usage.shared_bitmaps == 0x1000);
+
+    bitmaps.enable_io_bitmaps();
+    bitmaps.trap_msr_bit(0x30);
+    CHECK(!bitmaps.is_shared());
+
+    usage = {};
+    bitmaps.memory_usage(usage);
+    CHECK(usage.bitmaps == 0x3000);
+    CHECK(usage.shared_bitmaps == 0);
+    CHECK(usage.total() == 0x3000);
+}
+
+TEST_CASE("vcpu bitmaps, ranges")
+{
+    setup_eapis_test_support();
+
+    auto bitmaps = vcpu_bitmaps(nullptr);
+    bitmaps.enable_io_bitmaps();
+
+    bitmaps.trap_msr_range(bitmap_policy::rdmsr_bits(0x803, 0x8F4));
+    CHECK(!is_set(bitmaps.policy()->msr_bitmap(), 0x802));
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x803));
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x850));
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x8F4));
+    CHECK(!is_set(bitmaps.policy()->msr_bitmap(), 0x8F5));
+
+    bitmaps.pass_through_msr_range(bitmap_policy::rdmsr_bits(0x810, 0x81F));
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x80F));
+    CHECK(!is_set(bitmaps.policy()->msr_bitmap(), 0x810));
+    CHECK(!is_set(bitmaps.policy()->msr_bitmap(), 0x81F));
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x820));
+
+    bitmaps.trap_msr_range(bitmap_policy::wrmsr_bits(0xC0000080, 0xC0000082));
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x6080));
+    CHECK(is_set(bitmaps.policy()->msr_bitmap(), 0x6082));
+
+    CHECK_THROWS(bitmap_policy::rdmsr_bits(0x10, 0x0F));
+    CHECK_THROWS(bitmap_policy::rdmsr_bits(0x1000, 0xC0000010));
+
+    bitmaps.trap_io_range(0x7FFE, 0x8001);
+    CHECK(is_set(bitmaps.policy()->io_bitmap_a(), 0x7FFE));
+    CHECK(is_set(bitmaps.policy()->io_bitmap_a(), 0x7FFF));
+    CHECK(is_set(bitmaps.policy()->io_bitmap_b(), 0x0000));
+    CHECK(is_set(bitmaps.policy()->io_bitmap_b(), 0x0001));
+    CHECK(!is_set(bitmaps.policy()->io_bitmap_b(), 0x0002));
+
+    bitmaps.pass_through_io_range(0x7FFF, 0x8000);
+    CHECK(is_set(bitmaps.policy()->io_bitmap_a(), 0x7FFE));
+    CHECK(!is_set(bitmaps.policy()->io_bitmap_a(), 0x7FFF));
+    CHECK(!is_set(bitmaps.policy()->io_bitmap_b(), 0x0000));
+
+    CHECK_THROWS(bitmaps.trap_io_range(0xFFFF, 0x10000));
+}
@@ -0,0 +1,195 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/decoder.h>
+
+using namespace eapis::intel_x64;
+
+// mov [rax], ebx / mov dword [rax], 1
+static const std::array<uint8_t, 15> g_store = {0x89, 0x18};
+static const std::array<uint8_t, 15> g_store_imm = {0xC7, 0x00, 0x01, 0x00, 0x00, 0x00};
+
+TEST_CASE("insn cache, find / insert")
+{
+    insn_cache<> cache;
+    decoded_insn_t insn{2, 4, true, false, 0, capstone::ebx};
+
+    CHECK(cache.find(0x1000, 0x401000, CS_MODE_64, g_store) == nullptr);
+    CHECK(cache.misses() == 1);
+
+    cache.insert(0x1000, 0x401000, CS_MODE_64, g_store, insn);
+
+    auto found = cache.find(0x1000, 0x401000, CS_MODE_64, g_store);
+    REQUIRE(found != nullptr);
+    CHECK(found->len == 2);
+    CHECK(found->size == 4);
+    CHECK(found->reg.id == X86_REG_EBX);
+    CHECK(cache.hits() == 1);
+
+    CHECK(cache.find(0x2000, 0x401000, CS_MODE_64, g_store) == nullptr);
+    CHECK(cache.find(0x1000, 0x401002, CS_MODE_64, g_store) == nullptr);
+    CHECK(cache.find(0x1000, 0x401000, CS_MODE_32, g_store) == nullptr);
+
+    CHECK_THROWS(cache.insert(0x1000, 0x401000, CS_MODE_64, gsl::make_span(g_store).first(1), insn));
+}
+
+TEST_CASE("insn cache, rewritten instruction")
+{
+    insn_cache<> cache;
+    decoded_insn_t insn{2, 4, true, false, 0, capstone::ebx};
+
+    auto bytes = g_store;
+    cache.insert(0x1000, 0x401000, CS_MODE_64, bytes, insn);
+
+    // Bytes past the end of the instruction do not matter
+    bytes.at(2) = 0xCC;
+    CHECK(cache.find(0x1000, 0x401000, CS_MODE_64, bytes) != nullptr);
+
+    // mov [rax], ecx
+    bytes.at(1) = 0x08;
+    CHECK(cache.find(0x1000, 0x401000, CS_MODE_64, bytes) == nullptr);
+    CHECK(cache.find(0x1000, 0x401000, CS_MODE_64, gsl::make_span(g_store).first(1)) == nullptr);
+}
+
+TEST_CASE("insn cache, invalidate")
+{
+    insn_cache<> cache;
+    decoded_insn_t insn{6, 4, true, true, 1, {}};
+
+    cache.insert(0x1000, 0x401000, CS_MODE_64, g_store_imm, insn);
+    cache.insert(0x2000, 0x402ffc, CS_MODE_64, g_store_imm, insn);
+    cache.insert(0x3000, 0x500000, CS_MODE_64, g_store_imm, insn);
+
+    cache.invalidate_page(0x403010);
+    CHECK(cache.find(0x1000, 0x401000, CS_MODE_64, g_store_imm) != nullptr);
+    CHECK(cache.find(0x2000, 0x402ffc, CS_MODE_64, g_store_imm) == nullptr);
+
+    cache.invalidate_cr3(0x1000);
+    CHECK(cache.find(0x1000, 0x401000, CS_MODE_64, g_store_imm) == nullptr);
+    CHECK(cache.find(0x3000, 0x500000, CS_MODE_64, g_store_imm) != nullptr);
+
+    cache.clear();
+    CHECK(cache.find(0x3000, 0x500000, CS_MODE_64, g_store_imm) == nullptr);
+}
+
+TEST_CASE("insn decoder, mov")
+{
+    insn_decoder decoder;
+    decoded_insn_t insn{};
+
+    // mov [rax], ebx
+    std::array<uint8_t, 2> store = {0x89, 0x18};
+    CHECK(decoder.decode(store, 0, insn));
+    CHECK(insn.len == 2);
+    CHECK(insn.size == 4);
+    CHECK(insn.write);
+    CHECK(!insn.imm);
+    CHECK(insn.reg.id == X86_REG_EBX);
+
+    // mov rax, [rbx]
+    std::array<uint8_t, 3> load = {0x48, 0x8B, 0x03};
+    CHECK(decoder.decode(load, 0, insn));
+    CHECK(insn.len == 3);
+    CHECK(insn.size == 8);
+    CHECK(!insn.write);
+    CHECK(insn.reg.id == X86_REG_RAX);
+
+    // mov dword [rax], 1
+    std::array<uint8_t, 6> imm = {0xC7, 0x00, 0x01, 0x00, 0x00, 0x00};
+    CHECK(decoder.decode(imm, 0, insn));
+    CHECK(insn.len == 6);
+    CHECK(insn.write);
+    CHECK(insn.imm);
+    CHECK(insn.imm_val == 1);
+
+    // add [rax], ebx
+    std::array<uint8_t, 2> add = {0x01, 0x18};
+    CHECK(!decoder.decode(add, 0, insn));
+}
+
+TEST_CASE("insn decoder, reuse")
+{
+    insn_decoder decoder;
+    decoded_insn_t insn{};
+
+    // mov [rax], ebx, followed by garbage, then truncated
+    std::array<uint8_t, 4> bytes = {0x89, 0x18, 0xFF, 0xFF};
+
+    for (auto i = 0; i < 0x100; i++) {
+        CHECK(decoder.decode(bytes, 0x401000, insn));
+        CHECK(insn.len == 2);
+        CHECK(insn.reg.id == X86_REG_EBX);
+        CHECK(!decoder.decode(gsl::make_span(bytes).subspan(2), 0x401002, insn));
+        CHECK(!decoder.decode(gsl::make_span(bytes).first(1), 0x401000, insn));
+    }
+}
+
+TEST_CASE("insn decoder, fast path")
+{
+    insn_decoder decoder;
+    decoded_insn_t insn{};
+
+    // movzx eax, word [rbx]
+    std::array<uint8_t, 3> movzx = {0x0F, 0xB7, 0x03};
+    CHECK(decoder.decode(movzx, 0, insn));
+    CHECK(insn.len == 3);
+    CHECK(insn.size == 2);
+    CHECK(!insn.write);
+    CHECK(insn.reg.id == X86_REG_EAX);
+    CHECK(decoder.fast_decodes() == 1);
+    CHECK(decoder.capstone_decodes() == 0);
+
+    // rep movsd
+    std::array<uint8_t, 2> movs = {0xF3, 0xA5};
+    CHECK(!decoder.decode(movs, 0, insn));
+    CHECK(decoder.capstone_decodes() == 0);
+
+    // mov [rax], es is left to capstone
+    std::array<uint8_t, 2> sreg = {0x8C, 0x00};
+    CHECK(!decoder.decode(sreg, 0, insn));
+    CHECK(decoder.capstone_decodes() == 1);
+}
+
+TEST_CASE("insn decoder, not 64 bit mode")
+{
+    insn_decoder decoder;
+    decoded_insn_t insn{};
+
+    // mov [eax], ebx is left to capstone outside of 64 bit mode
+    std::array<uint8_t, 2> store = {0x89, 0x18};
+    CHECK(decoder.decode(store, 0, insn, CS_MODE_32));
+    CHECK(insn.len == 2);
+    CHECK(insn.size == 4);
+    CHECK(insn.reg.id == X86_REG_EBX);
+    CHECK(decoder.fast_decodes() == 0);
+    CHECK(decoder.capstone_decodes() == 1);
+
+    // The same bytes are mov [bx + si], bx in 16 bit mode
+    CHECK(decoder.decode(store, 0, insn, CS_MODE_16));
+    CHECK(insn.size == 2);
+    CHECK(insn.reg.id == X86_REG_BX);
+    CHECK(decoder.capstone_decodes() == 2);
+
+    CHECK(decoder.decode(store, 0, insn, CS_MODE_64));
+    CHECK(insn.size == 4);
+    CHECK(decoder.fast_decodes() == 1);
+}
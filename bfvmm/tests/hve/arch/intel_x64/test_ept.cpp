@@ -59,3 +59,277 @@ TEST_CASE("set_eptp")
     handler.set_eptp(nullptr);
     CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_disabled());
 }
+
+TEST_CASE("set_eptp accessed and dirty flags")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+
+    handler.set_eptp(&mm);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+
+    handler.set_eptp(&mm, true);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_enabled());
+
+    handler.set_eptp(&mm);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+
+    handler.set_eptp(nullptr);
+}
+
+TEST_CASE("invalidate")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+
+    CHECK(!handler.invalidate());
+    CHECK(handler.invalidations() == 0);
+
+    handler.set_eptp(&mm);
+    CHECK(handler.invalidate());
+    CHECK(!handler.invalidate());
+    CHECK(handler.invalidate(true));
+
+    mm.map_4k(0x1000, 0x1000);
+    CHECK(handler.invalidate());
+    CHECK(!handler.invalidate());
+
+    CHECK(handler.invalidations() == 3);
+    CHECK(handler.invalidations_avoided() == 2);
+
+    handler.set_eptp(nullptr);
+    CHECK(!handler.invalidate());
+}
+
+TEST_CASE("invalidate, invept types")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    g_msrs[0x48C] = (1ULL << 25) | (1ULL << 26);
+    CHECK(ept_handler::is_invept_single_context_supported());
+    CHECK(ept_handler::is_invept_all_context_supported());
+
+    g_msrs[0x48C] = 1ULL << 26;
+    CHECK(!ept_handler::is_invept_single_context_supported());
+    CHECK(ept_handler::is_invept_all_context_supported());
+
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm1 = ept::mmap{};
+    auto mm2 = ept::mmap{};
+
+    handler.set_eptp(&mm1);
+    CHECK(handler.invalidate());
+    CHECK(!handler.invalidate());
+
+    handler.add_view(mm1);
+    handler.add_view(mm2);
+    handler.set_view(0);
+
+    CHECK(handler.invalidate());
+    CHECK(!handler.invalidate());
+
+    mm2.map_4k(0x1000, 0x1000);
+    CHECK(handler.invalidate());
+
+    CHECK(handler.invalidations() == 3);
+    CHECK(handler.invalidations_avoided() == 2);
+
+    g_msrs[0x48C] = 0;
+}
+
+static ept_handler *g_resume_handler{nullptr};
+
+static bool
+test_exit(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+    return true;
+}
+
+static void
+test_resume(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+    g_resume_handler->invalidate();
+}
+
+TEST_CASE("invalidate, shared map on resume")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler1 = ept_handler(eapis, &g_eapis_vcpu_global_state);
+    auto handler2 = ept_handler(eapis, &g_eapis_vcpu_global_state);
+    auto table = exit_dispatch_table<>();
+
+    auto mm = ept::mmap{};
+    auto reason = vmcs_n::exit_reason::basic_exit_reason::rdtsc;
+    auto resume = exit_poll_delegate_t::create<test_resume>();
+
+    handler1.set_eptp(&mm);
+    handler2.set_eptp(&mm);
+
+    g_resume_handler = &handler2;
+    table.push_front(reason, ::handler_delegate_t::create<test_exit>());
+    table.set_resume(&resume);
+
+    CHECK(table.handle(reason, vmcs));
+    CHECK(handler2.invalidations() == 1);
+
+    mm.map_4k(0x1000, 0x1000);
+    CHECK(handler1.invalidate());
+
+    CHECK(table.handle(reason, vmcs));
+    CHECK(handler2.invalidations() == 2);
+    CHECK(table.handle(reason, vmcs));
+    CHECK(handler2.invalidations() == 2);
+
+    table.set_resume(nullptr);
+    mm.map_4k(0x2000, 0x2000);
+
+    CHECK(table.handle(reason, vmcs));
+    CHECK(handler2.invalidations() == 2);
+
+    handler1.set_eptp(nullptr);
+    handler2.set_eptp(nullptr);
+    g_resume_handler = nullptr;
+}
+
+TEST_CASE("views")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto exec = ept::mmap{};
+    auto rw = ept::mmap{};
+
+    CHECK(handler.num_views() == 0);
+    CHECK_THROWS(handler.set_view(0));
+
+    CHECK(handler.add_view(exec) == 0);
+    CHECK(handler.add_view(rw, true) == 1);
+    CHECK(handler.num_views() == 2);
+
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vm_functions::is_enabled());
+    CHECK(vmcs_n::vm_function_controls::eptp_switching::is_enabled());
+    CHECK(vmcs_n::eptp_list_address::get() != 0);
+
+    handler.set_view(1);
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_enabled());
+    CHECK(vmcs_n::ept_pointer::phys_addr::get() == rw.eptp());
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_enabled());
+    CHECK(handler.view() == 1);
+
+    handler.set_view(0);
+    CHECK(vmcs_n::ept_pointer::phys_addr::get() == exec.eptp());
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+    CHECK(handler.view() == 0);
+
+    handler.set_eptp(nullptr);
+}
+
+TEST_CASE("views, invalidate")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto exec = ept::mmap{};
+    auto rw = ept::mmap{};
+
+    handler.add_view(exec);
+    handler.add_view(rw);
+    CHECK(!handler.invalidate());
+
+    handler.set_view(0);
+    CHECK(handler.invalidate());
+    CHECK(!handler.invalidate());
+
+    rw.map_4k(0x1000, 0x1000);
+    CHECK(handler.invalidate());
+    CHECK(!handler.invalidate());
+    CHECK(handler.invalidate(true));
+
+    CHECK(handler.invalidations() == 3);
+    CHECK(handler.invalidations_avoided() == 2);
+
+    handler.set_eptp(nullptr);
+}
+
+TEST_CASE("virtualization exceptions")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK(handler.ve_info() == nullptr);
+    CHECK(handler.ve_info_phys() == 0);
+
+    handler.enable_ve();
+    REQUIRE(handler.ve_info() != nullptr);
+    CHECK(handler.ve_info()->busy == 0);
+    CHECK(vmcs_n::virtualization_exception_information_address::get() == handler.ve_info_phys());
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_enabled());
+
+    handler.disable_ve();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_disabled());
+}
+
+TEST_CASE("sub-page write permissions")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm1 = ept::mmap{};
+    auto mm2 = ept::mmap{};
+
+    g_msrs[0x48B] = 0;
+    handler.set_eptp(&mm1);
+    CHECK(!ept_handler::is_spp_supported());
+    CHECK_THROWS(handler.enable_spp());
+
+    g_msrs[0x48B] = (1ULL << 23) << 32;
+    CHECK(ept_handler::is_spp_supported());
+
+    handler.enable_spp();
+    CHECK(handler.is_spp_enabled());
+    CHECK(::intel_x64::vm::read(0x2030U) == mm1.spptp());
+    CHECK((::intel_x64::vm::read(vmcs_n::secondary_processor_based_vm_execution_controls::addr) & (1ULL << 23)) != 0);
+
+    handler.set_eptp(&mm2);
+    CHECK(::intel_x64::vm::read(0x2030U) == mm2.spptp());
+
+    handler.disable_spp();
+    CHECK(!handler.is_spp_enabled());
+    CHECK((::intel_x64::vm::read(vmcs_n::secondary_processor_based_vm_execution_controls::addr) & (1ULL << 23)) == 0);
+
+    handler.enable_spp();
+    handler.set_eptp(nullptr);
+    CHECK(!handler.is_spp_enabled());
+}
@@ -0,0 +1,100 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/base.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+bool
+test_exit(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+    return true;
+}
+
+bool
+test_exit_returns_false(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+    return false;
+}
+
+TEST_CASE("exit latency: buckets")
+{
+    exit_latency_t lat{};
+
+    lat.add(0);
+    lat.add(1);
+    lat.add(2);
+    lat.add(3);
+    lat.add(1024);
+    lat.add(2047);
+
+    CHECK(lat.count == 6);
+    CHECK(lat.total == 3077);
+    CHECK(lat.max == 2047);
+
+    CHECK(lat.buckets.at(0) == 2);
+    CHECK(lat.buckets.at(1) == 2);
+    CHECK(lat.buckets.at(10) == 2);
+    CHECK(lat.buckets.at(11) == 0);
+
+    lat.add(0xFFFFFFFFFFFFFFFF);
+    CHECK(lat.buckets.at(63) == 1);
+    CHECK(lat.max == 0xFFFFFFFFFFFFFFFF);
+}
+
+TEST_CASE("exit latency: dispatch table")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto table = exit_dispatch_table<>();
+
+    auto handled = vmcs_n::exit_reason::basic_exit_reason::cpuid;
+    auto unhandled = vmcs_n::exit_reason::basic_exit_reason::rdmsr;
+
+    table.push_front(handled, ::handler_delegate_t::create<test_exit>());
+    table.push_front(unhandled, ::handler_delegate_t::create<test_exit_returns_false>());
+
+    // Nothing is timed until there is somewhere to record it
+    CHECK(table.handle(handled, vmcs));
+
+    auto latencies = std::array<exit_latency_t, exit_dispatch_table<>::size()>();
+    table.set_latencies(latencies.data());
+
+    CHECK(table.handle(handled, vmcs));
+    CHECK(table.handle(handled, vmcs));
+    CHECK(!table.handle(unhandled, vmcs));
+
+    CHECK(latencies.at(handled).count == 2);
+    CHECK(latencies.at(handled).total >= latencies.at(handled).max);
+    CHECK(latencies.at(unhandled).count == 0);
+
+    table.set_latencies(nullptr);
+
+    CHECK(table.handle(handled, vmcs));
+    CHECK(latencies.at(handled).count == 2);
+}
+
+#endif
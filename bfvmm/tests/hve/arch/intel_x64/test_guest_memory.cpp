@@ -0,0 +1,130 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/guest_memory.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+static uint64_t g_unmaps = 0;
+
+// A stand in for unique_map that records when the page is unmapped
+
+class fake_map
+{
+public:
+
+    fake_map(uint64_t page) :
+        m_page{std::make_unique<uint8_t[]>(::x64::pt::page_size)}
+    { m_page[0] = static_cast<uint8_t>(page >> 12); }
+
+    ~fake_map()
+    {
+        if (m_page) {
+            g_unmaps++;
+        }
+    }
+
+    uint8_t *get() const noexcept
+    { return m_page.get(); }
+
+    fake_map(fake_map &&) = default;
+    fake_map &operator=(fake_map &&) = default;
+
+private:
+
+    std::unique_ptr<uint8_t[]> m_page;
+};
+
+static uint64_t g_maps = 0;
+
+static auto
+map(uint64_t page)
+{
+    g_maps++;
+    return fake_map(page);
+}
+
+TEST_CASE("map cache: find or map")
+{
+    g_maps = 0;
+    map_cache<fake_map, 2> cache;
+
+    CHECK(cache.find_or_map(0x1000, map)[0] == 1);
+    CHECK(cache.find_or_map(0x1000, map)[0] == 1);
+    CHECK(g_maps == 1);
+
+    CHECK(cache.find_or_map(0x2000, map)[0] == 2);
+    CHECK(g_maps == 2);
+
+    CHECK(cache.hits() == 1);
+    CHECK(cache.misses() == 2);
+    CHECK(cache.evictions() == 0);
+}
+
+TEST_CASE("map cache: evicts the least recently used page")
+{
+    g_maps = 0;
+    g_unmaps = 0;
+    map_cache<fake_map, 2> cache;
+
+    cache.find_or_map(0x1000, map);
+    cache.find_or_map(0x2000, map);
+    cache.find_or_map(0x1000, map);
+    cache.find_or_map(0x3000, map);
+
+    CHECK(cache.evictions() == 1);
+    CHECK(g_unmaps == 1);
+
+    CHECK(cache.find_or_map(0x1000, map)[0] == 1);
+    CHECK(g_maps == 3);
+
+    CHECK(cache.find_or_map(0x2000, map)[0] == 2);
+    CHECK(g_maps == 4);
+}
+
+TEST_CASE("map cache: invalidate")
+{
+    g_maps = 0;
+    g_unmaps = 0;
+    map_cache<fake_map, 4> cache;
+
+    cache.find_or_map(0x1000, map);
+    cache.find_or_map(0x2000, map);
+    cache.find_or_map(0x3000, map);
+
+    cache.invalidate(0x1800, 0x1000);
+    CHECK(g_unmaps == 2);
+
+    cache.find_or_map(0x3000, map);
+    CHECK(g_maps == 3);
+
+    cache.find_or_map(0x1000, map);
+    CHECK(g_maps == 4);
+
+    cache.clear();
+    CHECK(g_unmaps == 4);
+
+    cache.find_or_map(0x3000, map);
+    CHECK(g_maps == 5);
+}
+
+#endif
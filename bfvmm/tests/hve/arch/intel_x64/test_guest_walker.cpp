@@ -0,0 +1,216 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/guest_walker.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+constexpr const uint64_t cr4_pcide = 1ULL << 17;
+
+static uint64_t g_walks = 0;
+
+static void
+setup_walk(MockRepository &mocks)
+{
+    g_walks = 0;
+
+    mocks.OnCallFunc(guest_walker::walk).Do([](uint64_t gva, uint64_t cr3) {
+        g_walks++;
+        return (gva ^ 0x100000) + (cr3 & 0xFFF000);
+    });
+}
+
+TEST_CASE("gva cache: find / insert")
+{
+    gva_cache<4> cache;
+    uint64_t gpa = 0;
+
+    CHECK(!cache.find(0x1000, 0x400123, gpa));
+
+    cache.insert(0x1000, 0x400123, 0x9000);
+    CHECK(cache.find(0x1000, 0x400456, gpa));
+    CHECK(gpa == 0x9456);
+    CHECK(!cache.find(0x2000, 0x400456, gpa));
+
+    cache.insert(0x2000, 0x400000, 0xA000);
+    cache.invalidate_tag(0x1000);
+    CHECK(!cache.find(0x1000, 0x400000, gpa));
+    CHECK(cache.find(0x2000, 0x400000, gpa));
+
+    cache.invalidate_page(0x400FFF);
+    CHECK(!cache.find(0x2000, 0x400000, gpa));
+
+    CHECK(cache.hits() == 2);
+    CHECK(cache.misses() == 4);
+}
+
+TEST_CASE("gva cache: invalidate pcid")
+{
+    gva_cache<4> cache;
+    uint64_t gpa = 0;
+
+    cache.insert(0x1001, 0x400000, 0x9000);
+    cache.insert(0x2001, 0x400000, 0xA000);
+    cache.insert(0x3002, 0x400000, 0xB000);
+
+    cache.invalidate_pcid(1);
+    CHECK(!cache.find(0x1001, 0x400000, gpa));
+    CHECK(!cache.find(0x2001, 0x400000, gpa));
+    CHECK(cache.find(0x3002, 0x400000, gpa));
+}
+
+TEST_CASE("guest walker: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(guest_walker(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("guest walker: translation")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto walker = guest_walker(eapis, &g_eapis_vcpu_global_state);
+
+    setup_walk(mocks);
+    vmcs_n::guest_cr3::set(0x1000);
+
+    CHECK(walker.gva_to_gpa(0x400010) == 0x501010);
+    CHECK(walker.gva_to_gpa(0x400020) == 0x501020);
+    CHECK(g_walks == 1);
+
+    CHECK(walker.gva_to_gpa(0x400010, 0x2000) == 0x502010);
+    CHECK(g_walks == 2);
+}
+
+TEST_CASE("guest walker: invalidation")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto walker = guest_walker(eapis, &g_eapis_vcpu_global_state);
+
+    setup_walk(mocks);
+    control_register_handler::info_t info{};
+
+    walker.gva_to_gpa(0x400000, 0x1000);
+    walker.gva_to_gpa(0x400000, 0x2001);
+
+    vmcs_n::guest_cr4::set(cr4_pcide);
+
+    info.val = 0x8000000000002001;
+    CHECK(!walker.handle_wrcr3(vmcs, info));
+    walker.gva_to_gpa(0x400000, 0x2001);
+    CHECK(g_walks == 2);
+
+    info.val = 0x2001;
+    CHECK(!walker.handle_wrcr3(vmcs, info));
+    walker.gva_to_gpa(0x400000, 0x2001);
+    walker.gva_to_gpa(0x400000, 0x1000);
+    CHECK(g_walks == 3);
+
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, 0x400800);
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 3);
+    g_save_state.rip = 0x10;
+
+    CHECK(walker.handle_invlpg(vmcs));
+    CHECK(g_save_state.rip == 0x13);
+    walker.gva_to_gpa(0x400000, 0x1000);
+    CHECK(g_walks == 4);
+
+    vmcs_n::guest_cr4::set(0);
+
+    info.val = 0x1000;
+    CHECK(!walker.handle_wrcr3(vmcs, info));
+    walker.gva_to_gpa(0x400000, 0x1000);
+    CHECK(g_walks == 5);
+
+    CHECK(!walker.handle_wrcr4(vmcs, info));
+    walker.gva_to_gpa(0x400000, 0x1000);
+    CHECK(g_walks == 6);
+}
+
+TEST_CASE("guest walker: cr3 flushes the pcid")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto walker = guest_walker(eapis, &g_eapis_vcpu_global_state);
+
+    setup_walk(mocks);
+    control_register_handler::info_t info{};
+
+    vmcs_n::guest_cr4::set(cr4_pcide);
+
+    // Switching to another address space with the same PCID (and no
+    // bit 63) drops what was cached for the first one, so switching back
+    // without a flush walks again
+    //
+
+    walker.gva_to_gpa(0x400000, 0x1001);
+
+    info.val = 0x2001;
+    CHECK(!walker.handle_wrcr3(vmcs, info));
+
+    info.val = 0x8000000000001001;
+    CHECK(!walker.handle_wrcr3(vmcs, info));
+    CHECK(walker.gva_to_gpa(0x400000, 0x1001) == 0x501000);
+    CHECK(g_walks == 2);
+
+    vmcs_n::guest_cr4::set(0);
+}
+
+TEST_CASE("guest walker: invpcid")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto walker = guest_walker(eapis, &g_eapis_vcpu_global_state);
+
+    setup_walk(mocks);
+
+    walker.gva_to_gpa(0x400000, 0x1001);
+    walker.gva_to_gpa(0x400000, 0x2002);
+
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 5);
+    g_save_state.rip = 0x10;
+
+    CHECK(walker.handle_invpcid(vmcs));
+    CHECK(g_save_state.rip == 0x15);
+
+    walker.gva_to_gpa(0x400000, 0x1001);
+    walker.gva_to_gpa(0x400000, 0x2002);
+    CHECK(g_walks == 4);
+}
+
+#endif
@@ -0,0 +1,130 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/msr_lists.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+TEST_CASE("msr lists: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(msr_lists(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("msr lists: add")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto lists = msr_lists(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0xC0000102] = 0x42;
+
+    lists.add(0xC0000102, 0x10);
+    CHECK(lists.size() == 1);
+    CHECK(lists.contains(0xC0000102));
+    CHECK(lists.guest_value(0xC0000102) == 0x10);
+    CHECK(lists.host_value(0xC0000102) == 0x42);
+
+    CHECK(vmcs_n::vm_entry_msr_load_count::get() == 1);
+    CHECK(vmcs_n::vm_exit_msr_store_count::get() == 1);
+    CHECK(vmcs_n::vm_exit_msr_load_count::get() == 1);
+    CHECK(vmcs_n::vm_entry_msr_load_address::get() == vmcs_n::vm_exit_msr_store_address::get());
+    CHECK(vmcs_n::vm_entry_msr_load_address::get() != vmcs_n::vm_exit_msr_load_address::get());
+
+    lists.add(0xC0000102, 0x20);
+    CHECK(lists.size() == 1);
+    CHECK(lists.guest_value(0xC0000102) == 0x20);
+    CHECK(lists.host_value(0xC0000102) == 0x42);
+
+    lists.add(0xC0000081, 0x1, 0x2);
+    CHECK(lists.size() == 2);
+    CHECK(lists.guest_area()[1].index == 0xC0000081);
+    CHECK(lists.host_area()[1].data == 0x2);
+    CHECK(vmcs_n::vm_entry_msr_load_count::get() == 2);
+}
+
+TEST_CASE("msr lists: full")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto lists = msr_lists(eapis, &g_eapis_vcpu_global_state);
+
+    for (auto i = 0U; i < msr_lists::max_entries; i++) {
+        lists.add(i, i, i);
+    }
+
+    CHECK(lists.size() == msr_lists::max_entries);
+    CHECK_THROWS(lists.add(msr_lists::max_entries, 0, 0));
+    CHECK_NOTHROW(lists.add(0, 1, 1));
+}
+
+TEST_CASE("msr lists: remove")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto lists = msr_lists(eapis, &g_eapis_vcpu_global_state);
+
+    lists.add(0x1, 0x10, 0x11);
+    lists.add(0x2, 0x20, 0x21);
+    lists.add(0x3, 0x30, 0x31);
+
+    lists.remove(0x1);
+    CHECK(lists.size() == 2);
+    CHECK(!lists.contains(0x1));
+    CHECK(lists.guest_value(0x3) == 0x30);
+    CHECK(lists.host_value(0x3) == 0x31);
+    CHECK(vmcs_n::vm_exit_msr_load_count::get() == 2);
+
+    CHECK_NOTHROW(lists.remove(0x1));
+    CHECK(lists.size() == 2);
+}
+
+TEST_CASE("msr lists: values")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto lists = msr_lists(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_THROWS(lists.guest_value(0x1));
+    CHECK_THROWS(lists.set_host_value(0x1, 0));
+
+    lists.add(0x1, 0x10, 0x11);
+    lists.set_guest_value(0x1, 0x12);
+    lists.set_host_value(0x1, 0x13);
+
+    CHECK(lists.guest_value(0x1) == 0x12);
+    CHECK(lists.host_value(0x1) == 0x13);
+}
+
+#endif
@@ -0,0 +1,272 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/mtrr_pat.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using range_t = mtrrs::range_t;
+
+constexpr const auto wc = ept::mmap::memory_type::write_combining;
+constexpr const uint64_t host_pat = 0x0007040600070406ULL;
+constexpr const uint64_t mapped = 0x80000000ULL;
+
+// The host has UC below 1MB (the fixed ranges), WB up to 2GB (variable
+// range 0) and UC above that (the default). Variable range 1 is free.
+//
+static void
+setup_host_mtrrs()
+{
+    enable_mtrrs(2);
+    ::intel_x64::msrs::ia32_mtrr_def_type::type::set(0);
+    add_variable_range(0, range_t{wb, 0x0, mapped});
+    add_variable_range(1, range_t{uc, 0x0, 0x1000}, true);
+
+    g_msrs[0x277U] = host_pat;
+}
+
+static uint64_t
+physmask(uint64_t size)
+{ return (size_to_physmask(size) << 12) | 0x800U; }
+
+static uint64_t
+type_of(ept::mmap &map, uint64_t gpa)
+{ return ::intel_x64::ept::pt::entry::memory_type::get(map.entry(gpa)); }
+
+static bool
+guest_write(mtrr_pat_handler &handler, gsl::not_null<vmcs_t *> vmcs, uint64_t msr, uint64_t val)
+{
+    wrmsr_handler::info_t info = {msr, val, false, false};
+    return handler.handle_wrmsr(vmcs, info) && info.ignore_write;
+}
+
+static uint64_t
+guest_read(mtrr_pat_handler &handler, gsl::not_null<vmcs_t *> vmcs, uint64_t msr)
+{
+    rdmsr_handler::info_t info = {msr, 0, false, false};
+    CHECK(handler.handle_rdmsr(vmcs, info));
+
+    return info.val;
+}
+
+TEST_CASE("mtrr_pat: enable")
+{
+    setup_eapis_test_support();
+    setup_host_mtrrs();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    ept::mmap map{};
+    identity_map(map, 0, mapped);
+
+    auto handler = mtrr_pat_handler(eapis, &g_eapis_vcpu_global_state);
+    CHECK_THROWS(handler.enable(map, 0x1001));
+
+    handler.enable(map, mapped);
+    CHECK_THROWS(handler.enable(map, mapped));
+
+    CHECK(handler.guest_pat() == host_pat);
+    CHECK(handler.guest_msrs().def_type == g_msrs[0x2FFU]);
+    CHECK(handler.guest_mtrrs().type_of(0x100000) == wb);
+    CHECK(handler.guest_mtrrs().type_of(mapped) == uc);
+
+    CHECK(::intel_x64::vm::read(0x2804U) == host_pat);
+    CHECK(::intel_x64::vm::read(0x2C00U) == host_pat);
+    CHECK((::intel_x64::vm::read(0x400CU) & (3ULL << 18)) == (3ULL << 18));
+    CHECK((::intel_x64::vm::read(0x4012U) & (1ULL << 14)) != 0);
+
+    CHECK(guest_read(handler, vmcs, 0x277U) == host_pat);
+    CHECK(guest_read(handler, vmcs, 0x200U) == g_msrs[0x200U]);
+}
+
+TEST_CASE("mtrr_pat: variable ranges")
+{
+    setup_eapis_test_support();
+    setup_host_mtrrs();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    ept::mmap map{};
+    identity_map(map, 0, mapped);
+
+    auto handler = mtrr_pat_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.enable(map, mapped);
+
+    // Neither write changes a memory type until the range is valid
+    //
+
+    CHECK(guest_write(handler, vmcs, 0x202U, 0x10000000U | 0x1U));
+    CHECK(guest_read(handler, vmcs, 0x202U) == (0x10000000U | 0x1U));
+    CHECK(handler.updates() == 1);
+    CHECK(handler.invalidations() == 0);
+
+    CHECK(guest_write(handler, vmcs, 0x203U, physmask(0x200000)));
+    CHECK(handler.updates() == 2);
+    CHECK(handler.invalidations() == 1);
+    CHECK(handler.retyped_bytes() == 0x200000);
+
+    CHECK(map.is_2m(0x10000000));
+    CHECK(type_of(map, 0x10000000) == 1);
+    CHECK(type_of(map, 0x10200000) == 6);
+    CHECK(type_of(map, 0x0FE00000) == 6);
+
+    // Writing the same value again is not an update
+    //
+
+    CHECK(guest_write(handler, vmcs, 0x203U, physmask(0x200000)));
+    CHECK(handler.updates() == 2);
+
+    // Invalidating the range restores the host's type
+    //
+
+    CHECK(guest_write(handler, vmcs, 0x203U, 0));
+    CHECK(handler.invalidations() == 2);
+    CHECK(type_of(map, 0x10000000) == 6);
+}
+
+TEST_CASE("mtrr_pat: guest types never exceed the host's")
+{
+    setup_eapis_test_support();
+    setup_host_mtrrs();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    ept::mmap map{};
+    identity_map(map, 0, mapped);
+
+    auto handler = mtrr_pat_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.enable(map, mapped);
+
+    CHECK(mtrr_pat_handler::effective_type(wb, uc) == uc);
+    CHECK(mtrr_pat_handler::effective_type(uc, wb) == uc);
+    CHECK(mtrr_pat_handler::effective_type(wb, wc) == wc);
+
+    // The host's fixed ranges are UC, so making them WB changes nothing
+    //
+
+    CHECK(guest_write(handler, vmcs, 0x250U, 0x0606060606060606U));
+    CHECK(handler.guest_mtrrs().type_of(0x0) == wb);
+    CHECK(handler.updates() == 1);
+    CHECK(handler.invalidations() == 0);
+    CHECK(type_of(map, 0x0) == 0);
+
+    // Making the WB range UC retypes all of it (but the first 1MB, which
+    // already was UC)
+    //
+
+    CHECK(guest_write(handler, vmcs, 0x200U, 0x0U));
+    CHECK(handler.invalidations() == 1);
+    CHECK(handler.retyped_bytes() == mapped - 0x100000);
+    CHECK(type_of(map, 0x100000) == 0);
+    CHECK(type_of(map, 0x40000000) == 0);
+
+    CHECK(guest_write(handler, vmcs, 0x200U, 0x6U));
+    CHECK(handler.invalidations() == 2);
+    CHECK(type_of(map, 0x40000000) == 6);
+}
+
+TEST_CASE("mtrr_pat: overrides")
+{
+    setup_eapis_test_support();
+    setup_host_mtrrs();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    ept::memory_type_overrides overrides{};
+    overrides.add(0x40000000, 0x1000, wc);
+
+    ept::mmap map{};
+    identity_map(map, 0, mapped, ept::mmap::attr_type::read_write_execute, &overrides);
+
+    auto handler = mtrr_pat_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.enable(map, mapped, &overrides);
+
+    CHECK(guest_write(handler, vmcs, 0x200U, 0x0U));
+    CHECK(type_of(map, 0x40000000) == 1);
+    CHECK(type_of(map, 0x40001000) == 0);
+    CHECK(handler.retyped_bytes() == mapped - 0x100000 - 0x1000);
+}
+
+TEST_CASE("mtrr_pat: pat")
+{
+    setup_eapis_test_support();
+    setup_host_mtrrs();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    ept::mmap map{};
+    identity_map(map, 0, mapped);
+
+    auto handler = mtrr_pat_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.enable(map, mapped);
+
+    CHECK(guest_write(handler, vmcs, 0x277U, 0x0106040600070406U));
+    CHECK(handler.guest_pat() == 0x0106040600070406U);
+    CHECK(::intel_x64::vm::read(0x2804U) == 0x0106040600070406U);
+    CHECK(g_msrs[0x277U] == host_pat);
+    CHECK(handler.updates() == 0);
+    CHECK(handler.invalidations() == 0);
+}
+
+TEST_CASE("mtrr_pat: rejected writes")
+{
+    setup_eapis_test_support();
+    setup_host_mtrrs();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    ept::mmap map{};
+    identity_map(map, 0, mapped);
+
+    auto handler = mtrr_pat_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.enable(map, mapped);
+
+    auto def_type = handler.guest_msrs().def_type;
+
+    CHECK(guest_write(handler, vmcs, 0x277U, 0x0000000000000002U));
+    CHECK(guest_write(handler, vmcs, 0x2FFU, def_type | 0x1000U));
+    CHECK(guest_write(handler, vmcs, 0x2FFU, (def_type & ~0xFFULL) | 0x7U));
+    CHECK(guest_write(handler, vmcs, 0x202U, 0x3U));
+    CHECK(guest_write(handler, vmcs, 0x26FU, 0x0200000000000000U));
+
+    CHECK(handler.rejected_writes() == 5);
+    CHECK(handler.guest_pat() == host_pat);
+    CHECK(handler.guest_msrs().def_type == def_type);
+    CHECK(handler.updates() == 0);
+
+    rdmsr_handler::info_t info = {0x10, 0, false, false};
+    CHECK(!handler.handle_rdmsr(vmcs, info));
+}
+
+#endif
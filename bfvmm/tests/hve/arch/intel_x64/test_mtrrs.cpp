@@ -337,3 +337,84 @@ TEST_CASE("variable range type: uncacheable")
         0x100000
     });
 }
+
+TEST_CASE("fixed ranges")
+{
+    constexpr auto wp = ept::mmap::memory_type::write_protected;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{wb, 0x0, 0x80000000});
+
+    ::intel_x64::msrs::ia32_mtrr_def_type::type::set(0);
+    set_fixed_range(0x250U, wb);
+    set_fixed_range(0x258U, wb);
+    set_fixed_range(0x259U, uc);
+
+    for (auto addr = 0x268U; addr <= 0x26FU; addr++) {
+        set_fixed_range(addr, wp);
+    }
+
+    mtrrs m{};
+
+    REQUIRE(m.size() == 5);
+    CHECK(m.ranges().at(0) == range_t{wb, 0, 0xA0000});
+    CHECK(m.ranges().at(1) == range_t{uc, 0xA0000, 0x20000});
+    CHECK(m.ranges().at(2) == range_t{wp, 0xC0000, 0x40000});
+    CHECK(m.ranges().at(3) == range_t{wb, 0x100000, 0x80000000 - 0x100000});
+    CHECK(m.ranges().at(4) == range_t{uc, 0x80000000, 0xFFFFFFFFFFFFFFFF - 0x80000000});
+}
+
+TEST_CASE("fixed ranges, sub-ranges")
+{
+    enable_mtrrs(0);
+    ::intel_x64::msrs::set(0x26FU, 0x0600000000000006U);
+
+    mtrrs m{};
+
+    CHECK(m.ranges().at(0) == range_t{uc, 0, 0xF8000});
+    CHECK(m.ranges().at(1) == range_t{wb, 0xF8000, 0x1000});
+    CHECK(m.ranges().at(2) == range_t{uc, 0xF9000, 0x6000});
+    CHECK(m.ranges().at(3) == range_t{wb, 0xFF000, 0x1000});
+    CHECK(m.ranges().at(4) == range_t{wb, 0x100000, 0xFFFFFFFFFFFFFFFF - 0x100000});
+}
+
+TEST_CASE("fixed ranges disabled")
+{
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0x80000, 0x80000});
+
+    auto def = ::intel_x64::msrs::get(::intel_x64::msrs::ia32_mtrr_def_type::addr);
+    ::intel_x64::msrs::set(::intel_x64::msrs::ia32_mtrr_def_type::addr, def & ~0x400ULL);
+
+    mtrrs m{};
+
+    REQUIRE(m.size() == 3);
+    CHECK(m.ranges().at(0) == range_t{wb, 0, 0x80000});
+    CHECK(m.ranges().at(1) == range_t{uc, 0x80000, 0x80000});
+    CHECK(m.ranges().at(2) == range_t{wb, 0x100000, 0xFFFFFFFFFFFFFFFF - 0x100000});
+}
+
+TEST_CASE("find / type_of / next_boundary")
+{
+    enable_mtrrs(2);
+    add_variable_range(0, range_t{ept::mmap::memory_type::uncacheable, 0x400000, 0x200000});
+    add_variable_range(1, range_t{ept::mmap::memory_type::write_combining, 0x200000, 0x100000});
+
+    mtrrs m{};
+
+    CHECK(m.find(0x0) == range_t{uc, 0, 0x100000});
+    CHECK(m.find(0x450000) == m.ranges().at(4));
+    CHECK(m.find(0x1000) == m.ranges().at(0));
+
+    CHECK(m.type_of(0x500000) == ept::mmap::memory_type::uncacheable);
+    CHECK(m.type_of(0x200000) == ept::mmap::memory_type::write_combining);
+    CHECK(m.type_of(0x2FFFFF) == ept::mmap::memory_type::write_combining);
+    CHECK(m.type_of(0x300000) == wb);
+    CHECK(m.type_of(0x100000) == wb);
+    CHECK(m.type_of(0xFFFFFFFFFFFFF000) == wb);
+
+    CHECK(m.next_boundary(0x0) == 0x100000);
+    CHECK(m.next_boundary(0x250000) == 0x300000);
+    CHECK(m.next_boundary(0x300000) == 0x400000);
+    CHECK(m.next_boundary(0x700000) == 0xFFFFFFFFFFFFFFFF);
+}
@@ -0,0 +1,127 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/posted_interrupts.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+static uint64_t
+virr(posted_interrupt_handler &handler, uint64_t reg)
+{ return handler.virtual_apic()->read(0x200U + (reg * 0x10U)); }
+
+TEST_CASE("posted interrupts: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    auto vapic = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_NOTHROW(posted_interrupt_handler(eapis, &g_eapis_vcpu_global_state, &vapic));
+}
+
+TEST_CASE("posted interrupts: enable / disable")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto vapic = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+    auto handler = posted_interrupt_handler(eapis, &g_eapis_vcpu_global_state, &vapic);
+
+    g_msrs[0x802] = 3;
+
+    CHECK(!handler.is_enabled());
+    CHECK_THROWS(handler.enable(8));
+    CHECK_THROWS(handler.post(0x40));
+
+    handler.enable(0xF2);
+    CHECK(handler.is_enabled());
+    CHECK(handler.descriptor()->control == 0x0000000300F20000);
+    CHECK(vmcs_n::posted_interrupt_notification_vector::get() == 0xF2);
+    CHECK(vmcs_n::pin_based_vm_execution_controls::process_posted_interrupts::is_enabled());
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::virtual_interrupt_delivery::is_enabled());
+
+    CHECK(vapic.is_enabled());
+
+    handler.disable();
+    CHECK(!handler.is_enabled());
+    CHECK(vmcs_n::pin_based_vm_execution_controls::process_posted_interrupts::is_disabled());
+    CHECK(vapic.is_enabled());
+}
+
+TEST_CASE("posted interrupts: post / sync")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto vapic = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+    auto handler = posted_interrupt_handler(eapis, &g_eapis_vcpu_global_state, &vapic);
+
+    g_msrs[0x802] = 3;
+    handler.enable(0xF2);
+
+    vmcs_n::guest_interrupt_status::set(0);
+
+    CHECK(handler.post(0x31));
+    CHECK(g_msrs[::intel_x64::msrs::ia32_x2apic_icr::addr] == 0x00000003000000F2);
+    CHECK(!handler.post(0x80));
+    CHECK_THROWS(handler.post(8));
+
+    CHECK(handler.sync() == 2);
+    CHECK(virr(handler, 1) == (1U << 0x11));
+    CHECK(virr(handler, 4) == 1U);
+    CHECK(vmcs_n::guest_interrupt_status::get() == 0x80);
+    CHECK(handler.sync() == 0);
+
+    handler.suppress_notifications(true);
+    CHECK(!handler.post(0x32));
+    handler.suppress_notifications(false);
+    CHECK(handler.sync() == 1);
+    CHECK(vmcs_n::guest_interrupt_status::get() == 0x80);
+}
+
+TEST_CASE("posted interrupts: notification")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto vapic = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+    auto handler = posted_interrupt_handler(eapis, &g_eapis_vcpu_global_state, &vapic);
+
+    handler.enable(0xF2);
+    handler.post(0x40);
+
+    external_interrupt_handler::info_t info = {0x30};
+    CHECK(!handler.handle_notification(vmcs, info));
+
+    info.vector = 0xF2;
+    CHECK(handler.handle_notification(vmcs, info));
+    CHECK(handler.descriptor()->pir.at(1) == 0);
+    CHECK(virr(handler, 2) == 1U);
+}
+
+#endif
@@ -0,0 +1,183 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/processor_trace.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+static uint64_t g_full_calls = 0;
+
+static void
+set_output(uint64_t index, uint64_t offset)
+{ g_msrs[0x561] = (offset << 32U) | (index << 7U) | 0x7FU; }
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, processor_trace_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    CHECK(info.wraps == 1);
+    g_full_calls++;
+
+    return true;
+}
+
+TEST_CASE("processor trace: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(processor_trace_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("processor trace: topa")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = processor_trace_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto topa = handler.topa();
+    CHECK((topa[processor_trace_handler::num_pages - 1] & 0x4U) != 0);
+    CHECK((topa[processor_trace_handler::num_pages] & 0x1U) != 0);
+}
+
+TEST_CASE("processor trace: enable / disable")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = processor_trace_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_THROWS(handler.enable(0x10));
+
+    handler.enable(0xF0);
+    CHECK(handler.is_enabled());
+    CHECK(g_msrs[0x834] == 0xF0);
+    CHECK(g_msrs[0x561] == 0x7F);
+    CHECK(::intel_x64::vm::read(0x2814U) == (processor_trace_handler::default_ctl | 0x101U));
+    CHECK((::intel_x64::vm::read(vmcs_n::vm_entry_controls::addr) & (1ULL << 18)) != 0);
+    CHECK((::intel_x64::vm::read(vmcs_n::vm_exit_controls::addr) & (1ULL << 25)) != 0);
+
+    handler.disable();
+    CHECK(!handler.is_enabled());
+    CHECK(::intel_x64::vm::read(0x2814U) == 0);
+}
+
+TEST_CASE("processor trace: read")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = processor_trace_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.enable(0xF0);
+
+    std::array<uint8_t, 0x2000> buf{};
+
+    set_output(0, 0x100);
+    CHECK(handler.pending() == 0x100);
+    CHECK(handler.read(buf) == 0x100);
+    CHECK(handler.pending() == 0);
+
+    set_output(2, 0x800);
+    CHECK(handler.read(buf) == 0x2000);
+    CHECK(handler.read(buf) == 0x700);
+
+    set_output(1, 0);
+    CHECK(handler.wraps() == 0);
+    CHECK(handler.pending() == processor_trace_handler::buffer_size - 0x1800);
+    CHECK(handler.wraps() == 1);
+    CHECK(handler.dropped() == 0);
+
+    set_output(3, 0);
+    CHECK(handler.pending() == processor_trace_handler::buffer_size);
+    CHECK(handler.read(buf) == 0x2000);
+    CHECK(handler.dropped() == 0x800);
+}
+
+TEST_CASE("processor trace: pmi")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = processor_trace_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_full_calls = 0;
+    handler.add_handler(
+        processor_trace_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    external_interrupt_handler::info_t info{};
+
+    info.vector = 0xF0;
+    CHECK(!handler.handle_pmi(vmcs, info));
+
+    handler.enable(0xF0);
+
+    set_output(processor_trace_handler::num_pages - 1, 0x800);
+    CHECK(handler.pending() != 0);
+
+    g_msrs[0x834] = 0x100F0;
+    g_msrs[0x38E] = 1ULL << 55;
+    set_output(0, 0x10);
+
+    info.vector = 0x30;
+    CHECK(!handler.handle_pmi(vmcs, info));
+
+    info.vector = 0xF0;
+    CHECK(handler.handle_pmi(vmcs, info));
+    CHECK(g_msrs[0x390] == 1ULL << 55);
+    CHECK(g_msrs[0x834] == 0xF0);
+    CHECK(g_full_calls == 1);
+}
+
+TEST_CASE("processor trace: wrmsr")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = processor_trace_handler(eapis, &g_eapis_vcpu_global_state);
+
+    wrmsr_handler::info_t info{};
+
+    CHECK(handler.handle_wrmsr(vmcs, info));
+    CHECK(!info.ignore_write);
+
+    handler.enable(0xF0);
+
+    CHECK(handler.handle_wrmsr(vmcs, info));
+    CHECK(info.ignore_write);
+}
+
+#endif
@@ -0,0 +1,405 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <cstring>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/stats.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::stats;
+
+constexpr const uint64_t output_offset = 0x200;
+
+// A batch of up to 8 commands, with the output starting at output_offset
+
+class test_batch
+{
+public:
+
+    test_batch() :
+        m_buf(0x1000)
+    { this->set_header({batch_magic, batch_version, 0, 1}); }
+
+    void add(command_t cmd)
+    {
+        auto hdr = this->header();
+        std::memcpy(&m_buf.at(sizeof(hdr) + (hdr.num_commands * sizeof(cmd))), &cmd, sizeof(cmd));
+
+        hdr.num_commands++;
+        this->set_header(hdr);
+    }
+
+    batch_header_t header() const
+    {
+        batch_header_t hdr{};
+        std::memcpy(&hdr, m_buf.data(), sizeof(hdr));
+        return hdr;
+    }
+
+    void set_header(const batch_header_t &hdr)
+    { std::memcpy(m_buf.data(), &hdr, sizeof(hdr)); }
+
+    command_t command(uint64_t i) const
+    {
+        command_t cmd{};
+        std::memcpy(&cmd, &m_buf.at(sizeof(batch_header_t) + (i * sizeof(cmd))), sizeof(cmd));
+        return cmd;
+    }
+
+    template<typename T>
+    T output(uint64_t offset = 0) const
+    {
+        T val{};
+        std::memcpy(&val, &m_buf.at(output_offset + offset), sizeof(val));
+        return val;
+    }
+
+    gsl::span<uint8_t> span()
+    { return gsl::make_span(m_buf); }
+
+private:
+
+    std::vector<uint8_t> m_buf;
+};
+
+static command_t
+make_command(uint32_t op, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t size = 0)
+{ return {op, 1, arg0, arg1, size != 0 ? output_offset : 0, size, 0}; }
+
+TEST_CASE("stats: constructor")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    mocks.ExpectCall(eapis, apis::add_vmcall_handler);
+    mocks.ExpectCall(eapis, apis::add_vmcall_handler);
+    CHECK_NOTHROW(stats_service(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("stats: invalid batch")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    test_batch batch;
+    CHECK(service.process(batch.span().first(4)) == status_invalid);
+
+    batch.set_header({0, batch_version, 0, 1});
+    CHECK(service.process(batch.span()) == status_invalid);
+    CHECK(batch.header().status == status_invalid);
+
+    batch.set_header({batch_magic, batch_version, 0x1000, 1});
+    CHECK(service.process(batch.span()) == status_invalid);
+
+    CHECK(service.batches() == 0);
+}
+
+TEST_CASE("stats: nop, unknown op and bad output")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    test_batch batch;
+    batch.add(make_command(op_nop));
+    batch.add(make_command(0x1000));
+    batch.add({op_profile, 1, 0, 0, 0, 0x10, 0});
+    batch.add({op_profile, 1, 0, 0, 0xFF8, 0x10, 0});
+
+    CHECK(service.process(batch.span()) == status_success);
+    CHECK(batch.header().status == status_success);
+
+    CHECK(batch.command(0).status == status_success);
+    CHECK(batch.command(1).status == status_unknown_op);
+    CHECK(batch.command(2).status == status_invalid);
+    CHECK(batch.command(3).status == status_invalid);
+
+    CHECK(service.batches() == 1);
+    CHECK(service.commands() == 4);
+}
+
+TEST_CASE("stats: exit counts and latency")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    exit_latency_t lat{};
+    lat.add(100);
+    lat.add(1000);
+
+    mocks.OnCall(eapis, apis::exit_latency).Return(&lat);
+
+    test_batch batch;
+    batch.add(make_command(op_exit_counts, 60, 0, 0x100));
+
+    CHECK(service.process(batch.span()) == status_success);
+    CHECK(batch.command(0).status == status_success);
+    CHECK(batch.command(0).result == 5);
+    CHECK(batch.output<uint64_t>(0) == 2);
+    CHECK(batch.output<uint64_t>(32) == 2);
+
+    test_batch batch2;
+    batch2.add(make_command(op_exit_latency, 10, 0, sizeof(latency_t)));
+    batch2.add(make_command(op_exit_latency, num_exit_reasons, 0, sizeof(latency_t)));
+
+    CHECK(service.process(batch2.span()) == status_success);
+    CHECK(batch2.command(0).status == status_success);
+    CHECK(batch2.command(1).status == status_invalid);
+
+    auto ret = batch2.output<latency_t>();
+    CHECK(ret.count == 2);
+    CHECK(ret.total == 1100);
+    CHECK(ret.max == 1000);
+    CHECK(ret.buckets[6] == 1);
+    CHECK(ret.buckets[9] == 1);
+}
+
+TEST_CASE("stats: not enabled")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    mocks.OnCall(eapis, apis::exit_latency).Return(nullptr);
+    mocks.OnCall(eapis, apis::profiler).Return(nullptr);
+    mocks.OnCall(eapis, apis::exported_exits).Return(nullptr);
+
+    test_batch batch;
+    batch.add(make_command(op_exit_counts, 0, 0, 0x100));
+    batch.add(make_command(op_exit_latency, 0, 0, sizeof(latency_t)));
+    batch.add(make_command(op_drain_samples, 0, 0, 0x100));
+    batch.add(make_command(op_export_info, 0, 0, sizeof(export_t)));
+
+    CHECK(service.process(batch.span()) == status_success);
+
+    for (auto i = 0U; i < 4; i++) {
+        CHECK(batch.command(i).status == status_not_enabled);
+    }
+}
+
+TEST_CASE("stats: drain samples")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    auto prof = exit_profiler<>(4);
+    prof.add({10, 0x1000, 0x2000});
+    prof.add({30, 0x3000, 0x4000});
+
+    mocks.OnCall(eapis, apis::profiler).Return(&prof);
+
+    test_batch batch;
+    batch.add(make_command(op_profile, 0, 0, sizeof(profile_t)));
+    batch.add({op_drain_samples, 1, 0, 0, output_offset + 0x100, 0x100, 0});
+
+    CHECK(service.process(batch.span()) == status_success);
+    CHECK(batch.command(0).status == status_success);
+    CHECK(batch.command(1).status == status_success);
+    CHECK(batch.command(1).result == 2);
+
+    auto profile = batch.output<profile_t>();
+    CHECK(profile.rate == 4);
+    CHECK(profile.taken == 2);
+
+    auto sample = batch.output<sample_t>(0x100 + sizeof(sample_t));
+    CHECK(sample.reason == 30);
+    CHECK(sample.rip == 0x3000);
+    CHECK(sample.cr3 == 0x4000);
+
+    std::array<exit_profiler<>::sample_t, 4> samples{};
+    CHECK(prof.drain(samples) == 0);
+}
+
+TEST_CASE("stats: enable / disable")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    mocks.ExpectCall(eapis, apis::enable_exit_latency);
+    mocks.ExpectCall(eapis, apis::enable_exit_profiler).With(8);
+    mocks.ExpectCall(eapis, apis::disable_exit_export);
+
+    test_batch batch;
+    batch.add(make_command(op_enable, feature_latency));
+    batch.add(make_command(op_enable, feature_profiler, 8));
+    batch.add(make_command(op_disable, feature_export));
+    batch.add(make_command(op_enable, 42));
+
+    CHECK(service.process(batch.span()) == status_success);
+    CHECK(batch.command(0).status == status_success);
+    CHECK(batch.command(1).status == status_success);
+    CHECK(batch.command(2).status == status_success);
+    CHECK(batch.command(3).status == status_invalid);
+}
+
+TEST_CASE("stats: trap / pass through ranges")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    mocks.ExpectCall(eapis, apis::trap_io_instruction_range).With(0xCF8, 0xCFF);
+    mocks.ExpectCall(eapis, apis::pass_through_rdmsr_range).With(0x800, 0x8FF);
+    mocks.ExpectCall(eapis, apis::trap_wrmsr_range).With(0x10, 0x10);
+
+    test_batch batch;
+    batch.add(make_command(op_trap_io_range, 0xCF8, 0xCFF));
+    batch.add(make_command(op_pass_through_rdmsr_range, 0x800, 0x8FF));
+    batch.add(make_command(op_trap_wrmsr_range, 0x10, 0x10));
+    batch.add(make_command(op_trap_io_range, 0xFFFF, 0x10000));
+    batch.add(make_command(op_pass_through_io_range, 0x10, 0x1));
+
+    CHECK(service.process(batch.span()) == status_success);
+    CHECK(batch.command(0).status == status_success);
+    CHECK(batch.command(1).status == status_success);
+    CHECK(batch.command(2).status == status_success);
+    CHECK(batch.command(3).status == status_invalid);
+    CHECK(batch.command(4).status == status_invalid);
+}
+
+TEST_CASE("stats: vmcall without guest memory")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    vmcall_handler::info_t info = {vmcall_opcode, 0x1000, 0x1000, 0, false, false};
+
+    CHECK(service.handle(vmcs, info));
+    CHECK(info.rax == static_cast<uint64_t>(static_cast<int64_t>(status_invalid)));
+}
+
+// A request ring of 8 slots, with the output starting at output_offset
+
+class test_ring
+{
+public:
+
+    test_ring() :
+        m_buf(ring_size)
+    { this->set_header({ring_magic, ring_version, 8, 1, 0, 0, 0}); }
+
+    void submit(command_t cmd)
+    {
+        auto hdr = this->header();
+        auto offset = sizeof(hdr) + ((hdr.tail & 7U) * sizeof(cmd));
+
+        std::memcpy(&m_buf.at(offset), &cmd, sizeof(cmd));
+
+        hdr.tail++;
+        this->set_header(hdr);
+    }
+
+    ring_header_t header() const
+    {
+        ring_header_t hdr{};
+        std::memcpy(&hdr, m_buf.data(), sizeof(hdr));
+        return hdr;
+    }
+
+    void set_header(const ring_header_t &hdr)
+    { std::memcpy(m_buf.data(), &hdr, sizeof(hdr)); }
+
+    command_t slot(uint64_t i) const
+    {
+        command_t cmd{};
+        std::memcpy(&cmd, &m_buf.at(sizeof(ring_header_t) + ((i & 7U) * sizeof(cmd))), sizeof(cmd));
+        return cmd;
+    }
+
+    gsl::span<uint8_t> span()
+    { return gsl::make_span(m_buf); }
+
+private:
+
+    std::vector<uint8_t> m_buf;
+};
+
+TEST_CASE("stats: request ring")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    test_ring ring;
+    CHECK(service.process_ring(ring.span()) == status_success);
+    CHECK(ring.header().polls == 0);
+
+    for (auto i = 0; i < 10; i++) {
+        ring.submit(make_command(op_nop));
+
+        if (i % 4 == 3) {
+            CHECK(service.process_ring(ring.span()) == status_success);
+        }
+    }
+
+    CHECK(service.process_ring(ring.span()) == status_success);
+
+    CHECK(ring.header().head == 10);
+    CHECK(ring.header().polls == 3);
+    CHECK(ring.header().status == status_success);
+    CHECK(ring.slot(9).status == status_success);
+    CHECK(service.ring_requests() == 10);
+
+    // The ring cannot be attached or detached from the ring itself
+    ring.submit(make_command(op_ring_detach));
+    ring.submit(make_command(42));
+    CHECK(service.process_ring(ring.span()) == status_success);
+    CHECK(ring.slot(10).status == status_invalid);
+    CHECK(ring.slot(11).status == status_unknown_op);
+}
+
+TEST_CASE("stats: invalid request ring")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto service = stats_service(eapis, &g_eapis_vcpu_global_state);
+
+    test_ring ring;
+    CHECK(service.process_ring(ring.span().first(0x100)) == status_invalid);
+
+    ring.set_header({ring_magic, ring_version, 6, 1, 0, 1, 0});
+    CHECK(service.process_ring(ring.span()) == status_invalid);
+    CHECK(ring.header().status == status_invalid);
+
+    ring.set_header({ring_magic, ring_version, 8, 1, 0, 9, 0});
+    CHECK(service.process_ring(ring.span()) == status_invalid);
+    CHECK(ring.header().head == 0);
+
+    // Output that overlaps the slots is rejected
+    ring.set_header({ring_magic, ring_version, 8, 1, 0, 0, 0});
+    ring.submit({op_profile, 1, 0, 0, 0x10, sizeof(profile_t), 0});
+    CHECK(service.process_ring(ring.span()) == status_success);
+    CHECK(ring.slot(0).status == status_invalid);
+
+    CHECK(service.poll() == status_not_enabled);
+    CHECK(service.attach_ring(0x1000) == status_invalid);
+    CHECK(!service.is_ring_attached());
+}
+
+#endif
@@ -0,0 +1,94 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/tsc.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+constexpr const uint64_t use_tsc_offsetting = 1ULL << 3;
+constexpr const uint64_t rdtsc_exiting = 1ULL << 12;
+constexpr const uint64_t tsc_offset_addr = 0x2010U;
+
+TEST_CASE("tsc: constructor")
+{
+    using namespace vmcs_n;
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    primary_processor_based_vm_execution_controls::set(rdtsc_exiting);
+    auto handler = tsc_handler(eapis, &g_eapis_vcpu_global_state);
+
+    const auto ctls = primary_processor_based_vm_execution_controls::get();
+    CHECK((ctls & use_tsc_offsetting) != 0);
+    CHECK((ctls & rdtsc_exiting) == 0);
+    CHECK(handler.offset() == 0);
+}
+
+TEST_CASE("tsc: offsetting")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = tsc_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.set_guest_tsc(1000, 400);
+    CHECK(handler.offset() == 600);
+    CHECK(::intel_x64::vm::read(tsc_offset_addr) == 600);
+    CHECK(handler.guest_tsc(500) == 1100);
+
+    handler.set_guest_tsc(0, 400);
+    CHECK(handler.guest_tsc(500) == 100);
+
+    wrmsr_handler::info_t info = {0x10, 0, false, false};
+    CHECK(handler.handle_wrmsr(vmcs, info));
+    CHECK(info.ignore_write);
+    CHECK(handler.tsc_writes() == 1);
+}
+
+TEST_CASE("tsc: scaling")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = tsc_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK(tsc_handler::is_scaling_supported());
+    CHECK_THROWS(handler.enable_scaling(0, 1000));
+
+    handler.enable_scaling(2000, 1000);
+    CHECK(handler.multiplier() == 2ULL << tsc_handler::multiplier_shift);
+    CHECK(handler.guest_tsc(2000) - handler.guest_tsc(1000) == 2000);
+
+    handler.enable_scaling(1000, 4000);
+    CHECK(handler.guest_tsc(4000) - handler.guest_tsc(0) == 1000);
+
+    handler.disable_scaling();
+    CHECK(handler.multiplier() == 1ULL << tsc_handler::multiplier_shift);
+    CHECK(handler.guest_tsc(2000) - handler.guest_tsc(1000) == 1000);
+}
+
+#endif
@@ -0,0 +1,141 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/virtual_apic.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+TEST_CASE("virtual apic: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(virtual_apic_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("virtual apic: enable / disable")
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x808] = 0x20;
+
+    CHECK(!handler.is_enabled());
+    CHECK_THROWS(handler.enable_register_virtualization());
+
+    handler.enable();
+    CHECK(handler.is_enabled());
+    CHECK(handler.read(0x80) == 0x20);
+    CHECK(vmcs_n::primary_processor_based_vm_execution_controls::use_tpr_shadow::is_enabled());
+    CHECK(virtualize_x2apic_mode::is_enabled());
+    CHECK(virtual_interrupt_delivery::is_enabled());
+    CHECK_NOTHROW(handler.enable());
+
+    g_msrs[0x802] = 3;
+    g_msrs[0x803] = 0x50014;
+    g_msrs[0x80D] = 0x30008;
+
+    handler.enable_register_virtualization();
+    CHECK(handler.read(0x20) == 3);
+    CHECK(handler.read(0x30) == 0x50014);
+    CHECK(handler.read(0xD0) == 0x30008);
+    CHECK(apic_register_virtualization::is_enabled());
+
+    handler.disable();
+    CHECK(!handler.is_enabled());
+    CHECK(virtual_interrupt_delivery::is_disabled());
+    CHECK(apic_register_virtualization::is_disabled());
+}
+
+TEST_CASE("virtual apic: read / write")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.write(0x300, 42);
+    CHECK(handler.read(0x300) == 42);
+    CHECK(handler.page().at(0xC0) == 42);
+
+    CHECK_THROWS(handler.read(0x1000));
+    CHECK_THROWS(handler.read(0x304));
+    CHECK_THROWS(handler.write(0x1000, 0));
+}
+
+TEST_CASE("virtual apic: inject")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.enable();
+
+    CHECK_THROWS(handler.inject(8));
+    CHECK_THROWS(handler.inject(256));
+    CHECK_THROWS(handler.inject(4, 1));
+
+    handler.inject(0x31);
+    CHECK(handler.read(0x210) == (1U << 0x11));
+    CHECK(vmcs_n::guest_interrupt_status::get() == 0x31);
+
+    handler.inject(0x20);
+    CHECK(handler.read(0x210) == ((1U << 0x11) | 1U));
+    CHECK(vmcs_n::guest_interrupt_status::get() == 0x31);
+
+    handler.inject(3, 0x8000000000000001);
+    CHECK(handler.read(0x2C0) == 1U);
+    CHECK(handler.read(0x2F0) == 0x80000000U);
+    CHECK(vmcs_n::guest_interrupt_status::get() == 0xFF);
+
+    CHECK_NOTHROW(handler.inject(2, 0));
+}
+
+TEST_CASE("virtual apic: external interrupt")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+
+    external_interrupt_handler::info_t info = {0x40};
+    CHECK(!handler.handle_external_interrupt(vmcs, info));
+
+    handler.enable();
+    CHECK(handler.handle_external_interrupt(vmcs, info));
+    CHECK(handler.read(0x220) == 1U);
+    CHECK(vmcs_n::guest_interrupt_status::get() == 0x40);
+}
+
+#endif
@@ -52,3 +52,75 @@ TEST_CASE("enable / disable")
     handler.disable();
     CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::is_disabled());
 }
+
+TEST_CASE("ids are released")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    auto handler1 = std::make_unique<vpid_handler>(eapis, &g_eapis_vcpu_global_state);
+    auto handler2 = std::make_unique<vpid_handler>(eapis, &g_eapis_vcpu_global_state);
+
+    auto id = handler1->id();
+    CHECK(handler2->id() != id);
+
+    handler1.reset();
+
+    auto handler3 = vpid_handler(eapis, &g_eapis_vcpu_global_state);
+    CHECK(handler3.id() == id);
+
+    auto handler4 = std::move(handler3);
+    CHECK(handler4.id() == id);
+    CHECK(handler3.id() == 0);
+}
+
+TEST_CASE("allocator: fresh ids")
+{
+    vpid_allocator allocator;
+    bool recycled = true;
+
+    CHECK(allocator.allocate(recycled) == 1);
+    CHECK(!recycled);
+    CHECK(allocator.allocate(recycled) == 2);
+    CHECK(!recycled);
+}
+
+TEST_CASE("allocator: recycled ids")
+{
+    vpid_allocator allocator;
+    bool recycled = false;
+
+    allocator.allocate(recycled);
+    allocator.allocate(recycled);
+    allocator.allocate(recycled);
+
+    allocator.release(1);
+    allocator.release(3);
+
+    CHECK(allocator.allocate(recycled) == 3);
+    CHECK(recycled);
+    CHECK(allocator.allocate(recycled) == 1);
+    CHECK(recycled);
+    CHECK(allocator.allocate(recycled) == 4);
+    CHECK(!recycled);
+
+    CHECK_THROWS(allocator.release(0));
+}
+
+TEST_CASE("allocator: out of ids")
+{
+    auto allocator = std::make_unique<vpid_allocator>();
+    bool recycled = false;
+
+    for (auto i = 1ULL; i < vpid_allocator::max_vpids; i++) {
+        allocator->allocate(recycled);
+    }
+
+    CHECK(allocator->allocate(recycled) == 0);
+
+    allocator->release(42);
+    CHECK(allocator->allocate(recycled) == 42);
+    CHECK(recycled);
+}
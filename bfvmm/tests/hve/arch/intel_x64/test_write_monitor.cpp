@@ -0,0 +1,243 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/write_monitor.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+bool
+test_granted(
+    gsl::not_null<vmcs_t *> vmcs, ept_write_monitor::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    return true;
+}
+
+bool
+test_denied(
+    gsl::not_null<vmcs_t *> vmcs, ept_write_monitor::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    return false;
+}
+
+bool
+test_is_writable(ept::mmap &mm, uint64_t gpa)
+{ return ::intel_x64::ept::pt::entry::write_access::is_enabled(mm.entry(gpa)); }
+
+ept_violation_handler::info_t
+test_write_violation(uint64_t gpa)
+{ return {0, gpa, 2, true}; }
+
+TEST_CASE("write monitor: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(ept_write_monitor(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("write monitor: watch / unwatch")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto monitor = ept_write_monitor(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x1000, 0x1000);
+
+    mocks.ExpectCall(eapis, apis::add_ept_page_violation_handler);
+    monitor.watch(mm, 0x1042, ept_write_monitor::handler_delegate_t::create<test_granted>());
+
+    CHECK(monitor.is_watched(0x1000));
+    CHECK(!test_is_writable(mm, 0x1000));
+
+    mocks.ExpectCall(eapis, apis::remove_ept_page_violation_handlers);
+    monitor.unwatch(0x1000);
+
+    CHECK(!monitor.is_watched(0x1000));
+    CHECK(test_is_writable(mm, 0x1000));
+
+    CHECK_NOTHROW(monitor.unwatch(0x1000));
+}
+
+TEST_CASE("write monitor: watch splits large pages")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto monitor = ept_write_monitor(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    mm.map_2m(0x200000, 0x200000);
+
+    monitor.watch(mm, 0x201000, ept_write_monitor::handler_delegate_t::create<test_granted>());
+
+    CHECK(mm.is_4k(0x201000));
+    CHECK(!test_is_writable(mm, 0x201000));
+    CHECK(test_is_writable(mm, 0x200000));
+    CHECK(test_is_writable(mm, 0x202000));
+
+    monitor.unwatch(0x201000);
+    CHECK(test_is_writable(mm, 0x201000));
+}
+
+TEST_CASE("write monitor: trap, step, re-protect")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto monitor = ept_write_monitor(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x1000, 0x1000);
+    monitor.watch(mm, 0x1000, ept_write_monitor::handler_delegate_t::create<test_granted>());
+
+    auto info = test_write_violation(0x1008);
+
+    mocks.ExpectCall(eapis, apis::enable_monitor_trap_flag);
+    CHECK(monitor.handle_violation(vmcs, info));
+    CHECK(test_is_writable(mm, 0x1000));
+    CHECK(monitor.violations() == 1);
+
+    auto step = monitor_trap_handler::info_t{false};
+
+    CHECK(monitor.handle_step(vmcs, step));
+    CHECK(!test_is_writable(mm, 0x1000));
+    CHECK(monitor.steps() == 1);
+
+    CHECK(!monitor.handle_step(vmcs, step));
+    CHECK(monitor.steps() == 1);
+}
+
+TEST_CASE("write monitor: denied and non-write violations fall through")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto monitor = ept_write_monitor(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x1000, 0x1000);
+    mm.map_4k(0x2000, 0x2000);
+    monitor.watch(mm, 0x1000, ept_write_monitor::handler_delegate_t::create<test_denied>());
+    monitor.watch(mm, 0x2000, ept_write_monitor::handler_delegate_t::create<test_granted>());
+
+    auto info = test_write_violation(0x1000);
+    CHECK(!monitor.handle_violation(vmcs, info));
+    CHECK(!test_is_writable(mm, 0x1000));
+
+    info = test_write_violation(0x2000);
+    info.exit_qualification = 1;
+    CHECK(!monitor.handle_violation(vmcs, info));
+    CHECK(!test_is_writable(mm, 0x2000));
+
+    info = test_write_violation(0x3000);
+    CHECK(!monitor.handle_violation(vmcs, info));
+
+    CHECK(monitor.violations() == 0);
+}
+
+TEST_CASE("write monitor: batching")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto monitor = ept_write_monitor(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x1000, 0x1000);
+    monitor.watch(mm, 0x1000, ept_write_monitor::handler_delegate_t::create<test_granted>());
+    monitor.set_batching(2, 1000);
+
+    auto step = monitor_trap_handler::info_t{false};
+    auto timer = preemption_timer_handler::info_t{0, 0};
+
+    for (auto i = 0; i < 2; i++) {
+        auto info = test_write_violation(0x1000);
+
+        CHECK(monitor.handle_violation(vmcs, info));
+        CHECK(monitor.handle_step(vmcs, step));
+    }
+
+    auto info = test_write_violation(0x1000);
+
+    mocks.ExpectCall(eapis, apis::arm_preemption_deadline).With(1000);
+    mocks.NeverCall(eapis, apis::enable_monitor_trap_flag);
+    CHECK(monitor.handle_violation(vmcs, info));
+    CHECK(test_is_writable(mm, 0x1000));
+
+    CHECK(!monitor.handle_step(vmcs, step));
+    CHECK(test_is_writable(mm, 0x1000));
+
+    CHECK(monitor.handle_timer(vmcs, timer));
+    CHECK(!test_is_writable(mm, 0x1000));
+    CHECK(monitor.windows() == 1);
+
+    CHECK(!monitor.handle_timer(vmcs, timer));
+    CHECK(monitor.violations() == 3);
+    CHECK(monitor.steps() == 2);
+}
+
+TEST_CASE("write monitor: batching disabled")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto monitor = ept_write_monitor(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x1000, 0x1000);
+    monitor.watch(mm, 0x1000, ept_write_monitor::handler_delegate_t::create<test_granted>());
+    monitor.set_batching(1, 0);
+
+    auto step = monitor_trap_handler::info_t{false};
+
+    for (auto i = 0; i < 4; i++) {
+        auto info = test_write_violation(0x1000);
+
+        CHECK(monitor.handle_violation(vmcs, info));
+        CHECK(monitor.handle_step(vmcs, step));
+    }
+
+    CHECK(monitor.steps() == 4);
+    CHECK(monitor.windows() == 0);
+}
+
+#endif
@@ -55,6 +55,19 @@ test_handler_ignore_advance(
     return false;
 }
 
+static uint64_t g_watched_calls = 0;
+
+bool
+test_handler_watched(
+    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    g_watched_calls++;
+    return false;
+}
+
 TEST_CASE("constructor/destruction")
 {
     MockRepository mocks;
@@ -114,6 +127,40 @@ TEST_CASE("enable exiting")
     CHECK_NOTHROW(handler.enable_wrcr3_exiting());
 }
 
+TEST_CASE("enable exiting, vmcs cache")
+{
+    setup_eapis_test_support();
+
+    using namespace vmcs_n;
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+
+    vmcs_field_cache<> cache;
+    handler.set_vmcs_cache(&cache);
+
+    ::intel_x64::vm::write(addr, 0);
+    cache.begin_exit();
+
+    // Once the controls are cached, a direct write would be overwritten
+    // by the next cached read-modify-write
+    //
+
+    handler.vmset_bits(addr, interrupt_window_exiting::mask);
+    handler.enable_rdcr3_exiting();
+    handler.enable_wrcr3_exiting();
+    handler.vmset_bits(addr, monitor_trap_flag::mask);
+
+    cache.end_exit();
+
+    CHECK(interrupt_window_exiting::is_enabled());
+    CHECK(cr3_store_exiting::is_enabled());
+    CHECK(cr3_load_exiting::is_enabled());
+    CHECK(monitor_trap_flag::is_enabled());
+}
+
 TEST_CASE("wrcr0 log")
 {
     MockRepository mocks;
@@ -161,6 +208,84 @@ TEST_CASE("wrcr0 exit")
     CHECK(vmcs_n::cr0_read_shadow::get() == 42);
 }
 
+TEST_CASE("wrcr0 exit, watched bits")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    vmcs_n::guest_cr0::set(0);
+    vmcs_n::cr0_read_shadow::set(0);
+    vmcs_n::cr0_guest_host_mask::set(0);
+
+    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr,
+        0x0000000000000000ULL
+    );
+
+    g_watched_calls = 0;
+    handler.add_wrcr0_handler(
+        0x8, control_register_handler::handler_delegate_t::create<test_handler_watched>()
+    );
+
+    CHECK(handler.cr0_watched() == 0x8);
+    CHECK((vmcs_n::cr0_guest_host_mask::get() & 0x8) != 0);
+
+    g_save_state.rax = 0x8;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_watched_calls == 1);
+    CHECK(vmcs_n::cr0_read_shadow::get() == 0x8);
+
+    g_save_state.rax = 0x28;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_watched_calls == 1);
+    CHECK(vmcs_n::guest_cr0::get() == 0x28);
+
+    handler.enable_wrcr0_exiting(0x20);
+    CHECK(handler.cr0_watched() == 0x28);
+    CHECK((vmcs_n::cr0_guest_host_mask::get() & 0x28) == 0x28);
+    CHECK(vmcs_n::cr0_read_shadow::get() == 0x28);
+
+    g_save_state.rax = 0x20;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_watched_calls == 2);
+}
+
+TEST_CASE("wrcr4 exit, watched bits")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+
+    vmcs_n::guest_cr4::set(0);
+    vmcs_n::cr4_read_shadow::set(0);
+    vmcs_n::cr4_guest_host_mask::set(0);
+
+    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr,
+        0x0000000000000004ULL
+    );
+
+    g_watched_calls = 0;
+    handler.add_wrcr4_handler(
+        0x80, control_register_handler::handler_delegate_t::create<test_handler_watched>()
+    );
+
+    CHECK(handler.cr4_watched() == 0x80);
+
+    g_save_state.rax = 0x200;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_watched_calls == 0);
+
+    g_save_state.rax = 0x280;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_watched_calls == 1);
+}
+
 TEST_CASE("wrcr0 exit, ignore write")
 {
     MockRepository mocks;
@@ -302,6 +427,89 @@ TEST_CASE("wrcr3 exit")
     CHECK(vmcs_n::guest_cr3::get() == 42);
 }
 
+TEST_CASE("wrcr3 exit, cr3 target list")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x485] = 4ULL << 16;
+    vmcs_n::guest_cr3::set(0x1000);
+
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr,
+        0x0000000000000003ULL
+    );
+
+    handler.enable_cr3_target_list();
+    handler.watch_cr3(0x8000);
+
+    for (auto cr3 : {0x2000ULL, 0x3000ULL, 0x8000ULL, 0x4000ULL, 0x5000ULL}) {
+        g_save_state.rax = cr3;
+        CHECK(handler.handle(vmcs));
+    }
+
+    CHECK(handler.cr3_targets().size() == 4);
+    CHECK(handler.cr3_targets()[0] == 0x5000);
+    CHECK(handler.cr3_targets()[3] == 0x2000);
+    CHECK(::intel_x64::vm::read(0x400AU) == 4);
+    CHECK(::intel_x64::vm::read(0x6008U) == 0x5000);
+    CHECK(handler.cr3_exits_avoided() == 0);
+    CHECK(handler.cr3_target_evictions() == 0);
+
+    g_save_state.rax = 0x6000;
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.cr3_target_evictions() == 1);
+    CHECK(handler.cr3_targets()[3] == 0x3000);
+
+    vmcs_n::guest_cr3::set(0x4000);
+    g_save_state.rax = 0x8000;
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.cr3_exits_avoided() == 1);
+    CHECK(handler.cr3_targets()[0] == 0x6000);
+
+    handler.watch_cr3(0x4000);
+    CHECK(handler.cr3_targets().size() == 3);
+
+    handler.disable_cr3_target_list();
+    CHECK(handler.cr3_targets().empty());
+    CHECK(::intel_x64::vm::read(0x400AU) == 0);
+}
+
+TEST_CASE("wrcr3 exit, cr3 target list, exits required")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x485] = 4ULL << 16;
+    vmcs_n::guest_cr3::set(0x1000);
+
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr,
+        0x0000000000000003ULL
+    );
+
+    handler.enable_cr3_target_list();
+
+    g_save_state.rax = 0x2000;
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.cr3_targets().size() == 1);
+
+    handler.require_wrcr3_exits();
+    CHECK(handler.cr3_targets().empty());
+    CHECK(::intel_x64::vm::read(0x400AU) == 0);
+
+    handler.enable_cr3_target_list();
+
+    g_save_state.rax = 0x3000;
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.cr3_targets().empty());
+    CHECK(::intel_x64::vm::read(0x400AU) == 0);
+}
+
 TEST_CASE("wrcr3 exit, ignore write")
 {
     MockRepository mocks;
@@ -69,6 +69,22 @@ test_handler_ignore_advance(
     return true;
 }
 
+uint64_t g_num_cacheable_calls{};
+
+bool
+test_handler_cacheable(
+    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.rax = 42;
+    info.rbx = 42;
+    info.cacheable = true;
+
+    g_num_cacheable_calls++;
+    return true;
+}
+
 TEST_CASE("constructor/destruction")
 {
     MockRepository mocks;
@@ -109,6 +125,88 @@ TEST_CASE("cpuid log")
     CHECK_NOTHROW(handler.dump_log());
 }
 
+TEST_CASE("cpuid log, drain")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.enable_log();
+
+    for (auto i = 0U; i < EAPIS_LOG_MAX + 2; i++) {
+        g_save_state.rax = 42;
+        CHECK(handler.handle(vmcs) == true);
+    }
+
+    auto records = std::vector<cpuid_handler::record_t>(EAPIS_LOG_MAX + 2);
+    auto expected = ndebug ? 0U : EAPIS_LOG_MAX;
+
+    CHECK(handler.drain_log(records) == expected);
+    CHECK(handler.drain_log(records) == 0U);
+}
+
+TEST_CASE("cpuid log, disabled")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.enable_log();
+    handler.disable_log();
+
+    g_save_state.rax = 42;
+    CHECK(handler.handle(vmcs) == true);
+
+    auto records = std::vector<cpuid_handler::record_t>(1);
+    CHECK(handler.drain_log(records) == 0U);
+}
+
+TEST_CASE("cpuid stats")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK(!handler.stats_enabled());
+    handler.enable_stats();
+    CHECK(handler.stats_enabled() == (EAPIS_STATS != 0));
+
+    for (auto i = 0U; i < EAPIS_STATS_SAMPLE_RATE * 2; i++) {
+        g_save_state.rax = 42;
+        CHECK(handler.handle(vmcs) == true);
+    }
+
+    auto records = std::vector<cpuid_handler::record_t>(2);
+    auto expected = EAPIS_STATS != 0 ? 2U : 0U;
+
+    CHECK(handler.drain_log(records) == expected);
+
+    handler.disable_stats();
+    CHECK(!handler.stats_enabled());
+
+    for (auto i = 0U; i < EAPIS_STATS_SAMPLE_RATE * 2; i++) {
+        g_save_state.rax = 42;
+        CHECK(handler.handle(vmcs) == true);
+    }
+
+    CHECK(handler.drain_log(records) == 0U);
+}
+
 TEST_CASE("cpuid exit")
 {
     MockRepository mocks;
@@ -132,6 +230,42 @@ TEST_CASE("cpuid exit")
     CHECK(g_save_state.rdx == 42);
 }
 
+TEST_CASE("cpuid exit, static handlers")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    using handlers_t =
+        static_handlers<cpuid_handler::info_t, test_handler_returns_false, test_handler>;
+
+    CHECK(handlers_t::size() == 2);
+
+    g_save_state.rax = 42;
+    g_save_state.rbx = 0;
+    g_save_state.rcx = 0;
+    g_save_state.rdx = 0;
+
+    handler.add_handler(42, handlers_t::delegate());
+
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rax == 42);
+    CHECK(g_save_state.rbx == 42);
+    CHECK(g_save_state.rcx == 42);
+    CHECK(g_save_state.rdx == 42);
+
+    g_save_state.rax = 42;
+    g_save_state.rbx = 0;
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler_ignore_write>()
+    );
+
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rbx == 0);
+}
+
 TEST_CASE("cpuid exit, ignore write")
 {
     MockRepository mocks;
@@ -177,6 +311,233 @@ TEST_CASE("cpuid exit, ignore advance")
     CHECK(g_save_state.rip == 0);
 }
 
+TEST_CASE("cpuid exit, counters")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    g_save_state.rax = 42;
+    CHECK(handler.handle(vmcs) == true);
+    g_save_state.rax = 42;
+    CHECK(handler.handle(vmcs) == true);
+    g_save_state.rax = 43;
+    CHECK(handler.handle(vmcs) == false);
+
+    CHECK(handler.counters().count(42) == 2);
+    CHECK(handler.counters().count(43) == 1);
+    CHECK(handler.counters().count(44) == 0);
+}
+
+TEST_CASE("cpuid exit, dispatch table")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto table = exit_dispatch_table<>();
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    auto reason = vmcs_n::exit_reason::basic_exit_reason::cpuid;
+    auto d = ::handler_delegate_t::create<cpuid_handler, &cpuid_handler::handle>(&handler);
+
+    CHECK(table.push_front(reason, d) == true);
+
+    g_save_state.rax = 42;
+    CHECK(table.handle(reason, vmcs) == true);
+    g_save_state.rax = 43;
+    CHECK(table.handle(reason, vmcs) == false);
+
+    auto latencies = std::array<exit_latency_t, exit_dispatch_table<>::size()>();
+    table.set_latencies(latencies.data());
+
+    g_save_state.rax = 42;
+    CHECK(table.push_front(reason, d) == false);
+    CHECK(table.handle(reason, vmcs) == true);
+    CHECK(latencies.at(reason).count == 1);
+}
+
+bool
+test_exit(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+    return true;
+}
+
+static std::unique_ptr<uint64_t> g_exit_allocation;
+
+bool
+test_exit_allocates(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+
+    g_exit_allocation = std::make_unique<uint64_t>(42);
+    return true;
+}
+
+TEST_CASE("cpuid exit, allocation tracking")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto table = exit_dispatch_table<>();
+    auto allocs = std::array<exit_allocs_t, exit_dispatch_table<>::size()>();
+
+    auto reason = vmcs_n::exit_reason::basic_exit_reason::cpuid;
+    auto other = vmcs_n::exit_reason::basic_exit_reason::rdtsc;
+
+    table.push_front(reason, ::handler_delegate_t::create<test_exit>());
+    table.push_front(other, ::handler_delegate_t::create<test_exit_allocates>());
+    table.set_allocs(allocs.data());
+
+    CHECK(count_allocations([&] { table.handle(reason, vmcs); }) == 0);
+    CHECK(table.handle(other, vmcs));
+
+    CHECK(allocs.at(reason).exits == 1);
+    CHECK(allocs.at(reason).allocations == 0);
+    CHECK(allocs.at(other).exits == 1);
+    CHECK(allocs.at(other).allocating_exits == 1);
+    CHECK(allocs.at(other).allocations >= 1);
+    CHECK(allocs.at(other).max == allocs.at(other).allocations);
+
+    table.set_allocs(allocs.data(), true);
+    CHECK_NOTHROW(table.handle(reason, vmcs));
+    CHECK_THROWS(table.handle(other, vmcs));
+
+    table.set_allocs(nullptr);
+    CHECK_NOTHROW(table.handle(other, vmcs));
+    CHECK(allocs.at(other).exits == 2);
+}
+
+TEST_CASE("cpuid exit, profiler")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto table = exit_dispatch_table<>();
+    auto profiler = exit_profiler<>(2);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    auto reason = vmcs_n::exit_reason::basic_exit_reason::cpuid;
+    auto d = ::handler_delegate_t::create<cpuid_handler, &cpuid_handler::handle>(&handler);
+
+    table.push_front(reason, d);
+    table.set_profiler(&profiler);
+
+    g_save_state.rax = 42;
+    vmcs_n::guest_cr3::set(0x1000);
+
+    for (auto i = 0U; i < 6; i++) {
+        g_save_state.rip = (i < 4) ? 0x100 : 0x200;
+        CHECK(table.handle(reason, vmcs));
+    }
+
+    CHECK(profiler.exits() == 6);
+    CHECK(profiler.taken() == 3);
+
+    auto top = profiler.top(1);
+    REQUIRE(top.size() == 1);
+    CHECK(top[0].sample.reason == reason);
+    CHECK(top[0].sample.rip == 0x100);
+    CHECK(top[0].sample.cr3 == 0x1000);
+    CHECK(top[0].count == 2);
+    CHECK(profiler.top(10).size() == 2);
+
+    std::array<exit_profiler<>::sample_t, 4> samples{};
+    CHECK(profiler.drain(samples) == 3);
+    CHECK(profiler.size() == 0);
+    CHECK(profiler.top(10).empty());
+
+    CHECK_THROWS(profiler.set_rate(0));
+
+    table.set_profiler(nullptr);
+    CHECK(table.handle(reason, vmcs));
+    CHECK(profiler.exits() == 6);
+}
+
+TEST_CASE("cpuid exit, export")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto table = exit_dispatch_table<>();
+    auto exp = exit_export(exit_dispatch_table<>::size(), 1);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    auto reason = vmcs_n::exit_reason::basic_exit_reason::cpuid;
+    auto d = ::handler_delegate_t::create<cpuid_handler, &cpuid_handler::handle>(&handler);
+
+    table.push_front(reason, d);
+    table.set_export(&exp);
+
+    g_save_state.rax = 42;
+    vmcs_n::guest_cr3::set(0x1000);
+
+    auto &ring = exp.ring();
+    auto capacity = ring.capacity();
+
+    CHECK(capacity == 0x1000 / sizeof(exit_export::record_t));
+    CHECK(ring.header()->magic == shared_ring_magic);
+    CHECK(ring.header()->record_size == sizeof(exit_export::record_t));
+    CHECK(ring.header()->num_pages == 1);
+    CHECK(ring.header()->pages[0] != 0);
+    CHECK(ring.header_phys() != 0);
+
+    for (auto i = 0ULL; i < capacity + 2; i++) {
+        g_save_state.rip = i;
+        CHECK(table.handle(reason, vmcs));
+    }
+
+    CHECK(ring.pushed() == capacity + 2);
+    CHECK(ring.header()->head == capacity + 2);
+    CHECK(ring.header()->claim == capacity + 2);
+    CHECK(ring.at(0).rip == capacity);
+    CHECK(ring.at(capacity + 1).rip == capacity + 1);
+    CHECK(ring.at(2).reason == reason);
+    CHECK(ring.at(2).cr3 == 0x1000);
+
+    auto counters = exp.counters().page();
+    CHECK(counters->magic == shared_counters_magic);
+    CHECK(counters->num_counters == exit_dispatch_table<>::size());
+    CHECK(std::string(counters->counters[reason].name) == "exit " + std::to_string(reason));
+    CHECK(counters->counters[reason].value == capacity + 2);
+    CHECK(counters->counters[0].value == 0);
+
+    auto &mine = exp.counters().add("my counter");
+    mine = 42;
+    CHECK(exp.counters().find("my counter") == &mine);
+    CHECK(exp.counters().find("missing") == nullptr);
+    CHECK(counters->num_counters == exit_dispatch_table<>::size() + 1);
+
+    while (exp.counters().size() < shared_counters::max_counters) {
+        exp.counters().add("filler");
+    }
+
+    CHECK_THROWS(exp.counters().add("full"));
+
+    table.set_export(nullptr);
+    CHECK(table.handle(reason, vmcs));
+    CHECK(ring.pushed() == capacity + 2);
+
+    CHECK_THROWS(shared_ring<exit_export::record_t>(0));
+    CHECK_THROWS(shared_ring<exit_export::record_t>(shared_ring_max_pages + 1));
+}
+
 TEST_CASE("cpuid exit, no handler")
 {
     MockRepository mocks;
@@ -204,4 +565,181 @@ TEST_CASE("cpuid exit, returns false")
     CHECK(handler.handle(vmcs) == false);
 }
 
+TEST_CASE("cpuid exit, cacheable")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler_cacheable>()
+    );
+
+    g_num_cacheable_calls = 0;
+
+    for (auto i = 0; i < 3; i++) {
+        g_save_state.rax = 42;
+        g_save_state.rbx = 0;
+        g_save_state.rcx = 0;
+
+        CHECK(handler.handle(vmcs) == true);
+        CHECK(g_save_state.rax == 42);
+        CHECK(g_save_state.rbx == 42);
+    }
+
+    CHECK(g_num_cacheable_calls == 1);
+    CHECK(handler.cache_hits() == 2);
+
+    g_save_state.rax = 42;
+    g_save_state.rcx = 1;
+
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_num_cacheable_calls == 2);
+
+    handler.invalidate_cache();
+
+    g_save_state.rax = 42;
+    g_save_state.rcx = 0;
+
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_num_cacheable_calls == 3);
+}
+
+TEST_CASE("cpuid exit, cacheable, handlers added and removed")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler_cacheable>()
+    );
+
+    g_num_cacheable_calls = 0;
+
+    g_save_state.rax = 42;
+    g_save_state.rbx = 0;
+    g_save_state.rcx = 0;
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rbx == 42);
+    CHECK(g_num_cacheable_calls == 1);
+
+    handler.add_handler(
+        42, cpuid_handler::handler_delegate_t::create<test_handler_ignore_write>()
+    );
+
+    g_save_state.rax = 42;
+    g_save_state.rbx = 0;
+    g_save_state.rcx = 0;
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rbx == 0);
+    CHECK(handler.cache_hits() == 0);
+
+    g_save_state.rax = 42;
+    g_save_state.rcx = 1;
+    handler.add_handler(
+        42, 1, cpuid_handler::handler_delegate_t::create<test_handler_cacheable>()
+    );
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_num_cacheable_calls == 2);
+
+    CHECK(handler.remove_handlers(42));
+    CHECK_FALSE(handler.remove_handlers(42));
+
+    g_save_state.rax = 42;
+    g_save_state.rcx = 1;
+    CHECK(handler.handle(vmcs) == false);
+    CHECK(handler.cache_hits() == 0);
+
+    handler.add_handler(
+        0x40000000, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+    CHECK(handler.remove_handlers(0x40000000));
+
+    g_save_state.rax = 0x40000000;
+    g_save_state.rcx = 0;
+    CHECK(handler.handle(vmcs) == false);
+}
+
+TEST_CASE("cpuid exit, subleaf")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_THROWS(
+        handler.add_handler(
+            7, 0x100, cpuid_handler::handler_delegate_t::create<test_handler>()
+        )
+    );
+
+    handler.add_handler(
+        7, 1, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.add_handler(
+        0x80000008, 2, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    g_save_state.rax = 7;
+    g_save_state.rcx = 0;
+    CHECK(handler.handle(vmcs) == false);
+
+    g_save_state.rax = 7;
+    g_save_state.rbx = 0;
+    g_save_state.rcx = 1;
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rbx == 42);
+
+    g_save_state.rax = 7;
+    g_save_state.rcx = 2;
+    CHECK(handler.handle(vmcs) == false);
+
+    handler.add_handler(
+        7, cpuid_handler::handler_delegate_t::create<test_handler_ignore_write>()
+    );
+
+    g_save_state.rax = 7;
+    g_save_state.rbx = 0;
+    g_save_state.rcx = 2;
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rbx == 0);
+
+    g_save_state.rax = 0x80000008;
+    g_save_state.rbx = 0;
+    g_save_state.rcx = 2;
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rbx == 42);
+
+    g_save_state.rax = 0x40000000;
+    g_save_state.rcx = 0;
+    CHECK(handler.handle(vmcs) == false);
+}
+
+TEST_CASE("cpuid exit, memory usage")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+
+    bfignored(vmcs);
+
+    memory_usage_t before{};
+    handler.memory_usage(before);
+    CHECK(before.logs > 0);
+
+    handler.add_handler(
+        7, 1, cpuid_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    memory_usage_t after{};
+    handler.memory_usage(after);
+    CHECK(after.logs == before.logs);
+    CHECK(after.handlers > before.handlers);
+}
+
 #endif
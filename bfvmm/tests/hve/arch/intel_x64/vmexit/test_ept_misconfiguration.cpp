@@ -22,6 +22,7 @@
 
 #include <test/support.h>
 #include <hve/arch/intel_x64/vmexit/ept_misconfiguration.h>
+#include <hve/arch/intel_x64/vmexit/ept_violation.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
@@ -166,4 +167,71 @@ TEST_CASE("ept misconfiguration exit, returns false")
     CHECK_THROWS(handler.handle(vmcs));
 }
 
+bool
+test_mmio_handler(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::mmio_info_t &info)
+{
+    bfignored(vmcs);
+
+    if (!info.write) {
+        info.val = 0x12345678;
+    }
+
+    return true;
+}
+
+TEST_CASE("ept misconfiguration exit, mmio fast path")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto violation = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto handler = ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state);
+
+    violation.add_mmio_handler(
+        0xFEE00000, 0xFEE00FFF,
+        ept_violation_handler::mmio_delegate_t::create<test_mmio_handler>()
+    );
+
+    using mmio_delegate_t = ept_misconfiguration_handler::mmio_delegate_t;
+
+    handler.set_mmio_handler(
+        mmio_delegate_t::create<ept_violation_handler, &ept_violation_handler::emulate_mmio>(&violation)
+    );
+
+    // mov eax, [rbx]
+    mocks.OnCallFunc(insn_decoder::read_guest).Do([](uint64_t rip, uint64_t cr3, gsl::span<uint8_t> bytes) {
+        bfignored(rip);
+        bfignored(cr3);
+
+        bytes[0] = 0x8B;
+        bytes[1] = 0x03;
+    });
+
+    g_save_state.rip = 0x401000;
+    g_save_state.rax = 0;
+
+    ::intel_x64::vm::write(
+        vmcs_n::vm_entry_controls::addr, vmcs_n::vm_entry_controls::ia_32e_mode_guest::mask);
+    ::intel_x64::vm::write(
+        vmcs_n::guest_cs_access_rights::addr, vmcs_n::guest_cs_access_rights::l::mask);
+    ::intel_x64::vm::write(vmcs_n::guest_cr3::addr, 0x1000);
+    ::intel_x64::vm::write(vmcs_n::guest_physical_address::addr, 0xFEE00030);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rax == 0x12345678);
+    CHECK(g_save_state.rip == 0x401002);
+
+    ::intel_x64::vm::write(vmcs_n::guest_physical_address::addr, 0xFEC00000);
+    CHECK_THROWS(handler.handle(vmcs));
+
+    handler.add_handler(
+        ept_misconfiguration_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK(handler.handle(vmcs));
+}
+
 #endif
@@ -380,5 +380,511 @@ TEST_CASE("ept violation exit, invalid qualification")
     CHECK_THROWS(handler.handle(vmcs));
 }
 
+uint64_t g_page_calls{};
+uint64_t g_global_calls{};
+
+bool
+test_page_handler(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+{
+    bfignored(info);
+    bfignored(vmcs);
+
+    g_page_calls++;
+    return true;
+}
+
+bool
+test_global_handler(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+{
+    bfignored(info);
+    bfignored(vmcs);
+
+    g_global_calls++;
+    return true;
+}
+
+static void
+setup_violation(uint64_t gpa, uint64_t qual)
+{
+    ::intel_x64::vm::write(vmcs_n::guest_physical_address::addr, gpa);
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qual);
+}
+
+TEST_CASE("page handlers")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_THROWS(
+        handler.add_page_handler(
+            0x1000, 0, ept_violation_handler::handler_delegate_t::create<test_page_handler>()
+        )
+    );
+
+    handler.add_page_handler(
+        0x1000, ept_violation_handler::access_write,
+        ept_violation_handler::handler_delegate_t::create<test_page_handler>()
+    );
+
+    handler.add_write_handler(
+        ept_violation_handler::handler_delegate_t::create<test_global_handler>()
+    );
+
+    g_page_calls = 0;
+    g_global_calls = 0;
+
+    setup_violation(0x1FF8, 2);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_page_calls == 1);
+    CHECK(g_global_calls == 0);
+
+    setup_violation(0x2000, 2);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_page_calls == 1);
+    CHECK(g_global_calls == 1);
+
+    setup_violation(0x1000, 1);
+    CHECK_THROWS(handler.handle(vmcs));
+
+    CHECK(handler.remove_page_handlers(0x1000));
+    CHECK(!handler.remove_page_handlers(0x1000));
+
+    setup_violation(0x1000, 2);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_page_calls == 1);
+    CHECK(g_global_calls == 2);
+}
+
+TEST_CASE("page handlers, fall through")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_page_handler(
+        0x1000, ept_violation_handler::access_read | ept_violation_handler::access_execute,
+        ept_violation_handler::handler_delegate_t::create<test_handler_returns_false>()
+    );
+
+    handler.add_execute_handler(
+        ept_violation_handler::handler_delegate_t::create<test_global_handler>()
+    );
+
+    g_global_calls = 0;
+
+    setup_violation(0x1000, 4);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_global_calls == 1);
+
+    setup_violation(0x1000, 1);
+    CHECK_THROWS(handler.handle(vmcs));
+}
+
+TEST_CASE("range handlers")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto d = ept_violation_handler::handler_delegate_t::create<test_page_handler>();
+
+    CHECK_NOTHROW(handler.add_range_handler(0x10000, 0x1FFFF, ept_violation_handler::access_read, d));
+    CHECK_NOTHROW(handler.add_range_handler(0x10000, 0x1FFFF, ept_violation_handler::access_write, d));
+    CHECK_THROWS(handler.add_range_handler(0x18000, 0x2FFFF, ept_violation_handler::access_read, d));
+    CHECK_THROWS(handler.add_range_handler(0x00000, 0x10000, ept_violation_handler::access_read, d));
+    CHECK_THROWS(handler.add_range_handler(0x2FFFF, 0x20000, ept_violation_handler::access_read, d));
+    CHECK_THROWS(handler.add_range_handler(0x20000, 0x2FFFF, 0, d));
+
+    g_page_calls = 0;
+
+    setup_violation(0x10000, 1);
+    CHECK(handler.handle(vmcs));
+    setup_violation(0x1FFFF, 2);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_page_calls == 2);
+
+    setup_violation(0x20000, 1);
+    CHECK_THROWS(handler.handle(vmcs));
+
+    CHECK(handler.remove_range_handlers(0x10000));
+    CHECK(!handler.remove_range_handlers(0x10000));
+
+    setup_violation(0x10000, 1);
+    CHECK_THROWS(handler.handle(vmcs));
+}
+
+bool
+test_mmio_handler(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::mmio_info_t &info)
+{
+    bfignored(vmcs);
+
+    if (!info.write) {
+        info.val = 0xFFFFFFFF12345678;
+    }
+
+    return info.gpa != 0xFEE00FF0;
+}
+
+// The instruction the guest is executing (see insn_decoder::read_guest)
+static std::array<uint8_t, 15> g_insn{};
+
+static void
+setup_insn(MockRepository &mocks, const std::array<uint8_t, 15> &insn)
+{
+    g_insn = insn;
+
+    mocks.OnCallFunc(insn_decoder::read_guest).Do([](uint64_t rip, uint64_t cr3, gsl::span<uint8_t> bytes) {
+        bfignored(rip);
+        bfignored(cr3);
+
+        std::copy(g_insn.begin(), g_insn.begin() + bytes.size(), bytes.begin());
+    });
+}
+
+static void
+setup_mmio_exit(uint64_t gpa, uint64_t qual)
+{
+    g_save_state.rip = 0x401000;
+
+    ::intel_x64::vm::write(
+        vmcs_n::vm_entry_controls::addr, vmcs_n::vm_entry_controls::ia_32e_mode_guest::mask);
+    ::intel_x64::vm::write(
+        vmcs_n::guest_cs_access_rights::addr, vmcs_n::guest_cs_access_rights::l::mask);
+    ::intel_x64::vm::write(vmcs_n::guest_cr3::addr, 0x1000);
+    ::intel_x64::vm::write(vmcs_n::guest_physical_address::addr, gpa);
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qual);
+}
+
+TEST_CASE("mmio handlers, add / remove")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto d = ept_violation_handler::mmio_delegate_t::create<test_mmio_handler>();
+
+    CHECK(handler.decoder() == nullptr);
+    CHECK_NOTHROW(handler.add_mmio_handler(0xFEE00000, 0xFEE00FFF, d));
+    CHECK(handler.decoder() != nullptr);
+
+    CHECK_NOTHROW(handler.add_mmio_handler(0xFEC00000, 0xFEC00FFF, d));
+    CHECK_THROWS(handler.add_mmio_handler(0xFEE00800, 0xFEE01FFF, d));
+    CHECK_THROWS(handler.add_mmio_handler(0xFED00000, 0xFEE00000, d));
+    CHECK_THROWS(handler.add_mmio_handler(0xFEE00FFF, 0xFEE00000, d));
+
+    CHECK(handler.remove_mmio_handler(0xFEE00000));
+    CHECK(!handler.remove_mmio_handler(0xFEE00000));
+    CHECK_NOTHROW(handler.add_mmio_handler(0xFEE00800, 0xFEE01FFF, d));
+}
+
+TEST_CASE("mmio handlers, load")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_mmio_handler(
+        0xFEE00000, 0xFEE00FFF,
+        ept_violation_handler::mmio_delegate_t::create<test_mmio_handler>()
+    );
+
+    // mov eax, [rbx]
+    setup_insn(mocks, {0x8B, 0x03});
+
+    setup_mmio_exit(0xFEE00030, 1);
+    g_save_state.rax = 0xFFFFFFFFFFFFFFFF;
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rax == 0x12345678);
+    CHECK(g_save_state.rip == 0x401002);
+
+    setup_mmio_exit(0xFEE00030, 1);
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.decoder()->cache().hits() == 1);
+
+    // The code at RIP was rewritten to mov ecx, [rbx]
+    g_insn.at(1) = 0x0B;
+
+    setup_mmio_exit(0xFEE00030, 1);
+    g_save_state.rcx = 0xFFFFFFFFFFFFFFFF;
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rcx == 0x12345678);
+    CHECK(handler.decoder()->cache().hits() == 1);
+}
+
+TEST_CASE("mmio handlers, store")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_mmio_handler(
+        0xFEE00000, 0xFEE00FFF,
+        ept_violation_handler::mmio_delegate_t::create<test_mmio_handler>()
+    );
+
+    // mov dword [rax], 1
+    setup_insn(mocks, {0xC7, 0x00, 0x01, 0x00, 0x00, 0x00});
+
+    setup_mmio_exit(0xFEE000B0, 2);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0x401006);
+}
+
+TEST_CASE("mmio handlers, fall through")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_mmio_handler(
+        0xFEE00000, 0xFEE00FFF,
+        ept_violation_handler::mmio_delegate_t::create<test_mmio_handler>()
+    );
+
+    // mov dword [rax], 1
+    setup_insn(mocks, {0xC7, 0x00, 0x01, 0x00, 0x00, 0x00});
+
+    // No read handler registered, so the access must not be emulated
+    setup_mmio_exit(0xFEE00FF0, 1);
+    CHECK_THROWS(handler.handle(vmcs));
+
+    handler.add_read_handler(
+        ept_violation_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    setup_mmio_exit(0xFED00000, 1);
+    CHECK(handler.handle(vmcs));
+}
+
+std::vector<coalesced_write_t> g_coalesced;
+
+void
+test_flush_handler(gsl::span<const coalesced_write_t> writes)
+{ g_coalesced.insert(g_coalesced.end(), writes.begin(), writes.end()); }
+
+TEST_CASE("mmio handlers, coalesced")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto d = ept_violation_handler::mmio_delegate_t::create<test_mmio_handler>();
+
+    CHECK_THROWS(handler.add_coalesced_mmio_handler(0xFEE00000, 0xFEE00FFF, d));
+
+    auto coalesced = coalesced_ring<>();
+    handler.set_coalesced_ring(&coalesced);
+    CHECK_THROWS(handler.add_coalesced_mmio_handler(0xFEE00000, 0xFEE00FFF, d));
+
+    coalesced.set_flush_handler(
+        coalesced_ring<>::flush_delegate_t::create<test_flush_handler>()
+    );
+
+    CHECK_NOTHROW(handler.add_coalesced_mmio_handler(0xFEE00000, 0xFEE00FFF, d));
+    g_coalesced.clear();
+
+    // mov dword [rax], 1
+    setup_insn(mocks, {0xC7, 0x00, 0x01, 0x00, 0x00, 0x00});
+
+    setup_mmio_exit(0xFEE000B0, 2);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0x401006);
+
+    setup_mmio_exit(0xFEE000C0, 2);
+    CHECK(handler.handle(vmcs));
+
+    CHECK(coalesced.size() == 2);
+    CHECK(g_coalesced.empty());
+
+    // mov eax, [rbx]
+    g_insn = {0x8B, 0x03};
+
+    setup_mmio_exit(0xFEE00030, 1);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rax == 0x12345678);
+
+    CHECK(coalesced.size() == 0);
+    CHECK(coalesced.flushes() == 1);
+    REQUIRE(g_coalesced.size() == 2);
+    CHECK(g_coalesced.at(0).addr == 0xFEE000B0);
+    CHECK(g_coalesced.at(0).val == 1);
+    CHECK(g_coalesced.at(0).size == 4);
+    CHECK(g_coalesced.at(0).mmio == 1);
+    CHECK(g_coalesced.at(1).addr == 0xFEE000C0);
+}
+
+TEST_CASE("coalesced ring, flushes when full")
+{
+    auto ring = coalesced_ring<2>();
+    ring.set_flush_handler(
+        coalesced_ring<2>::flush_delegate_t::create<test_flush_handler>()
+    );
+
+    g_coalesced.clear();
+    ring.flush();
+    CHECK(ring.flushes() == 0);
+
+    ring.push({0xE9, 'a', 1, 0});
+    ring.push({0xE9, 'b', 1, 0});
+    CHECK(g_coalesced.empty());
+
+    ring.push({0xE9, 'c', 1, 0});
+    CHECK(g_coalesced.size() == 2);
+    CHECK(ring.size() == 1);
+
+    ring.flush();
+    CHECK(g_coalesced.size() == 3);
+    CHECK(g_coalesced.at(2).val == 'c');
+    CHECK(ring.pushes() == 3);
+    CHECK(ring.flushes() == 2);
+}
+
+std::vector<uint64_t> g_woken;
+
+void
+test_wake_handler(uint64_t bit)
+{ g_woken.push_back(bit); }
+
+TEST_CASE("doorbells")
+{
+    auto doorbells = doorbell_bitmap<128>();
+    doorbells.set_wake_handler(
+        doorbell_bitmap<128>::wake_delegate_t::create<test_wake_handler>()
+    );
+
+    auto table = doorbell_table();
+    table.add(0xC050, 1, 1);
+    table.add(0xC050, 2, 2);
+    table.add(0xC050, doorbell_table::any_value, 3);
+    table.add(0xC060, 0, 70);
+
+    uint64_t bit = 0;
+    CHECK(table.contains(0xC050));
+    CHECK(!table.contains(0xC058));
+    CHECK(table.find(0xC050, 2, bit));
+    CHECK(bit == 2);
+    CHECK(table.find(0xC050, 42, bit));
+    CHECK(bit == 3);
+    CHECK(!table.find(0xC060, 1, bit));
+    CHECK(table.find(0xC060, 0, bit));
+    CHECK(bit == 70);
+
+    g_woken.clear();
+    CHECK(doorbells.ring(70));
+    CHECK(!doorbells.ring(70));
+    CHECK(doorbells.ring(3));
+    CHECK(doorbells.is_pending(70));
+    CHECK(!doorbells.is_pending(2));
+    CHECK(g_woken.size() == 2);
+    CHECK(doorbells.rings() == 3);
+    CHECK(doorbells.wakes() == 2);
+
+    std::vector<uint64_t> drained;
+    CHECK(doorbells.drain([&](uint64_t b) { drained.push_back(b); }) == 2);
+    CHECK(drained == std::vector<uint64_t>({3, 70}));
+    CHECK(!doorbells.is_pending(70));
+    CHECK(doorbells.drain([&](uint64_t b) { drained.push_back(b); }) == 0);
+}
+
+TEST_CASE("mmio doorbells")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto doorbells = doorbell_bitmap<>();
+    CHECK_THROWS(handler.add_doorbell(0xFEB00000, 1, 1));
+
+    handler.set_doorbells(&doorbells);
+    CHECK_THROWS(handler.add_doorbell(0xFEB00000, 1, doorbell_bitmap<>::size()));
+    CHECK_NOTHROW(handler.add_doorbell(0xFEB00000, 1, 5));
+
+    // mov dword [rax], 1
+    setup_insn(mocks, {0xC7, 0x00, 0x01, 0x00, 0x00, 0x00});
+
+    setup_mmio_exit(0xFEB00000, 2);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0x401006);
+    CHECK(doorbells.is_pending(5));
+
+    // A read, or a store of another value, is not a doorbell
+    setup_mmio_exit(0xFEB00000, 1);
+    CHECK_THROWS(handler.handle(vmcs));
+
+    handler.add_doorbell(0xFEB00010, 2, 6);
+    setup_mmio_exit(0xFEB00010, 2);
+    CHECK_THROWS(handler.handle(vmcs));
+    CHECK(!doorbells.is_pending(6));
+}
+
+bool
+test_spp_handler(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::spp_info_t &info)
+{
+    bfignored(vmcs);
+    return !info.misconfiguration;
+}
+
+TEST_CASE("spp event exit")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, 1ULL << 11);
+    CHECK_THROWS(handler.handle_spp(vmcs));
+
+    handler.add_spp_handler(
+        ept_violation_handler::spp_delegate_t::create<test_spp_handler>()
+    );
+
+    mocks.ExpectCall(eapis, apis::invalidate_ept);
+    CHECK(handler.handle_spp(vmcs));
+
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, 0);
+    CHECK_THROWS(handler.handle_spp(vmcs));
+}
+
+TEST_CASE("sub-page violation")
+{
+    auto info = ept_violation_handler::info_t{0, 0x1000, 2, false};
+    CHECK(!ept_violation_handler::is_sub_page_violation(info));
+
+    info.exit_qualification |= 1ULL << 11;
+    CHECK(ept_violation_handler::is_sub_page_violation(info));
+}
 
 #endif
@@ -45,6 +45,19 @@ test_handler_returns_false(
     return false;
 }
 
+uint64_t g_high_priority_calls = 0;
+
+bool
+test_handler_high_priority(
+    gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info)
+{
+    bfignored(info);
+    bfignored(vmcs);
+
+    g_high_priority_calls++;
+    return false;
+}
+
 TEST_CASE("constructor/destruction")
 {
     MockRepository mocks;
@@ -151,4 +164,113 @@ TEST_CASE("external interrupt exit, returns false")
     CHECK_THROWS(handler.handle(vmcs));
 }
 
+TEST_CASE("external interrupt exit, priority")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        external_interrupt_handler::handler_delegate_t::create<test_handler>(), 1
+    );
+
+    for (auto i = 0; i < 5; i++) {
+        handler.add_handler(
+            external_interrupt_handler::handler_delegate_t::create<test_handler_returns_false>()
+        );
+    }
+
+    CHECK(handler.handle(vmcs) == true);
+}
+
+TEST_CASE("external interrupt exit, adaptive reordering")
+{
+    using delegate_t = external_interrupt_handler::handler_delegate_t;
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    external_interrupt_handler::info_t info = {0};
+
+    delegate_chain<delegate_t, 2> chain;
+    chain.push_front(delegate_t::create<test_handler>());
+    chain.push_front(delegate_t::create<test_handler_returns_false>());
+    chain.push_front(delegate_t::create<test_handler_returns_false>());
+    chain.push_front(delegate_t::create<test_handler_high_priority>(), 1);
+
+    // Nothing is counted until adaptive reordering is enabled
+    //
+
+    CHECK(chain.dispatch(vmcs, info));
+    CHECK(chain.hits(3) == 0);
+
+    adaptive_dispatch::enable(4);
+    g_high_priority_calls = 0;
+
+    for (auto i = 0; i < 3; i++) {
+        CHECK(chain.dispatch(vmcs, info));
+    }
+
+    CHECK(chain.hits(3) == 3);
+    CHECK(chain.reorders() == 0);
+
+    // On the 4th accepted exit, the accepting delegate moves to the front
+    // of its priority class, but not past the higher priority delegate
+    //
+
+    CHECK(chain.dispatch(vmcs, info));
+    CHECK(chain.reorders() == 1);
+    CHECK(chain.hits(1) == 2);
+    CHECK(chain.hits(0) == 0);
+    CHECK(chain.hits(3) == 0);
+    CHECK(g_high_priority_calls == 4);
+
+    // An order that is already right is not changed again
+    //
+
+    for (auto i = 0; i < 4; i++) {
+        CHECK(chain.dispatch(vmcs, info));
+    }
+
+    CHECK(chain.reorders() == 1);
+    CHECK(g_high_priority_calls == 8);
+
+    adaptive_dispatch::disable();
+
+    auto hits = chain.hits(1);
+    CHECK(chain.dispatch(vmcs, info));
+    CHECK(chain.hits(1) == hits);
+}
+
+TEST_CASE("external interrupt exit, adaptive handler")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        external_interrupt_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    for (auto i = 0; i < 5; i++) {
+        handler.add_handler(
+            external_interrupt_handler::handler_delegate_t::create<test_handler_returns_false>()
+        );
+    }
+
+    adaptive_dispatch::enable(2);
+
+    for (auto i = 0; i < 8; i++) {
+        CHECK(handler.handle(vmcs));
+    }
+
+    adaptive_dispatch::disable();
+    CHECK(adaptive_dispatch::period() == 0);
+}
+
 #endif
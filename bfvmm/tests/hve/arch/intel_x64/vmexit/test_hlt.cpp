@@ -0,0 +1,238 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/hlt.h>
+#include <hve/arch/intel_x64/vmexit/interrupt_window.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+constexpr const uint64_t hlt_exiting = 1ULL << 7;
+constexpr const auto x2apic_irr1_msr = 0x821U;
+constexpr const auto apic_base_msr = 0x1BU;
+constexpr const uint64_t apic_base_x2apic_mode = 1ULL << 10;
+
+static void
+reset_guest()
+{
+    using namespace vmcs_n;
+
+    guest_rflags::interrupt_enable_flag::enable();
+    guest_interruptibility_state::blocking_by_sti::disable();
+    guest_interruptibility_state::blocking_by_mov_ss::disable();
+    guest_activity_state::set(guest_activity_state::active);
+    vm_entry_interruption_information::set(0);
+
+    g_msrs[x2apic_irr1_msr] = 0;
+    g_msrs[apic_base_msr] = apic_base_x2apic_mode;
+    g_save_state.rip = 0x10;
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 1);
+}
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, hlt_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    return true;
+}
+
+TEST_CASE("hlt: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(hlt_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("hlt: enable / disable exiting")
+{
+    using namespace vmcs_n;
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = hlt_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.enable_exiting();
+    CHECK((primary_processor_based_vm_execution_controls::get() & hlt_exiting) != 0);
+
+    handler.disable_exiting();
+    CHECK((primary_processor_based_vm_execution_controls::get() & hlt_exiting) == 0);
+}
+
+TEST_CASE("hlt: enable / disable exiting, vmcs cache")
+{
+    using namespace vmcs_n;
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = hlt_handler(eapis, &g_eapis_vcpu_global_state);
+
+    vmcs_field_cache<> cache;
+    handler.set_vmcs_cache(&cache);
+
+    // Outside of an exit, the writes reach the VMCS right away, and are
+    // not dropped by the next exit
+    //
+
+    handler.enable_exiting();
+    CHECK((primary_processor_based_vm_execution_controls::get() & hlt_exiting) != 0);
+
+    cache.begin_exit();
+    cache.end_exit();
+    CHECK((primary_processor_based_vm_execution_controls::get() & hlt_exiting) != 0);
+
+    primary_processor_based_vm_execution_controls::set(0);
+    handler.enable_exiting();
+    CHECK((primary_processor_based_vm_execution_controls::get() & hlt_exiting) != 0);
+    CHECK(cache.reads() == 0);
+    CHECK(cache.writes() == 0);
+
+    // During an exit, they are buffered until the exit ends
+    //
+
+    cache.begin_exit();
+    handler.disable_exiting();
+    CHECK((primary_processor_based_vm_execution_controls::get() & hlt_exiting) != 0);
+
+    cache.end_exit();
+    CHECK((primary_processor_based_vm_execution_controls::get() & hlt_exiting) == 0);
+}
+
+TEST_CASE("hlt: handler")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = hlt_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        hlt_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    reset_guest();
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0x11);
+    CHECK(vmcs_n::guest_activity_state::get() == vmcs_n::guest_activity_state::active);
+    CHECK(handler.blocks() == 0);
+}
+
+TEST_CASE("hlt: pending interrupt")
+{
+    using namespace vmcs_n;
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = hlt_handler(eapis, &g_eapis_vcpu_global_state);
+    auto window = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.set_interrupt_window(&window);
+
+    reset_guest();
+    guest_rflags::interrupt_enable_flag::disable();
+    window.queue(0x30);
+    CHECK(window.num_pending() == 1);
+
+    guest_rflags::interrupt_enable_flag::enable();
+    CHECK(handler.handle(vmcs));
+    CHECK(window.num_pending() == 0);
+    CHECK(vm_entry_interruption_information::valid_bit::is_enabled());
+    CHECK(guest_activity_state::get() == guest_activity_state::active);
+    CHECK(g_save_state.rip == 0x11);
+}
+
+TEST_CASE("hlt: adaptive polling")
+{
+    using namespace vmcs_n;
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = hlt_handler(eapis, &g_eapis_vcpu_global_state);
+
+    reset_guest();
+    CHECK(handler.handle(vmcs));
+    CHECK(guest_activity_state::get() == guest_activity_state::hlt);
+    CHECK(handler.blocks() == 1);
+    CHECK(handler.poll_window() == hlt_handler::default_poll_start);
+
+    reset_guest();
+    g_msrs[x2apic_irr1_msr] = 1;
+    CHECK(handler.handle(vmcs));
+    CHECK(guest_activity_state::get() == guest_activity_state::active);
+    CHECK(handler.poll_hits() == 1);
+    CHECK(g_save_state.rip == 0x11);
+
+    reset_guest();
+    CHECK(handler.handle(vmcs));
+    CHECK(guest_activity_state::get() == guest_activity_state::hlt);
+    CHECK(handler.poll_window() == hlt_handler::default_poll_start / 2);
+    CHECK(handler.polls() == 2);
+    CHECK(handler.poll_success_rate() == 50);
+
+    reset_guest();
+    guest_rflags::interrupt_enable_flag::disable();
+    g_msrs[x2apic_irr1_msr] = 1;
+    CHECK(handler.handle(vmcs));
+    CHECK(guest_activity_state::get() == guest_activity_state::hlt);
+    CHECK(handler.polls() == 2);
+
+    handler.set_max_poll(0);
+    CHECK(handler.poll_window() == 0);
+    CHECK(handler.exits() == 4);
+}
+
+TEST_CASE("hlt: xapic host")
+{
+    using namespace vmcs_n;
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = hlt_handler(eapis, &g_eapis_vcpu_global_state);
+
+    for (auto i = 0; i < 2; i++) {
+        reset_guest();
+        g_msrs[apic_base_msr] = 0;
+        g_msrs[x2apic_irr1_msr] = 1;
+
+        CHECK(handler.handle(vmcs));
+        CHECK(guest_activity_state::get() == guest_activity_state::hlt);
+    }
+
+    CHECK(handler.polls() == 0);
+    CHECK(handler.poll_hits() == 0);
+    CHECK(handler.blocks() == 2);
+}
+
+#endif
@@ -1,6 +1,5 @@
 //
 // Bareflank Extended APIs
-//
 // Copyright (C) 2018 Assured Information Security, Inc.
 //
 // This library is free software; you can redistribute it and/or
@@ -17,63 +16,112 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
-// TIDY_EXCLUSION=-performance-move-const-arg
-//
-// Reason:
-//     Tidy complains that the std::move(d)'s used in the add_handler calls
-//     have no effect. Removing std::move however results in a compiler error
-//     saying the lvalue (d) can't bind to the rvalue.
-//
-
-#include <intrinsics.h>
+#include <catch/catch.hpp>
+#include <hippomocks.h>
 
-#include <support/arch/intel_x64/test_support.h>
-#include <hve/arch/intel_x64/init_signal.h>
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/init_signal.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
-bool test_handler(gsl::not_null<vmcs_t *> vmcs)
+constexpr const auto apic_base_msr = 0x1BU;
+constexpr const auto x2apic_id_msr = 0x802U;
+constexpr const uint64_t x2apic_mode = 1ULL << 10;
+
+TEST_CASE("constructor/destruction")
 {
-    bfignored(vmcs);
-    return true;
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(init_signal_handler(eapis, &g_eapis_vcpu_global_state));
 }
 
-namespace eapis
-{
-namespace intel_x64
+TEST_CASE("init signal exit")
 {
+    setup_eapis_test_support();
 
-TEST_CASE("init_signal::init_signal")
-{
-    auto hve = setup_hve();
-    CHECK_NOTHROW(eapis::intel_x64::init_signal(hve.get()));
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = init_signal_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_save_state.rip = 0x1000;
+    g_save_state.rdx = 42;
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0xFFF0);
+    CHECK(g_save_state.rdx == 0x600);
+    CHECK(vmcs_n::guest_cs_selector::get() == 0xF000);
+    CHECK(vmcs_n::guest_activity_state::get() == vmcs_n::guest_activity_state::wait_for_sipi);
+    CHECK(vmcs_n::vm_entry_controls::ia_32e_mode_guest::is_disabled());
+    CHECK(g_eapis_vcpu_global_state.init_called.load());
+
+    g_eapis_vcpu_global_state.init_called = false;
 }
 
-TEST_CASE("init_signal::add_handler")
+TEST_CASE("init signal exit, x2apic id")
 {
-    auto hve = setup_hve();
-    auto init_signal = eapis::intel_x64::init_signal(hve.get());
-    auto hdlr = init_signal::handler_delegate_t::create<test_handler>();
+    setup_eapis_test_support();
 
-    CHECK_NOTHROW(init_signal.add_handler(std::move(hdlr)));
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = init_signal_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto &pending = g_eapis_vcpu_global_state.init_pending.at(5);
+    g_msrs[x2apic_id_msr] = 5;
+
+    // In xAPIC mode, the x2APIC ID is not read, and targeted INITs are
+    // never tracked
+    //
+
+    pending = true;
+    g_msrs[apic_base_msr] = 0;
+    CHECK(handler.handle(vmcs));
+    CHECK(pending.load());
+
+    g_msrs[apic_base_msr] = x2apic_mode;
+    CHECK(handler.handle(vmcs));
+    CHECK(!pending.load());
+
+    g_msrs[apic_base_msr] = 0;
+    g_eapis_vcpu_global_state.init_called = false;
 }
 
-TEST_CASE("init_signal::handle")
+TEST_CASE("sipi, target reset")
 {
-    auto hve = setup_hve();
-    auto ehlr = hve->exit_handler();
+    setup_eapis_test_support();
 
-    namespace reason = vmcs_n::exit_reason::basic_exit_reason;
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = init_signal_handler(eapis, &g_eapis_vcpu_global_state);
 
-    auto init_signal = eapis::intel_x64::init_signal(hve.get());
-    auto hdlr = init_signal::handler_delegate_t::create<test_handler>();
-    init_signal.add_handler(std::move(hdlr));
-    g_vmcs_fields[vmcs_n::exit_reason::addr] = reason::init_signal;
+    auto sipi = wrmsr_handler::info_t{0, (5ULL << 32) | (6ULL << 8) | 0x10, false, false};
 
-    CHECK_NOTHROW(ehlr->handle(ehlr));
+    g_eapis_vcpu_global_state.init_pending.at(5) = false;
+    CHECK(!handler.handle_icr_write(vmcs, sipi));
+    CHECK(!sipi.ignore_write);
+    CHECK(handler.sipi_timeouts() == 0);
 }
 
-}
+TEST_CASE("sipi, target never reset")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = init_signal_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto sipi = wrmsr_handler::info_t{0, (5ULL << 32) | (6ULL << 8) | 0x10, false, false};
+
+    g_eapis_vcpu_global_state.init_pending.at(5) = true;
+    CHECK(!handler.handle_icr_write(vmcs, sipi));
+    CHECK(!sipi.ignore_write);
+    CHECK(handler.sipi_timeouts() == 1);
+
+    g_eapis_vcpu_global_state.init_pending.at(5) = false;
 }
 
 #endif
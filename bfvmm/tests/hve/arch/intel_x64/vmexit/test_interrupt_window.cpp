@@ -135,6 +135,154 @@ TEST_CASE("is_open")
     CHECK(handler.is_open() == true);
 }
 
+TEST_CASE("is_open, vmcs cache")
+{
+    using namespace vmcs_n;
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+
+    vmcs_field_cache<> cache;
+    handler.set_vmcs_cache(&cache);
+
+    reset_window();
+    cache.begin_exit();
+
+    CHECK(handler.is_open() == true);
+    CHECK(handler.is_open() == true);
+    CHECK(cache.reads() == 6);
+    CHECK(cache.vmreads() == 3);
+
+    // Cached for the rest of the exit
+    guest_rflags::interrupt_enable_flag::disable();
+    CHECK(handler.is_open() == true);
+
+    cache.end_exit();
+    cache.begin_exit();
+    CHECK(handler.is_open() == false);
+    CHECK(cache.exits() == 2);
+}
+
+TEST_CASE("vmcs cache, write back")
+{
+    using namespace vmcs_n;
+
+    vmcs_field_cache<2> cache;
+
+    guest_rflags::set(0);
+    guest_activity_state::set(0);
+    guest_interruptibility_state::set(0);
+
+    cache.begin_exit();
+    cache.write(guest_rflags::addr, 0x202);
+    cache.write(guest_rflags::addr, 0x2);
+    CHECK(cache.read(guest_rflags::addr) == 0x2);
+    CHECK(guest_rflags::get() == 0);
+
+    cache.end_exit();
+    CHECK(guest_rflags::get() == 0x2);
+    CHECK(cache.writes() == 2);
+    CHECK(cache.vmwrites() == 1);
+    CHECK(cache.vmreads() == 0);
+
+    // Once the cache is full, writes go to the VMCS immediately
+    cache.begin_exit();
+    cache.write(guest_rflags::addr, 0x202);
+    cache.write(guest_activity_state::addr, guest_activity_state::hlt);
+    cache.write(guest_interruptibility_state::addr, 1);
+    CHECK(guest_rflags::get() == 0x202);
+    CHECK(guest_activity_state::get() == guest_activity_state::hlt);
+    CHECK(guest_interruptibility_state::get() == 1);
+
+    // Writes that were not flushed are dropped
+    cache.write(guest_rflags::addr, 0x2);
+    cache.begin_exit();
+    cache.end_exit();
+    CHECK(guest_rflags::get() == 0x202);
+
+    cache.clear_stats();
+    CHECK(cache.exits() == 0);
+}
+
+TEST_CASE("vmcs cache, drop")
+{
+    using namespace vmcs_n;
+
+    vmcs_field_cache<> cache;
+
+    guest_rflags::set(0);
+    guest_activity_state::set(0);
+
+    cache.begin_exit();
+    cache.write(guest_rflags::addr, 0x202);
+    cache.write(guest_activity_state::addr, guest_activity_state::hlt);
+
+    // A direct write is neither overwritten nor hidden by the cache
+    guest_rflags::set(0x2);
+    cache.drop(guest_rflags::addr);
+    cache.drop(guest_interruptibility_state::addr);
+
+    CHECK(cache.read(guest_rflags::addr) == 0x2);
+    CHECK(cache.read(guest_activity_state::addr) == guest_activity_state::hlt);
+
+    cache.end_exit();
+    CHECK(guest_rflags::get() == 0x2);
+    CHECK(guest_activity_state::get() == guest_activity_state::hlt);
+}
+
+TEST_CASE("vmcs cache, release")
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+    vmcs_field_cache<> cache;
+
+    ::intel_x64::vm::write(addr, 0);
+    guest_rflags::set(0);
+
+    cache.begin_exit();
+    cache.write(addr, interrupt_window_exiting::mask);
+    CHECK(cache.read(guest_rflags::addr) == 0);
+
+    // The buffered write is flushed before the direct read-modify-write,
+    // so neither is lost
+    //
+
+    cache.release(addr);
+    cache.release(guest_rflags::addr);
+    cache.release(guest_interruptibility_state::addr);
+    CHECK(interrupt_window_exiting::is_enabled());
+
+    monitor_trap_flag::enable();
+    guest_rflags::set(0x2);
+
+    CHECK(cache.read(addr) == (interrupt_window_exiting::mask | monitor_trap_flag::mask));
+    CHECK(cache.read(guest_rflags::addr) == 0x2);
+
+    cache.end_exit();
+    CHECK(interrupt_window_exiting::is_enabled());
+    CHECK(monitor_trap_flag::is_enabled());
+}
+
+TEST_CASE("vmcs cache, handler throws")
+{
+    using namespace vmcs_n;
+
+    vmcs_field_cache<> cache;
+    guest_rflags::set(0);
+
+    cache.begin_exit();
+    cache.write(guest_rflags::addr, 0x202);
+    cache.abort_exit();
+
+    CHECK(!cache.active());
+    CHECK(guest_rflags::get() == 0);
+
+    cache.write(guest_rflags::addr, 0x2);
+    CHECK(guest_rflags::get() == 0x2);
+}
+
 TEST_CASE("inject")
 {
     MockRepository mocks;
@@ -208,4 +356,113 @@ TEST_CASE("interrupt window exit, returns false")
     CHECK_THROWS(handler.handle(vmcs));
 }
 
+TEST_CASE("interrupt window exit, unhandled policy")
+{
+    setup_eapis_test_support();
+
+    using namespace vmcs_n;
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK(handler.last_error() == exit_error::none);
+
+    handler.set_unhandled_policy(unhandled_policy::forward);
+    CHECK_NOTHROW(handler.handle(vmcs));
+    CHECK(!handler.handle(vmcs));
+    CHECK(handler.last_error() == exit_error::unhandled_exit);
+    CHECK(handler.num_errors() == 2);
+
+    vm_entry_interruption_information::set(0);
+    handler.set_unhandled_policy(unhandled_policy::inject_gp);
+    CHECK(handler.handle(vmcs));
+    CHECK(vm_entry_interruption_information::valid_bit::is_enabled());
+    CHECK(vm_entry_interruption_information::vector::get() == 13);
+    CHECK(vm_entry_exception_error_code::get() == 0);
+
+    guest_activity_state::set(guest_activity_state::active);
+    handler.set_unhandled_policy(unhandled_policy::halt);
+    CHECK(handler.handle(vmcs));
+    CHECK(guest_activity_state::get() == guest_activity_state::shutdown);
+    CHECK(handler.num_errors() == 4);
+
+    handler.set_unhandled_policy(unhandled_policy::raise);
+    CHECK_THROWS(handler.handle(vmcs));
+}
+
+TEST_CASE("queue")
+{
+    setup_eapis_test_support();
+
+    using namespace vmcs_n;
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+
+    reset_window();
+    vm_entry_interruption_information::set(0);
+    guest_rflags::interrupt_enable_flag::disable();
+
+    handler.queue(0x30);
+    handler.queue(0xEF);
+    handler.queue(0x30);
+    CHECK(handler.num_pending() == 2);
+    CHECK(interrupt_window_exiting::is_enabled());
+    CHECK(vm_entry_interruption_information::valid_bit::is_disabled());
+
+    CHECK_THROWS(handler.queue(256));
+
+    guest_rflags::interrupt_enable_flag::enable();
+    CHECK(handler.handle(vmcs));
+    CHECK(vm_entry_interruption_information::vector::get() == 0xEF);
+    CHECK(handler.num_pending() == 1);
+    CHECK(interrupt_window_exiting::is_enabled());
+
+    CHECK(!handler.inject_pending());
+    CHECK(vm_entry_interruption_information::vector::get() == 0xEF);
+
+    vm_entry_interruption_information::set(0);
+    CHECK(handler.handle(vmcs));
+    CHECK(vm_entry_interruption_information::vector::get() == 0x30);
+    CHECK(handler.num_pending() == 0);
+    CHECK(interrupt_window_exiting::is_disabled());
+
+    CHECK(!handler.inject_pending());
+}
+
+TEST_CASE("queue, vmcs cache")
+{
+    setup_eapis_test_support();
+
+    using namespace vmcs_n;
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+
+    vmcs_field_cache<> cache;
+    handler.set_vmcs_cache(&cache);
+
+    reset_window();
+    vm_entry_interruption_information::set(0);
+
+    // The first vector is only buffered by the cache, but the second
+    // queue() has to see it, or it would be overwritten
+    //
+
+    cache.begin_exit();
+    handler.queue(0x30);
+    handler.queue(0xEF);
+    CHECK(handler.num_pending() == 1);
+    cache.end_exit();
+
+    CHECK(vm_entry_interruption_information::vector::get() == 0x30);
+    CHECK(vm_entry_interruption_information::valid_bit::is_enabled());
+}
+
 #endif
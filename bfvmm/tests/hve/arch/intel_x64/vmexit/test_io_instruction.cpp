@@ -0,0 +1,345 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/io_instruction.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+// A one byte access, with the port number encoded in the instruction
+// (bits 31:16), in (bit 3 set) or out
+//
+static uint64_t
+qualification(uint64_t port, bool in)
+{
+    auto qual = (port << 16) | (1ULL << 6);
+    return in ? qual | (1ULL << 3) : qual;
+}
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, io_instruction_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.ignore_write = true;
+    return true;
+}
+
+bool
+test_handler_returns_false(
+    gsl::not_null<vmcs_t *> vmcs, io_instruction_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    return false;
+}
+
+std::vector<int> g_order;
+
+template<int I>
+bool
+test_order_handler(
+    gsl::not_null<vmcs_t *> vmcs, io_instruction_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    g_order.push_back(I);
+    info.ignore_write = true;
+
+    return I == 0;
+}
+
+TEST_CASE("constructor/destruction")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(io_instruction_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("io instruction exit")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = io_instruction_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_handler>(),
+        io_instruction_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    g_save_state.rip = 0;
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 2);
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qualification(0x80, false));
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 2);
+}
+
+TEST_CASE("io instruction exit, unhandled does not advance")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = io_instruction_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_handler_returns_false>(),
+        io_instruction_handler::handler_delegate_t::create<test_handler_returns_false>()
+    );
+
+    g_save_state.rip = 0;
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 2);
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qualification(0x80, false));
+
+    CHECK_THROWS(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0);
+
+    handler.set_unhandled_policy(unhandled_policy::forward);
+    CHECK(!handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0);
+    CHECK(handler.last_error() == exit_error::unhandled_write);
+
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qualification(0x81, true));
+
+    vmcs_n::vm_entry_interruption_information::set(0);
+    handler.set_unhandled_policy(unhandled_policy::inject_gp);
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0);
+    CHECK(handler.last_error() == exit_error::unhandled_read);
+    CHECK(vmcs_n::vm_entry_interruption_information::vector::get() == 13);
+}
+
+TEST_CASE("io instruction exit, port table")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = io_instruction_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto d = io_instruction_handler::handler_delegate_t::create<test_handler>();
+
+    CHECK_NOTHROW(handler.add_handler(0x0, d, d));
+    CHECK_NOTHROW(handler.add_handler(0xFFFF, d, d));
+    CHECK_THROWS(handler.add_handler(0x10000, d, d));
+
+    handler.set_unhandled_policy(unhandled_policy::forward);
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 2);
+
+    // Ports in the same 64 port leaf as a registered port, and ports in a
+    // leaf that was never allocated, have no handlers
+    //
+
+    for (auto port : {0x0ULL, 0xFFFFULL}) {
+        g_save_state.rip = 0;
+        ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qualification(port, false));
+        CHECK(handler.handle(vmcs));
+        CHECK(g_save_state.rip == 2);
+    }
+
+    for (auto port : {0x1ULL, 0xFFFEULL, 0x1000ULL}) {
+        ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qualification(port, false));
+        CHECK(!handler.handle(vmcs));
+    }
+}
+
+TEST_CASE("io instruction exit, handler order")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = io_instruction_handler(eapis, &g_eapis_vcpu_global_state);
+
+    // More handlers than the chain stores inline, so that some of them
+    // spill into the chain's overflow
+    //
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<0>>(),
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<0>>()
+    );
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<1>>(),
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<1>>()
+    );
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<2>>(),
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<2>>()
+    );
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<3>>(),
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<3>>()
+    );
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<4>>(),
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<4>>()
+    );
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<5>>(),
+        io_instruction_handler::handler_delegate_t::create<test_order_handler<5>>()
+    );
+
+    g_order.clear();
+    g_save_state.rip = 0;
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 2);
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qualification(0x80, false));
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_order == std::vector<int>({5, 4, 3, 2, 1, 0}));
+}
+
+// A REP OUTSB (bits 4 and 5), and the address size reported in the
+// instruction information (bits 9:7, with IA32_VMX_BASIC bit 54 set)
+//
+static void
+setup_rep_outs(uint64_t port, uint64_t address_size)
+{
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr, qualification(port, false) | (1ULL << 4) | (1ULL << 5));
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_information::addr, address_size << 7);
+    ::intel_x64::vm::write(vmcs_n::guest_linear_address::addr, 0);
+    ::intel_x64::vm::write(vmcs_n::guest_rflags::addr, 0);
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 2);
+
+    g_save_state.rip = 0;
+}
+
+TEST_CASE("io instruction exit, rep outs, address size")
+{
+    setup_eapis_test_support();
+    g_msrs[0x480] = 1ULL << 54;
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = io_instruction_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_handler>(),
+        io_instruction_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    // 16 bit: only CX and SI are used, and SI wraps
+    setup_rep_outs(0x80, 0);
+    g_save_state.rcx = 0x0000000100000003;
+    g_save_state.rsi = 0x00000000AAAAFFFE;
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rcx == 0x0000000100000000);
+    CHECK(g_save_state.rsi == 0x00000000AAAA0001);
+    CHECK(g_save_state.rip == 2);
+
+    // 32 bit: the upper halves of RCX and RSI are left alone
+    setup_rep_outs(0x80, 1);
+    g_save_state.rcx = 0xFFFFFFFF00000002;
+    g_save_state.rsi = 0x00000001FFFFFFFF;
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rcx == 0xFFFFFFFF00000000);
+    CHECK(g_save_state.rsi == 0x0000000100000001);
+
+    // 64 bit: nothing is transferred, so nothing changes
+    handler.add_handler(
+        0x81,
+        io_instruction_handler::handler_delegate_t::create<test_handler_returns_false>(),
+        io_instruction_handler::handler_delegate_t::create<test_handler_returns_false>()
+    );
+
+    setup_rep_outs(0x81, 2);
+    g_save_state.rcx = 0x0000000100000000;
+    g_save_state.rsi = 0x00000000FFFFFFFF;
+
+    handler.set_unhandled_policy(unhandled_policy::forward);
+    CHECK(!handler.handle(vmcs));
+    CHECK(g_save_state.rcx == 0x0000000100000000);
+    CHECK(g_save_state.rsi == 0x00000000FFFFFFFF);
+    CHECK(g_save_state.rip == 0);
+
+    g_msrs[0x480] = 0;
+}
+
+TEST_CASE("io instruction exit, rep outs, address size from the guest's mode")
+{
+    setup_eapis_test_support();
+    g_msrs[0x480] = 0;
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = io_instruction_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0x80,
+        io_instruction_handler::handler_delegate_t::create<test_handler>(),
+        io_instruction_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    // The instruction information is not used when it is not supported
+    setup_rep_outs(0x80, 2);
+    ::intel_x64::vm::write(vmcs_n::vm_entry_controls::addr, 0);
+    ::intel_x64::vm::write(vmcs_n::guest_cs_access_rights::addr, 0);
+    g_save_state.rcx = 0x0000000100000001;
+    g_save_state.rsi = 0x000000000000FFFF;
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rcx == 0x0000000100000000);
+    CHECK(g_save_state.rsi == 0x0000000000000000);
+
+    ::intel_x64::vm::write(
+        vmcs_n::vm_entry_controls::addr, vmcs_n::vm_entry_controls::ia_32e_mode_guest::mask);
+    ::intel_x64::vm::write(
+        vmcs_n::guest_cs_access_rights::addr, vmcs_n::guest_cs_access_rights::l::mask);
+
+    setup_rep_outs(0x80, 0);
+    g_save_state.rcx = 0x0000000000000001;
+    g_save_state.rsi = 0x000000000000FFFF;
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rcx == 0x0000000000000000);
+    CHECK(g_save_state.rsi == 0x0000000000010000);
+}
+
+#endif
@@ -0,0 +1,189 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/ipi.h>
+#include <hve/arch/intel_x64/posted_interrupts.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+constexpr const auto icr = ::intel_x64::msrs::ia32_x2apic_icr::addr;
+
+static void
+setup_icr_write(uint64_t val)
+{
+    g_save_state.rip = 0;
+    g_save_state.rcx = icr;
+    g_save_state.rax = val & 0xFFFFFFFF;
+    g_save_state.rdx = val >> 32;
+
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 4);
+    g_msrs[icr] = 0;
+}
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, ipi_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    CHECK(info.vector == 0x40);
+    CHECK(info.destination == 5);
+    CHECK(info.shorthand == 0);
+    CHECK(!info.logical);
+
+    return false;
+}
+
+bool
+test_handler_ignore_write(
+    gsl::not_null<vmcs_t *> vmcs, ipi_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.ignore_write = true;
+    return true;
+}
+
+TEST_CASE("ipi: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(ipi_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("ipi: not the icr")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ipi_handler(eapis, &g_eapis_vcpu_global_state);
+
+    setup_icr_write(0x0000000500000040);
+    g_save_state.rcx = 0x808;
+
+    CHECK(!handler.handle(vmcs));
+    CHECK(g_save_state.rip == 0);
+}
+
+TEST_CASE("ipi: init falls back")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ipi_handler(eapis, &g_eapis_vcpu_global_state);
+
+    setup_icr_write(0x0000000500004500);
+
+    CHECK(!handler.handle(vmcs));
+    CHECK(g_msrs[icr] == 0);
+    CHECK(g_save_state.rip == 0);
+}
+
+TEST_CASE("ipi: fixed")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ipi_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        ipi_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    setup_icr_write(0x0000000500000040);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_msrs[icr] == 0x0000000500000040);
+    CHECK(g_save_state.rip == 4);
+    CHECK(handler.sent() == 1);
+}
+
+TEST_CASE("ipi: fixed, ignore write")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ipi_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        ipi_handler::handler_delegate_t::create<test_handler_ignore_write>()
+    );
+
+    setup_icr_write(0x0000000500000040);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_msrs[icr] == 0);
+    CHECK(g_save_state.rip == 4);
+    CHECK(handler.sent() == 0);
+}
+
+TEST_CASE("ipi: fixed, posted to target")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ipi_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto vapic = virtual_apic_handler(eapis, &g_eapis_vcpu_global_state);
+    auto target = posted_interrupt_handler(eapis, &g_eapis_vcpu_global_state, &vapic);
+
+    g_msrs[0x802] = 5;
+    target.enable(0xF2);
+    handler.add_target(5, &target);
+
+    setup_icr_write(0x0000000500000040);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(target.descriptor()->pir.at(1) == 1);
+    CHECK(g_msrs[icr] == 0x00000005000000F2);
+    CHECK(g_save_state.rip == 4);
+    CHECK(handler.posted() == 1);
+    CHECK(handler.sent() == 0);
+
+    setup_icr_write(0x0000000600000040);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_msrs[icr] == 0x0000000600000040);
+    CHECK(handler.sent() == 1);
+
+    handler.remove_target(5);
+    setup_icr_write(0x0000000500000040);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.posted() == 1);
+    CHECK(handler.sent() == 2);
+}
+
+#endif
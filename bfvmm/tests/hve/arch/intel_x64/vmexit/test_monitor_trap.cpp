@@ -0,0 +1,186 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/monitor_trap.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+static uint64_t g_handler_calls = 0;
+static uint64_t g_trace_done_calls = 0;
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, monitor_trap_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    g_handler_calls++;
+    return true;
+}
+
+void
+test_trace_done(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+    g_trace_done_calls++;
+}
+
+TEST_CASE("monitor trap: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(monitor_trap_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("monitor trap: handle")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = monitor_trap_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_handler_calls = 0;
+    handler.add_handler(
+        monitor_trap_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.enable();
+    CHECK(monitor_trap_flag::is_enabled());
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_handler_calls == 1);
+    CHECK(monitor_trap_flag::is_disabled());
+}
+
+TEST_CASE("monitor trap: trace steps")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = monitor_trap_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_handler_calls = 0;
+    g_trace_done_calls = 0;
+
+    handler.add_handler(
+        monitor_trap_handler::handler_delegate_t::create<test_handler>()
+    );
+    handler.set_trace_done(
+        monitor_trap_handler::trace_done_delegate_t::create<test_trace_done>()
+    );
+
+    CHECK_THROWS(handler.trace(0));
+
+    handler.trace(3);
+    CHECK(handler.is_tracing());
+    CHECK(monitor_trap_flag::is_enabled());
+
+    for (auto rip = 0x1000ULL; rip < 0x1003ULL; rip++) {
+        g_save_state.rip = rip;
+        g_save_state.rax = 42;
+        CHECK(handler.handle(vmcs));
+    }
+
+    CHECK(!handler.is_tracing());
+    CHECK(monitor_trap_flag::is_disabled());
+    CHECK(g_handler_calls == 0);
+    CHECK(g_trace_done_calls == 1);
+    CHECK(handler.trace_pending() == 3);
+
+    std::array<monitor_trap_handler::trace_entry_t, 2> buf{};
+    CHECK(handler.drain(buf) == 2);
+    CHECK(buf.at(0).rip == 0x1000);
+    CHECK(buf.at(1).rip == 0x1001);
+    CHECK(buf.at(0).rax == 0);
+
+    CHECK(handler.drain(buf) == 1);
+    CHECK(buf.at(0).rip == 0x1002);
+    CHECK(handler.trace_pending() == 0);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_handler_calls == 1);
+}
+
+TEST_CASE("monitor trap: trace range")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = monitor_trap_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_THROWS(handler.trace_range(0x2000, 0x1000, 10));
+
+    handler.trace_range(0x1000, 0x2000, 100, true);
+
+    g_save_state.rip = 0x1000;
+    g_save_state.rax = 42;
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.is_tracing());
+
+    g_save_state.rip = 0x2000;
+    CHECK(handler.handle(vmcs));
+    CHECK(!handler.is_tracing());
+    CHECK(monitor_trap_flag::is_disabled());
+
+    std::array<monitor_trap_handler::trace_entry_t, 4> buf{};
+    CHECK(handler.drain(buf) == 2);
+    CHECK(buf.at(0).rax == 42);
+    CHECK(buf.at(1).rip == 0x2000);
+}
+
+TEST_CASE("monitor trap: stop trace / dropped")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = monitor_trap_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.trace(monitor_trap_handler::trace_size * 2);
+    for (auto i = 0U; i < monitor_trap_handler::trace_size + 4; i++) {
+        CHECK(handler.handle(vmcs));
+    }
+
+    CHECK(handler.is_tracing());
+    CHECK(handler.trace_pending() == monitor_trap_handler::trace_size);
+    CHECK(handler.trace_dropped() == 4);
+
+    handler.stop_trace();
+    CHECK(!handler.is_tracing());
+    CHECK(monitor_trap_flag::is_disabled());
+}
+
+#endif
@@ -0,0 +1,150 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/mov_dr.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+static std::array<uint64_t, 8> g_drs{};
+
+static void
+setup_drs(MockRepository &mocks)
+{
+    g_drs = {};
+
+    mocks.OnCallFunc(mov_dr_handler::read_dr).Do([](uint64_t n) {
+        return g_drs.at(n);
+    });
+
+    mocks.OnCallFunc(mov_dr_handler::write_dr).Do([](uint64_t n, uint64_t val) {
+        g_drs.at(n) = val;
+    });
+}
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, mov_dr_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    return true;
+}
+
+TEST_CASE("mov dr: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(mov_dr_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("mov dr: enable / disable exiting")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = mov_dr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.enable_exiting();
+    CHECK(mov_dr_exiting::is_enabled());
+
+    handler.disable_exiting();
+    CHECK(mov_dr_exiting::is_disabled());
+}
+
+TEST_CASE("mov dr: handler")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = mov_dr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_THROWS(handler.handle(vmcs));
+
+    handler.add_handler(
+        mov_dr_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    g_save_state.rax = 0x400;
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, 0x7);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(vmcs_n::guest_dr7::get() == 0x400);
+}
+
+TEST_CASE("mov dr: lazy exiting")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = mov_dr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    setup_drs(mocks);
+    g_drs.at(0) = 0x1000;
+    g_drs.at(6) = 0xFFFF0FF0;
+
+    handler.enable_lazy_exiting();
+    CHECK(mov_dr_exiting::is_enabled());
+    CHECK(!handler.guest_owns_drs());
+    CHECK(handler.guest_dr(0) == 0x1000);
+
+    g_drs.at(0) = 0x2000;
+    handler.set_guest_dr(1, 0x3000);
+    CHECK(g_drs.at(1) == 0);
+
+    g_save_state.rip = 0x10;
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 3);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.guest_owns_drs());
+    CHECK(mov_dr_exiting::is_disabled());
+    CHECK(handler.lazy_loads() == 1);
+    CHECK(g_save_state.rip == 0x10);
+    CHECK(g_drs.at(0) == 0x1000);
+    CHECK(g_drs.at(1) == 0x3000);
+    CHECK(g_drs.at(6) == 0xFFFF0FF0);
+
+    g_drs.at(2) = 0x4000;
+    handler.save_guest_drs();
+    CHECK(!handler.guest_owns_drs());
+    CHECK(mov_dr_exiting::is_enabled());
+    CHECK(handler.guest_dr(2) == 0x4000);
+    CHECK_THROWS(handler.guest_dr(4));
+
+    handler.disable_lazy_exiting();
+    CHECK(handler.guest_owns_drs());
+    CHECK(mov_dr_exiting::is_disabled());
+    CHECK_THROWS(handler.handle(vmcs));
+}
+
+#endif
@@ -0,0 +1,160 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/nested_vmx.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+uint64_t g_exit_reason{};
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, nested_vmx_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    g_exit_reason = info.exit_reason;
+    return true;
+}
+
+static bool
+is_trapped(gsl::span<uint8_t> bitmap, uint64_t field)
+{ return (bitmap[gsl::narrow_cast<std::ptrdiff_t>(field >> 3)] & (1U << (field & 7U))) != 0; }
+
+TEST_CASE("constructor/destruction")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(nested_vmx_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("is supported")
+{
+    g_msrs[0x48B] = 0;
+    CHECK(!nested_vmx_handler::is_supported());
+
+    setup_eapis_test_support();
+    CHECK(nested_vmx_handler::is_supported());
+}
+
+TEST_CASE("enable/disable")
+{
+    setup_eapis_test_support();
+    g_msrs[0x480] = 0x42;
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = nested_vmx_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto shadow = static_cast<uint32_t *>(g_mm->physint_to_virtptr(handler.shadow_vmcs()));
+    CHECK(shadow[0] == (0x42U | 0x80000000U));
+
+    CHECK(is_trapped(handler.vmread_bitmap(), 0x681E));
+    CHECK(is_trapped(handler.vmwrite_bitmap(), 0x681E));
+
+    handler.enable();
+    CHECK(handler.is_enabled());
+    CHECK(vmcs_n::vmcs_link_pointer::get() == handler.shadow_vmcs());
+    CHECK((::intel_x64::vm::read(vmcs_n::secondary_processor_based_vm_execution_controls::addr) & (1ULL << 14)) != 0);
+    CHECK(::intel_x64::vm::read(0x2026U) != 0);
+    CHECK(::intel_x64::vm::read(0x2028U) != 0);
+
+    CHECK(!is_trapped(handler.vmread_bitmap(), 0x681E));
+    CHECK(!is_trapped(handler.vmwrite_bitmap(), 0x681E));
+    CHECK(!is_trapped(handler.vmread_bitmap(), 0x4402));
+    CHECK(is_trapped(handler.vmwrite_bitmap(), 0x4402));
+    CHECK(is_trapped(handler.vmread_bitmap(), 0x4002));
+
+    handler.disable();
+    CHECK(!handler.is_enabled());
+    CHECK(vmcs_n::vmcs_link_pointer::get() == 0xFFFFFFFFFFFFFFFF);
+    CHECK((::intel_x64::vm::read(vmcs_n::secondary_processor_based_vm_execution_controls::addr) & (1ULL << 14)) == 0);
+}
+
+TEST_CASE("shadow/trap field")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = nested_vmx_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.shadow_field(0x4002);
+    CHECK(!is_trapped(handler.vmread_bitmap(), 0x4002));
+    CHECK(!is_trapped(handler.vmwrite_bitmap(), 0x4002));
+    CHECK(is_trapped(handler.vmread_bitmap(), 0x4003));
+
+    handler.trap_field(0x4002);
+    CHECK(is_trapped(handler.vmread_bitmap(), 0x4002));
+    CHECK(is_trapped(handler.vmwrite_bitmap(), 0x4002));
+
+    CHECK_THROWS(handler.shadow_field(0x8000));
+    CHECK_THROWS(handler.trap_field(0x8000));
+}
+
+TEST_CASE("handle")
+{
+    setup_eapis_test_support();
+    namespace reason = vmcs_n::exit_reason::basic_exit_reason;
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto vmcs = setup_vmcs(mocks);
+    auto handler = nested_vmx_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_vmcs_fields[vmcs_n::exit_reason::addr] = reason::vmlaunch;
+    CHECK(!handler.handle(vmcs));
+
+    handler.enable();
+    CHECK_THROWS(handler.handle(vmcs));
+
+    handler.add_handler(
+        nested_vmx_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_exit_reason == reason::vmlaunch);
+
+    g_vmcs_fields[vmcs_n::exit_reason::addr] = reason::vmread;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_exit_reason == reason::vmread);
+
+    handler.dump_log();
+}
+
+TEST_CASE("cpuid")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto vmcs = setup_vmcs(mocks);
+    auto handler = nested_vmx_handler(eapis, &g_eapis_vcpu_global_state);
+
+    cpuid_handler::info_t info{};
+    CHECK(!handler.handle_cpuid(vmcs, info));
+
+    handler.enable();
+    CHECK(handler.handle_cpuid(vmcs, info));
+    CHECK((info.rcx & (1ULL << ::intel_x64::cpuid::feature_information::ecx::vmx::from)) != 0);
+}
+
+#endif
@@ -0,0 +1,115 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/pause.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+constexpr const uint64_t ple_window_addr = 0x4022U;
+
+static pause_handler::info_t g_info{};
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, pause_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    g_info = info;
+    return true;
+}
+
+TEST_CASE("pause: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(pause_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("pause: exiting")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = pause_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        pause_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.enable_exiting();
+
+    g_save_state.rip = 0x10;
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 2);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(!g_info.lock_holder_preempted);
+    CHECK(g_save_state.rip == 0x12);
+    CHECK(handler.exits() == 1);
+    CHECK(handler.loop_exits() == 0);
+}
+
+TEST_CASE("pause: loop exiting")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = pause_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        pause_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK_THROWS(handler.enable_loop_exiting(128, 0));
+    handler.enable_loop_exiting(128, 0x1000, 0x4000);
+    CHECK(::intel_x64::vm::read(ple_window_addr) == 0x1000);
+
+    ::intel_x64::vm::write(vmcs_n::vm_exit_instruction_length::addr, 2);
+
+    for (auto i = 1U; i <= 3; i++) {
+        g_save_state.rip = 0x10;
+
+        CHECK(handler.handle(vmcs));
+        CHECK(g_info.lock_holder_preempted);
+        CHECK(g_info.spins == i);
+    }
+
+    CHECK(handler.window() == 0x4000);
+    CHECK(::intel_x64::vm::read(ple_window_addr) == 0x4000);
+
+    g_save_state.rip = 0x20;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_info.spins == 1);
+    CHECK(handler.loop_exits() == 4);
+
+    handler.shrink_window();
+    CHECK(::intel_x64::vm::read(ple_window_addr) == 0x1000);
+}
+
+#endif
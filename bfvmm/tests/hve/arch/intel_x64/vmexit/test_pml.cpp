@@ -0,0 +1,145 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/pml.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+uint64_t g_num_gpas{};
+uint64_t g_first_gpa{};
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, pml_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    g_num_gpas = static_cast<uint64_t>(info.gpas.size());
+    g_first_gpa = info.gpas.empty() ? 0 : info.gpas.at(0);
+
+    return true;
+}
+
+uint64_t *
+pml_log()
+{
+    return static_cast<uint64_t *>(
+        g_mm->physint_to_virtptr(vmcs_n::pml_address::get())
+    );
+}
+
+TEST_CASE("constructor/destruction")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(pml_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("add handlers")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = pml_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK_NOTHROW(
+        handler.add_handler(
+            pml_handler::handler_delegate_t::create<test_handler>()
+        )
+    );
+
+    handler.dump_log();
+}
+
+TEST_CASE("enable/disable")
+{
+    setup_eapis_test_support();
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = pml_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.enable();
+    CHECK(enable_pml::is_enabled());
+    CHECK(vmcs_n::pml_address::get() != 0);
+    CHECK(vmcs_n::guest_pml_index::get() == 511);
+
+    handler.disable();
+    CHECK(enable_pml::is_disabled());
+}
+
+TEST_CASE("drain")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto vmcs = setup_vmcs(mocks);
+    auto handler = pml_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        pml_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK(handler.drain(vmcs) == 0);
+    handler.enable();
+
+    g_num_gpas = 0;
+    CHECK(handler.drain(vmcs) == 0);
+    CHECK(g_num_gpas == 0);
+
+    pml_log()[509] = 0x3000;
+    pml_log()[510] = 0x2000;
+    pml_log()[511] = 0x1000;
+    vmcs_n::guest_pml_index::set(508);
+
+    CHECK(handler.drain(vmcs) == 3);
+    CHECK(g_num_gpas == 3);
+    CHECK(g_first_gpa == 0x3000);
+    CHECK(vmcs_n::guest_pml_index::get() == 511);
+}
+
+TEST_CASE("log full")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto vmcs = setup_vmcs(mocks);
+    auto handler = pml_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        pml_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.enable();
+    pml_log()[0] = 0x42000;
+    vmcs_n::guest_pml_index::set(0xFFFF);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_num_gpas == 512);
+    CHECK(g_first_gpa == 0x42000);
+    CHECK(vmcs_n::guest_pml_index::get() == 511);
+}
+
+#endif
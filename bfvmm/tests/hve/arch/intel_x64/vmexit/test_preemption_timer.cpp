@@ -0,0 +1,145 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/preemption_timer.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+constexpr const auto vmx_misc_msr = 0x485U;
+constexpr const uint64_t vmx_preemption_timer_value_addr = 0x482EU;
+constexpr const uint64_t activate_vmx_preemption_timer = 1ULL << 6;
+
+static uint64_t g_handler_calls = 0;
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, preemption_timer_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    g_handler_calls++;
+    return true;
+}
+
+static bool
+timer_active()
+{
+    const auto ctls = ::intel_x64::vm::read(vmcs_n::pin_based_vm_execution_controls::addr);
+    return (ctls & activate_vmx_preemption_timer) != 0;
+}
+
+TEST_CASE("preemption timer: constructor")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    g_msrs[vmx_misc_msr] = 5;
+    auto handler = preemption_timer_handler(eapis, &g_eapis_vcpu_global_state);
+
+    CHECK(handler.rate() == 5);
+    CHECK(!handler.is_armed());
+    CHECK(preemption_timer_handler::is_supported());
+}
+
+TEST_CASE("preemption timer: arm / disarm")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    g_msrs[vmx_misc_msr] = 5;
+    auto handler = preemption_timer_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.arm(1000);
+    CHECK(handler.is_armed());
+    CHECK(timer_active());
+    CHECK(::intel_x64::vm::read(vmx_preemption_timer_value_addr) == 32);
+
+    handler.disarm();
+    CHECK(!handler.is_armed());
+    CHECK(!timer_active());
+
+    CHECK_THROWS(handler.arm_periodic(0));
+}
+
+TEST_CASE("preemption timer: one-shot")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = preemption_timer_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_handler_calls = 0;
+    handler.add_handler(
+        preemption_timer_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK_THROWS(handler.handle(vmcs));
+
+    handler.arm(1ULL << 40);
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.is_armed());
+    CHECK(g_handler_calls == 0);
+
+    handler.arm(0);
+    CHECK(handler.handle(vmcs));
+    CHECK(!handler.is_armed());
+    CHECK(!timer_active());
+    CHECK(handler.expirations() == 1);
+    CHECK(g_handler_calls == 1);
+}
+
+TEST_CASE("preemption timer: periodic")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = preemption_timer_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_handler_calls = 0;
+    handler.add_handler(
+        preemption_timer_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.arm_periodic(1);
+    const auto deadline = handler.deadline();
+
+    CHECK(handler.handle(vmcs));
+    CHECK(handler.is_armed());
+    CHECK(timer_active());
+    CHECK(handler.deadline() > deadline);
+    CHECK(handler.expirations() == 1);
+    CHECK(g_handler_calls == 1);
+
+    handler.disarm();
+    CHECK(!timer_active());
+}
+
+#endif
@@ -0,0 +1,191 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/rdmsr.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+static uint64_t g_handler_val{0};
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    g_handler_val = info.val;
+    info.val = 42;
+
+    return true;
+}
+
+bool
+test_handler_returns_false(
+    gsl::not_null<vmcs_t *> vmcs, rdmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    g_handler_val = info.val;
+    return false;
+}
+
+TEST_CASE("constructor/destruction")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(rdmsr_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("rdmsr exit")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = rdmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x42] = 0x100000001;
+    g_save_state.rcx = 0x42;
+
+    CHECK(!handler.handle(vmcs));
+
+    handler.add_handler(0x42, rdmsr_handler::handler_delegate_t::create<test_handler>());
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_handler_val == 0x100000001);
+    CHECK(g_save_state.rax == 42);
+    CHECK(g_save_state.rdx == 0);
+}
+
+TEST_CASE("rdmsr exit, constant")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = rdmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x42] = 0x100000001;
+    g_save_state.rcx = 0x42;
+
+    handler.add_constant(0x42, 0x200000002);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rax == 2);
+    CHECK(g_save_state.rdx == 2);
+}
+
+TEST_CASE("rdmsr exit, constant with delegates")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = rdmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x42] = 0x100000001;
+    g_save_state.rcx = 0x42;
+
+    handler.add_constant(0x42, 0x200000002);
+    handler.add_handler(0x42, rdmsr_handler::handler_delegate_t::create<test_handler_returns_false>());
+
+    g_handler_val = 0;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_handler_val == 0x200000002);
+    CHECK(g_save_state.rax == 2);
+    CHECK(g_save_state.rdx == 2);
+
+    handler.add_handler(0x42, rdmsr_handler::handler_delegate_t::create<test_handler>());
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_save_state.rax == 42);
+    CHECK(g_save_state.rdx == 0);
+}
+
+TEST_CASE("rdmsr exit, dispatch table")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = rdmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    // The ends of both bitmap ranges, and MSRs that fall back to the
+    // hash map
+    //
+
+    std::array<uint64_t, 6> msrs = {
+        0x0, 0x1FFF, 0xC0000000, 0xC0001FFF, 0x2000, 0x40000000
+    };
+
+    for (auto msr : msrs) {
+        handler.add_handler(msr, rdmsr_handler::handler_delegate_t::create<test_handler>());
+    }
+
+    for (auto msr : msrs) {
+        g_msrs[msr] = 0;
+        g_save_state.rcx = msr;
+        g_save_state.rax = 0;
+
+        CHECK(handler.handle(vmcs));
+        CHECK(g_save_state.rax == 42);
+    }
+
+    for (auto msr : {0x1ULL, 0x1FFEULL, 0xC0000001ULL, 0xC0002000ULL, 0x40000001ULL}) {
+        g_msrs[msr] = 0;
+        g_save_state.rcx = msr;
+
+        CHECK(!handler.handle(vmcs));
+    }
+}
+
+TEST_CASE("msr map")
+{
+    eapis::intel_x64::msr_map<uint64_t> map;
+
+    CHECK(map.find(0x10) == nullptr);
+    CHECK(map.find(0x40000000) == nullptr);
+    CHECK(map.heap_bytes() == 0);
+
+    CHECK(map.at(0x10) == 0);
+    map.at(0x10) = 1;
+    map.at(0xC0000080) = 2;
+    map.at(0x40000000) = 3;
+
+    REQUIRE(map.find(0x10) != nullptr);
+    CHECK(*map.find(0x10) == 1);
+    REQUIRE(map.find(0xC0000080) != nullptr);
+    CHECK(*map.find(0xC0000080) == 2);
+    REQUIRE(map.find(0x40000000) != nullptr);
+    CHECK(*map.find(0x40000000) == 3);
+
+    CHECK(map.find(0x80) == nullptr);
+    CHECK(map.find(0xC0000010) == nullptr);
+    CHECK(map.heap_bytes() != 0);
+}
+
+#endif
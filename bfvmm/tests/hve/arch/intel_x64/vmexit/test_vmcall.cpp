@@ -0,0 +1,168 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/vmcall.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, vmcall_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.rax = 0;
+    info.rbx = 42;
+    info.rcx = 42;
+    info.rdx = 42;
+
+    return true;
+}
+
+bool
+test_handler_returns_false(
+    gsl::not_null<vmcs_t *> vmcs, vmcall_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    return false;
+}
+
+bool
+test_handler_ignore_write(
+    gsl::not_null<vmcs_t *> vmcs, vmcall_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.rax = 0;
+    info.ignore_write = true;
+
+    return true;
+}
+
+TEST_CASE("vmcall: constructor / destruction")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(vmcall_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("vmcall: unknown opcode")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = vmcall_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0xBF01, vmcall_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    g_save_state.rax = 0xBF02;
+
+    CHECK(handler.handle(vmcs) == false);
+    CHECK(handler.calls() == 0);
+}
+
+TEST_CASE("vmcall exit")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = vmcall_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0xBF01, vmcall_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    g_save_state.rax = 0xBF01;
+    g_save_state.rbx = 0;
+    g_save_state.rcx = 0;
+    g_save_state.rdx = 0;
+
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rax == 0);
+    CHECK(g_save_state.rbx == 42);
+    CHECK(g_save_state.rcx == 42);
+    CHECK(g_save_state.rdx == 42);
+    CHECK(handler.calls() == 1);
+}
+
+TEST_CASE("vmcall exit, handler chain")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = vmcall_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0xBF01, vmcall_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    handler.add_handler(
+        0xBF01, vmcall_handler::handler_delegate_t::create<test_handler_returns_false>()
+    );
+
+    g_save_state.rax = 0xBF01;
+    g_save_state.rbx = 0;
+
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rbx == 42);
+}
+
+TEST_CASE("vmcall exit, returns false")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = vmcall_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0xBF01, vmcall_handler::handler_delegate_t::create<test_handler_returns_false>()
+    );
+
+    g_save_state.rax = 0xBF01;
+
+    CHECK(handler.handle(vmcs) == false);
+    CHECK(handler.calls() == 0);
+}
+
+TEST_CASE("vmcall exit, ignore write")
+{
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = vmcall_handler(eapis, &g_eapis_vcpu_global_state);
+
+    handler.add_handler(
+        0xBF01, vmcall_handler::handler_delegate_t::create<test_handler_ignore_write>()
+    );
+
+    g_save_state.rax = 0xBF01;
+
+    CHECK(handler.handle(vmcs) == true);
+    CHECK(g_save_state.rax == 0xBF01);
+}
+
+#endif
@@ -0,0 +1,197 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/wrmsr.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+static uint64_t g_handler_calls{0};
+
+bool
+test_handler(
+    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    g_handler_calls++;
+    return true;
+}
+
+bool
+test_handler_ignore_write(
+    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    g_handler_calls++;
+    return (info.ignore_write = true);
+}
+
+bool
+test_handler_returns_false(
+    gsl::not_null<vmcs_t *> vmcs, wrmsr_handler::info_t &info)
+{
+    bfignored(vmcs);
+    bfignored(info);
+
+    g_handler_calls++;
+    return false;
+}
+
+TEST_CASE("constructor/destruction")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(wrmsr_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("wrmsr exit")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = wrmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x42] = 0;
+    g_save_state.rcx = 0x42;
+    g_save_state.rax = 0xFF;
+    g_save_state.rdx = 0;
+
+    CHECK(!handler.handle(vmcs));
+
+    handler.add_handler(0x42, wrmsr_handler::handler_delegate_t::create<test_handler>());
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_msrs[0x42] == 0xFF);
+}
+
+TEST_CASE("wrmsr exit, mask")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = wrmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x42] = 0xF0;
+    g_save_state.rcx = 0x42;
+    g_save_state.rax = 0x0F;
+    g_save_state.rdx = 0;
+
+    handler.add_write_mask(0x42, 0x03);
+
+    CHECK(handler.handle(vmcs));
+    CHECK(g_msrs[0x42] == 0xF3);
+
+    handler.add_write_mask(0x42);
+
+    g_save_state.rax = 0;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_msrs[0x42] == 0xF3);
+}
+
+TEST_CASE("wrmsr exit, mask with delegates")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = wrmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    g_msrs[0x42] = 0xF0;
+    g_save_state.rcx = 0x42;
+    g_save_state.rax = 0x0F;
+    g_save_state.rdx = 0;
+
+    handler.add_write_mask(0x42, 0x03);
+    handler.add_handler(0x42, wrmsr_handler::handler_delegate_t::create<test_handler_returns_false>());
+
+    g_handler_calls = 0;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_handler_calls == 1);
+    CHECK(g_msrs[0x42] == 0xF3);
+
+    handler.add_handler(0x42, wrmsr_handler::handler_delegate_t::create<test_handler>());
+
+    g_msrs[0x42] = 0xF0;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_handler_calls == 2);
+    CHECK(g_msrs[0x42] == 0xF3);
+
+    handler.add_handler(0x42, wrmsr_handler::handler_delegate_t::create<test_handler_ignore_write>());
+
+    g_msrs[0x42] = 0xF0;
+    CHECK(handler.handle(vmcs));
+    CHECK(g_handler_calls == 3);
+    CHECK(g_msrs[0x42] == 0xF0);
+}
+
+TEST_CASE("wrmsr exit, dispatch table")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = wrmsr_handler(eapis, &g_eapis_vcpu_global_state);
+
+    // The ends of both bitmap ranges, and MSRs that fall back to the
+    // hash map
+    //
+
+    std::array<uint64_t, 6> msrs = {
+        0x0, 0x1FFF, 0xC0000000, 0xC0001FFF, 0x2000, 0x40000000
+    };
+
+    for (auto msr : msrs) {
+        handler.add_handler(msr, wrmsr_handler::handler_delegate_t::create<test_handler_ignore_write>());
+    }
+
+    g_handler_calls = 0;
+    g_save_state.rax = 0xFF;
+    g_save_state.rdx = 0;
+
+    for (auto msr : msrs) {
+        g_msrs[msr] = 0;
+        g_save_state.rcx = msr;
+
+        CHECK(handler.handle(vmcs));
+        CHECK(g_msrs[msr] == 0);
+    }
+
+    CHECK(g_handler_calls == msrs.size());
+
+    for (auto msr : {0x1ULL, 0x1FFEULL, 0xC0000001ULL, 0xC0002000ULL, 0x40000001ULL}) {
+        g_save_state.rcx = msr;
+        CHECK(!handler.handle(vmcs));
+    }
+
+    CHECK(g_handler_calls == msrs.size());
+}
+
+#endif
@@ -0,0 +1,70 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vmexit/xsetbv.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+TEST_CASE("constructor/destruction")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    CHECK_NOTHROW(xsetbv_handler(eapis, &g_eapis_vcpu_global_state));
+}
+
+TEST_CASE("xsave area size")
+{
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = xsetbv_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto standard = ::x64::cpuid::get(0xD, 0, 0, 0);
+    auto compact = ::x64::cpuid::get(0xD, 0, 1, 0);
+
+    auto usage = memory_usage_t{};
+    handler.memory_usage(usage);
+    auto before = usage.handlers;
+
+    auto size = handler.xsave_area_size();
+    CHECK(handler.xsave_area_size() == size);
+
+    if ((compact.rax & (1ULL << 3)) != 0) {
+
+        // The guest may enable more components than are enabled now, so
+        // the area must be at least as big as what XSAVES currently needs
+        // and as the legacy region and header
+        //
+
+        CHECK(size >= (compact.rbx & 0xFFFFFFFFULL));
+        CHECK(size >= 576U);
+    }
+    else {
+        CHECK(size == (standard.rcx & 0xFFFFFFFFULL));
+    }
+
+    usage = memory_usage_t{};
+    handler.memory_usage(usage);
+    CHECK(usage.handlers >= before + size);
+}
+
+#endif